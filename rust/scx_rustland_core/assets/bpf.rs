@@ -6,6 +6,16 @@
 use crate::bpf_intf;
 use crate::bpf_skel::*;
 
+use std::cell::RefCell;
+use std::collections::HashMap;
+use std::sync::atomic::AtomicU32;
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::sync::Mutex;
+use std::time::Duration;
+
+use anyhow::bail;
 use anyhow::Context;
 use anyhow::Result;
 
@@ -15,15 +25,18 @@ use libbpf_rs::skel::OpenSkel;
 use libbpf_rs::skel::Skel;
 use libbpf_rs::skel::SkelBuilder;
 
-use libc::{sched_param, sched_setscheduler};
+use libc::{sched_param, sched_setaffinity, sched_setscheduler};
 
 use scx_utils::compat;
 use scx_utils::init_libbpf_logging;
+use scx_utils::lathist::LatHist;
+use scx_utils::lathist::LATHIST_DECISION;
 use scx_utils::scx_ops_attach;
 use scx_utils::scx_ops_load;
 use scx_utils::scx_ops_open;
 use scx_utils::uei_exited;
 use scx_utils::uei_report;
+use scx_utils::Topology;
 use scx_utils::UserExitInfo;
 
 use scx_rustland_core::ALLOCATOR;
@@ -51,27 +64,52 @@ pub const RL_PREEMPT_CPU: u64 = bpf_intf::RL_PREEMPT_CPU as u64;
 ///
 /// The scheduler then can use BpfScheduler() instance to receive tasks (in the form of QueuedTask
 /// objects) and dispatch tasks (in the form of DispatchedTask objects), using respectively the
-/// methods dequeue_task() and dispatch_task().
+/// methods dequeue_task() and dispatch_task(), or their batched variants dequeue_tasks() and
+/// dispatch_tasks().
 ///
 /// The CPU ownership map can be accessed using the method get_cpu_pid(), this also allows to keep
 /// track of the idle and busy CPUs, with the corresponding PIDs associated to them.
 ///
+/// The BPF component also maintains a bitmap of the idle CPUs and of the fully idle cores: after
+/// refresh_idle_cpus(), nr_idle_cores() and idle_cores() report the idle cores and
+/// pick_idle_cpu() returns an idle CPU in the cpumask of a task, close to its previous CPU
+/// (sharing its core or its LLC, if possible), without looking up the owner of each CPU.
+///
 /// BPF counters and statistics can be accessed using the methods nr_*_mut(), in particular
 /// nr_queued_mut() and nr_scheduled_mut() can be updated to notify the BPF component if the
 /// user-space scheduler has some pending work to do or not.
 ///
+/// Wakeups of the user-space scheduler
+/// ===================================
+///
+/// The BPF component wakes up the user-space scheduler when there is work to do. Under load these
+/// wakeups can be coalesced until wakeup_batch tasks are pending or the oldest one has waited for
+/// wakeup_delay_us. If busy_poll_cpu is set, when almost all the CPUs are busy the scheduler is
+/// kept running on that CPU instead: busy_polling() reports when this is the case, so that the
+/// scheduler can spin instead of yielding the CPU. If lathist is enabled, the time it takes the
+/// scheduler to dispatch the queued tasks is reported by decision_lat().
+///
 /// Finally the methods exited() and shutdown_and_report() can be used respectively to test
 /// whether the BPF component exited, and to shutdown and report the exit message.
-/// whether the BPF component exited, and to shutdown and report exit message.
+///
+/// Multi-threaded schedulers
+/// =========================
+///
+/// If the BpfScheduler() is initialized with numa_workers enabled, the tasks enqueued on the CPUs
+/// of each NUMA node are sent to a separate ring buffer. The method workers() can then be used to
+/// get one BpfWorker() per NUMA node: each worker can be moved to a different thread (and pinned
+/// to the CPUs of its node with pin()) to receive and dispatch the tasks of its node in parallel
+/// with the other workers.
 
 // Task queued for scheduling from the BPF component (see bpf_intf::queued_task_ctx).
-#[derive(Debug, PartialEq, Eq, PartialOrd, Clone)]
+#[derive(Debug, Default, PartialEq, Eq, PartialOrd, Clone)]
 pub struct QueuedTask {
     pub pid: i32,              // pid that uniquely identifies a task
     pub cpu: i32,              // CPU where the task is running (-1 = exiting)
     pub sum_exec_runtime: u64, // Total cpu time
     pub nvcsw: u64,            // Voluntary context switches
     pub weight: u64,           // Task static priority
+    pub nr_cpus_allowed: u64,  // Number of CPUs the task can run on
     cpumask_cnt: u64,          // cpumask generation counter (private)
 }
 
@@ -151,43 +189,550 @@ impl EnqueuedMessage {
             sum_exec_runtime: self.inner.sum_exec_runtime,
             nvcsw: self.inner.nvcsw,
             weight: self.inner.weight,
+            nr_cpus_allowed: self.inner.nr_cpus_allowed,
         }
     }
 }
 
 pub struct BpfScheduler<'cb> {
-    pub skel: BpfSkel<'cb>,                // Low-level BPF connector
-    queued: libbpf_rs::RingBuffer<'cb>,    // Ring buffer of queued tasks
-    dispatched: libbpf_rs::UserRingBuffer, // User Ring buffer of dispatched tasks
-    struct_ops: Option<libbpf_rs::Link>,   // Low-level BPF methods
+    pub skel: BpfSkel<'cb>,                   // Low-level BPF connector
+    queued: RefCell<Option<QueuedRing<'cb>>>, // Ring buffer of queued tasks
+    dispatched: Arc<Mutex<DispatchRing>>,     // User Ring buffer of dispatched tasks
+    shard_cpus: Vec<Vec<usize>>,              // CPUs assigned to each queued ring buffer
+    idle: IdleCpus,                           // Snapshot of the idle CPUs and cores
+    cpumasks: HashMap<i32, TaskCpumask>,      // Cpumasks of the tasks with a restricted affinity
+    struct_ops: Option<libbpf_rs::Link>,      // Low-level BPF methods
+}
+
+// Options of the BPF component (see BpfScheduler::init()).
+//
+// Schedulers only need to set the options that differ from the defaults, e.g.:
+//
+//   BpfScheduler::init(&BpfSchedulerOpts {
+//       slice_us: 5000,
+//       full_user: true,
+//       ..Default::default()
+//   })
+#[derive(Debug, Clone)]
+pub struct BpfSchedulerOpts {
+    pub slice_us: u64,        // Default task time slice
+    pub nr_cpus_online: i32,  // Max CPUs available in the system
+    pub partial: bool,        // Only schedule SCHED_EXT tasks
+    pub exit_dump_len: u32,   // Buffer size of the exit info
+    pub full_user: bool,      // Schedule all tasks in user-space
+    pub low_power: bool,      // Low power mode
+    pub fifo_sched: bool,     // Enable BPF FIFO scheduling when the system is not busy
+    pub wakeup_batch: u64,    // Queued tasks required to wake up the scheduler (1 = don't coalesce)
+    pub wakeup_delay_us: u64, // Max delay of coalesced scheduler wakeups
+    pub busy_poll_cpu: i32,   // CPU where the scheduler busy polls (-1 = disabled)
+    pub lathist: bool,        // Record the decision latency
+    pub numa_workers: bool,   // One queued ring buffer per NUMA node (see workers())
+    pub debug: bool,          // Debug mode
 }
 
-// Buffer to store a task read from the ring buffer.
+impl Default for BpfSchedulerOpts {
+    fn default() -> Self {
+        Self {
+            slice_us: 5000,
+            nr_cpus_online: libbpf_rs::num_possible_cpus().unwrap_or(1) as i32,
+            partial: false,
+            exit_dump_len: 0,
+            full_user: false,
+            low_power: false,
+            fifo_sched: false,
+            wakeup_batch: 1,
+            wakeup_delay_us: 0,
+            busy_poll_cpu: -1,
+            lathist: false,
+            numa_workers: false,
+            debug: false,
+        }
+    }
+}
+
+// Maximum amount of tasks that can be received with a single dequeue_tasks() call.
+pub const MAX_DEQUEUE_BATCH: usize = 64;
+
+// Maximum amount of tasks that can be sent to the BPF component with a single user ring buffer
+// reservation (larger batches passed to dispatch_tasks() are split in multiple reservations).
+pub const MAX_DISPATCH_BATCH: usize = bpf_intf::MAX_DISPATCH_BATCH as usize;
+
+// Buffer to store the tasks read from the ring buffer.
 //
 // NOTE: make the buffer aligned to 64-bits to prevent misaligned dereferences when accessing the
 // buffer using a pointer.
-const BUFSIZE: usize = std::mem::size_of::<QueuedTask>();
+const BUFSIZE: usize = std::mem::size_of::<bpf_intf::queued_task_ctx>();
 
 #[repr(align(8))]
-struct AlignedBuffer([u8; BUFSIZE]);
-
-static mut BUF: AlignedBuffer = AlignedBuffer([0; BUFSIZE]);
+struct DequeueBuffer {
+    data: [[u8; BUFSIZE]; MAX_DEQUEUE_BATCH],
+    len: usize, // Amount of items currently stored in the buffer
+    cap: usize, // Maximum amount of items to store before stopping the ring buffer consumer
+}
 
 // Special negative error code for libbpf to stop after consuming just one item from a BPF
 // ring buffer.
 const LIBBPF_STOP: i32 = -255;
 
+impl DequeueBuffer {
+    // Copy one item from the ring buffer.
+    //
+    // Each invocation of the callback will trigger the copy of exactly one queued_task_ctx item
+    // to the next free slot of the buffer, the copy is safe, since the size of each slot is
+    // exactly the size of queued_task_ctx and the callback operates in chunks of queued_task_ctx
+    // items. It also never copies more than cap items, this is guaranteed by the error code
+    // returned by this callback (see below).
+    //
+    // Zero-length records are only submitted by the BPF component to wake up the consumer (see
+    // signal_queued_rings()) and are skipped.
+    fn push(&mut self, data: &[u8]) -> i32 {
+        if data.is_empty() {
+            return 0;
+        }
+        self.data[self.len].copy_from_slice(data);
+        self.len += 1;
+        if self.len < self.cap {
+            return 0;
+        }
+
+        // Return an unsupported error to stop early, once the batch is complete.
+        //
+        // NOTE: this is quite a hack. I wish libbpf would honor stopping after the first item is
+        // consumed, upon returning a non-zero positive value here, but it doesn't seem to be the
+        // case:
+        //
+        // https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/tree/tools/lib/bpf/ringbuf.c?h=v6.8-rc5#n260
+        //
+        // Maybe we should fix this to stop processing items from the ring buffer also when a
+        // value > 0 is returned.
+        //
+        LIBBPF_STOP
+    }
+}
+
+// Ring buffer of queued tasks, with its private buffer used to receive the tasks.
+//
+// Each ring buffer can be consumed only by one thread at a time: this is guaranteed by the fact
+// that all the methods that consume a QueuedRing require a mutable reference.
+struct QueuedRing<'cb> {
+    ring: libbpf_rs::RingBuffer<'cb>,
+    buf: *mut DequeueBuffer,
+}
+
+// SAFETY: a QueuedRing exclusively owns both the libbpf ring buffer consumer and the buffer used
+// by its callback, and it is only consumed through a mutable reference, so it can be moved to
+// another thread.
+unsafe impl<'cb> Send for QueuedRing<'cb> {}
+
+impl<'cb> QueuedRing<'cb> {
+    fn new(map: &libbpf_rs::Map) -> Self {
+        let buf = Box::into_raw(Box::new(DequeueBuffer {
+            data: [[0; BUFSIZE]; MAX_DEQUEUE_BATCH],
+            len: 0,
+            cap: 0,
+        }));
+
+        let mut rbb = libbpf_rs::RingBufferBuilder::new();
+        rbb.add(map, move |data: &[u8]| {
+            // SAFETY: the buffer is accessed by the callback only while the QueuedRing is
+            // consumed, and it is released only when the QueuedRing is dropped.
+            unsafe { (*buf).push(data) }
+        })
+        .expect("failed to add ringbuf callback");
+        let ring = rbb.build().expect("failed to build ringbuf");
+
+        QueuedRing { ring, buf }
+    }
+
+    // Receive up to min(tasks.len(), MAX_DEQUEUE_BATCH) tasks, waiting up to @timeout for new
+    // tasks if none is immediately available (None = don't wait).
+    fn consume(
+        &mut self,
+        tasks: &mut [QueuedTask],
+        timeout: Option<Duration>,
+    ) -> Result<usize, i32> {
+        let cap = tasks.len().min(MAX_DEQUEUE_BATCH);
+        if cap == 0 {
+            return Ok(0);
+        }
+
+        unsafe {
+            (*self.buf).len = 0;
+            (*self.buf).cap = cap;
+        }
+        let res = match timeout {
+            Some(timeout) => self.ring.poll_raw(timeout),
+            None => self.ring.consume_raw(),
+        };
+        match res {
+            LIBBPF_STOP => {}
+            res if res < 0 => return Err(res),
+            _ => {}
+        }
+
+        // Convert the received data to proper task structs.
+        let buf = unsafe { &*self.buf };
+        for (i, task) in tasks[..buf.len].iter_mut().enumerate() {
+            *task = EnqueuedMessage::from_bytes(&buf.data[i]).to_queued_task();
+        }
+
+        Ok(buf.len)
+    }
+}
+
+impl<'cb> Drop for QueuedRing<'cb> {
+    fn drop(&mut self) {
+        drop(unsafe { Box::from_raw(self.buf) });
+    }
+}
+
+// Number of u64 words of the BPF idle CPU and core bitmaps.
+const IDLE_WORDS: usize = bpf_intf::MAX_CPUS as usize / 64;
+
+// Local snapshot of the idle CPUs and cores exported by the BPF component (see idle_cpus and
+// idle_cores in main.bpf.c), with the topology needed to pick idle CPUs close to a given CPU.
+//
+// The CPUs returned by pick() are removed from the snapshot, so that the same CPU is not picked
+// twice before the BPF component reports a new idle state.
+struct IdleCpus {
+    gen: u64,                          // Generation of the last snapshot (see idle_gen)
+    cpus: [u64; IDLE_WORDS],           // Idle CPUs
+    cores: [u64; IDLE_WORDS],          // Idle cores (first CPU of each core)
+    cpu_to_core: Vec<usize>,           // First CPU of the core of each CPU
+    cpu_to_llc: Vec<usize>,            // Index in llc_spans of the LLC of each CPU
+    llc_spans: Vec<[u64; IDLE_WORDS]>, // CPUs of each LLC
+    nr_cpus: usize,                    // Amount of online CPUs
+}
+
+// Cpumask of a task that can't run on all the online CPUs, valid as long as the cpumask
+// generation counter of the task doesn't change.
+struct TaskCpumask {
+    cpumask_cnt: u64,
+    cpus: [u64; IDLE_WORDS],
+}
+
+impl IdleCpus {
+    fn new(topo: &Topology) -> Self {
+        let nr_cpus = topo.nr_cpus_possible().min(bpf_intf::MAX_CPUS as usize);
+        let mut cpu_to_core: Vec<usize> = (0..nr_cpus).collect();
+        let mut cpu_to_llc = vec![usize::MAX; nr_cpus];
+        let mut llc_spans = Vec::new();
+
+        for node in topo.nodes() {
+            for llc in node.llcs().values() {
+                let mut span = [0u64; IDLE_WORDS];
+                for core in llc.cores().values() {
+                    let first = match core.cpus().keys().next() {
+                        Some(&cpu) => cpu,
+                        None => continue,
+                    };
+                    for &cpu in core.cpus().keys().filter(|&&cpu| cpu < nr_cpus) {
+                        cpu_to_core[cpu] = first;
+                        cpu_to_llc[cpu] = llc_spans.len();
+                        span[cpu / 64] |= 1 << (cpu % 64);
+                    }
+                }
+                llc_spans.push(span);
+            }
+        }
+
+        // All the online CPUs are initially idle.
+        let mut cpus = [0u64; IDLE_WORDS];
+        let mut cores = [0u64; IDLE_WORDS];
+        for &cpu in topo.cpus().keys().filter(|&&cpu| cpu < nr_cpus) {
+            cpus[cpu / 64] |= 1 << (cpu % 64);
+            let core = cpu_to_core[cpu];
+            cores[core / 64] |= 1 << (core % 64);
+        }
+        let nr_cpus = cpus.iter().map(|word| word.count_ones() as usize).sum();
+
+        Self {
+            gen: 0,
+            cpus,
+            cores,
+            cpu_to_core,
+            cpu_to_llc,
+            llc_spans,
+            nr_cpus,
+        }
+    }
+
+    // Return the first CPU set in @bitmap and in @span (if specified).
+    fn first(bitmap: &[u64; IDLE_WORDS], span: Option<&[u64; IDLE_WORDS]>) -> Option<usize> {
+        for i in 0..IDLE_WORDS {
+            let word = bitmap[i] & span.map_or(u64::MAX, |span| span[i]);
+            if word != 0 {
+                return Some(i * 64 + word.trailing_zeros() as usize);
+            }
+        }
+        None
+    }
+
+    fn test(bitmap: &[u64; IDLE_WORDS], cpu: usize) -> bool {
+        bitmap[cpu / 64] & (1 << (cpu % 64)) != 0
+    }
+
+    // Remove @cpu and its core from the idle CPUs and cores.
+    fn claim(&mut self, cpu: usize) -> usize {
+        let core = self.cpu_to_core.get(cpu).copied().unwrap_or(cpu);
+        self.cpus[cpu / 64] &= !(1 << (cpu % 64));
+        self.cores[core / 64] &= !(1 << (core % 64));
+        cpu
+    }
+
+    // Pick an idle CPU close to @prev_cpu, in order of preference: @prev_cpu if its whole core
+    // is idle, a fully idle core in the same LLC, @prev_cpu, an idle CPU in the same LLC, a fully
+    // idle core, any idle CPU. Only the CPUs in @allowed (if specified) are considered.
+    fn pick(&mut self, prev_cpu: i32, allowed: Option<&[u64; IDLE_WORDS]>) -> Option<usize> {
+        let all = [u64::MAX; IDLE_WORDS];
+        let allowed = allowed.unwrap_or(&all);
+        let prev = usize::try_from(prev_cpu)
+            .ok()
+            .filter(|&cpu| cpu < self.cpu_to_core.len());
+        let span = prev
+            .and_then(|cpu| self.llc_spans.get(self.cpu_to_llc[cpu]))
+            .map(|span| {
+                let mut span = *span;
+                for i in 0..IDLE_WORDS {
+                    span[i] &= allowed[i];
+                }
+                span
+            });
+        let prev = prev.filter(|&cpu| Self::test(allowed, cpu));
+
+        if let Some(cpu) = prev {
+            if Self::test(&self.cores, self.cpu_to_core[cpu]) {
+                return Some(self.claim(cpu));
+            }
+        }
+        if let Some(span) = span.as_ref() {
+            if let Some(cpu) = Self::first(&self.cores, Some(span)) {
+                return Some(self.claim(cpu));
+            }
+        }
+        if let Some(cpu) = prev.filter(|&cpu| Self::test(&self.cpus, cpu)) {
+            return Some(self.claim(cpu));
+        }
+        if let Some(span) = span.as_ref() {
+            if let Some(cpu) = Self::first(&self.cpus, Some(span)) {
+                return Some(self.claim(cpu));
+            }
+        }
+        if let Some(cpu) = Self::first(&self.cores, Some(allowed)) {
+            return Some(self.claim(cpu));
+        }
+        Self::first(&self.cpus, Some(allowed)).map(|cpu| self.claim(cpu))
+    }
+}
+
+// User ring buffer of dispatched tasks.
+//
+// The user ring buffer can be shared by multiple workers, but libbpf requires the producers to
+// be serialized, so it must be always accessed holding the Mutex that wraps it.
+struct DispatchRing(libbpf_rs::UserRingBuffer);
+
+unsafe impl Send for DispatchRing {}
+
+impl DispatchRing {
+    // Convert a dispatched task into the low-level dispatched task context.
+    fn fill_dispatched_task_ctx(
+        dispatched_task: &mut bpf_intf::dispatched_task_ctx,
+        task: &DispatchedTask,
+    ) {
+        let bpf_intf::dispatched_task_ctx {
+            pid,
+            cpu,
+            flags,
+            cpumask_cnt,
+            slice_ns,
+            ..
+        } = &mut dispatched_task.as_mut();
+
+        *pid = task.pid;
+        *cpu = task.cpu;
+        *flags = task.flags;
+        *cpumask_cnt = task.cpumask_cnt;
+        *slice_ns = task.slice_ns;
+    }
+
+    // Send a batch of tasks to the dispatcher (see BpfScheduler::dispatch_tasks()).
+    fn submit(&self, tasks: &[DispatchedTask]) -> Result<usize, libbpf_rs::Error> {
+        let mut nr_dispatched = 0;
+
+        for chunk in tasks.chunks(MAX_DISPATCH_BATCH) {
+            // Reserve a slot for the whole chunk in the user ring buffer.
+            let mut urb_sample = match self
+                .0
+                .reserve(chunk.len() * std::mem::size_of::<bpf_intf::dispatched_task_ctx>())
+            {
+                Ok(sample) => sample,
+                Err(err) if nr_dispatched == 0 => return Err(err),
+                Err(_) => break,
+            };
+            let bytes = urb_sample.as_mut();
+            let dispatched_tasks =
+                plain::slice_from_mut_bytes::<bpf_intf::dispatched_task_ctx>(bytes)
+                    .expect("failed to convert bytes");
+
+            for (dispatched_task, task) in dispatched_tasks.iter_mut().zip(chunk) {
+                Self::fill_dispatched_task_ctx(dispatched_task, task);
+            }
+
+            // Store the tasks in the user ring buffer.
+            //
+            // NOTE: submit() only updates the reserved slot in the user ring buffer, so it is not
+            // expected to fail.
+            self.0.submit(urb_sample).expect("failed to submit task");
+
+            nr_dispatched += chunk.len();
+        }
+
+        Ok(nr_dispatched)
+    }
+}
+
+// Return the queued ring buffer map associated to a shard.
+fn queued_map<'a>(maps: &'a BpfMaps<'a>, shard: usize) -> &'a libbpf_rs::Map {
+    match shard {
+        0 => maps.queued(),
+        1 => maps.queued_1(),
+        2 => maps.queued_2(),
+        3 => maps.queued_3(),
+        4 => maps.queued_4(),
+        5 => maps.queued_5(),
+        6 => maps.queued_6(),
+        _ => maps.queued_7(),
+    }
+}
+
+// Return a reference to a counter of the BPF .bss section that can be updated atomically.
+fn bss_atomic<T, A>(val: &T) -> &A {
+    // SAFETY: the counters shared between the BPF component and the workers are always accessed
+    // atomically and A is an atomic type with the same size and alignment of T.
+    assert_eq!(std::mem::size_of::<T>(), std::mem::size_of::<A>());
+    unsafe { &*(val as *const T as *const A) }
+}
+
+// Worker of a multi-threaded user-space scheduler (see BpfScheduler::workers()).
+//
+// Each worker receives the tasks enqueued on the CPUs of a NUMA node and can dispatch tasks in
+// parallel with the other workers. A worker borrows the BpfScheduler that created it, so it can
+// never outlive the BPF skeleton.
+//
+// The worker must be dropped by the thread that used it: this releases the memory blocks cached
+// by the thread in the allocator and unregisters the thread from the BPF component.
+pub struct BpfWorker<'a> {
+    shard: usize,                         // Index of the queued ring buffer
+    cpus: Vec<usize>,                     // CPUs served by the worker
+    queued: QueuedRing<'a>,               // Ring buffer of queued tasks
+    dispatched: Arc<Mutex<DispatchRing>>, // User Ring buffer of dispatched tasks
+    nr_queued: &'a AtomicU64,             // Shared counter of queued tasks
+    nr_scheduled: &'a AtomicU64,          // Shared counter of scheduled tasks
+    worker_pid: &'a AtomicU32,            // Worker thread registered in the BPF component
+    tid: u32,                             // Thread that is consuming the queued ring buffer
+    scheduled: u64,                       // Scheduled tasks reported by this worker
+}
+
+impl<'a> BpfWorker<'a> {
+    // Index of the queued ring buffer (i.e., NUMA node) served by the worker.
+    #[allow(dead_code)]
+    pub fn shard(&self) -> usize {
+        self.shard
+    }
+
+    // CPUs whose tasks are received by the worker.
+    #[allow(dead_code)]
+    pub fn cpus(&self) -> &[usize] {
+        &self.cpus
+    }
+
+    // Pin the calling thread to the CPUs served by the worker.
+    #[allow(dead_code)]
+    pub fn pin(&self) -> Result<()> {
+        let mut cpuset: libc::cpu_set_t = unsafe { std::mem::zeroed() };
+        for &cpu in self.cpus.iter() {
+            unsafe { libc::CPU_SET(cpu, &mut cpuset) };
+        }
+        let res = unsafe { sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &cpuset) };
+        if res != 0 {
+            return Err(anyhow::Error::msg(format!(
+                "sched_setaffinity error: {}",
+                std::io::Error::last_os_error()
+            )));
+        }
+        Ok(())
+    }
+
+    // Receive a batch of tasks to be scheduled from the BPF dispatcher, waiting up to @timeout
+    // if no task is immediately available.
+    //
+    // The received tasks are automatically removed from the counter of queued tasks. Return the
+    // amount of tasks stored at the beginning of @tasks (0 = no task was queued).
+    //
+    // NOTE: if task.cpu is negative the task is exiting and it does not require to be scheduled.
+    pub fn dequeue_tasks(
+        &mut self,
+        tasks: &mut [QueuedTask],
+        timeout: Duration,
+    ) -> Result<usize, i32> {
+        self.register();
+
+        let nr = self.queued.consume(tasks, Some(timeout))?;
+        if nr > 0 {
+            let _ = self
+                .nr_queued
+                .fetch_update(Ordering::Relaxed, Ordering::Relaxed, |n| {
+                    Some(n.saturating_sub(nr as u64))
+                });
+        }
+        Ok(nr)
+    }
+
+    // Send a batch of tasks to the dispatcher (see BpfScheduler::dispatch_tasks()).
+    pub fn dispatch_tasks(&mut self, tasks: &[DispatchedTask]) -> Result<usize, libbpf_rs::Error> {
+        self.dispatched.lock().unwrap().submit(tasks)
+    }
+
+    // Update the amount of tasks that have been scheduled by this worker, but not dispatched yet.
+    //
+    // The shared counter of scheduled tasks is the sum of the amounts reported by each worker.
+    #[allow(dead_code)]
+    pub fn update_tasks(&mut self, nr_scheduled: u64) {
+        let nr = self.nr_scheduled;
+        if nr_scheduled > self.scheduled {
+            nr.fetch_add(nr_scheduled - self.scheduled, Ordering::Relaxed);
+        } else {
+            nr.fetch_sub(self.scheduled - nr_scheduled, Ordering::Relaxed);
+        }
+        self.scheduled = nr_scheduled;
+    }
+
+    // Register the calling thread in the BPF component as the thread that consumes the queued
+    // ring buffer of this worker, so that it is always dispatched directly, without depending on
+    // the user-space scheduler to run.
+    fn register(&mut self) {
+        let tid = unsafe { libc::gettid() } as u32;
+        if tid != self.tid {
+            self.tid = tid;
+            self.worker_pid.store(tid, Ordering::Relaxed);
+        }
+    }
+}
+
+impl<'a> Drop for BpfWorker<'a> {
+    fn drop(&mut self) {
+        self.update_tasks(0);
+        if self.tid != 0 {
+            let _ =
+                self.worker_pid
+                    .compare_exchange(self.tid, 0, Ordering::Relaxed, Ordering::Relaxed);
+        }
+        ALLOCATOR.flush_thread_cache();
+    }
+}
+
 impl<'cb> BpfScheduler<'cb> {
-    pub fn init(
-        slice_us: u64,
-        nr_cpus_online: i32,
-        partial: bool,
-        exit_dump_len: u32,
-        full_user: bool,
-        low_power: bool,
-        fifo_sched: bool,
-        debug: bool,
-    ) -> Result<Self> {
+    pub fn init(opts: &BpfSchedulerOpts) -> Result<Self> {
         // Open the BPF prog first for verification.
         let skel_builder = BpfSkelBuilder::default();
         init_libbpf_logging(None);
@@ -197,59 +742,50 @@ impl<'cb> BpfScheduler<'cb> {
         // scheduling.
         ALLOCATOR.lock_memory();
 
-        // Copy one item from the ring buffer.
-        //
-        // # Safety
-        //
-        // Each invocation of the callback will trigger the copy of exactly one QueuedTask item to
-        // BUF. The caller must be synchronize to ensure that multiple invocations of the callback
-        // are not happening at the same time, but this is implicitly guaranteed by the fact that
-        // the caller is a single-thread process (for now).
-        //
-        // Use of a `str` whose contents are not valid UTF-8 is undefined behavior.
-        fn callback(data: &[u8]) -> i32 {
-            unsafe {
-                // SAFETY: copying from the BPF ring buffer to BUF is safe, since the size of BUF
-                // is exactly the size of QueuedTask and the callback operates in chunks of
-                // QueuedTask items. It also copies exactly one QueuedTask at a time, this is
-                // guaranteed by the error code returned by this callback (see below). From a
-                // thread-safety perspective this is also correct, assuming the caller is a
-                // single-thread process (as it is for now).
-                BUF.0.copy_from_slice(data);
-            }
-
-            // Return an unsupported error to stop early and consume only one item.
-            //
-            // NOTE: this is quite a hack. I wish libbpf would honor stopping after the first item
-            // is consumed, upon returning a non-zero positive value here, but it doesn't seem to
-            // be the case:
-            //
-            // https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/tree/tools/lib/bpf/ringbuf.c?h=v6.8-rc5#n260
-            //
-            // Maybe we should fix this to stop processing items from the ring buffer also when a
-            // value > 0 is returned.
-            //
-            LIBBPF_STOP
-        }
-
         // Initialize online CPUs counter.
         //
         // NOTE: we should probably refresh this counter during the normal execution to support cpu
         // hotplugging, but for now let's keep it simple and set this only at initialization).
-        skel.rodata_mut().num_possible_cpus = nr_cpus_online;
+        skel.rodata_mut().num_possible_cpus = opts.nr_cpus_online;
 
         // Set scheduler options (defined in the BPF part).
-        if partial {
+        if opts.partial {
             skel.struct_ops.rustland_mut().flags |= *compat::SCX_OPS_SWITCH_PARTIAL;
         }
-        skel.struct_ops.rustland_mut().exit_dump_len = exit_dump_len;
+        skel.struct_ops.rustland_mut().exit_dump_len = opts.exit_dump_len;
 
         skel.bss_mut().usersched_pid = std::process::id();
-        skel.rodata_mut().slice_ns = slice_us * 1000;
-        skel.rodata_mut().debug = debug;
-        skel.rodata_mut().full_user = full_user;
-        skel.rodata_mut().low_power = low_power;
-        skel.rodata_mut().fifo_sched = fifo_sched;
+        skel.rodata_mut().slice_ns = opts.slice_us * 1000;
+        skel.rodata_mut().debug = opts.debug;
+        skel.rodata_mut().full_user = opts.full_user;
+        skel.rodata_mut().low_power = opts.low_power;
+        skel.rodata_mut().fifo_sched = opts.fifo_sched;
+        skel.rodata_mut().wakeup_batch = opts.wakeup_batch;
+        skel.rodata_mut().wakeup_delay_ns = opts.wakeup_delay_us * 1000;
+        skel.rodata_mut().busy_poll_cpu = opts.busy_poll_cpu;
+        skel.rodata_mut().lathist_enabled = opts.lathist;
+
+        // Assign the CPUs of each NUMA node to a different queued ring buffer.
+        let topo = Topology::new()?;
+        if opts.busy_poll_cpu >= 0 && !topo.span().test_cpu(opts.busy_poll_cpu as usize) {
+            bail!("Busy polling CPU {} is not online", opts.busy_poll_cpu);
+        }
+        let shard_cpus = Self::shard_cpus(&topo, opts.numa_workers);
+        for (shard, cpus) in shard_cpus.iter().enumerate() {
+            for &cpu in cpus.iter() {
+                if let Some(slot) = skel.rodata_mut().cpu_to_queued_shard.get_mut(cpu) {
+                    *slot = shard as u32;
+                }
+            }
+        }
+
+        // Initialize the idle CPU and core bitmaps.
+        let idle = IdleCpus::new(&topo);
+        for (cpu, &core) in idle.cpu_to_core.iter().enumerate() {
+            skel.rodata_mut().cpu_to_core[cpu] = core as u32;
+        }
+        skel.bss_mut().idle_cpus = idle.cpus;
+        skel.bss_mut().idle_cores = idle.cores;
 
         // Attach BPF scheduler.
         let mut skel = scx_ops_load!(skel, rustland, uei)?;
@@ -257,15 +793,12 @@ impl<'cb> BpfScheduler<'cb> {
 
         // Build the ring buffer of queued tasks.
         let maps = skel.maps();
-        let queued_ring_buffer = maps.queued();
-        let mut rbb = libbpf_rs::RingBufferBuilder::new();
-        rbb.add(queued_ring_buffer, callback)
-            .expect("failed to add ringbuf callback");
-        let queued = rbb.build().expect("failed to build ringbuf");
+        let queued = RefCell::new(Some(QueuedRing::new(maps.queued())));
 
         // Build the user ring buffer of dispatched tasks.
         let dispatched = libbpf_rs::UserRingBuffer::new(&maps.dispatched())
             .expect("failed to create user ringbuf");
+        let dispatched = Arc::new(Mutex::new(DispatchRing(dispatched)));
 
         // Make sure to use the SCHED_EXT class at least for the scheduler itself.
         match Self::use_sched_ext() {
@@ -273,6 +806,9 @@ impl<'cb> BpfScheduler<'cb> {
                 skel,
                 queued,
                 dispatched,
+                shard_cpus,
+                idle,
+                cpumasks: HashMap::new(),
                 struct_ops,
             }),
             err => Err(anyhow::Error::msg(format!(
@@ -282,6 +818,59 @@ impl<'cb> BpfScheduler<'cb> {
         }
     }
 
+    // Return the CPUs assigned to each queued ring buffer: all the CPUs are assigned to the first
+    // ring buffer, unless @numa_workers is set, in this case each NUMA node gets its own ring
+    // buffer (nodes exceeding MAX_QUEUED_SHARDS share the ring buffers in a round-robin fashion).
+    fn shard_cpus(topo: &Topology, numa_workers: bool) -> Vec<Vec<usize>> {
+        let all_cpus = || topo.cpus().keys().copied().collect::<Vec<usize>>();
+
+        if !numa_workers {
+            return vec![all_cpus()];
+        }
+        let nodes = topo.nodes();
+        let nr_shards = nodes.len().clamp(1, bpf_intf::MAX_QUEUED_SHARDS as usize);
+        let mut shard_cpus = vec![Vec::new(); nr_shards];
+        for (i, node) in nodes.iter().enumerate() {
+            let span = node.span();
+            shard_cpus[i % nr_shards].extend((0..span.len()).filter(|&cpu| span.test_cpu(cpu)));
+        }
+        if shard_cpus.iter().all(|cpus| cpus.is_empty()) {
+            return vec![all_cpus()];
+        }
+
+        shard_cpus
+    }
+
+    // Return one worker for each queued ring buffer.
+    //
+    // After calling this method the queued tasks can be received only via the returned workers
+    // (dequeue_task() and dequeue_tasks() will always return no task), while tasks can still be
+    // dispatched using any worker or the BpfScheduler() itself. The workers can be created only
+    // once, any following call returns no worker.
+    pub fn workers(&self) -> Vec<BpfWorker<'_>> {
+        if self.queued.borrow_mut().take().is_none() {
+            return Vec::new();
+        }
+
+        let bss = self.skel.bss();
+        let maps = self.skel.maps();
+        self.shard_cpus
+            .iter()
+            .enumerate()
+            .map(|(shard, cpus)| BpfWorker {
+                shard,
+                cpus: cpus.clone(),
+                queued: QueuedRing::new(queued_map(&maps, shard)),
+                dispatched: self.dispatched.clone(),
+                nr_queued: bss_atomic(&bss.nr_queued),
+                nr_scheduled: bss_atomic(&bss.nr_scheduled),
+                worker_pid: bss_atomic(&bss.worker_pids[shard]),
+                tid: 0,
+                scheduled: 0,
+            })
+            .collect()
+    }
+
     // Update the amount of tasks that have been queued to the user-space scheduler and dispatched.
     //
     // This method is used to notify the BPF component if the user-space scheduler has still some
@@ -353,6 +942,32 @@ impl<'cb> BpfScheduler<'cb> {
         &mut self.skel.bss_mut().nr_sched_congested
     }
 
+    // Counter of wakeups of the user-space scheduler.
+    #[allow(dead_code)]
+    pub fn nr_usersched_wakeups_mut(&mut self) -> &mut u64 {
+        &mut self.skel.bss_mut().nr_usersched_wakeups
+    }
+
+    // Counter of tasks sent to user-space without waking up the scheduler.
+    #[allow(dead_code)]
+    pub fn nr_coalesced_wakeups_mut(&mut self) -> &mut u64 {
+        &mut self.skel.bss_mut().nr_coalesced_wakeups
+    }
+
+    // Return true if the user-space scheduler is expected to busy poll instead of yielding the
+    // CPU.
+    #[allow(dead_code)]
+    pub fn busy_polling(&self) -> bool {
+        unsafe { std::ptr::read_volatile(&self.skel.bss().usersched_busy_poll) }
+    }
+
+    // Histogram of the time from when a task is queued to the user-space scheduler until the
+    // scheduler dispatches it (see scx_utils::lathist), only recorded if lathist is enabled.
+    #[allow(dead_code)]
+    pub fn decision_lat(&self) -> Result<LatHist> {
+        LatHist::read(self.skel.maps().lathists(), LATHIST_DECISION)
+    }
+
     // Set scheduling class for the scheduler itself to SCHED_EXT
     fn use_sched_ext() -> i32 {
         let pid = std::process::id();
@@ -385,64 +1000,150 @@ impl<'cb> BpfScheduler<'cb> {
         unsafe { *cpu_map_ptr.offset(cpu as isize) }
     }
 
+    // Read the idle CPUs and cores reported by the BPF component, if they changed since the last
+    // call (CPUs picked with pick_idle_cpu() become available again only after a refresh that
+    // reads a new idle state). Return true if a new idle state has been read.
+    #[allow(dead_code)]
+    pub fn refresh_idle_cpus(&mut self) -> bool {
+        let bss = self.skel.bss();
+        let gen = unsafe { std::ptr::read_volatile(&bss.idle_gen) };
+
+        if gen == self.idle.gen {
+            return false;
+        }
+        self.idle.gen = gen;
+        for i in 0..IDLE_WORDS {
+            self.idle.cpus[i] = unsafe { std::ptr::read_volatile(&bss.idle_cpus[i]) };
+            self.idle.cores[i] = unsafe { std::ptr::read_volatile(&bss.idle_cores[i]) };
+        }
+        true
+    }
+
+    // Amount of fully idle cores that have not been picked yet.
+    #[allow(dead_code)]
+    pub fn nr_idle_cores(&self) -> usize {
+        self.idle
+            .cores
+            .iter()
+            .map(|word| word.count_ones() as usize)
+            .sum()
+    }
+
+    // Iterate over the fully idle cores that have not been picked yet, each core is represented
+    // by its first CPU.
+    #[allow(dead_code)]
+    pub fn idle_cores(&self) -> impl Iterator<Item = usize> + '_ {
+        self.idle.cores.iter().enumerate().flat_map(|(i, &word)| {
+            let mut word = word;
+            std::iter::from_fn(move || {
+                if word == 0 {
+                    return None;
+                }
+                let bit = word.trailing_zeros() as usize;
+                word &= word - 1;
+                Some(i * 64 + bit)
+            })
+        })
+    }
+
+    // Pick an idle CPU that @task can run on, preferring the CPU where it was running, then the
+    // CPUs in the same LLC and fully idle cores over partially idle ones. Return -1 if there are
+    // no idle CPUs in the cpumask of the task.
+    //
+    // The cpumask of the tasks that can't run on all the online CPUs is read with
+    // sched_getaffinity() and cached until the task changes its affinity.
+    #[allow(dead_code)]
+    pub fn pick_idle_cpu(&mut self, task: &QueuedTask) -> i32 {
+        if task.nr_cpus_allowed as usize >= self.idle.nr_cpus {
+            return self.idle.pick(task.cpu, None).map_or(-1, |cpu| cpu as i32);
+        }
+        let cpus = match self.cpumasks.get(&task.pid) {
+            Some(mask) if mask.cpumask_cnt == task.cpumask_cnt => mask.cpus,
+            _ => match Self::read_cpumask(task.pid) {
+                Some(cpus) => {
+                    let cpumask_cnt = task.cpumask_cnt;
+                    self.cpumasks
+                        .insert(task.pid, TaskCpumask { cpumask_cnt, cpus });
+                    cpus
+                }
+                None => return -1,
+            },
+        };
+        self.idle
+            .pick(task.cpu, Some(&cpus))
+            .map_or(-1, |cpu| cpu as i32)
+    }
+
+    // Read the cpumask of @pid, return None if the task doesn't exist anymore.
+    fn read_cpumask(pid: i32) -> Option<[u64; IDLE_WORDS]> {
+        let mut cpuset: libc::cpu_set_t = unsafe { std::mem::zeroed() };
+        let size = std::mem::size_of::<libc::cpu_set_t>();
+        if unsafe { libc::sched_getaffinity(pid, size, &mut cpuset) } != 0 {
+            return None;
+        }
+
+        let mut cpus = [0u64; IDLE_WORDS];
+        for cpu in 0..bpf_intf::MAX_CPUS as usize {
+            if unsafe { libc::CPU_ISSET(cpu, &cpuset) } {
+                cpus[cpu / 64] |= 1 << (cpu % 64);
+            }
+        }
+        Some(cpus)
+    }
+
     // Receive a task to be scheduled from the BPF dispatcher.
     //
     // NOTE: if task.cpu is negative the task is exiting and it does not require to be scheduled.
     pub fn dequeue_task(&mut self) -> Result<Option<QueuedTask>, i32> {
-        match self.queued.consume_raw() {
+        let mut task = [QueuedTask::default()];
+
+        match self.dequeue_tasks(&mut task)? {
             0 => Ok(None),
-            LIBBPF_STOP => {
-                // A valid task is received, convert data to a proper task struct.
-                let task = unsafe { EnqueuedMessage::from_bytes(&BUF.0).to_queued_task() };
-                Ok(Some(task))
+            _ => Ok(Some(std::mem::take(&mut task[0]))),
+        }
+    }
+
+    // Receive a batch of tasks to be scheduled from the BPF dispatcher, storing them in the
+    // caller-provided @tasks buffer.
+    //
+    // Up to min(tasks.len(), MAX_DEQUEUE_BATCH) tasks are consumed with a single ring buffer poll.
+    // Return the amount of tasks stored at the beginning of @tasks (0 = no task was queued).
+    //
+    // NOTE: if task.cpu is negative the task is exiting and it does not require to be scheduled.
+    pub fn dequeue_tasks(&mut self, tasks: &mut [QueuedTask]) -> Result<usize, i32> {
+        let nr_tasks = match self.queued.get_mut().as_mut() {
+            Some(queued) => queued.consume(tasks, None)?,
+            None => 0,
+        };
+
+        // Forget the cached cpumasks of the exiting tasks, their pids can be reused.
+        if !self.cpumasks.is_empty() {
+            for task in tasks[..nr_tasks].iter().filter(|task| task.cpu < 0) {
+                self.cpumasks.remove(&task.pid);
             }
-            res if res < 0 => Err(res),
-            res => panic!(
-                "Unexpected return value from libbpf-rs::consume_raw(): {}",
-                res
-            ),
         }
+        Ok(nr_tasks)
     }
 
     // Send a task to the dispatcher.
     pub fn dispatch_task(&mut self, task: &DispatchedTask) -> Result<(), libbpf_rs::Error> {
-        // Reserve a slot in the user ring buffer.
-        let mut urb_sample = self
-            .dispatched
-            .reserve(std::mem::size_of::<bpf_intf::dispatched_task_ctx>())?;
-        let bytes = urb_sample.as_mut();
-        let dispatched_task = plain::from_mut_bytes::<bpf_intf::dispatched_task_ctx>(bytes)
-            .expect("failed to convert bytes");
-
-        // Convert the dispatched task into the low-level dispatched task context.
-        let bpf_intf::dispatched_task_ctx {
-            pid,
-            cpu,
-            flags,
-            cpumask_cnt,
-            slice_ns,
-            ..
-        } = &mut dispatched_task.as_mut();
-
-        *pid = task.pid;
-        *cpu = task.cpu;
-        *flags = task.flags;
-        *cpumask_cnt = task.cpumask_cnt;
-        *slice_ns = task.slice_ns;
-
-        // Store the task in the user ring buffer.
-        //
-        // NOTE: submit() only updates the reserved slot in the user ring buffer, so it is not
-        // expected to fail.
-        self.dispatched
-            .submit(urb_sample)
-            .expect("failed to submit task");
+        self.dispatch_tasks(std::slice::from_ref(task)).map(|_| ())
+    }
 
-        Ok(())
+    // Send a batch of tasks to the dispatcher.
+    //
+    // Tasks are stored in the user ring buffer in chunks of MAX_DISPATCH_BATCH items, reserving a
+    // single slot for each chunk. Return the amount of tasks that have been sent, that can be less
+    // than tasks.len() if the user ring buffer becomes full: in this case the caller is
+    // responsible of re-submitting the remaining tasks later.
+    //
+    // An error is returned only if no task could be sent at all.
+    pub fn dispatch_tasks(&mut self, tasks: &[DispatchedTask]) -> Result<usize, libbpf_rs::Error> {
+        self.dispatched.lock().unwrap().submit(tasks)
     }
 
     // Read exit code from the BPF part.
-    pub fn exited(&mut self) -> bool {
+    pub fn exited(&self) -> bool {
         uei_exited!(&self.skel, uei)
     }
 
@@ -462,3 +1163,86 @@ impl<'a> Drop for BpfScheduler<'a> {
         ALLOCATOR.unlock_memory();
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // Build the idle state of 2 LLCs with 2 cores each and 2 CPUs per core, with all the CPUs
+    // idle: CPUs 0-3 belong to the first LLC and 4-7 to the second one, the CPUs of each core are
+    // adjacent.
+    fn idle_cpus() -> IdleCpus {
+        let mut cpus = [0u64; IDLE_WORDS];
+        let mut cores = [0u64; IDLE_WORDS];
+        let mut llc_spans = vec![[0u64; IDLE_WORDS]; 2];
+        cpus[0] = 0xff;
+        cores[0] = 0x55;
+        llc_spans[0][0] = 0x0f;
+        llc_spans[1][0] = 0xf0;
+
+        IdleCpus {
+            gen: 0,
+            cpus,
+            cores,
+            cpu_to_core: (0..8).map(|cpu| cpu & !1).collect(),
+            cpu_to_llc: (0..8).map(|cpu| cpu / 4).collect(),
+            llc_spans,
+            nr_cpus: 8,
+        }
+    }
+
+    fn mask(cpus: &[usize]) -> [u64; IDLE_WORDS] {
+        let mut mask = [0u64; IDLE_WORDS];
+        for &cpu in cpus {
+            mask[cpu / 64] |= 1 << (cpu % 64);
+        }
+        mask
+    }
+
+    #[test]
+    fn test_pick_order() {
+        let mut idle = idle_cpus();
+
+        // The previous CPU with its whole core idle, then the other idle core of the LLC, then
+        // the sibling of the previous CPU, then the idle cores of the other LLC.
+        assert_eq!(idle.pick(1, None), Some(1));
+        assert_eq!(idle.pick(1, None), Some(2));
+        assert_eq!(idle.pick(1, None), Some(0));
+        assert_eq!(idle.pick(1, None), Some(3));
+        assert_eq!(idle.pick(1, None), Some(4));
+        assert_eq!(idle.pick(1, None), Some(6));
+        assert_eq!(idle.pick(1, None), Some(5));
+        assert_eq!(idle.pick(1, None), Some(7));
+        assert_eq!(idle.pick(1, None), None);
+    }
+
+    #[test]
+    fn test_pick_no_prev_cpu() {
+        let mut idle = idle_cpus();
+
+        // Exiting tasks and invalid CPUs only get the fully idle cores first.
+        assert_eq!(idle.pick(-1, None), Some(0));
+        assert_eq!(idle.pick(64, None), Some(2));
+    }
+
+    #[test]
+    fn test_pick_allowed() {
+        let mut idle = idle_cpus();
+
+        // The previous CPU and its LLC are skipped if the task can't run there.
+        let allowed = mask(&[5, 7]);
+        assert_eq!(idle.pick(1, Some(&allowed)), Some(5));
+        assert_eq!(idle.pick(1, Some(&allowed)), Some(7));
+        assert_eq!(idle.pick(1, Some(&allowed)), None);
+
+        // A fully idle core in the cpumask is preferred over the previous CPU if its sibling is
+        // busy.
+        let mut idle = idle_cpus();
+        let allowed = mask(&[1, 2, 6]);
+        assert_eq!(idle.pick(0, Some(&mask(&[0]))), Some(0));
+        assert_eq!(idle.pick(1, Some(&allowed)), Some(2));
+        assert_eq!(idle.pick(1, Some(&allowed)), Some(1));
+        assert_eq!(idle.pick(1, Some(&allowed)), Some(6));
+        assert_eq!(idle.pick(1, Some(&allowed)), None);
+    }
+}
@@ -39,6 +39,14 @@ typedef long long s64;
  */
 #define MAX_CPUS 1024
 
+/*
+ * Maximum amount of ring buffers used to send queued tasks to user-space.
+ *
+ * Each ring buffer can be drained by a different user-space worker (typically
+ * one worker per NUMA node).
+ */
+#define MAX_QUEUED_SHARDS 8
+
 /* Special dispatch flags */
 enum {
 	/*
@@ -67,8 +75,15 @@ struct queued_task_ctx {
 	u64 sum_exec_runtime; /* Total cpu time */
 	u64 nvcsw; /* Voluntary context switches */
 	u64 weight; /* Task static priority */
+	u64 nr_cpus_allowed; /* Number of CPUs the task can run on */
 };
 
+/*
+ * Maximum amount of tasks that can be sent to the BPF dispatcher in a single
+ * user ring buffer sample (see BpfScheduler::dispatch_tasks()).
+ */
+#define MAX_DISPATCH_BATCH 32
+
 /*
  * Task sent to the BPF dispatcher by the user-space scheduler.
  *
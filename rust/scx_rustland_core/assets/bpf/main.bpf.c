@@ -13,9 +13,15 @@
  * to be dispatched in the proper order.
  *
  * Messages between the BPF component and the user-space scheduler are passed
- * using two BPF_MAP_TYPE_QUEUE maps: @queued for the messages sent by the BPF
- * dispatcher to the user-space scheduler and @dispatched for the messages sent
- * by the user-space scheduler to the BPF dispatcher.
+ * using ring buffers: @queued (and its per-NUMA-node siblings) for the
+ * messages sent by the BPF dispatcher to the user-space scheduler and
+ * @dispatched for the messages sent by the user-space scheduler to the BPF
+ * dispatcher.
+ *
+ * The user-space scheduler is woken up on demand: when a CPU becomes idle with
+ * pending work, when a task releases a CPU and periodically by a heartbeat
+ * timer. Under load the wakeups can be coalesced, or the scheduler can be kept
+ * busy polling on a dedicated CPU (see wakeup_batch and busy_poll_cpu).
  *
  * The BPF dispatcher is completely agnostic of the particular scheduling
  * policy implemented in user-space. For this reason developers that are
@@ -27,6 +33,7 @@
  * GNU General Public License version 2.
  */
 #include <scx/common.bpf.h>
+#include <scx/lathist_impl.bpf.h>
 #include "intf.h"
 
 char _license[] SEC("license") = "GPL";
@@ -45,10 +52,22 @@ UEI_DEFINE(uei);
 /* !0 for veristat, set during init */
 const volatile s32 num_possible_cpus = 8;
 
+/*
+ * Map each CPU to the @queued ring buffer used for the tasks that are
+ * enqueued on that CPU (all CPUs use the first ring buffer by default).
+ */
+const volatile u32 cpu_to_queued_shard[MAX_CPUS];
+
 /*
  * Scheduler attributes and statistics.
  */
 u32 usersched_pid; /* User-space scheduler PID */
+
+/*
+ * Threads of the user-space scheduler that consume the @queued ring buffers
+ * (one for each shard, 0 = no thread registered), set by user-space.
+ */
+volatile u32 worker_pids[MAX_QUEUED_SHARDS];
 const volatile bool switch_partial; /* Switch all tasks or SCHED_EXT tasks */
 const volatile u64 slice_ns = SCX_SLICE_DFL; /* Base time slice duration */
 
@@ -118,6 +137,36 @@ const volatile bool low_power;
 const volatile bool fifo_sched;
 static bool is_fifo_enabled;
 
+/*
+ * Coalesce the wakeups of the user-space scheduler under load.
+ *
+ * When 'wakeup_batch' is greater than 1 and at least half of the CPUs are
+ * busy, the tasks sent to user-space don't wake up the scheduler until
+ * 'wakeup_batch' of them are pending or the oldest one has been waiting for
+ * 'wakeup_delay_ns'. Under light load the scheduler is notified right away,
+ * relying on the regular ring buffer wakeup notifications.
+ *
+ * CPUs becoming idle with pending work and the heartbeat timer always wake up
+ * the scheduler, so coalescing never leaves a CPU idle for long.
+ */
+const volatile u64 wakeup_batch;
+const volatile u64 wakeup_delay_ns;
+
+/*
+ * Busy poll on a dedicated CPU under high load.
+ *
+ * If 'busy_poll_cpu' is set, when almost all the CPUs are busy the user-space
+ * scheduler is kept running on 'busy_poll_cpu' instead of being woken up on
+ * demand. The mode is re-evaluated by the heartbeat timer and exported in
+ * 'usersched_busy_poll', so that the scheduler keeps polling instead of
+ * yielding the CPU.
+ */
+const volatile s32 busy_poll_cpu = -1;
+volatile bool usersched_busy_poll;
+
+/* Wakeup statistics */
+volatile u64 nr_usersched_wakeups, nr_coalesced_wakeups;
+
 /* Allow to use bpf_printk() only when @debug is set */
 #define dbg_msg(_fmt, ...) do {						\
 	if (debug)							\
@@ -139,15 +188,32 @@ static bool is_fifo_enabled;
 #define MAX_DISPATCH_SLOT (MAX_ENQUEUED_TASKS / 8)
 
 /*
- * The map containing tasks that are queued to user space from the kernel.
+ * The maps containing tasks that are queued to user space from the kernel.
  *
- * This map is drained by the user space scheduler.
+ * These maps are drained by the user space scheduler: a single-threaded
+ * scheduler only uses @queued, while multi-threaded schedulers can drain each
+ * ring buffer from a different worker (see cpu_to_queued_shard).
  */
-struct {
+struct queued_ringbuf {
 	__uint(type, BPF_MAP_TYPE_RINGBUF);
 	__uint(max_entries, MAX_ENQUEUED_TASKS *
 				sizeof(struct queued_task_ctx));
-} queued SEC(".maps");
+} queued SEC(".maps"), queued_1 SEC(".maps"), queued_2 SEC(".maps"),
+  queued_3 SEC(".maps"), queued_4 SEC(".maps"), queued_5 SEC(".maps"),
+  queued_6 SEC(".maps"), queued_7 SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(max_entries, MAX_QUEUED_SHARDS);
+	__type(key, u32);
+	__array(values, struct queued_ringbuf);
+} queued_shards SEC(".maps") = {
+	.values = {
+		[0] = &queued, [1] = &queued_1, [2] = &queued_2,
+		[3] = &queued_3, [4] = &queued_4, [5] = &queued_5,
+		[6] = &queued_6, [7] = &queued_7,
+	},
+};
 
 /*
  * The user ring buffer containing pids that are dispatched from user space to
@@ -180,6 +246,13 @@ struct task_ctx {
 	 * considering migrating it to a different CPU.
 	 */
 	bool allow_migration;
+
+	/*
+	 * Timestamp of when the task has been sent to the user-space
+	 * scheduler (0 if it's not waiting for a decision), only kept if
+	 * lathist_enabled is set.
+	 */
+	u64 queued_at;
 };
 
 /* Map that contains task-local storage. */
@@ -233,6 +306,61 @@ struct {
  */
 volatile u32 cpu_map[MAX_CPUS];
 
+/*
+ * Bitmaps of the idle CPUs and of the fully idle cores, derived from
+ * @cpu_map, so that user-space can find idle CPUs without reading the owner
+ * of each CPU.
+ *
+ * A core is represented in @idle_cores by the bit of its first CPU (see
+ * @cpu_to_core). @idle_gen is bumped at each update, user-space can skip
+ * re-reading the bitmaps while it doesn't change.
+ *
+ * The bitmaps are a hint: the dispatch path still handles CPUs that are busy
+ * or not allowed for the dispatched task.
+ */
+volatile u64 idle_cpus[MAX_CPUS / 64];
+volatile u64 idle_cores[MAX_CPUS / 64];
+volatile u64 idle_gen;
+
+/*
+ * Map each CPU to the first CPU of its core (set by user-space, the bits of
+ * the CPUs in @idle_cpus and of the cores in @idle_cores are also initially
+ * set by user-space).
+ */
+const volatile u32 cpu_to_core[MAX_CPUS];
+
+/* Number of busy CPUs of each core, indexed by the first CPU of the core */
+static u32 core_nr_busy[MAX_CPUS];
+
+/*
+ * Update the idle bitmaps when @cpu transitions to idle or busy.
+ */
+static void update_cpu_idle(u32 cpu, bool idle)
+{
+	u32 core;
+
+	if (cpu >= MAX_CPUS)
+		return;
+	core = cpu_to_core[cpu];
+	if (core >= MAX_CPUS) {
+		scx_bpf_error("Invalid core for cpu %d: %d", cpu, core);
+		return;
+	}
+
+	if (idle) {
+		__sync_fetch_and_or(&idle_cpus[cpu / 64], 1LLU << (cpu % 64));
+		if (__sync_fetch_and_sub(&core_nr_busy[core], 1) == 1)
+			__sync_fetch_and_or(&idle_cores[core / 64],
+					    1LLU << (core % 64));
+	} else {
+		__sync_fetch_and_and(&idle_cpus[cpu / 64], ~(1LLU << (cpu % 64)));
+		if (__sync_fetch_and_add(&core_nr_busy[core], 1) == 0)
+			__sync_fetch_and_and(&idle_cores[core / 64],
+					     ~(1LLU << (core % 64)));
+	}
+	__sync_fetch_and_add(&idle_gen, 1);
+}
+
 /*
  * Assign a task to a CPU (used in .running() and .stopping()).
  *
@@ -240,11 +368,17 @@ volatile u32 cpu_map[MAX_CPUS];
  */
 static void set_cpu_owner(u32 cpu, u32 pid)
 {
+	u32 prev_pid;
+
 	if (cpu >= MAX_CPUS) {
 		scx_bpf_error("Invalid cpu: %d", cpu);
 		return;
 	}
+	prev_pid = cpu_map[cpu];
 	cpu_map[cpu] = pid;
+
+	if (!prev_pid != !pid)
+		update_cpu_idle(cpu, !pid);
 }
 
 /*
@@ -269,6 +403,44 @@ static inline bool is_usersched_task(const struct task_struct *p)
 	return p->pid == usersched_pid;
 }
 
+/*
+ * Return true if the target task @p is a worker of the user-space scheduler
+ * draining a @queued ring buffer.
+ *
+ * Only the registered workers are considered: the other threads of the
+ * user-space scheduler (e.g., statistics) are scheduled like any other task.
+ */
+static inline bool is_usersched_worker(const struct task_struct *p)
+{
+	u32 i;
+
+	if (p->tgid != usersched_pid || p->pid == usersched_pid)
+		return false;
+
+	bpf_for(i, 0, MAX_QUEUED_SHARDS)
+		if (worker_pids[i] == p->pid)
+			return true;
+
+	return false;
+}
+
+/*
+ * Return the ring buffer used to queue the tasks enqueued on @cpu.
+ */
+static void *queued_ringbuf(s32 cpu)
+{
+	void *ringbuf;
+	u32 shard = 0;
+
+	if (cpu >= 0 && cpu < MAX_CPUS)
+		shard = cpu_to_queued_shard[cpu];
+
+	ringbuf = bpf_map_lookup_elem(&queued_shards, &shard);
+	if (!ringbuf)
+		return &queued;
+	return ringbuf;
+}
+
 /*
  * Return true if the target task @p is a kernel thread.
  */
@@ -328,6 +500,117 @@ static bool usersched_has_pending_tasks(void)
 	return nr_queued || nr_scheduled;
 }
 
+/*
+ * Tasks sent to the user-space scheduler since its last wakeup and when the
+ * first of them has been sent.
+ */
+static u64 nr_unnotified, unnotified_since;
+
+/*
+ * Return true if the wakeups of the user-space scheduler are currently
+ * coalesced.
+ */
+static bool wakeup_coalescing(void)
+{
+	return wakeup_batch > 1 && nr_running * 2 >= num_possible_cpus;
+}
+
+/*
+ * Return true if the coalesced wakeups can't be delayed any further.
+ */
+static bool wakeup_due(u64 now)
+{
+	return nr_unnotified &&
+	       (nr_unnotified >= wakeup_batch ||
+		now - unnotified_since >= wakeup_delay_ns);
+}
+
+/*
+ * Request a run of the user-space scheduler and reset the coalesced wakeups.
+ * The caller is responsible for signaling the ring buffers.
+ */
+static void __wakeup_usersched(void)
+{
+	nr_unnotified = 0;
+	unnotified_since = 0;
+	set_usersched_needed();
+	__sync_fetch_and_add(&nr_usersched_wakeups, 1);
+}
+
+/*
+ * Wake up the consumers of the ring buffers holding tasks submitted with
+ * BPF_RB_NO_WAKEUP. A consumer sleeping in poll() is only woken up by a
+ * submission, so submit a zero-length record, which is skipped by user space,
+ * with BPF_RB_FORCE_WAKEUP.
+ */
+static void signal_queued_rings(void)
+{
+	u64 empty = 0;
+	u32 shard;
+
+	bpf_for(shard, 0, MAX_QUEUED_SHARDS) {
+		void *ringbuf = bpf_map_lookup_elem(&queued_shards, &shard);
+
+		if (ringbuf && bpf_ringbuf_query(ringbuf, BPF_RB_AVAIL_DATA))
+			bpf_ringbuf_output(ringbuf, &empty, 0,
+					   BPF_RB_FORCE_WAKEUP);
+	}
+}
+
+/*
+ * Wake up the user-space scheduler.
+ */
+static void wakeup_usersched(void)
+{
+	bool coalesced = nr_unnotified;
+
+	__wakeup_usersched();
+	if (coalesced)
+		signal_queued_rings();
+}
+
+/*
+ * Account a task sent to the user-space scheduler and return the wakeup flags
+ * to submit it to the ring buffer with.
+ */
+static u64 usersched_notify(void)
+{
+	u64 now;
+
+	if (!wakeup_coalescing())
+		return 0;
+	now = bpf_ktime_get_ns();
+
+	if (!__sync_fetch_and_add(&nr_unnotified, 1))
+		unnotified_since = now;
+
+	/* the submission of the task itself signals its ring buffer */
+	if (wakeup_due(now)) {
+		__wakeup_usersched();
+		return BPF_RB_FORCE_WAKEUP;
+	}
+	__sync_fetch_and_add(&nr_coalesced_wakeups, 1);
+
+	return BPF_RB_NO_WAKEUP;
+}
+
+/*
+ * Record the time from when @p has been sent to the user-space scheduler until
+ * the scheduler dispatched it in LATHIST_DECISION. Only called if
+ * lathist_enabled is set.
+ */
+static void record_decision_lat(struct task_struct *p)
+{
+	struct task_ctx *tctx;
+
+	tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
+	if (tctx && tctx->queued_at) {
+		lathist_record(LATHIST_DECISION,
+			       bpf_ktime_get_ns() - tctx->queued_at);
+		tctx->queued_at = 0;
+	}
+}
+
 /*
  * Return the corresponding CPU associated to a DSQ.
  */
@@ -449,13 +732,20 @@ dispatch_task(struct task_struct *p, u64 dsq_id,
 
 /*
  * Dispatch the user-space scheduler.
+ *
+ * While busy polling, only @busy_poll_cpu runs the scheduler and it does so
+ * regardless of whether a wakeup has been requested.
  */
-static void dispatch_user_scheduler(void)
+static void dispatch_user_scheduler(s32 cpu)
 {
 	struct task_struct *p;
 
-	if (!test_and_clear_usersched_needed())
+	if (usersched_busy_poll) {
+		if (cpu != busy_poll_cpu)
+			return;
+	} else if (!test_and_clear_usersched_needed()) {
 		return;
+	}
 
 	p = bpf_task_from_pid(usersched_pid);
 	if (!p) {
@@ -466,7 +756,10 @@ static void dispatch_user_scheduler(void)
 	 * Dispatch the scheduler on the first CPU available, likely the
 	 * current one.
 	 */
-	dispatch_task(p, SHARED_DSQ, 0, 0, SCX_ENQ_PREEMPT);
+	if (usersched_busy_poll && bpf_cpumask_test_cpu(cpu, p->cpus_ptr))
+		scx_bpf_dispatch(p, SCX_DSQ_LOCAL, slice_ns, 0);
+	else
+		dispatch_task(p, SHARED_DSQ, 0, 0, SCX_ENQ_PREEMPT);
 	bpf_task_release(p);
 }
 
@@ -574,6 +867,7 @@ static void get_task_info(struct queued_task_ctx *task,
 	task->sum_exec_runtime = p->se.sum_exec_runtime;
 	task->nvcsw = p->nvcsw;
 	task->weight = p->scx.weight;
+	task->nr_cpus_allowed = p->nr_cpus_allowed;
 	task->cpu = scx_bpf_task_cpu(p);
 }
 
@@ -594,13 +888,27 @@ static void sched_congested(struct task_struct *p)
 void BPF_STRUCT_OPS(rustland_enqueue, struct task_struct *p, u64 enq_flags)
 {
 	struct queued_task_ctx *task;
+	struct task_ctx *tctx;
 
 	/*
 	 * Scheduler is dispatched directly in .dispatch() when needed, so
-	 * we can skip it here.
+	 * we can skip it here, unless it's busy polling on its dedicated CPU.
 	 */
-	if (is_usersched_task(p))
+	if (is_usersched_task(p)) {
+		if (usersched_busy_poll && scx_bpf_task_cpu(p) == busy_poll_cpu)
+			scx_bpf_dispatch(p, SCX_DSQ_LOCAL, slice_ns, enq_flags);
 		return;
+	}
+
+	/*
+	 * The workers of the user-space scheduler must never depend on the
+	 * user-space scheduler itself to run, so dispatch them directly on
+	 * their CPU (workers are pinned to the CPUs whose tasks they receive).
+	 */
+	if (is_usersched_worker(p)) {
+		dispatch_direct_cpu(p, scx_bpf_task_cpu(p), slice_ns, enq_flags);
+		return;
+	}
 
 	/*
 	 * Always dispatch per-CPU kthreads on the same CPU, bypassing the
@@ -633,7 +941,8 @@ void BPF_STRUCT_OPS(rustland_enqueue, struct task_struct *p, u64 enq_flags)
 	 * will be dispatched directly from the kernel (using the first CPU
 	 * available in this case).
 	 */
-	task = bpf_ringbuf_reserve(&queued, sizeof(*task), 0);
+	task = bpf_ringbuf_reserve(queued_ringbuf(scx_bpf_task_cpu(p)),
+				   sizeof(*task), 0);
 	if (!task) {
 		sched_congested(p);
 		dispatch_task(p, SHARED_DSQ, 0, 0, enq_flags);
@@ -642,7 +951,10 @@ void BPF_STRUCT_OPS(rustland_enqueue, struct task_struct *p, u64 enq_flags)
 	}
 	get_task_info(task, p, false);
 	dbg_msg("enqueue: pid=%d (%s)", p->pid, p->comm);
-	bpf_ringbuf_submit(task, 0);
+
+	if (lathist_enabled && (tctx = lookup_task_ctx(p)))
+		tctx->queued_at = bpf_ktime_get_ns();
+	bpf_ringbuf_submit(task, usersched_notify());
 
 	__sync_fetch_and_add(&nr_queued, 1);
 }
@@ -651,21 +963,18 @@ void BPF_STRUCT_OPS(rustland_enqueue, struct task_struct *p, u64 enq_flags)
  * Handle a task dispatched from user-space, performing the actual low-level
  * BPF dispatch.
  */
-static long handle_dispatched_task(struct bpf_dynptr *dynptr, void *context)
+static void dispatch_user_task(const struct dispatched_task_ctx *task)
 {
-	const struct dispatched_task_ctx *task;
 	struct task_struct *p;
 	u64 enq_flags = 0;
 
-	/* Get a pointer to the dispatched task */
-	task = bpf_dynptr_data(dynptr, 0, sizeof(*task));
-	if (!task)
-		return 0;
-
 	/* Ignore entry if the task doesn't exist anymore */
 	p = bpf_task_from_pid(task->pid);
 	if (!p)
-		return 0;
+		return;
+
+	if (lathist_enabled)
+		record_decision_lat(p);
 
 	dbg_msg("usersched: pid=%d cpu=%d cpumask_cnt=%llu slice_ns=%llu flags=%llx",
 		task->pid, task->cpu, task->cpumask_cnt, task->slice_ns, task->flags);
@@ -690,8 +999,32 @@ static long handle_dispatched_task(struct bpf_dynptr *dynptr, void *context)
 			      task->cpumask_cnt, task->slice_ns, enq_flags);
 	bpf_task_release(p);
 	__sync_fetch_and_add(&nr_user_dispatches, 1);
+}
+
+/*
+ * Handle a sample of the @dispatched user ring buffer.
+ *
+ * Each sample contains a batch of up to MAX_DISPATCH_BATCH tasks, so that the
+ * user-space scheduler can submit multiple tasks reserving a single slot of
+ * the ring buffer.
+ */
+static long handle_dispatched_task(struct bpf_dynptr *dynptr, void *context)
+{
+	struct dispatched_task_ctx task;
+	u32 i;
+
+	bpf_for(i, 0, MAX_DISPATCH_BATCH) {
+		if (bpf_dynptr_read(&task, sizeof(task), dynptr,
+				    i * sizeof(task), 0))
+			break;
+		dispatch_user_task(&task);
+	}
 
-	return !scx_bpf_dispatch_nr_slots();
+	/*
+	 * Stop draining if the next batch may not fit in the remaining
+	 * dispatch slots.
+	 */
+	return scx_bpf_dispatch_nr_slots() < MAX_DISPATCH_BATCH;
 }
 
 /*
@@ -710,7 +1043,7 @@ void BPF_STRUCT_OPS(rustland_dispatch, s32 cpu, struct task_struct *prev)
 	 * Check if the user-space scheduler needs to run, and in that case try
 	 * to dispatch it immediately.
 	 */
-	dispatch_user_scheduler();
+	dispatch_user_scheduler(cpu);
 
 	/*
 	 * Consume all tasks from the @dispatched list and immediately try to
@@ -748,6 +1081,12 @@ void BPF_STRUCT_OPS(rustland_running, struct task_struct *p)
 	if (!is_usersched_task(p)) {
 		set_cpu_owner(cpu, p->pid);
 		__sync_fetch_and_add(&nr_running, 1);
+	} else if (usersched_busy_poll && cpu == busy_poll_cpu) {
+		/*
+		 * Keep the user-space scheduler from dispatching tasks to the
+		 * CPU it's busy polling on.
+		 */
+		set_cpu_owner(cpu, p->pid);
 	}
 }
 
@@ -769,8 +1108,15 @@ void BPF_STRUCT_OPS(rustland_stopping, struct task_struct *p, bool runnable)
 		 * Kick the user-space scheduler immediately when a task
 		 * releases a CPU and speculate on the fact that most of the
 		 * time there is another task ready to run.
+		 *
+		 * If wakeups are coalesced, kick it only if it has tasks
+		 * waiting for a CPU or if the coalesced wakeups are due.
 		 */
-		set_usersched_needed();
+		if (!wakeup_coalescing() || nr_scheduled ||
+		    wakeup_due(bpf_ktime_get_ns()))
+			wakeup_usersched();
+	} else if (get_cpu_owner(cpu) == p->pid) {
+		set_cpu_owner(cpu, 0);
 	}
 }
 
@@ -790,7 +1136,7 @@ void BPF_STRUCT_OPS(rustland_update_idle, s32 cpu, bool idle)
 	 * can be dispatched.
 	 */
 	if (usersched_has_pending_tasks()) {
-		set_usersched_needed();
+		wakeup_usersched();
 		/*
 		 * Wake up the idle CPU and trigger a resched, so that it can
 		 * immediately accept dispatched tasks.
@@ -860,7 +1206,8 @@ void BPF_STRUCT_OPS(rustland_exit_task, struct task_struct *p,
 	struct queued_task_ctx *task;
 
 	dbg_msg("exit: pid=%d (%s)", p->pid, p->comm);
-	task = bpf_ringbuf_reserve(&queued, sizeof(*task), 0);
+	task = bpf_ringbuf_reserve(queued_ringbuf(scx_bpf_task_cpu(p)),
+				   sizeof(*task), 0);
 	if (!task) {
 		/*
 		 * We may have a memory leak in the scheduler at this point,
@@ -919,6 +1266,46 @@ static bool should_enable_fifo(void)
 	return nr_waiting_avg == 0;
 }
 
+/*
+ * Return true if @busy_poll_cpu is online. While busy polling, the user-space
+ * scheduler is only dispatched on @busy_poll_cpu, so an offline CPU would
+ * stall it: without a way to check, don't busy poll at all.
+ */
+static bool busy_poll_cpu_online(void)
+{
+	const struct cpumask *online;
+	bool ret;
+
+	if (!bpf_ksym_exists(scx_bpf_get_online_cpumask) ||
+	    !bpf_ksym_exists(scx_bpf_put_cpumask))
+		return false;
+
+	online = scx_bpf_get_online_cpumask();
+	ret = bpf_cpumask_test_cpu(busy_poll_cpu, online);
+	scx_bpf_put_cpumask(online);
+
+	return ret;
+}
+
+/*
+ * Check whether the user-space scheduler should busy poll on its dedicated
+ * CPU.
+ */
+static bool should_busy_poll(void)
+{
+	if (busy_poll_cpu < 0 || !busy_poll_cpu_online())
+		return false;
+
+	/*
+	 * Start busy polling when almost all the CPUs are busy and stop when
+	 * less than half of them are busy.
+	 */
+	if (usersched_busy_poll)
+		return nr_running * 2 >= num_possible_cpus;
+
+	return nr_running >= num_possible_cpus - 1;
+}
+
 /*
  * Heartbeat scheduler timer callback.
  *
@@ -933,11 +1320,14 @@ static int usersched_timer_fn(void *map, int *key, struct bpf_timer *timer)
 	int err = 0;
 
 	/* Kick the scheduler */
-	set_usersched_needed();
+	wakeup_usersched();
 
 	/* Update flag that determines if FIFO scheduling needs to be enabled */
 	is_fifo_enabled = should_enable_fifo();
 
+	/* Update flag that determines if the scheduler needs to busy poll */
+	usersched_busy_poll = should_busy_poll();
+
 	/* Re-arm the timer */
 	err = bpf_timer_start(timer, USERSCHED_TIMER_NS, 0);
 	if (err)
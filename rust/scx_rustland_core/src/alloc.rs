@@ -4,9 +4,12 @@
 // GNU General Public License version 2.
 
 use std::alloc::{GlobalAlloc, Layout};
+use std::cell::UnsafeCell;
 use std::fs::File;
+use std::hint::spin_loop;
 use std::io::{BufRead, BufReader, Write};
 use std::num::ParseIntError;
+use std::sync::atomic::{AtomicBool, Ordering};
 
 use buddy_alloc::{BuddyAllocParam, FastAllocParam, NonThreadsafeAlloc};
 
@@ -15,6 +18,13 @@ const FAST_HEAP_SIZE: usize = 1024 * 1024; // 1M
 const HEAP_SIZE: usize = 64 * 1024 * 1024; // 64M
 const LEAF_SIZE: usize = 64;
 
+// Per-thread magazine parameters: small blocks (from 64 up to 512 bytes) are cached in each
+// thread and moved from/to the shared arena in batches of MAGAZINE_BATCH blocks.
+const MAGAZINE_MIN_SHIFT: usize = 6;
+const MAGAZINE_NR_CLASSES: usize = 4;
+const MAGAZINE_SIZE: usize = 32;
+const MAGAZINE_BATCH: usize = MAGAZINE_SIZE / 2;
+
 #[repr(align(4096))]
 struct AlignedHeap<const N: usize>([u8; N]);
 
@@ -31,21 +41,182 @@ static mut HEAP: AlignedHeap<HEAP_SIZE> = AlignedHeap([0u8; HEAP_SIZE]);
 // designed to operate on a pre-allocated buffer. This, coupled with the memory locking achieved
 // through mlockall(), prevents page faults from occurring during the execution of the user-space
 // scheduler.
+//
+// The allocator can be used by multiple threads: the arena is protected by a spinlock (a sleeping
+// lock could make a thread of the scheduler wait on a task that needs to be scheduled by the
+// scheduler itself) and the contention on the lock is reduced by per-thread magazines, that cache
+// the most common small blocks and exchange them with the arena in batches.
 #[cfg_attr(not(test), global_allocator)]
 pub static ALLOCATOR: UserAllocator = unsafe {
     let fast_param = FastAllocParam::new(FAST_HEAP.0.as_ptr(), FAST_HEAP_SIZE);
     let buddy_param = BuddyAllocParam::new(HEAP.0.as_ptr(), HEAP_SIZE, LEAF_SIZE);
     UserAllocator {
         arena: NonThreadsafeAlloc::new(fast_param, buddy_param),
+        lock: AtomicBool::new(false),
     }
 };
 
+// Per-thread cache of free blocks, grouped by size class.
+struct Magazine {
+    blocks: [[*mut u8; MAGAZINE_SIZE]; MAGAZINE_NR_CLASSES],
+    len: [usize; MAGAZINE_NR_CLASSES],
+}
+
+impl Magazine {
+    const fn new() -> Self {
+        Magazine {
+            blocks: [[std::ptr::null_mut(); MAGAZINE_SIZE]; MAGAZINE_NR_CLASSES],
+            len: [0; MAGAZINE_NR_CLASSES],
+        }
+    }
+
+    fn pop(&mut self, class: usize) -> Option<*mut u8> {
+        if self.len[class] == 0 {
+            return None;
+        }
+        self.len[class] -= 1;
+        Some(self.blocks[class][self.len[class]])
+    }
+
+    fn push(&mut self, class: usize, ptr: *mut u8) -> bool {
+        if self.len[class] == MAGAZINE_SIZE {
+            return false;
+        }
+        self.blocks[class][self.len[class]] = ptr;
+        self.len[class] += 1;
+        true
+    }
+}
+
+// NOTE: the magazine must be const-initialized and must not implement Drop, so that accessing it
+// never requires to allocate memory (that would recursively call the allocator). Blocks cached
+// by a thread are returned to the arena only via UserAllocator::flush_thread_cache().
+thread_local! {
+    static MAGAZINE: UnsafeCell<Magazine> = const { UnsafeCell::new(Magazine::new()) };
+}
+
+// Return the magazine size class of a memory layout, or None if the layout must be always served
+// directly by the arena.
+fn size_class(layout: &Layout) -> Option<usize> {
+    if layout.align() > 1 << MAGAZINE_MIN_SHIFT {
+        return None;
+    }
+    let shift = layout.size().max(1).next_power_of_two().trailing_zeros() as usize;
+    let class = shift.max(MAGAZINE_MIN_SHIFT) - MAGAZINE_MIN_SHIFT;
+    if class < MAGAZINE_NR_CLASSES {
+        Some(class)
+    } else {
+        None
+    }
+}
+
+// Return the memory layout used to allocate the blocks of a certain size class from the arena.
+fn class_layout(class: usize) -> Layout {
+    unsafe {
+        Layout::from_size_align_unchecked(
+            1 << (class + MAGAZINE_MIN_SHIFT),
+            1 << MAGAZINE_MIN_SHIFT,
+        )
+    }
+}
+
 // Main allocator class.
 pub struct UserAllocator {
     arena: NonThreadsafeAlloc,
+    lock: AtomicBool,
 }
 
 impl UserAllocator {
+    fn lock(&self) {
+        while self
+            .lock
+            .compare_exchange_weak(false, true, Ordering::Acquire, Ordering::Relaxed)
+            .is_err()
+        {
+            while self.lock.load(Ordering::Relaxed) {
+                spin_loop();
+            }
+        }
+    }
+
+    fn unlock(&self) {
+        self.lock.store(false, Ordering::Release);
+    }
+
+    // Return all the blocks cached by the current thread to the shared arena.
+    //
+    // This should be called by any thread that allocated memory before exiting, otherwise the
+    // blocks cached in its magazine are leaked.
+    pub fn flush_thread_cache(&self) {
+        let _ = MAGAZINE.try_with(|mag| {
+            let mag = unsafe { &mut *mag.get() };
+            self.lock();
+            for class in 0..MAGAZINE_NR_CLASSES {
+                while let Some(ptr) = mag.pop(class) {
+                    unsafe { self.arena.dealloc(ptr, class_layout(class)) };
+                }
+            }
+            self.unlock();
+        });
+    }
+
+    // Allocate a block of a certain size class, refilling the magazine of the current thread from
+    // the arena if it is empty.
+    unsafe fn alloc_class(&self, class: usize) -> *mut u8 {
+        let layout = class_layout(class);
+        let res = MAGAZINE.try_with(|mag| {
+            let mag = &mut *mag.get();
+            if let Some(ptr) = mag.pop(class) {
+                return ptr;
+            }
+            self.lock();
+            for _ in 0..MAGAZINE_BATCH {
+                let ptr = self.arena.alloc(layout);
+                if ptr.is_null() {
+                    break;
+                }
+                mag.push(class, ptr);
+            }
+            let ptr = self.arena.alloc(layout);
+            self.unlock();
+            ptr
+        });
+        match res {
+            Ok(ptr) => ptr,
+            Err(_) => {
+                self.lock();
+                let ptr = self.arena.alloc(layout);
+                self.unlock();
+                ptr
+            }
+        }
+    }
+
+    // Release a block of a certain size class to the magazine of the current thread, moving a
+    // batch of blocks back to the arena if the magazine is full.
+    unsafe fn dealloc_class(&self, ptr: *mut u8, class: usize) {
+        let layout = class_layout(class);
+        let res = MAGAZINE.try_with(|mag| {
+            let mag = &mut *mag.get();
+            if mag.push(class, ptr) {
+                return;
+            }
+            self.lock();
+            for _ in 0..MAGAZINE_BATCH {
+                if let Some(ptr) = mag.pop(class) {
+                    self.arena.dealloc(ptr, layout);
+                }
+            }
+            self.unlock();
+            mag.push(class, ptr);
+        });
+        if res.is_err() {
+            self.lock();
+            self.arena.dealloc(ptr, layout);
+            self.unlock();
+        }
+    }
+
     pub fn lock_memory(&self) {
         unsafe {
             match VM.save() {
@@ -84,11 +255,22 @@ impl UserAllocator {
 // Override global allocator methods.
 unsafe impl GlobalAlloc for UserAllocator {
     unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
-        self.arena.alloc(layout)
+        if let Some(class) = size_class(&layout) {
+            return self.alloc_class(class);
+        }
+        self.lock();
+        let ptr = self.arena.alloc(layout);
+        self.unlock();
+        ptr
     }
 
     unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        if let Some(class) = size_class(&layout) {
+            return self.dealloc_class(ptr, class);
+        }
+        self.lock();
         self.arena.dealloc(ptr, layout);
+        self.unlock();
     }
 }
 
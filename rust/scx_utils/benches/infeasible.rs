@@ -0,0 +1,54 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+//! Benchmark recording domain loads into a LoadAggregator and calculating the
+//! LoadLedger, as scx_rusty does on every load balancing pass.
+//!
+//! ```text
+//! cargo bench -p scx_utils --bench infeasible
+//! ```
+
+use criterion::black_box;
+use criterion::criterion_group;
+use criterion::criterion_main;
+use criterion::BenchmarkId;
+use criterion::Criterion;
+use scx_utils::LoadAggregator;
+
+const NR_BUCKETS: usize = 100;
+
+fn record_and_calculate(nr_doms: usize, infeasible: bool) {
+    let mut aggregator = LoadAggregator::new(256, false);
+    for dom in 0..nr_doms {
+        for bucket in 0..NR_BUCKETS {
+            let weight = 1 + bucket * 100;
+            aggregator.record_dom_load(dom, weight, 0.01 * (bucket + 1) as f64);
+        }
+    }
+    if infeasible {
+        aggregator.record_dom_load(nr_doms, 100000, 1.0);
+    }
+    black_box(aggregator.calculate());
+}
+
+fn bench_calculate(c: &mut Criterion) {
+    let mut group = c.benchmark_group("calculate");
+    for nr_doms in [4, 16, 64] {
+        group.bench_with_input(
+            BenchmarkId::new("feasible", nr_doms),
+            &nr_doms,
+            |b, &nr_doms| b.iter(|| record_and_calculate(nr_doms, false)),
+        );
+        group.bench_with_input(
+            BenchmarkId::new("infeasible", nr_doms),
+            &nr_doms,
+            |b, &nr_doms| b.iter(|| record_and_calculate(nr_doms, true)),
+        );
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_calculate);
+criterion_main!(benches);
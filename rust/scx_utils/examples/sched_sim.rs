@@ -0,0 +1,74 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+//! Replay a scheduling trace against the built-in simulator policies.
+//!
+//! ```text
+//! cargo run --example sched_sim -- TRACE [NR_CPUS] [SLICE_US]
+//! ```
+//!
+//! TRACE is a file written by `scx_utils::sched_trace::TraceWriter`, e.g.
+//! with `scx_rusty --trace-file`. NR_CPUS defaults to the number of CPUs seen
+//! in the trace and SLICE_US to 20000.
+//!
+//! Only the FIFO and vtime baselines of `scx_utils::sched_sim` are replayed,
+//! they don't model the policy of the scheduler which captured the trace. To
+//! evaluate another policy, implement `SimPolicy` and add it to `policies`.
+
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+use scx_utils::sched_sim::nr_cpus_in_trace;
+use scx_utils::sched_sim::simulate;
+use scx_utils::sched_sim::tasks_from_trace;
+use scx_utils::sched_sim::FifoPolicy;
+use scx_utils::sched_sim::SimPolicy;
+use scx_utils::sched_sim::VtimePolicy;
+use scx_utils::sched_trace::read_trace;
+use std::path::Path;
+
+fn parse_arg(args: &[String], idx: usize, name: &str) -> Result<Option<u64>> {
+    match args.get(idx) {
+        Some(val) => Ok(Some(
+            val.parse::<u64>()
+                .with_context(|| format!("Invalid {} {:?}", name, val))?,
+        )),
+        None => Ok(None),
+    }
+}
+
+fn main() -> Result<()> {
+    let args: Vec<String> = std::env::args().collect();
+    if args.len() < 2 || args.len() > 4 {
+        bail!("Usage: {} TRACE [NR_CPUS] [SLICE_US]", args[0]);
+    }
+
+    let events = read_trace(Path::new(&args[1]))?;
+    let specs = tasks_from_trace(&events);
+    let nr_cpus = match parse_arg(&args, 2, "NR_CPUS")? {
+        Some(nr) => nr as usize,
+        None => nr_cpus_in_trace(&events),
+    };
+    let slice_ns = parse_arg(&args, 3, "SLICE_US")?.unwrap_or(20_000) * 1000;
+
+    println!(
+        "trace: events={} tasks={} nr_cpus={} slice={}us",
+        events.len(),
+        specs.len(),
+        nr_cpus,
+        slice_ns / 1000
+    );
+
+    let policies: Vec<(&str, Box<dyn SimPolicy>)> = vec![
+        ("fifo", Box::new(FifoPolicy::new(slice_ns))),
+        ("vtime", Box::new(VtimePolicy::new(slice_ns))),
+    ];
+    for (name, mut policy) in policies {
+        let report = simulate(&specs, nr_cpus, policy.as_mut());
+        println!("\n[{}]\n{}", name, report);
+    }
+
+    Ok(())
+}
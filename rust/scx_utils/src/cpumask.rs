@@ -10,8 +10,10 @@
 //! Cpumask
 //! -------
 //!
-//! A Cpumask object is simply a BitVec of u64's, along with a series of helper
-//! functions for creating, manipulating, and reading these BitVec objects.
+//! A Cpumask object is a fixed-width array of u64 words, along with a series
+//! of helper functions for creating, manipulating, and reading it. The width
+//! is fixed at creation time (by default, the number of possible CPUs on the
+//! host), and all bits beyond it are always kept clear.
 //!
 //! Empty Cpumasks can be created directly, or they can be created from a
 //! hexadecimal string:
@@ -38,6 +40,23 @@
 //!     info!("{}", mask); // 32:<11111111111111111111111111111111>
 //!     assert!(mask.test_cpu(0));
 //!```
+//!
+//! Binary operations work a word at a time and have in-place variants which
+//! don't allocate, which makes them cheap enough to use on hot paths such as
+//! periodic cpumask refreshes on machines with hundreds of CPUs:
+//!
+//!```
+//!     let mut avail = Cpumask::new()?;
+//!     avail.setall();
+//!     avail.andnot_assign(&busy);     // avail &= !busy
+//!     avail &= &allowed;
+//!     if let Some(cpu) = avail.first_cpu() {
+//!         info!("first available cpu {}", cpu);
+//!     }
+//!     for cpu in avail.iter() {
+//!         info!("cpu {} is available", cpu);
+//!     }
+//!```
 
 use anyhow::bail;
 use anyhow::Context;
@@ -51,9 +70,11 @@ use std::ops::BitOrAssign;
 use std::ops::BitXor;
 use std::ops::BitXorAssign;
 
-#[derive(Debug, Clone)]
+const BITS_PER_WORD: usize = u64::BITS as usize;
+
+#[derive(Debug, Clone, PartialEq, Eq)]
 pub struct Cpumask {
-    mask: BitVec<u64, Lsb0>,
+    mask: Vec<u64>,
     nr_cpus: usize,
 }
 
@@ -70,14 +91,29 @@ impl Cpumask {
         Ok(())
     }
 
+    fn nr_words(nr_cpus: usize) -> usize {
+        ((nr_cpus + BITS_PER_WORD - 1) / BITS_PER_WORD).max(1)
+    }
+
+    /// Mask of the valid bits in the last word of the Cpumask.
+    fn tail_mask(&self) -> u64 {
+        match self.nr_cpus % BITS_PER_WORD {
+            0 => u64::MAX,
+            rem => (1u64 << rem) - 1,
+        }
+    }
+
     /// Build a new empty Cpumask object.
     pub fn new() -> Result<Cpumask> {
-        let nr_cpus = Cpumask::get_cpus_possible();
+        Ok(Cpumask::new_with_size(Cpumask::get_cpus_possible()))
+    }
 
-        Ok(Cpumask {
-            mask: bitvec![u64, Lsb0; 0; nr_cpus],
+    /// Build a new empty Cpumask object which can hold @nr_cpus bits.
+    pub fn new_with_size(nr_cpus: usize) -> Cpumask {
+        Cpumask {
+            mask: vec![0; Cpumask::nr_words(nr_cpus)],
             nr_cpus,
-        })
+        }
     }
 
     /// Build a Cpumask object from a hexadecimal string.
@@ -97,14 +133,14 @@ impl Cpumask {
         let byte_vec = hex::decode(&hex_str)
             .with_context(|| format!("Failed to parse cpumask: {}", cpumask))?;
 
-        let mut mask = bitvec![u64, Lsb0; 0; nr_cpus];
+        let mut mask = Cpumask::new_with_size(nr_cpus);
         for (index, &val) in byte_vec.iter().rev().enumerate() {
             let mut v = val;
             while v != 0 {
                 let lsb = v.trailing_zeros() as usize;
                 v &= !(1 << lsb);
                 let cpu = index * 8 + lsb;
-                if cpu > nr_cpus {
+                if cpu >= nr_cpus {
                     bail!(
                         concat!(
                             "Found cpu ({}) in cpumask ({}) which is larger",
@@ -115,46 +151,63 @@ impl Cpumask {
                         nr_cpus
                     );
                 }
-                mask.set(cpu, true);
+                mask.mask[cpu / BITS_PER_WORD] |= 1 << (cpu % BITS_PER_WORD);
             }
         }
 
-        Ok(Self {
-            mask,
-            nr_cpus,
-        })
+        Ok(mask)
     }
 
     /// Return a slice of u64's whose bits reflect the Cpumask.
     pub fn as_raw_slice(&self) -> &[u64] {
-        self.mask.as_raw_slice()
+        &self.mask
     }
 
-    /// Return the mutable raw BitVec object backing the Cpumask.
-    pub fn as_raw_bitvec_mut(&mut self) -> &mut BitVec<u64, Lsb0> {
-        &mut self.mask
+    /// Return the raw bits of the Cpumask.
+    #[deprecated(
+        note = "Cpumask is no longer backed by a BitVec, use as_raw_slice() or the Cpumask methods"
+    )]
+    pub fn as_raw_bitvec(&self) -> &BitSlice<u64, Lsb0> {
+        &self.mask.view_bits::<Lsb0>()[..self.nr_cpus]
     }
 
-    /// Return the raw BitVec object backing the Cpumask.
-    pub fn as_raw_bitvec(&self) -> &BitVec<u64, Lsb0> {
-        &self.mask
+    /// Return the mutable raw bits of the Cpumask.
+    #[deprecated(note = "Cpumask is no longer backed by a BitVec, use the Cpumask methods")]
+    pub fn as_raw_bitvec_mut(&mut self) -> &mut BitSlice<u64, Lsb0> {
+        let nr_cpus = self.nr_cpus;
+        &mut self.mask.view_bits_mut::<Lsb0>()[..nr_cpus]
+    }
+
+    /// Copy the Cpumask into a byte array laid out like a kernel / BPF
+    /// cpumask (e.g. `unsigned char cpus[MAX_CPUS_U8]`), CPU N being bit
+    /// (N % 8) of byte (N / 8). Bytes past the width of the Cpumask or past
+    /// the end of @dst are left untouched.
+    pub fn write_to_u8_slice(&self, dst: &mut [u8]) {
+        let nr_bytes = ((self.nr_cpus + 7) / 8).min(dst.len());
+        for (chunk, word) in dst[..nr_bytes].chunks_mut(8).zip(self.mask.iter()) {
+            chunk.copy_from_slice(&word.to_le_bytes()[..chunk.len()]);
+        }
     }
 
     /// Set all bits in the Cpumask to 1
     pub fn setall(&mut self) {
-        self.mask.fill(true);
+        self.mask.fill(u64::MAX);
+        let tail = self.tail_mask();
+        if let Some(last) = self.mask.last_mut() {
+            *last &= tail;
+        }
     }
 
     /// Set all bits in the Cpumask to 0
     pub fn clear(&mut self) {
-        self.mask.fill(false);
+        self.mask.fill(0);
     }
 
     /// Set a bit in the Cpumask. Returns an error if the specified CPU exceeds
     /// the size of the Cpumask.
     pub fn set_cpu(&mut self, cpu: usize) -> Result<()> {
         self.check_cpu(cpu)?;
-        self.mask.set(cpu, true);
+        self.mask[cpu / BITS_PER_WORD] |= 1 << (cpu % BITS_PER_WORD);
         Ok(())
     }
 
@@ -162,26 +215,27 @@ impl Cpumask {
     /// exceeds the size of the Cpumask.
     pub fn clear_cpu(&mut self, cpu: usize) -> Result<()> {
         self.check_cpu(cpu)?;
-        self.mask.set(cpu, false);
+        self.mask[cpu / BITS_PER_WORD] &= !(1 << (cpu % BITS_PER_WORD));
         Ok(())
     }
 
     /// Test whether the specified CPU bit is set in the Cpumask. If the CPU
     /// exceeds the number of possible CPUs on the host, false is returned.
     pub fn test_cpu(&self, cpu: usize) -> bool {
-        match self.mask.get(cpu) {
-            Some(bit) => {
-                *bit
-            }
-            None => {
-                false
-            }
+        if cpu >= self.nr_cpus {
+            return false;
         }
+        self.mask[cpu / BITS_PER_WORD] & (1 << (cpu % BITS_PER_WORD)) != 0
     }
 
     /// Count the number of bits set in the Cpumask.
     pub fn weight(&self) -> usize {
-        self.mask.count_ones()
+        self.mask.iter().map(|w| w.count_ones() as usize).sum()
+    }
+
+    /// Test whether no bit is set in the Cpumask.
+    pub fn is_empty(&self) -> bool {
+        self.mask.iter().all(|w| *w == 0)
     }
 
     /// The total size of the cpumask.
@@ -189,24 +243,114 @@ impl Cpumask {
         self.nr_cpus
     }
 
+    /// Return the first CPU set in the Cpumask at or after @cpu, if any.
+    pub fn next_cpu(&self, cpu: usize) -> Option<usize> {
+        if cpu >= self.nr_cpus {
+            return None;
+        }
+        let mut idx = cpu / BITS_PER_WORD;
+        let mut word = self.mask[idx] & (u64::MAX << (cpu % BITS_PER_WORD));
+        loop {
+            if word != 0 {
+                return Some(idx * BITS_PER_WORD + word.trailing_zeros() as usize);
+            }
+            idx += 1;
+            if idx >= self.mask.len() {
+                return None;
+            }
+            word = self.mask[idx];
+        }
+    }
+
+    /// Return the lowest CPU set in the Cpumask, if any.
+    pub fn first_cpu(&self) -> Option<usize> {
+        self.next_cpu(0)
+    }
+
+    /// Return the highest CPU set in the Cpumask, if any.
+    pub fn last_cpu(&self) -> Option<usize> {
+        self.mask.iter().enumerate().rev().find_map(|(idx, word)| match word {
+            0 => None,
+            w => Some(idx * BITS_PER_WORD + (BITS_PER_WORD - 1 - w.leading_zeros() as usize)),
+        })
+    }
+
+    /// Iterate over the CPUs set in the Cpumask in ascending order.
+    pub fn iter(&self) -> CpumaskIterator<'_> {
+        CpumaskIterator {
+            mask: &self.mask,
+            idx: 0,
+            word: self.mask[0],
+        }
+    }
+
+    /// Test whether the Cpumask and @other have any CPU in common.
+    pub fn intersects(&self, other: &Cpumask) -> bool {
+        self.mask
+            .iter()
+            .zip(other.mask.iter())
+            .any(|(a, b)| a & b != 0)
+    }
+
+    /// Test whether every CPU set in the Cpumask is also set in @other.
+    pub fn is_subset_of(&self, other: &Cpumask) -> bool {
+        self.mask
+            .iter()
+            .zip(other.mask.iter().chain(std::iter::repeat(&0)))
+            .all(|(a, b)| a & !b == 0)
+    }
+
+    /// Overwrite the Cpumask with the contents of @other without
+    /// reallocating. Bits of @other beyond the width of the Cpumask are
+    /// dropped.
+    pub fn copy_from(&mut self, other: &Cpumask) {
+        let tail = self.tail_mask();
+        let nr = self.mask.len().min(other.mask.len());
+        self.mask[..nr].copy_from_slice(&other.mask[..nr]);
+        self.mask[nr..].fill(0);
+        if let Some(last) = self.mask.last_mut() {
+            *last &= tail;
+        }
+    }
+
+    // The in-place helpers below are plain element-wise loops over the
+    // backing words so that the compiler can vectorize them. Both operands
+    // are expected to have the same width; if they don't, only the common
+    // words are considered.
+
+    /// Clear every CPU of the Cpumask which is also set in @other, in place.
+    pub fn andnot_assign(&mut self, other: &Cpumask) {
+        for (a, b) in self.mask.iter_mut().zip(other.mask.iter()) {
+            *a &= !b;
+        }
+    }
+
     /// Create a Cpumask that is the AND of the current Cpumask and another.
     pub fn and(&self, other: &Cpumask) -> Cpumask {
         let mut new = self.clone();
-        new.mask &= other.mask.clone();
+        new &= other;
         new
     }
 
     /// Create a Cpumask that is the OR of the current Cpumask and another.
     pub fn or(&self, other: &Cpumask) -> Cpumask {
         let mut new = self.clone();
-        new.mask |= other.mask.clone();
+        new |= other;
         new
     }
 
     /// Create a Cpumask that is the XOR of the current Cpumask and another.
     pub fn xor(&self, other: &Cpumask) -> Cpumask {
         let mut new = self.clone();
-        new.mask ^= other.mask.clone();
+        new ^= other;
+        new
+    }
+
+    /// Create a Cpumask that is the current Cpumask with all the CPUs of
+    /// another cleared.
+    pub fn andnot(&self, other: &Cpumask) -> Cpumask {
+        let mut new = self.clone();
+        new.andnot_assign(other);
         new
     }
 }
@@ -233,7 +377,17 @@ impl BitAnd for Cpumask {
 
 impl BitAndAssign for Cpumask {
     fn bitand_assign(&mut self, rhs: Cpumask) {
-        self.mask &= &rhs.mask;
+        *self &= &rhs;
+    }
+}
+
+impl BitAndAssign<&Cpumask> for Cpumask {
+    fn bitand_assign(&mut self, rhs: &Cpumask) {
+        let nr = self.mask.len().min(rhs.mask.len());
+        for (a, b) in self.mask.iter_mut().zip(rhs.mask.iter()) {
+            *a &= b;
+        }
+        self.mask[nr..].fill(0);
     }
 }
 
@@ -246,7 +400,21 @@ impl BitOr for Cpumask {
 
 impl BitOrAssign for Cpumask {
     fn bitor_assign(&mut self, rhs: Cpumask) {
-        self.mask |= &rhs.mask;
+        *self |= &rhs;
+    }
+}
+
+impl BitOrAssign<&Cpumask> for Cpumask {
+    fn bitor_assign(&mut self, rhs: &Cpumask) {
+        for (a, b) in self.mask.iter_mut().zip(rhs.mask.iter()) {
+            *a |= b;
+        }
+        if rhs.nr_cpus > self.nr_cpus {
+            let tail = self.tail_mask();
+            if let Some(last) = self.mask.last_mut() {
+                *last &= tail;
+            }
+        }
     }
 }
 
@@ -259,7 +427,56 @@ impl BitXor for Cpumask {
 
 impl BitXorAssign for Cpumask {
     fn bitxor_assign(&mut self, rhs: Cpumask) {
-        self.mask ^= &rhs.mask;
+        *self ^= &rhs;
+    }
+}
+
+impl BitXorAssign<&Cpumask> for Cpumask {
+    fn bitxor_assign(&mut self, rhs: &Cpumask) {
+        for (a, b) in self.mask.iter_mut().zip(rhs.mask.iter()) {
+            *a ^= b;
+        }
+        if rhs.nr_cpus > self.nr_cpus {
+            let tail = self.tail_mask();
+            if let Some(last) = self.mask.last_mut() {
+                *last &= tail;
+            }
+        }
+    }
+}
+
+/// Iterate over the set CPUs of a borrowed Cpumask, skipping a whole word at
+/// a time when it's empty.
+pub struct CpumaskIterator<'a> {
+    mask: &'a [u64],
+    idx: usize,
+    word: u64,
+}
+
+impl<'a> Iterator for CpumaskIterator<'a> {
+    type Item = usize;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        while self.word == 0 {
+            self.idx += 1;
+            if self.idx >= self.mask.len() {
+                return None;
+            }
+            self.word = self.mask[self.idx];
+        }
+
+        let bit = self.word.trailing_zeros() as usize;
+        self.word &= self.word - 1;
+        Some(self.idx * BITS_PER_WORD + bit)
+    }
+}
+
+impl<'a> IntoIterator for &'a Cpumask {
+    type Item = usize;
+    type IntoIter = CpumaskIterator<'a>;
+
+    fn into_iter(self) -> CpumaskIterator<'a> {
+        self.iter()
     }
 }
 
@@ -292,15 +509,8 @@ impl Iterator for CpumaskIntoIterator {
     type Item = usize;
 
     fn next(&mut self) -> Option<Self::Item> {
-        while self.index < self.mask.nr_cpus {
-            let index = self.index;
-            self.index += 1;
-            let bit_val = self.mask.test_cpu(index);
-            if bit_val {
-                return Some(index);
-            }
-        }
-
-        None
+        let cpu = self.mask.next_cpu(self.index)?;
+        self.index = cpu + 1;
+        Some(cpu)
     }
 }
@@ -0,0 +1,30 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+//! # Scheduler State Handoff
+//!
+//! Schedulers which support `--handoff` save their warm state into BPF maps
+//! when they're unloaded and pin them under /sys/fs/bpf so that the next
+//! instance can adopt the state. Call [`pin_handoff_map()`] on each of these
+//! maps before loading the scheduler.
+
+use anyhow::Context;
+use anyhow::Result;
+use log::warn;
+
+/// Pin `map` at `path`, reusing the map already pinned there by the previous
+/// instance. A map of a different value size is discarded as libbpf would
+/// refuse to reuse it. Same-size layout changes have to be caught by a
+/// version field in each entry, checked by BPF when adopting the entry.
+pub fn pin_handoff_map(map: &mut libbpf_rs::OpenMap, path: &str, value_size: usize) -> Result<()> {
+    if let Ok(prev) = libbpf_rs::MapHandle::from_pinned_path(path) {
+        if prev.value_size() as usize != value_size {
+            warn!("Discarding incompatible handoff state in {}", path);
+            std::fs::remove_file(path).with_context(|| format!("Failed to remove {}", path))?;
+        }
+    }
+    map.set_pin_path(path)
+        .with_context(|| format!("Failed to set pin path {}", path))
+}
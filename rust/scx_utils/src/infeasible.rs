@@ -127,10 +127,9 @@
 //!     // Domain 64, weight 10000, has duty cycle 1.0.
 //!     aggregator.record_dom_load(64, 10000, 1.0);
 //!
-//!     // Note that it is allowed to record load for a domain more than once.
-//!     // For a given domain you may only record load for a specific weight
-//!     // once, but you may record loads for multiple different weights for a
-//!     // single domain.
+//!     // Note that it is allowed to record load for a domain more than once,
+//!     // for the same or for different weights. Duty cycles recorded for the
+//!     // same (domain, weight) pair are summed.
 //!
 //!     // Create the LoadLedger object
 //!     let ledger = aggregator.calculate();
@@ -194,10 +193,6 @@
 //!     // ...
 //! ```
 
-use anyhow::bail;
-use anyhow::Result;
-use std::collections::BTreeMap;
-
 const MIN_WEIGHT: usize = 1;
 
 #[derive(Debug)]
@@ -238,9 +233,9 @@ impl LoadLedger {
     }
 }
 
-#[derive(Debug)]
-struct Domain {
-    loads: BTreeMap<usize, f64>,
+#[derive(Clone, Debug, Default)]
+struct DomainSums {
+    present: bool,
     dcycle_sum: f64,
     load_sum: f64,
 }
@@ -253,10 +248,15 @@ fn approx_ge(a: f64, b: f64) -> bool {
     a > b || approx_eq(a, b)
 }
 
+/// Recorded loads are kept as a structure of arrays, one entry per
+/// record_dom_load() call, so that recording is a few pushes and the
+/// threshold passes in calculate() are linear scans over flat arrays.
 #[derive(Debug)]
 pub struct LoadAggregator {
-    doms: BTreeMap<usize, Domain>,
-    global_loads: BTreeMap<usize, f64>,
+    doms: Vec<DomainSums>,
+    rec_doms: Vec<usize>,
+    rec_weights: Vec<usize>,
+    rec_dcycles: Vec<f64>,
     nr_cpus: usize,
     max_weight: usize,
     global_dcycle_sum: f64,
@@ -270,8 +270,10 @@ impl LoadAggregator {
     /// the caller, and then used to create a LoadLedger object.
     pub fn new(nr_cpus: usize, dcycle_only: bool) -> LoadAggregator {
         LoadAggregator {
-            doms: BTreeMap::new(),
-            global_loads: BTreeMap::new(),
+            doms: Vec::new(),
+            rec_doms: Vec::new(),
+            rec_weights: Vec::new(),
+            rec_dcycles: Vec::new(),
             nr_cpus,
             max_weight: 0,
             global_dcycle_sum: 0.0f64,
@@ -287,11 +289,11 @@ impl LoadAggregator {
         if !self.dcycle_only && approx_ge(self.max_weight as f64, self.infeasible_threshold()) {
             self.adjust_infeas_weights();
         }
-        
+
         let mut dom_load_sums = Vec::new();
         let mut dom_dcycle_sums = Vec::new();
 
-        for (_, dom) in self.doms.iter() {
+        for dom in self.doms.iter().filter(|dom| dom.present) {
             dom_load_sums.push(dom.load_sum);
             dom_dcycle_sums.push(dom.dcycle_sum);
         }
@@ -306,46 +308,28 @@ impl LoadAggregator {
     }
 
     /// Record an instance of some domain's load (by specifying its weight and
-    /// dcycle). Returns an error if duty cycle is specified more than once
-    /// for a given (Domain, weight) tuple.
-    pub fn record_dom_load(&mut self, dom_id: usize, weight: usize, dcycle: f64) -> Result<()> {
-        if weight < MIN_WEIGHT {
-            bail!("weight {} is less than minimum weight {}", weight, MIN_WEIGHT);
-        }
-
-        if !self.doms.contains_key(&dom_id) {
-            self.doms.insert(dom_id, Domain {
-                loads: BTreeMap::new(),
-                dcycle_sum: 0.0f64,
-                load_sum: 0.0f64,
-            });
-        }
-
-        let domain = self.doms.get_mut(&dom_id).unwrap();
-        if let Some(_) = domain.loads.insert(weight, dcycle) {
-            bail!("Domain {} already had load for weight {}", dom_id, weight);
-        }
+    /// dcycle). Weights below the minimum weight of 1 are treated as 1.
+    pub fn record_dom_load(&mut self, dom_id: usize, weight: usize, dcycle: f64) {
+        let weight = weight.max(MIN_WEIGHT);
 
-        if !self.global_loads.contains_key(&weight) {
-            self.global_loads.insert(weight, 0.0f64);
+        if dom_id >= self.doms.len() {
+            self.doms.resize(dom_id + 1, DomainSums::default());
         }
-        let mut weight_dcycle = self.global_loads.get(&weight).unwrap().clone();
-        weight_dcycle += dcycle;
-        self.global_loads.insert(weight, weight_dcycle);
 
         let load = weight as f64 * dcycle;
+        let domain = &mut self.doms[dom_id];
 
+        domain.present = true;
         domain.dcycle_sum += dcycle;
         domain.load_sum += load;
 
+        self.rec_doms.push(dom_id);
+        self.rec_weights.push(weight);
+        self.rec_dcycles.push(dcycle);
+
         self.global_dcycle_sum += dcycle;
         self.global_load_sum += load;
-
-        if weight > self.max_weight {
-            self.max_weight = weight;
-        }
-
-        Ok(())
+        self.max_weight = self.max_weight.max(weight);
     }
 
     fn infeasible_threshold(&self) -> f64 {
@@ -372,16 +356,38 @@ impl LoadAggregator {
     fn apply_infeasible_threshold(&mut self, lambda_x: f64) {
         self.effective_max_weight = lambda_x;
         self.global_load_sum = 0.0f64;
-        for (_, dom) in self.doms.iter_mut() {
+        for dom in self.doms.iter_mut() {
             dom.load_sum = 0.0f64;
-            for (weight, dcycle) in dom.loads.iter() {
-                let adjusted = (*weight as f64).min(lambda_x);
-                let load = adjusted * dcycle;
+        }
+        for ((dom_id, weight), dcycle) in self
+            .rec_doms
+            .iter()
+            .zip(self.rec_weights.iter())
+            .zip(self.rec_dcycles.iter())
+        {
+            let adjusted = (*weight as f64).min(lambda_x);
+            let load = adjusted * dcycle;
+
+            self.doms[*dom_id].load_sum += load;
+            self.global_load_sum += load;
+        }
+    }
 
-                dom.load_sum += load;
+    /// Return the recorded duty cycle sums of each distinct weight, heaviest
+    /// weight first.
+    fn weight_dcycles_desc(&self) -> Vec<(usize, f64)> {
+        let mut order: Vec<usize> = (0..self.rec_weights.len()).collect();
+        order.sort_unstable_by(|a, b| self.rec_weights[*b].cmp(&self.rec_weights[*a]));
+
+        let mut weight_dcycles: Vec<(usize, f64)> = Vec::new();
+        for idx in order {
+            let (weight, dcycle) = (self.rec_weights[idx], self.rec_dcycles[idx]);
+            match weight_dcycles.last_mut() {
+                Some((last_weight, sum)) if *last_weight == weight => *sum += dcycle,
+                _ => weight_dcycles.push((weight, dcycle)),
             }
-            self.global_load_sum += dom.load_sum;
         }
+        weight_dcycles
     }
 
     fn adjust_infeas_weights(&mut self) {
@@ -432,12 +438,15 @@ impl LoadAggregator {
         // All of this is described and proven in detail in the following pdf:
         //
         // https://drive.google.com/file/d/1fAoWUlmW-HTp6akuATVpMxpUpvWcGSAv
+        //
+        // The distinct weights are sorted once, O(n log n), and then walked
+        // from the heaviest down, each step updating the running sums in O(1).
         let p = self.nr_cpus as f64;
         let mut curr_dcycle_sum = 0.0f64;
         let mut curr_load_sum = self.global_load_sum;
         let mut lambda_x = curr_load_sum / p;
 
-        for (weight, dcycles) in self.global_loads.iter().rev() {
+        for (weight, dcycles) in self.weight_dcycles_desc().iter() {
             if approx_ge(lambda_x, *weight as f64) {
                 self.apply_infeasible_threshold(lambda_x);
                 return;
@@ -457,3 +466,75 @@ impl LoadAggregator {
         // when the scheduler was launched.
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_feasible() {
+        let mut aggregator = LoadAggregator::new(4, false);
+        for dom in 0..4 {
+            aggregator.record_dom_load(dom, 100, 0.5);
+        }
+        let ledger = aggregator.calculate();
+        assert!(approx_eq(ledger.global_load_sum(), 200.0));
+        assert!(approx_eq(ledger.global_dcycle_sum(), 2.0));
+        assert_eq!(ledger.dom_load_sums().len(), 4);
+    }
+
+    #[test]
+    fn test_infeasible() {
+        // The example from the module documentation.
+        let mut aggregator = LoadAggregator::new(32, false);
+        for dom in 0..64 {
+            aggregator.record_dom_load(dom, 1, 1.0);
+        }
+        aggregator.record_dom_load(64, 10000, 1.0);
+
+        let ledger = aggregator.calculate();
+        let lambda_x = ledger.effective_max_weight();
+        assert!(approx_eq(lambda_x, 64.0 / 31.0));
+        assert!(approx_eq(ledger.global_load_sum(), 64.0 + lambda_x));
+        assert!(approx_eq(ledger.dom_load_sums()[64], lambda_x));
+    }
+
+    #[test]
+    fn test_many_weights() {
+        // Many distinct weights spread over domains on an overloaded host.
+        // After adjustment, the load sum must equal lambda_x * P.
+        let nr_cpus = 4;
+        let mut aggregator = LoadAggregator::new(nr_cpus, false);
+        for i in 0..400usize {
+            let weight = 1 + (i * 7919) % 100;
+            aggregator.record_dom_load(i % 16, weight, 0.01);
+        }
+        aggregator.record_dom_load(3, 10000, 1.0);
+        aggregator.record_dom_load(5, 9000, 1.0);
+
+        let ledger = aggregator.calculate();
+        let lambda_x = ledger.effective_max_weight();
+        assert!(lambda_x < 9000.0);
+        assert!(approx_eq(
+            ledger.global_load_sum() / lambda_x,
+            nr_cpus as f64
+        ));
+        let dom_sum: f64 = ledger.dom_load_sums().iter().sum();
+        assert!(approx_eq(dom_sum, ledger.global_load_sum()));
+    }
+
+    #[test]
+    fn test_repeated_records() {
+        // Repeated (domain, weight) records are summed and weights below the
+        // minimum are clamped.
+        let mut aggregator = LoadAggregator::new(4, false);
+        aggregator.record_dom_load(0, 100, 0.25);
+        aggregator.record_dom_load(0, 100, 0.25);
+        aggregator.record_dom_load(1, 0, 0.5);
+
+        let ledger = aggregator.calculate();
+        assert!(approx_eq(ledger.dom_load_sums()[0], 50.0));
+        assert!(approx_eq(ledger.dom_load_sums()[1], 0.5));
+        assert!(approx_eq(ledger.global_dcycle_sum(), 1.0));
+    }
+}
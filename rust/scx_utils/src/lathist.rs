@@ -0,0 +1,215 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+//! # Latency Histogram Utilities
+//!
+//! Rust userland reader for the log2 latency histograms recorded by BPF
+//! schedulers which include
+//! [lathist_impl.bpf.h](https://github.com/sched-ext/scx/blob/main/scheds/include/scx/lathist_impl.bpf.h).
+//! Set the `lathist_enabled` rodata variable before loading the scheduler and
+//! read the `lathists` map with [`LatHist::read()`].
+//!
+//! Bucket 0 counts values below 2ns and bucket `b > 0` counts values in
+//! `[2^b, 2^(b+1))` ns. The reported percentiles are the upper bounds of the
+//! matching buckets and thus within 2x of the actual values.
+
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+
+/// Number of buckets of a histogram, equivalent to C LATHIST_NR_BUCKETS.
+pub const LATHIST_NR_BUCKETS: usize = 32;
+
+/// Names of the histograms, indexed by C enum lathist_idx.
+pub const LATHIST_NAMES: &[&str] = &[
+    "runq",
+    "select_cpu",
+    "enqueue",
+    "dispatch",
+    "running",
+    "stopping",
+    "decision",
+];
+
+/// Index of the user-space scheduler decision latency histogram, equivalent
+/// to C LATHIST_DECISION.
+pub const LATHIST_DECISION: u32 = 6;
+
+/// A latency histogram, summed over all CPUs.
+#[derive(Clone, Debug, Default, PartialEq)]
+pub struct LatHist {
+    pub buckets: Vec<u64>,
+    pub sum: u64,
+}
+
+impl LatHist {
+    /// Read histogram `@idx` from the per-CPU `lathists` map.
+    pub fn read(map: &libbpf_rs::Map, idx: u32) -> Result<LatHist> {
+        let percpu = map
+            .lookup_percpu(&idx.to_ne_bytes(), libbpf_rs::MapFlags::ANY)
+            .with_context(|| format!("Failed to lookup latency histogram {}", idx))?
+            .with_context(|| format!("Latency histogram {} doesn't exist", idx))?;
+        Self::from_percpu(&percpu)
+    }
+
+    /// Read all the histograms from the per-CPU `lathists` map, indexed by C
+    /// enum lathist_idx.
+    pub fn read_all(map: &libbpf_rs::Map) -> Result<Vec<LatHist>> {
+        (0..LATHIST_NAMES.len() as u32)
+            .map(|idx| Self::read(map, idx))
+            .collect()
+    }
+
+    /// Sum the per-CPU raw values of a histogram, each laid out as C struct
+    /// lathist: the buckets followed by the sum, all u64.
+    pub fn from_percpu(percpu: &[Vec<u8>]) -> Result<LatHist> {
+        let mut hist = LatHist::default();
+
+        for raw in percpu.iter() {
+            if raw.len() < 16 || raw.len() % 8 != 0 {
+                bail!("Invalid latency histogram size {}", raw.len());
+            }
+            let vals: Vec<u64> = raw
+                .chunks_exact(8)
+                .map(|b| u64::from_ne_bytes(b.try_into().unwrap()))
+                .collect();
+            let (buckets, sum) = vals.split_at(vals.len() - 1);
+
+            if hist.buckets.is_empty() {
+                hist.buckets = vec![0; buckets.len()];
+            }
+            for (acc, val) in hist.buckets.iter_mut().zip(buckets.iter()) {
+                *acc += val;
+            }
+            hist.sum += sum[0];
+        }
+        Ok(hist)
+    }
+
+    /// Record `@val` in user space, equivalent to C lathist_record().
+    pub fn record(&mut self, val: u64) {
+        if self.buckets.is_empty() {
+            self.buckets = vec![0; LATHIST_NR_BUCKETS];
+        }
+        let bucket = (63 - (val | 1).leading_zeros() as usize).min(self.buckets.len() - 1);
+        self.buckets[bucket] += 1;
+        self.sum += val;
+    }
+
+    /// Return the histogram of what has been recorded since `@prev` was read.
+    pub fn delta(&self, prev: &LatHist) -> LatHist {
+        LatHist {
+            buckets: self
+                .buckets
+                .iter()
+                .enumerate()
+                .map(|(i, cnt)| cnt.saturating_sub(*prev.buckets.get(i).unwrap_or(&0)))
+                .collect(),
+            sum: self.sum.saturating_sub(prev.sum),
+        }
+    }
+
+    /// Number of recorded values.
+    pub fn count(&self) -> u64 {
+        self.buckets.iter().sum()
+    }
+
+    /// Mean of the recorded values in ns, 0 if empty.
+    pub fn mean(&self) -> f64 {
+        match self.count() {
+            0 => 0.0,
+            cnt => self.sum as f64 / cnt as f64,
+        }
+    }
+
+    /// Upper bound in ns of the bucket containing the `@pct` percentile, 0
+    /// if empty.
+    pub fn percentile(&self, pct: f64) -> u64 {
+        let cnt = self.count();
+        if cnt == 0 {
+            return 0;
+        }
+
+        let target = ((cnt as f64 * pct / 100.0).ceil() as u64).clamp(1, cnt);
+        let mut acc = 0;
+        for (bucket, nr) in self.buckets.iter().enumerate() {
+            acc += nr;
+            if acc >= target {
+                return 1u64 << (bucket + 1).min(63);
+            }
+        }
+        u64::MAX
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn raw(buckets: &[u64], sum: u64) -> Vec<u8> {
+        buckets
+            .iter()
+            .chain(std::iter::once(&sum))
+            .flat_map(|v| v.to_ne_bytes())
+            .collect()
+    }
+
+    #[test]
+    fn test_from_percpu() {
+        let hist = LatHist::from_percpu(&[raw(&[1, 2, 0, 0], 10), raw(&[0, 1, 3, 0], 20)]).unwrap();
+
+        assert_eq!(hist.buckets, vec![1, 3, 3, 0]);
+        assert_eq!(hist.sum, 30);
+        assert_eq!(hist.count(), 7);
+        assert!(LatHist::from_percpu(&[vec![0u8; 12]]).is_err());
+    }
+
+    #[test]
+    fn test_record() {
+        let mut hist = LatHist::default();
+
+        for val in [0, 1, 2, 3, 4, 1 << 40] {
+            hist.record(val);
+        }
+        assert_eq!(hist.buckets.len(), LATHIST_NR_BUCKETS);
+        assert_eq!(&hist.buckets[..3], &[2, 2, 1]);
+        assert_eq!(hist.buckets[LATHIST_NR_BUCKETS - 1], 1);
+    }
+
+    #[test]
+    fn test_percentile() {
+        let hist = LatHist {
+            buckets: vec![0, 90, 0, 9, 1],
+            sum: 300,
+        };
+
+        assert_eq!(hist.percentile(50.0), 4);
+        assert_eq!(hist.percentile(90.0), 4);
+        assert_eq!(hist.percentile(99.0), 16);
+        assert_eq!(hist.percentile(100.0), 32);
+        assert_eq!(LatHist::default().percentile(99.0), 0);
+        assert_eq!(hist.mean(), 3.0);
+    }
+
+    #[test]
+    fn test_delta() {
+        let prev = LatHist {
+            buckets: vec![1, 2],
+            sum: 5,
+        };
+        let cur = LatHist {
+            buckets: vec![3, 2],
+            sum: 9,
+        };
+
+        assert_eq!(
+            cur.delta(&prev),
+            LatHist {
+                buckets: vec![2, 0],
+                sum: 4
+            }
+        );
+    }
+}
@@ -57,11 +57,20 @@ pub use libbpf_logger::init_libbpf_logging;
 
 pub mod ravg;
 
+pub mod lathist;
+
+pub mod sched_trace;
+
+pub mod sched_sim;
+
+pub mod handoff;
+
 mod topology;
 pub use topology::Cache;
 pub use topology::Core;
 pub use topology::Cpu;
 pub use topology::Node;
+pub use topology::NO_ID;
 pub use topology::Topology;
 pub use topology::TopologyMap;
 
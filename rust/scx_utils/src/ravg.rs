@@ -100,3 +100,183 @@ pub fn ravg_read(
     //
     old * (1.0 - normalized_dur(now % half_life) / 2.0) + cur / 2.0
 }
+
+/// Number of entries in the pre-computed decayed full-period sums table. The
+/// sums don't change in fixed point beyond this with the default
+/// RAVG_FRAC_BITS.
+pub const RAVG_FULL_SUMS_LEN: usize = 20;
+
+/// Generate the decayed full-period sums table of C `ravg_full_sum[]`.
+///
+/// `[0]` is `decay(1.0, 1)`, `[1]` is `[0] + decay(1.0, 2)` and so on where
+/// 1.0 is `1 << @frac_bits`. This is a `const fn` so that the table can be
+/// generated at compile time.
+pub const fn ravg_full_sums(frac_bits: u32) -> [u64; RAVG_FULL_SUMS_LEN] {
+    let one = 1u64 << frac_bits;
+    let mut sums = [0u64; RAVG_FULL_SUMS_LEN];
+    let mut sum = 0;
+    let mut i = 0;
+
+    while i < RAVG_FULL_SUMS_LEN {
+        sum += one >> (i + 1);
+        sums[i] = sum;
+        i += 1;
+    }
+    sums
+}
+
+/// Fields of BPF struct ravg_data
+///
+/// `bindgen` generates a separate ravg_data type for each scheduler. Build
+/// this from it to use [`RavgReader`].
+#[derive(Clone, Copy, Debug, Default)]
+pub struct RavgData {
+    pub val: u64,
+    pub val_at: u64,
+    pub old: u64,
+    pub cur: u64,
+}
+
+/// Batched running average reader
+///
+/// Reads many ravg_data records as of the same timestamp. The half-life
+/// period arithmetic which only depends on the timestamp is done once per
+/// batch instead of once per record, and the per-record part is carried out
+/// in the same fixed point arithmetic as C `ravg_read()` without floating
+/// point until the final conversion, so the results match what BPF would
+/// read.
+#[derive(Clone, Debug)]
+pub struct RavgReader {
+    half_life: u64,
+    frac_bits: u32,
+    full_sums: [u64; RAVG_FULL_SUMS_LEN],
+}
+
+impl RavgReader {
+    pub const fn new(half_life: u32, frac_bits: u32) -> Self {
+        Self {
+            half_life: half_life as u64,
+            frac_bits,
+            full_sums: ravg_full_sums(frac_bits),
+        }
+    }
+
+    fn one(&self) -> u64 {
+        1 << self.frac_bits
+    }
+
+    fn decay(v: u64, shift: u64) -> u64 {
+        if shift >= 64 {
+            0
+        } else {
+            v >> shift
+        }
+    }
+
+    fn normalize_dur(&self, dur: u64) -> u64 {
+        if dur < self.half_life {
+            ((dur << self.frac_bits) + self.half_life - 1) / self.half_life
+        } else {
+            self.one()
+        }
+    }
+
+    /// Read one running average as of @now. See [`RavgReader::read_batch`].
+    pub fn read(&self, rd: &RavgData, now: u64) -> f64 {
+        let mut out = [0.0];
+        self.read_batch(std::slice::from_ref(rd), now, &mut out);
+        out[0]
+    }
+
+    /// Read the running averages of @rds as of @now into @out
+    ///
+    /// @out must be at least as long as @rds. The values are in the same unit
+    /// as [`ravg_read()`]'s, i.e. divided by `1 << frac_bits`.
+    pub fn read_batch(&self, rds: &[RavgData], now: u64, out: &mut [f64]) {
+        let hl = self.half_life;
+        let one = self.one();
+        let cur_seq = now / hl;
+        let now_rem = now - cur_seq * hl;
+        let now_dur = self.normalize_dur(now_rem);
+        let old_mult = (one - now_dur / 2) as u128;
+        let ravg_1 = one as f64;
+
+        for (rd, out) in rds.iter().zip(out.iter_mut()) {
+            // A record accumulated after @now, this is rare and can take the
+            // slow path.
+            if rd.val_at > now {
+                let mut trd = [0.0];
+                self.read_batch(std::slice::from_ref(rd), rd.val_at, &mut trd);
+                *out = trd[0];
+                continue;
+            }
+
+            let val_seq = rd.val_at / hl;
+            let val_rem = rd.val_at - val_seq * hl;
+            let seq_delta = cur_seq - val_seq;
+            let mut old = rd.old;
+            let mut cur = rd.cur;
+
+            if seq_delta > 0 {
+                old = Self::decay(old, seq_delta);
+                old = old.saturating_add(Self::decay(cur, seq_delta));
+                cur = 0;
+
+                if rd.val != 0 {
+                    let dur = self.normalize_dur(hl - val_rem);
+                    old = old.saturating_add(rd.val.saturating_mul(Self::decay(dur, seq_delta)));
+                    if seq_delta > 1 {
+                        let idx = ((seq_delta - 2) as usize).min(RAVG_FULL_SUMS_LEN - 1);
+                        old = old.saturating_add(rd.val.saturating_mul(self.full_sums[idx]));
+                    }
+                    cur = rd.val.saturating_mul(now_dur);
+                }
+            } else if rd.val != 0 {
+                cur =
+                    cur.saturating_add(rd.val.saturating_mul(self.normalize_dur(now - rd.val_at)));
+            }
+
+            let avg = if now_rem != 0 {
+                ((old as u128 * old_mult) >> self.frac_bits) as u64 + cur / 2
+            } else {
+                old
+            };
+            *out = avg as f64 / ravg_1;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_full_sums() {
+        let sums = ravg_full_sums(20);
+        assert_eq!(sums[0], 524288);
+        assert_eq!(sums[3], 983040);
+        assert_eq!(sums[RAVG_FULL_SUMS_LEN - 1], 1048575);
+    }
+
+    #[test]
+    fn test_read_batch() {
+        let half_life = 1_000_000;
+        let reader = RavgReader::new(half_life, 20);
+        let rds: Vec<RavgData> = (0..64u64)
+            .map(|i| RavgData {
+                val: i * 1000,
+                val_at: i * 123_457,
+                old: i << 20,
+                cur: (i * 777) << 20,
+            })
+            .collect();
+        let now = 9_876_543;
+        let mut out = vec![0.0; rds.len()];
+
+        reader.read_batch(&rds, now, &mut out);
+        for (rd, avg) in rds.iter().zip(out.iter()) {
+            let expected = ravg_read(rd.val, rd.val_at, rd.old, rd.cur, now, half_life, 20);
+            assert!((avg - expected).abs() <= expected.abs() * 1e-4 + 1e-3);
+        }
+    }
+}
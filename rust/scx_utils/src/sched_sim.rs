@@ -0,0 +1,555 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+//! # Scheduling Trace Replay Simulator
+//!
+//! Replay the tasks of a scheduling trace captured with
+//! [`crate::sched_trace`] against a model of a scheduling policy and report
+//! the run queue latency, the throughput and the number of migrations, so
+//! that policies and tunables can be compared on the same workload offline.
+//!
+//! Each task of the trace is turned into a sequence of bursts, each being the
+//! time the task slept before waking up and the CPU time it consumed before
+//! blocking again. The bursts are replayed closed-loop: a task wakes up the
+//! recorded sleep time after its previous burst completed in the simulation,
+//! so that a policy which delays a task also delays its later wakeups as it
+//! would on a real system. Dependencies between tasks (e.g. who wakes up whom)
+//! are not modeled.
+//!
+//! Policies implement [`SimPolicy`], which mirrors the select_cpu, enqueue,
+//! dispatch and stopping operations of a sched_ext scheduler. The simulated
+//! CPUs are work-conserving: after each event, the CPU picked by
+//! [`SimPolicy::select_cpu()`] and then all the other idle CPUs get to
+//! dispatch. [`FifoPolicy`] and [`VtimePolicy`] are provided as baselines
+//! and are the only policies shipped: the schedulers' own policies aren't
+//! modeled, so comparing e.g. scx_rusty's deadlines requires implementing
+//! them as a [`SimPolicy`] first.
+//!
+//! The `sched_sim` example replays a trace file against the baselines:
+//!
+//! ```text
+//! cargo run --example sched_sim -- TRACE [NR_CPUS] [SLICE_US]
+//! ```
+
+use std::cmp::Reverse;
+use std::collections::BTreeMap;
+use std::collections::BTreeSet;
+use std::collections::BinaryHeap;
+use std::collections::VecDeque;
+use std::fmt;
+
+use crate::lathist::LatHist;
+use crate::sched_trace::TraceEvent;
+use crate::sched_trace::TraceKind;
+
+/// A wakeup of a task and the CPU time it consumed before blocking again.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Burst {
+    /// Time slept before waking up. For the first burst, time from the
+    /// beginning of the trace.
+    pub sleep: u64,
+    pub runtime: u64,
+}
+
+/// A task to replay.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct SimTaskSpec {
+    pub pid: u32,
+    pub weight: u32,
+    /// First CPU the task ran on in the trace.
+    pub cpu: usize,
+    pub bursts: Vec<Burst>,
+}
+
+#[derive(Default)]
+struct TaskTrace {
+    spec: Option<SimTaskSpec>,
+    blocked_at: u64,
+    run_start: Option<u64>,
+    open: Option<Burst>,
+}
+
+/// Turn the events of a trace into the tasks to replay, ordered by pid.
+pub fn tasks_from_trace(events: &[TraceEvent]) -> Vec<SimTaskSpec> {
+    let mut events = events.to_vec();
+    events.sort_by_key(|ev| ev.ts);
+
+    let start = match events.first() {
+        Some(ev) => ev.ts,
+        None => return vec![],
+    };
+    let mut tasks: BTreeMap<u32, TaskTrace> = BTreeMap::new();
+
+    for ev in events.iter() {
+        let task = tasks.entry(ev.pid).or_insert_with(|| TaskTrace {
+            blocked_at: start,
+            ..Default::default()
+        });
+        let spec = task.spec.get_or_insert_with(|| SimTaskSpec {
+            pid: ev.pid,
+            weight: ev.weight.max(1),
+            cpu: ev.cpu as usize,
+            bursts: vec![],
+        });
+
+        // A task which was runnable when the capture started has no wakeup.
+        if task.open.is_none() && ev.kind != TraceKind::Stop {
+            task.open = Some(Burst {
+                sleep: ev.ts - task.blocked_at,
+                runtime: 0,
+            });
+        }
+
+        match ev.kind {
+            TraceKind::Wake => {}
+            TraceKind::Run => task.run_start = Some(ev.ts),
+            TraceKind::Stop => {
+                if let (Some(run_start), Some(burst)) = (task.run_start.take(), task.open.as_mut())
+                {
+                    burst.runtime += ev.ts - run_start;
+                }
+                if !ev.runnable {
+                    if let Some(burst) = task.open.take() {
+                        if burst.runtime > 0 {
+                            spec.bursts.push(burst);
+                        }
+                    }
+                    task.blocked_at = ev.ts;
+                }
+            }
+        }
+    }
+
+    tasks
+        .into_values()
+        .filter_map(|mut task| {
+            let mut spec = task.spec.take()?;
+            if let Some(burst) = task.open.take().filter(|burst| burst.runtime > 0) {
+                spec.bursts.push(burst);
+            }
+            Some(spec).filter(|spec| !spec.bursts.is_empty())
+        })
+        .collect()
+}
+
+/// A task as seen by a [`SimPolicy`].
+#[derive(Clone, Debug)]
+pub struct SimTask {
+    /// Index of the task in the replayed tasks, to be returned by
+    /// [`SimPolicy::dispatch()`].
+    pub id: usize,
+    pub pid: u32,
+    pub weight: u32,
+    /// CPU the task last ran on in the simulation, or in the trace if it
+    /// hasn't run yet.
+    pub prev_cpu: usize,
+}
+
+/// Model of a scheduling policy.
+pub trait SimPolicy {
+    /// Pick the CPU to kick for the waking up `@task`, `@idle` tells which
+    /// CPUs are idle. The default picks `prev_cpu` if idle and otherwise the
+    /// first idle CPU.
+    fn select_cpu(&mut self, task: &SimTask, idle: &[bool]) -> Option<usize> {
+        if idle.get(task.prev_cpu).copied().unwrap_or(false) {
+            Some(task.prev_cpu)
+        } else {
+            idle.iter().position(|&idle| idle)
+        }
+    }
+
+    /// Queue the runnable `@task`.
+    fn enqueue(&mut self, now: u64, task: &SimTask);
+
+    /// Pick the next task to run on the idle `@cpu`, returning its id and
+    /// slice. None keeps the CPU idle.
+    fn dispatch(&mut self, now: u64, cpu: usize) -> Option<(usize, u64)>;
+
+    /// `@task` ran for `@ran` ns and stopped, either because its slice
+    /// expired or because it blocked.
+    fn stopping(&mut self, _now: u64, _task: &SimTask, _ran: u64) {}
+}
+
+/// Global FIFO with a fixed slice.
+pub struct FifoPolicy {
+    pub slice_ns: u64,
+    queue: VecDeque<usize>,
+}
+
+impl FifoPolicy {
+    pub fn new(slice_ns: u64) -> Self {
+        Self {
+            slice_ns,
+            queue: VecDeque::new(),
+        }
+    }
+}
+
+impl SimPolicy for FifoPolicy {
+    fn enqueue(&mut self, _now: u64, task: &SimTask) {
+        self.queue.push_back(task.id);
+    }
+
+    fn dispatch(&mut self, _now: u64, _cpu: usize) -> Option<(usize, u64)> {
+        self.queue.pop_front().map(|id| (id, self.slice_ns))
+    }
+}
+
+/// Global weighted vtime queue with a fixed slice, similar to scx_simple's
+/// weighted vtime mode.
+pub struct VtimePolicy {
+    pub slice_ns: u64,
+    vtime_now: u64,
+    vtimes: BTreeMap<usize, u64>,
+    queue: BTreeSet<(u64, usize)>,
+}
+
+impl VtimePolicy {
+    pub fn new(slice_ns: u64) -> Self {
+        Self {
+            slice_ns,
+            vtime_now: 0,
+            vtimes: BTreeMap::new(),
+            queue: BTreeSet::new(),
+        }
+    }
+}
+
+impl SimPolicy for VtimePolicy {
+    fn enqueue(&mut self, _now: u64, task: &SimTask) {
+        // Limit the budget that an idling task can accumulate to one slice.
+        let min_vtime = self.vtime_now.saturating_sub(self.slice_ns);
+        let vtime = self.vtimes.entry(task.id).or_insert(min_vtime);
+        *vtime = (*vtime).max(min_vtime);
+        self.queue.insert((*vtime, task.id));
+    }
+
+    fn dispatch(&mut self, _now: u64, _cpu: usize) -> Option<(usize, u64)> {
+        let (vtime, id) = self.queue.pop_first()?;
+        self.vtime_now = self.vtime_now.max(vtime);
+        Some((id, self.slice_ns))
+    }
+
+    fn stopping(&mut self, _now: u64, task: &SimTask, ran: u64) {
+        if let Some(vtime) = self.vtimes.get_mut(&task.id) {
+            *vtime += ran * 100 / task.weight.max(1) as u64;
+        }
+    }
+}
+
+/// Result of a simulation.
+#[derive(Clone, Debug, Default)]
+pub struct SimReport {
+    pub nr_cpus: usize,
+    /// Time from becoming runnable to running, for each time a task ran.
+    pub runq_lat: LatHist,
+    /// Number of completed bursts.
+    pub nr_bursts: u64,
+    /// Number of times a task stopped because its slice expired.
+    pub nr_preemptions: u64,
+    /// Number of times a task ran on a different CPU than the last time.
+    pub nr_migrations: u64,
+    /// Number of tasks which were left runnable when the simulation ended.
+    pub nr_stranded: u64,
+    pub busy_ns: u64,
+    /// Time at which the last burst completed.
+    pub makespan_ns: u64,
+}
+
+impl fmt::Display for SimReport {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        let makespan = self.makespan_ns.max(1) as f64;
+        writeln!(
+            f,
+            "bursts={} makespan={:.3}ms throughput={:.1}/s util={:.1}%",
+            self.nr_bursts,
+            makespan / 1_000_000.0,
+            self.nr_bursts as f64 * 1_000_000_000.0 / makespan,
+            self.busy_ns as f64 * 100.0 / (makespan * self.nr_cpus.max(1) as f64),
+        )?;
+        write!(
+            f,
+            "runq_lat avg={:.0}ns p50<{}ns p99<{}ns preempt={} migrate={} stranded={}",
+            self.runq_lat.mean(),
+            self.runq_lat.percentile(50.0),
+            self.runq_lat.percentile(99.0),
+            self.nr_preemptions,
+            self.nr_migrations,
+            self.nr_stranded,
+        )
+    }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq, PartialOrd, Ord)]
+enum SimEvent {
+    Wake(usize),
+    SliceEnd(usize),
+}
+
+struct TaskState {
+    task: SimTask,
+    next_burst: usize,
+    remaining: u64,
+    queued_at: u64,
+    ran_once: bool,
+}
+
+struct Sim<'a> {
+    specs: &'a [SimTaskSpec],
+    tasks: Vec<TaskState>,
+    cpus: Vec<Option<(usize, u64)>>,
+    events: BinaryHeap<Reverse<(u64, u64, SimEvent)>>,
+    seq: u64,
+    report: SimReport,
+}
+
+impl<'a> Sim<'a> {
+    fn push(&mut self, at: u64, ev: SimEvent) {
+        self.seq += 1;
+        self.events.push(Reverse((at, self.seq, ev)));
+    }
+
+    fn idle_cpus(&self) -> Vec<bool> {
+        self.cpus.iter().map(|curr| curr.is_none()).collect()
+    }
+
+    fn try_dispatch(&mut self, now: u64, cpu: usize, policy: &mut dyn SimPolicy) {
+        if self.cpus[cpu].is_some() {
+            return;
+        }
+        let (id, slice) = match policy.dispatch(now, cpu) {
+            Some(picked) => picked,
+            None => return,
+        };
+        let state = match self.tasks.get_mut(id) {
+            Some(state) if state.remaining > 0 => state,
+            _ => return,
+        };
+
+        self.report.runq_lat.record(now - state.queued_at);
+        if state.ran_once && state.task.prev_cpu != cpu {
+            self.report.nr_migrations += 1;
+        }
+        state.ran_once = true;
+        state.task.prev_cpu = cpu;
+
+        let run = state.remaining.min(slice.max(1));
+        self.cpus[cpu] = Some((id, now));
+        self.push(now + run, SimEvent::SliceEnd(cpu));
+    }
+
+    fn dispatch_all(&mut self, now: u64, first: Option<usize>, policy: &mut dyn SimPolicy) {
+        if let Some(cpu) = first.filter(|&cpu| cpu < self.cpus.len()) {
+            self.try_dispatch(now, cpu, policy);
+        }
+        for cpu in 0..self.cpus.len() {
+            self.try_dispatch(now, cpu, policy);
+        }
+    }
+
+    fn run(&mut self, policy: &mut dyn SimPolicy) {
+        while let Some(Reverse((now, _, ev))) = self.events.pop() {
+            let kick = match ev {
+                SimEvent::Wake(id) => {
+                    let state = &mut self.tasks[id];
+                    state.remaining = self.specs[id].bursts[state.next_burst].runtime;
+                    state.queued_at = now;
+                    let task = state.task.clone();
+                    let kick = policy.select_cpu(&task, &self.idle_cpus());
+                    policy.enqueue(now, &task);
+                    kick
+                }
+                SimEvent::SliceEnd(cpu) => {
+                    let (id, started_at) = match self.cpus[cpu].take() {
+                        Some(curr) => curr,
+                        None => continue,
+                    };
+                    let ran = now - started_at;
+                    let state = &mut self.tasks[id];
+                    state.remaining -= ran.min(state.remaining);
+                    self.report.busy_ns += ran;
+
+                    let task = state.task.clone();
+                    policy.stopping(now, &task, ran);
+
+                    if state.remaining > 0 {
+                        self.report.nr_preemptions += 1;
+                        state.queued_at = now;
+                        policy.enqueue(now, &task);
+                    } else {
+                        self.report.nr_bursts += 1;
+                        self.report.makespan_ns = now;
+                        state.next_burst += 1;
+                        if let Some(burst) = self.specs[id].bursts.get(state.next_burst) {
+                            let wake_at = now + burst.sleep;
+                            self.push(wake_at, SimEvent::Wake(id));
+                        }
+                    }
+                    Some(cpu)
+                }
+            };
+            self.dispatch_all(now, kick, policy);
+        }
+
+        self.report.nr_stranded = self
+            .tasks
+            .iter()
+            .filter(|state| state.remaining > 0)
+            .count() as u64;
+    }
+}
+
+/// Replay `@specs` on `@nr_cpus` CPUs scheduled by `@policy`.
+pub fn simulate(specs: &[SimTaskSpec], nr_cpus: usize, policy: &mut dyn SimPolicy) -> SimReport {
+    let nr_cpus = nr_cpus.max(1);
+    let mut sim = Sim {
+        specs,
+        tasks: specs
+            .iter()
+            .enumerate()
+            .map(|(id, spec)| TaskState {
+                task: SimTask {
+                    id,
+                    pid: spec.pid,
+                    weight: spec.weight,
+                    prev_cpu: spec.cpu.min(nr_cpus - 1),
+                },
+                next_burst: 0,
+                remaining: 0,
+                queued_at: 0,
+                ran_once: false,
+            })
+            .collect(),
+        cpus: vec![None; nr_cpus],
+        events: BinaryHeap::new(),
+        seq: 0,
+        report: SimReport {
+            nr_cpus,
+            ..Default::default()
+        },
+    };
+
+    for (id, spec) in specs.iter().enumerate() {
+        if let Some(burst) = spec.bursts.first() {
+            sim.push(burst.sleep, SimEvent::Wake(id));
+        }
+    }
+    sim.run(policy);
+    sim.report
+}
+
+/// Number of CPUs seen in a trace.
+pub fn nr_cpus_in_trace(events: &[TraceEvent]) -> usize {
+    events
+        .iter()
+        .map(|ev| ev.cpu as usize + 1)
+        .max()
+        .unwrap_or(1)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn ev(ts: u64, pid: u32, kind: TraceKind, runnable: bool) -> TraceEvent {
+        TraceEvent {
+            ts,
+            pid,
+            cpu: 0,
+            weight: 100,
+            kind,
+            runnable,
+        }
+    }
+
+    #[test]
+    fn test_tasks_from_trace() {
+        let events = vec![
+            ev(0, 1, TraceKind::Wake, true),
+            ev(10, 1, TraceKind::Run, true),
+            ev(30, 1, TraceKind::Stop, true),
+            ev(40, 1, TraceKind::Run, true),
+            ev(50, 1, TraceKind::Stop, false),
+            ev(100, 1, TraceKind::Wake, true),
+            ev(100, 1, TraceKind::Run, true),
+            ev(105, 1, TraceKind::Stop, false),
+            // running when the capture started
+            ev(20, 2, TraceKind::Run, true),
+            ev(60, 2, TraceKind::Stop, false),
+        ];
+        let tasks = tasks_from_trace(&events);
+
+        assert_eq!(tasks.len(), 2);
+        assert_eq!(
+            tasks[0].bursts,
+            vec![
+                Burst {
+                    sleep: 0,
+                    runtime: 30
+                },
+                Burst {
+                    sleep: 50,
+                    runtime: 5
+                },
+            ]
+        );
+        assert_eq!(
+            tasks[1].bursts,
+            vec![Burst {
+                sleep: 20,
+                runtime: 40
+            }]
+        );
+    }
+
+    fn spec(pid: u32, bursts: &[(u64, u64)]) -> SimTaskSpec {
+        SimTaskSpec {
+            pid,
+            weight: 100,
+            cpu: 0,
+            bursts: bursts
+                .iter()
+                .map(|&(sleep, runtime)| Burst { sleep, runtime })
+                .collect(),
+        }
+    }
+
+    #[test]
+    fn test_simulate_fifo() {
+        let specs = vec![spec(1, &[(0, 10), (5, 10)]), spec(2, &[(0, 10)])];
+        let report = simulate(&specs, 1, &mut FifoPolicy::new(100));
+
+        // 1 runs [0, 10), 2 runs [10, 20), 1 wakes at 15 and runs [20, 30)
+        assert_eq!(report.nr_bursts, 3);
+        assert_eq!(report.makespan_ns, 30);
+        assert_eq!(report.busy_ns, 30);
+        assert_eq!(report.runq_lat.count(), 3);
+        assert_eq!(report.runq_lat.sum, 10 + 5);
+        assert_eq!(report.nr_preemptions, 0);
+        assert_eq!(report.nr_stranded, 0);
+
+        // two CPUs run both tasks right away, 1 goes back to CPU 0
+        let report = simulate(&specs, 2, &mut FifoPolicy::new(100));
+        assert_eq!(report.makespan_ns, 25);
+        assert_eq!(report.runq_lat.sum, 0);
+        assert_eq!(report.nr_migrations, 0);
+    }
+
+    #[test]
+    fn test_simulate_vtime() {
+        // a long running task and a task which wakes up periodically
+        let specs = vec![
+            spec(1, &[(0, 1000)]),
+            spec(2, &[(1, 10), (40, 10), (40, 10)]),
+        ];
+        let report = simulate(&specs, 1, &mut VtimePolicy::new(20));
+
+        assert_eq!(report.nr_bursts, 4);
+        assert_eq!(report.busy_ns, 1030);
+        assert!(report.nr_preemptions > 0);
+        // the waking task never waits more than a slice
+        assert!(report.runq_lat.percentile(100.0) <= 32);
+    }
+}
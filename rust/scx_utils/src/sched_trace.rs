@@ -0,0 +1,247 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+//! # Scheduling Trace Utilities
+//!
+//! Rust userland writer and reader for the scheduling event traces captured
+//! by BPF schedulers which include
+//! [sched_trace_impl.bpf.h](https://github.com/sched-ext/scx/blob/main/scheds/include/scx/sched_trace_impl.bpf.h).
+//! Set the `sched_trace_enabled` rodata variable and size the
+//! `sched_trace_rb` map with [`size_trace_ring()`] before loading the
+//! scheduler, create a [`TraceWriter`] on the `sched_trace_rb` map and call
+//! [`TraceWriter::consume()`] periodically. The resulting file can be loaded
+//! with [`read_trace()`] and replayed with [`crate::sched_sim`].
+//!
+//! scx_rusty and scx_layered capture traces with `--trace-file`.
+//!
+//! A trace file starts with a 16 bytes header, the magic `SCXTRACE`
+//! followed by the version and the size of each event as native endian u32,
+//! followed by the events laid out as C struct sched_trace_event.
+
+use std::cell::Cell;
+use std::cell::RefCell;
+use std::fs::File;
+use std::io::BufWriter;
+use std::io::Write;
+use std::path::Path;
+use std::rc::Rc;
+
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+
+const TRACE_MAGIC: &[u8; 8] = b"SCXTRACE";
+const TRACE_VERSION: u32 = 1;
+
+/// Size of C struct sched_trace_event.
+pub const TRACE_EVENT_SIZE: usize = 24;
+
+/// C enum sched_trace_kind.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum TraceKind {
+    Wake,
+    Run,
+    Stop,
+}
+
+/// A scheduling event, equivalent to C struct sched_trace_event.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct TraceEvent {
+    pub ts: u64,
+    pub pid: u32,
+    pub cpu: u32,
+    pub weight: u32,
+    pub kind: TraceKind,
+    /// For TraceKind::Stop, whether the task is still runnable.
+    pub runnable: bool,
+}
+
+impl TraceEvent {
+    /// Decode an event from its C layout.
+    pub fn from_bytes(data: &[u8]) -> Result<TraceEvent> {
+        if data.len() < TRACE_EVENT_SIZE {
+            bail!("Truncated trace event ({} bytes)", data.len());
+        }
+        let u32_at = |off: usize| u32::from_ne_bytes(data[off..off + 4].try_into().unwrap());
+        let kind = match data[20] {
+            0 => TraceKind::Wake,
+            1 => TraceKind::Run,
+            2 => TraceKind::Stop,
+            kind => bail!("Invalid trace event kind {}", kind),
+        };
+
+        Ok(TraceEvent {
+            ts: u64::from_ne_bytes(data[0..8].try_into().unwrap()),
+            pid: u32_at(8),
+            cpu: u32_at(12),
+            weight: u32_at(16),
+            kind,
+            runnable: data[21] != 0,
+        })
+    }
+
+    /// Encode an event in its C layout.
+    pub fn to_bytes(&self) -> [u8; TRACE_EVENT_SIZE] {
+        let mut data = [0u8; TRACE_EVENT_SIZE];
+
+        data[0..8].copy_from_slice(&self.ts.to_ne_bytes());
+        data[8..12].copy_from_slice(&self.pid.to_ne_bytes());
+        data[12..16].copy_from_slice(&self.cpu.to_ne_bytes());
+        data[16..20].copy_from_slice(&self.weight.to_ne_bytes());
+        data[20] = self.kind as u8;
+        data[21] = self.runnable as u8;
+        data
+    }
+}
+
+fn write_header(out: &mut impl Write) -> std::io::Result<()> {
+    out.write_all(TRACE_MAGIC)?;
+    out.write_all(&TRACE_VERSION.to_ne_bytes())?;
+    out.write_all(&(TRACE_EVENT_SIZE as u32).to_ne_bytes())
+}
+
+/// Size the `sched_trace_rb` ring buffer `@map` of an open skeleton. The
+/// 4MiB it's declared with are only needed if `@enabled`, otherwise nothing
+/// is ever written to it and it's shrunk to a single page.
+pub fn size_trace_ring(map: &mut libbpf_rs::OpenMap, enabled: bool) -> Result<()> {
+    if enabled {
+        return Ok(());
+    }
+    let page_size = match unsafe { libc::sysconf(libc::_SC_PAGESIZE) } {
+        size if size > 0 => size as u32,
+        _ => 4096,
+    };
+    map.set_max_entries(page_size)
+        .context("Failed to shrink the trace ring buffer")
+}
+
+/// Drain the `sched_trace_rb` ring buffer of a scheduler into a trace file.
+pub struct TraceWriter<'cb> {
+    ring: libbpf_rs::RingBuffer<'cb>,
+    out: Rc<RefCell<BufWriter<File>>>,
+    nr_events: Rc<Cell<u64>>,
+}
+
+impl<'cb> TraceWriter<'cb> {
+    /// Create the trace file `@path` and start appending the events of the
+    /// ring buffer `@map` to it.
+    pub fn new(map: &libbpf_rs::Map, path: &Path) -> Result<Self> {
+        let file = File::create(path)
+            .with_context(|| format!("Failed to create trace file {:?}", path))?;
+        let mut out = BufWriter::new(file);
+        write_header(&mut out).context("Failed to write trace header")?;
+        let out = Rc::new(RefCell::new(out));
+
+        let nr_events = Rc::new(Cell::new(0));
+        let cb_out = out.clone();
+        let cb_nr_events = nr_events.clone();
+        let mut rbb = libbpf_rs::RingBufferBuilder::new();
+        rbb.add(map, move |data: &[u8]| {
+            let len = data.len().min(TRACE_EVENT_SIZE);
+            match cb_out.borrow_mut().write_all(&data[..len]) {
+                Ok(()) => {
+                    cb_nr_events.set(cb_nr_events.get() + 1);
+                    0
+                }
+                Err(_) => -1,
+            }
+        })?;
+        let ring = rbb.build()?;
+
+        Ok(Self {
+            ring,
+            out,
+            nr_events,
+        })
+    }
+
+    /// Append all the events currently in the ring buffer to the file.
+    pub fn consume(&mut self) -> Result<()> {
+        self.ring
+            .consume()
+            .context("Failed to write trace events")?;
+        self.out
+            .borrow_mut()
+            .flush()
+            .context("Failed to flush trace file")
+    }
+
+    /// Number of events written so far.
+    pub fn nr_events(&self) -> u64 {
+        self.nr_events.get()
+    }
+}
+
+/// Load all the events of a trace file.
+pub fn read_trace(path: &Path) -> Result<Vec<TraceEvent>> {
+    let data =
+        std::fs::read(path).with_context(|| format!("Failed to read trace file {:?}", path))?;
+    parse_trace(&data)
+}
+
+/// Parse the content of a trace file.
+pub fn parse_trace(data: &[u8]) -> Result<Vec<TraceEvent>> {
+    if data.len() < 16 || &data[0..8] != TRACE_MAGIC {
+        bail!("Not a sched trace");
+    }
+    let version = u32::from_ne_bytes(data[8..12].try_into().unwrap());
+    let ev_size = u32::from_ne_bytes(data[12..16].try_into().unwrap()) as usize;
+    if version != TRACE_VERSION || ev_size != TRACE_EVENT_SIZE {
+        bail!(
+            "Unsupported sched trace version {} event size {}",
+            version,
+            ev_size
+        );
+    }
+
+    data[16..]
+        .chunks_exact(TRACE_EVENT_SIZE)
+        .map(TraceEvent::from_bytes)
+        .collect()
+}
+
+/// Encode `@events` as the content of a trace file.
+pub fn encode_trace(events: &[TraceEvent]) -> Vec<u8> {
+    let mut data = Vec::with_capacity(16 + events.len() * TRACE_EVENT_SIZE);
+
+    write_header(&mut data).unwrap();
+    for ev in events.iter() {
+        data.extend_from_slice(&ev.to_bytes());
+    }
+    data
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_encode_parse() {
+        let events = vec![
+            TraceEvent {
+                ts: 100,
+                pid: 42,
+                cpu: 3,
+                weight: 100,
+                kind: TraceKind::Wake,
+                runnable: true,
+            },
+            TraceEvent {
+                ts: 250,
+                pid: 42,
+                cpu: 3,
+                weight: 100,
+                kind: TraceKind::Stop,
+                runnable: false,
+            },
+        ];
+        let data = encode_trace(&events);
+
+        assert_eq!(data.len(), 16 + 2 * TRACE_EVENT_SIZE);
+        assert_eq!(parse_trace(&data).unwrap(), events);
+        assert!(parse_trace(&data[..8]).is_err());
+        assert!(parse_trace(b"NOTATRACE_______").is_err());
+    }
+}
@@ -65,8 +65,30 @@
 //!
 //! With a created Topology, you can query the topological hierarchy using the
 //! set of accessor functions defined below. All objects in the topological
-//! hierarchy are entirely read-only. If the host topology were to change (due
-//! to e.g. hotplug), a new Topology object should be created.
+//! hierarchy are entirely read-only.
+//!
+//! Besides the hierarchy, a Topology also carries flat lookup tables indexed
+//! by CPU ID, which map each CPU to its core, LLC and NUMA node in O(1), and
+//! the NUMA distance matrix:
+//!
+//!```
+//!     let top = Topology::new()?;
+//!     let llc_id = top.cpu_llc_id(cpu).unwrap();
+//!     let dist = top.node_distance(0, 1);
+//!```
+//!
+//! Caching and Hotplug
+//! -------------------
+//!
+//! Reading the topology from sysfs takes several file reads per CPU, which
+//! adds up on large hosts. Topology::with_cache() stores the parsed topology
+//! in a file keyed by the boot ID and the online CPU mask, and reuses it when
+//! both still match, e.g. when a scheduler is restarted. CPU frequencies can
+//! be changed at runtime and are not cached, they're always read from sysfs.
+//!
+//! If the set of online CPUs changes (due to e.g. hotplug),
+//! Topology::update_online() re-reads only the CPUs which came online and
+//! drops the ones which went offline, instead of re-parsing the whole host.
 
 use crate::Cpumask;
 use anyhow::bail;
@@ -74,6 +96,7 @@ use anyhow::Result;
 use glob::glob;
 use sscanf::sscanf;
 use std::collections::BTreeMap;
+use std::fmt::Write;
 use std::path::Path;
 use std::slice::Iter;
 
@@ -179,15 +202,25 @@ impl Node {
     }
 }
 
-#[derive(Debug)]
+#[derive(Debug, Clone)]
 pub struct Topology {
     nodes: Vec<Node>,
     cores: Vec<Core>,
     cpus: BTreeMap<usize, Cpu>,
     span: Cpumask,
     nr_cpus_possible: usize,
+
+    // Flat lookup tables indexed by CPU ID. NO_ID for offline CPUs.
+    cpu_core_idx: Vec<usize>,
+    cpu_llc_id: Vec<usize>,
+    cpu_node_id: Vec<usize>,
+    // Indexed by [from node ID][to node ID]
+    node_distance: Vec<Vec<usize>>,
 }
 
+/// Value of the flat lookup tables for CPUs which aren't online.
+pub const NO_ID: usize = usize::MAX;
+
 impl Topology {
     /// Build a complete host Topology
     pub fn new() -> Result<Topology> {
@@ -200,6 +233,80 @@ impl Topology {
         } else {
             create_default_node(&span)?
         };
+        let node_distance = read_node_distances(&nodes);
+
+        Topology::from_nodes(nodes, span, node_distance)
+    }
+
+    /// Build a Topology from the cache file at @path if it was written during
+    /// the current boot for the current set of online CPUs. Otherwise, build
+    /// it from sysfs and try to update the cache file. Failing to write the
+    /// cache file is not an error.
+    pub fn with_cache(path: &Path) -> Result<Topology> {
+        let boot_id = std::fs::read_to_string("/proc/sys/kernel/random/boot_id")?;
+        let online = std::fs::read_to_string("/sys/devices/system/cpu/online")?;
+        let key = format!("{} {} {}", TOPO_CACHE_VERSION, boot_id.trim(), online.trim());
+
+        if let Ok(cache) = std::fs::read_to_string(path) {
+            if let Ok(Some(topo)) = Topology::from_cache(&cache, &key) {
+                return Ok(topo);
+            }
+        }
+
+        let topo = Topology::new()?;
+        if let Some(dir) = path.parent() {
+            let _ = std::fs::create_dir_all(dir);
+        }
+        let _ = std::fs::write(path, topo.to_cache(&key));
+        Ok(topo)
+    }
+
+    /// Re-read the online CPU mask and update the Topology if it changed.
+    /// CPUs which came online are read from sysfs and inserted into their
+    /// NUMA nodes, CPUs which went offline are removed along with any core,
+    /// LLC or node left empty. Returns whether the Topology changed.
+    pub fn update_online(&mut self) -> Result<bool> {
+        let online = cpus_online()?;
+        if online == self.span {
+            return Ok(false);
+        }
+
+        let mut nodes = std::mem::take(&mut self.nodes);
+        for cpu_id in self.span.andnot(&online).iter() {
+            for node in nodes.iter_mut() {
+                remove_cpu(cpu_id, node)?;
+            }
+        }
+        nodes.retain(|node| !node.span.is_empty());
+
+        let numa = Path::new("/sys/devices/system/node").exists();
+        for cpu_id in online.andnot(&self.span).iter() {
+            let node_id = if numa { cpu_node_id_sysfs(cpu_id)? } else { 0 };
+            let idx = match nodes.iter().position(|node| node.id == node_id) {
+                Some(idx) => idx,
+                None => {
+                    nodes.push(Node {
+                        id: node_id,
+                        llcs: BTreeMap::new(),
+                        span: Cpumask::new()?,
+                    });
+                    nodes.len() - 1
+                }
+            };
+            create_insert_cpu(cpu_id, &mut nodes[idx], &online)?;
+        }
+        nodes.sort_by_key(|node| node.id);
+
+        let node_distance = read_node_distances(&nodes);
+        *self = Topology::from_nodes(nodes, online, node_distance)?;
+        Ok(true)
+    }
+
+    fn from_nodes(nodes: Vec<Node>, span: Cpumask, node_distance: Vec<Vec<usize>>) -> Result<Topology> {
+        let nr_cpus_possible = libbpf_rs::num_possible_cpus().unwrap();
+        let mut cpu_core_idx = vec![NO_ID; nr_cpus_possible];
+        let mut cpu_llc_id = vec![NO_ID; nr_cpus_possible];
+        let mut cpu_node_id = vec![NO_ID; nr_cpus_possible];
 
         // For convenient and efficient lookup from the root topology object,
         // create two BTreeMaps to the full set of Core and Cpu objects on the
@@ -211,18 +318,112 @@ impl Topology {
         for node in nodes.iter() {
             for llc in node.llcs.values() {
                 for core in llc.cores.values() {
-                    cores.push(core.clone());
                     for (cpu_id, cpu) in core.cpus.iter() {
                         if let Some(_) = cpus.insert(*cpu_id, cpu.clone()) {
                             bail!("Found duplicate CPU ID {}", cpu_id);
                         }
+                        if *cpu_id < nr_cpus_possible {
+                            cpu_core_idx[*cpu_id] = cores.len();
+                            cpu_llc_id[*cpu_id] = llc.id;
+                            cpu_node_id[*cpu_id] = node.id;
+                        }
                     }
+                    cores.push(core.clone());
                 }
             }
         }
 
-        let nr_cpus_possible = libbpf_rs::num_possible_cpus().unwrap();
-        Ok(Topology { nodes, cores, cpus, span, nr_cpus_possible, })
+        Ok(Topology {
+            nodes,
+            cores,
+            cpus,
+            span,
+            nr_cpus_possible,
+            cpu_core_idx,
+            cpu_llc_id,
+            cpu_node_id,
+            node_distance,
+        })
+    }
+
+    fn to_cache(&self, key: &str) -> String {
+        let mut buf = format!("key {}\n", key);
+
+        for node in self.nodes.iter() {
+            for llc in node.llcs.values() {
+                for core in llc.cores.values() {
+                    for cpu in core.cpus.values() {
+                        let _ = writeln!(buf, "cpu {} {} {} {} {}",
+                                         cpu.id, node.id, llc.id, core.id, cpu.trans_lat_ns);
+                    }
+                }
+            }
+        }
+        for (node_id, dists) in self.node_distance.iter().enumerate() {
+            if dists.is_empty() {
+                continue;
+            }
+            let dists: Vec<String> = dists.iter().map(|d| d.to_string()).collect();
+            let _ = writeln!(buf, "distance {} {}", node_id, dists.join(" "));
+        }
+        buf
+    }
+
+    /// Parse a cache written by to_cache(). Returns None if the cache was
+    /// written for a different @key.
+    fn from_cache(cache: &str, key: &str) -> Result<Option<Topology>> {
+        let mut lines = cache.lines();
+        match lines.next() {
+            Some(line) if line.strip_prefix("key ") == Some(key) => {}
+            _ => return Ok(None),
+        }
+
+        let mut nodes: Vec<Node> = Vec::new();
+        let mut span = Cpumask::new()?;
+        let mut node_distance: Vec<Vec<usize>> = Vec::new();
+
+        for line in lines {
+            let mut fields = line.split_whitespace();
+            let kind = fields.next();
+            let vals = fields
+                .map(|f| f.parse::<usize>())
+                .collect::<std::result::Result<Vec<usize>, _>>()?;
+
+            match (kind, vals.len()) {
+                (Some("cpu"), 5) => {
+                    let (cpu_id, node_id) = (vals[0], vals[1]);
+                    let idx = match nodes.iter().position(|node| node.id == node_id) {
+                        Some(idx) => idx,
+                        None => {
+                            nodes.push(Node {
+                                id: node_id,
+                                llcs: BTreeMap::new(),
+                                span: Cpumask::new()?,
+                            });
+                            nodes.len() - 1
+                        }
+                    };
+                    let (min_freq, max_freq) = read_cpu_freqs(cpu_id);
+                    let cpu = Cpu {
+                        id: cpu_id,
+                        min_freq: min_freq,
+                        max_freq: max_freq,
+                        trans_lat_ns: vals[4],
+                    };
+                    insert_cpu(cpu, vals[2], vals[3], &mut nodes[idx])?;
+                    span.set_cpu(cpu_id)?;
+                }
+                (Some("distance"), n) if n >= 1 => {
+                    if vals[0] >= node_distance.len() {
+                        node_distance.resize(vals[0] + 1, Vec::new());
+                    }
+                    node_distance[vals[0]] = vals[1..].to_vec();
+                }
+                _ => bail!("Invalid topology cache line {:?}", line),
+            }
+        }
+
+        Ok(Some(Topology::from_nodes(nodes, span, node_distance)?))
     }
 
     /// Get a slice of the NUMA nodes on the host.
@@ -261,6 +462,50 @@ impl Topology {
     pub fn nr_cpus_possible(&self) -> usize {
         self.nr_cpus_possible
     }
+
+    /// Get the index into cores() of the core of @cpu, None if @cpu is offline.
+    pub fn cpu_core_idx(&self, cpu: usize) -> Option<usize> {
+        self.cpu_core_idx.get(cpu).copied().filter(|id| *id != NO_ID)
+    }
+
+    /// Get the ID of the LLC of @cpu, None if @cpu is offline.
+    pub fn cpu_llc_id(&self, cpu: usize) -> Option<usize> {
+        self.cpu_llc_id.get(cpu).copied().filter(|id| *id != NO_ID)
+    }
+
+    /// Get the ID of the NUMA node of @cpu, None if @cpu is offline.
+    pub fn cpu_node_id(&self, cpu: usize) -> Option<usize> {
+        self.cpu_node_id.get(cpu).copied().filter(|id| *id != NO_ID)
+    }
+
+    /// Get the flat table of core indices, indexed by CPU ID, with NO_ID for
+    /// offline CPUs. Convenient for filling BPF-side lookup arrays.
+    pub fn cpu_core_idxs(&self) -> &[usize] {
+        &self.cpu_core_idx
+    }
+
+    /// Get the flat table of LLC IDs, indexed by CPU ID, with NO_ID for
+    /// offline CPUs.
+    pub fn cpu_llc_ids(&self) -> &[usize] {
+        &self.cpu_llc_id
+    }
+
+    /// Get the flat table of NUMA node IDs, indexed by CPU ID, with NO_ID for
+    /// offline CPUs.
+    pub fn cpu_node_ids(&self) -> &[usize] {
+        &self.cpu_node_id
+    }
+
+    /// Get the NUMA distance from node @from to node @to as reported by the
+    /// kernel. The local distance is 10. If the distances are unknown, 10 is
+    /// returned for the local node and 20 for all others.
+    pub fn node_distance(&self, from: usize, to: usize) -> usize {
+        match self.node_distance.get(from).and_then(|dists| dists.get(to)) {
+            Some(dist) => *dist,
+            None if from == to => 10,
+            None => 20,
+        }
+    }
 }
 
 /// Generate a topology map from a Topology object, represented as an array of arrays.
@@ -324,6 +569,10 @@ impl TopologyMap {
 
 const CACHE_LEVEL: usize = 3;
 
+/// Bumped whenever the format written by Topology::to_cache() changes so that
+/// stale cache files are rebuilt instead of misparsed.
+const TOPO_CACHE_VERSION: &str = "v2";
+
 fn read_file_usize(path: &Path) -> Result<usize> {
     let val = match std::fs::read_to_string(&path) {
         Ok(val) => val,
@@ -340,35 +589,51 @@ fn read_file_usize(path: &Path) -> Result<usize> {
     }
 }
 
-fn cpus_online() -> Result<Cpumask> {
-    let path = "/sys/devices/system/cpu/online";
-    let online = std::fs::read_to_string(&path)?;
-    let online_groups: Vec<&str> = online.split(',').collect();
-    let mut mask = Cpumask::new()?;
-    for group in online_groups.iter() {
+/// Parse a sysfs ID list such as "0-3,8,10-11" into the IDs it contains.
+fn read_id_list(path: &str) -> Result<Vec<usize>> {
+    let list = std::fs::read_to_string(&path)?;
+    let groups: Vec<&str> = list.trim().split(',').filter(|g| !g.is_empty()).collect();
+    let mut ids = Vec::new();
+    for group in groups.iter() {
         let (min, max) = match sscanf!(group.trim(), "{usize}-{usize}") {
             Ok((x, y)) => (x, y),
             Err(_) => {
                 match sscanf!(group.trim(), "{usize}") {
                     Ok(x) => (x, x),
                     Err(_) => {
-                        bail!("Failed to parse online cpus {}", group.trim());
+                        bail!("Failed to parse ID list {} in {}", group.trim(), path);
                     }
                 }
             },
         };
-        for i in min..(max + 1) {
-            mask.set_cpu(i)?;
-        }
+        ids.extend(min..(max + 1));
     }
 
+    Ok(ids)
+}
+
+fn cpus_online() -> Result<Cpumask> {
+    let mut mask = Cpumask::new()?;
+    for cpu in read_id_list("/sys/devices/system/cpu/online")? {
+        mask.set_cpu(cpu)?;
+    }
     Ok(mask)
 }
 
+/// Read the current scaling min and max frequencies of a CPU. If the kernel
+/// is not compiled with CONFIG_CPU_FREQ, just assume 0 for both frequencies.
+fn read_cpu_freqs(cpu_id: usize) -> (usize, usize) {
+    let freq_path = Path::new("/sys/devices/system/cpu")
+        .join(format!("cpu{}", cpu_id))
+        .join("cpufreq");
+    let min_freq = read_file_usize(&freq_path.join("scaling_min_freq")).unwrap_or(0);
+    let max_freq = read_file_usize(&freq_path.join("scaling_max_freq")).unwrap_or(0);
+    (min_freq, max_freq)
+}
+
 fn create_insert_cpu(cpu_id: usize, node: &mut Node, online_mask: &Cpumask) -> Result<()> {
-    // CPU is offline. The Topology hierarchy is read-only, and assumes
-    // that hotplug will cause the scheduler to restart. Thus, we can
-    // just skip this CPU altogether.
+    // CPU is offline. Skip it altogether, Topology::update_online() will
+    // insert it if it comes online later.
     if !online_mask.test_cpu(cpu_id) {
         return Ok(());
     }
@@ -388,13 +653,23 @@ fn create_insert_cpu(cpu_id: usize, node: &mut Node, online_mask: &Cpumask) -> R
     let llc_id =
         read_file_usize(&cache_path.join(format!("index{}", CACHE_LEVEL)).join("id")).unwrap_or(0);
 
-    // Min and max frequencies. If the kernel is not compiled with
-    // CONFIG_CPU_FREQ, just assume 0 for both frequencies.
+    // Min and max frequencies
+    let (min_freq, max_freq) = read_cpu_freqs(cpu_id);
     let freq_path = cpu_path.join("cpufreq");
-    let min_freq = read_file_usize(&freq_path.join("scaling_min_freq")).unwrap_or(0);
-    let max_freq = read_file_usize(&freq_path.join("scaling_max_freq")).unwrap_or(0);
     let trans_lat_ns = read_file_usize(&freq_path.join("cpuinfo_transition_latency")).unwrap_or(0);
 
+    let cpu = Cpu {
+        id: cpu_id,
+        min_freq: min_freq,
+        max_freq: max_freq,
+        trans_lat_ns: trans_lat_ns,
+    };
+    insert_cpu(cpu, llc_id, core_id, node)
+}
+
+fn insert_cpu(cpu: Cpu, llc_id: usize, core_id: usize, node: &mut Node) -> Result<()> {
+    let cpu_id = cpu.id;
+
     if !node.llcs.contains_key(&llc_id) {
         let cache = Cache {
             id: llc_id,
@@ -415,15 +690,7 @@ fn create_insert_cpu(cpu_id: usize, node: &mut Node, online_mask: &Cpumask) -> R
     }
     let core = cache.cores.get_mut(&core_id).unwrap();
 
-    core.cpus.insert(
-        cpu_id,
-        Cpu {
-            id: cpu_id,
-            min_freq: min_freq,
-            max_freq: max_freq,
-            trans_lat_ns: trans_lat_ns,
-        },
-    );
+    core.cpus.insert(cpu_id, cpu);
 
     if node.span.test_cpu(cpu_id) {
         bail!("Node {} already had CPU {}", node.id, cpu_id);
@@ -504,3 +771,160 @@ fn create_numa_nodes(online_mask: &Cpumask) -> Result<Vec<Node>> {
     }
     Ok(nodes)
 }
+
+fn remove_cpu(cpu_id: usize, node: &mut Node) -> Result<()> {
+    if !node.span.test_cpu(cpu_id) {
+        return Ok(());
+    }
+
+    for cache in node.llcs.values_mut() {
+        for core in cache.cores.values_mut() {
+            if core.cpus.remove(&cpu_id).is_some() {
+                core.span.clear_cpu(cpu_id)?;
+            }
+        }
+        cache.cores.retain(|_, core| !core.cpus.is_empty());
+        cache.span.clear_cpu(cpu_id)?;
+    }
+    node.llcs.retain(|_, cache| !cache.cores.is_empty());
+    node.span.clear_cpu(cpu_id)?;
+
+    Ok(())
+}
+
+fn cpu_node_id_sysfs(cpu_id: usize) -> Result<usize> {
+    let pattern = format!("/sys/devices/system/cpu/cpu{}/node[0-9]*", cpu_id);
+    for path in glob(&pattern)?.filter_map(Result::ok) {
+        let path_str = path.to_str().unwrap().trim();
+        if let Ok((_, node_id)) = sscanf!(path_str, "/sys/devices/system/cpu/cpu{usize}/node{usize}") {
+            return Ok(node_id);
+        }
+    }
+    bail!("Failed to find the NUMA node of CPU {}", cpu_id);
+}
+
+/// Read the NUMA distance matrix. Each node's distance file lists the
+/// distances to all online nodes, including memory-only nodes without CPUs,
+/// in ascending node ID order. The rows are indexed by node ID. Nodes whose
+/// distances can't be read are left empty and node_distance() falls back to
+/// the default distances for them.
+fn read_node_distances(nodes: &Vec<Node>) -> Vec<Vec<usize>> {
+    let online_ids = match read_id_list("/sys/devices/system/node/online") {
+        Ok(ids) => ids,
+        Err(_) => return Vec::new(),
+    };
+
+    let nr_node_ids = online_ids
+        .iter()
+        .chain(nodes.iter().map(|node| &node.id))
+        .max()
+        .map_or(0, |id| id + 1);
+    let mut distances = vec![Vec::new(); nr_node_ids];
+
+    for node in nodes.iter() {
+        let path = format!("/sys/devices/system/node/node{}/distance", node.id);
+        let dists: Vec<usize> = match std::fs::read_to_string(&path) {
+            Ok(val) => val
+                .split_whitespace()
+                .filter_map(|d| d.parse::<usize>().ok())
+                .collect(),
+            Err(_) => continue,
+        };
+        if dists.len() != online_ids.len() {
+            continue;
+        }
+
+        let mut row = vec![20; nr_node_ids];
+        for (to, dist) in online_ids.iter().zip(dists.iter()) {
+            row[*to] = *dist;
+        }
+        distances[node.id] = row;
+    }
+    distances
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const KEY: &str = "v2 test-boot 0-3";
+
+    /// Parse @cache and check that writing the result out reproduces it.
+    /// Returns None if the host doesn't have the 4 possible CPUs the test
+    /// topologies need for their cpumasks.
+    fn round_trip(cache: &str) -> Option<Topology> {
+        if libbpf_rs::num_possible_cpus().unwrap() < 4 {
+            return None;
+        }
+        let topo = Topology::from_cache(cache, KEY).unwrap().unwrap();
+        assert_eq!(topo.to_cache(KEY), cache);
+        Some(topo)
+    }
+
+    #[test]
+    fn test_cache_multi_node_smt_off() {
+        // Two nodes with one LLC each and one CPU per core.
+        let cache = "key v2 test-boot 0-3\n\
+                     cpu 0 0 0 0 1000\n\
+                     cpu 1 0 0 1 1000\n\
+                     cpu 2 1 1 2 2000\n\
+                     cpu 3 1 1 3 2000\n\
+                     distance 0 10 21\n\
+                     distance 1 21 10\n";
+        let topo = match round_trip(cache) {
+            Some(topo) => topo,
+            None => return,
+        };
+
+        assert_eq!(topo.nodes().len(), 2);
+        assert_eq!(topo.cores().len(), 4);
+        assert_eq!(topo.span().weight(), 4);
+        for core in topo.cores() {
+            assert_eq!(core.cpus().len(), 1);
+            assert_eq!(core.span().weight(), 1);
+        }
+        for node in topo.nodes() {
+            assert_eq!(node.llcs().len(), 1);
+            assert_eq!(node.span().weight(), 2);
+        }
+
+        assert_eq!(topo.cpu_node_id(2), Some(1));
+        assert_eq!(topo.cpu_llc_id(3), Some(1));
+        assert_eq!(topo.cpu_core_idx(3), Some(3));
+        assert_eq!(topo.cpus()[&2].trans_lat_ns(), 2000);
+        assert_eq!(topo.node_distance(0, 1), 21);
+        assert_eq!(topo.node_distance(1, 1), 10);
+    }
+
+    #[test]
+    fn test_cache_smt_multi_llc() {
+        // A single node with two LLCs of one 2-way SMT core each, and no
+        // distances.
+        let cache = "key v2 test-boot 0-3\n\
+                     cpu 0 0 0 0 0\n\
+                     cpu 1 0 0 0 0\n\
+                     cpu 2 0 1 1 0\n\
+                     cpu 3 0 1 1 0\n";
+        let topo = match round_trip(cache) {
+            Some(topo) => topo,
+            None => return,
+        };
+
+        assert_eq!(topo.nodes().len(), 1);
+        assert_eq!(topo.nodes()[0].llcs().len(), 2);
+        assert_eq!(topo.cores().len(), 2);
+        for core in topo.cores() {
+            assert_eq!(core.span().weight(), 2);
+        }
+        assert_eq!(topo.cpu_core_idx(1), Some(0));
+        assert_eq!(topo.cpu_core_idx(2), Some(1));
+        assert_eq!(topo.cpu_llc_id(2), Some(1));
+        assert_eq!(topo.node_distance(0, 0), 10);
+    }
+
+    #[test]
+    fn test_cache_key_mismatch() {
+        let cache = "key v2 other-boot 0-3\ncpu 0 0 0 0 0\n";
+        assert!(Topology::from_cache(cache, KEY).unwrap().is_none());
+    }
+}
@@ -1,17 +1,26 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 /*
- * A central FIFO sched_ext scheduler which demonstrates the followings:
+ * A central vtime sched_ext scheduler which demonstrates the followings:
  *
  * a. Making all scheduling decisions from one CPU:
  *
  *    The central CPU is the only one making scheduling decisions. All other
  *    CPUs kick the central CPU when they run out of tasks to run.
  *
- *    There is one global BPF queue and the central CPU schedules all CPUs by
- *    dispatching from the global queue to each CPU's local dsq from dispatch().
- *    This isn't the most straightforward. e.g. It'd be easier to bounce
- *    through per-CPU BPF queues. The current design is chosen to maximally
- *    utilize and verify various SCX mechanisms such as LOCAL_ON dispatching.
+ *    There is one global BPF rbtree ordered by weighted vtime and the central
+ *    CPU schedules all CPUs by dispatching from the rbtree to each CPU's local
+ *    dsq from dispatch(). This isn't the most straightforward. e.g. It'd be
+ *    easier to bounce through per-CPU dsq's. The current design is chosen to
+ *    maximally utilize and verify various SCX mechanisms such as LOCAL_ON
+ *    dispatching.
+ *
+ *    Tasks pinned to a single CPU would keep getting popped for CPUs they
+ *    can't run on. Instead, they are queued on the per-CPU side dsq of that
+ *    CPU, ordered by the same vtime, which the CPU consumes by itself. Tasks
+ *    allowed on more CPUs stay in the rbtree so that any of those CPUs can
+ *    pick them up. When popped for a CPU they can't run on, they're moved to
+ *    the per-domain dsq of an allowed CPU, preferably an idle one, which all
+ *    CPUs of the domain consume.
  *
  * b. Tickless operation
  *
@@ -25,7 +34,21 @@
  *    have a way to pin to a specific CPU, so the periodic timer isn't pinned to
  *    the central CPU.
  *
- * c. Preemption
+ * c. Multiple central CPUs
+ *
+ *    A single central CPU saturates well before it runs out of CPUs to
+ *    schedule on large machines. Optionally, the CPUs can be partitioned into
+ *    scheduling domains, e.g. one per NUMA node, each with its own central CPU,
+ *    rbtree and preemption timer. Tasks are queued on the domain of the CPU
+ *    they last ran on and a central CPU which runs out of tasks for its domain
+ *    steals from the other domains' rbtrees.
+ *
+ *    To further reduce the number of round trips through the central CPU, up
+ *    to dispatch_batch tasks can be dispatched to a CPU's local dsq at once
+ *    with a single kick. As all tasks are dispatched with the infinite slice,
+ *    the queued ones start running as the timer preempts the current one.
+ *
+ * d. Preemption
  *
  *    Kthreads are unconditionally queued to the head of a matching local dsq
  *    and dispatched with SCX_DSQ_PREEMPT. This ensures that a kthread is always
@@ -46,35 +69,61 @@
  * Copyright (c) 2022 David Vernet <dvernet@meta.com>
  */
 #include <scx/common.bpf.h>
+#include <scx/lathist_impl.bpf.h>
 
 char _license[] SEC("license") = "GPL";
 
 enum {
 	FALLBACK_DSQ_ID		= 0,
+	SIDE_DSQ_BASE		= 1,	/* per-CPU side dsq's start here */
+	DOM_DSQ_BASE		= 1LLU << 32, /* per-domain dsq's start here */
 	MS_TO_NS		= 1000LLU * 1000,
 	TIMER_INTERVAL_NS	= 1 * MS_TO_NS,
+	MAX_CENTRALS		= 8,
+	MAX_DISPATCH_BATCH	= 8,
 };
 
-const volatile s32 central_cpu;
+const volatile u32 nr_centrals = 1;
+const volatile s32 central_cpus[MAX_CENTRALS];
 const volatile u32 nr_cpu_ids = 1;	/* !0 for veristat, set during init */
 const volatile u64 slice_ns = SCX_SLICE_DFL;
+const volatile u32 dispatch_batch = 1;
 
 bool timer_pinned = true;
 u64 nr_total, nr_locals, nr_queued, nr_lost_pids;
 u64 nr_timers, nr_dispatches, nr_mismatches, nr_retries;
-u64 nr_overflows;
+u64 nr_overflows, nr_steals, nr_batched, nr_side;
+
+/* per-domain number of queued tasks, used to decide how many CPUs to kick */
+static u64 central_nr_queued[MAX_CENTRALS];
+static u32 central_timer_started[MAX_CENTRALS];
 
 UEI_DEFINE(uei);
 
+struct central_node {
+	struct bpf_rb_node	rb_node;
+	u64			vtime;
+	s32			pid;
+};
+
+/* per-domain queue of tasks ordered by vtime */
+struct central_tree {
+	struct bpf_spin_lock	lock;
+	struct bpf_rb_root	root __contains(central_node, rb_node);
+	u64			vtime_now;
+};
+
 struct {
-	__uint(type, BPF_MAP_TYPE_QUEUE);
-	__uint(max_entries, 4096);
-	__type(value, s32);
-} central_q SEC(".maps");
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_CENTRALS);
+	__type(key, u32);
+	__type(value, struct central_tree);
+} central_trees SEC(".maps");
 
 /* can't use percpu map due to bad lookups */
 bool RESIZABLE_ARRAY(data, cpu_gimme_task);
 u64 RESIZABLE_ARRAY(data, cpu_started_at);
+u32 RESIZABLE_ARRAY(data, cpu_central);	/* domain each CPU belongs to */
 
 struct central_timer {
 	struct bpf_timer timer;
@@ -82,7 +131,7 @@ struct central_timer {
 
 struct {
 	__uint(type, BPF_MAP_TYPE_ARRAY);
-	__uint(max_entries, 1);
+	__uint(max_entries, MAX_CENTRALS);
 	__type(key, u32);
 	__type(value, struct central_timer);
 } central_timer SEC(".maps");
@@ -92,21 +141,110 @@ static bool vtime_before(u64 a, u64 b)
 	return (s64)(a - b) < 0;
 }
 
+static u32 cpu_to_central(s32 cpu)
+{
+	u32 *idx;
+
+	idx = ARRAY_ELEM_PTR(cpu_central, cpu, nr_cpu_ids);
+	if (!idx || *idx >= nr_centrals)
+		return 0;
+	return *idx;
+}
+
+static s32 central_cpu_of(u32 idx)
+{
+	if (idx >= MAX_CENTRALS)
+		return central_cpus[0];
+	return central_cpus[idx];
+}
+
+static bool is_central_cpu(s32 cpu)
+{
+	return cpu == central_cpu_of(cpu_to_central(cpu));
+}
+
+static struct central_tree *lookup_central_tree(u32 idx)
+{
+	struct central_tree *tree;
+
+	tree = bpf_map_lookup_elem(&central_trees, &idx);
+	if (!tree)
+		scx_bpf_error("central_tree lookup failed for %u", idx);
+	return tree;
+}
+
+static bool central_node_less(struct bpf_rb_node *a, const struct bpf_rb_node *b)
+{
+	struct central_node *node_a, *node_b;
+
+	node_a = container_of(a, struct central_node, rb_node);
+	node_b = container_of(b, struct central_node, rb_node);
+
+	return node_a->vtime < node_b->vtime;
+}
+
+/*
+ * Queue @p outside the rbtree on a CPU it can run on. @cpu is used if allowed.
+ * Otherwise, an idle allowed CPU is preferred so that @p doesn't end up
+ * waiting behind a busy one. Tasks pinned to a single CPU go to that CPU's
+ * side dsq. Other tasks go to the domain dsq of the chosen CPU so that any of
+ * the domain's CPUs they're allowed on can take them. The CPUs consume these
+ * dsq's by themselves, so the chosen CPU only needs a kick if idle. Busy CPUs
+ * get preempted by the timer once their slice expires.
+ */
+static void dispatch_side(struct task_struct *p, s32 cpu, u64 vtime,
+			  u64 enq_flags)
+{
+	u64 dsq_id;
+
+	if (cpu < 0 || !bpf_cpumask_test_cpu(cpu, p->cpus_ptr)) {
+		cpu = scx_bpf_pick_idle_cpu(p->cpus_ptr, 0);
+		if (cpu < 0)
+			cpu = bpf_cpumask_any_distribute(p->cpus_ptr);
+	}
+	if (cpu >= nr_cpu_ids) {
+		scx_bpf_dispatch(p, FALLBACK_DSQ_ID, SCX_SLICE_INF, enq_flags);
+		return;
+	}
+
+	if (p->nr_cpus_allowed == 1)
+		dsq_id = SIDE_DSQ_BASE + cpu;
+	else
+		dsq_id = DOM_DSQ_BASE + cpu_to_central(cpu);
+
+	__sync_fetch_and_add(&nr_side, 1);
+	scx_bpf_dispatch_vtime(p, dsq_id, SCX_SLICE_INF, vtime, enq_flags);
+	scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+}
+
+/* consume the dsq's @cpu takes tasks from outside the rbtrees */
+static bool consume_side(s32 cpu)
+{
+	return scx_bpf_consume(SIDE_DSQ_BASE + cpu) ||
+	       scx_bpf_consume(DOM_DSQ_BASE + cpu_to_central(cpu)) ||
+	       scx_bpf_consume(FALLBACK_DSQ_ID);
+}
+
 s32 BPF_STRUCT_OPS(central_select_cpu, struct task_struct *p,
 		   s32 prev_cpu, u64 wake_flags)
 {
 	/*
-	 * Steer wakeups to the central CPU as much as possible to avoid
-	 * disturbing other CPUs. It's safe to blindly return the central cpu as
-	 * select_cpu() is a hint and if @p can't be on it, the kernel will
-	 * automatically pick a fallback CPU.
+	 * Steer wakeups to the central CPU of @prev_cpu's domain as much as
+	 * possible to avoid disturbing other CPUs. It's safe to blindly return
+	 * the central cpu as select_cpu() is a hint and if @p can't be on it,
+	 * the kernel will automatically pick a fallback CPU.
 	 */
-	return central_cpu;
+	return central_cpu_of(cpu_to_central(prev_cpu));
 }
 
-void BPF_STRUCT_OPS(central_enqueue, struct task_struct *p, u64 enq_flags)
+static __always_inline void __central_enqueue(struct task_struct *p,
+					      u64 enq_flags)
 {
-	s32 pid = p->pid;
+	s32 task_cpu = scx_bpf_task_cpu(p);
+	u32 idx = cpu_to_central(task_cpu);
+	u64 vtime = p->scx.dsq_vtime;
+	struct central_tree *tree;
+	struct central_node *node;
 
 	__sync_fetch_and_add(&nr_total, 1);
 
@@ -123,28 +261,100 @@ void BPF_STRUCT_OPS(central_enqueue, struct task_struct *p, u64 enq_flags)
 		return;
 	}
 
-	if (bpf_map_push_elem(&central_q, &pid, 0)) {
+	tree = lookup_central_tree(idx);
+	if (!tree) {
+		scx_bpf_dispatch(p, FALLBACK_DSQ_ID, SCX_SLICE_INF, enq_flags);
+		return;
+	}
+
+	/* limit the amount of budget that an idling task can accumulate */
+	if (vtime_before(vtime, tree->vtime_now - slice_ns))
+		vtime = tree->vtime_now - slice_ns;
+
+	if (p->nr_cpus_allowed == 1) {
+		dispatch_side(p, task_cpu, vtime, enq_flags);
+		return;
+	}
+
+	node = bpf_obj_new(struct central_node);
+	if (!node) {
 		__sync_fetch_and_add(&nr_overflows, 1);
 		scx_bpf_dispatch(p, FALLBACK_DSQ_ID, SCX_SLICE_INF, enq_flags);
 		return;
 	}
 
+	node->pid = p->pid;
+	node->vtime = vtime;
+
+	bpf_spin_lock(&tree->lock);
+	bpf_rbtree_add(&tree->root, &node->rb_node, central_node_less);
+	bpf_spin_unlock(&tree->lock);
+
 	__sync_fetch_and_add(&nr_queued, 1);
+	if (idx < MAX_CENTRALS)
+		__sync_fetch_and_add(&central_nr_queued[idx], 1);
 
 	if (!scx_bpf_task_running(p))
-		scx_bpf_kick_cpu(central_cpu, SCX_KICK_PREEMPT);
+		scx_bpf_kick_cpu(central_cpu_of(idx), SCX_KICK_PREEMPT);
 }
 
-static bool dispatch_to_cpu(s32 cpu)
+/* select_cpu() never dispatches, so all the tasks go through here */
+void BPF_STRUCT_OPS(central_enqueue, struct task_struct *p, u64 enq_flags)
 {
+	u64 started_at = lathist_start();
+
+	lathist_enqueued(p);
+	__central_enqueue(p, enq_flags);
+	lathist_end(LATHIST_ENQUEUE, started_at);
+}
+
+/*
+ * Pop tasks from the rbtree of domain @idx and dispatch up to @max of them to
+ * @cpu's local dsq. Returns the number of tasks dispatched to @cpu. *@stop is
+ * set if the dispatch buffer ran out.
+ */
+static u32 dispatch_from_q(s32 cpu, u32 idx, u32 max, bool *stop)
+{
+	struct central_tree *tree;
+	struct central_node *node;
+	struct bpf_rb_node *rb_node;
 	struct task_struct *p;
+	u32 nr = 0;
+	u64 vtime;
 	s32 pid;
 
+	tree = lookup_central_tree(idx);
+	if (!tree)
+		return 0;
+
 	bpf_repeat(BPF_MAX_LOOPS) {
-		if (bpf_map_pop_elem(&central_q, &pid))
+		if (nr >= max)
 			break;
 
+		if (!scx_bpf_dispatch_nr_slots()) {
+			*stop = true;
+			break;
+		}
+
+		bpf_spin_lock(&tree->lock);
+		rb_node = bpf_rbtree_first(&tree->root);
+		if (rb_node)
+			rb_node = bpf_rbtree_remove(&tree->root, rb_node);
+		bpf_spin_unlock(&tree->lock);
+		if (!rb_node)
+			break;
+
+		node = container_of(rb_node, struct central_node, rb_node);
+		pid = node->pid;
+		vtime = node->vtime;
+		bpf_obj_drop(node);
+
+		if (vtime_before(tree->vtime_now, vtime))
+			tree->vtime_now = vtime;
+
 		__sync_fetch_and_sub(&nr_queued, 1);
+		if (idx < MAX_CENTRALS)
+			__sync_fetch_and_sub(&central_nr_queued[idx], 1);
 
 		p = bpf_task_from_pid(pid);
 		if (!p) {
@@ -153,55 +363,97 @@ static bool dispatch_to_cpu(s32 cpu)
 		}
 
 		/*
-		 * If we can't run the task at the top, do the dumb thing and
-		 * bounce it to the fallback dsq.
+		 * The affinity changed after the task was queued. Move it to
+		 * a side or domain dsq of a CPU it can run on so that it isn't
+		 * popped again for CPUs it can't run on.
 		 */
 		if (!bpf_cpumask_test_cpu(cpu, p->cpus_ptr)) {
 			__sync_fetch_and_add(&nr_mismatches, 1);
-			scx_bpf_dispatch(p, FALLBACK_DSQ_ID, SCX_SLICE_INF, 0);
+			dispatch_side(p, -1, vtime, 0);
 			bpf_task_release(p);
 			/*
 			 * We might run out of dispatch buffer slots if we continue dispatching
-			 * to the fallback DSQ, without dispatching to the local DSQ of the
-			 * target CPU. In such a case, break the loop now as will fail the
-			 * next dispatch operation.
+			 * to the side DSQs, without dispatching to the local DSQ of the
+			 * target CPU. The slot check at the top of the loop breaks out
+			 * before the next dispatch operation would fail.
 			 */
-			if (!scx_bpf_dispatch_nr_slots())
-				break;
 			continue;
 		}
 
 		/* dispatch to local and mark that @cpu doesn't need more */
 		scx_bpf_dispatch(p, SCX_DSQ_LOCAL_ON | cpu, SCX_SLICE_INF, 0);
+		bpf_task_release(p);
+		nr++;
+	}
 
-		if (cpu != central_cpu)
-			scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+	return nr;
+}
 
-		bpf_task_release(p);
-		return true;
+static bool dispatch_to_cpu(s32 cpu)
+{
+	u32 own = cpu_to_central(cpu), max = dispatch_batch, nr = 0, i;
+	bool stop = false;
+
+	/* the central CPU dispatches for itself every time it runs out */
+	if (is_central_cpu(cpu) || max < 1)
+		max = 1;
+	else if (max > MAX_DISPATCH_BATCH)
+		max = MAX_DISPATCH_BATCH;
+
+	/* own domain first and then steal from the others in order */
+	bpf_for(i, 0, nr_centrals) {
+		u32 idx = (own + i) % nr_centrals;
+		u32 got;
+
+		got = dispatch_from_q(cpu, idx, max - nr, &stop);
+		if (got && idx != own)
+			__sync_fetch_and_add(&nr_steals, got);
+		nr += got;
+		if (nr >= max || stop)
+			break;
 	}
 
-	return false;
+	if (!nr)
+		return false;
+
+	if (nr > 1)
+		__sync_fetch_and_add(&nr_batched, nr - 1);
+	if (!is_central_cpu(cpu))
+		scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+	return true;
 }
 
-void BPF_STRUCT_OPS(central_dispatch, s32 cpu, struct task_struct *prev)
+static void start_central_timer(u32 idx);
+
+static __always_inline void __central_dispatch(s32 cpu)
 {
-	if (cpu == central_cpu) {
-		/* dispatch for all other CPUs first */
+	u32 idx = cpu_to_central(cpu);
+
+	if (cpu == central_cpu_of(idx)) {
+		s32 i;
+
+		/* the other domains' timers are started from their centrals */
+		if (idx < MAX_CENTRALS && !central_timer_started[idx])
+			start_central_timer(idx);
+
+		/* dispatch for all other CPUs of the domain first */
 		__sync_fetch_and_add(&nr_dispatches, 1);
 
-		bpf_for(cpu, 0, nr_cpu_ids) {
+		bpf_for(i, 0, nr_cpu_ids) {
 			bool *gimme;
 
 			if (!scx_bpf_dispatch_nr_slots())
 				break;
 
+			if (i == cpu || cpu_to_central(i) != idx)
+				continue;
+
 			/* central's gimme is never set */
-			gimme = ARRAY_ELEM_PTR(cpu_gimme_task, cpu, nr_cpu_ids);
+			gimme = ARRAY_ELEM_PTR(cpu_gimme_task, i, nr_cpu_ids);
 			if (gimme && !*gimme)
 				continue;
 
-			if (dispatch_to_cpu(cpu))
+			if (dispatch_to_cpu(i))
 				*gimme = false;
 		}
 
@@ -214,18 +466,18 @@ void BPF_STRUCT_OPS(central_dispatch, s32 cpu, struct task_struct *prev)
 		 */
 		if (!scx_bpf_dispatch_nr_slots()) {
 			__sync_fetch_and_add(&nr_retries, 1);
-			scx_bpf_kick_cpu(central_cpu, SCX_KICK_PREEMPT);
+			scx_bpf_kick_cpu(cpu, SCX_KICK_PREEMPT);
 			return;
 		}
 
 		/* look for a task to run on the central CPU */
-		if (scx_bpf_consume(FALLBACK_DSQ_ID))
+		if (consume_side(cpu))
 			return;
-		dispatch_to_cpu(central_cpu);
+		dispatch_to_cpu(cpu);
 	} else {
 		bool *gimme;
 
-		if (scx_bpf_consume(FALLBACK_DSQ_ID))
+		if (consume_side(cpu))
 			return;
 
 		gimme = ARRAY_ELEM_PTR(cpu_gimme_task, cpu, nr_cpu_ids);
@@ -236,31 +488,64 @@ void BPF_STRUCT_OPS(central_dispatch, s32 cpu, struct task_struct *prev)
 		 * Force dispatch on the scheduling CPU so that it finds a task
 		 * to run for us.
 		 */
-		scx_bpf_kick_cpu(central_cpu, SCX_KICK_PREEMPT);
+		scx_bpf_kick_cpu(central_cpu_of(idx), SCX_KICK_PREEMPT);
 	}
 }
 
+void BPF_STRUCT_OPS(central_dispatch, s32 cpu, struct task_struct *prev)
+{
+	u64 started_at = lathist_start();
+
+	__central_dispatch(cpu);
+	lathist_end(LATHIST_DISPATCH, started_at);
+}
+
 void BPF_STRUCT_OPS(central_running, struct task_struct *p)
 {
+	u64 lat_started_at = lathist_start();
 	s32 cpu = scx_bpf_task_cpu(p);
 	u64 *started_at = ARRAY_ELEM_PTR(cpu_started_at, cpu, nr_cpu_ids);
+
+	lathist_running(p);
 	if (started_at)
 		*started_at = bpf_ktime_get_ns() ?: 1;	/* 0 indicates idle */
+	lathist_end(LATHIST_RUNNING, lat_started_at);
 }
 
 void BPF_STRUCT_OPS(central_stopping, struct task_struct *p, bool runnable)
 {
+	u64 lat_started_at = lathist_start();
 	s32 cpu = scx_bpf_task_cpu(p);
 	u64 *started_at = ARRAY_ELEM_PTR(cpu_started_at, cpu, nr_cpu_ids);
-	if (started_at)
+	if (started_at) {
+		/* charge the execution time scaled by the inverse of the weight */
+		if (*started_at)
+			p->scx.dsq_vtime += (bpf_ktime_get_ns() - *started_at) *
+				100 / p->scx.weight;
 		*started_at = 0;
+	}
+	lathist_end(LATHIST_STOPPING, lat_started_at);
+}
+
+void BPF_STRUCT_OPS(central_enable, struct task_struct *p)
+{
+	struct central_tree *tree;
+
+	tree = lookup_central_tree(cpu_to_central(scx_bpf_task_cpu(p)));
+	if (tree)
+		p->scx.dsq_vtime = tree->vtime_now;
 }
 
 static int central_timerfn(void *map, int *key, struct bpf_timer *timer)
 {
+	u32 idx = *key;
 	u64 now = bpf_ktime_get_ns();
-	u64 nr_to_kick = nr_queued;
-	s32 i, curr_cpu;
+	u64 nr_to_kick;
+	s32 i, curr_cpu, central_cpu = central_cpu_of(idx);
+
+	if (idx >= MAX_CENTRALS)
+		return 0;
+	nr_to_kick = central_nr_queued[idx];
 
 	curr_cpu = bpf_get_smp_processor_id();
 	if (timer_pinned && (curr_cpu != central_cpu)) {
@@ -273,7 +558,7 @@ static int central_timerfn(void *map, int *key, struct bpf_timer *timer)
 		s32 cpu = (nr_timers + i) % nr_cpu_ids;
 		u64 *started_at;
 
-		if (cpu == central_cpu)
+		if (cpu == central_cpu || cpu_to_central(cpu) != idx)
 			continue;
 
 		/* kick iff the current one exhausted its slice */
@@ -284,6 +569,8 @@ static int central_timerfn(void *map, int *key, struct bpf_timer *timer)
 
 		/* and there's something pending */
 		if (scx_bpf_dsq_nr_queued(FALLBACK_DSQ_ID) ||
+		    scx_bpf_dsq_nr_queued(SIDE_DSQ_BASE + cpu) ||
+		    scx_bpf_dsq_nr_queued(DOM_DSQ_BASE + idx) ||
 		    scx_bpf_dsq_nr_queued(SCX_DSQ_LOCAL_ON | cpu))
 			;
 		else if (nr_to_kick)
@@ -299,25 +586,19 @@ static int central_timerfn(void *map, int *key, struct bpf_timer *timer)
 	return 0;
 }
 
-int BPF_STRUCT_OPS_SLEEPABLE(central_init)
+/*
+ * Start the preemption timer of domain @idx. BPF_F_TIMER_CPU_PIN pins the timer
+ * to the current CPU, so this must be called from @idx's central CPU.
+ */
+static int __start_central_timer(u32 idx)
 {
-	u32 key = 0;
 	struct bpf_timer *timer;
 	int ret;
 
-	ret = scx_bpf_create_dsq(FALLBACK_DSQ_ID, -1);
-	if (ret)
-		return ret;
-
-	timer = bpf_map_lookup_elem(&central_timer, &key);
+	timer = bpf_map_lookup_elem(&central_timer, &idx);
 	if (!timer)
 		return -ESRCH;
 
-	if (bpf_get_smp_processor_id() != central_cpu) {
-		scx_bpf_error("init from non-central CPU");
-		return -EINVAL;
-	}
-
 	bpf_timer_init(timer, &central_timer, CLOCK_MONOTONIC);
 	bpf_timer_set_callback(timer, central_timerfn);
 
@@ -338,6 +619,45 @@ int BPF_STRUCT_OPS_SLEEPABLE(central_init)
 	return ret;
 }
 
+static void start_central_timer(u32 idx)
+{
+	if (idx >= MAX_CENTRALS ||
+	    __sync_val_compare_and_swap(&central_timer_started[idx], 0, 1))
+		return;
+	__start_central_timer(idx);
+}
+
+int BPF_STRUCT_OPS_SLEEPABLE(central_init)
+{
+	u32 idx;
+	s32 cpu;
+	int ret;
+
+	ret = scx_bpf_create_dsq(FALLBACK_DSQ_ID, -1);
+	if (ret)
+		return ret;
+
+	bpf_for(cpu, 0, nr_cpu_ids) {
+		ret = scx_bpf_create_dsq(SIDE_DSQ_BASE + cpu, -1);
+		if (ret)
+			return ret;
+	}
+
+	bpf_for(idx, 0, nr_centrals) {
+		ret = scx_bpf_create_dsq(DOM_DSQ_BASE + idx, -1);
+		if (ret)
+			return ret;
+	}
+
+	if (bpf_get_smp_processor_id() != central_cpu_of(0)) {
+		scx_bpf_error("init from non-central CPU");
+		return -EINVAL;
+	}
+
+	central_timer_started[0] = 1;
+	return __start_central_timer(0);
+}
+
 void BPF_STRUCT_OPS(central_exit, struct scx_exit_info *ei)
 {
 	UEI_RECORD(uei, ei);
@@ -356,6 +676,7 @@ SCX_OPS_DEFINE(central_ops,
 	       .dispatch		= (void *)central_dispatch,
 	       .running			= (void *)central_running,
 	       .stopping		= (void *)central_stopping,
+	       .enable			= (void *)central_enable,
 	       .init			= (void *)central_init,
 	       .exit			= (void *)central_exit,
 	       .name			= "central");
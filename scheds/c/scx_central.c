@@ -11,19 +11,26 @@
 #include <inttypes.h>
 #include <signal.h>
 #include <libgen.h>
+#include <string.h>
+#include <time.h>
 #include <bpf/bpf.h>
 #include <scx/common.h>
+#include <scx/lathist.h>
 #include "scx_central.bpf.skel.h"
 
 const char help_fmt[] =
-"A central FIFO sched_ext scheduler.\n"
+"A central vtime sched_ext scheduler.\n"
 "\n"
 "See the top-level comment in .bpf.c for more details.\n"
 "\n"
-"Usage: %s [-s SLICE_US] [-c CPU]\n"
+"Usage: %s [-s SLICE_US] [-c CPU] [-n] [-b BATCH] [-l]\n"
 "\n"
 "  -s SLICE_US   Override slice duration\n"
 "  -c CPU        Override the central CPU (default: 0)\n"
+"  -n            Use one central CPU per NUMA node, the first CPU of each node\n"
+"                other than the one -c CPU belongs to\n"
+"  -b BATCH      Dispatch up to BATCH tasks to a CPU at once (default: 1)\n"
+"  -l            Record and print the latency histograms of the operations\n"
 "  -v            Print libbpf debug messages\n"
 "  -h            Display this help and exit\n";
 
@@ -42,11 +49,83 @@ static void sigint_handler(int dummy)
 	exit_req = 1;
 }
 
+#define MAX_NUMA_NODES		1024
+
+/*
+ * Split the CPUs into one scheduling domain per NUMA node. Domain 0 is always
+ * the one containing the primary central CPU, which runs ops.init(). The other
+ * domains are scheduled from their first CPU.
+ */
+static void init_numa_centrals(struct scx_central *skel)
+{
+	__u32 *cpu_central = skel->data_cpu_central->cpu_central;
+	__s32 primary = skel->rodata->central_cpus[0];
+	const __u32 max_centrals = sizeof(skel->rodata->central_cpus) /
+		sizeof(skel->rodata->central_cpus[0]);
+	__u32 nr_centrals = 0, primary_idx, i;
+	int node;
+
+	for (node = 0; node < MAX_NUMA_NODES; node++) {
+		__s32 cpus[skel->rodata->nr_cpu_ids];
+		__u32 idx = nr_centrals < max_centrals ? nr_centrals : node % max_centrals;
+		__u32 nr, j;
+		bool found = false;
+		char path[64];
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		nr = scx_read_cpulist(path, cpus, skel->rodata->nr_cpu_ids);
+
+		for (j = 0; j < nr; j++) {
+			__s32 cpu = cpus[j];
+
+			if (cpu < 0 || cpu >= skel->rodata->nr_cpu_ids)
+				continue;
+			if (!found && idx == nr_centrals)
+				skel->rodata->central_cpus[idx] = cpu;
+			cpu_central[cpu] = idx;
+			found = true;
+		}
+
+		if (found && idx == nr_centrals)
+			nr_centrals++;
+	}
+
+	if (nr_centrals <= 1) {
+		skel->rodata->central_cpus[0] = primary;
+		return;
+	}
+
+	/* make the domain of the primary central CPU domain 0 */
+	primary_idx = cpu_central[primary];
+	skel->rodata->central_cpus[primary_idx] = skel->rodata->central_cpus[0];
+	skel->rodata->central_cpus[0] = primary;
+	for (i = 0; i < skel->rodata->nr_cpu_ids; i++) {
+		if (cpu_central[i] == primary_idx)
+			cpu_central[i] = 0;
+		else if (cpu_central[i] == 0)
+			cpu_central[i] = primary_idx;
+	}
+
+	skel->rodata->nr_centrals = nr_centrals;
+}
+
+static double now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
 int main(int argc, char **argv)
 {
+	struct lathist prev_lathists[LATHIST_NR] = {};
 	struct scx_central *skel;
 	struct bpf_link *link;
 	__u64 seq = 0, ecode;
+	__u64 last_mismatches = 0, last_retries = 0, last_overflows = 0;
+	double last_at;
+	bool numa_centrals = false;
 	__s32 opt;
 	cpu_set_t *cpuset;
 
@@ -56,16 +135,25 @@ int main(int argc, char **argv)
 restart:
 	skel = SCX_OPS_OPEN(central_ops, scx_central);
 
-	skel->rodata->central_cpu = 0;
+	skel->rodata->central_cpus[0] = 0;
 	skel->rodata->nr_cpu_ids = libbpf_num_possible_cpus();
 
-	while ((opt = getopt(argc, argv, "s:c:pvh")) != -1) {
+	while ((opt = getopt(argc, argv, "s:c:nb:lpvh")) != -1) {
 		switch (opt) {
 		case 's':
 			skel->rodata->slice_ns = strtoull(optarg, NULL, 0) * 1000;
 			break;
 		case 'c':
-			skel->rodata->central_cpu = strtoul(optarg, NULL, 0);
+			skel->rodata->central_cpus[0] = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			numa_centrals = true;
+			break;
+		case 'b':
+			skel->rodata->dispatch_batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			skel->rodata->lathist_enabled = true;
 			break;
 		case 'v':
 			verbose = true;
@@ -79,6 +167,10 @@ restart:
 	/* Resize arrays so their element count is equal to cpu count. */
 	RESIZE_ARRAY(skel, data, cpu_gimme_task, skel->rodata->nr_cpu_ids);
 	RESIZE_ARRAY(skel, data, cpu_started_at, skel->rodata->nr_cpu_ids);
+	RESIZE_ARRAY(skel, data, cpu_central, skel->rodata->nr_cpu_ids);
+
+	if (numa_centrals)
+		init_numa_centrals(skel);
 
 	SCX_OPS_LOAD(skel, central_ops, scx_central, uei);
 
@@ -96,10 +188,10 @@ restart:
 	cpuset = CPU_ALLOC(skel->rodata->nr_cpu_ids);
 	SCX_BUG_ON(!cpuset, "Failed to allocate cpuset");
 	CPU_ZERO(cpuset);
-	CPU_SET(skel->rodata->central_cpu, cpuset);
+	CPU_SET(skel->rodata->central_cpus[0], cpuset);
 	SCX_BUG_ON(sched_setaffinity(0, sizeof(cpuset), cpuset),
 		   "Failed to affinitize to central CPU %d (max %d)",
-		   skel->rodata->central_cpu, skel->rodata->nr_cpu_ids - 1);
+		   skel->rodata->central_cpus[0], skel->rodata->nr_cpu_ids - 1);
 	CPU_FREE(cpuset);
 
 	link = SCX_OPS_ATTACH(skel, central_ops, scx_central);
@@ -107,7 +199,16 @@ restart:
 	if (!skel->data->timer_pinned)
 		printf("WARNING : BPF_F_TIMER_CPU_PIN not available, timer not pinned to central\n");
 
+	printf("centrals=%u batch=%u\n", skel->rodata->nr_centrals,
+	       skel->rodata->dispatch_batch);
+	last_at = now_secs();
+
 	while (!exit_req && !UEI_EXITED(skel, uei)) {
+		__u64 nr_mismatches = skel->bss->nr_mismatches;
+		__u64 nr_retries = skel->bss->nr_retries;
+		__u64 nr_overflows = skel->bss->nr_overflows;
+		double now = now_secs(), dur = now - last_at ?: 1;
+
 		printf("[SEQ %llu]\n", seq++);
 		printf("total   :%10" PRIu64 "    local:%10" PRIu64 "   queued:%10" PRIu64 "  lost:%10" PRIu64 "\n",
 		       skel->bss->nr_total,
@@ -119,9 +220,24 @@ restart:
 		       skel->bss->nr_dispatches,
 		       skel->bss->nr_mismatches,
 		       skel->bss->nr_retries);
-		printf("overflow:%10" PRIu64 "\n",
-		       skel->bss->nr_overflows);
+		printf("overflow:%10" PRIu64 "    steal:%10" PRIu64 "  batched:%10" PRIu64 "   side:%10" PRIu64 "\n",
+		       skel->bss->nr_overflows,
+		       skel->bss->nr_steals,
+		       skel->bss->nr_batched,
+		       skel->bss->nr_side);
+		printf("rate/s  :  mismatch:%10.1lf    retry:%10.1lf overflow:%10.1lf\n",
+		       (nr_mismatches - last_mismatches) / dur,
+		       (nr_retries - last_retries) / dur,
+		       (nr_overflows - last_overflows) / dur);
+		if (skel->rodata->lathist_enabled)
+			scx_lathist_report(bpf_map__fd(skel->maps.lathists),
+					   prev_lathists);
 		fflush(stdout);
+
+		last_mismatches = nr_mismatches;
+		last_retries = nr_retries;
+		last_overflows = nr_overflows;
+		last_at = now;
 		sleep(1);
 	}
 
@@ -42,6 +42,33 @@
  * The scheduler first picks the cgroup to run and then schedule the tasks
  * within by using nested weighted vtime scheduling by default. The
  * cgroup-internal scheduling can be switched to FIFO with the -f option.
+ *
+ * With deep hierarchies, the ancestor walks which maintain the active weight
+ * sums and the hweights become the dominant cost of runnable and quiescent.
+ * Two things keep them in check. First, hweights are tagged with the
+ * generation they were calculated in and a refresh only recalculates the
+ * levels which are stale, so cgroups sharing ancestors don't repeat each
+ * other's work. Second, a cgroup which becomes quiescent isn't immediately
+ * removed from the weight tree. Instead, its cgid is queued on the CPU and the
+ * deactivations are folded in from fcg_dispatch() a bit later. If the cgroup
+ * becomes runnable again in the meantime, which is common for cgroups whose
+ * threads keep sleeping and waking up, both walks are skipped.
+ *
+ * To avoid serializing all CPUs on a single rbtree lock, the active cgroups
+ * are sharded into per-LLC rbtrees. A cgroup is queued on the shard of the CPU
+ * its task last ran on and, once picked, requeued on the shard of the picking
+ * CPU. CPUs whose shard is empty steal from the other shards. Each shard
+ * tracks its own cvtime_now and the shards are periodically reconciled by
+ * advancing the lagging ones to the global maximum so that cgroups moving
+ * across shards compete in the same vtime domain.
+ *
+ * A CPU which picked a cgroup holds it for cgrp_slice_ns and keeps consuming
+ * from it without going back to the cgroup tree. To further amortize the
+ * dispatch path when a cgroup runs many short tasks, up to cgrp_batch tasks
+ * can be moved to the local DSQ at once while the lease lasts. Batching is off
+ * by default and only happens while the cgroup has more queued tasks than
+ * there are idle CPUs to steal them, so that it doesn't cost work
+ * conservation.
  */
 #include <scx/common.bpf.h>
 #include "scx_flatcg.h"
@@ -56,8 +83,16 @@ char _license[] SEC("license") = "GPL";
 const volatile u32 nr_cpus = 32;	/* !0 for veristat, set during init */
 const volatile u64 cgrp_slice_ns = SCX_SLICE_DFL;
 const volatile bool fifo_sched;
+const volatile u64 deact_delay_ns = 500 * 1000;
+const volatile bool bench;
+const volatile u32 nr_shards = 1;
+const volatile u32 cpu_shards[FCG_MAX_CPUS];
+const volatile u64 cvtime_reconcile_ns = 10 * 1000 * 1000;
+const volatile bool lock_stats;
+const volatile u32 cgrp_batch = 1;
 
 u64 cvtime_now;
+u64 cvtime_reconciled_at;
 UEI_DEFINE(uei);
 
 struct {
@@ -67,18 +102,42 @@ struct {
 	__uint(max_entries, FCG_NR_STATS);
 } stats SEC(".maps");
 
-static void stat_inc(enum fcg_stat_idx idx)
+static void stat_add(enum fcg_stat_idx idx, u64 v)
 {
 	u32 idx_v = idx;
 
 	u64 *cnt_p = bpf_map_lookup_elem(&stats, &idx_v);
 	if (cnt_p)
-		(*cnt_p)++;
+		(*cnt_p) += v;
+}
+
+static void stat_inc(enum fcg_stat_idx idx)
+{
+	stat_add(idx, 1);
+}
+
+static u64 bench_start(void)
+{
+	return bench ? bpf_ktime_get_ns() : 0;
+}
+
+/* @idx is the count and @idx + 1 the accumulated duration */
+static void bench_end(enum fcg_stat_idx idx, u64 started_at)
+{
+	if (!bench)
+		return;
+	stat_inc(idx);
+	stat_add(idx + 1, bpf_ktime_get_ns() - started_at);
 }
 
 struct fcg_cpu_ctx {
 	u64			cur_cgid;
 	u64			cur_at;
+
+	/* cgroups which became quiescent on this CPU, see defer_deact() */
+	u64			deact_at;
+	u32			nr_deacts;
+	u64			deact_cgids[FCG_DEACT_BATCH];
 };
 
 struct {
@@ -102,8 +161,28 @@ struct cgv_node {
 	struct bpf_refcount	refcount;
 };
 
-private(CGV_TREE) struct bpf_spin_lock cgv_tree_lock;
-private(CGV_TREE) struct bpf_rb_root cgv_tree __contains(cgv_node, rb_node);
+/* protects the weight tree, i.e. ->nr_active, ->weight and ->child_weight_sum */
+private(FCG_WEIGHT) struct bpf_spin_lock weight_lock;
+
+struct cgv_shard {
+	struct bpf_spin_lock	lock;
+	struct bpf_rb_root	tree __contains(cgv_node, rb_node);
+	u64			cvtime_now;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct cgv_shard);
+	__uint(max_entries, FCG_MAX_SHARDS);
+} cgv_shards SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct fcg_shard_stat);
+	__uint(max_entries, FCG_MAX_SHARDS);
+} shard_stats SEC(".maps");
 
 struct cgv_node_stash {
 	struct cgv_node __kptr *node;
@@ -163,6 +242,88 @@ static struct fcg_cpu_ctx *find_cpu_ctx(void)
 	return cpuc;
 }
 
+static struct cgv_shard *lookup_shard(u32 shard_idx)
+{
+	struct cgv_shard *shard;
+
+	shard = bpf_map_lookup_elem(&cgv_shards, &shard_idx);
+	if (!shard) {
+		scx_bpf_error("cgv_shard lookup failed for %u", shard_idx);
+		return NULL;
+	}
+	return shard;
+}
+
+static u32 cpu_to_shard(s32 cpu)
+{
+	if (cpu < 0 || cpu >= FCG_MAX_CPUS)
+		return 0;
+	return cpu_shards[cpu];
+}
+
+/*
+ * bpf_spin_lock() can't be wrapped in a function, so the shard lock sites are
+ * bracketed with shard_lock_start() and shard_lock_end() instead.
+ */
+static u64 shard_lock_start(void)
+{
+	return lock_stats ? bpf_ktime_get_ns() : 0;
+}
+
+static void shard_lock_end(u32 shard_idx, u64 started_at)
+{
+	struct fcg_shard_stat *stat;
+
+	stat = bpf_map_lookup_elem(&shard_stats, &shard_idx);
+	if (!stat)
+		return;
+	stat->nr_locks++;
+	if (lock_stats)
+		stat->lock_ns += bpf_ktime_get_ns() - started_at;
+}
+
+static void shard_stat_steal(u32 shard_idx)
+{
+	struct fcg_shard_stat *stat;
+
+	stat = bpf_map_lookup_elem(&shard_stats, &shard_idx);
+	if (stat)
+		stat->nr_steals++;
+}
+
+/*
+ * Each shard's cvtime_now progresses with the consumption of the cgroups in
+ * it. Periodically advance the lagging shards to the maximum so that the
+ * shards don't drift apart and update the global cvtime_now which new cgroups
+ * start from.
+ */
+static void reconcile_cvtime(u64 now)
+{
+	u64 last = cvtime_reconciled_at, max_now = cvtime_now;
+	struct cgv_shard *shard;
+	u32 i;
+
+	if (now - last < cvtime_reconcile_ns ||
+	    __sync_val_compare_and_swap(&cvtime_reconciled_at, last, now) != last)
+		return;
+
+	bpf_for(i, 0, nr_shards) {
+		if (!(shard = lookup_shard(i)))
+			return;
+		if (vtime_before(max_now, shard->cvtime_now))
+			max_now = shard->cvtime_now;
+	}
+
+	cvtime_now = max_now;
+
+	bpf_for(i, 0, nr_shards) {
+		if (!(shard = lookup_shard(i)))
+			return;
+		if (vtime_before(shard->cvtime_now, max_now))
+			shard->cvtime_now = max_now;
+	}
+}
+
 static struct fcg_cgrp_ctx *find_cgrp_ctx(struct cgroup *cgrp)
 {
 	struct fcg_cgrp_ctx *cgc;
@@ -194,6 +355,8 @@ static struct fcg_cgrp_ctx *find_ancestor_cgrp_ctx(struct cgroup *cgrp, int leve
 
 static void cgrp_refresh_hweight(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc)
 {
+	struct fcg_cgrp_ctx *leaf_cgc = cgc, *pcgc = NULL;
+	u64 gen = hweight_gen;
 	int level;
 
 	if (!cgc->nr_active) {
@@ -201,56 +364,64 @@ static void cgrp_refresh_hweight(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc)
 		return;
 	}
 
-	if (cgc->hweight_gen == hweight_gen) {
+	if (cgc->hweight_gen == gen) {
 		stat_inc(FCG_STAT_HWT_CACHE);
 		return;
 	}
 
+	/*
+	 * Walk down from the root. Levels which were already refreshed in this
+	 * generation, e.g. by a sibling, are up-to-date and skipped. Each
+	 * level's ctx is carried over as the parent of the next level so that
+	 * each ancestor is looked up only once.
+	 */
 	stat_inc(FCG_STAT_HWT_UPDATES);
 	bpf_for(level, 0, cgrp->level + 1) {
 		struct fcg_cgrp_ctx *cgc;
 		bool is_active;
 
-		cgc = find_ancestor_cgrp_ctx(cgrp, level);
+		if (level == cgrp->level)
+			cgc = leaf_cgc;
+		else
+			cgc = find_ancestor_cgrp_ctx(cgrp, level);
 		if (!cgc)
 			break;
 
-		if (!level) {
+		if (cgc->hweight_gen == gen) {
+			/* already refreshed in this generation */
+		} else if (!pcgc) {
 			cgc->hweight = FCG_HWEIGHT_ONE;
-			cgc->hweight_gen = hweight_gen;
+			cgc->hweight_gen = gen;
 		} else {
-			struct fcg_cgrp_ctx *pcgc;
-
-			pcgc = find_ancestor_cgrp_ctx(cgrp, level - 1);
-			if (!pcgc)
-				break;
-
 			/*
 			 * We can be oppotunistic here and not grab the
-			 * cgv_tree_lock and deal with the occasional races.
+			 * weight_lock and deal with the occasional races.
 			 * However, hweight updates are already cached and
 			 * relatively low-frequency. Let's just do the
 			 * straightforward thing.
 			 */
-			bpf_spin_lock(&cgv_tree_lock);
+			bpf_spin_lock(&weight_lock);
 			is_active = cgc->nr_active;
 			if (is_active) {
-				cgc->hweight_gen = pcgc->hweight_gen;
+				cgc->hweight_gen = gen;
 				cgc->hweight =
 					div_round_up(pcgc->hweight * cgc->weight,
 						     pcgc->child_weight_sum);
 			}
-			bpf_spin_unlock(&cgv_tree_lock);
+			bpf_spin_unlock(&weight_lock);
 
 			if (!is_active) {
 				stat_inc(FCG_STAT_HWT_RACE);
 				break;
 			}
 		}
+
+		pcgc = cgc;
 	}
 }
 
-static void cgrp_cap_budget(struct cgv_node *cgv_node, struct fcg_cgrp_ctx *cgc)
+static void cgrp_cap_budget(struct cgv_node *cgv_node, struct fcg_cgrp_ctx *cgc,
+			    u64 shard_cvtime_now)
 {
 	u64 delta, cvtime, max_budget;
 
@@ -270,17 +441,20 @@ static void cgrp_cap_budget(struct cgv_node *cgv_node, struct fcg_cgrp_ctx *cgc)
 	 */
 	max_budget = (cgrp_slice_ns * nr_cpus * cgc->hweight) /
 		(2 * FCG_HWEIGHT_ONE);
-	if (vtime_before(cvtime, cvtime_now - max_budget))
-		cvtime = cvtime_now - max_budget;
+	if (vtime_before(cvtime, shard_cvtime_now - max_budget))
+		cvtime = shard_cvtime_now - max_budget;
 
 	cgv_node->cvtime = cvtime;
 }
 
-static void cgrp_enqueued(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc)
+static void cgrp_enqueued(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc,
+			  u32 shard_idx)
 {
 	struct cgv_node_stash *stash;
 	struct cgv_node *cgv_node;
+	struct cgv_shard *shard;
 	u64 cgid = cgrp->kn->id;
+	u64 started_at;
 
 	/* paired with cmpxchg in try_pick_next_cgroup() */
 	if (__sync_val_compare_and_swap(&cgc->queued, 0, 1)) {
@@ -304,10 +478,18 @@ static void cgrp_enqueued(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc)
 		return;
 	}
 
-	bpf_spin_lock(&cgv_tree_lock);
-	cgrp_cap_budget(cgv_node, cgc);
-	bpf_rbtree_add(&cgv_tree, &cgv_node->rb_node, cgv_node_less);
-	bpf_spin_unlock(&cgv_tree_lock);
+	shard = lookup_shard(shard_idx);
+	if (!shard) {
+		bpf_obj_drop(cgv_node);
+		return;
+	}
+
+	started_at = shard_lock_start();
+	bpf_spin_lock(&shard->lock);
+	cgrp_cap_budget(cgv_node, cgc, shard->cvtime_now);
+	bpf_rbtree_add(&shard->tree, &cgv_node->rb_node, cgv_node_less);
+	bpf_spin_unlock(&shard->lock);
+	shard_lock_end(shard_idx, started_at);
 }
 
 static void set_bypassed_at(struct task_struct *p, struct fcg_task_ctx *taskc)
@@ -408,42 +590,24 @@ void BPF_STRUCT_OPS(fcg_enqueue, struct task_struct *p, u64 enq_flags)
 				       tvtime, enq_flags);
 	}
 
-	cgrp_enqueued(cgrp, cgc);
+	cgrp_enqueued(cgrp, cgc, cpu_to_shard(scx_bpf_task_cpu(p)));
 out_release:
 	bpf_cgroup_release(cgrp);
 }
 
 /*
- * Walk the cgroup tree to update the active weight sums as tasks wake up and
- * sleep. The weight sums are used as the base when calculating the proportion a
- * given cgroup or task is entitled to at each level.
+ * Walk the cgroup tree to update the active weight sums as cgroups become
+ * active and inactive. The weight sums are used as the base when calculating
+ * the proportion a given cgroup or task is entitled to at each level.
  */
-static void update_active_weight_sums(struct cgroup *cgrp, bool runnable)
+static void propagate_active(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc,
+			     bool runnable)
 {
-	struct fcg_cgrp_ctx *cgc;
+	struct fcg_cgrp_ctx *pcgc;
 	bool updated = false;
 	int idx;
 
-	cgc = find_cgrp_ctx(cgrp);
-	if (!cgc)
-		return;
-
-	/*
-	 * In most cases, a hot cgroup would have multiple threads going to
-	 * sleep and waking up while the whole cgroup stays active. In leaf
-	 * cgroups, ->nr_runnable which is updated with __sync operations gates
-	 * ->nr_active updates, so that we don't have to grab the cgv_tree_lock
-	 * repeatedly for a busy cgroup which is staying active.
-	 */
-	if (runnable) {
-		if (__sync_fetch_and_add(&cgc->nr_runnable, 1))
-			return;
-		stat_inc(FCG_STAT_ACT);
-	} else {
-		if (__sync_sub_and_fetch(&cgc->nr_runnable, 1))
-			return;
-		stat_inc(FCG_STAT_DEACT);
-	}
+	stat_inc(runnable ? FCG_STAT_ACT : FCG_STAT_DEACT);
 
 	/*
 	 * If @cgrp is becoming runnable, its hweight should be refreshed after
@@ -455,20 +619,19 @@ static void update_active_weight_sums(struct cgroup *cgrp, bool runnable)
 	if (!runnable)
 		cgrp_refresh_hweight(cgrp, cgc);
 
-	/* propagate upwards */
+	/*
+	 * Propagate upwards. The parent ctx of each level becomes the ctx of
+	 * the next level, so each ancestor is looked up once.
+	 */
+	pcgc = cgc;
 	bpf_for(idx, 0, cgrp->level) {
 		int level = cgrp->level - idx;
-		struct fcg_cgrp_ctx *cgc, *pcgc = NULL;
+		struct fcg_cgrp_ctx *cgc = pcgc;
 		bool propagate = false;
 
-		cgc = find_ancestor_cgrp_ctx(cgrp, level);
-		if (!cgc)
+		pcgc = find_ancestor_cgrp_ctx(cgrp, level - 1);
+		if (!pcgc)
 			break;
-		if (level) {
-			pcgc = find_ancestor_cgrp_ctx(cgrp, level - 1);
-			if (!pcgc)
-				break;
-		}
 
 		/*
 		 * We need the propagation protected by a lock to synchronize
@@ -476,27 +639,23 @@ static void update_active_weight_sums(struct cgroup *cgrp, bool runnable)
 		 * each level but bpf_spin_lock() doesn't want any function
 		 * calls while locked.
 		 */
-		bpf_spin_lock(&cgv_tree_lock);
+		bpf_spin_lock(&weight_lock);
 
 		if (runnable) {
 			if (!cgc->nr_active++) {
 				updated = true;
-				if (pcgc) {
-					propagate = true;
-					pcgc->child_weight_sum += cgc->weight;
-				}
+				propagate = true;
+				pcgc->child_weight_sum += cgc->weight;
 			}
 		} else {
 			if (!--cgc->nr_active) {
 				updated = true;
-				if (pcgc) {
-					propagate = true;
-					pcgc->child_weight_sum -= cgc->weight;
-				}
+				propagate = true;
+				pcgc->child_weight_sum -= cgc->weight;
 			}
 		}
 
-		bpf_spin_unlock(&cgv_tree_lock);
+		bpf_spin_unlock(&weight_lock);
 
 		if (!propagate)
 			break;
@@ -509,13 +668,125 @@ static void update_active_weight_sums(struct cgroup *cgrp, bool runnable)
 		cgrp_refresh_hweight(cgrp, cgc);
 }
 
+/*
+ * Queue the deactivation of @cgrp on the current CPU instead of walking the
+ * tree right away. The cgroup stays accounted as active until the deactivation
+ * is flushed from fcg_dispatch() or canceled by the cgroup becoming runnable
+ * again. Returns %false if the caller should deactivate @cgrp immediately.
+ */
+static bool defer_deact(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc)
+{
+	struct fcg_cpu_ctx *cpuc;
+	u32 idx;
+
+	if (!deact_delay_ns || !cgrp->level)
+		return false;
+
+	cpuc = find_cpu_ctx();
+	if (!cpuc)
+		return false;
+
+	idx = cpuc->nr_deacts;
+	if (idx >= FCG_DEACT_BATCH)
+		return false;
+
+	/*
+	 * Paired with the cmpxchg's in update_active_weight_sums(),
+	 * flush_deacts() and fcg_cgroup_exit(). Whoever clears ->deact_pending
+	 * owns the pending deactivation.
+	 *
+	 * The previous deactivation may still be pending if the cgroup became
+	 * runnable on another CPU which hasn't canceled it yet. That
+	 * activation will consume the pending deactivation, so this one has to
+	 * be applied right away.
+	 */
+	if (__sync_val_compare_and_swap(&cgc->deact_pending, 0, 1)) {
+		stat_inc(FCG_STAT_DEACT_RACE);
+		return false;
+	}
+
+	if (!idx)
+		cpuc->deact_at = bpf_ktime_get_ns();
+	cpuc->deact_cgids[idx] = cgrp->kn->id;
+	cpuc->nr_deacts = idx + 1;
+	return true;
+}
+
+static void flush_deacts(struct fcg_cpu_ctx *cpuc)
+{
+	u32 i, nr_deacts = cpuc->nr_deacts;
+
+	bpf_for(i, 0, nr_deacts) {
+		struct fcg_cgrp_ctx *cgc;
+		struct cgroup *cgrp;
+
+		if (i >= FCG_DEACT_BATCH)
+			break;
+
+		/* if the cgroup is gone, fcg_cgroup_exit() took care of it */
+		cgrp = bpf_cgroup_from_id(cpuc->deact_cgids[i]);
+		if (!cgrp)
+			continue;
+
+		cgc = bpf_cgrp_storage_get(&cgrp_ctx, cgrp, 0, 0);
+		if (cgc && __sync_val_compare_and_swap(&cgc->deact_pending, 1, 0))
+			propagate_active(cgrp, cgc, false);
+
+		bpf_cgroup_release(cgrp);
+	}
+
+	cpuc->nr_deacts = 0;
+	stat_inc(FCG_STAT_DEACT_FLUSH);
+}
+
+static void update_active_weight_sums(struct cgroup *cgrp, bool runnable)
+{
+	struct fcg_cgrp_ctx *cgc;
+
+	cgc = find_cgrp_ctx(cgrp);
+	if (!cgc)
+		return;
+
+	/*
+	 * In most cases, a hot cgroup would have multiple threads going to
+	 * sleep and waking up while the whole cgroup stays active. In leaf
+	 * cgroups, ->nr_runnable which is updated with __sync operations gates
+	 * ->nr_active updates, so that we don't have to grab the weight_lock
+	 * repeatedly for a busy cgroup which is staying active.
+	 */
+	if (runnable) {
+		if (__sync_fetch_and_add(&cgc->nr_runnable, 1))
+			return;
+
+		/*
+		 * If the deactivation is still pending, the cgroup never left
+		 * the weight tree and there's nothing to propagate.
+		 */
+		if (__sync_val_compare_and_swap(&cgc->deact_pending, 1, 0)) {
+			stat_inc(FCG_STAT_DEACT_CANCEL);
+			cgrp_refresh_hweight(cgrp, cgc);
+			return;
+		}
+	} else {
+		if (__sync_sub_and_fetch(&cgc->nr_runnable, 1))
+			return;
+		if (defer_deact(cgrp, cgc))
+			return;
+	}
+
+	propagate_active(cgrp, cgc, runnable);
+}
+
 void BPF_STRUCT_OPS(fcg_runnable, struct task_struct *p, u64 enq_flags)
 {
 	struct cgroup *cgrp;
+	u64 started_at = bench_start();
 
 	cgrp = scx_bpf_task_cgroup(p);
 	update_active_weight_sums(cgrp, true);
 	bpf_cgroup_release(cgrp);
+
+	bench_end(FCG_STAT_BENCH_RUNNABLE, started_at);
 }
 
 void BPF_STRUCT_OPS(fcg_running, struct task_struct *p)
@@ -582,10 +853,13 @@ void BPF_STRUCT_OPS(fcg_stopping, struct task_struct *p, bool runnable)
 void BPF_STRUCT_OPS(fcg_quiescent, struct task_struct *p, u64 deq_flags)
 {
 	struct cgroup *cgrp;
+	u64 started_at = bench_start();
 
 	cgrp = scx_bpf_task_cgroup(p);
 	update_active_weight_sums(cgrp, false);
 	bpf_cgroup_release(cgrp);
+
+	bench_end(FCG_STAT_BENCH_QUIESCENT, started_at);
 }
 
 void BPF_STRUCT_OPS(fcg_cgroup_set_weight, struct cgroup *cgrp, u32 weight)
@@ -602,34 +876,48 @@ void BPF_STRUCT_OPS(fcg_cgroup_set_weight, struct cgroup *cgrp, u32 weight)
 			return;
 	}
 
-	bpf_spin_lock(&cgv_tree_lock);
+	bpf_spin_lock(&weight_lock);
 	if (pcgc && cgc->nr_active)
 		pcgc->child_weight_sum += (s64)weight - cgc->weight;
 	cgc->weight = weight;
-	bpf_spin_unlock(&cgv_tree_lock);
+	bpf_spin_unlock(&weight_lock);
 }
 
-static bool try_pick_next_cgroup(u64 *cgidp)
+/*
+ * Pop the front cgroup of shard @src_idx and, if it has tasks to run, requeue
+ * it on shard @dst_idx which is the shard of the dispatching CPU. Returns %true
+ * if the caller should stop trying, with *@cgidp set to the picked cgroup or 0
+ * if @src_idx is empty.
+ */
+static bool try_pick_next_cgroup(u64 *cgidp, u32 src_idx, u32 dst_idx)
 {
 	struct bpf_rb_node *rb_node;
 	struct cgv_node *cgv_node;
+	struct cgv_shard *src, *dst;
 	struct fcg_cgrp_ctx *cgc;
 	struct cgroup *cgrp;
-	u64 cgid;
+	u64 cgid, started_at;
+
+	if (!(src = lookup_shard(src_idx)) || !(dst = lookup_shard(dst_idx))) {
+		*cgidp = 0;
+		return true;
+	}
 
 	/* pop the front cgroup and wind cvtime_now accordingly */
-	bpf_spin_lock(&cgv_tree_lock);
+	started_at = shard_lock_start();
+	bpf_spin_lock(&src->lock);
 
-	rb_node = bpf_rbtree_first(&cgv_tree);
+	rb_node = bpf_rbtree_first(&src->tree);
 	if (!rb_node) {
-		bpf_spin_unlock(&cgv_tree_lock);
-		stat_inc(FCG_STAT_PNC_NO_CGRP);
+		bpf_spin_unlock(&src->lock);
+		shard_lock_end(src_idx, started_at);
 		*cgidp = 0;
 		return true;
 	}
 
-	rb_node = bpf_rbtree_remove(&cgv_tree, rb_node);
-	bpf_spin_unlock(&cgv_tree_lock);
+	rb_node = bpf_rbtree_remove(&src->tree, rb_node);
+	bpf_spin_unlock(&src->lock);
+	shard_lock_end(src_idx, started_at);
 
 	if (!rb_node) {
 		/*
@@ -640,12 +928,13 @@ static bool try_pick_next_cgroup(u64 *cgidp)
 		scx_bpf_error("node could not be removed");
 		return true;
 	}
+	stat_inc(FCG_STAT_TREE_POP);
 
 	cgv_node = container_of(rb_node, struct cgv_node, rb_node);
 	cgid = cgv_node->cgid;
 
-	if (vtime_before(cvtime_now, cgv_node->cvtime))
-		cvtime_now = cgv_node->cvtime;
+	if (vtime_before(src->cvtime_now, cgv_node->cvtime))
+		src->cvtime_now = cgv_node->cvtime;
 
 	/*
 	 * If lookup fails, the cgroup's gone. Free and move on. See
@@ -684,11 +973,16 @@ static bool try_pick_next_cgroup(u64 *cgidp)
 	 * according to the actual consumption. This prevents lowpri thundering
 	 * herd from saturating the machine.
 	 */
-	bpf_spin_lock(&cgv_tree_lock);
+	started_at = shard_lock_start();
+	bpf_spin_lock(&dst->lock);
 	cgv_node->cvtime += cgrp_slice_ns * FCG_HWEIGHT_ONE / (cgc->hweight ?: 1);
-	cgrp_cap_budget(cgv_node, cgc);
-	bpf_rbtree_add(&cgv_tree, &cgv_node->rb_node, cgv_node_less);
-	bpf_spin_unlock(&cgv_tree_lock);
+	cgrp_cap_budget(cgv_node, cgc, dst->cvtime_now);
+	bpf_rbtree_add(&dst->tree, &cgv_node->rb_node, cgv_node_less);
+	bpf_spin_unlock(&dst->lock);
+	shard_lock_end(dst_idx, started_at);
+
+	if (src_idx != dst_idx)
+		shard_stat_steal(dst_idx);
 
 	*cgidp = cgid;
 	stat_inc(FCG_STAT_PNC_NEXT);
@@ -703,9 +997,11 @@ out_stash:
 	__sync_val_compare_and_swap(&cgc->queued, 1, 0);
 
 	if (scx_bpf_dsq_nr_queued(cgid)) {
-		bpf_spin_lock(&cgv_tree_lock);
-		bpf_rbtree_add(&cgv_tree, &cgv_node->rb_node, cgv_node_less);
-		bpf_spin_unlock(&cgv_tree_lock);
+		started_at = shard_lock_start();
+		bpf_spin_lock(&src->lock);
+		bpf_rbtree_add(&src->tree, &cgv_node->rb_node, cgv_node_less);
+		bpf_spin_unlock(&src->lock);
+		shard_lock_end(src_idx, started_at);
 		stat_inc(FCG_STAT_PNC_RACE);
 		return false;
 	}
@@ -715,25 +1011,60 @@ out_free:
 	return false;
 }
 
+/*
+ * One task from the current cgroup has been consumed. Move up to cgrp_batch - 1
+ * more to the local DSQ while the lease lasts. The batched tasks can't be
+ * stolen by other CPUs, so only batch the tasks which the idle CPUs couldn't
+ * pick up anyway.
+ */
+static void consume_batch(struct fcg_cpu_ctx *cpuc, u64 now)
+{
+	const struct cpumask *idle;
+	u32 nr_idle, i;
+
+	if (cgrp_batch <= 1 || !vtime_before(now, cpuc->cur_at + cgrp_slice_ns))
+		return;
+
+	idle = scx_bpf_get_idle_cpumask();
+	nr_idle = bpf_cpumask_weight(idle);
+	scx_bpf_put_idle_cpumask(idle);
+
+	bpf_for(i, 1, cgrp_batch) {
+		if (scx_bpf_dsq_nr_queued(cpuc->cur_cgid) <= nr_idle ||
+		    !scx_bpf_consume(cpuc->cur_cgid))
+			break;
+		stat_inc(FCG_STAT_CNS_BATCH);
+	}
+}
+
 void BPF_STRUCT_OPS(fcg_dispatch, s32 cpu, struct task_struct *prev)
 {
 	struct fcg_cpu_ctx *cpuc;
 	struct fcg_cgrp_ctx *cgc;
 	struct cgroup *cgrp;
 	u64 now = bpf_ktime_get_ns();
+	u32 shard_idx = cpu_to_shard(cpu);
 	bool picked_next = false;
+	u32 i;
 
 	cpuc = find_cpu_ctx();
 	if (!cpuc)
 		return;
 
+	reconcile_cvtime(now);
+
+	/* fold in the deactivations which have been pending long enough */
+	if (cpuc->nr_deacts && now - cpuc->deact_at >= deact_delay_ns)
+		flush_deacts(cpuc);
+
 	if (!cpuc->cur_cgid)
 		goto pick_next_cgroup;
 
 	if (vtime_before(now, cpuc->cur_at + cgrp_slice_ns)) {
 		if (scx_bpf_consume(cpuc->cur_cgid)) {
 			stat_inc(FCG_STAT_CNS_KEEP);
-			return;
+			consume_batch(cpuc, now);
+			goto out;
 		}
 		stat_inc(FCG_STAT_CNS_EMPTY);
 	} else {
@@ -753,15 +1084,13 @@ void BPF_STRUCT_OPS(fcg_dispatch, s32 cpu, struct task_struct *prev)
 	cgc = bpf_cgrp_storage_get(&cgrp_ctx, cgrp, 0, 0);
 	if (cgc) {
 		/*
-		 * We want to update the vtime delta and then look for the next
-		 * cgroup to execute but the latter needs to be done in a loop
-		 * and we can't keep the lock held. Oh well...
+		 * The delta is applied by cgrp_cap_budget() when the cgroup's
+		 * node is requeued on whichever shard it's on. It's updated
+		 * atomically on both sides and doesn't need the shard lock.
 		 */
-		bpf_spin_lock(&cgv_tree_lock);
 		__sync_fetch_and_add(&cgc->cvtime_delta,
 				     (cpuc->cur_at + cgrp_slice_ns - now) *
 				     FCG_HWEIGHT_ONE / (cgc->hweight ?: 1));
-		bpf_spin_unlock(&cgv_tree_lock);
 	} else {
 		stat_inc(FCG_STAT_CNS_GONE);
 	}
@@ -773,16 +1102,39 @@ pick_next_cgroup:
 
 	if (scx_bpf_consume(SCX_DSQ_GLOBAL)) {
 		cpuc->cur_cgid = 0;
-		return;
+		goto out;
 	}
 
 	bpf_repeat(CGROUP_MAX_RETRIES) {
-		if (try_pick_next_cgroup(&cpuc->cur_cgid)) {
+		if (try_pick_next_cgroup(&cpuc->cur_cgid, shard_idx, shard_idx)) {
 			picked_next = true;
 			break;
 		}
 	}
 
+	/* the local shard is empty, steal from the others in order */
+	bpf_for(i, 1, nr_shards) {
+		u32 src_idx = (shard_idx + i) % nr_shards;
+
+		if (!picked_next || cpuc->cur_cgid)
+			break;
+
+		picked_next = false;
+		bpf_repeat(CGROUP_MAX_RETRIES) {
+			if (try_pick_next_cgroup(&cpuc->cur_cgid, src_idx,
+						 shard_idx)) {
+				picked_next = true;
+				break;
+			}
+		}
+	}
+
+	if (picked_next && !cpuc->cur_cgid)
+		stat_inc(FCG_STAT_PNC_NO_CGRP);
+
+	if (picked_next && cpuc->cur_cgid)
+		consume_batch(cpuc, now);
+
 	/*
 	 * This only happens if try_pick_next_cgroup() races against enqueue
 	 * path for more than CGROUP_MAX_RETRIES times, which is extremely
@@ -791,6 +1143,15 @@ pick_next_cgroup:
 	 */
 	if (!picked_next)
 		stat_inc(FCG_STAT_PNC_FAIL);
+
+	/*
+	 * Nothing to run and the CPU is about to go idle. Don't leave the
+	 * deactivations pending for an unbounded amount of time.
+	 */
+	if (!cpuc->cur_cgid && cpuc->nr_deacts)
+		flush_deacts(cpuc);
+out:
+	bench_end(FCG_STAT_BENCH_DISPATCH, now);
 }
 
 s32 BPF_STRUCT_OPS(fcg_init_task, struct task_struct *p,
@@ -891,11 +1252,20 @@ err_destroy_dsq:
 
 void BPF_STRUCT_OPS(fcg_cgroup_exit, struct cgroup *cgrp)
 {
+	struct fcg_cgrp_ctx *cgc;
 	u64 cgid = cgrp->kn->id;
 
 	/*
-	 * For now, there's no way find and remove the cgv_node if it's on the
-	 * cgv_tree. Let's drain them in the dispatch path as they get popped
+	 * A deferred deactivation can't be flushed once the cgroup is gone.
+	 * Apply it now so that the parent's weight sum doesn't leak.
+	 */
+	cgc = bpf_cgrp_storage_get(&cgrp_ctx, cgrp, 0, 0);
+	if (cgc && __sync_val_compare_and_swap(&cgc->deact_pending, 1, 0))
+		propagate_active(cgrp, cgc, false);
+
+	/*
+	 * For now, there's no way find and remove the cgv_node if it's on a
+	 * cgv_shard. Let's drain them in the dispatch path as they get popped
 	 * off the front of the tree.
 	 */
 	bpf_map_delete_elem(&cgv_node_stash, &cgid);
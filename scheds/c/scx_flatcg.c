@@ -12,6 +12,9 @@
 #include <inttypes.h>
 #include <fcntl.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <bpf/bpf.h>
 #include <scx/common.h>
 #include "scx_flatcg.h"
@@ -21,15 +24,25 @@
 #define FILEID_KERNFS		0xfe
 #endif
 
+#define BENCH_CGRP_ROOT		"/sys/fs/cgroup/scx_flatcg_bench"
+#define BENCH_NR_PAIRS		4
+
 const char help_fmt[] =
 "A flattened cgroup hierarchy sched_ext scheduler.\n"
 "\n"
 "See the top-level comment in .bpf.c for more details.\n"
 "\n"
-"Usage: %s [-s SLICE_US] [-i INTERVAL] [-f] [-v]\n"
+"Usage: %s [-s SLICE_US] [-i INTERVAL] [-D DELAY_US] [-B BATCH] [-b DEPTH] [-g]\n"
+"       [-l] [-f] [-v]\n"
 "\n"
 "  -s SLICE_US   Override slice duration\n"
 "  -i INTERVAL   Report interval\n"
+"  -D DELAY_US   Max delay for folding in cgroup deactivations, 0 to disable\n"
+"  -B BATCH      Max tasks moved from the current cgroup per dispatch (default 1)\n"
+"  -b DEPTH      Benchmark runnable/quiescent/dispatch cost for nesting depths\n"
+"                1 to DEPTH, one INTERVAL each, and exit\n"
+"  -g            Use a single global cgroup rbtree instead of per-LLC shards\n"
+"  -l            Measure the time spent acquiring and holding the shard locks\n"
 "  -f            Use FIFO scheduling instead of weighted vtime scheduling\n"
 "  -v            Print libbpf debug messages\n"
 "  -h            Display this help and exit\n";
@@ -118,14 +131,205 @@ static void fcg_read_stats(struct scx_flatcg *skel, __u64 *stats)
 	}
 }
 
+static int write_cgrp_file(const char *dir, const char *file, const char *buf)
+{
+	char path[PATH_MAX];
+	ssize_t len = strlen(buf);
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, buf, len) != len)
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+/*
+ * Create a chain of @depth nested cgroups with the cpu controller enabled all
+ * the way down starting at BENCH_CGRP_ROOT. The path of the innermost cgroup is
+ * returned in @leaf.
+ */
+static int bench_create_cgrps(int depth, char *leaf, size_t leaf_len)
+{
+	int level, ret;
+
+	snprintf(leaf, leaf_len, "%s", BENCH_CGRP_ROOT);
+	ret = write_cgrp_file("/sys/fs/cgroup", "cgroup.subtree_control", "+cpu");
+	if (ret)
+		return ret;
+
+	for (level = 1; level <= depth; level++) {
+		if (level > 1) {
+			ret = write_cgrp_file(leaf, "cgroup.subtree_control", "+cpu");
+			if (ret)
+				return ret;
+			if (strlen(leaf) + 5 >= leaf_len)
+				return -ENAMETOOLONG;
+			sprintf(leaf + strlen(leaf), "/l%d", level);
+		}
+		if (mkdir(leaf, 0755) && errno != EEXIST)
+			return -errno;
+	}
+	return 0;
+}
+
+static void bench_destroy_cgrps(int depth)
+{
+	char path[PATH_MAX];
+	int level;
+
+	for (; depth > 0; depth--) {
+		snprintf(path, sizeof(path), "%s", BENCH_CGRP_ROOT);
+		for (level = 2; level <= depth; level++)
+			sprintf(path + strlen(path), "/l%d", level);
+		rmdir(path);
+	}
+}
+
+static pid_t bench_spawn(const char *leaf, int rfd, int wfd, bool kick)
+{
+	char buf[32];
+	pid_t pid;
+	char c = 0;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	snprintf(buf, sizeof(buf), "%d", getpid());
+	if (write_cgrp_file(leaf, "cgroup.procs", buf))
+		_exit(1);
+
+	/* bounce a byte back and forth to go through sleep/wakeup constantly */
+	if (kick && write(wfd, &c, 1) != 1)
+		_exit(1);
+	while (read(rfd, &c, 1) == 1)
+		if (write(wfd, &c, 1) != 1)
+			break;
+	_exit(0);
+}
+
+/*
+ * Run BENCH_NR_PAIRS pairs of ping-pong tasks in cgroups nested 1 to
+ * @max_depth levels deep and report how much runnable, quiescent and dispatch
+ * cost on average at each depth.
+ */
+static void run_bench(struct scx_flatcg *skel, int max_depth,
+		      struct timespec *intv_ts)
+{
+	int depth;
+
+	printf("\n%5s %12s %12s %12s %10s %10s %10s\n", "depth",
+	       "runnable_ns", "quiescent_ns", "dispatch_ns", "act", "deact",
+	       "cancel");
+
+	for (depth = 1; depth <= max_depth && !exit_req; depth++) {
+		__u64 before[FCG_NR_STATS], after[FCG_NR_STATS], d[FCG_NR_STATS];
+		pid_t pids[BENCH_NR_PAIRS * 2];
+		char leaf[PATH_MAX];
+		int i, ret, nr_pids = 0;
+
+		ret = bench_create_cgrps(depth, leaf, sizeof(leaf));
+		if (ret) {
+			fprintf(stderr, "failed to create bench cgroups (%d)\n", ret);
+			bench_destroy_cgrps(depth);
+			return;
+		}
+
+		for (i = 0; i < BENCH_NR_PAIRS; i++) {
+			int ping[2], pong[2];
+
+			if (pipe(ping) || pipe(pong)) {
+				perror("pipe");
+				break;
+			}
+			pids[nr_pids++] = bench_spawn(leaf, ping[0], pong[1], true);
+			pids[nr_pids++] = bench_spawn(leaf, pong[0], ping[1], false);
+			close(ping[0]);
+			close(ping[1]);
+			close(pong[0]);
+			close(pong[1]);
+		}
+
+		/* let the workers settle into their cgroup before measuring */
+		usleep(100 * 1000);
+		fcg_read_stats(skel, before);
+		nanosleep(intv_ts, NULL);
+		fcg_read_stats(skel, after);
+
+		for (i = 0; i < nr_pids; i++) {
+			if (pids[i] > 0) {
+				kill(pids[i], SIGKILL);
+				waitpid(pids[i], NULL, 0);
+			}
+		}
+		bench_destroy_cgrps(depth);
+
+		for (i = 0; i < FCG_NR_STATS; i++)
+			d[i] = after[i] - before[i];
+
+		printf("%5d %12.1lf %12.1lf %12.1lf %10llu %10llu %10llu\n", depth,
+		       (double)d[FCG_STAT_BENCH_RUNNABLE_NS] /
+		       (d[FCG_STAT_BENCH_RUNNABLE] ?: 1),
+		       (double)d[FCG_STAT_BENCH_QUIESCENT_NS] /
+		       (d[FCG_STAT_BENCH_QUIESCENT] ?: 1),
+		       (double)d[FCG_STAT_BENCH_DISPATCH_NS] /
+		       (d[FCG_STAT_BENCH_DISPATCH] ?: 1),
+		       d[FCG_STAT_ACT], d[FCG_STAT_DEACT],
+		       d[FCG_STAT_DEACT_CANCEL]);
+		fflush(stdout);
+	}
+}
+
+/*
+ * Shard the cgroup rbtree by the last level cache.
+ */
+static void init_shards(struct scx_flatcg *skel)
+{
+	int nr_cpus = skel->rodata->nr_cpus;
+
+	skel->rodata->nr_shards = scx_read_cpu_llc_ids(skel->rodata->cpu_shards,
+						       nr_cpus < FCG_MAX_CPUS ? nr_cpus : FCG_MAX_CPUS,
+						       FCG_MAX_SHARDS);
+}
+
+static void fcg_read_shard_stats(struct scx_flatcg *skel,
+				 struct fcg_shard_stat *stats)
+{
+	struct fcg_shard_stat cnts[skel->rodata->nr_cpus];
+	__u32 idx;
+
+	memset(stats, 0, sizeof(stats[0]) * skel->rodata->nr_shards);
+
+	for (idx = 0; idx < skel->rodata->nr_shards; idx++) {
+		int ret, cpu;
+
+		ret = bpf_map_lookup_elem(bpf_map__fd(skel->maps.shard_stats),
+					  &idx, cnts);
+		if (ret < 0)
+			continue;
+		for (cpu = 0; cpu < skel->rodata->nr_cpus; cpu++) {
+			stats[idx].nr_locks += cnts[cpu].nr_locks;
+			stats[idx].lock_ns += cnts[cpu].lock_ns;
+			stats[idx].nr_steals += cnts[cpu].nr_steals;
+		}
+	}
+}
+
 int main(int argc, char **argv)
 {
 	struct scx_flatcg *skel;
 	struct bpf_link *link;
 	struct timespec intv_ts = { .tv_sec = 2, .tv_nsec = 0 };
 	bool dump_cgrps = false;
+	int bench_depth = 0;
 	__u64 last_cpu_sum = 0, last_cpu_idle = 0;
 	__u64 last_stats[FCG_NR_STATS] = {};
+	struct fcg_shard_stat last_shard_stats[FCG_MAX_SHARDS] = {};
+	bool global_tree = false;
 	unsigned long seq = 0;
 	__s32 opt;
 	__u64 ecode;
@@ -138,7 +342,7 @@ restart:
 
 	skel->rodata->nr_cpus = libbpf_num_possible_cpus();
 
-	while ((opt = getopt(argc, argv, "s:i:dfvh")) != -1) {
+	while ((opt = getopt(argc, argv, "s:i:dD:B:b:glfvh")) != -1) {
 		double v;
 
 		switch (opt) {
@@ -154,6 +358,23 @@ restart:
 		case 'd':
 			dump_cgrps = true;
 			break;
+		case 'D':
+			v = strtod(optarg, NULL);
+			skel->rodata->deact_delay_ns = v * 1000;
+			break;
+		case 'B':
+			skel->rodata->cgrp_batch = strtoul(optarg, NULL, 0) ?: 1;
+			break;
+		case 'b':
+			bench_depth = strtol(optarg, NULL, 0);
+			skel->rodata->bench = bench_depth > 0;
+			break;
+		case 'g':
+			global_tree = true;
+			break;
+		case 'l':
+			skel->rodata->lock_stats = true;
+			break;
 		case 'f':
 			skel->rodata->fifo_sched = true;
 			break;
@@ -167,17 +388,26 @@ restart:
 		}
 	}
 
-	printf("slice=%.1lfms intv=%.1lfs dump_cgrps=%d",
+	if (!global_tree)
+		init_shards(skel);
+
+	printf("slice=%.1lfms intv=%.1lfs dump_cgrps=%d shards=%u",
 	       (double)skel->rodata->cgrp_slice_ns / 1000000.0,
 	       (double)intv_ts.tv_sec + (double)intv_ts.tv_nsec / 1000000000.0,
-	       dump_cgrps);
+	       dump_cgrps, skel->rodata->nr_shards);
 
 	SCX_OPS_LOAD(skel, flatcg_ops, scx_flatcg, uei);
 	link = SCX_OPS_ATTACH(skel, flatcg_ops, scx_flatcg);
 
+	if (bench_depth > 0) {
+		run_bench(skel, bench_depth, &intv_ts);
+		exit_req = 1;
+	}
+
 	while (!exit_req && !UEI_EXITED(skel, uei)) {
 		__u64 acc_stats[FCG_NR_STATS];
 		__u64 stats[FCG_NR_STATS];
+		struct fcg_shard_stat shard_stats[FCG_MAX_SHARDS];
 		float cpu_util;
 		int i;
 
@@ -196,6 +426,10 @@ restart:
 		       stats[FCG_STAT_DEACT],
 		       stats[FCG_STAT_GLOBAL],
 		       stats[FCG_STAT_LOCAL]);
+		printf("DFR cancel:%6llu  flush:%6llu   race:%6llu\n",
+		       stats[FCG_STAT_DEACT_CANCEL],
+		       stats[FCG_STAT_DEACT_FLUSH],
+		       stats[FCG_STAT_DEACT_RACE]);
 		printf("HWT  cache:%6llu update:%6llu   skip:%6llu  race:%6llu\n",
 		       stats[FCG_STAT_HWT_CACHE],
 		       stats[FCG_STAT_HWT_UPDATES],
@@ -204,11 +438,12 @@ restart:
 		printf("ENQ   skip:%6llu   race:%6llu\n",
 		       stats[FCG_STAT_ENQ_SKIP],
 		       stats[FCG_STAT_ENQ_RACE]);
-		printf("CNS   keep:%6llu expire:%6llu  empty:%6llu  gone:%6llu\n",
+		printf("CNS   keep:%6llu expire:%6llu  empty:%6llu  gone:%6llu batch:%6llu\n",
 		       stats[FCG_STAT_CNS_KEEP],
 		       stats[FCG_STAT_CNS_EXPIRE],
 		       stats[FCG_STAT_CNS_EMPTY],
-		       stats[FCG_STAT_CNS_GONE]);
+		       stats[FCG_STAT_CNS_GONE],
+		       stats[FCG_STAT_CNS_BATCH]);
 		printf("PNC   next:%6llu  empty:%6llu nocgrp:%6llu  gone:%6llu race:%6llu fail:%6llu\n",
 		       stats[FCG_STAT_PNC_NEXT],
 		       stats[FCG_STAT_PNC_EMPTY],
@@ -216,8 +451,26 @@ restart:
 		       stats[FCG_STAT_PNC_GONE],
 		       stats[FCG_STAT_PNC_RACE],
 		       stats[FCG_STAT_PNC_FAIL]);
+		printf("TRE    pop:%6llu pop/task:%6.3lf\n",
+		       stats[FCG_STAT_TREE_POP],
+		       (double)stats[FCG_STAT_TREE_POP] /
+		       ((stats[FCG_STAT_CNS_KEEP] + stats[FCG_STAT_CNS_BATCH] +
+			 stats[FCG_STAT_PNC_NEXT]) ?: 1));
 		printf("BAD remove:%6llu\n",
 		       acc_stats[FCG_STAT_BAD_REMOVAL]);
+
+		fcg_read_shard_stats(skel, shard_stats);
+		for (i = 0; i < skel->rodata->nr_shards; i++) {
+			struct fcg_shard_stat *cur = &shard_stats[i];
+			struct fcg_shard_stat *last = &last_shard_stats[i];
+			__u64 nr_locks = cur->nr_locks - last->nr_locks;
+
+			printf("SHD %3d  locks:%8llu lock_ns:%8.1lf steals:%6llu\n",
+			       i, nr_locks,
+			       (double)(cur->lock_ns - last->lock_ns) / (nr_locks ?: 1),
+			       cur->nr_steals - last->nr_steals);
+			*last = *cur;
+		}
 		fflush(stdout);
 
 		nanosleep(&intv_ts, NULL);
@@ -3,11 +3,17 @@
 
 enum {
 	FCG_HWEIGHT_ONE		= 1LLU << 16,
+	FCG_DEACT_BATCH		= 16,
+	FCG_MAX_CPUS		= 1024,
+	FCG_MAX_SHARDS		= 64,
 };
 
 enum fcg_stat_idx {
 	FCG_STAT_ACT,
 	FCG_STAT_DEACT,
+	FCG_STAT_DEACT_CANCEL,
+	FCG_STAT_DEACT_FLUSH,
+	FCG_STAT_DEACT_RACE,
 	FCG_STAT_LOCAL,
 	FCG_STAT_GLOBAL,
 
@@ -23,6 +29,7 @@ enum fcg_stat_idx {
 	FCG_STAT_CNS_EXPIRE,
 	FCG_STAT_CNS_EMPTY,
 	FCG_STAT_CNS_GONE,
+	FCG_STAT_CNS_BATCH,
 
 	FCG_STAT_PNC_NO_CGRP,
 	FCG_STAT_PNC_NEXT,
@@ -30,18 +37,35 @@ enum fcg_stat_idx {
 	FCG_STAT_PNC_GONE,
 	FCG_STAT_PNC_RACE,
 	FCG_STAT_PNC_FAIL,
+	FCG_STAT_TREE_POP,
 
 	FCG_STAT_BAD_REMOVAL,
 
+	/* only updated in benchmark mode, count followed by total ns */
+	FCG_STAT_BENCH_RUNNABLE,
+	FCG_STAT_BENCH_RUNNABLE_NS,
+	FCG_STAT_BENCH_QUIESCENT,
+	FCG_STAT_BENCH_QUIESCENT_NS,
+	FCG_STAT_BENCH_DISPATCH,
+	FCG_STAT_BENCH_DISPATCH_NS,
+
 	FCG_NR_STATS,
 };
 
+/* per-shard, per-CPU stats */
+struct fcg_shard_stat {
+	u64			nr_locks;
+	u64			lock_ns;	/* wait + hold, only with lock_stats */
+	u64			nr_steals;
+};
+
 struct fcg_cgrp_ctx {
 	u32			nr_active;
 	u32			nr_runnable;
 	u32			queued;
 	u32			weight;
 	u32			hweight;
+	u32			deact_pending;
 	u64			child_weight_sum;
 	u64			hweight_gen;
 	s64			cvtime_delta;
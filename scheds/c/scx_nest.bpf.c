@@ -13,6 +13,15 @@
  * - More robust task placement policies.
  * - Termination notification for userspace.
  *
+ * Nest growth is driven by the measured utilization of the primary cores. A
+ * task whose previous primary core has recently been saturated expands the
+ * primary nest right away instead of waiting to become impatient, and idle
+ * cores are searched for in the LLC of the task's previous CPU before the rest
+ * of the machine. The delay before an unused primary core is compacted can
+ * scale with its recent utilization and back off when cores bounce in and out
+ * of the primary nest. The utilization-driven growth and the delay scaling
+ * are both opt-in.
+ *
  * While rather simple, this scheduler should work reasonably well on CPUs with
  * a uniform L3 cache topology. While preemption is not implemented, the fact
  * that the scheduling queue is shared across all CPUs means that whatever is
@@ -39,6 +48,9 @@ enum {
 	NSEC_PER_MSEC		= USEC_PER_MSEC * NSEC_PER_USEC,
 	USEC_PER_SEC		= USEC_PER_MSEC * MSEC_PER_SEC,
 	NSEC_PER_SEC		= NSEC_PER_USEC * USEC_PER_SEC,
+
+	UTIL_WINDOW_NS		= 4 * NSEC_PER_MSEC,
+	MAX_BACKOFF_SHIFT	= 3,
 };
 
 #define CLOCK_BOOTTIME 7
@@ -51,9 +63,14 @@ const volatile u64 slice_ns = SCX_SLICE_DFL;
 const volatile bool find_fully_idle = false;
 const volatile u64 sampling_cadence_ns = 1 * NSEC_PER_SEC;
 const volatile u64 r_depth = 5;
+const volatile u64 p_remove_max_ns = 0;	/* <= p_remove_ns to disable scaling */
+const volatile u32 grow_util_thresh = 0;	/* 0 to disable */
+const volatile u32 nr_llcs = 1;
+const volatile u32 cpu_llc_id[NEST_MAX_CPUS];
 
 // Used for stats tracking. May be stale at any given time.
 u64 stats_primary_mask, stats_reserved_mask, stats_other_mask, stats_idle_mask;
+u64 stats_primary_util;
 
 // Used for internal tracking.
 static s32 nr_reserved;
@@ -107,11 +124,31 @@ struct pcpu_ctx {
 
 	/* Whether the current core has been scheduled for compaction. */
 	bool scheduled_compaction;
+
+	/*
+	 * The number of times the compaction delay is doubled. Bumped when the
+	 * core is promoted back into the primary nest soon after having been
+	 * compacted, and decayed on every compaction.
+	 */
+	u32 backoff;
+
+	/*
+	 * Utilization of the core in NEST_UTIL_ONE units, averaged over
+	 * UTIL_WINDOW_NS windows. Only updated when tasks stop running on the
+	 * core, see cpu_util() for how idle windows are accounted for.
+	 */
+	u32 util;
+	u64 running_at;
+	u64 busy_ns;
+	u64 window_at;
+
+	/* When the core was last compacted from the primary nest. */
+	u64 compacted_at;
 };
 
 struct {
 	__uint(type, BPF_MAP_TYPE_ARRAY);
-	__uint(max_entries, 1024);
+	__uint(max_entries, NEST_MAX_CPUS);
 	__type(key, s32);
 	__type(value, struct pcpu_ctx);
 } pcpu_ctxs SEC(".maps");
@@ -132,6 +169,17 @@ const volatile u32 nr_cpus = 1; /* !0 for veristat, set during init. */
 private(NESTS) struct bpf_cpumask __kptr *primary_cpumask;
 private(NESTS) struct bpf_cpumask __kptr *reserve_cpumask;
 
+struct llc_ctx {
+	struct bpf_cpumask __kptr *cpumask;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, NEST_MAX_LLCS);
+	__type(key, u32);
+	__type(value, struct llc_ctx);
+} llc_ctxs SEC(".maps");
+
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
 	__uint(key_size, sizeof(u32));
@@ -157,6 +205,119 @@ static const struct cpumask *cast_mask(struct bpf_cpumask *mask)
 	return (const struct cpumask *)mask;
 }
 
+/*
+ * Returns the cpumask of @cpu's LLC, or NULL if the scheduler isn't
+ * topology-aware. Must be called while holding the RCU read lock.
+ */
+static __always_inline struct bpf_cpumask *lookup_llc_mask(s32 cpu)
+{
+	struct llc_ctx *llcc;
+	u32 llc;
+
+	if (nr_llcs <= 1 || cpu < 0 || cpu >= NEST_MAX_CPUS)
+		return NULL;
+
+	llc = cpu_llc_id[cpu];
+	llcc = bpf_map_lookup_elem(&llc_ctxs, &llc);
+	if (!llcc)
+		return NULL;
+
+	return llcc->cpumask;
+}
+
+static s32 pick_idle_cpu(const struct cpumask *cpumask, bool fully_idle)
+{
+	s32 cpu;
+
+	if (fully_idle) {
+		cpu = scx_bpf_pick_idle_cpu(cpumask, SCX_PICK_IDLE_CORE);
+		if (cpu >= 0)
+			return cpu;
+	}
+
+	return scx_bpf_pick_idle_cpu(cpumask, 0);
+}
+
+/*
+ * The utilization is only updated when a task stops running on the core, so a
+ * core which has been idle for a while still reports the utilization of its
+ * last busy window. Halve it for every window that went by without an update.
+ */
+static u32 cpu_util(struct pcpu_ctx *pcpu_ctx, u64 now)
+{
+	u64 elapsed = now - pcpu_ctx->window_at;
+	u64 missed;
+
+	if (elapsed < 2 * UTIL_WINDOW_NS)
+		return pcpu_ctx->util;
+
+	missed = elapsed / UTIL_WINDOW_NS - 1;
+	if (missed >= 10)
+		return 0;
+	return pcpu_ctx->util >> missed;
+}
+
+static void update_util(struct pcpu_ctx *pcpu_ctx, u64 now)
+{
+	u64 elapsed, busy;
+
+	if (pcpu_ctx->running_at) {
+		pcpu_ctx->busy_ns += now - pcpu_ctx->running_at;
+		pcpu_ctx->running_at = 0;
+	}
+
+	elapsed = now - pcpu_ctx->window_at;
+	if (elapsed < UTIL_WINDOW_NS)
+		return;
+
+	busy = pcpu_ctx->busy_ns < elapsed ? pcpu_ctx->busy_ns : elapsed;
+	pcpu_ctx->util = (cpu_util(pcpu_ctx, now) +
+			  busy * NEST_UTIL_ONE / elapsed) / 2;
+	pcpu_ctx->busy_ns = 0;
+	pcpu_ctx->window_at = now;
+}
+
+/*
+ * Whether @cpu is a primary core which has recently been too busy to be
+ * shared with another task.
+ */
+static bool cpu_saturated(s32 cpu, struct bpf_cpumask *primary)
+{
+	struct pcpu_ctx *pcpu_ctx;
+
+	if (!grow_util_thresh || !bpf_cpumask_test_cpu(cpu, cast_mask(primary)))
+		return false;
+
+	pcpu_ctx = bpf_map_lookup_elem(&pcpu_ctxs, &cpu);
+	if (!pcpu_ctx)
+		return false;
+
+	return cpu_util(pcpu_ctx, bpf_ktime_get_ns()) >= grow_util_thresh;
+}
+
+/*
+ * How long an unused primary core is kept in the nest before being compacted.
+ * Busy cores are likely to be needed again soon, so the delay is scaled from
+ * p_remove_ns up to p_remove_max_ns with the core's utilization, and doubled
+ * for each backoff step to stop the nest from thrashing under bursty loads.
+ * The backoff can double the delay up to MAX_BACKOFF_SHIFT times, but the
+ * result never exceeds p_remove_max_ns. If p_remove_max_ns isn't above
+ * p_remove_ns, the delay is always p_remove_ns.
+ */
+static u64 compaction_delay(struct pcpu_ctx *pcpu_ctx)
+{
+	u64 delay = p_remove_ns;
+
+	if (p_remove_max_ns <= p_remove_ns)
+		return delay;
+
+	delay += (p_remove_max_ns - p_remove_ns) *
+		cpu_util(pcpu_ctx, bpf_ktime_get_ns()) / NEST_UTIL_ONE;
+	delay <<= pcpu_ctx->backoff;
+
+	return delay < p_remove_max_ns ? delay : p_remove_max_ns;
+}
+
 static __always_inline void
 try_make_core_reserved(s32 cpu, struct bpf_cpumask * reserved, bool promotion)
 {
@@ -224,17 +385,21 @@ static int compact_primary_core(void *map, int *key, struct bpf_timer *timer)
 	try_make_core_reserved(cpu, reserve, false);
 	bpf_rcu_read_unlock();
 	pcpu_ctx->scheduled_compaction = false;
+	pcpu_ctx->compacted_at = bpf_ktime_get_ns();
+	if (pcpu_ctx->backoff)
+		pcpu_ctx->backoff--;
 	return 0;
 }
 
 s32 BPF_STRUCT_OPS(nest_select_cpu, struct task_struct *p, s32 prev_cpu,
 		   u64 wake_flags)
 {
-	struct bpf_cpumask *p_mask, *primary, *reserve;
+	struct bpf_cpumask *p_mask, *primary, *reserve, *llc;
 	s32 cpu;
 	struct task_ctx *tctx;
 	struct pcpu_ctx *pcpu_ctx;
 	bool direct_to_primary = false, reset_impatient = true;
+	bool saturated = false, promoted = false;
 
 	tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
 	if (!tctx)
@@ -250,6 +415,7 @@ s32 BPF_STRUCT_OPS(nest_select_cpu, struct task_struct *p, s32 prev_cpu,
 	}
 
 	tctx->prev_cpu = prev_cpu;
+	llc = lookup_llc_mask(prev_cpu);
 
 	bpf_cpumask_and(p_mask, p->cpus_ptr, cast_mask(primary));
 
@@ -274,6 +440,17 @@ s32 BPF_STRUCT_OPS(nest_select_cpu, struct task_struct *p, s32 prev_cpu,
 		goto migrate_primary;
 	}
 
+	/* Then try an idle core in primary that shares the previous CPU's LLC. */
+	if (llc) {
+		bpf_cpumask_and(p_mask, cast_mask(p_mask), cast_mask(llc));
+		cpu = pick_idle_cpu(cast_mask(p_mask), find_fully_idle);
+		if (cpu >= 0) {
+			stat_inc(NEST_STAT(WAKEUP_LLC_PRIMARY));
+			goto migrate_primary;
+		}
+		bpf_cpumask_and(p_mask, p->cpus_ptr, cast_mask(primary));
+	}
+
 	if (find_fully_idle) {
 		/* Then try any fully idle core in primary. */
 		cpu = scx_bpf_pick_idle_cpu(cast_mask(p_mask),
@@ -291,7 +468,17 @@ s32 BPF_STRUCT_OPS(nest_select_cpu, struct task_struct *p, s32 prev_cpu,
 		goto migrate_primary;
 	}
 
-	if (r_impatient > 0 && ++tctx->prev_misses >= r_impatient) {
+	/*
+	 * If the previous core is saturated, the primary nest is too small for
+	 * the current load. Grow it right away and look for a core whose
+	 * hypertwin is idle so that the new primary core runs at full speed.
+	 */
+	if (cpu_saturated(prev_cpu, primary)) {
+		saturated = true;
+		direct_to_primary = true;
+		tctx->prev_misses = 0;
+		stat_inc(NEST_STAT(TASK_SATURATED));
+	} else if (r_impatient > 0 && ++tctx->prev_misses >= r_impatient) {
 		direct_to_primary = true;
 		tctx->prev_misses = 0;
 		stat_inc(NEST_STAT(TASK_IMPATIENT));
@@ -299,9 +486,21 @@ s32 BPF_STRUCT_OPS(nest_select_cpu, struct task_struct *p, s32 prev_cpu,
 
 	reset_impatient = false;
 
+	/* Then try an idle core in reserve that shares the previous CPU's LLC. */
+	if (llc) {
+		bpf_cpumask_and(p_mask, p->cpus_ptr, cast_mask(reserve));
+		bpf_cpumask_and(p_mask, cast_mask(p_mask), cast_mask(llc));
+		cpu = pick_idle_cpu(cast_mask(p_mask),
+				    find_fully_idle || saturated);
+		if (cpu >= 0) {
+			stat_inc(NEST_STAT(WAKEUP_LLC_RESERVE));
+			goto promote_to_primary;
+		}
+	}
+
 	/* Then try any fully idle core in reserve. */
 	bpf_cpumask_and(p_mask, p->cpus_ptr, cast_mask(reserve));
-	if (find_fully_idle) {
+	if (find_fully_idle || saturated) {
 		cpu = scx_bpf_pick_idle_cpu(cast_mask(p_mask),
 					    SCX_PICK_IDLE_CORE);
 		if (cpu >= 0) {
@@ -317,8 +516,19 @@ s32 BPF_STRUCT_OPS(nest_select_cpu, struct task_struct *p, s32 prev_cpu,
 		goto promote_to_primary;
 	}
 
-	/* Then try _any_ idle core in the task's cpumask. */
-	cpu = scx_bpf_pick_idle_cpu(p->cpus_ptr, 0);
+	/*
+	 * Then try _any_ idle core in the task's cpumask, starting with the
+	 * previous CPU's LLC.
+	 */
+	cpu = -ENOENT;
+	if (llc) {
+		bpf_cpumask_and(p_mask, p->cpus_ptr, cast_mask(llc));
+		cpu = pick_idle_cpu(cast_mask(p_mask), saturated);
+		if (cpu >= 0)
+			stat_inc(NEST_STAT(WAKEUP_LLC_OTHER));
+	}
+	if (cpu < 0)
+		cpu = pick_idle_cpu(p->cpus_ptr, saturated);
 	if (cpu >= 0) {
 		/*
 		 * We found a core that (we didn't _think_) is in any nest.
@@ -357,11 +567,23 @@ s32 BPF_STRUCT_OPS(nest_select_cpu, struct task_struct *p, s32 prev_cpu,
 
 promote_to_primary:
 	stat_inc(NEST_STAT(PROMOTED_TO_PRIMARY));
+	promoted = true;
 migrate_primary:
 	if (reset_impatient)
 		tctx->prev_misses = 0;
 	pcpu_ctx = bpf_map_lookup_elem(&pcpu_ctxs, &cpu);
 	if (pcpu_ctx) {
+		/*
+		 * The core was compacted too early. Keep it in the primary
+		 * nest for longer the next time it goes unused.
+		 */
+		if (promoted && pcpu_ctx->compacted_at &&
+		    bpf_ktime_get_ns() - pcpu_ctx->compacted_at < p_remove_max_ns &&
+		    pcpu_ctx->backoff < MAX_BACKOFF_SHIFT) {
+			pcpu_ctx->backoff++;
+			stat_inc(NEST_STAT(COMPACTION_BACKOFF));
+		}
+
 		if (pcpu_ctx->scheduled_compaction) {
 			if (bpf_timer_cancel(&pcpu_ctx->timer) < 0)
 				scx_bpf_error("Failed to cancel pcpu timer");
@@ -467,10 +689,11 @@ void BPF_STRUCT_OPS(nest_dispatch, s32 cpu, struct task_struct *prev)
 				pcpu_ctx->scheduled_compaction = true;
 				/*
 				 * The core isn't being used anymore. Set a
-				 * timer to remove the core from the nest in
-				 * p_remove if it's still unused by that point.
+				 * timer to remove the core from the nest if
+				 * it's still unused by that point.
 				 */
-				bpf_timer_start(&pcpu_ctx->timer, p_remove_ns,
+				bpf_timer_start(&pcpu_ctx->timer,
+						compaction_delay(pcpu_ctx),
 						BPF_F_TIMER_CPU_PIN);
 				stat_inc(NEST_STAT(SCHEDULED_COMPACTION));
 			}
@@ -488,14 +711,28 @@ void BPF_STRUCT_OPS(nest_running, struct task_struct *p)
 	 * thus racy. Any error should be contained and temporary. Let's just
 	 * live with it.
 	 */
+	s32 cpu = bpf_get_smp_processor_id();
+	struct pcpu_ctx *pcpu_ctx;
+
 	if (vtime_before(vtime_now, p->scx.dsq_vtime))
 		vtime_now = p->scx.dsq_vtime;
+
+	pcpu_ctx = bpf_map_lookup_elem(&pcpu_ctxs, &cpu);
+	if (pcpu_ctx)
+		pcpu_ctx->running_at = bpf_ktime_get_ns();
 }
 
 void BPF_STRUCT_OPS(nest_stopping, struct task_struct *p, bool runnable)
 {
+	s32 cpu = bpf_get_smp_processor_id();
+	struct pcpu_ctx *pcpu_ctx;
+
 	/* scale the execution time by the inverse of the weight and charge */
 	p->scx.dsq_vtime += (slice_ns - p->scx.slice) * 100 / p->scx.weight;
+
+	pcpu_ctx = bpf_map_lookup_elem(&pcpu_ctxs, &cpu);
+	if (pcpu_ctx)
+		update_util(pcpu_ctx, bpf_ktime_get_ns());
 }
 
 s32 BPF_STRUCT_OPS(nest_init_task, struct task_struct *p,
@@ -541,6 +778,7 @@ static int stats_timerfn(void *map, int *key, struct bpf_timer *timer)
 	stats_reserved_mask = 0;
 	stats_other_mask = 0;
 	stats_idle_mask = 0;
+	u64 now = bpf_ktime_get_ns(), util_sum = 0, nr_primary = 0;
 	long err;
 
 	bpf_rcu_read_lock();
@@ -554,9 +792,15 @@ static int stats_timerfn(void *map, int *key, struct bpf_timer *timer)
 
 	idle = scx_bpf_get_idle_cpumask();
 	bpf_for(cpu, 0, nr_cpus) {
-		if (bpf_cpumask_test_cpu(cpu, cast_mask(primary)))
+		if (bpf_cpumask_test_cpu(cpu, cast_mask(primary))) {
+			struct pcpu_ctx *pcpu_ctx;
+
 			stats_primary_mask |= (1ULL << cpu);
-		else if (bpf_cpumask_test_cpu(cpu, cast_mask(reserve)))
+			pcpu_ctx = bpf_map_lookup_elem(&pcpu_ctxs, &cpu);
+			if (pcpu_ctx)
+				util_sum += cpu_util(pcpu_ctx, now);
+			nr_primary++;
+		} else if (bpf_cpumask_test_cpu(cpu, cast_mask(reserve)))
 			stats_reserved_mask |= (1ULL << cpu);
 		else
 			stats_other_mask |= (1ULL << cpu);
@@ -566,6 +810,7 @@ static int stats_timerfn(void *map, int *key, struct bpf_timer *timer)
 	}
 	bpf_rcu_read_unlock();
 	scx_bpf_put_idle_cpumask(idle);
+	stats_primary_util = nr_primary ? util_sum * 100 / NEST_UTIL_ONE / nr_primary : 0;
 
 	err = bpf_timer_start(timer, sampling_cadence_ns - 5000, 0);
 	if (err)
@@ -578,6 +823,7 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(nest_init)
 {
 	struct bpf_cpumask *cpumask;
 	s32 cpu;
+	u32 llc;
 	int err;
 	struct bpf_timer *timer;
 	u32 key = 0;
@@ -605,6 +851,30 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(nest_init)
 	if (cpumask)
 		bpf_cpumask_release(cpumask);
 
+	bpf_for(llc, 0, nr_llcs) {
+		struct llc_ctx *llcc;
+
+		cpumask = bpf_cpumask_create();
+		if (!cpumask)
+			return -ENOMEM;
+
+		bpf_cpumask_clear(cpumask);
+		bpf_for(cpu, 0, nr_cpus) {
+			if (cpu < NEST_MAX_CPUS && cpu_llc_id[cpu] == llc)
+				bpf_cpumask_set_cpu(cpu, cpumask);
+		}
+
+		llcc = bpf_map_lookup_elem(&llc_ctxs, &llc);
+		if (!llcc) {
+			bpf_cpumask_release(cpumask);
+			scx_bpf_error("Failed to lookup llc_ctx %u", llc);
+			return -ENOENT;
+		}
+		cpumask = bpf_kptr_xchg(&llcc->cpumask, cpumask);
+		if (cpumask)
+			bpf_cpumask_release(cpumask);
+	}
+
 	bpf_for(cpu, 0, nr_cpus) {
 		s32 key = cpu;
 		struct pcpu_ctx *ctx = bpf_map_lookup_elem(&pcpu_ctxs, &key);
@@ -9,6 +9,8 @@
 #include <inttypes.h>
 #include <signal.h>
 #include <libgen.h>
+#include <limits.h>
+#include <errno.h>
 #include <bpf/bpf.h>
 #include <scx/common.h>
 
@@ -22,11 +24,14 @@ const char help_fmt[] =
 "\n"
 "See the top-level comment in .bpf.c for more details.\n"
 "\n"
-"Usage: %s [-p] [-d DELAY] [-m <max>] [-i ITERS]\n"
+"Usage: %s [-p] [-d DELAY] [-D MAX_DELAY] [-m <max>] [-i ITERS] [-u UTIL] [-L]\n"
 "\n"
 "  -d DELAY_US   Delay (us), before removing an idle core from the primary nest (default 2000us / 2ms)\n"
+"  -D MAX_US     Scale the removal delay with the core's utilization and double it for thrashing cores, up to MAX_US (us). Disabled by default, or if <= DELAY_US\n"
 "  -m R_MAX      Maximum number of cores in the reserve nest (default 5)\n"
 "  -i ITERS      Number of successive placement failures tolerated before trying to aggressively expand primary nest (default 2), or 0 to disable\n"
+"  -u UTIL_PCT   Expand the primary nest right away when the previous primary core's utilization (%%) is above UTIL_PCT, e.g. 75. Disabled by default, or if 0\n"
+"  -L            Ignore the LLC topology when searching nests for idle cores\n"
 "  -s SLICE_US   Override slice duration in us (default 20000us / 20ms)\n"
 "  -I            First try to find a fully idle core, and then any idle core, when searching nests. Default behavior is to ignore hypertwins and check for any idle core.\n"
 "  -v            Print libbpf debug messages\n"
@@ -83,6 +88,18 @@ static void read_stats(struct scx_nest *skel, u64 *stats)
 	}
 }
 
+/*
+ * Group the CPUs by their last level cache.
+ */
+static void init_llcs(struct scx_nest *skel)
+{
+	int nr_cpus = skel->rodata->nr_cpus;
+
+	skel->rodata->nr_llcs = scx_read_cpu_llc_ids(skel->rodata->cpu_llc_id,
+						     nr_cpus < NEST_MAX_CPUS ? nr_cpus : NEST_MAX_CPUS,
+						     NEST_MAX_LLCS);
+}
+
 static void print_underline(const char *str)
 {
 	char buf[64];
@@ -154,6 +171,7 @@ static void print_active_nests(const struct scx_nest *skel)
 		}
 		printf("%-9s(%2" PRIu64 "): | %s |\n", mask_str, total, cpus);
 	}
+	printf("PRIMARY UTIL: %" PRIu64 "%%\n", skel->bss->stats_primary_util);
 }
 
 int main(int argc, char **argv)
@@ -162,6 +180,7 @@ int main(int argc, char **argv)
 	struct bpf_link *link;
 	__u32 opt;
 	__u64 ecode;
+	bool llc_aware = true;
 
 	libbpf_set_print(libbpf_print_fn);
 	signal(SIGINT, sigint_handler);
@@ -172,17 +191,27 @@ restart:
 	skel->rodata->nr_cpus = libbpf_num_possible_cpus();
 	skel->rodata->sampling_cadence_ns = SAMPLING_CADENCE_S * 1000 * 1000 * 1000;
 
-	while ((opt = getopt(argc, argv, "d:m:i:Is:vh")) != -1) {
+	while ((opt = getopt(argc, argv, "d:D:m:i:u:LIs:vh")) != -1) {
 		switch (opt) {
 		case 'd':
 			skel->rodata->p_remove_ns = strtoull(optarg, NULL, 0) * 1000;
 			break;
+		case 'D':
+			skel->rodata->p_remove_max_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
 		case 'm':
 			skel->rodata->r_max = strtoull(optarg, NULL, 0);
 			break;
 		case 'i':
 			skel->rodata->r_impatient = strtoull(optarg, NULL, 0);
 			break;
+		case 'u':
+			skel->rodata->grow_util_thresh =
+				strtoul(optarg, NULL, 0) * NEST_UTIL_ONE / 100;
+			break;
+		case 'L':
+			llc_aware = false;
+			break;
 		case 'I':
 			skel->rodata->find_fully_idle = true;
 			break;
@@ -198,6 +227,9 @@ restart:
 		}
 	}
 
+	if (llc_aware)
+		init_llcs(skel);
+
 	SCX_OPS_LOAD(skel, nest_ops, scx_nest, uei);
 	link = SCX_OPS_ATTACH(skel, nest_ops, scx_nest);
 
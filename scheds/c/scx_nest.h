@@ -1,6 +1,12 @@
 #ifndef __SCX_NEST_H
 #define __SCX_NEST_H
 
+enum nest_consts {
+	NEST_MAX_CPUS		= 1024,
+	NEST_MAX_LLCS		= 64,
+	NEST_UTIL_ONE		= 1024,
+};
+
 enum nest_stat_group {
 	STAT_GRP_WAKEUP,
 	STAT_GRP_NEST,
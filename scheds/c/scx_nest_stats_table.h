@@ -5,8 +5,12 @@ NEST_ST(WAKEUP_ANY_IDLE_PRIMARY, STAT_GRP_WAKEUP, "Woken up to idle logical prim
 NEST_ST(WAKEUP_FULLY_IDLE_RESERVE, STAT_GRP_WAKEUP, "Woken up to fully idle reserve nest core")
 NEST_ST(WAKEUP_ANY_IDLE_RESERVE, STAT_GRP_WAKEUP, "Woken up to idle logical reserve nest core")
 NEST_ST(WAKEUP_IDLE_OTHER, STAT_GRP_WAKEUP, "Woken to any idle logical core in p->cpus_ptr")
+NEST_ST(WAKEUP_LLC_PRIMARY, STAT_GRP_WAKEUP, "Woken up to idle primary nest core in the previous CPU's LLC")
+NEST_ST(WAKEUP_LLC_RESERVE, STAT_GRP_WAKEUP, "Woken up to idle reserve nest core in the previous CPU's LLC")
+NEST_ST(WAKEUP_LLC_OTHER, STAT_GRP_WAKEUP, "Woken up to idle core outside of the nests in the previous CPU's LLC")
 
 NEST_ST(TASK_IMPATIENT, STAT_GRP_NEST, "A task was found to be impatient")
+NEST_ST(TASK_SATURATED, STAT_GRP_NEST, "A task found its previous primary core to be saturated")
 NEST_ST(PROMOTED_TO_PRIMARY, STAT_GRP_NEST, "A core was promoted into the primary nest")
 NEST_ST(PROMOTED_TO_RESERVED, STAT_GRP_NEST, "A core was promoted into the reserve nest")
 NEST_ST(DEMOTED_TO_RESERVED, STAT_GRP_NEST, "A core was demoted into the reserve nest")
@@ -15,6 +19,7 @@ NEST_ST(SCHEDULED_COMPACTION, STAT_GRP_NEST, "Scheduled a primary core to be com
 NEST_ST(CANCELLED_COMPACTION, STAT_GRP_NEST, "Cancelled a primary core from being compacted at task wakeup time")
 NEST_ST(EAGERLY_COMPACTED, STAT_GRP_NEST, "A core was compacted in ops.dispatch()")
 NEST_ST(CALLBACK_COMPACTED, STAT_GRP_NEST, "A core was compacted in the scheduled timer callback")
+NEST_ST(COMPACTION_BACKOFF, STAT_GRP_NEST, "A core was promoted again shortly after being compacted")
 
 NEST_ST(CONSUMED, STAT_GRP_CONSUME, "A task was consumed from the global DSQ")
 NEST_ST(NOT_CONSUMED, STAT_GRP_CONSUME, "There was no task in the global DSQ")
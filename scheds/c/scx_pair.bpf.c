@@ -12,6 +12,12 @@
  * loaded. Throughout the runtime of the scheduler, these CPU pairs guarantee
  * that they will only ever schedule tasks that belong to the same CPU cgroup.
  *
+ * A "pair" may also be a larger group of up to MAX_GROUP_CPUS CPUs, e.g. all
+ * the hardware threads of a core or all the CPUs sharing an LLC. The group
+ * then gang-schedules one cgroup at a time, which isolates the L2 or L3 cache
+ * between the cgroups. Everything below applies to such groups as well, with
+ * the pair CPU being the next CPU in the group.
+ *
  * Scheduler Initialization
  * ------------------------
  *
@@ -22,10 +28,12 @@
  * 1. *Pair CPU*: The CPU that it synchronizes with when making scheduling
  *		  decisions. Paired CPUs always schedule tasks from the same
  *		  CPU cgroup, and synchronize with each other to guarantee
- *		  that this constraint is not violated.
+ *		  that this constraint is not violated. In larger groups, the
+ *		  pair CPUs link all the CPUs of the group into a ring.
  * 2. *Pair ID*:  Each CPU pair is assigned a Pair ID, which is used to access
  *		  a struct pair_ctx object that is shared between the pair.
- * 3. *In-pair-index*: An index, 0 or 1, that is assigned to each core in the
+ * 3. *In-pair-index*: An index, 0 or 1 (up to MAX_GROUP_CPUS - 1 in larger
+ *		       groups), that is assigned to each core in the
  *		       pair. Each struct pair_ctx has an active_mask field,
  *		       which is a bitmap used to indicate whether each core
  *		       in the pair currently has an actively running task.
@@ -45,7 +53,8 @@
  * always schedule tasks from the same cgroup within a given CPU pair. When a
  * task is enqueued (i.e. passed to the pair_enqueue() callback function), its
  * cgroup ID is read from its task struct, and then a corresponding queue map
- * is used to FIFO-enqueue the task for that cgroup.
+ * is used to FIFO-enqueue the task for that cgroup. The cgroups which may have
+ * queued tasks are tracked in the cgrp_q_bitmap bitmap.
  *
  * If you look through the implementation of the scheduler, you'll notice that
  * there is quite a bit of complexity involved with looking up the per-cgroup
@@ -68,7 +77,7 @@
  *    the structure that's used to synchronize amongst the two pair CPUs in their
  *    scheduling decisions. After any of the following events have occurred:
  *
- * - The cgroup's slice run has expired, or
+ * - The cgroup's pair_batch_dur_ns batch has expired, or
  * - The cgroup becomes empty, or
  * - Either CPU in the pair is preempted by a higher priority scheduling class
  *
@@ -79,9 +88,12 @@
  *    wait for the pair CPU to be preempted.
  *
  * 3. Otherwise, if the pair CPU is not running a task, we can move onto
- *    scheduling new tasks. Pop the next cgroup id from the top_q queue.
+ *    scheduling new tasks. Find the next set bit in cgrp_q_bitmap after the
+ *    cgroup that was picked last.
  *
- * 4. Pop a task from that cgroup's FIFO task queue, and begin executing it.
+ * 4. Pop a task from that cgroup's FIFO task queue, and begin executing it
+ *    with a slice which ends with the batch, so that all the CPUs in the pair
+ *    come back to switch to the next cgroup together.
  *
  * Note again that this scheduling behavior is simple, but the implementation
  * is complex mostly because this it hits several BPF shortcomings and has to
@@ -124,26 +136,32 @@ char _license[] SEC("license") = "GPL";
 const volatile u32 nr_cpu_ids = 1;
 
 /* a pair of CPUs stay on a cgroup for this duration */
-const volatile u32 pair_batch_dur_ns = SCX_SLICE_DFL;
+const volatile u64 pair_batch_dur_ns = SCX_SLICE_DFL;
+
+/* don't bother starting a task for less than this at the end of a batch */
+const volatile u32 pair_min_slice_ns = SCX_SLICE_DFL / 100;
 
-/* cpu ID -> pair cpu ID */
+/* cpu ID -> pair cpu ID, the next CPU in the group for groups larger than 2 */
 const volatile s32 RESIZABLE_ARRAY(rodata, pair_cpu);
 
 /* cpu ID -> pair_id */
 const volatile u32 RESIZABLE_ARRAY(rodata, pair_id);
 
-/* CPU ID -> CPU # in the pair (0 or 1) */
+/* CPU ID -> CPU # in the pair (0 or 1, < MAX_GROUP_CPUS in larger groups) */
 const volatile u32 RESIZABLE_ARRAY(rodata, in_pair_idx);
 
 struct pair_ctx {
 	struct bpf_spin_lock	lock;
 
-	/* the cgroup the pair is currently executing */
-	u64			cgid;
+	/* the cgrp_q of the cgroup the pair is currently executing */
+	s32			q_idx;
 
 	/* the pair started executing the current cgroup at */
 	u64			started_at;
 
+	/* the pair started draining the current cgroup at */
+	u64			drain_at;
+
 	/* whether the current cgroup is draining */
 	bool			draining;
 
@@ -163,20 +181,15 @@ struct {
 	__type(value, struct pair_ctx);
 } pair_ctx SEC(".maps");
 
-/* queue of cgrp_q's possibly with tasks on them */
-struct {
-	__uint(type, BPF_MAP_TYPE_QUEUE);
-	/*
-	 * Because it's difficult to build strong synchronization encompassing
-	 * multiple non-trivial operations in BPF, this queue is managed in an
-	 * opportunistic way so that we guarantee that a cgroup w/ active tasks
-	 * is always on it but possibly multiple times. Once we have more robust
-	 * synchronization constructs and e.g. linked list, we should be able to
-	 * do this in a prettier way but for now just size it big enough.
-	 */
-	__uint(max_entries, 4 * MAX_CGRPS);
-	__type(value, u64);
-} top_q SEC(".maps");
+/*
+ * Bitmap of cgrp_q's possibly with tasks on them. A bit is set whenever the
+ * cgrp_q goes from empty to non-empty and is only cleared when the cgrp_q is
+ * found to be empty while looking for the next cgroup, so a cgroup with queued
+ * tasks always has its bit set. pair_dispatch() scans the bitmap from
+ * cgrp_q_scan_cursor so that the cgroups are picked round-robin.
+ */
+static u64 cgrp_q_bitmap[NR_CGRP_WORDS];
+static u32 cgrp_q_scan_cursor;
 
 /* per-cgroup q which FIFOs the tasks from the cgroup */
 struct cgrp_q {
@@ -236,6 +249,7 @@ struct {
 u64 nr_total, nr_dispatched, nr_missing, nr_kicks, nr_preemptions;
 u64 nr_exps, nr_exp_waits, nr_exp_empty;
 u64 nr_cgrp_next, nr_cgrp_coll, nr_cgrp_empty;
+u64 batch_ns_sum, drain_ns_sum;
 
 UEI_DEFINE(uei);
 
@@ -278,20 +292,80 @@ void BPF_STRUCT_OPS(pair_enqueue, struct task_struct *p, u64 enq_flags)
 		return;
 	}
 
-	/* bump q len, if going 0 -> 1, queue cgroup into the top_q */
+	/* bump q len, if going 0 -> 1, mark the cgroup in cgrp_q_bitmap */
 	cgq_len = MEMBER_VPTR(cgrp_q_len, [*q_idx]);
 	if (!cgq_len) {
 		scx_bpf_error("MEMBER_VTPR malfunction");
 		return;
 	}
 
-	if (!__sync_fetch_and_add(cgq_len, 1) &&
-	    bpf_map_push_elem(&top_q, &cgid, 0)) {
-		scx_bpf_error("top_q overflow");
-		return;
+	if (!__sync_fetch_and_add(cgq_len, 1)) {
+		u64 *word = MEMBER_VPTR(cgrp_q_bitmap, [*q_idx / 64]);
+
+		if (!word) {
+			scx_bpf_error("MEMBER_VTPR malfunction");
+			return;
+		}
+		__sync_fetch_and_or(word, 1LLU << (*q_idx % 64));
 	}
 }
 
+/*
+ * Find the next cgrp_q with queued tasks at or after cgrp_q_scan_cursor,
+ * clearing the bits of the empty ones on the way. Returns -ENOENT if there is
+ * none.
+ */
+static s32 pick_next_cgrp_q(void)
+{
+	u32 cursor = cgrp_q_scan_cursor % MAX_CGRPS;
+	u32 i, j;
+
+	/* go around one extra word to cover the bits before the cursor */
+	bpf_for(i, 0, NR_CGRP_WORDS + 1) {
+		u32 widx = (cursor / 64 + i) % NR_CGRP_WORDS;
+		u64 *wordp = MEMBER_VPTR(cgrp_q_bitmap, [widx]);
+		u64 word;
+
+		if (!wordp)
+			break;
+		word = *wordp;
+		if (!i)
+			word &= -1LLU << (cursor % 64);
+
+		bpf_for(j, 0, 64) {
+			u32 bit, q_idx;
+			u64 *cgq_len;
+
+			if (!word)
+				break;
+			bit = lowest_bit_u64(word);
+			word &= word - 1;
+
+			q_idx = widx * 64 + bit;
+			cgq_len = MEMBER_VPTR(cgrp_q_len, [q_idx]);
+			if (!cgq_len)
+				break;
+
+			/*
+			 * This is the only place where empty cgroups are
+			 * cleared from the bitmap. Recheck after clearing as
+			 * we may race against pair_enqueue().
+			 */
+			if (!*cgq_len) {
+				__sync_fetch_and_and(wordp, ~(1LLU << bit));
+				if (!*(volatile u64 *)cgq_len)
+					continue;
+				__sync_fetch_and_or(wordp, 1LLU << bit);
+			}
+
+			cgrp_q_scan_cursor = q_idx + 1;
+			return q_idx;
+		}
+	}
+
+	return -ENOENT;
+}
+
 static int lookup_pairc_and_mask(s32 cpu, struct pair_ctx **pairc, u32 *mask)
 {
 	u32 *vptr;
@@ -308,22 +382,47 @@ static int lookup_pairc_and_mask(s32 cpu, struct pair_ctx **pairc, u32 *mask)
 	if (!vptr)
 		return -EINVAL;
 
-	*mask = 1U << *vptr;
+	*mask = 1U << (*vptr % MAX_GROUP_CPUS);
 
 	return 0;
 }
 
+/*
+ * Kick the other CPUs in @cpu's pair whose in-pair bit is set in @mask by
+ * walking the ring of pair CPUs.
+ */
+static void kick_pair_cpus(s32 cpu, u32 mask, u64 flags)
+{
+	s32 cur = cpu;
+	u32 i;
+
+	bpf_for(i, 0, MAX_GROUP_CPUS) {
+		s32 *next = (s32 *)ARRAY_ELEM_PTR(pair_cpu, cur, nr_cpu_ids);
+		u32 *idx;
+
+		if (!next || *next < 0 || *next == cpu)
+			break;
+		cur = *next;
+
+		idx = (u32 *)ARRAY_ELEM_PTR(in_pair_idx, cur, nr_cpu_ids);
+		if (idx && (mask & (1U << (*idx % MAX_GROUP_CPUS)))) {
+			__sync_fetch_and_add(&nr_kicks, 1);
+			scx_bpf_kick_cpu(cur, flags);
+		}
+	}
+}
+
 static int try_dispatch(s32 cpu)
 {
 	struct pair_ctx *pairc;
 	struct bpf_map *cgq_map;
 	struct task_struct *p;
 	u64 now = bpf_ktime_get_ns();
-	bool kick_pair = false;
-	bool expired, pair_preempted;
-	u32 *vptr, in_pair_mask;
+	u32 kick_mask = 0;
+	bool expired;
+	u32 in_pair_mask, pair_preempted;
+	u64 batch_end, slice_ns;
 	s32 pid, q_idx;
-	u64 cgid;
 	int ret;
 
 	ret = lookup_pairc_and_mask(cpu, &pairc, &in_pair_mask);
@@ -338,7 +437,7 @@ static int try_dispatch(s32 cpu)
 
 	expired = time_before(pairc->started_at + pair_batch_dur_ns, now);
 	if (expired || pairc->draining) {
-		u64 new_cgid = 0;
+		s32 new_q_idx;
 
 		__sync_fetch_and_add(&nr_exps, 1);
 
@@ -347,16 +446,18 @@ static int try_dispatch(s32 cpu)
 		 * would be not draining if the next cgroup is the current one.
 		 * For now, be dumb and always expire.
 		 */
+		if (!pairc->draining)
+			pairc->drain_at = now;
 		pairc->draining = true;
 
 		pair_preempted = pairc->preempted_mask;
 		if (pairc->active_mask || pair_preempted) {
 			/*
-			 * The other CPU is still active, or is no longer under
-			 * our control due to e.g. being preempted by a higher
-			 * priority sched_class. We want to wait until this
-			 * cgroup expires, or until control of our pair CPU has
-			 * been returned to us.
+			 * The other CPUs are still active, or are no longer
+			 * under our control due to e.g. being preempted by a
+			 * higher priority sched_class. We want to wait until
+			 * this cgroup expires, or until control of our pair
+			 * CPUs has been returned to us.
 			 *
 			 * If the pair controls its CPU, and the time already
 			 * expired, kick.  When the other CPU arrives at
@@ -364,9 +465,9 @@ static int try_dispatch(s32 cpu)
 			 * pair to the next cgroup and kick this CPU.
 			 */
 			__sync_fetch_and_add(&nr_exp_waits, 1);
-			bpf_spin_unlock(&pairc->lock);
 			if (expired && !pair_preempted)
-				kick_pair = true;
+				kick_mask = pairc->active_mask;
+			bpf_spin_unlock(&pairc->lock);
 			goto out_maybe_kick;
 		}
 
@@ -380,34 +481,11 @@ static int try_dispatch(s32 cpu)
 		 * really protect anything non-trivial. Let's do opportunistic
 		 * operations instead.
 		 */
-		bpf_repeat(BPF_MAX_LOOPS) {
-			u32 *q_idx;
-			u64 *cgq_len;
-
-			if (bpf_map_pop_elem(&top_q, &new_cgid)) {
-				/* no active cgroup, go idle */
-				__sync_fetch_and_add(&nr_exp_empty, 1);
-				return 0;
-			}
-
-			q_idx = bpf_map_lookup_elem(&cgrp_q_idx_hash, &new_cgid);
-			if (!q_idx)
-				continue;
-
-			/*
-			 * This is the only place where empty cgroups are taken
-			 * off the top_q.
-			 */
-			cgq_len = MEMBER_VPTR(cgrp_q_len, [*q_idx]);
-			if (!cgq_len || !*cgq_len)
-				continue;
-
-			/*
-			 * If it has any tasks, requeue as we may race and not
-			 * execute it.
-			 */
-			bpf_map_push_elem(&top_q, &new_cgid, 0);
-			break;
+		new_q_idx = pick_next_cgrp_q();
+		if (new_q_idx < 0) {
+			/* no active cgroup, go idle */
+			__sync_fetch_and_add(&nr_exp_empty, 1);
+			return 0;
 		}
 
 		bpf_spin_lock(&pairc->lock);
@@ -419,27 +497,26 @@ static int try_dispatch(s32 cpu)
 		 */
 		if (pairc->draining && !pairc->active_mask) {
 			__sync_fetch_and_add(&nr_cgrp_next, 1);
-			pairc->cgid = new_cgid;
+			if (pairc->started_at) {
+				__sync_fetch_and_add(&batch_ns_sum,
+						     pairc->drain_at - pairc->started_at);
+				__sync_fetch_and_add(&drain_ns_sum,
+						     now - pairc->drain_at);
+			}
+			pairc->q_idx = new_q_idx;
 			pairc->started_at = now;
 			pairc->draining = false;
-			kick_pair = true;
+			kick_mask = ~pairc->preempted_mask;
 		} else {
 			__sync_fetch_and_add(&nr_cgrp_coll, 1);
 		}
 	}
 
-	cgid = pairc->cgid;
+	q_idx = pairc->q_idx;
+	batch_end = pairc->started_at + pair_batch_dur_ns;
 	pairc->active_mask |= in_pair_mask;
 	bpf_spin_unlock(&pairc->lock);
 
-	/* again, it'd be better to do all these with the lock held, oh well */
-	vptr = bpf_map_lookup_elem(&cgrp_q_idx_hash, &cgid);
-	if (!vptr) {
-		scx_bpf_error("failed to lookup q_idx for cgroup[%llu]", cgid);
-		return -ENOENT;
-	}
-	q_idx = *vptr;
-
 	/* claim one task from cgrp_q w/ q_idx */
 	bpf_repeat(BPF_MAX_LOOPS) {
 		u64 *cgq_len, len;
@@ -449,6 +526,8 @@ static int try_dispatch(s32 cpu)
 			/* the cgroup must be empty, expire and repeat */
 			__sync_fetch_and_add(&nr_cgrp_empty, 1);
 			bpf_spin_lock(&pairc->lock);
+			if (!pairc->draining)
+				pairc->drain_at = now;
 			pairc->draining = true;
 			pairc->active_mask &= ~in_pair_mask;
 			bpf_spin_unlock(&pairc->lock);
@@ -463,21 +542,28 @@ static int try_dispatch(s32 cpu)
 
 	cgq_map = bpf_map_lookup_elem(&cgrp_q_arr, &q_idx);
 	if (!cgq_map) {
-		scx_bpf_error("failed to lookup cgq_map for cgroup[%llu] q_idx[%d]",
-			      cgid, q_idx);
+		scx_bpf_error("failed to lookup cgq_map for q_idx[%d]", q_idx);
 		return -ENOENT;
 	}
 
 	if (bpf_map_pop_elem(cgq_map, &pid)) {
-		scx_bpf_error("cgq_map is empty for cgroup[%llu] q_idx[%d]",
-			      cgid, q_idx);
+		scx_bpf_error("cgq_map is empty for q_idx[%d]", q_idx);
 		return -ENOENT;
 	}
 
+	/*
+	 * Run the task until the end of the batch so that all the CPUs in the
+	 * pair come back to switch cgroups at around the same time instead of
+	 * idling while waiting for the last one to drain.
+	 */
+	slice_ns = time_before(now, batch_end) ? batch_end - now : 0;
+	if (slice_ns < pair_min_slice_ns)
+		slice_ns = pair_min_slice_ns;
+
 	p = bpf_task_from_pid(pid);
 	if (p) {
 		__sync_fetch_and_add(&nr_dispatched, 1);
-		scx_bpf_dispatch(p, SCX_DSQ_GLOBAL, SCX_SLICE_DFL, 0);
+		scx_bpf_dispatch(p, SCX_DSQ_LOCAL, slice_ns, 0);
 		bpf_task_release(p);
 	} else {
 		/* we don't handle dequeues, retry on lost tasks */
@@ -486,13 +572,8 @@ static int try_dispatch(s32 cpu)
 	}
 
 out_maybe_kick:
-	if (kick_pair) {
-		s32 *pair = (s32 *)ARRAY_ELEM_PTR(pair_cpu, cpu, nr_cpu_ids);
-		if (pair) {
-			__sync_fetch_and_add(&nr_kicks, 1);
-			scx_bpf_kick_cpu(*pair, SCX_KICK_PREEMPT);
-		}
-	}
+	if (kick_mask)
+		kick_pair_cpus(cpu, kick_mask, SCX_KICK_PREEMPT);
 	return 0;
 }
 
@@ -507,9 +588,8 @@ void BPF_STRUCT_OPS(pair_dispatch, s32 cpu, struct task_struct *prev)
 void BPF_STRUCT_OPS(pair_cpu_acquire, s32 cpu, struct scx_cpu_acquire_args *args)
 {
 	int ret;
-	u32 in_pair_mask;
+	u32 in_pair_mask, kick_mask;
 	struct pair_ctx *pairc;
-	bool kick_pair;
 
 	ret = lookup_pairc_and_mask(cpu, &pairc, &in_pair_mask);
 	if (ret)
@@ -517,26 +597,19 @@ void BPF_STRUCT_OPS(pair_cpu_acquire, s32 cpu, struct scx_cpu_acquire_args *args
 
 	bpf_spin_lock(&pairc->lock);
 	pairc->preempted_mask &= ~in_pair_mask;
-	/* Kick the pair CPU, unless it was also preempted. */
-	kick_pair = !pairc->preempted_mask;
+	/* Kick the pair CPUs, unless they were also preempted. */
+	kick_mask = ~pairc->preempted_mask;
 	bpf_spin_unlock(&pairc->lock);
 
-	if (kick_pair) {
-		s32 *pair = (s32 *)ARRAY_ELEM_PTR(pair_cpu, cpu, nr_cpu_ids);
-
-		if (pair) {
-			__sync_fetch_and_add(&nr_kicks, 1);
-			scx_bpf_kick_cpu(*pair, SCX_KICK_PREEMPT);
-		}
-	}
+	kick_pair_cpus(cpu, kick_mask, SCX_KICK_PREEMPT);
 }
 
 void BPF_STRUCT_OPS(pair_cpu_release, s32 cpu, struct scx_cpu_release_args *args)
 {
 	int ret;
-	u32 in_pair_mask;
+	u32 in_pair_mask, kick_mask;
 	struct pair_ctx *pairc;
-	bool kick_pair;
+	u64 now = bpf_ktime_get_ns();
 
 	ret = lookup_pairc_and_mask(cpu, &pairc, &in_pair_mask);
 	if (ret)
@@ -545,19 +618,14 @@ void BPF_STRUCT_OPS(pair_cpu_release, s32 cpu, struct scx_cpu_release_args *args
 	bpf_spin_lock(&pairc->lock);
 	pairc->preempted_mask |= in_pair_mask;
 	pairc->active_mask &= ~in_pair_mask;
-	/* Kick the pair CPU if it's still running. */
-	kick_pair = pairc->active_mask;
+	/* Kick the pair CPUs which are still running. */
+	kick_mask = pairc->active_mask;
+	if (!pairc->draining)
+		pairc->drain_at = now;
 	pairc->draining = true;
 	bpf_spin_unlock(&pairc->lock);
 
-	if (kick_pair) {
-		s32 *pair = (s32 *)ARRAY_ELEM_PTR(pair_cpu, cpu, nr_cpu_ids);
-
-		if (pair) {
-			__sync_fetch_and_add(&nr_kicks, 1);
-			scx_bpf_kick_cpu(*pair, SCX_KICK_PREEMPT | SCX_KICK_WAIT);
-		}
-	}
+	kick_pair_cpus(cpu, kick_mask, SCX_KICK_PREEMPT | SCX_KICK_WAIT);
 	__sync_fetch_and_add(&nr_preemptions, 1);
 }
 
@@ -9,6 +9,8 @@
 #include <inttypes.h>
 #include <signal.h>
 #include <libgen.h>
+#include <limits.h>
+#include <string.h>
 #include <bpf/bpf.h>
 #include <scx/common.h>
 #include "scx_pair.h"
@@ -20,9 +22,12 @@ const char help_fmt[] =
 "\n"
 "See the top-level comment in .bpf.c for more details.\n"
 "\n"
-"Usage: %s [-S STRIDE]\n"
+"Usage: %s [-S STRIDE] [-G smt|llc] [-b BATCH_US]\n"
 "\n"
 "  -S STRIDE     Override CPU pair stride (default: nr_cpus_ids / 2)\n"
+"  -G TOPO       Group the CPUs by core (smt) or by LLC (llc) instead of pairing them,\n"
+"                groups larger than %d CPUs are split\n"
+"  -b BATCH_US   Time a pair stays on a cgroup before switching (default: 20000us)\n"
 "  -v            Print libbpf debug messages\n"
 "  -h            Display this help and exit\n";
 
@@ -41,12 +46,78 @@ static void sigint_handler(int dummy)
 	exit_req = 1;
 }
 
+static __u32 nr_groups;
+
+/* link @cpus into a ring of pair CPUs sharing a pair_ctx */
+static void add_group(struct scx_pair *skel, const __s32 *cpus, __u32 nr)
+{
+	__u32 i;
+
+	printf("[");
+	for (i = 0; i < nr; i++) {
+		skel->rodata_pair_cpu->pair_cpu[cpus[i]] = cpus[(i + 1) % nr];
+		skel->rodata_pair_id->pair_id[cpus[i]] = nr_groups;
+		skel->rodata_in_pair_idx->in_pair_idx[cpus[i]] = i;
+		printf(i ? ", %d" : "%d", cpus[i]);
+	}
+	printf("] ");
+	nr_groups++;
+}
+
+/*
+ * Group the CPUs which share a core or an LLC according to sysfs. CPUs whose
+ * topology can't be read end up in their own groups.
+ */
+static void init_topo_groups(struct scx_pair *skel, const char *topo)
+{
+	__u32 nr_cpu_ids = skel->rodata->nr_cpu_ids;
+	__s32 cpus[nr_cpu_ids], group[MAX_GROUP_CPUS];
+	const char *fmt;
+	__u32 i, j, nr, nr_group;
+
+	if (!strcmp(topo, "smt"))
+		fmt = "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list";
+	else if (!strcmp(topo, "llc"))
+		fmt = "/sys/devices/system/cpu/cpu%u/cache/index3/shared_cpu_list";
+	else
+		SCX_BUG("Invalid topology \"%s\", must be smt or llc", topo);
+
+	for (i = 0; i < nr_cpu_ids; i++) {
+		char path[PATH_MAX];
+
+		if (skel->rodata_pair_cpu->pair_cpu[i] >= 0)
+			continue;
+
+		snprintf(path, sizeof(path), fmt, i);
+		nr = scx_read_cpulist(path, cpus, nr_cpu_ids);
+		if (!nr) {
+			cpus[0] = i;
+			nr = 1;
+		}
+
+		nr_group = 0;
+		for (j = 0; j < nr; j++) {
+			if (cpus[j] < 0 || cpus[j] >= nr_cpu_ids ||
+			    skel->rodata_pair_cpu->pair_cpu[cpus[j]] >= 0)
+				continue;
+			group[nr_group++] = cpus[j];
+			if (nr_group == MAX_GROUP_CPUS) {
+				add_group(skel, group, nr_group);
+				nr_group = 0;
+			}
+		}
+		if (nr_group)
+			add_group(skel, group, nr_group);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	struct scx_pair *skel;
 	struct bpf_link *link;
 	__u64 seq = 0, ecode;
 	__s32 stride, i, opt, outer_fd;
+	const char *topo = NULL;
 
 	libbpf_set_print(libbpf_print_fn);
 	signal(SIGINT, sigint_handler);
@@ -59,22 +130,26 @@ restart:
 	/* pair up the earlier half to the latter by default, override with -s */
 	stride = skel->rodata->nr_cpu_ids / 2;
 
-	while ((opt = getopt(argc, argv, "S:vh")) != -1) {
+	while ((opt = getopt(argc, argv, "S:G:b:vh")) != -1) {
 		switch (opt) {
 		case 'S':
 			stride = strtoul(optarg, NULL, 0);
 			break;
+		case 'G':
+			topo = optarg;
+			break;
+		case 'b':
+			skel->rodata->pair_batch_dur_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
 		case 'v':
 			verbose = true;
 			break;
 		default:
-			fprintf(stderr, help_fmt, basename(argv[0]));
+			fprintf(stderr, help_fmt, basename(argv[0]), MAX_GROUP_CPUS);
 			return opt != 'h';
 		}
 	}
 
-	bpf_map__set_max_entries(skel->maps.pair_ctx, skel->rodata->nr_cpu_ids / 2);
-
 	/* Resize arrays so their element count is equal to cpu count. */
 	RESIZE_ARRAY(skel, rodata, pair_cpu, skel->rodata->nr_cpu_ids);
 	RESIZE_ARRAY(skel, rodata, pair_id, skel->rodata->nr_cpu_ids);
@@ -83,32 +158,35 @@ restart:
 	for (i = 0; i < skel->rodata->nr_cpu_ids; i++)
 		skel->rodata_pair_cpu->pair_cpu[i] = -1;
 
+	nr_groups = 0;
 	printf("Pairs: ");
-	for (i = 0; i < skel->rodata->nr_cpu_ids; i++) {
-		int j = (i + stride) % skel->rodata->nr_cpu_ids;
+	if (topo) {
+		init_topo_groups(skel, topo);
+	} else {
+		for (i = 0; i < skel->rodata->nr_cpu_ids; i++) {
+			__s32 pair[2];
+			int j = (i + stride) % skel->rodata->nr_cpu_ids;
 
-		if (skel->rodata_pair_cpu->pair_cpu[i] >= 0)
-			continue;
+			if (skel->rodata_pair_cpu->pair_cpu[i] >= 0)
+				continue;
 
-		SCX_BUG_ON(i == j,
-			   "Invalid stride %d - CPU%d wants to be its own pair",
-			   stride, i);
+			SCX_BUG_ON(i == j,
+				   "Invalid stride %d - CPU%d wants to be its own pair",
+				   stride, i);
 
-		SCX_BUG_ON(skel->rodata_pair_cpu->pair_cpu[j] >= 0,
-			   "Invalid stride %d - three CPUs (%d, %d, %d) want to be a pair",
-			   stride, i, j, skel->rodata_pair_cpu->pair_cpu[j]);
+			SCX_BUG_ON(skel->rodata_pair_cpu->pair_cpu[j] >= 0,
+				   "Invalid stride %d - three CPUs (%d, %d, %d) want to be a pair",
+				   stride, i, j, skel->rodata_pair_cpu->pair_cpu[j]);
 
-		skel->rodata_pair_cpu->pair_cpu[i] = j;
-		skel->rodata_pair_cpu->pair_cpu[j] = i;
-		skel->rodata_pair_id->pair_id[i] = i;
-		skel->rodata_pair_id->pair_id[j] = i;
-		skel->rodata_in_pair_idx->in_pair_idx[i] = 0;
-		skel->rodata_in_pair_idx->in_pair_idx[j] = 1;
-
-		printf("[%d, %d] ", i, j);
+			pair[0] = i;
+			pair[1] = j;
+			add_group(skel, pair, 2);
+		}
 	}
 	printf("\n");
 
+	bpf_map__set_max_entries(skel->maps.pair_ctx, nr_groups);
+
 	SCX_OPS_LOAD(skel, pair_ops, scx_pair, uei);
 
 	/*
@@ -163,6 +241,11 @@ restart:
 		       skel->bss->nr_cgrp_next,
 		       skel->bss->nr_cgrp_coll,
 		       skel->bss->nr_cgrp_empty);
+		printf(" batch:%10.3lfms   drain:%10.3lfms\n",
+		       skel->bss->nr_cgrp_next ?
+		       (double)skel->bss->batch_ns_sum / skel->bss->nr_cgrp_next / 1000000 : 0,
+		       skel->bss->nr_cgrp_next ?
+		       (double)skel->bss->drain_ns_sum / skel->bss->nr_cgrp_next / 1000000 : 0);
 		fflush(stdout);
 		sleep(1);
 	}
@@ -4,6 +4,10 @@
 enum {
 	MAX_QUEUED		= 4096,
 	MAX_CGRPS		= 4096,
+	NR_CGRP_WORDS		= MAX_CGRPS / 64,
+
+	/* the CPU masks in struct pair_ctx are u32's */
+	MAX_GROUP_CPUS		= 32,
 };
 
 #endif /* __SCX_EXAMPLE_PAIR_H */
@@ -1,15 +1,21 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 /*
- * A simple five-level FIFO queue scheduler.
+ * A simple five-level feedback queue scheduler.
  *
- * There are five FIFOs implemented using BPF_MAP_TYPE_QUEUE. A task gets
- * assigned to one depending on its compound weight. Each CPU round robins
- * through the FIFOs and dispatches more from FIFOs with higher indices - 1 from
- * queue0, 2 from queue1, 4 from queue2 and so on.
+ * There are five levels, each backed by a user DSQ ordered by a per-level
+ * sequence number used as vtime, which makes each level a FIFO. A task starts
+ * at the level its compound weight maps to. Tasks which keep exhausting their
+ * slices are demoted by up to two levels and tasks which go to sleep shortly
+ * after starting to run are promoted by one. Each CPU round robins through the
+ * levels and dispatches more from levels with higher indices - 1 from level0,
+ * 2 from level1, 4 from level2 and so on.
+ *
+ * As the levels are DSQs, dispatching moves tasks straight into the local DSQ
+ * without looking up tasks by PID and dequeues are handled by the kernel.
  *
  * This scheduler demonstrates:
  *
- * - BPF-side queueing using PIDs.
+ * - Multi-level queueing on top of vtime-ordered user DSQs.
  * - Sleepable per-task storage allocation using ops.prep_enable().
  * - Using ops.cpu_release() to handle a higher priority scheduling class taking
  *   the CPU away.
@@ -28,8 +34,19 @@
 enum consts {
 	ONE_SEC_IN_NS		= 1000000000,
 	SHARED_DSQ		= 0,
+	LEVEL_DSQ_BASE		= 1,
+	NR_LEVELS		= 5,
+
+	/* a task may be moved this many levels away from its weight's level */
+	LEVEL_MAX_DEMOTE	= 2,
+	LEVEL_MAX_PROMOTE	= 1,
+
+	/* fixed point shift for cpu_ctx->avg_level */
+	AVG_LEVEL_SHIFT		= 8,
 };
 
+#define LEVEL_DSQ(level)	(LEVEL_DSQ_BASE + (level))
+
 char _license[] SEC("license") = "GPL";
 
 const volatile u64 slice_ns = SCX_SLICE_DFL;
@@ -37,7 +54,7 @@ const volatile u32 stall_user_nth;
 const volatile u32 stall_kernel_nth;
 const volatile u32 dsp_inf_loop_after;
 const volatile u32 dsp_batch;
-const volatile bool print_shared_dsq;
+const volatile bool print_dsqs;
 const volatile u64 exp_cgid;
 const volatile s32 disallow_tgid;
 const volatile bool suppress_dump;
@@ -46,36 +63,12 @@ u32 test_error_cnt;
 
 UEI_DEFINE(uei);
 
-struct qmap {
-	__uint(type, BPF_MAP_TYPE_QUEUE);
-	__uint(max_entries, 4096);
-	__type(value, u32);
-} queue0 SEC(".maps"),
-  queue1 SEC(".maps"),
-  queue2 SEC(".maps"),
-  queue3 SEC(".maps"),
-  queue4 SEC(".maps");
-
-struct {
-	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
-	__uint(max_entries, 5);
-	__type(key, int);
-	__array(values, struct qmap);
-} queue_arr SEC(".maps") = {
-	.values = {
-		[0] = &queue0,
-		[1] = &queue1,
-		[2] = &queue2,
-		[3] = &queue3,
-		[4] = &queue4,
-	},
-};
-
 /*
- * If enabled, CPU performance target is set according to the queue index
- * according to the following table.
+ * If enabled, CPU performance target is set according to the running average
+ * of the levels of the tasks running on the CPU according to the following
+ * table.
  */
-static const u32 qidx_to_cpuperf_target[] = {
+static const u32 qidx_to_cpuperf_target[NR_LEVELS] = {
 	[0] = SCX_CPUPERF_ONE * 0 / 4,
 	[1] = SCX_CPUPERF_ONE * 1 / 4,
 	[2] = SCX_CPUPERF_ONE * 2 / 4,
@@ -84,20 +77,26 @@ static const u32 qidx_to_cpuperf_target[] = {
 };
 
 /*
- * Per-queue sequence numbers to implement core-sched ordering.
+ * Per-level sequence numbers to implement FIFO and core-sched ordering.
  *
- * Tail seq is assigned to each queued task and incremented. Head seq tracks the
- * sequence number of the latest dispatched task. The distance between the a
- * task's seq and the associated queue's head seq is called the queue distance
+ * Tail seq is assigned to each queued task and incremented. It's also used as
+ * the task's vtime in the level DSQ. Head seq tracks the sequence number of the
+ * latest task which started running from the level. The distance between the a
+ * task's seq and the associated level's head seq is called the queue distance
  * and used when comparing two tasks for ordering. See qmap_core_sched_before().
  */
-static u64 core_sched_head_seqs[5];
-static u64 core_sched_tail_seqs[5];
+static u64 core_sched_head_seqs[NR_LEVELS];
+static u64 core_sched_tail_seqs[NR_LEVELS];
 
 /* Per-task scheduling context */
 struct task_ctx {
 	bool	force_local;	/* Dispatch directly to local_dsq */
+	bool	queued;		/* Dispatched to a level DSQ */
+	s32	level_adj;	/* Level adjustment from runtime feedback */
+	u32	level;		/* Level of the last enqueue */
 	u64	core_sched_seq;
+	u64	running_at;
+	u64	runtime;	/* Runtime since the last sleep or demotion */
 };
 
 struct {
@@ -110,7 +109,7 @@ struct {
 struct cpu_ctx {
 	u64	dsp_idx;	/* dispatch index */
 	u64	dsp_cnt;	/* remaining count */
-	u32	avg_weight;
+	u32	avg_level;	/* Running avg of levels, AVG_LEVEL_SHIFT fixed point */
 	u32	cpuperf_target;
 };
 
@@ -124,6 +123,8 @@ struct {
 /* Statistics */
 u64 nr_enqueued, nr_dispatched, nr_reenqueued, nr_dequeued;
 u64 nr_core_sched_execed, nr_expedited;
+u64 nr_dsp_batches, nr_promoted, nr_demoted;
+u64 nr_level_dispatched[NR_LEVELS];
 u32 cpuperf_min, cpuperf_avg, cpuperf_max;
 u32 cpuperf_target_min, cpuperf_target_avg, cpuperf_target_max;
 
@@ -167,13 +168,23 @@ static int weight_to_idx(u32 weight)
 		return 4;
 }
 
+static __always_inline u32 task_level(struct task_struct *p,
+				      struct task_ctx *tctx)
+{
+	s32 level = weight_to_idx(p->scx.weight) + tctx->level_adj;
+
+	if (level < 0)
+		return 0;
+	if (level >= NR_LEVELS)
+		return NR_LEVELS - 1;
+	return level;
+}
+
 void BPF_STRUCT_OPS(qmap_enqueue, struct task_struct *p, u64 enq_flags)
 {
 	static u32 user_cnt, kernel_cnt;
 	struct task_ctx *tctx;
-	u32 pid = p->pid;
-	int idx = weight_to_idx(p->scx.weight);
-	void *ring;
+	u32 level;
 
 	if (p->flags & PF_KTHREAD) {
 		if (stall_kernel_nth && !(++kernel_cnt % stall_kernel_nth))
@@ -197,7 +208,10 @@ void BPF_STRUCT_OPS(qmap_enqueue, struct task_struct *p, u64 enq_flags)
 	 * core-sched ordering, which is why %SCX_OPS_ENQ_LAST is specified in
 	 * qmap_ops.flags.
 	 */
-	tctx->core_sched_seq = core_sched_tail_seqs[idx]++;
+	level = task_level(p, tctx);
+	tctx->level = level;
+	tctx->queued = false;
+	tctx->core_sched_seq = core_sched_tail_seqs[level]++;
 
 	/*
 	 * If qmap_select_cpu() is telling us to or this is the last runnable
@@ -225,24 +239,17 @@ void BPF_STRUCT_OPS(qmap_enqueue, struct task_struct *p, u64 enq_flags)
 		return;
 	}
 
-	ring = bpf_map_lookup_elem(&queue_arr, &idx);
-	if (!ring) {
-		scx_bpf_error("failed to find ring %d", idx);
-		return;
-	}
-
-	/* Queue on the selected FIFO. If the FIFO overflows, punt to global. */
-	if (bpf_map_push_elem(ring, &pid, 0)) {
-		scx_bpf_dispatch(p, SHARED_DSQ, slice_ns, enq_flags);
-		return;
-	}
+	/* Queue on the selected level in FIFO order. */
+	tctx->queued = true;
+	scx_bpf_dispatch_vtime(p, LEVEL_DSQ(level), slice_ns,
+			       tctx->core_sched_seq, enq_flags);
 
 	__sync_fetch_and_add(&nr_enqueued, 1);
 }
 
 /*
- * The BPF queue map doesn't support removal and sched_ext can handle spurious
- * dispatches. qmap_dequeue() is only used to collect statistics.
+ * Tasks on the level DSQs are removed by the kernel. qmap_dequeue() is only
+ * used to collect statistics.
  */
 void BPF_STRUCT_OPS(qmap_dequeue, struct task_struct *p, u64 deq_flags)
 {
@@ -251,33 +258,21 @@ void BPF_STRUCT_OPS(qmap_dequeue, struct task_struct *p, u64 deq_flags)
 		__sync_fetch_and_add(&nr_core_sched_execed, 1);
 }
 
-static void update_core_sched_head_seq(struct task_struct *p)
-{
-	struct task_ctx *tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
-	int idx = weight_to_idx(p->scx.weight);
-
-	if (tctx)
-		core_sched_head_seqs[idx] = tctx->core_sched_seq;
-	else
-		scx_bpf_error("task_ctx lookup failed");
-}
-
-static bool consume_shared_dsq(void)
+static bool consume_dsq(u64 dsq_id)
 {
 	struct task_struct *p;
 	bool consumed;
 
 	if (!exp_cgid)
-		return scx_bpf_consume(SHARED_DSQ);
+		return scx_bpf_consume(dsq_id);
 
 	/*
 	 * To demonstrate the use of scx_bpf_consume_task(), implement silly
-	 * selective priority boosting mechanism by scanning SHARED_DSQ looking
-	 * for matching comms and consume them first. This makes difference only
-	 * when dsp_batch is larger than 1.
+	 * selective priority boosting mechanism by scanning @dsq_id looking
+	 * for matching cgroups and consume them first.
 	 */
 	consumed = false;
-	__COMPAT_DSQ_FOR_EACH(p, SHARED_DSQ, 0) {
+	__COMPAT_DSQ_FOR_EACH(p, dsq_id, 0) {
 		if (p->cgroups->dfl_cgrp->kn->id == exp_cgid &&
 		    __COMPAT_scx_bpf_consume_task(BPF_FOR_EACH_ITER, p)) {
 			consumed = true;
@@ -285,20 +280,29 @@ static bool consume_shared_dsq(void)
 		}
 	}
 
-	return consumed || scx_bpf_consume(SHARED_DSQ);
+	return consumed || scx_bpf_consume(dsq_id);
 }
 
 void BPF_STRUCT_OPS(qmap_dispatch, s32 cpu, struct task_struct *prev)
 {
 	struct task_struct *p;
 	struct cpu_ctx *cpuc;
-	u32 zero = 0, batch = dsp_batch ?: 1;
-	void *fifo;
-	s32 i, pid;
+	u32 zero = 0, batch = dsp_batch ?: 1, nr_dsp = 0;
+	u64 *cnt;
+	s32 i;
 
-	if (consume_shared_dsq())
+	if (consume_dsq(SHARED_DSQ))
 		return;
 
+	/*
+	 * Tasks are consumed straight into the local DSQ, where no other CPU
+	 * can pick them up. Cap the batch at the number of dispatch slots of
+	 * this round so that a large -b doesn't drain the level DSQs onto a
+	 * single CPU.
+	 */
+	if (batch > scx_bpf_dispatch_nr_slots())
+		batch = scx_bpf_dispatch_nr_slots() ?: 1;
+
 	if (dsp_inf_loop_after && nr_dispatched > dsp_inf_loop_after) {
 		/*
 		 * PID 2 should be kthreadd which should mostly be idle and off
@@ -318,77 +322,140 @@ void BPF_STRUCT_OPS(qmap_dispatch, s32 cpu, struct task_struct *prev)
 		return;
 	}
 
-	for (i = 0; i < 5; i++) {
-		/* Advance the dispatch cursor and pick the fifo. */
+	for (i = 0; i < NR_LEVELS; i++) {
+		/* Advance the dispatch cursor and pick the level. */
 		if (!cpuc->dsp_cnt) {
-			cpuc->dsp_idx = (cpuc->dsp_idx + 1) % 5;
+			cpuc->dsp_idx = (cpuc->dsp_idx + 1) % NR_LEVELS;
 			cpuc->dsp_cnt = 1 << cpuc->dsp_idx;
 		}
 
-		fifo = bpf_map_lookup_elem(&queue_arr, &cpuc->dsp_idx);
-		if (!fifo) {
-			scx_bpf_error("failed to find ring %llu", cpuc->dsp_idx);
+		cnt = MEMBER_VPTR(nr_level_dispatched, [cpuc->dsp_idx]);
+		if (!cnt) {
+			scx_bpf_error("invalid dsp_idx %llu", cpuc->dsp_idx);
 			return;
 		}
 
-		/* Dispatch or advance. */
+		/*
+		 * Move up to @batch tasks into the local DSQ or advance. The
+		 * tasks are consumed directly from the level DSQ and head seqs
+		 * are updated from qmap_running().
+		 */
 		bpf_repeat(BPF_MAX_LOOPS) {
-			if (bpf_map_pop_elem(fifo, &pid))
+			if (!consume_dsq(LEVEL_DSQ(cpuc->dsp_idx)))
 				break;
 
-			p = bpf_task_from_pid(pid);
-			if (!p)
-				continue;
-
-			update_core_sched_head_seq(p);
 			__sync_fetch_and_add(&nr_dispatched, 1);
-			scx_bpf_dispatch(p, SHARED_DSQ, slice_ns, 0);
-			bpf_task_release(p);
+			__sync_fetch_and_add(cnt, 1);
+			nr_dsp++;
 			batch--;
 			cpuc->dsp_cnt--;
-			if (!batch || !scx_bpf_dispatch_nr_slots()) {
-				consume_shared_dsq();
-				return;
-			}
+			if (!batch)
+				goto out;
 			if (!cpuc->dsp_cnt)
 				break;
 		}
 
 		cpuc->dsp_cnt = 0;
 	}
+out:
+	if (nr_dsp)
+		__sync_fetch_and_add(&nr_dsp_batches, 1);
+}
+
+void BPF_STRUCT_OPS(qmap_running, struct task_struct *p)
+{
+	struct task_ctx *tctx;
+
+	if (!(tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0))) {
+		scx_bpf_error("task_ctx lookup failed");
+		return;
+	}
+
+	tctx->running_at = bpf_ktime_get_ns();
+
+	/* only tasks dispatched from a level DSQ advance the level's head */
+	if (tctx->queued) {
+		tctx->queued = false;
+		if (tctx->level < NR_LEVELS)
+			core_sched_head_seqs[tctx->level] = tctx->core_sched_seq;
+	}
+}
+
+/*
+ * Feed the measured runtime back into the level. A task which used up a full
+ * slice without sleeping is demoted and a task which went to sleep after
+ * running for less than a quarter of a slice is promoted.
+ */
+void BPF_STRUCT_OPS(qmap_stopping, struct task_struct *p, bool runnable)
+{
+	struct task_ctx *tctx;
+
+	if (!(tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0))) {
+		scx_bpf_error("task_ctx lookup failed");
+		return;
+	}
+
+	tctx->runtime += bpf_ktime_get_ns() - tctx->running_at;
+
+	if (runnable) {
+		if (tctx->runtime < slice_ns)
+			return;
+		if (tctx->level_adj > -LEVEL_MAX_DEMOTE) {
+			tctx->level_adj--;
+			__sync_fetch_and_add(&nr_demoted, 1);
+		}
+	} else {
+		if (tctx->runtime < slice_ns / 4 &&
+		    tctx->level_adj < LEVEL_MAX_PROMOTE) {
+			tctx->level_adj++;
+			__sync_fetch_and_add(&nr_promoted, 1);
+		}
+	}
+
+	tctx->runtime = 0;
 }
 
 void BPF_STRUCT_OPS(qmap_tick, struct task_struct *p)
 {
+	struct task_ctx *tctx;
 	struct cpu_ctx *cpuc;
-	u32 zero = 0;
-	int idx;
+	u32 zero = 0, idx;
 
 	if (!(cpuc = bpf_map_lookup_elem(&cpu_ctx_stor, &zero))) {
 		scx_bpf_error("failed to look up cpu_ctx");
 		return;
 	}
 
+	if (!(tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0))) {
+		scx_bpf_error("task_ctx lookup failed");
+		return;
+	}
+
 	/*
-	 * Use the running avg of weights to select the target cpuperf level.
+	 * Use the running avg of the levels of the running tasks to select
+	 * the target cpuperf level. As levels follow the runtime feedback,
+	 * CPU-bound tasks which keep getting demoted pull the target down.
 	 * This is a demonstration of the cpuperf feature rather than a
 	 * practical strategy to regulate CPU frequency.
 	 */
-	cpuc->avg_weight = cpuc->avg_weight * 3 / 4 + p->scx.weight / 4;
-	idx = weight_to_idx(cpuc->avg_weight);
+	cpuc->avg_level = cpuc->avg_level * 3 / 4 +
+		(tctx->level << AVG_LEVEL_SHIFT) / 4;
+	idx = (cpuc->avg_level + (1 << (AVG_LEVEL_SHIFT - 1))) >> AVG_LEVEL_SHIFT;
+	if (idx >= NR_LEVELS)
+		idx = NR_LEVELS - 1;
 	cpuc->cpuperf_target = qidx_to_cpuperf_target[idx];
 
 	scx_bpf_cpuperf_set(scx_bpf_task_cpu(p), cpuc->cpuperf_target);
 }
 
 /*
- * The distance from the head of the queue scaled by the weight of the queue.
+ * The distance from the head of the level scaled by the weight of the level.
  * The lower the number, the older the task and the higher the priority.
  */
 static s64 task_qdist(struct task_struct *p)
 {
-	int idx = weight_to_idx(p->scx.weight);
 	struct task_ctx *tctx;
+	u32 idx;
 	s64 qdist;
 
 	tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
@@ -397,10 +464,16 @@ static s64 task_qdist(struct task_struct *p)
 		return 0;
 	}
 
+	idx = tctx->level;
+	if (idx >= NR_LEVELS) {
+		scx_bpf_error("invalid level %u", idx);
+		return 0;
+	}
+
 	qdist = tctx->core_sched_seq - core_sched_head_seqs[idx];
 
 	/*
-	 * As queue index increments, the priority doubles. The queue w/ index 3
+	 * As level index increments, the priority doubles. The level w/ index 3
 	 * is dispatched twice more frequently than 2. Reflect the difference by
 	 * scaling qdists accordingly. Note that the shift amount needs to be
 	 * flipped depending on the sign to avoid flipping priority direction.
@@ -459,23 +532,19 @@ s32 BPF_STRUCT_OPS(qmap_init_task, struct task_struct *p,
 
 void BPF_STRUCT_OPS(qmap_dump, struct scx_dump_ctx *dctx)
 {
-	s32 i, pid;
+	struct task_struct *p;
+	s32 i;
 
 	if (suppress_dump)
 		return;
 
-	bpf_for(i, 0, 5) {
-		void *fifo;
-
-		if (!(fifo = bpf_map_lookup_elem(&queue_arr, &i)))
-			return;
-
-		scx_bpf_dump("QMAP FIFO[%d]:", i);
-		bpf_repeat(4096) {
-			if (bpf_map_pop_elem(fifo, &pid))
-				break;
-			scx_bpf_dump(" %d", pid);
-		}
+	bpf_for(i, 0, NR_LEVELS) {
+		scx_bpf_dump("QMAP LEVEL[%d]: nr_queued=%d", i,
+			     scx_bpf_dsq_nr_queued(LEVEL_DSQ(i)));
+		bpf_rcu_read_lock();
+		__COMPAT_DSQ_FOR_EACH(p, LEVEL_DSQ(i), 0)
+			scx_bpf_dump(" %d", p->pid);
+		bpf_rcu_read_unlock();
 		scx_bpf_dump("\n");
 	}
 }
@@ -490,8 +559,8 @@ void BPF_STRUCT_OPS(qmap_dump_cpu, struct scx_dump_ctx *dctx, s32 cpu, bool idle
 	if (!(cpuc = bpf_map_lookup_percpu_elem(&cpu_ctx_stor, &zero, cpu)))
 		return;
 
-	scx_bpf_dump("QMAP: dsp_idx=%llu dsp_cnt=%llu avg_weight=%u cpuperf_target=%u",
-		     cpuc->dsp_idx, cpuc->dsp_cnt, cpuc->avg_weight,
+	scx_bpf_dump("QMAP: dsp_idx=%llu dsp_cnt=%llu avg_level=%u cpuperf_target=%u",
+		     cpuc->dsp_idx, cpuc->dsp_cnt, cpuc->avg_level,
 		     cpuc->cpuperf_target);
 }
 
@@ -504,8 +573,9 @@ void BPF_STRUCT_OPS(qmap_dump_task, struct scx_dump_ctx *dctx, struct task_struc
 	if (!(taskc = bpf_task_storage_get(&task_ctx_stor, p, 0, 0)))
 		return;
 
-	scx_bpf_dump("QMAP: force_local=%d core_sched_seq=%llu",
-		     taskc->force_local, taskc->core_sched_seq);
+	scx_bpf_dump("QMAP: force_local=%d level=%u level_adj=%d runtime=%llu core_sched_seq=%llu",
+		     taskc->force_local, taskc->level, taskc->level_adj,
+		     taskc->runtime, taskc->core_sched_seq);
 }
 
 /*
@@ -634,32 +704,44 @@ out:
 }
 
 /*
- * Dump the currently queued tasks in the shared DSQ to demonstrate the usage of
- * scx_bpf_dsq_nr_queued() and DSQ iterator. Raise the dispatch batch count to
- * see meaningful dumps in the trace pipe.
+ * Dump the currently queued tasks in @dsq_id to demonstrate the usage of
+ * scx_bpf_dsq_nr_queued() and DSQ iterator.
  */
-static void dump_shared_dsq(void)
+static void dump_dsq(u64 dsq_id, const char *name, s32 level)
 {
 	struct task_struct *p;
 	s32 nr;
 
-	if (!(nr = scx_bpf_dsq_nr_queued(SHARED_DSQ)))
+	if (!(nr = scx_bpf_dsq_nr_queued(dsq_id)))
 		return;
 
-	bpf_printk("Dumping %d tasks in SHARED_DSQ in reverse order", nr);
+	bpf_printk("Dumping %d tasks in %s[%d] in reverse order", nr, name, level);
 
 	bpf_rcu_read_lock();
-	__COMPAT_DSQ_FOR_EACH(p, SHARED_DSQ, SCX_DSQ_ITER_REV)
+	__COMPAT_DSQ_FOR_EACH(p, dsq_id, SCX_DSQ_ITER_REV)
 		bpf_printk("%s[%d]", p->comm, p->pid);
 	bpf_rcu_read_unlock();
 }
 
+/*
+ * SHARED_DSQ only holds tasks re-enqueued after being preempted by a higher
+ * priority class. Everything else waits on the level DSQs.
+ */
+static void dump_dsqs(void)
+{
+	s32 i;
+
+	dump_dsq(SHARED_DSQ, "SHARED_DSQ", 0);
+	bpf_for(i, 0, NR_LEVELS)
+		dump_dsq(LEVEL_DSQ(i), "LEVEL_DSQ", i);
+}
+
 static int monitor_timerfn(void *map, int *key, struct bpf_timer *timer)
 {
 	monitor_cpuperf();
 
-	if (print_shared_dsq)
-		dump_shared_dsq();
+	if (print_dsqs)
+		dump_dsqs();
 
 	bpf_timer_start(timer, ONE_SEC_IN_NS, 0);
 	return 0;
@@ -669,7 +751,7 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(qmap_init)
 {
 	u32 key = 0;
 	struct bpf_timer *timer;
-	s32 ret;
+	s32 i, ret;
 
 	print_cpus();
 
@@ -677,6 +759,12 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(qmap_init)
 	if (ret)
 		return ret;
 
+	bpf_for(i, 0, NR_LEVELS) {
+		ret = scx_bpf_create_dsq(LEVEL_DSQ(i), -1);
+		if (ret)
+			return ret;
+	}
+
 	timer = bpf_map_lookup_elem(&monitor_timer, &key);
 	if (!timer)
 		return -ESRCH;
@@ -697,6 +785,8 @@ SCX_OPS_DEFINE(qmap_ops,
 	       .enqueue			= (void *)qmap_enqueue,
 	       .dequeue			= (void *)qmap_dequeue,
 	       .dispatch		= (void *)qmap_dispatch,
+	       .running			= (void *)qmap_running,
+	       .stopping		= (void *)qmap_stopping,
 	       .tick			= (void *)qmap_tick,
 	       .core_sched_before	= (void *)qmap_core_sched_before,
 	       .cpu_release		= (void *)qmap_cpu_release,
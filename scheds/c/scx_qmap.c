@@ -15,7 +15,7 @@
 #include "scx_qmap.bpf.skel.h"
 
 const char help_fmt[] =
-"A simple five-level FIFO queue sched_ext scheduler.\n"
+"A simple five-level feedback queue sched_ext scheduler.\n"
 "\n"
 "See the top-level comment in .bpf.c for more details.\n"
 "\n"
@@ -28,8 +28,8 @@ const char help_fmt[] =
 "  -T COUNT      Stall every COUNT'th kernel thread\n"
 "  -l COUNT      Trigger dispatch infinite looping after COUNT dispatches\n"
 "  -b COUNT      Dispatch upto COUNT tasks together\n"
-"  -P            Print out DSQ content to trace_pipe every second, use with -b\n"
-"  -E CGID       Expedite consumption of threads in a cgroup, use with -b\n"
+"  -P            Print out the shared and level DSQ content to trace_pipe every second\n"
+"  -E CGID       Expedite consumption of threads in a cgroup\n"
 "  -d PID        Disallow a process from switching into SCHED_EXT (-1 for self)\n"
 "  -D LEN        Set scx_exit_info.dump buffer length\n"
 "  -S            Suppress qmap-specific debug dump\n"
@@ -85,7 +85,7 @@ int main(int argc, char **argv)
 			skel->rodata->dsp_batch = strtoul(optarg, NULL, 0);
 			break;
 		case 'P':
-			skel->rodata->print_shared_dsq = true;
+			skel->rodata->print_dsqs = true;
 			break;
 		case 'E':
 			skel->rodata->exp_cgid = strtoull(optarg, NULL, 0);
@@ -114,7 +114,7 @@ int main(int argc, char **argv)
 	}
 
 	if (!__COMPAT_HAS_DSQ_ITER &&
-	    (skel->rodata->print_shared_dsq || skel->rodata->exp_cgid))
+	    (skel->rodata->print_dsqs || skel->rodata->exp_cgid))
 		fprintf(stderr, "kernel doesn't support DSQ iteration\n");
 
 	SCX_OPS_LOAD(skel, qmap_ops, scx_qmap, uei);
@@ -128,6 +128,14 @@ int main(int argc, char **argv)
 		       nr_enqueued, nr_dispatched, nr_enqueued - nr_dispatched,
 		       skel->bss->nr_reenqueued, skel->bss->nr_dequeued,
 		       skel->bss->nr_core_sched_execed, skel->bss->nr_expedited);
+		printf("levels : dsp=%"PRIu64"/%"PRIu64"/%"PRIu64"/%"PRIu64"/%"PRIu64" batches=%"PRIu64" promote=%"PRIu64" demote=%"PRIu64"\n",
+		       skel->bss->nr_level_dispatched[0],
+		       skel->bss->nr_level_dispatched[1],
+		       skel->bss->nr_level_dispatched[2],
+		       skel->bss->nr_level_dispatched[3],
+		       skel->bss->nr_level_dispatched[4],
+		       skel->bss->nr_dsp_batches,
+		       skel->bss->nr_promoted, skel->bss->nr_demoted);
 		if (__COMPAT_has_ksym("scx_bpf_cpuperf_cur"))
 			printf("cpuperf: cur min/avg/max=%u/%u/%u target min/avg/max=%u/%u/%u\n",
 			       skel->bss->cpuperf_min,
@@ -6,6 +6,7 @@
  * be switched to FIFO scheduling. It also demonstrates the following niceties.
  *
  * - Statistics tracking how many tasks are queued to local and global dsq's.
+ * - Optional latency histograms of the scheduling operations (-l).
  * - Termination notification for userspace.
  *
  * While very simple, this scheduler should work reasonably well on CPUs with a
@@ -16,19 +17,69 @@
  * but comes with the usual problems with FIFO scheduling where saturating
  * threads can easily drown out interactive ones.
  *
+ * On large machines, all CPUs serialize on the lock of the single shared queue
+ * and on the global vtime. The scalable mode avoids both so that the scheduler
+ * remains a fair baseline at high CPU counts:
+ *
+ * - There is one shared queue per LLC. CPUs consume from their own LLC's queue
+ *   and only steal from other LLCs when it's empty.
+ * - Each CPU advances its own vtime clock and folds it into its LLC's clock
+ *   only when it has moved ahead by a fraction of a slice. A task migrating
+ *   across LLCs has its vtime translated between the LLCs' clocks.
+ * - Wakeups are kept on the previous CPU if it's idle, and synchronous wakeups
+ *   are placed on the waker's CPU if it shares the LLC and has nothing queued.
+ *
  * Copyright (c) 2022 Meta Platforms, Inc. and affiliates.
  * Copyright (c) 2022 Tejun Heo <tj@kernel.org>
  * Copyright (c) 2022 David Vernet <dvernet@meta.com>
  */
 #include <scx/common.bpf.h>
+#include <scx/cacheline.h>
+#include <scx/lathist_impl.bpf.h>
 
 char _license[] SEC("license") = "GPL";
 
+#define MAX_CPUS	1024
+#define MAX_LLCS	64
+#define VTIME_MERGE_NS	(SCX_SLICE_DFL / 4)
+
 const volatile bool fifo_sched;
+const volatile bool scalable;
+const volatile u32 nr_llcs = 1;
+const volatile u32 cpu_llc[MAX_CPUS];
 
 static u64 vtime_now;
 UEI_DEFINE(uei);
 
+/*
+ * Vtime clocks of the scalable mode. Each is written by its own CPU or only
+ * occasionally, and thus sits on its own cacheline.
+ */
+struct llc_ctx {
+	u64 vtime_now;
+} __scx_cacheline_aligned;
+SCX_ASSERT_CACHELINE_ALIGNED(struct llc_ctx);
+
+struct cpu_ctx {
+	u64 vtime_now;
+} __scx_cacheline_aligned;
+SCX_ASSERT_CACHELINE_ALIGNED(struct cpu_ctx);
+
+struct llc_ctx llc_ctxs[MAX_LLCS];
+struct cpu_ctx cpu_ctxs[MAX_CPUS];
+
+/* LLC whose vtime clock the task's dsq_vtime is relative to */
+struct task_ctx {
+	u32 llc;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct task_ctx);
+} task_ctx_stor SEC(".maps");
+
 /*
  * Built-in DSQs such as SCX_DSQ_GLOBAL cannot be used as priority queues
  * (meaning, cannot be dispatched to with scx_bpf_dispatch_vtime()). We
@@ -42,7 +93,7 @@ struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
 	__uint(key_size, sizeof(u32));
 	__uint(value_size, sizeof(u64));
-	__uint(max_entries, 2);			/* [local, global] */
+	__uint(max_entries, 3);			/* [local, global, steal] */
 } stats SEC(".maps");
 
 static void stat_inc(u32 idx)
@@ -57,51 +108,214 @@ static inline bool vtime_before(u64 a, u64 b)
 	return (s64)(a - b) < 0;
 }
 
-s32 BPF_STRUCT_OPS(simple_select_cpu, struct task_struct *p, s32 prev_cpu, u64 wake_flags)
+static u32 cpu_to_llc(s32 cpu)
+{
+	const volatile u32 *llcp = MEMBER_VPTR(cpu_llc, [cpu]);
+
+	return llcp && *llcp < MAX_LLCS ? *llcp : 0;
+}
+
+static struct llc_ctx *lookup_llc_ctx(u32 llc)
+{
+	struct llc_ctx *llcc = MEMBER_VPTR(llc_ctxs, [llc]);
+
+	if (!llcc)
+		scx_bpf_error("Failed to lookup llc ctx for %u", llc);
+	return llcc;
+}
+
+/*
+ * Make @p's vtime relative to the clock of @llc if it was relative to another
+ * LLC's, preserving its lag or lead.
+ */
+static void task_move_vtime(struct task_struct *p, u32 llc)
+{
+	struct llc_ctx *from, *to;
+	struct task_ctx *tctx;
+
+	tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
+	if (!tctx || tctx->llc == llc)
+		return;
+
+	if (!(from = lookup_llc_ctx(tctx->llc)) || !(to = lookup_llc_ctx(llc)))
+		return;
+
+	p->scx.dsq_vtime = p->scx.dsq_vtime - from->vtime_now + to->vtime_now;
+	tctx->llc = llc;
+}
+
+/*
+ * Wake-affine fast path of the scalable mode. Keep @p on @prev_cpu if it's
+ * idle as its cache is likely still hot there. On synchronous wakeups, the
+ * waker is about to go to sleep, so run @p on the waker's CPU if it shares the
+ * LLC with @prev_cpu and has nothing else queued.
+ */
+static s32 select_cpu_affine(struct task_struct *p, s32 prev_cpu, u64 wake_flags)
+{
+	s32 cpu = bpf_get_smp_processor_id();
+
+	if (bpf_cpumask_test_cpu(prev_cpu, p->cpus_ptr) &&
+	    scx_bpf_test_and_clear_cpu_idle(prev_cpu))
+		return prev_cpu;
+
+	if ((wake_flags & SCX_WAKE_SYNC) && cpu != prev_cpu &&
+	    cpu_to_llc(cpu) == cpu_to_llc(prev_cpu) &&
+	    bpf_cpumask_test_cpu(cpu, p->cpus_ptr) &&
+	    !scx_bpf_dsq_nr_queued(SCX_DSQ_LOCAL_ON | cpu))
+		return cpu;
+
+	return -ENOENT;
+}
+
+/* @p skips ops.enqueue(), so its LATHIST_RUNQ timestamp is taken here */
+static void dispatch_local(struct task_struct *p)
+{
+	stat_inc(0);	/* count local queueing */
+	lathist_enqueued(p);
+	scx_bpf_dispatch(p, SCX_DSQ_LOCAL, SCX_SLICE_DFL, 0);
+}
+
+static __always_inline s32 __simple_select_cpu(struct task_struct *p,
+					       s32 prev_cpu, u64 wake_flags)
 {
 	bool is_idle = false;
 	s32 cpu;
 
-	cpu = scx_bpf_select_cpu_dfl(p, prev_cpu, wake_flags, &is_idle);
-	if (is_idle) {
-		stat_inc(0);	/* count local queueing */
-		scx_bpf_dispatch(p, SCX_DSQ_LOCAL, SCX_SLICE_DFL, 0);
+	if (scalable) {
+		cpu = select_cpu_affine(p, prev_cpu, wake_flags);
+		if (cpu >= 0) {
+			dispatch_local(p);
+			return cpu;
+		}
 	}
 
+	cpu = scx_bpf_select_cpu_dfl(p, prev_cpu, wake_flags, &is_idle);
+	if (is_idle)
+		dispatch_local(p);
+
 	return cpu;
 }
 
-void BPF_STRUCT_OPS(simple_enqueue, struct task_struct *p, u64 enq_flags)
+s32 BPF_STRUCT_OPS(simple_select_cpu, struct task_struct *p, s32 prev_cpu, u64 wake_flags)
 {
+	u64 started_at = lathist_start();
+	s32 cpu;
+
+	cpu = __simple_select_cpu(p, prev_cpu, wake_flags);
+	lathist_end(LATHIST_SELECT_CPU, started_at);
+	return cpu;
+}
+
+static __always_inline void __simple_enqueue(struct task_struct *p, u64 enq_flags)
+{
+	u64 dsq_id = SHARED_DSQ, now = vtime_now;
+
 	stat_inc(1);	/* count global queueing */
 
+	if (scalable) {
+		struct llc_ctx *llcc;
+
+		dsq_id = cpu_to_llc(scx_bpf_task_cpu(p));
+		if (!(llcc = lookup_llc_ctx(dsq_id)))
+			return;
+		now = llcc->vtime_now;
+	}
+
 	if (fifo_sched) {
-		scx_bpf_dispatch(p, SHARED_DSQ, SCX_SLICE_DFL, enq_flags);
+		scx_bpf_dispatch(p, dsq_id, SCX_SLICE_DFL, enq_flags);
 	} else {
-		u64 vtime = p->scx.dsq_vtime;
+		u64 vtime;
+
+		if (scalable)
+			task_move_vtime(p, dsq_id);
+		vtime = p->scx.dsq_vtime;
 
 		/*
 		 * Limit the amount of budget that an idling task can accumulate
 		 * to one slice.
 		 */
-		if (vtime_before(vtime, vtime_now - SCX_SLICE_DFL))
-			vtime = vtime_now - SCX_SLICE_DFL;
+		if (vtime_before(vtime, now - SCX_SLICE_DFL))
+			vtime = now - SCX_SLICE_DFL;
 
-		scx_bpf_dispatch_vtime(p, SHARED_DSQ, SCX_SLICE_DFL, vtime,
+		scx_bpf_dispatch_vtime(p, dsq_id, SCX_SLICE_DFL, vtime,
 				       enq_flags);
 	}
 }
 
+void BPF_STRUCT_OPS(simple_enqueue, struct task_struct *p, u64 enq_flags)
+{
+	u64 started_at = lathist_start();
+
+	lathist_enqueued(p);
+	__simple_enqueue(p, enq_flags);
+	lathist_end(LATHIST_ENQUEUE, started_at);
+}
+
+static __always_inline void __simple_dispatch(s32 cpu)
+{
+	u32 llc, i;
+
+	if (!scalable) {
+		scx_bpf_consume(SHARED_DSQ);
+		return;
+	}
+
+	llc = cpu_to_llc(cpu);
+	if (scx_bpf_consume(llc))
+		return;
+
+	/* the local LLC is out of tasks, steal from the others */
+	bpf_for(i, 1, nr_llcs) {
+		if (scx_bpf_consume((llc + i) % nr_llcs)) {
+			stat_inc(2);	/* count cross-LLC steals */
+			return;
+		}
+	}
+}
+
 void BPF_STRUCT_OPS(simple_dispatch, s32 cpu, struct task_struct *prev)
 {
-	scx_bpf_consume(SHARED_DSQ);
+	u64 started_at = lathist_start();
+
+	__simple_dispatch(cpu);
+	lathist_end(LATHIST_DISPATCH, started_at);
 }
 
-void BPF_STRUCT_OPS(simple_running, struct task_struct *p)
+/*
+ * Advance the clock of the current CPU and fold it into the LLC's clock once
+ * it's ahead by VTIME_MERGE_NS. The LLC's clock thus lags by at most that
+ * much while being written at most once per VTIME_MERGE_NS of progress.
+ */
+static void scalable_running(struct task_struct *p)
+{
+	s32 cpu = bpf_get_smp_processor_id();
+	u32 llc = cpu_to_llc(cpu);
+	struct llc_ctx *llcc;
+	struct cpu_ctx *cpuc;
+
+	if (!(cpuc = MEMBER_VPTR(cpu_ctxs, [cpu])) ||
+	    !(llcc = lookup_llc_ctx(llc)))
+		return;
+
+	/* @p may have been stolen from another LLC */
+	task_move_vtime(p, llc);
+
+	if (vtime_before(cpuc->vtime_now, p->scx.dsq_vtime))
+		cpuc->vtime_now = p->scx.dsq_vtime;
+	if (vtime_before(llcc->vtime_now + VTIME_MERGE_NS, cpuc->vtime_now))
+		llcc->vtime_now = cpuc->vtime_now;
+}
+
+static __always_inline void __simple_running(struct task_struct *p)
 {
 	if (fifo_sched)
 		return;
 
+	if (scalable) {
+		scalable_running(p);
+		return;
+	}
+
 	/*
 	 * Global vtime always progresses forward as tasks start executing. The
 	 * test and update can be performed concurrently from multiple CPUs and
@@ -112,7 +326,16 @@ void BPF_STRUCT_OPS(simple_running, struct task_struct *p)
 		vtime_now = p->scx.dsq_vtime;
 }
 
-void BPF_STRUCT_OPS(simple_stopping, struct task_struct *p, bool runnable)
+void BPF_STRUCT_OPS(simple_running, struct task_struct *p)
+{
+	u64 started_at = lathist_start();
+
+	lathist_running(p);
+	__simple_running(p);
+	lathist_end(LATHIST_RUNNING, started_at);
+}
+
+static __always_inline void __simple_stopping(struct task_struct *p)
 {
 	if (fifo_sched)
 		return;
@@ -129,14 +352,60 @@ void BPF_STRUCT_OPS(simple_stopping, struct task_struct *p, bool runnable)
 	p->scx.dsq_vtime += (SCX_SLICE_DFL - p->scx.slice) * 100 / p->scx.weight;
 }
 
+void BPF_STRUCT_OPS(simple_stopping, struct task_struct *p, bool runnable)
+{
+	u64 started_at = lathist_start();
+
+	__simple_stopping(p);
+	lathist_end(LATHIST_STOPPING, started_at);
+}
+
 void BPF_STRUCT_OPS(simple_enable, struct task_struct *p)
 {
-	p->scx.dsq_vtime = vtime_now;
+	struct task_ctx *tctx;
+	struct llc_ctx *llcc;
+	u32 llc;
+
+	if (!scalable) {
+		p->scx.dsq_vtime = vtime_now;
+		return;
+	}
+
+	llc = cpu_to_llc(scx_bpf_task_cpu(p));
+	if (!(llcc = lookup_llc_ctx(llc)))
+		return;
+
+	p->scx.dsq_vtime = llcc->vtime_now;
+	if ((tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0)))
+		tctx->llc = llc;
+}
+
+s32 BPF_STRUCT_OPS(simple_init_task, struct task_struct *p,
+		   struct scx_init_task_args *args)
+{
+	if (!scalable)
+		return 0;
+
+	if (!bpf_task_storage_get(&task_ctx_stor, p, 0,
+				  BPF_LOCAL_STORAGE_GET_F_CREATE))
+		return -ENOMEM;
+	return 0;
 }
 
 s32 BPF_STRUCT_OPS_SLEEPABLE(simple_init)
 {
-	return scx_bpf_create_dsq(SHARED_DSQ, -1);
+	u32 llc;
+	s32 ret;
+
+	if (!scalable)
+		return scx_bpf_create_dsq(SHARED_DSQ, -1);
+
+	bpf_for(llc, 0, nr_llcs) {
+		ret = scx_bpf_create_dsq(llc, -1);
+		if (ret)
+			return ret;
+	}
+	return 0;
 }
 
 void BPF_STRUCT_OPS(simple_exit, struct scx_exit_info *ei)
@@ -151,6 +420,7 @@ SCX_OPS_DEFINE(simple_ops,
 	       .running			= (void *)simple_running,
 	       .stopping		= (void *)simple_stopping,
 	       .enable			= (void *)simple_enable,
+	       .init_task		= (void *)simple_init_task,
 	       .init			= (void *)simple_init,
 	       .exit			= (void *)simple_exit,
 	       .name			= "simple");
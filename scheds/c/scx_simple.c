@@ -8,8 +8,11 @@
 #include <unistd.h>
 #include <signal.h>
 #include <libgen.h>
+#include <limits.h>
+#include <errno.h>
 #include <bpf/bpf.h>
 #include <scx/common.h>
+#include <scx/lathist.h>
 #include "scx_simple.bpf.skel.h"
 
 const char help_fmt[] =
@@ -17,9 +20,11 @@ const char help_fmt[] =
 "\n"
 "See the top-level comment in .bpf.c for more details.\n"
 "\n"
-"Usage: %s [-f] [-v]\n"
+"Usage: %s [-f] [-s] [-l] [-v]\n"
 "\n"
 "  -f            Use FIFO scheduling instead of weighted vtime scheduling\n"
+"  -s            Scalable mode with per-LLC queues and vtime clocks\n"
+"  -l            Record and print the latency histograms of the operations\n"
 "  -v            Print libbpf debug messages\n"
 "  -h            Display this help and exit\n";
 
@@ -41,12 +46,12 @@ static void sigint_handler(int simple)
 static void read_stats(struct scx_simple *skel, __u64 *stats)
 {
 	int nr_cpus = libbpf_num_possible_cpus();
-	__u64 cnts[2][nr_cpus];
+	__u64 cnts[3][nr_cpus];
 	__u32 idx;
 
-	memset(stats, 0, sizeof(stats[0]) * 2);
+	memset(stats, 0, sizeof(stats[0]) * 3);
 
-	for (idx = 0; idx < 2; idx++) {
+	for (idx = 0; idx < 3; idx++) {
 		int ret, cpu;
 
 		ret = bpf_map_lookup_elem(bpf_map__fd(skel->maps.stats),
@@ -58,8 +63,23 @@ static void read_stats(struct scx_simple *skel, __u64 *stats)
 	}
 }
 
+/*
+ * Number the LLCs and map each CPU to its LLC for the scalable mode.
+ */
+static void init_llcs(struct scx_simple *skel)
+{
+	const int max_cpus = sizeof(skel->rodata->cpu_llc) / sizeof(skel->rodata->cpu_llc[0]);
+	const int max_llcs = sizeof(skel->bss->llc_ctxs) / sizeof(skel->bss->llc_ctxs[0]);
+	int nr_cpus = libbpf_num_possible_cpus();
+
+	skel->rodata->nr_llcs = scx_read_cpu_llc_ids(skel->rodata->cpu_llc,
+						     nr_cpus < max_cpus ? nr_cpus : max_cpus,
+						     max_llcs);
+}
+
 int main(int argc, char **argv)
 {
+	struct lathist prev_lathists[LATHIST_NR] = {};
 	struct scx_simple *skel;
 	struct bpf_link *link;
 	__u32 opt;
@@ -71,11 +91,17 @@ int main(int argc, char **argv)
 restart:
 	skel = SCX_OPS_OPEN(simple_ops, scx_simple);
 
-	while ((opt = getopt(argc, argv, "fvh")) != -1) {
+	while ((opt = getopt(argc, argv, "fslvh")) != -1) {
 		switch (opt) {
 		case 'f':
 			skel->rodata->fifo_sched = true;
 			break;
+		case 's':
+			skel->rodata->scalable = true;
+			break;
+		case 'l':
+			skel->rodata->lathist_enabled = true;
+			break;
 		case 'v':
 			verbose = true;
 			break;
@@ -85,14 +111,21 @@ restart:
 		}
 	}
 
+	if (skel->rodata->scalable)
+		init_llcs(skel);
+
 	SCX_OPS_LOAD(skel, simple_ops, scx_simple, uei);
 	link = SCX_OPS_ATTACH(skel, simple_ops, scx_simple);
 
 	while (!exit_req && !UEI_EXITED(skel, uei)) {
-		__u64 stats[2];
+		__u64 stats[3];
 
 		read_stats(skel, stats);
-		printf("local=%llu global=%llu\n", stats[0], stats[1]);
+		printf("local=%llu global=%llu steal=%llu\n",
+		       stats[0], stats[1], stats[2]);
+		if (skel->rodata->lathist_enabled)
+			scx_lathist_report(bpf_map__fd(skel->maps.lathists),
+					   prev_lathists);
 		fflush(stdout);
 		sleep(1);
 	}
@@ -7,14 +7,16 @@
  *    All such tasks are direct-dispatched from the kernel, and are never
  *    enqueued in user space.
  * 2. A primitive vruntime scheduler that is implemented in user space, for all
- *    other tasks.
+ *    other tasks. As a shortcut, such tasks which wake up while their previous
+ *    CPU is idle are dispatched directly to it without waking up the user
+ *    space scheduler. Their runtime is still accounted by user space the next
+ *    time they are enqueued there as it's derived from sum_exec_runtime.
  *
- * Some parts of this example user space scheduler could be implemented more
- * efficiently using more complex and sophisticated data structures. For
- * example, rather than using BPF_MAP_TYPE_QUEUE's,
- * BPF_MAP_TYPE_{USER_}RINGBUF's could be used for exchanging messages between
- * user space and kernel space. Similarly, we use a simple vruntime-sorted list
- * in user space, but an rbtree could be used instead.
+ * Tasks are exchanged between the kernel and user space through a
+ * BPF_MAP_TYPE_RINGBUF and a BPF_MAP_TYPE_USER_RINGBUF. Both are memory mapped
+ * by user space, so producing and consuming a task doesn't take a syscall.
+ * User space orders tasks with a d-ary heap by default, but an rbtree could be
+ * used instead.
  *
  * Copyright (c) 2022 Meta Platforms, Inc. and affiliates.
  * Copyright (c) 2022 Tejun Heo <tj@kernel.org>
@@ -23,20 +25,17 @@
 #include <scx/common.bpf.h>
 #include "scx_userland.h"
 
-/*
- * Maximum amount of tasks enqueued/dispatched between kernel and user-space.
- */
-#define MAX_ENQUEUED_TASKS 4096
-
 char _license[] SEC("license") = "GPL";
 
 const volatile s32 usersched_pid;
+const volatile bool direct_dispatch = true;
 
 /* !0 for veristat, set during init */
 const volatile u32 num_possible_cpus = 64;
 
 /* Stats that are printed by user space. */
 u64 nr_failed_enqueues, nr_kernel_enqueues, nr_user_enqueues;
+u64 nr_direct_dispatches;
 
 /*
  * Number of tasks that are queued for scheduling.
@@ -58,25 +57,26 @@ volatile u64 nr_scheduled;
 UEI_DEFINE(uei);
 
 /*
- * The map containing tasks that are enqueued in user space from the kernel.
+ * The ring buffer containing tasks that are enqueued in user space from the
+ * kernel.
  *
- * This map is drained by the user space scheduler.
+ * This ring buffer is drained by the user space scheduler. It isn't notified
+ * of new records, it's woken up through usersched_needed instead.
  */
 struct {
-	__uint(type, BPF_MAP_TYPE_QUEUE);
-	__uint(max_entries, MAX_ENQUEUED_TASKS);
-	__type(value, struct scx_userland_enqueued_task);
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, ENQUEUED_RINGBUF_SIZE);
 } enqueued SEC(".maps");
 
 /*
- * The map containing tasks that are dispatched to the kernel from user space.
+ * The ring buffer containing the pids of tasks that are dispatched to the
+ * kernel from user space.
  *
  * Drained by the kernel in userland_dispatch().
  */
 struct {
-	__uint(type, BPF_MAP_TYPE_QUEUE);
-	__uint(max_entries, MAX_ENQUEUED_TASKS);
-	__type(value, s32);
+	__uint(type, BPF_MAP_TYPE_USER_RINGBUF);
+	__uint(max_entries, DISPATCHED_RINGBUF_SIZE);
 } dispatched SEC(".maps");
 
 /* Per-task scheduling context */
@@ -143,27 +143,39 @@ static struct task_struct *usersched_task(void)
 s32 BPF_STRUCT_OPS(userland_select_cpu, struct task_struct *p,
 		   s32 prev_cpu, u64 wake_flags)
 {
-	if (keep_in_kernel(p)) {
-		s32 cpu;
-		struct task_ctx *tctx;
+	struct task_ctx *tctx;
+	s32 cpu;
 
-		tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
-		if (!tctx) {
-			scx_bpf_error("Failed to look up task-local storage for %s", p->comm);
-			return -ESRCH;
-		}
+	if (!keep_in_kernel(p) && (!direct_dispatch || is_usersched_task(p)))
+		return prev_cpu;
 
-		if (p->nr_cpus_allowed == 1 ||
-		    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
-			tctx->force_local = true;
-			return prev_cpu;
-		}
+	tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
+	if (!tctx) {
+		scx_bpf_error("Failed to look up task-local storage for %s", p->comm);
+		return -ESRCH;
+	}
 
-		cpu = scx_bpf_pick_idle_cpu(p->cpus_ptr, 0);
-		if (cpu >= 0) {
+	if (!keep_in_kernel(p)) {
+		/*
+		 * Waking up onto an idle CPU is a trivial decision, there's
+		 * no need to involve the user space scheduler. See
+		 * dispatch_direct().
+		 */
+		if (scx_bpf_test_and_clear_cpu_idle(prev_cpu))
 			tctx->force_local = true;
-			return cpu;
-		}
+		return prev_cpu;
+	}
+
+	if (p->nr_cpus_allowed == 1 ||
+	    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
+		tctx->force_local = true;
+		return prev_cpu;
+	}
+
+	cpu = scx_bpf_pick_idle_cpu(p->cpus_ptr, 0);
+	if (cpu >= 0) {
+		tctx->force_local = true;
+		return cpu;
 	}
 
 	return prev_cpu;
@@ -180,25 +192,52 @@ static void dispatch_user_scheduler(void)
 	}
 }
 
-static void enqueue_task_in_user_space(struct task_struct *p, u64 enq_flags)
+/*
+ * Dispatch a task which woke up on its idle previous CPU, as decided in
+ * userland_select_cpu(), directly to the CPU. Returns false if the task should
+ * be enqueued in user space instead.
+ */
+static bool dispatch_direct(struct task_struct *p, u64 enq_flags)
 {
-	struct scx_userland_enqueued_task task = {};
+	struct task_ctx *tctx;
 
-	task.pid = p->pid;
-	task.sum_exec_runtime = p->se.sum_exec_runtime;
-	task.weight = p->scx.weight;
+	tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
+	if (!tctx) {
+		scx_bpf_error("Failed to lookup task ctx for %s", p->comm);
+		return false;
+	}
+
+	if (!tctx->force_local)
+		return false;
+
+	tctx->force_local = false;
+	scx_bpf_dispatch(p, SCX_DSQ_LOCAL, SCX_SLICE_DFL, enq_flags);
+	__sync_fetch_and_add(&nr_direct_dispatches, 1);
+	return true;
+}
+
+static void enqueue_task_in_user_space(struct task_struct *p, u64 enq_flags)
+{
+	struct scx_userland_enqueued_task *task;
 
-	if (bpf_map_push_elem(&enqueued, &task, 0)) {
+	task = bpf_ringbuf_reserve(&enqueued, sizeof(*task), 0);
+	if (!task) {
 		/*
 		 * If we fail to enqueue the task in user space, put it
 		 * directly on the global DSQ.
 		 */
 		__sync_fetch_and_add(&nr_failed_enqueues, 1);
 		scx_bpf_dispatch(p, SCX_DSQ_GLOBAL, SCX_SLICE_DFL, enq_flags);
-	} else {
-		__sync_fetch_and_add(&nr_user_enqueues, 1);
-		set_usersched_needed();
+		return;
 	}
+
+	task->pid = p->pid;
+	task->sum_exec_runtime = p->se.sum_exec_runtime;
+	task->weight = p->scx.weight;
+	bpf_ringbuf_submit(task, BPF_RB_NO_WAKEUP);
+
+	__sync_fetch_and_add(&nr_user_enqueues, 1);
+	set_usersched_needed();
 }
 
 void BPF_STRUCT_OPS(userland_enqueue, struct task_struct *p, u64 enq_flags)
@@ -220,34 +259,48 @@ void BPF_STRUCT_OPS(userland_enqueue, struct task_struct *p, u64 enq_flags)
 		__sync_fetch_and_add(&nr_kernel_enqueues, 1);
 		return;
 	} else if (!is_usersched_task(p)) {
+		if (direct_dispatch && dispatch_direct(p, enq_flags))
+			return;
 		enqueue_task_in_user_space(p, enq_flags);
 	}
 }
 
-void BPF_STRUCT_OPS(userland_dispatch, s32 cpu, struct task_struct *prev)
+static long dispatch_one(struct bpf_dynptr *dynptr, void *context)
 {
-	if (test_and_clear_usersched_needed())
-		dispatch_user_scheduler();
+	struct task_struct *p;
+	s32 pid;
+
+	if (bpf_dynptr_read(&pid, sizeof(pid), dynptr, 0, 0)) {
+		scx_bpf_error("Failed to read dispatched pid");
+		return 1;
+	}
+
+	/*
+	 * The task could have exited by the time we get around to dispatching
+	 * it. Treat this as a normal occurrence, and simply move onto the next
+	 * record.
+	 */
+	p = bpf_task_from_pid(pid);
+	if (!p)
+		return 0;
 
-	bpf_repeat(MAX_ENQUEUED_TASKS) {
-		s32 pid;
-		struct task_struct *p;
+	scx_bpf_dispatch(p, SCX_DSQ_GLOBAL, SCX_SLICE_DFL, 0);
+	bpf_task_release(p);
 
-		if (bpf_map_pop_elem(&dispatched, &pid))
-			break;
+	/* Stop once the dispatch buffer is full, the rest stays in the ring. */
+	return scx_bpf_dispatch_nr_slots() ? 0 : 1;
+}
 
-		/*
-		 * The task could have exited by the time we get around to
-		 * dispatching it. Treat this as a normal occurrence, and simply
-		 * move onto the next iteration.
-		 */
-		p = bpf_task_from_pid(pid);
-		if (!p)
-			continue;
+void BPF_STRUCT_OPS(userland_dispatch, s32 cpu, struct task_struct *prev)
+{
+	if (test_and_clear_usersched_needed())
+		dispatch_user_scheduler();
 
-		scx_bpf_dispatch(p, SCX_DSQ_GLOBAL, SCX_SLICE_DFL, 0);
-		bpf_task_release(p);
-	}
+	/*
+	 * Only one CPU can drain the ring at a time. Others get -EBUSY, which
+	 * is fine as the tasks go to the global DSQ either way.
+	 */
+	bpf_user_ringbuf_drain(&dispatched, dispatch_one, NULL, 0);
 }
 
 /*
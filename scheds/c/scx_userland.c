@@ -1,7 +1,7 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 /*
  * A demo sched_ext user space scheduler which provides vruntime semantics
- * using a simple ordered-list implementation.
+ * using either a simple ordered-list or an indexed d-ary min-heap run queue.
  *
  * Each CPU in the system resides in a single, global domain. This precludes
  * the need to do any load balancing between domains. The scheduler could
@@ -23,6 +23,8 @@
 #include <libgen.h>
 #include <pthread.h>
 #include <bpf/bpf.h>
+#include <time.h>
+#include <errno.h>
 #include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/syscall.h>
@@ -38,9 +40,12 @@ const char help_fmt[] =
 "\n"
 "Try to reduce `sysctl kernel.pid_max` if this program triggers OOMs.\n"
 "\n"
-"Usage: %s [-b BATCH]\n"
+"Usage: %s [-b BATCH] [-q QUEUE] [-D]\n"
 "\n"
 "  -b BATCH      The number of tasks to batch when dispatching (default: 8)\n"
+"  -q QUEUE      The run queue backend, \"heap\" or \"list\" (default: heap)\n"
+"  -D            Always go through user space, even for tasks waking up on an\n"
+"                idle CPU\n"
 "  -v            Print libbpf debug messages\n"
 "  -h            Display this help and exit\n";
 
@@ -52,7 +57,9 @@ static __u32 batch_size = 8;
 
 static bool verbose;
 static volatile int exit_req;
-static int enqueued_fd, dispatched_fd;
+static bool direct_dispatch = true;
+static struct ring_buffer *enqueued_rb;
+static struct user_ring_buffer *dispatched_rb;
 
 static struct scx_userland *skel;
 static struct bpf_link *ops_link;
@@ -60,6 +67,13 @@ static struct bpf_link *ops_link;
 /* Stats collected in user space. */
 static __u64 nr_vruntime_enqueues, nr_vruntime_dispatches, nr_vruntime_failed;
 
+/*
+ * Total time spent inserting tasks into the run queue, in nanoseconds, and the
+ * number of tasks inserted. Tasks which were only repositioned in place aren't
+ * timed and thus not counted.
+ */
+static __u64 vruntime_insert_ns, nr_vruntime_inserts;
+
 /* Number of tasks currently enqueued. */
 static __u64 nr_curr_enqueued;
 
@@ -68,13 +82,35 @@ struct enqueued_task {
 	LIST_ENTRY(enqueued_task) entries;
 	__u64 sum_exec_runtime;
 	double vruntime;
+	/* Position in the heap backend, only valid while @queued is set. */
+	__u32 heap_idx;
+	/* Waiting in drain_buf to be inserted into the run queue. */
+	bool staged;
+	/* Linked into the run queue. */
+	bool queued;
 };
 
 /*
- * Use a vruntime-sorted list to store tasks. This could easily be extended to
- * a more optimal data structure, such as an rbtree as is done in CFS. We
- * currently elect to use a sorted list to simplify the example for
- * illustrative purposes.
+ * A run queue backend, ordering enqueued tasks by vruntime. Backends never
+ * allocate memory after init(), as allocating on the scheduling path could
+ * deadlock against a task we have yet to schedule.
+ *
+ * @insert_batch: Queue @nr tasks that are not yet queued.
+ * @update: Reposition a queued task whose vruntime has changed.
+ * @pop: Remove and return the task with the lowest vruntime, or NULL.
+ */
+struct rq_ops {
+	const char *name;
+	int (*init)(void);
+	void (*insert_batch)(struct enqueued_task **batch, __u32 nr);
+	void (*update)(struct enqueued_task *task);
+	struct enqueued_task *(*pop)(void);
+};
+
+/*
+ * The simplest run queue backend: a vruntime-sorted list. Each insert is O(n),
+ * which becomes a bottleneck with thousands of runnable tasks, but the code is
+ * kept as the reference for illustrative purposes.
  */
 LIST_HEAD(listhead, enqueued_task);
 
@@ -85,6 +121,23 @@ LIST_HEAD(listhead, enqueued_task);
  */
 static struct listhead vruntime_head = LIST_HEAD_INITIALIZER(vruntime_head);
 
+/*
+ * The default run queue backend: an indexed d-ary min-heap of task pointers.
+ * A 4-ary heap halves the tree depth of a binary heap and keeps the children
+ * of a node in the same cache line, at the cost of a few more comparisons
+ * when sifting down. The heap is allocated once, sized to pid_max.
+ */
+#define HEAP_ARITY 4
+
+static struct enqueued_task **heap;
+static __u32 heap_nr;
+
+/* Staging buffer used to drain the enqueued ring buffer in batches. */
+static struct enqueued_task *drain_buf[MAX_ENQUEUED_TASKS];
+static __u32 drain_nr;
+
+static const struct rq_ops *rq;
+
 /*
  * The main array of tasks. The array is allocated all at once during
  * initialization, based on /proc/sys/kernel/pid_max, to avoid having to
@@ -150,18 +203,211 @@ static __u32 task_pid(const struct enqueued_task *task)
 	return ((uintptr_t)task - (uintptr_t)tasks) / sizeof(*task);
 }
 
+static __u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int list_init(void)
+{
+	return 0;
+}
+
+static void list_insert(struct enqueued_task *curr)
+{
+	struct enqueued_task *enqueued, *prev;
+
+	if (LIST_EMPTY(&vruntime_head)) {
+		LIST_INSERT_HEAD(&vruntime_head, curr, entries);
+		return;
+	}
+
+	LIST_FOREACH(enqueued, &vruntime_head, entries) {
+		if (curr->vruntime <= enqueued->vruntime) {
+			LIST_INSERT_BEFORE(enqueued, curr, entries);
+			return;
+		}
+		prev = enqueued;
+	}
+
+	LIST_INSERT_AFTER(prev, curr, entries);
+}
+
+static void list_insert_batch(struct enqueued_task **batch, __u32 nr)
+{
+	__u32 i;
+
+	for (i = 0; i < nr; i++)
+		list_insert(batch[i]);
+}
+
+static void list_update(struct enqueued_task *task)
+{
+	LIST_REMOVE(task, entries);
+	list_insert(task);
+}
+
+static struct enqueued_task *list_pop(void)
+{
+	struct enqueued_task *task;
+
+	task = LIST_FIRST(&vruntime_head);
+	if (task)
+		LIST_REMOVE(task, entries);
+
+	return task;
+}
+
+static const struct rq_ops list_rq_ops = {
+	.name		= "list",
+	.init		= list_init,
+	.insert_batch	= list_insert_batch,
+	.update		= list_update,
+	.pop		= list_pop,
+};
+
+static int heap_init(void)
+{
+	heap = calloc(pid_max, sizeof(*heap));
+	if (!heap) {
+		fprintf(stderr, "Error allocating run queue heap\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void heap_set(__u32 idx, struct enqueued_task *task)
+{
+	heap[idx] = task;
+	task->heap_idx = idx;
+}
+
+static void heap_sift_up(__u32 idx)
+{
+	struct enqueued_task *task = heap[idx];
+
+	while (idx > 0) {
+		__u32 parent = (idx - 1) / HEAP_ARITY;
+
+		if (heap[parent]->vruntime <= task->vruntime)
+			break;
+		heap_set(idx, heap[parent]);
+		idx = parent;
+	}
+	heap_set(idx, task);
+}
+
+static void heap_sift_down(__u32 idx)
+{
+	struct enqueued_task *task = heap[idx];
+
+	while (1) {
+		__u32 child = idx * HEAP_ARITY + 1;
+		__u32 i, last, min = idx;
+		double min_vtime = task->vruntime;
+
+		if (child >= heap_nr)
+			break;
+
+		last = child + HEAP_ARITY;
+		if (last > heap_nr)
+			last = heap_nr;
+		for (i = child; i < last; i++) {
+			if (heap[i]->vruntime < min_vtime) {
+				min = i;
+				min_vtime = heap[i]->vruntime;
+			}
+		}
+		if (min == idx)
+			break;
+		heap_set(idx, heap[min]);
+		idx = min;
+	}
+	heap_set(idx, task);
+}
+
+static void heap_insert_batch(struct enqueued_task **batch, __u32 nr)
+{
+	__u32 i, base = heap_nr;
+
+	for (i = 0; i < nr; i++)
+		heap_set(heap_nr++, batch[i]);
+
+	/*
+	 * When the batch is large relative to the existing heap, rebuilding
+	 * the whole heap bottom-up is O(n) and beats sifting up every new
+	 * entry, which is O(nr * log n).
+	 */
+	if (nr > base) {
+		for (i = heap_nr / HEAP_ARITY + 1; i-- > 0;) {
+			if (i < heap_nr)
+				heap_sift_down(i);
+		}
+	} else {
+		for (i = base; i < heap_nr; i++)
+			heap_sift_up(i);
+	}
+}
+
+static void heap_update(struct enqueued_task *task)
+{
+	heap_sift_up(task->heap_idx);
+	heap_sift_down(task->heap_idx);
+}
+
+static struct enqueued_task *heap_pop(void)
+{
+	struct enqueued_task *task;
+
+	if (!heap_nr)
+		return NULL;
+
+	task = heap[0];
+	if (--heap_nr) {
+		heap_set(0, heap[heap_nr]);
+		heap_sift_down(0);
+	}
+
+	return task;
+}
+
+static const struct rq_ops heap_rq_ops = {
+	.name		= "heap",
+	.init		= heap_init,
+	.insert_batch	= heap_insert_batch,
+	.update		= heap_update,
+	.pop		= heap_pop,
+};
+
+static const struct rq_ops *rq_ops_by_name(const char *name)
+{
+	if (!strcmp(name, heap_rq_ops.name))
+		return &heap_rq_ops;
+	if (!strcmp(name, list_rq_ops.name))
+		return &list_rq_ops;
+	return NULL;
+}
+
 static int dispatch_task(__s32 pid)
 {
-	int err;
+	__s32 *sample;
 
-	err = bpf_map_update_elem(dispatched_fd, NULL, &pid, 0);
-	if (err) {
+	/* Userspace is the only producer, the reservation can't race. */
+	sample = user_ring_buffer__reserve(dispatched_rb, sizeof(*sample));
+	if (!sample) {
 		nr_vruntime_failed++;
-	} else {
-		nr_vruntime_dispatches++;
+		return -errno;
 	}
 
-	return err;
+	*sample = pid;
+	user_ring_buffer__submit(dispatched_rb, sample);
+	nr_vruntime_dispatches++;
+
+	return 0;
 }
 
 static struct enqueued_task *get_enqueued_task(__s32 pid)
@@ -192,9 +438,15 @@ static void update_enqueued(struct enqueued_task *enqueued, const struct scx_use
 	enqueued->sum_exec_runtime = bpf_task->sum_exec_runtime;
 }
 
-static int vruntime_enqueue(const struct scx_userland_enqueued_task *bpf_task)
+/*
+ * Update the vruntime of the task described by @bpf_task. On success, @new is
+ * set to the task if it needs to be inserted into the run queue, or to NULL if
+ * it was already queued and has been repositioned in place.
+ */
+static int vruntime_enqueue(const struct scx_userland_enqueued_task *bpf_task,
+			    struct enqueued_task **new)
 {
-	struct enqueued_task *curr, *enqueued, *prev;
+	struct enqueued_task *curr;
 
 	curr = get_enqueued_task(bpf_task->pid);
 	if (!curr)
@@ -202,54 +454,88 @@ static int vruntime_enqueue(const struct scx_userland_enqueued_task *bpf_task)
 
 	update_enqueued(curr, bpf_task);
 	nr_vruntime_enqueues++;
-	nr_curr_enqueued++;
 
 	/*
-	 * Enqueue the task in a vruntime-sorted list. A more optimal data
-	 * structure such as an rbtree could easily be used as well. We elect
-	 * to use a list here simply because it's less code, and thus the
-	 * example is less convoluted and better serves to illustrate what a
-	 * user space scheduler could look like.
+	 * The kernel may enqueue a task again while it's still queued in user
+	 * space, e.g. after its affinity changed. Reposition it rather than
+	 * linking it into the run queue twice. A task which is only staged in
+	 * drain_buf isn't in the run queue yet and will be inserted with its
+	 * updated vruntime when the buffer is flushed.
 	 */
-
-	if (LIST_EMPTY(&vruntime_head)) {
-		LIST_INSERT_HEAD(&vruntime_head, curr, entries);
+	if (curr->staged) {
+		*new = NULL;
 		return 0;
 	}
-
-	LIST_FOREACH(enqueued, &vruntime_head, entries) {
-		if (curr->vruntime <= enqueued->vruntime) {
-			LIST_INSERT_BEFORE(enqueued, curr, entries);
-			return 0;
-		}
-		prev = enqueued;
+	if (curr->queued) {
+		rq->update(curr);
+		*new = NULL;
+		return 0;
 	}
 
-	LIST_INSERT_AFTER(prev, curr, entries);
+	curr->staged = true;
+	nr_curr_enqueued++;
+	*new = curr;
 
 	return 0;
 }
 
-static void drain_enqueued_map(void)
+static void flush_drain_buf(void)
 {
-	while (1) {
-		struct scx_userland_enqueued_task task;
-		int err;
+	__u64 start;
+	__u32 i;
 
-		if (bpf_map_lookup_and_delete_elem(enqueued_fd, NULL, &task)) {
-			skel->bss->nr_queued = 0;
-			skel->bss->nr_scheduled = nr_curr_enqueued;
-			return;
-		}
+	if (!drain_nr)
+		return;
 
-		err = vruntime_enqueue(&task);
-		if (err) {
-			fprintf(stderr, "Failed to enqueue task %d: %s\n",
-				task.pid, strerror(err));
-			exit_req = 1;
-			return;
-		}
+	for (i = 0; i < drain_nr; i++) {
+		drain_buf[i]->staged = false;
+		drain_buf[i]->queued = true;
+	}
+
+	start = now_ns();
+	rq->insert_batch(drain_buf, drain_nr);
+	vruntime_insert_ns += now_ns() - start;
+	nr_vruntime_inserts += drain_nr;
+	drain_nr = 0;
+}
+
+static int handle_enqueued(void *ctx, void *data, size_t size)
+{
+	const struct scx_userland_enqueued_task *task = data;
+	struct enqueued_task *new;
+	int err;
+
+	err = vruntime_enqueue(task, &new);
+	if (err) {
+		fprintf(stderr, "Failed to enqueue task %d: %s\n",
+			task->pid, strerror(err));
+		return -err;
 	}
+
+	if (!new)
+		return 0;
+
+	drain_buf[drain_nr++] = new;
+	if (drain_nr == MAX_ENQUEUED_TASKS)
+		flush_drain_buf();
+
+	return 0;
+}
+
+static void drain_enqueued_ringbuf(void)
+{
+	/*
+	 * Stage newly enqueued tasks and hand them to the run queue in
+	 * batches, so that backends can amortize the insertion cost, e.g. by
+	 * rebuilding the heap in one pass. Consuming the memory mapped ring
+	 * buffer doesn't enter the kernel.
+	 */
+	if (ring_buffer__consume(enqueued_rb) < 0)
+		exit_req = 1;
+
+	flush_drain_buf();
+	skel->bss->nr_queued = 0;
+	skel->bss->nr_scheduled = nr_curr_enqueued;
 }
 
 static void dispatch_batch(void)
@@ -261,23 +547,24 @@ static void dispatch_batch(void)
 		int err;
 		__s32 pid;
 
-		task = LIST_FIRST(&vruntime_head);
+		task = rq->pop();
 		if (!task)
 			break;
 
 		min_vruntime = task->vruntime;
 		pid = task_pid(task);
-		LIST_REMOVE(task, entries);
 		err = dispatch_task(pid);
 		if (err) {
 			/*
 			 * If we fail to dispatch, put the task back to the
-			 * vruntime_head list and stop dispatching additional
-			 * tasks in this batch.
+			 * run queue and stop dispatching additional tasks in
+			 * this batch. It still has the lowest vruntime, so it
+			 * will be picked first on the next round.
 			 */
-			LIST_INSERT_HEAD(&vruntime_head, task, entries);
+			rq->insert_batch(&task, 1);
 			break;
 		}
+		task->queued = false;
 		nr_curr_enqueued--;
 	}
 	skel->bss->nr_scheduled = nr_curr_enqueued;
@@ -287,17 +574,23 @@ static void *run_stats_printer(void *arg)
 {
 	while (!exit_req) {
 		__u64 nr_failed_enqueues, nr_kernel_enqueues, nr_user_enqueues, total;
+		__u64 nr_direct_dispatches, avg_insert_ns;
 
 		nr_failed_enqueues = skel->bss->nr_failed_enqueues;
 		nr_kernel_enqueues = skel->bss->nr_kernel_enqueues;
 		nr_user_enqueues = skel->bss->nr_user_enqueues;
-		total = nr_failed_enqueues + nr_kernel_enqueues + nr_user_enqueues;
+		nr_direct_dispatches = skel->bss->nr_direct_dispatches;
+		total = nr_failed_enqueues + nr_kernel_enqueues + nr_user_enqueues +
+			nr_direct_dispatches;
+		avg_insert_ns = nr_vruntime_inserts ?
+			vruntime_insert_ns / nr_vruntime_inserts : 0;
 
 		printf("o-----------------------o\n");
 		printf("| BPF ENQUEUES          |\n");
 		printf("|-----------------------|\n");
 		printf("|  kern:     %10llu |\n", nr_kernel_enqueues);
 		printf("|  user:     %10llu |\n", nr_user_enqueues);
+		printf("|  direct:   %10llu |\n", nr_direct_dispatches);
 		printf("|  failed:   %10llu |\n", nr_failed_enqueues);
 		printf("|  -------------------- |\n");
 		printf("|  total:    %10llu |\n", total);
@@ -308,6 +601,9 @@ static void *run_stats_printer(void *arg)
 		printf("|  enq:      %10llu |\n", nr_vruntime_enqueues);
 		printf("|  disp:     %10llu |\n", nr_vruntime_dispatches);
 		printf("|  failed:   %10llu |\n", nr_vruntime_failed);
+		printf("|  queued:   %10llu |\n", nr_curr_enqueued);
+		printf("|  ins ns:   %10llu |\n", avg_insert_ns);
+		printf("|  rq:       %10s |\n", rq->name);
 		printf("o-----------------------o\n");
 		printf("\n\n");
 		fflush(stdout);
@@ -354,10 +650,6 @@ static void pre_bootstrap(int argc, char **argv)
 		.sched_priority = sched_get_priority_max(SCHED_EXT),
 	};
 
-	err = init_tasks();
-	if (err)
-		exit(err);
-
 	libbpf_set_print(libbpf_print_fn);
 	signal(SIGINT, sigint_handler);
 	signal(SIGTERM, sigint_handler);
@@ -372,11 +664,23 @@ static void pre_bootstrap(int argc, char **argv)
 	err = syscall(__NR_sched_setscheduler, getpid(), SCHED_EXT, &sched_param);
 	SCX_BUG_ON(err, "Failed to set scheduler to SCHED_EXT");
 
-	while ((opt = getopt(argc, argv, "b:vh")) != -1) {
+	rq = &heap_rq_ops;
+
+	while ((opt = getopt(argc, argv, "b:q:Dvh")) != -1) {
 		switch (opt) {
 		case 'b':
 			batch_size = strtoul(optarg, NULL, 0);
 			break;
+		case 'q':
+			rq = rq_ops_by_name(optarg);
+			if (!rq) {
+				fprintf(stderr, "Unknown run queue backend: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'D':
+			direct_dispatch = false;
+			break;
 		case 'v':
 			verbose = true;
 			break;
@@ -386,6 +690,14 @@ static void pre_bootstrap(int argc, char **argv)
 		}
 	}
 
+	err = init_tasks();
+	if (err)
+		exit(err);
+
+	err = rq->init();
+	if (err)
+		exit(err);
+
 	/*
 	 * It's not always safe to allocate in a user space scheduler, as an
 	 * enqueued task could hold a lock that we require in order to be able
@@ -403,13 +715,21 @@ static void bootstrap(char *comm)
 	assert(skel->rodata->num_possible_cpus > 0);
 	skel->rodata->usersched_pid = getpid();
 	assert(skel->rodata->usersched_pid > 0);
+	skel->rodata->direct_dispatch = direct_dispatch;
 
 	SCX_OPS_LOAD(skel, userland_ops, scx_userland, uei);
 
-	enqueued_fd = bpf_map__fd(skel->maps.enqueued);
-	dispatched_fd = bpf_map__fd(skel->maps.dispatched);
-	assert(enqueued_fd > 0);
-	assert(dispatched_fd > 0);
+	/*
+	 * Both ring buffers are memory mapped here, before SCX_OPS_ATTACH().
+	 * Setting them up later could fault and allocate on the scheduling
+	 * path.
+	 */
+	enqueued_rb = ring_buffer__new(bpf_map__fd(skel->maps.enqueued),
+				       handle_enqueued, NULL, NULL);
+	SCX_BUG_ON(!enqueued_rb, "Failed to create enqueued ring buffer");
+	dispatched_rb = user_ring_buffer__new(bpf_map__fd(skel->maps.dispatched),
+					      NULL);
+	SCX_BUG_ON(!dispatched_rb, "Failed to create dispatched ring buffer");
 
 	SCX_BUG_ON(spawn_stats_thread(), "Failed to spawn stats thread");
 
@@ -424,17 +744,17 @@ static void sched_main_loop(void)
 		 * Perform the following work in the main user space scheduler
 		 * loop:
 		 *
-		 * 1. Drain all tasks from the enqueued map, and enqueue them
-		 *    to the vruntime sorted list.
+		 * 1. Drain all tasks from the enqueued ring buffer, and enqueue
+		 *    them to the vruntime ordered run queue.
 		 *
-		 * 2. Dispatch a batch of tasks from the vruntime sorted list
-		 *    down to the kernel.
+		 * 2. Dispatch a batch of tasks from the vruntime ordered run
+		 *    queue down to the kernel.
 		 *
 		 * 3. Yield the CPU back to the system. The BPF scheduler will
 		 *    reschedule the user space scheduler once another task has
 		 *    been enqueued to user space.
 		 */
-		drain_enqueued_map();
+		drain_enqueued_ringbuf();
 		dispatch_batch();
 		sched_yield();
 	}
@@ -452,6 +772,8 @@ restart:
 	exit_req = 1;
 	bpf_link__destroy(ops_link);
 	ecode = UEI_REPORT(skel, uei);
+	user_ring_buffer__free(dispatched_rb);
+	ring_buffer__free(enqueued_rb);
 	scx_userland__destroy(skel);
 
 	if (UEI_ECODE_RESTART(ecode))
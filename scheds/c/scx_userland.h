@@ -4,6 +4,18 @@
 #ifndef __SCX_USERLAND_COMMON_H
 #define __SCX_USERLAND_COMMON_H
 
+/*
+ * Maximum amount of tasks enqueued/dispatched between kernel and user-space.
+ */
+#define MAX_ENQUEUED_TASKS 4096
+
+/*
+ * Sizes of the ring buffers used to exchange tasks. Each record carries an
+ * 8-byte header and is padded to 8 bytes. The sizes must be powers of two.
+ */
+#define ENQUEUED_RINGBUF_SIZE (MAX_ENQUEUED_TASKS * 32)
+#define DISPATCHED_RINGBUF_SIZE (MAX_ENQUEUED_TASKS * 16)
+
 /*
  * An instance of a task that has been enqueued by the kernel for consumption
  * by a user space global scheduler thread.
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Helpers to lay out structs which are shared between CPUs without false
+ * sharing. This header is included from interface headers and thus must be
+ * usable from BPF programs, userspace C and bindgen alike.
+ *
+ * Copyright (c) 2024 Meta Platforms, Inc. and affiliates.
+ */
+#ifndef __SCX_CACHELINE_H
+#define __SCX_CACHELINE_H
+
+#define SCX_CACHELINE_SIZE	64
+
+/*
+ * Align a struct or a struct member to a cacheline boundary.
+ *
+ * Put fields which are frequently written from multiple CPUs on their own
+ * cachelines away from read-mostly fields, and mark the first field of each
+ * such group with __scx_cacheline_aligned. Aligning the struct itself keeps
+ * neighboring elements of an array from sharing the first and the last
+ * cachelines.
+ *
+ * For example:
+ *
+ *	struct foo {
+ *		u64	config;				// read-mostly
+ *
+ *		u64	counter __scx_cacheline_aligned;	// written by all CPUs
+ *	} __scx_cacheline_aligned;
+ */
+#define __scx_cacheline_aligned	__attribute__((aligned(SCX_CACHELINE_SIZE)))
+
+/*
+ * Fail the build if @type doesn't start on a cacheline boundary or doesn't
+ * span whole cachelines, e.g. because __scx_cacheline_aligned was dropped from
+ * the struct. Put it right after the definition of each aligned struct.
+ */
+#define SCX_ASSERT_CACHELINE_ALIGNED(type)					\
+	_Static_assert(_Alignof(type) == SCX_CACHELINE_SIZE &&			\
+		       sizeof(type) % SCX_CACHELINE_SIZE == 0,			\
+		       #type " must be cacheline aligned")
+
+/*
+ * Fail the build if @member of @type doesn't start its own cacheline.
+ */
+#define SCX_ASSERT_CACHELINE_START(type, member)				\
+	_Static_assert(__builtin_offsetof(type, member) % SCX_CACHELINE_SIZE == 0, \
+		       #type "." #member " must start a cacheline")
+
+#endif /* __SCX_CACHELINE_H */
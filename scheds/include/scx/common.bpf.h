@@ -312,6 +312,7 @@ bool bpf_cpumask_empty(const struct cpumask *cpumask) __ksym;
 bool bpf_cpumask_full(const struct cpumask *cpumask) __ksym;
 void bpf_cpumask_copy(struct bpf_cpumask *dst, const struct cpumask *src) __ksym;
 u32 bpf_cpumask_any_distribute(const struct cpumask *cpumask) __ksym;
+u32 bpf_cpumask_weight(const struct cpumask *cpumask) __ksym;
 u32 bpf_cpumask_any_and_distribute(const struct cpumask *src1,
 				   const struct cpumask *src2) __ksym;
 
@@ -412,6 +413,153 @@ static inline u32 log2_u64(u64 v)
                 return log2_u32(v) + 1;
 }
 
+/*
+ * lowest_bit_u64 - Find the 0-based index of the lowest set bit of a 64-bit
+ * value. Unlike the kernel's ffs(), the lowest bit is 0 rather than 1.
+ * @v: The value to search, must not be zero.
+ */
+static inline u32 lowest_bit_u64(u64 v)
+{
+	u32 bit = 0;
+
+	if (!(v & 0xffffffffLLU)) {
+		v >>= 32;
+		bit += 32;
+	}
+	if (!(v & 0xffff)) {
+		v >>= 16;
+		bit += 16;
+	}
+	if (!(v & 0xff)) {
+		v >>= 8;
+		bit += 8;
+	}
+	if (!(v & 0xf)) {
+		v >>= 4;
+		bit += 4;
+	}
+	if (!(v & 0x3)) {
+		v >>= 2;
+		bit += 2;
+	}
+	if (!(v & 0x1))
+		bit += 1;
+
+	return bit;
+}
+
+/*
+ * Scratch cpumasks of scx_pick_idle_cpu(), to be kept in a per-CPU map by the
+ * scheduler and allocated with scx_pick_scratch_init().
+ */
+struct scx_pick_scratch {
+	struct bpf_cpumask __kptr *llc_cpumask;
+	struct bpf_cpumask __kptr *node_cpumask;
+};
+
+static inline s32 __scx_pick_scratch_alloc(struct bpf_cpumask **p_cpumask)
+{
+	struct bpf_cpumask *cpumask;
+
+	if (!(cpumask = bpf_cpumask_create()))
+		return -ENOMEM;
+
+	cpumask = bpf_kptr_xchg(p_cpumask, cpumask);
+	if (cpumask)
+		bpf_cpumask_release(cpumask);
+
+	return 0;
+}
+
+/*
+ * scx_pick_scratch_init - Allocate the scratch cpumasks of scx_pick_idle_cpu().
+ * @scratch: Scratch cpumasks to allocate.
+ *
+ * Must be called from a sleepable context, usually ops.init().
+ */
+static inline s32 scx_pick_scratch_init(struct scx_pick_scratch *scratch)
+{
+	s32 ret;
+
+	if ((ret = __scx_pick_scratch_alloc(&scratch->llc_cpumask)))
+		return ret;
+	return __scx_pick_scratch_alloc(&scratch->node_cpumask);
+}
+
+/*
+ * scx_pick_idle_cpu - Pick and claim an idle CPU close to @prev_cpu.
+ * @cand_cpumask: CPUs to pick from, usually the task's allowed CPUs.
+ * @prev_cpu: CPU the task last ran on.
+ * @llc_cpumask: CPUs sharing the LLC with @prev_cpu, NULL if unknown.
+ * @node_cpumask: CPUs in the NUMA node of @prev_cpu, NULL if unknown.
+ * @idle_smtmask: Idle SMT mask, NULL if SMT is disabled.
+ * @scratch: Scratch cpumasks of the current CPU.
+ *
+ * Fully idle cores are tried first, as any of them is likely a better pick
+ * than a partially idle @prev_cpu. Within each pass the search widens from
+ * @prev_cpu to its LLC, its node and finally @cand_cpumask.
+ *
+ * The LLC and node masks are meant to be built once at init and cached by the
+ * scheduler. They are intersected with @cand_cpumask in @scratch, so that
+ * tasks with a narrower affinity still prefer the CPUs close to @prev_cpu. The
+ * LLC and node passes are skipped if @scratch is NULL or if the intersection
+ * is empty.
+ *
+ * Returns the claimed CPU or -EBUSY if there's no idle CPU in @cand_cpumask.
+ */
+static __always_inline s32
+scx_pick_idle_cpu(const struct cpumask *cand_cpumask, s32 prev_cpu,
+		  const struct cpumask *llc_cpumask,
+		  const struct cpumask *node_cpumask,
+		  const struct cpumask *idle_smtmask,
+		  struct scx_pick_scratch *scratch)
+{
+	bool prev_in_cand = bpf_cpumask_test_cpu(prev_cpu, cand_cpumask);
+	struct bpf_cpumask *tmp;
+	s32 cpu;
+
+	if (llc_cpumask) {
+		if (scratch && (tmp = scratch->llc_cpumask) &&
+		    bpf_cpumask_and(tmp, llc_cpumask, cand_cpumask))
+			llc_cpumask = (const struct cpumask *)tmp;
+		else
+			llc_cpumask = NULL;
+	}
+	if (node_cpumask) {
+		if (scratch && (tmp = scratch->node_cpumask) &&
+		    bpf_cpumask_and(tmp, node_cpumask, cand_cpumask))
+			node_cpumask = (const struct cpumask *)tmp;
+		else
+			node_cpumask = NULL;
+	}
+
+	if (idle_smtmask) {
+		if (prev_in_cand &&
+		    bpf_cpumask_test_cpu(prev_cpu, idle_smtmask) &&
+		    scx_bpf_test_and_clear_cpu_idle(prev_cpu))
+			return prev_cpu;
+
+		if (llc_cpumask &&
+		    (cpu = scx_bpf_pick_idle_cpu(llc_cpumask, SCX_PICK_IDLE_CORE)) >= 0)
+			return cpu;
+		if (node_cpumask &&
+		    (cpu = scx_bpf_pick_idle_cpu(node_cpumask, SCX_PICK_IDLE_CORE)) >= 0)
+			return cpu;
+		if ((cpu = scx_bpf_pick_idle_cpu(cand_cpumask, SCX_PICK_IDLE_CORE)) >= 0)
+			return cpu;
+	}
+
+	if (prev_in_cand && scx_bpf_test_and_clear_cpu_idle(prev_cpu))
+		return prev_cpu;
+
+	if (llc_cpumask && (cpu = scx_bpf_pick_idle_cpu(llc_cpumask, 0)) >= 0)
+		return cpu;
+	if (node_cpumask && (cpu = scx_bpf_pick_idle_cpu(node_cpumask, 0)) >= 0)
+		return cpu;
+
+	return scx_bpf_pick_idle_cpu(cand_cpumask, 0);
+}
+
 #include "compat.bpf.h"
 
 #endif	/* __SCX_COMMON_BPF_H */
@@ -0,0 +1,43 @@
+#ifndef __SCX_LATHIST_BPF_H__
+#define __SCX_LATHIST_BPF_H__
+
+/*
+ * Log2 latency histograms to be used in BPF progs. This header only has the
+ * definitions shared with user space and is meant to be included from
+ * interface headers. See lathist_impl.bpf.h for the recording side and
+ * scx_utils::lathist for the reader.
+ */
+enum lathist_consts {
+	/*
+	 * Bucket 0 counts values below 2ns, bucket b > 0 counts values in
+	 * [2^b, 2^(b+1)) ns. The last bucket also counts all the larger
+	 * values (>= ~2.1s).
+	 */
+	LATHIST_NR_BUCKETS	= 32,
+};
+
+/*
+ * What each histogram measures. LATHIST_RUNQ is the time from enqueue to
+ * running and LATHIST_DECISION the time from enqueue to the dispatch decision
+ * of a user-space scheduler. The others are the execution time of the
+ * matching operations. Schedulers record only the ones they instrument.
+ */
+enum lathist_idx {
+	LATHIST_RUNQ,
+	LATHIST_SELECT_CPU,
+	LATHIST_ENQUEUE,
+	LATHIST_DISPATCH,
+	LATHIST_RUNNING,
+	LATHIST_STOPPING,
+	LATHIST_DECISION,
+
+	LATHIST_NR,
+};
+
+struct lathist {
+	u64			buckets[LATHIST_NR_BUCKETS];
+	/* sum of all the recorded values, for the mean */
+	u64			sum;
+};
+
+#endif /* __SCX_LATHIST_BPF_H__ */
@@ -0,0 +1,130 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Userspace reader of the latency histograms recorded with
+ * lathist_impl.bpf.h. See scx_utils::lathist for the Rust equivalent.
+ *
+ * Copyright (c) 2024 Meta Platforms, Inc. and affiliates.
+ */
+#ifndef __SCX_LATHIST_H
+#define __SCX_LATHIST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include "lathist.bpf.h"
+
+/* names of the histograms, indexed by enum lathist_idx */
+static const char *scx_lathist_names[LATHIST_NR] = {
+	[LATHIST_RUNQ]		= "runq",
+	[LATHIST_SELECT_CPU]	= "select_cpu",
+	[LATHIST_ENQUEUE]	= "enqueue",
+	[LATHIST_DISPATCH]	= "dispatch",
+	[LATHIST_RUNNING]	= "running",
+	[LATHIST_STOPPING]	= "stopping",
+	[LATHIST_DECISION]	= "decision",
+};
+
+/**
+ * scx_lathist_read - Read a latency histogram summed over all CPUs
+ * @map_fd: fd of the per-CPU lathists map
+ * @idx: histogram to read
+ * @hist: filled with the sum of the per-CPU histograms
+ *
+ * Returns 0 on success, -errno otherwise.
+ */
+static inline int scx_lathist_read(int map_fd, u32 idx, struct lathist *hist)
+{
+	int nr_cpus = libbpf_num_possible_cpus(), cpu, bucket, ret;
+	struct lathist *percpu;
+
+	memset(hist, 0, sizeof(*hist));
+	if (nr_cpus <= 0)
+		return nr_cpus ?: -EINVAL;
+	if (!(percpu = calloc(nr_cpus, sizeof(*percpu))))
+		return -ENOMEM;
+
+	ret = bpf_map_lookup_elem(map_fd, &idx, percpu);
+	if (ret < 0) {
+		ret = -errno;
+		goto out_free;
+	}
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		for (bucket = 0; bucket < LATHIST_NR_BUCKETS; bucket++)
+			hist->buckets[bucket] += percpu[cpu].buckets[bucket];
+		hist->sum += percpu[cpu].sum;
+	}
+out_free:
+	free(percpu);
+	return ret;
+}
+
+/**
+ * scx_lathist_percentile - Upper bound of the bucket containing a percentile
+ * @hist: histogram to look up
+ * @cnt: number of values in @hist
+ * @pct: percentile, between 0 and 100
+ *
+ * Returns the upper bound in ns, which is within 2x of the actual value, or 0
+ * if @hist is empty.
+ */
+static inline u64 scx_lathist_percentile(const struct lathist *hist, u64 cnt,
+					 u32 pct)
+{
+	u64 target = (cnt * pct + 99) / 100, acc = 0;
+	int bucket;
+
+	if (!cnt)
+		return 0;
+	if (!target)
+		target = 1;
+
+	for (bucket = 0; bucket < LATHIST_NR_BUCKETS; bucket++) {
+		acc += hist->buckets[bucket];
+		if (acc >= target)
+			return 1LLU << (bucket + 1);
+	}
+	return (u64)-1;
+}
+
+/**
+ * scx_lathist_report - Print the latency histograms recorded since last time
+ * @map_fd: fd of the per-CPU lathists map
+ * @prev: LATHIST_NR histograms read by the previous call, updated
+ *
+ * Only the histograms which recorded any value since the previous call are
+ * printed, with the same format as the Rust schedulers.
+ */
+static inline void scx_lathist_report(int map_fd, struct lathist *prev)
+{
+	u32 idx;
+
+	for (idx = 0; idx < LATHIST_NR; idx++) {
+		struct lathist cur, delta;
+		u64 cnt = 0;
+		int bucket;
+
+		if (scx_lathist_read(map_fd, idx, &cur))
+			continue;
+
+		for (bucket = 0; bucket < LATHIST_NR_BUCKETS; bucket++) {
+			delta.buckets[bucket] = cur.buckets[bucket] -
+						prev[idx].buckets[bucket];
+			cnt += delta.buckets[bucket];
+		}
+		delta.sum = cur.sum - prev[idx].sum;
+		prev[idx] = cur;
+
+		if (!cnt)
+			continue;
+		printf("lat_%s: cnt=%llu avg=%lluns p50<%lluns p99<%lluns\n",
+		       scx_lathist_names[idx], (unsigned long long)cnt,
+		       (unsigned long long)(delta.sum / cnt),
+		       (unsigned long long)scx_lathist_percentile(&delta, cnt, 50),
+		       (unsigned long long)scx_lathist_percentile(&delta, cnt, 99));
+	}
+}
+
+#endif	/* __SCX_LATHIST_H */
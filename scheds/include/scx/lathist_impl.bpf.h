@@ -0,0 +1,94 @@
+/* to be included in the main bpf.c file */
+#include "lathist.bpf.h"
+
+#define LATHIST_FN_ATTRS	inline __attribute__((unused, always_inline))
+
+/*
+ * Recording is opt-in. While @lathist_enabled is false, which is the default,
+ * the verifier prunes all the recording code as dead and the instrumented
+ * operations run exactly as if they weren't instrumented.
+ */
+const volatile bool lathist_enabled;
+
+/* per-CPU histograms indexed by enum lathist_idx */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct lathist);
+	__uint(max_entries, LATHIST_NR);
+} lathists SEC(".maps");
+
+/* enqueue timestamp of each task for LATHIST_RUNQ */
+struct {
+	__uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, u64);
+} lathist_task_enq_at SEC(".maps");
+
+static LATHIST_FN_ATTRS void lathist_record(enum lathist_idx idx, u64 val)
+{
+	struct lathist *hist;
+	u32 key = idx, bucket;
+
+	if (!lathist_enabled)
+		return;
+
+	if (!(hist = bpf_map_lookup_elem(&lathists, &key)))
+		return;
+
+	/* log2_u64() returns the number of significant bits */
+	bucket = log2_u64(val) - 1;
+	if (bucket >= LATHIST_NR_BUCKETS)
+		bucket = LATHIST_NR_BUCKETS - 1;
+
+	hist->buckets[bucket]++;
+	hist->sum += val;
+}
+
+/*
+ * Time an operation: u64 start = lathist_start(); ...;
+ * lathist_end(LATHIST_ENQUEUE, start);
+ */
+static LATHIST_FN_ATTRS u64 lathist_start(void)
+{
+	return lathist_enabled ? bpf_ktime_get_ns() : 0;
+}
+
+static LATHIST_FN_ATTRS void lathist_end(enum lathist_idx idx, u64 start)
+{
+	if (lathist_enabled)
+		lathist_record(idx, bpf_ktime_get_ns() - start);
+}
+
+/*
+ * To be called from ops.enqueue(), and also from ops.select_cpu() if it may
+ * dispatch directly, as such tasks skip ops.enqueue().
+ */
+static LATHIST_FN_ATTRS void lathist_enqueued(struct task_struct *p)
+{
+	u64 *enq_at;
+
+	if (!lathist_enabled)
+		return;
+
+	enq_at = bpf_task_storage_get(&lathist_task_enq_at, p, 0,
+				      BPF_LOCAL_STORAGE_GET_F_CREATE);
+	if (enq_at)
+		*enq_at = bpf_ktime_get_ns();
+}
+
+/* to be called from ops.running(), records LATHIST_RUNQ */
+static LATHIST_FN_ATTRS void lathist_running(struct task_struct *p)
+{
+	u64 *enq_at;
+
+	if (!lathist_enabled)
+		return;
+
+	enq_at = bpf_task_storage_get(&lathist_task_enq_at, p, 0, 0);
+	if (enq_at && *enq_at) {
+		lathist_record(LATHIST_RUNQ, bpf_ktime_get_ns() - *enq_at);
+		*enq_at = 0;
+	}
+}
@@ -62,7 +62,8 @@ static const int ravg_full_sum_len = sizeof(ravg_full_sum) / sizeof(ravg_full_su
 static RAVG_FN_ATTRS void ravg_accumulate(struct ravg_data *rd, u64 new_val, u64 now,
 					  u32 half_life)
 {
-	u32 cur_seq, val_seq, seq_delta;
+	u64 cur_seq, val_seq;
+	u32 now_rem, val_rem, seq_delta;
 
 	/*
 	 * It may be difficult for the caller to guarantee monotonic progress if
@@ -72,8 +73,14 @@ static RAVG_FN_ATTRS void ravg_accumulate(struct ravg_data *rd, u64 new_val, u64
 	if (now < rd->val_at)
 		now = rd->val_at;
 
+	/*
+	 * 64bit divisions are expensive. Divide each timestamp once and derive
+	 * the remainders from the quotients.
+	 */
 	cur_seq = now / half_life;
 	val_seq = rd->val_at / half_life;
+	now_rem = now - cur_seq * half_life;
+	val_rem = rd->val_at - val_seq * half_life;
 	seq_delta = cur_seq - val_seq;
 
 	/*
@@ -112,7 +119,7 @@ static RAVG_FN_ATTRS void ravg_accumulate(struct ravg_data *rd, u64 new_val, u64
 		u32 dur;
 
 		/* fold the oldest period which may be partial */
-		dur = ravg_normalize_dur(half_life - rd->val_at % half_life, half_life);
+		dur = ravg_normalize_dur(half_life - val_rem, half_life);
 		ravg_add(&rd->old, rd->val * ravg_decay(dur, seq_delta));
 
 		/* fold the full periods in the middle with precomputed vals */
@@ -126,8 +133,7 @@ static RAVG_FN_ATTRS void ravg_accumulate(struct ravg_data *rd, u64 new_val, u64
 		}
 
 		/* accumulate the current period duration into ->cur */
-		rd->cur += rd->val * ravg_normalize_dur(now % half_life,
-							half_life);
+		rd->cur += rd->val * ravg_normalize_dur(now_rem, half_life);
 	} else {
 		rd->cur += rd->val * ravg_normalize_dur(now - rd->val_at,
 							half_life);
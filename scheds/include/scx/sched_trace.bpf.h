@@ -0,0 +1,28 @@
+#ifndef __SCX_SCHED_TRACE_BPF_H__
+#define __SCX_SCHED_TRACE_BPF_H__
+
+/*
+ * Compact scheduling event trace to be captured from BPF progs and replayed
+ * offline. This header only has the definitions shared with user space and is
+ * meant to be included from interface headers. See sched_trace_impl.bpf.h for
+ * the capture side, scx_utils::sched_trace for the capture writer and reader
+ * and scx_utils::sched_sim for the replay simulator.
+ */
+enum sched_trace_kind {
+	SCHED_TRACE_WAKE,	/* task became runnable */
+	SCHED_TRACE_RUN,	/* task started running */
+	SCHED_TRACE_STOP,	/* task stopped running, see @runnable */
+};
+
+struct sched_trace_event {
+	u64			ts;
+	u32			pid;
+	u32			cpu;
+	u32			weight;
+	u8			kind;
+	/* for SCHED_TRACE_STOP, whether the task is still runnable */
+	u8			runnable;
+	u16			__pad;
+};
+
+#endif /* __SCX_SCHED_TRACE_BPF_H__ */
@@ -0,0 +1,67 @@
+/* to be included in the main bpf.c file */
+#include "sched_trace.bpf.h"
+
+#define SCHED_TRACE_FN_ATTRS	inline __attribute__((unused, always_inline))
+
+/*
+ * Capture is opt-in. While @sched_trace_enabled is false, which is the
+ * default, the verifier prunes all the capture code as dead.
+ */
+const volatile bool sched_trace_enabled;
+
+/* events which didn't fit in @sched_trace_rb */
+u64 sched_trace_nr_dropped;
+
+/*
+ * 4MiB holds about 170k events. User space is expected to drain it several
+ * times a second, events are dropped while it's full. Schedulers shrink it at
+ * open time unless capture is enabled, see scx_utils::sched_trace.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 4 << 20);
+} sched_trace_rb SEC(".maps");
+
+static SCHED_TRACE_FN_ATTRS void sched_trace_record(struct task_struct *p,
+						    enum sched_trace_kind kind,
+						    bool runnable)
+{
+	struct sched_trace_event *ev;
+
+	if (!sched_trace_enabled)
+		return;
+
+	ev = bpf_ringbuf_reserve(&sched_trace_rb, sizeof(*ev), 0);
+	if (!ev) {
+		__sync_fetch_and_add(&sched_trace_nr_dropped, 1);
+		return;
+	}
+
+	ev->ts = bpf_ktime_get_ns();
+	ev->pid = p->pid;
+	ev->cpu = scx_bpf_task_cpu(p);
+	ev->weight = p->scx.weight;
+	ev->kind = kind;
+	ev->runnable = runnable;
+	ev->__pad = 0;
+	bpf_ringbuf_submit(ev, BPF_RB_NO_WAKEUP);
+}
+
+/* to be called from ops.runnable() */
+static SCHED_TRACE_FN_ATTRS void sched_trace_runnable(struct task_struct *p)
+{
+	sched_trace_record(p, SCHED_TRACE_WAKE, true);
+}
+
+/* to be called from ops.running() */
+static SCHED_TRACE_FN_ATTRS void sched_trace_running(struct task_struct *p)
+{
+	sched_trace_record(p, SCHED_TRACE_RUN, true);
+}
+
+/* to be called from ops.stopping() */
+static SCHED_TRACE_FN_ATTRS void sched_trace_stopping(struct task_struct *p,
+						      bool runnable)
+{
+	sched_trace_record(p, SCHED_TRACE_STOP, runnable);
+}
@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Userspace helpers to read the CPU topology from sysfs.
+ *
+ * Copyright (c) 2024 Meta Platforms, Inc. and affiliates.
+ */
+#ifndef __SCX_TOPOLOGY_H
+#define __SCX_TOPOLOGY_H
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+static inline int __scx_read_u64(const char *path, u64 *v)
+{
+	FILE *fp;
+	int ret;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+	ret = fscanf(fp, "%llu", (unsigned long long *)v) == 1 ? 0 : -EINVAL;
+	fclose(fp);
+	return ret;
+}
+
+/**
+ * scx_read_cpulist - Read a CPU list file from sysfs
+ * @path: path of the file, e.g. /sys/devices/system/node/node0/cpulist
+ * @cpus: filled with the CPUs in the list in order
+ * @max: maximum number of CPUs to read, i.e. the size of @cpus
+ *
+ * Parse a cpulist such as "0-3,8-11", ignoring malformed entries. Returns the
+ * number of CPUs read, which is 0 if @path can't be read.
+ */
+static inline u32 scx_read_cpulist(const char *path, s32 *cpus, u32 max)
+{
+	char buf[4096], *tok, *saveptr;
+	u32 nr = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	if (!fgets(buf, sizeof(buf), fp))
+		buf[0] = '\0';
+	fclose(fp);
+
+	for (tok = strtok_r(buf, ",\n", &saveptr); tok;
+	     tok = strtok_r(NULL, ",\n", &saveptr)) {
+		int first, last, cpu;
+
+		switch (sscanf(tok, "%d-%d", &first, &last)) {
+		case 1:
+			last = first;
+			break;
+		case 2:
+			break;
+		default:
+			continue;
+		}
+		for (cpu = first; cpu <= last && nr < max; cpu++)
+			cpus[nr++] = cpu;
+	}
+
+	return nr;
+}
+
+/**
+ * scx_read_cpu_llc_ids - Number the LLCs and map each CPU to its LLC
+ * @cpu_llc: filled with the LLC index of each CPU
+ * @nr_cpus: number of CPUs to map, i.e. the size of @cpu_llc
+ * @max_llcs: maximum number of LLCs
+ *
+ * The LLCs are numbered consecutively in the order they're first seen. The L3
+ * cache is used as the LLC and the L2 cache if there's no L3. CPUs whose cache
+ * topology can't be read are put in the first LLC. If there are more than
+ * @max_llcs LLCs, the excess ones are folded into the others by their IDs.
+ *
+ * Returns the number of LLCs, which is at least 1.
+ */
+static inline u32 scx_read_cpu_llc_ids(u32 *cpu_llc, int nr_cpus, u32 max_llcs)
+{
+	u64 llc_ids[max_llcs];
+	u32 nr_llcs = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		char path[PATH_MAX];
+		u64 id;
+		u32 llc;
+
+		cpu_llc[cpu] = 0;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index3/id", cpu);
+		if (__scx_read_u64(path, &id)) {
+			snprintf(path, sizeof(path),
+				 "/sys/devices/system/cpu/cpu%d/cache/index2/id", cpu);
+			if (__scx_read_u64(path, &id))
+				continue;
+		}
+
+		for (llc = 0; llc < nr_llcs; llc++)
+			if (llc_ids[llc] == id)
+				break;
+		if (llc == nr_llcs) {
+			if (nr_llcs < max_llcs)
+				llc_ids[nr_llcs++] = id;
+			else
+				llc = id % max_llcs;
+		}
+		cpu_llc[cpu] = llc;
+	}
+
+	return nr_llcs ?: 1;
+}
+
+#endif	/* __SCX_TOPOLOGY_H */
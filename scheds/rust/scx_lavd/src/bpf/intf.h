@@ -7,6 +7,7 @@
 #define __INTF_H
 
 #include <limits.h>
+#include <scx/cacheline.h>
 
 #ifndef __VMLINUX_H__
 typedef unsigned char u8;
@@ -49,7 +50,6 @@ extern void bpf_iter_task_destroy(struct bpf_iter_task *it) __weak __ksym;
  */
 enum consts {
 	CLOCK_BOOTTIME			= 7,
-	CACHELINE_SIZE			= 64,
 	NSEC_PER_USEC			= 1000ULL,
 	NSEC_PER_MSEC			= (1000ULL * NSEC_PER_USEC),
 	LAVD_TIME_ONE_SEC		= (1000ULL * NSEC_PER_MSEC),
@@ -78,6 +78,7 @@ enum consts {
 	LAVD_ELIGIBLE_TIME_MAX		= (LAVD_SLICE_MIN_NS >> 8),
 
 	LAVD_CPU_UTIL_MAX		= 1000, /* 100.0% */
+	LAVD_CPUPERF_HYST		= 32, /* 1/32 of SCX_CPUPERF_ONE */
 	LAVD_CPU_ID_HERE		= ((u32)-2),
 	LAVD_CPU_ID_NONE		= ((u32)-1),
 	LAVD_CPU_ID_MAX			= 512,
@@ -95,6 +96,22 @@ enum consts {
 					   LAVD_SYS_STAT_INTERVAL_NS),
 
 	LAVD_GLOBAL_DSQ			= 0,
+	LAVD_LLC_DSQ_BASE		= 1, /* DSQ id of LLC i = base + i */
+	LAVD_LLC_MAX			= 64,
+	LAVD_LLC_FLUSH_NR		= 16, /* schedules per flush of a CPU's pending sums */
+
+	LAVD_HANDOFF_MAX_AGE_NS		= (10 * LAVD_TIME_ONE_SEC), /* see --handoff */
+	LAVD_HANDOFF_MAX_TASKS		= 65536,
+	LAVD_HANDOFF_VERSION		= 1, /* bump when struct handoff_task changes */
+};
+
+/*
+ * Per-LLC stats
+ */
+struct llc_stat {
+	volatile u64	nr_queued;	/* average number of tasks on the LLC's DSQ */
+	volatile u64	nr_local;	/* average number of tasks consumed from the own LLC */
+	volatile u64	nr_stolen;	/* average number of tasks stolen from other LLCs */
 };
 
 /*
@@ -120,68 +137,143 @@ struct sys_stat {
 
 	volatile u64	nr_violation;	/* number of utilization violation */
 	volatile int	nr_active;	/* number of active cores */
+
+	struct llc_stat	llc[LAVD_LLC_MAX]; /* per-LLC stats when per_llc_dsq is on */
 };
 
 /*
  * Per-CPU context
  */
 struct cpu_ctx {
-	/* 
+	/*
+	 * Information of a current running task for preemption
+	 *
+	 * These are read by other CPUs looking for a victim to preempt, and
+	 * last_kick_clk is updated by the kicking CPU, so keep them away from
+	 * the fields the CPU updates for itself.
+	 */
+	volatile u64	stopping_tm_est_ns; /* estimated stopping time */
+	volatile u64	last_kick_clk;	/* when the CPU was kicked */
+	volatile u16	lat_prio;	/* latency priority */
+	volatile u8	is_online;	/* is this CPU online? */
+	s32		cpu_id;		/* cpu id */
+
+	/*
 	 * Information used to keep track of CPU utilization
 	 */
-	volatile u64	util;		/* average of the CPU utilization */
-	volatile u64	idle_total;	/* total idle time so far */
+	volatile u64	util __scx_cacheline_aligned; /* average of the CPU utilization */
+	volatile u64	idle_total;	/* cumulative idle time of finished idle periods */
 	volatile u64	idle_start_clk;	/* when the CPU becomes idle */
+	u64		util_clk;	/* when util was last updated */
+	u64		util_idle_snap;	/* idle_total when util was last updated */
+	u8		util_violation;	/* util is over LAVD_TC_PER_CORE_MAX_CTUIL */
 
 	/*
-	 * Information used to keep track of load
+	 * Information for CPU frequency scaling
 	 */
-	volatile u64	load_ideal;	/* ideal loaf of runnable tasks */
-	volatile u64	load_actual;	/* actual load of runnable tasks */
-	volatile u64	load_run_time_ns; /* total runtime of runnable tasks */
-	volatile u64	last_kick_clk;	/* when the CPU was kicked */
+	u32		cpuperf_cur;	/* CPU's current performance target */
+	u32		cpuperf_task;	/* task's CPU performance target */
+	u32		cpuperf_avg;	/* EWMA of task's CPU performance target */
+	volatile u32	cpuperf_pred;	/* governor's predicted performance target */
+
+	/*
+	 * Information for per-LLC DSQs
+	 */
+	u32		steal_cursor;	/* where the next remote LLC steal starts */
+	u64		pend_local;	/* tasks consumed from the own LLC */
+	u64		pend_stolen;	/* tasks stolen from other LLCs */
+
+	/*
+	 * Per-schedule counters of this CPU which haven't been added to its
+	 * LLC's partial sums yet. Only the CPU itself writes these, so they
+	 * don't need atomics. They're flushed to the llc_ctx every
+	 * LAVD_LLC_FLUSH_NR schedules and when the CPU goes idle.
+	 */
+	u64		pend_lat_cri;	/* sum of latency criticality */
+	u64		pend_sched_nr;	/* number of schedules */
+	u64		pend_perf_cri;	/* sum of performance criticality */
 
 	/*
 	 * Information for cpu hotplug
 	 */
-	u64		online_clk;	/* when a CPU becomes online */
+	u64		online_clk __scx_cacheline_aligned; /* when a CPU becomes online */
 	u64		offline_clk;	/* when a CPU becomes offline */
 
 	/*
-	 * Information used to keep track of latency criticality
+	 * Fields for core compaction
+	 *
 	 */
-	volatile u64	max_lat_cri;	/* maximum latency criticality */
-	volatile u64	min_lat_cri;	/* minimum latency criticality */
-	volatile u64	sum_lat_cri;	/* sum of latency criticality */
-	volatile u64	sched_nr;	/* number of schedules */
+	struct bpf_cpumask __kptr *tmp_a_mask;	/* temporary cpu mask */
+	struct bpf_cpumask __kptr *tmp_o_mask;	/* temporary cpu mask */
+} __scx_cacheline_aligned;
+SCX_ASSERT_CACHELINE_ALIGNED(struct cpu_ctx);
+SCX_ASSERT_CACHELINE_START(struct cpu_ctx, util);
+SCX_ASSERT_CACHELINE_START(struct cpu_ctx, online_clk);
+
+/*
+ * Per-LLC partial sums of the CPU statistics
+ *
+ * CPUs update these incrementally, so the update timer only needs to combine
+ * per-LLC totals. The counters marked cumulative never reset; the timer takes
+ * the difference from its snapshot of the previous interval. Counters bumped on
+ * every schedule are batched in struct cpu_ctx and flushed here every
+ * LAVD_LLC_FLUSH_NR schedules, so that CPUs of an LLC don't bounce a shared
+ * cacheline on every schedule.
+ */
+struct llc_ctx {
+	/*
+	 * Information used to keep track of load
+	 */
+	volatile u64	load_ideal;	/* ideal load of runnable tasks */
+	volatile u64	load_actual;	/* actual load of runnable tasks */
+	volatile u64	load_run_time_ns; /* total runtime of runnable tasks */
 
 	/*
-	 * Information used to keep track of performance criticality
+	 * Information used to keep track of CPU utilization
+	 *
+	 * The idle time until @now is idle_total + nr_idle * now - idle_start_sum.
+	 * These are updated on idle transitions rather than on every schedule,
+	 * so keep them on a separate cacheline.
 	 */
-	volatile u64	sum_perf_cri;	/* sum of performance criticality */
+	volatile u64	idle_total __scx_cacheline_aligned; /* idle time of finished idle periods (cumulative) */
+	volatile u64	idle_start_sum;	/* sum of idle_start_clk of idle CPUs */
+	volatile u64	nr_idle;	/* number of idle CPUs */
+	volatile u64	nr_violation;	/* number of CPUs over LAVD_TC_PER_CORE_MAX_CTUIL */
 
 	/*
-	 * Information of a current running task for preemption
+	 * Latency and performance criticality of the tasks scheduled on the
+	 * CPUs of the LLC, flushed in batches from struct cpu_ctx
 	 */
-	volatile u64	stopping_tm_est_ns; /* estimated stopping time */
-	volatile u16	lat_prio;	/* latency priority */
-	volatile u8	is_online;	/* is this CPU online? */
-	s32		cpu_id;		/* cpu id */
+	volatile u64	sum_lat_cri __scx_cacheline_aligned; /* sum of latency criticality (cumulative) */
+	volatile u64	sched_nr;	/* number of schedules (cumulative) */
+	volatile u64	sum_perf_cri;	/* sum of performance criticality (cumulative) */
+	volatile u64	nr_local;	/* tasks consumed from the own LLC (cumulative) */
+	volatile u64	nr_stolen;	/* tasks stolen from other LLCs (cumulative) */
 
 	/*
-	 * Information for CPU frequency scaling
+	 * Extremes of the latency criticality in the interval lat_cri_gen.
+	 * They're read on every schedule but rarely written once an interval
+	 * is under way, so they have their own cacheline. The first schedule
+	 * of a new interval restarts them and the timer never writes them.
 	 */
-	u32		cpuperf_cur;	/* CPU's current performance target */
-	u32		cpuperf_task;	/* task's CPU performance target */
-	u32		cpuperf_avg;	/* EWMA of task's CPU performance target */
+	volatile u64	max_lat_cri __scx_cacheline_aligned; /* maximum latency criticality */
+	volatile u64	min_lat_cri;	/* minimum latency criticality */
+	volatile u64	lat_cri_gen;	/* interval of max/min_lat_cri */
 
 	/*
-	 * Fields for core compaction
-	 *
+	 * Information for the cpuperf governor
 	 */
-	struct bpf_cpumask __kptr *tmp_a_mask;	/* temporary cpu mask */
-	struct bpf_cpumask __kptr *tmp_o_mask;	/* temporary cpu mask */
-} __attribute__((aligned(CACHELINE_SIZE)));
+	volatile u64	nr_lc_queued;	/* latency-critical tasks queued from the LLC */
+
+	/*
+	 * Information for core compaction
+	 */
+	volatile u8	dirty;		/* CPUs changed outside of core compaction */
+} __scx_cacheline_aligned;
+SCX_ASSERT_CACHELINE_ALIGNED(struct llc_ctx);
+SCX_ASSERT_CACHELINE_START(struct llc_ctx, idle_total);
+SCX_ASSERT_CACHELINE_START(struct llc_ctx, sum_lat_cri);
+SCX_ASSERT_CACHELINE_START(struct llc_ctx, max_lat_cri);
 
 struct task_ctx {
 	/*
@@ -219,21 +311,33 @@ struct task_ctx {
 	 * Task's performance criticality
 	 */
 	u64	perf_cri;		/* performance criticality of a task */
-};
 
-struct task_ctx_x {
-	pid_t	pid;
-	char	comm[TASK_COMM_LEN + 1];
-	u16	static_prio;	/* nice priority */
-	u32	cpu_id;		/* where a task ran */
-	u64	cpu_util;	/* cpu utilization in [0..100] */
-	u64	sys_load_factor; /* system load factor in [0..100..] */
-	u64	avg_lat_cri;	/* average latency criticality */
-	u64	avg_perf_cri;	/* average performance criticality */
-	u32	nr_active;	/* number of active cores */
-	u32	cpuperf_cur;	/* CPU's current performance target */
+	/*
+	 * Latency-critical task accounted in its LLC's nr_lc_queued
+	 */
+	u32	lc_queued_llc;		/* LLC index + 1, 0 if not accounted */
 };
 
+/*
+ * Latency criticality history saved into a pinned map when the scheduler is
+ * unloaded with --handoff, so that the next instance doesn't have to
+ * re-learn it.
+ */
+struct handoff_task {
+	u64	start_time;		/* to detect pid reuse */
+	u64	saved_at;
+	u64	run_time_ns;
+	u64	run_freq;
+	u64	wait_freq;
+	u64	wake_freq;
+	u64	load_actual;
+	u64	greedy_ratio;
+	u64	lat_cri;
+	u64	perf_cri;
+	u16	slice_boost_prio;
+	u16	__pad;
+	u32	version;		/* LAVD_HANDOFF_VERSION */
+};
 
 /*
  * introspection
@@ -246,7 +350,12 @@ enum {
 };
 
 enum {
-       LAVD_MSG_TASKC		= 0x1,
+       LAVD_MSG_TASK_BATCH	= 0x2,
+};
+
+enum {
+	LAVD_MSG_BATCH_MAX		= 8, /* must be a power of two */
+	LAVD_MSG_FLUSH_NS		= (100 * NSEC_PER_MSEC),
 };
 
 struct introspec {
@@ -259,10 +368,44 @@ struct msg_hdr {
 	u32		kind;
 };
 
-struct msg_task_ctx {
+/*
+ * A compact, fixed-size snapshot of a task's scheduling state
+ */
+struct task_sample {
+	u64	vdeadline_delta_ns;	/* time delta until task's virtual deadline */
+	u64	eligible_delta_ns;	/* time delta until task becomes eligible */
+	u64	slice_ns;		/* time slice */
+	u64	run_time_ns;		/* average runtime per schedule */
+	u32	pid;
+	u32	cpu_id;			/* where a task ran */
+	s32	victim_cpu;
+	u32	greedy_ratio;		/* task's overscheduling ratio */
+	u32	run_freq;		/* scheduling frequency in a second */
+	u32	wait_freq;		/* waiting frequency in a second */
+	u32	wake_freq;		/* waking-up frequency in a second */
+	u32	perf_cri;		/* performance criticality of a task */
+	u32	avg_lat_cri;		/* average latency criticality */
+	u32	avg_perf_cri;		/* average performance criticality */
+	u32	cpuperf_cur;		/* CPU's current performance target */
+	u16	cpu_util;		/* cpu utilization in [0..100] */
+	u16	sys_load_factor;	/* system load factor in [0..100..] */
+	u16	nr_active;		/* number of active cores */
+	u16	static_prio;		/* nice priority */
+	u16	lat_prio;		/* latency priority */
+	s16	lat_boost_prio;
+	u16	slice_boost_prio;
+	char	comm[TASK_COMM_LEN];
+};
+
+/*
+ * A batch of task samples collected on a CPU and flushed to user space in a
+ * single ring buffer record
+ */
+struct msg_task_batch {
 	struct msg_hdr		hdr;
-	struct task_ctx		taskc;
-	struct task_ctx_x	taskc_x;
+	u32			nr;	/* number of valid samples */
+	u64			first_clk; /* when the first sample was taken */
+	struct task_sample	samples[LAVD_MSG_BATCH_MAX];
 };
 
 #endif /* __INTF_H */
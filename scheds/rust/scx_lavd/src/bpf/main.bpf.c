@@ -157,6 +157,11 @@
  * quickly increase the clock frequency when a task gets running but gradually
  * decrease it upon every tick interval.
  *
+ * Alternatively, the cpuperf governor mode (--cpuperf-governor) predicts each
+ * CPU's performance target for the next interval from its utilization and the
+ * latency-critical tasks queued on its LLC, with a knob (--cpuperf-bias)
+ * trading latency for energy. See update_cpuperf_pred().
+ *
  *
  * 9. Core compaction
  * ------------------
@@ -204,6 +209,27 @@ volatile u64		nr_cpus_onln;
 
 static struct sys_stat	__sys_stats[2];
 static volatile int	__sys_stat_idx;
+static volatile u64	__lat_cri_gen = 1;	/* see llc_ctx->lat_cri_gen */
+
+/*
+ * Per-LLC partial sums and the update timer's snapshot of their cumulative
+ * counters in the previous interval
+ */
+static struct llc_ctx	__llc_ctxs[LAVD_LLC_MAX];
+
+struct llc_snap {
+	u64	sum_lat_cri;
+	u64	sched_nr;
+	u64	sum_perf_cri;
+	u64	idle;
+	u64	nr_local;
+	u64	nr_stolen;
+	u64	d_local;	/* nr_local delta of the last interval */
+	u64	d_stolen;	/* nr_stolen delta of the last interval */
+	u32	nr_active;	/* active CPUs assigned by core compaction */
+	u32	nr_ovrflw;	/* overflow CPUs assigned by core compaction */
+};
+static struct llc_snap	__llc_snaps[LAVD_LLC_MAX];
 
 private(LAVD) struct bpf_cpumask __kptr *active_cpumask; /* CPU mask for active CPUs */
 private(LAVD) struct bpf_cpumask __kptr *ovrflw_cpumask; /* CPU mask for overflow CPUs */
@@ -212,13 +238,26 @@ private(LAVD) struct bpf_cpumask __kptr *ovrflw_cpumask; /* CPU mask for overflo
  * CPU topology
  */
 const volatile u16 cpu_order[LAVD_CPU_ID_MAX]; /* ordered by cpus->core->llc->numa */
+const volatile u32 nr_llcs = 1;			/* number of LLCs */
+const volatile u8 cpu_llc_id[LAVD_CPU_ID_MAX];	/* LLC index of a CPU */
+const volatile u16 llc_cpu_start[LAVD_LLC_MAX];	/* first index of an LLC in cpu_order */
+const volatile u16 llc_nr_cpus[LAVD_LLC_MAX];	/* number of CPUs of an LLC */
+const volatile u32 llc_node_id[LAVD_LLC_MAX];	/* NUMA node of an LLC */
+const volatile u8 llc_nr_near[LAVD_LLC_MAX];	/* number of other LLCs on the same node */
+const volatile u8 llc_steal_order[LAVD_LLC_MAX][LAVD_LLC_MAX]; /* same node first, then remote */
 
 /*
  * Options
  */
 const volatile bool	no_freq_scaling;
+const volatile bool	cpuperf_governor;
+const volatile u32	cpuperf_bias = 50; /* 0: latency, 100: energy */
 const volatile bool	no_core_compaction;
+const volatile bool	per_llc_dsq;
+const volatile u32	introspec_sample_rate = 1; /* sample 1 out of N events */
+const volatile u32	llc_steal_max = 1; /* max remote LLCs probed per dispatch */
 const volatile u8	verbose;
+const volatile bool	handoff;
 
 UEI_DEFINE(uei);
 
@@ -278,6 +317,26 @@ struct {
 	__type(value, struct task_ctx);
 } task_ctx_stor SEC(".maps");
 
+/*
+ * With @handoff, the per-task statistics are saved into this map when the
+ * scheduler is unloaded. User space pins it so that the next instance can adopt
+ * them in lavd_init_task().
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, s32);
+	__type(value, struct handoff_task);
+	__uint(max_entries, LAVD_HANDOFF_MAX_TASKS);
+} handoff_tasks SEC(".maps");
+
+u64 nr_handoff_tasks;
+
+/*
+ * Set by user space right before detaching. lavd_exit_task() also runs when a
+ * task switches to another sched class, whose state shouldn't be saved.
+ */
+volatile bool unloading;
+
 /*
  * Preemption related ones
  */
@@ -295,9 +354,24 @@ struct introspec intrspc;
 
 struct {
 	__uint(type, BPF_MAP_TYPE_RINGBUF);
-	__uint(max_entries, 16 * 1024 /* 16 KB */);
+	__uint(max_entries, 64 * 1024 /* 64 KB */);
 } introspec_msg SEC(".maps");
 
+/*
+ * Per-CPU batch of task samples, which is flushed to introspec_msg in bulk
+ */
+struct introspec_batch {
+	u64			nr_events; /* number of events seen for sampling */
+	struct msg_task_batch	msg;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct introspec_batch);
+	__uint(max_entries, 1);
+} introspec_batch_stor SEC(".maps");
+
 /*
  * A nice priority to CPU usage weight array
  * -----------------------------------------
@@ -572,6 +646,25 @@ static struct cpu_ctx *get_cpu_ctx_id(s32 cpu_id)
 	return cpuc;
 }
 
+static u32 cpu_to_llc(s32 cpu_id)
+{
+	if (cpu_id < 0 || cpu_id >= LAVD_CPU_ID_MAX)
+		return 0;
+	return cpu_llc_id[cpu_id] & (LAVD_LLC_MAX - 1);
+}
+
+static struct llc_ctx *get_llc_ctx(struct cpu_ctx *cpuc)
+{
+	return &__llc_ctxs[cpu_to_llc(cpuc->cpu_id)];
+}
+
+static u64 cpu_to_dsq(s32 cpu_id)
+{
+	if (!per_llc_dsq)
+		return LAVD_GLOBAL_DSQ;
+	return LAVD_LLC_DSQ_BASE + cpu_to_llc(cpu_id);
+}
+
 static struct sys_stat *get_sys_stat_cur(void)
 {
 	if (READ_ONCE(__sys_stat_idx) == 0)
@@ -591,40 +684,121 @@ static void flip_sys_stat(void)
 	WRITE_ONCE(__sys_stat_idx, __sys_stat_idx ^ 0x1);
 }
 
+static struct introspec_batch *get_introspec_batch(void)
+{
+	const u32 idx = 0;
+
+	return bpf_map_lookup_elem(&introspec_batch_stor, &idx);
+}
+
+static void flush_task_samples(struct introspec_batch *b)
+{
+	if (!b->msg.nr)
+		return;
+
+	/*
+	 * Copy out the whole batch with a single helper call. If the ring
+	 * buffer is full, the batch is dropped; introspection is best-effort.
+	 */
+	b->msg.hdr.kind = LAVD_MSG_TASK_BATCH;
+	bpf_ringbuf_output(&introspec_msg, &b->msg, sizeof(b->msg), 0);
+	b->msg.nr = 0;
+}
+
+static void try_flush_task_samples(void)
+{
+	struct introspec_batch *b;
+
+	/*
+	 * Do not hold a partial batch for too long so that samples of a
+	 * sampling interval are delivered within the interval.
+	 */
+	b = get_introspec_batch();
+	if (b && b->msg.nr &&
+	    (bpf_ktime_get_ns() - b->msg.first_clk) >= LAVD_MSG_FLUSH_NS)
+		flush_task_samples(b);
+}
+
 static __always_inline
 int submit_task_ctx(struct task_struct *p, struct task_ctx *taskc, u32 cpu_id)
 {
 	struct sys_stat *stat_cur = get_sys_stat_cur();
+	struct introspec_batch *b;
+	struct task_sample *m;
 	struct cpu_ctx *cpuc;
-	struct msg_task_ctx *m;
-
-	cpuc = get_cpu_ctx_id(cpu_id);
-	if (!cpuc)
-		return -EINVAL;
+	u32 nr;
 
-	m = bpf_ringbuf_reserve(&introspec_msg, sizeof(*m), 0);
-	if (!m)
+	b = get_introspec_batch();
+	if (!b)
 		return -ENOMEM;
 
-	m->hdr.kind = LAVD_MSG_TASKC;
-	m->taskc_x.pid = p->pid;
-	memcpy(m->taskc_x.comm, p->comm, TASK_COMM_LEN);
-	m->taskc_x.static_prio = get_nice_prio(p);
-	m->taskc_x.cpu_util = cpuc->util / 10;
-	m->taskc_x.sys_load_factor = stat_cur->load_factor / 10;
-	m->taskc_x.cpu_id = cpu_id;
-	m->taskc_x.avg_lat_cri = stat_cur->avg_lat_cri;
-	m->taskc_x.avg_perf_cri = stat_cur->avg_perf_cri;
-	m->taskc_x.nr_active = stat_cur->nr_active;
-	m->taskc_x.cpuperf_cur = cpuc->cpuperf_cur;
-
-	memcpy(&m->taskc, taskc, sizeof(m->taskc));
+	nr = b->msg.nr;
+	if (nr >= LAVD_MSG_BATCH_MAX) {
+		flush_task_samples(b);
+		nr = 0;
+	}
+	if (nr == 0)
+		b->msg.first_clk = bpf_ktime_get_ns();
+
+	m = &b->msg.samples[nr & (LAVD_MSG_BATCH_MAX - 1)];
+	m->pid = p->pid;
+	__builtin_memcpy(m->comm, p->comm, TASK_COMM_LEN);
+	m->static_prio = get_nice_prio(p);
+	m->cpu_id = cpu_id;
+	m->sys_load_factor = stat_cur->load_factor / 10;
+	m->avg_lat_cri = stat_cur->avg_lat_cri;
+	m->avg_perf_cri = stat_cur->avg_perf_cri;
+	m->nr_active = stat_cur->nr_active;
+
+	/*
+	 * A dumped task is not running on any CPU.
+	 */
+	if (cpu_id != LAVD_CPU_ID_NONE && (cpuc = get_cpu_ctx_id(cpu_id))) {
+		m->cpu_util = cpuc->util / 10;
+		m->cpuperf_cur = cpuc->cpuperf_cur;
+	} else {
+		m->cpu_util = 0;
+		m->cpuperf_cur = 0;
+	}
 
-	bpf_ringbuf_submit(m, 0);
+	m->vdeadline_delta_ns = taskc->vdeadline_delta_ns;
+	m->eligible_delta_ns = taskc->eligible_delta_ns;
+	m->slice_ns = taskc->slice_ns;
+	m->run_time_ns = taskc->run_time_ns;
+	m->victim_cpu = taskc->victim_cpu;
+	m->greedy_ratio = taskc->greedy_ratio;
+	m->run_freq = taskc->run_freq;
+	m->wait_freq = taskc->wait_freq;
+	m->wake_freq = taskc->wake_freq;
+	m->perf_cri = taskc->perf_cri;
+	m->lat_prio = taskc->lat_prio;
+	m->lat_boost_prio = taskc->lat_boost_prio;
+	m->slice_boost_prio = taskc->slice_boost_prio;
+
+	b->msg.nr = nr + 1;
+	if (b->msg.nr >= LAVD_MSG_BATCH_MAX)
+		flush_task_samples(b);
 
 	return 0;
 }
 
+static bool should_sample_event(void)
+{
+	struct introspec_batch *b;
+
+	if (introspec_sample_rate <= 1)
+		return true;
+
+	/*
+	 * Skip events with a per-CPU counter before touching the globally
+	 * shared sample budget in intrspc.arg.
+	 */
+	b = get_introspec_batch();
+	if (!b)
+		return false;
+	return (b->nr_events++ % introspec_sample_rate) == 0;
+}
+
 static void proc_introspec_sched_n(struct task_struct *p,
 				   struct task_ctx *taskc, u32 cpu_id)
 {
@@ -633,6 +807,8 @@ static void proc_introspec_sched_n(struct task_struct *p,
 
 	/* introspec_arg is the number of schedules remaining */
 	cur_nr = intrspc.arg;
+	if (cur_nr == 0 || !should_sample_event())
+		return;
 
 	/*
 	 * Note that the bounded retry (@LAVD_MAX_CAS_RETRY) does *not
@@ -672,6 +848,7 @@ static bool have_scheduled(struct task_ctx *taskc)
 
 static void proc_dump_all_tasks(struct task_struct *p)
 {
+	struct introspec_batch *b;
 	struct task_struct *pos;
 	struct task_ctx *taskc;
 
@@ -687,6 +864,10 @@ static void proc_dump_all_tasks(struct task_struct *p)
 	}
 
 	bpf_rcu_read_unlock();
+
+	b = get_introspec_batch();
+	if (b)
+		flush_task_samples(b);
 }
 
 static void try_proc_introspec_cmd(struct task_struct *p,
@@ -700,9 +881,11 @@ static void try_proc_introspec_cmd(struct task_struct *p,
 	switch(intrspc.cmd) {
 	case LAVD_CMD_SCHED_N:
 		proc_introspec_sched_n(p, taskc, cpu_id);
+		try_flush_task_samples();
 		break;
 	case LAVD_CMD_PID:
 		proc_introspec_pid(p, taskc, cpu_id);
+		try_flush_task_samples();
 		break;
 	case LAVD_CMD_DUMP:
 		/*
@@ -788,86 +971,104 @@ static void init_sys_stat_ctx(struct sys_stat_ctx *c)
 	c->min_lat_cri = UINT_MAX;
 }
 
-static void collect_sys_stat(struct sys_stat_ctx *c)
+static u64 take_llc_delta(u64 *snap, u64 val)
 {
-	int cpu;
+	u64 delta = val - *snap;
 
-	bpf_for(cpu, 0, nr_cpus_onln) {
-		struct cpu_ctx *cpuc = get_cpu_ctx_id(cpu);
-		if (!cpuc) {
-			c->compute_total = 0;
-			break;
-		}
+	*snap = val;
+	return delta;
+}
 
-		/*
-		 * Accumulate cpus' loads.
-		 */
-		c->load_ideal += cpuc->load_ideal;
-		c->load_actual += cpuc->load_actual;
-		c->load_run_time_ns += cpuc->load_run_time_ns;
+/*
+ * Return the idle time of the CPUs of @llcx until @now. The fields are
+ * re-read until no CPU entered or exited idle in the middle, up to
+ * LAVD_MAX_CAS_RETRY times.
+ */
+static u64 read_llc_idle(struct llc_ctx *llcx, u64 now)
+{
+	u64 total, start_sum, nr_idle;
+	int i;
 
-		/*
-		 * Accumulate task's latency criticlity information.
-		 *
-		 * While updating cpu->* is racy, the resulting impact on
-		 * accuracy should be small and very rare and thus should be
-		 * fine.
-		 */
-		c->sum_lat_cri += cpuc->sum_lat_cri;
-		cpuc->sum_lat_cri = 0;
+	bpf_for(i, 0, LAVD_MAX_CAS_RETRY) {
+		total = READ_ONCE(llcx->idle_total);
+		nr_idle = READ_ONCE(llcx->nr_idle);
+		start_sum = READ_ONCE(llcx->idle_start_sum);
+		if (total == READ_ONCE(llcx->idle_total) &&
+		    nr_idle == READ_ONCE(llcx->nr_idle))
+			break;
+	}
 
-		c->sched_nr += cpuc->sched_nr;
-		cpuc->sched_nr = 0;
+	return total + nr_idle * now - start_sum;
+}
 
-		if (cpuc->max_lat_cri > c->max_lat_cri)
-			c->max_lat_cri = cpuc->max_lat_cri;
-		cpuc->max_lat_cri = 0;
+static void collect_sys_stat(struct sys_stat_ctx *c)
+{
+	u64 gen = READ_ONCE(__lat_cri_gen);
+	u32 llc;
 
-		if (cpuc->min_lat_cri < c->min_lat_cri)
-			c->min_lat_cri = cpuc->min_lat_cri;
-		cpuc->min_lat_cri = UINT_MAX;
+	/*
+	 * CPUs keep their LLC's partial sums up to date, so we only combine
+	 * the per-LLC totals here instead of walking every CPU.
+	 */
+	bpf_for(llc, 0, nr_llcs) {
+		u32 i = llc & (LAVD_LLC_MAX - 1);
+		struct llc_ctx *llcx = &__llc_ctxs[i];
+		struct llc_snap *snap = &__llc_snaps[i];
+		u64 idle, idle_max;
+		s64 idle_delta;
 
 		/*
-		 * Accumulate task's performance criticlity information.
+		 * Accumulate LLCs' loads. Note that a task could become
+		 * runnable in one LLC and quiescent in another, so an LLC's
+		 * own load can wrap around. Only the sum is meaningful.
 		 */
-		c->sum_perf_cri += cpuc->sum_perf_cri;
-		cpuc->sum_perf_cri = 0;
+		c->load_ideal += llcx->load_ideal;
+		c->load_actual += llcx->load_actual;
+		c->load_run_time_ns += llcx->load_run_time_ns;
 
 		/*
-		 * If the CPU is in an idle state (i.e., idle_start_clk is
-		 * non-zero), accumulate the current idle peirod so far.
+		 * Accumulate task's latency and performance criticality
+		 * information of this interval from the LLC's partial sums.
 		 */
-		for (int i = 0; i < LAVD_MAX_CAS_RETRY; i++) {
-			u64 old_clk = cpuc->idle_start_clk;
-			if (old_clk == 0)
-				break;
-
-			bool ret = __sync_bool_compare_and_swap(
-					&cpuc->idle_start_clk, old_clk, c->now);
-			if (ret) {
-				c->idle_total += c->now - old_clk;
-				break;
-			}
+		c->sum_lat_cri += take_llc_delta(&snap->sum_lat_cri,
+						 llcx->sum_lat_cri);
+		c->sched_nr += take_llc_delta(&snap->sched_nr, llcx->sched_nr);
+		c->sum_perf_cri += take_llc_delta(&snap->sum_perf_cri,
+						  llcx->sum_perf_cri);
+		snap->d_local = take_llc_delta(&snap->nr_local, llcx->nr_local);
+		snap->d_stolen = take_llc_delta(&snap->nr_stolen,
+						llcx->nr_stolen);
+
+		if (READ_ONCE(llcx->lat_cri_gen) == gen) {
+			if (llcx->max_lat_cri > c->max_lat_cri)
+				c->max_lat_cri = llcx->max_lat_cri;
+			if (llcx->min_lat_cri < c->min_lat_cri)
+				c->min_lat_cri = llcx->min_lat_cri;
 		}
 
 		/*
-		 * Calculcate per-CPU utilization
+		 * Accumulate the idle time of this interval, including the
+		 * ongoing idle periods of currently idle CPUs. The idle
+		 * fields are updated one by one by the CPUs entering and
+		 * exiting idle, so the delta is clamped to what the CPUs of
+		 * the LLC can have been idle in this interval.
 		 */
-		u64 compute = 0;
-		if (c->duration > cpuc->idle_total)
-			compute = c->duration - cpuc->idle_total;
-		c->new_util = (compute * LAVD_CPU_UTIL_MAX) / c->duration;
-		cpuc->util = calc_avg(cpuc->util, c->new_util);
-
-		if (cpuc->util > LAVD_TC_PER_CORE_MAX_CTUIL)
-			c->nr_violation += 1000;
-
-		/*
-		 * Accmulate system-wide idle time
-		 */
-		c->idle_total += cpuc->idle_total;
-		cpuc->idle_total = 0;
+		idle = read_llc_idle(llcx, c->now);
+		idle_delta = take_llc_delta(&snap->idle, idle);
+		idle_max = llc_nr_cpus[i] * c->duration;
+		if (idle_delta > (s64)idle_max)
+			idle_delta = idle_max;
+		if (idle_delta > 0)
+			c->idle_total += idle_delta;
+
+		c->nr_violation += llcx->nr_violation * 1000;
 	}
+
+	/*
+	 * Start a new interval for max/min_lat_cri. CPUs reset theirs on
+	 * their next schedule.
+	 */
+	WRITE_ONCE(__lat_cri_gen, gen + 1);
 }
 
 static void calc_sys_stat(struct sys_stat_ctx *c)
@@ -898,6 +1099,15 @@ static void calc_sys_stat(struct sys_stat_ctx *c)
 	else {
 		c->avg_lat_cri = c->sum_lat_cri / c->sched_nr;
 		c->avg_perf_cri = c->sum_perf_cri / c->sched_nr;
+
+		/*
+		 * The schedules of this interval may all have been recorded
+		 * against the previous interval's max/min_lat_cri.
+		 */
+		if (c->min_lat_cri > c->max_lat_cri) {
+			c->min_lat_cri = c->stat_cur->min_lat_cri;
+			c->max_lat_cri = c->stat_cur->max_lat_cri;
+		}
 	}
 }
 
@@ -933,6 +1143,32 @@ static void update_sys_stat_next(struct sys_stat_ctx *c)
 		calc_avg(stat_cur->nr_violation, c->nr_violation);
 }
 
+static void update_llc_stat_next(struct sys_stat_ctx *c)
+{
+	struct sys_stat *stat_cur = c->stat_cur;
+	struct sys_stat *stat_next = c->stat_next;
+	u32 llc;
+
+	if (!per_llc_dsq)
+		return;
+
+	bpf_for(llc, 0, nr_llcs) {
+		struct llc_stat *cur, *next;
+		struct llc_snap *snap;
+		u32 i = llc & (LAVD_LLC_MAX - 1);
+
+		cur = &stat_cur->llc[i];
+		next = &stat_next->llc[i];
+		snap = &__llc_snaps[i];
+
+		/* the deltas were taken by collect_sys_stat() */
+		next->nr_queued = calc_avg(cur->nr_queued,
+				scx_bpf_dsq_nr_queued(LAVD_LLC_DSQ_BASE + i));
+		next->nr_local = calc_avg(cur->nr_local, snap->d_local);
+		next->nr_stolen = calc_avg(cur->nr_stolen, snap->d_stolen);
+	}
+}
+
 static void calc_inc1k(struct sys_stat_ctx *c)
 {
 	/*
@@ -971,6 +1207,7 @@ static void do_update_sys_stat(void)
 	collect_sys_stat(&c);
 	calc_sys_stat(&c);
 	update_sys_stat_next(&c);
+	update_llc_stat_next(&c);
 	calc_inc1k(&c);
 
 	/*
@@ -1022,39 +1259,28 @@ static void clear_cpu_periodically(u32 cpu, struct bpf_cpumask *cpumask)
 		bpf_cpumask_clear_cpu(cpu, cpumask);
 }
 
-static void do_core_compaction(void)
+static void compact_llc(u32 llc, u32 nr_active, u32 nr_ovrflw,
+			struct bpf_cpumask *active, struct bpf_cpumask *ovrflw)
 {
-	struct sys_stat *stat_cur = get_sys_stat_cur();
+	struct llc_ctx *llcx = &__llc_ctxs[llc];
+	struct llc_snap *snap = &__llc_snaps[llc];
+	u32 nr_active_old = snap->nr_active;
+	u32 start = llc_cpu_start[llc];
+	bool dirty = false;
 	struct cpu_ctx *cpuc;
-	struct bpf_cpumask *active, *ovrflw;
-	int nr_cpus, nr_active, nr_active_old, cpu, i;
-
-	bpf_rcu_read_lock();
+	int i, cpu;
 
 	/*
-	 * Prepare cpumasks.
+	 * Clear the dirty mark first so that a CPU activated concurrently
+	 * marks it again.
 	 */
-	active = active_cpumask;
-	ovrflw = ovrflw_cpumask;
-	if (!active || !ovrflw) {
-		scx_bpf_error("Failed to prepare cpumasks.");
-		goto unlock_out;
-	}
-
-	/*
-	 * Assign active and overflow cores
-	 */
-	nr_active_old = stat_cur->nr_active;
-	nr_active = calc_nr_active_cpus(stat_cur);
-	nr_cpus = nr_active + LAVD_TC_NR_OVRFLW;
-	bpf_for(i, 0, nr_cpus_onln) {
-		if (i >= LAVD_CPU_ID_MAX)
-			break;
+	llcx->dirty = false;
 
+	bpf_for(i, 0, llc_nr_cpus[llc]) {
 		/*
 		 * Skip offline cpu
 		 */
-		cpu = cpu_order[i];
+		cpu = cpu_order[(start + i) & (LAVD_CPU_ID_MAX - 1)];
 		cpuc = get_cpu_ctx_id(cpu);
 		if (!cpuc || !cpuc->is_online) {
 			bpf_cpumask_clear_cpu(cpu, active);
@@ -1065,7 +1291,7 @@ static void do_core_compaction(void)
 		/*
 		 * Assign an online cpu to active and overflow cpumasks
 		 */
-		if (i < nr_cpus) {
+		if (i < nr_active + nr_ovrflw) {
 			if (i < nr_active) {
 				bpf_cpumask_set_cpu(cpu, active);
 				bpf_cpumask_clear_cpu(cpu, ovrflw);
@@ -1098,20 +1324,126 @@ static void do_core_compaction(void)
 				 */
 				clear_cpu_periodically(cpu, active);
 				bpf_cpumask_clear_cpu(cpu, ovrflw);
+				if (bpf_cpumask_test_cpu(cpu, cast_mask(active)))
+					dirty = true;
 			}
 		}
 	}
 
-	stat_cur->nr_active = nr_active;
+	/*
+	 * Revisit this LLC at the next interval while a pinned task keeps
+	 * one of its CPUs active.
+	 */
+	if (dirty)
+		llcx->dirty = true;
+
+	snap->nr_active = nr_active;
+	snap->nr_ovrflw = nr_ovrflw;
+}
+
+static void do_core_compaction(void)
+{
+	struct sys_stat *stat_cur = get_sys_stat_cur();
+	struct bpf_cpumask *active, *ovrflw;
+	u32 nr_active_total, nr_active, nr_ovrflw, llc;
+
+	bpf_rcu_read_lock();
+
+	/*
+	 * Prepare cpumasks.
+	 */
+	active = active_cpumask;
+	ovrflw = ovrflw_cpumask;
+	if (!active || !ovrflw) {
+		scx_bpf_error("Failed to prepare cpumasks.");
+		goto unlock_out;
+	}
+
+	/*
+	 * Assign active and overflow cores. The system-wide active and
+	 * overflow CPUs are handed out LLC by LLC in the topological order so
+	 * that the active CPUs are packed into as few LLCs as possible. Only
+	 * the LLCs whose share changed, or whose CPUs changed behind our back
+	 * (hotplug or a pinned task), are revisited.
+	 */
+	nr_active_total = calc_nr_active_cpus(stat_cur);
+	nr_active = nr_active_total;
+	nr_ovrflw = LAVD_TC_NR_OVRFLW;
+	bpf_for(llc, 0, nr_llcs) {
+		u32 i = llc & (LAVD_LLC_MAX - 1);
+		u32 nr_cpus = llc_nr_cpus[i];
+		u32 llc_active, llc_ovrflw;
+
+		llc_active = min(nr_active, nr_cpus);
+		llc_ovrflw = min(nr_ovrflw, nr_cpus - llc_active);
+		nr_active -= llc_active;
+		nr_ovrflw -= llc_ovrflw;
+
+		if (llc_active == __llc_snaps[i].nr_active &&
+		    llc_ovrflw == __llc_snaps[i].nr_ovrflw &&
+		    !__llc_ctxs[i].dirty)
+			continue;
+
+		compact_llc(i, llc_active, llc_ovrflw, active, ovrflw);
+	}
+
+	stat_cur->nr_active = nr_active_total;
 
 unlock_out:
 	bpf_rcu_read_unlock();
 }
 
+/*
+ * With cpuperf_governor, the update timer predicts the performance target of
+ * each CPU for the next interval instead of following the running task. The
+ * demand of a CPU is its utilization plus its share of the latency-critical
+ * tasks queued from its LLC, each of which is expected to need a whole CPU
+ * shortly. cpuperf_bias trades latency for energy: at 0, the queued
+ * latency-critical tasks count fully and the target has 100% headroom over
+ * the demand; at 100, they are ignored and the target matches the
+ * utilization.
+ */
+static void update_cpuperf_pred(void)
+{
+	u32 latency = 100 - min(cpuperf_bias, 100);
+	u32 llc;
+
+	bpf_for(llc, 0, nr_llcs) {
+		u32 li = llc & (LAVD_LLC_MAX - 1);
+		u32 start = llc_cpu_start[li];
+		u32 nr_cpus = llc_nr_cpus[li];
+		struct cpu_ctx *cpuc;
+		u64 lc_load, demand, target;
+		int i, cpu;
+
+		if (!nr_cpus)
+			continue;
+
+		lc_load = READ_ONCE(__llc_ctxs[li].nr_lc_queued) *
+			  LAVD_CPU_UTIL_MAX * latency / (100 * nr_cpus);
+
+		bpf_for(i, 0, nr_cpus) {
+			cpu = cpu_order[(start + i) & (LAVD_CPU_ID_MAX - 1)];
+			cpuc = get_cpu_ctx_id(cpu);
+			if (!cpuc || !cpuc->is_online)
+				continue;
+
+			demand = cpuc->util + lc_load;
+			target = demand * (100 + latency) * SCX_CPUPERF_ONE /
+				 (100 * LAVD_CPU_UTIL_MAX);
+			WRITE_ONCE(cpuc->cpuperf_pred,
+				   min(target, SCX_CPUPERF_ONE));
+		}
+	}
+}
+
 static void update_sys_stat(void)
 {
 	do_update_sys_stat();
 
+	if (cpuperf_governor)
+		update_cpuperf_pred();
+
 	if (!no_core_compaction)
 		do_core_compaction();
 }
@@ -1609,6 +1941,132 @@ static u64 get_suspended_duration_and_reset(struct cpu_ctx *cpuc)
 	return duration;
 }
 
+static void set_cpu_util_violation(struct cpu_ctx *cpuc, bool violation)
+{
+	struct llc_ctx *llcx;
+
+	if (cpuc->util_violation == violation)
+		return;
+
+	llcx = get_llc_ctx(cpuc);
+	if (violation)
+		__sync_fetch_and_add(&llcx->nr_violation, 1);
+	else
+		__sync_fetch_and_sub(&llcx->nr_violation, 1);
+	cpuc->util_violation = violation;
+}
+
+static void update_cpu_util(struct cpu_ctx *cpuc, u64 now)
+{
+	u64 duration, idle, compute, new_util;
+
+	/*
+	 * Each CPU calculates its own utilization once every
+	 * LAVD_SYS_STAT_INTERVAL_NS while it is not idle, so the update timer
+	 * does not need to visit it. An idle CPU catches up when it exits
+	 * from the idle state.
+	 */
+	duration = now - cpuc->util_clk;
+	if (duration < LAVD_SYS_STAT_INTERVAL_NS)
+		return;
+
+	idle = cpuc->idle_total - cpuc->util_idle_snap;
+	compute = duration > idle ? duration - idle : 0;
+	new_util = (compute * LAVD_CPU_UTIL_MAX) / duration;
+	cpuc->util = calc_avg(cpuc->util, new_util);
+	cpuc->util_clk = now;
+	cpuc->util_idle_snap = cpuc->idle_total;
+
+	set_cpu_util_violation(cpuc, cpuc->util > LAVD_TC_PER_CORE_MAX_CTUIL);
+}
+
+/*
+ * Add the per-schedule counters batched by @cpuc to its LLC's partial sums.
+ */
+static void flush_llc_sums(struct cpu_ctx *cpuc)
+{
+	struct llc_ctx *llcx;
+
+	if (!cpuc->pend_sched_nr && !cpuc->pend_local && !cpuc->pend_stolen)
+		return;
+
+	llcx = get_llc_ctx(cpuc);
+	__sync_fetch_and_add(&llcx->sum_lat_cri, cpuc->pend_lat_cri);
+	__sync_fetch_and_add(&llcx->sched_nr, cpuc->pend_sched_nr);
+	__sync_fetch_and_add(&llcx->sum_perf_cri, cpuc->pend_perf_cri);
+	__sync_fetch_and_add(&llcx->nr_local, cpuc->pend_local);
+	__sync_fetch_and_add(&llcx->nr_stolen, cpuc->pend_stolen);
+
+	cpuc->pend_lat_cri = 0;
+	cpuc->pend_sched_nr = 0;
+	cpuc->pend_perf_cri = 0;
+	cpuc->pend_local = 0;
+	cpuc->pend_stolen = 0;
+}
+
+/*
+ * Account @lat_cri in the max/min latency criticality of @llcx in the
+ * interval @gen. The extremes are only written when they change, and
+ * concurrent updates from the CPUs of the LLC may occasionally lose one,
+ * which is fine for statistics.
+ */
+static void update_llc_lat_cri(struct llc_ctx *llcx, u64 lat_cri, u64 gen)
+{
+	if (READ_ONCE(llcx->lat_cri_gen) != gen) {
+		WRITE_ONCE(llcx->max_lat_cri, lat_cri);
+		WRITE_ONCE(llcx->min_lat_cri, lat_cri);
+		WRITE_ONCE(llcx->lat_cri_gen, gen);
+		return;
+	}
+
+	if (lat_cri > READ_ONCE(llcx->max_lat_cri))
+		WRITE_ONCE(llcx->max_lat_cri, lat_cri);
+	if (lat_cri < READ_ONCE(llcx->min_lat_cri))
+		WRITE_ONCE(llcx->min_lat_cri, lat_cri);
+}
+
+static void exit_cpu_idle(struct cpu_ctx *cpuc, u64 now)
+{
+	struct llc_ctx *llcx = get_llc_ctx(cpuc);
+	u64 old_clk, duration;
+
+	/*
+	 * If idle_start_clk is zero, that means entering into the idle is not
+	 * captured by the scx (i.e., the scx scheduler is loaded when this CPU
+	 * is in an idle state). The CAS failure happens only when a hotplug
+	 * callback races with the CPU, which already took the idle period.
+	 */
+	old_clk = cpuc->idle_start_clk;
+	if (old_clk == 0 ||
+	    !__sync_bool_compare_and_swap(&cpuc->idle_start_clk, old_clk, 0))
+		return;
+
+	duration = now - old_clk;
+	cpuc->idle_total += duration;
+	__sync_fetch_and_add(&llcx->idle_total, duration);
+	__sync_fetch_and_sub(&llcx->nr_idle, 1);
+	__sync_fetch_and_sub(&llcx->idle_start_sum, old_clk);
+}
+
+static void enter_cpu_idle(struct cpu_ctx *cpuc, u64 now)
+{
+	struct llc_ctx *llcx = get_llc_ctx(cpuc);
+
+	/*
+	 * Close an idle period whose exit was missed before opening a new
+	 * one. An idle CPU does not violate the utilization limit.
+	 */
+	exit_cpu_idle(cpuc, now);
+	set_cpu_util_violation(cpuc, false);
+	flush_llc_sums(cpuc);
+
+	if (!__sync_bool_compare_and_swap(&cpuc->idle_start_clk, 0, now))
+		return;
+
+	__sync_fetch_and_add(&llcx->idle_start_sum, now);
+	__sync_fetch_and_add(&llcx->nr_idle, 1);
+}
+
 static void update_stat_for_runnable(struct task_struct *p,
 				     struct task_ctx *taskc,
 				     struct cpu_ctx *cpuc)
@@ -1616,17 +2074,21 @@ static void update_stat_for_runnable(struct task_struct *p,
 	/*
 	 * Reflect task's load immediately.
 	 */
+	struct llc_ctx *llcx = get_llc_ctx(cpuc);
+
 	taskc->load_actual = calc_task_load_actual(taskc);
 	taskc->acc_run_time_ns = 0;
-	cpuc->load_ideal  += get_task_load_ideal(p);
-	cpuc->load_actual += taskc->load_actual;
-	cpuc->load_run_time_ns += cap_time_slice_ns(taskc->run_time_ns);
+	__sync_fetch_and_add(&llcx->load_ideal, get_task_load_ideal(p));
+	__sync_fetch_and_add(&llcx->load_actual, taskc->load_actual);
+	__sync_fetch_and_add(&llcx->load_run_time_ns,
+			     cap_time_slice_ns(taskc->run_time_ns));
 }
 
 static void update_stat_for_running(struct task_struct *p,
 				    struct task_ctx *taskc,
 				    struct cpu_ctx *cpuc)
 {
+	u64 gen = READ_ONCE(__lat_cri_gen);
 	u64 wait_period, interval;
 	u64 now = bpf_ktime_get_ns();
 	u64 load_actual_ft, load_ideal_ft, wait_freq_ft, wake_freq_ft;
@@ -1643,15 +2105,11 @@ static void update_stat_for_running(struct task_struct *p,
 	}
 
 	/*
-	 * Update per-CPU latency criticality information for ever-scheduled
-	 * tasks.
+	 * Update latency criticality information for ever-scheduled tasks.
 	 */
-	if (cpuc->max_lat_cri < taskc->lat_cri)
-		cpuc->max_lat_cri = taskc->lat_cri;
-	if (cpuc->min_lat_cri > taskc->lat_cri)
-		cpuc->min_lat_cri = taskc->lat_cri;
-	cpuc->sum_lat_cri += taskc->lat_cri;
-	cpuc->sched_nr++;
+	update_llc_lat_cri(get_llc_ctx(cpuc), taskc->lat_cri, gen);
+	cpuc->pend_lat_cri += taskc->lat_cri;
+	cpuc->pend_sched_nr++;
 
 	/*
 	 * It is clear there is no need to consider the suspended duration
@@ -1680,7 +2138,10 @@ static void update_stat_for_running(struct task_struct *p,
 	perf_cri_raw = load_actual_ft * load_ideal_ft *
 		       wait_freq_ft * wake_freq_ft;
 	taskc->perf_cri = log2_u64(perf_cri_raw + 1);
-	cpuc->sum_perf_cri += taskc->perf_cri;
+	cpuc->pend_perf_cri += taskc->perf_cri;
+
+	if (cpuc->pend_sched_nr >= LAVD_LLC_FLUSH_NR)
+		flush_llc_sums(cpuc);
 
 	/*
 	 * Update task state when starts running.
@@ -1714,25 +2175,28 @@ static void update_stat_for_stopping(struct task_struct *p,
 	taskc->victim_cpu = (s32)LAVD_CPU_ID_NONE;
 
 	/*
-	 * After getting updated task's runtime, compensate CPU's total
+	 * After getting updated task's runtime, compensate LLC's total
 	 * runtime.
 	 */
-	cpuc->load_run_time_ns = cpuc->load_run_time_ns -
-				 cap_time_slice_ns(old_run_time_ns) +
-				 cap_time_slice_ns(taskc->run_time_ns);
+	__sync_fetch_and_add(&get_llc_ctx(cpuc)->load_run_time_ns,
+			     cap_time_slice_ns(taskc->run_time_ns) -
+			     cap_time_slice_ns(old_run_time_ns));
 }
 
 static void update_stat_for_quiescent(struct task_struct *p,
 				      struct task_ctx *taskc,
 				      struct cpu_ctx *cpuc)
 {
+	struct llc_ctx *llcx = get_llc_ctx(cpuc);
+
 	/*
-	 * When quiescent, reduce the per-CPU task load. Per-CPU task load will
-	 * be aggregated periodically at update_sys_cpu_load().
+	 * When quiescent, reduce the per-LLC task load. Per-LLC task load will
+	 * be aggregated periodically at collect_sys_stat().
 	 */
-	cpuc->load_ideal  -= get_task_load_ideal(p);
-	cpuc->load_actual -= taskc->load_actual;
-	cpuc->load_run_time_ns -= cap_time_slice_ns(taskc->run_time_ns);
+	__sync_fetch_and_sub(&llcx->load_ideal, get_task_load_ideal(p));
+	__sync_fetch_and_sub(&llcx->load_actual, taskc->load_actual);
+	__sync_fetch_and_sub(&llcx->load_run_time_ns,
+			     cap_time_slice_ns(taskc->run_time_ns));
 }
 
 static void calc_when_to_run(struct task_struct *p, struct task_ctx *taskc,
@@ -2025,7 +2489,7 @@ static bool try_yield_current_cpu(struct task_struct *p_run,
 	prm_run.lat_prio = taskc_run->lat_prio;
 
 	bpf_rcu_read_lock();
-	__COMPAT_DSQ_FOR_EACH(p_wait, LAVD_GLOBAL_DSQ, 0) {
+	__COMPAT_DSQ_FOR_EACH(p_wait, cpu_to_dsq(cpu_id), 0) {
 		taskc_wait = get_task_ctx(p_wait);
 		if (!taskc_wait)
 			break;
@@ -2050,7 +2514,7 @@ static bool try_yield_current_cpu(struct task_struct *p_run,
 		}
 
 		/*
-		 * Test only the first entry on the LAVD_GLOBAL_DSQ.
+		 * Test only the first entry on the CPU's DSQ.
 		 */
 		break;
 	}
@@ -2059,12 +2523,92 @@ static bool try_yield_current_cpu(struct task_struct *p_run,
 	return ret;
 }
 
+static u64 pick_task_dsq(struct task_struct *p)
+{
+	struct bpf_cpumask *active, *ovrflw;
+	s32 cpu_id = scx_bpf_task_cpu(p);
+	u32 alt;
+
+	if (!per_llc_dsq)
+		return LAVD_GLOBAL_DSQ;
+
+	/*
+	 * Queue the task on the LLC of its previous CPU to keep its cache
+	 * footprint warm. With core compaction, however, the previous CPU
+	 * might not be dispatching at all. In that case, queue it on the LLC
+	 * of an active or overflow CPU that it can run on so the task does
+	 * not have to rely on stealing to make progress.
+	 */
+	if (no_core_compaction)
+		return cpu_to_dsq(cpu_id);
+
+	bpf_rcu_read_lock();
+	active = active_cpumask;
+	ovrflw = ovrflw_cpumask;
+	if (!active || !ovrflw)
+		goto unlock_out;
+
+	if (bpf_cpumask_test_cpu(cpu_id, cast_mask(active)) ||
+	    bpf_cpumask_test_cpu(cpu_id, cast_mask(ovrflw)))
+		goto unlock_out;
+
+	alt = bpf_cpumask_any_and_distribute(cast_mask(active), p->cpus_ptr);
+	if (alt >= nr_cpus_onln)
+		alt = bpf_cpumask_any_and_distribute(cast_mask(ovrflw),
+						     p->cpus_ptr);
+	if (alt < nr_cpus_onln)
+		cpu_id = alt;
+
+unlock_out:
+	bpf_rcu_read_unlock();
+	return cpu_to_dsq(cpu_id);
+}
+
+static bool is_lat_cri(struct task_ctx *taskc, struct sys_stat *stat_cur)
+{
+	return taskc->lat_cri >= stat_cur->thr_lat_cri;
+}
+
+static void lc_queued_del(struct task_ctx *taskc)
+{
+	u32 llc = taskc->lc_queued_llc;
+
+	if (!llc)
+		return;
+
+	__sync_fetch_and_sub(&__llc_ctxs[(llc - 1) & (LAVD_LLC_MAX - 1)].nr_lc_queued, 1);
+	taskc->lc_queued_llc = 0;
+}
+
+/*
+ * Account @p in the nr_lc_queued of the LLC it's queued from if it's latency
+ * critical. The cpuperf governor ramps up the LLC's CPUs accordingly.
+ */
+static void lc_queued_add(struct task_struct *p, struct task_ctx *taskc,
+			  u64 dsq_id)
+{
+	u32 llc;
+
+	lc_queued_del(taskc);
+
+	if (!is_lat_cri(taskc, get_sys_stat_cur()))
+		return;
+
+	if (dsq_id == LAVD_GLOBAL_DSQ)
+		llc = cpu_to_llc(scx_bpf_task_cpu(p));
+	else
+		llc = (dsq_id - LAVD_LLC_DSQ_BASE) & (LAVD_LLC_MAX - 1);
+
+	__sync_fetch_and_add(&__llc_ctxs[llc].nr_lc_queued, 1);
+	taskc->lc_queued_llc = llc + 1;
+}
+
 static void put_global_rq(struct task_struct *p, struct task_ctx *taskc,
 			  struct cpu_ctx *cpuc, u64 enq_flags)
 {
 	struct task_ctx *taskc_run;
 	struct task_struct *p_run;
-	u64 vdeadline;
+	u64 vdeadline, dsq_id;
 
 	/*
 	 * Calculate when a tack can be scheduled.
@@ -2091,11 +2635,14 @@ static void put_global_rq(struct task_struct *p, struct task_ctx *taskc,
 		try_yield_current_cpu(p_run, cpuc, taskc_run);
 
 	/*
-	 * Enqueue the task to the global runqueue based on its virtual
-	 * deadline.
+	 * Enqueue the task to the global runqueue (or its LLC's runqueue)
+	 * based on its virtual deadline.
 	 */
-	scx_bpf_dispatch_vtime(p, LAVD_GLOBAL_DSQ, LAVD_SLICE_UNDECIDED,
-			       vdeadline, enq_flags);
+	dsq_id = pick_task_dsq(p);
+	if (cpuperf_governor)
+		lc_queued_add(p, taskc, dsq_id);
+	scx_bpf_dispatch_vtime(p, dsq_id, LAVD_SLICE_UNDECIDED, vdeadline,
+			       enq_flags);
 
 }
 
@@ -2337,10 +2884,76 @@ static bool is_kernel_task(struct task_struct *p)
 	return p->flags & PF_KTHREAD;
 }
 
+static bool consume_llc(struct cpu_ctx *cpuc, u32 llc)
+{
+	if (!scx_bpf_consume(LAVD_LLC_DSQ_BASE + (llc & (LAVD_LLC_MAX - 1))))
+		return false;
+
+	cpuc->pend_stolen++;
+	return true;
+}
+
+static bool consume_task(s32 cpu, struct cpu_ctx *cpuc)
+{
+	u32 llc, nr_near, nr_far, start, nr_probe, i, j;
+
+	if (!per_llc_dsq)
+		return scx_bpf_consume(LAVD_GLOBAL_DSQ);
+
+	/*
+	 * Consume the most urgent task of the CPU's own LLC first.
+	 */
+	llc = cpu_to_llc(cpu);
+	if (scx_bpf_consume(LAVD_LLC_DSQ_BASE + llc)) {
+		cpuc->pend_local++;
+		return true;
+	}
+
+	/*
+	 * Then, steal from the other LLCs on the same NUMA node. Those are
+	 * cheap to migrate from, so try all of them.
+	 */
+	nr_near = llc_nr_near[llc];
+	bpf_for(i, 0, nr_near) {
+		j = i & (LAVD_LLC_MAX - 1);
+		if (consume_llc(cpuc, llc_steal_order[llc][j]))
+			return true;
+	}
+
+	/*
+	 * Finally, probe at most llc_steal_max LLCs on the remote nodes.
+	 * Start from where the last probe stopped so that every remote LLC
+	 * is eventually visited and none of them is starved.
+	 */
+	if (nr_llcs <= nr_near + 1)
+		return false;
+	nr_far = nr_llcs - nr_near - 1;
+	nr_probe = min(llc_steal_max, nr_far);
+	start = cpuc->steal_cursor;
+
+	bpf_for(i, 0, nr_probe) {
+		j = (nr_near + (start + i) % nr_far) & (LAVD_LLC_MAX - 1);
+		if (consume_llc(cpuc, llc_steal_order[llc][j])) {
+			cpuc->steal_cursor = (start + i + 1) % nr_far;
+			return true;
+		}
+	}
+	cpuc->steal_cursor = (start + nr_probe) % nr_far;
+
+	return false;
+}
+
 void BPF_STRUCT_OPS(lavd_dispatch, s32 cpu, struct task_struct *prev)
 {
 	struct bpf_cpumask *active, *ovrflw;
 	struct task_struct *p;
+	struct cpu_ctx *cpuc;
+	u64 dsq_id;
+
+	cpuc = get_cpu_ctx_id(cpu);
+	if (!cpuc)
+		return;
+	dsq_id = cpu_to_dsq(cpu);
 
 	bpf_rcu_read_lock();
 
@@ -2359,7 +2972,7 @@ void BPF_STRUCT_OPS(lavd_dispatch, s32 cpu, struct task_struct *prev)
 	 */
 	if (bpf_cpumask_test_cpu(cpu, cast_mask(active)) ||
 	    bpf_cpumask_test_cpu(cpu, cast_mask(ovrflw))) {
-		scx_bpf_consume(LAVD_GLOBAL_DSQ);
+		consume_task(cpu, cpuc);
 		goto unlock_out;
 	}
 
@@ -2367,14 +2980,14 @@ void BPF_STRUCT_OPS(lavd_dispatch, s32 cpu, struct task_struct *prev)
 	 * If this CPU is not either in active or overflow CPUs, it tries to
 	 * find and run a task pinned to run on this CPU.
 	 */
-	__COMPAT_DSQ_FOR_EACH(p, LAVD_GLOBAL_DSQ, 0) {
+	__COMPAT_DSQ_FOR_EACH(p, dsq_id, 0) {
 		/*
 		 * Prioritize kernel tasks because most kernel tasks are pinned
 		 * to a particular CPU and latency-critical (e.g., ksoftirqd,
 		 * kworker, etc).
 		 */
 		if (is_kernel_task(p)) {
-			scx_bpf_consume(LAVD_GLOBAL_DSQ);
+			scx_bpf_consume(dsq_id);
 			break;
 		}
 
@@ -2406,7 +3019,7 @@ void BPF_STRUCT_OPS(lavd_dispatch, s32 cpu, struct task_struct *prev)
 		 * cores. We will optimize this path after introducing per-core
 		 * DSQ.
 		 */
-		scx_bpf_consume(LAVD_GLOBAL_DSQ);
+		scx_bpf_consume(dsq_id);
 
 		/*
 		 * This is the first time a particular pinned user-space task
@@ -2417,6 +3030,7 @@ void BPF_STRUCT_OPS(lavd_dispatch, s32 cpu, struct task_struct *prev)
 		 * obviously not idle.
 		 */
 		bpf_cpumask_set_cpu(cpu, active);
+		get_llc_ctx(cpuc)->dirty = true;
 
 release_break:
 		bpf_task_release(p);
@@ -2512,6 +3126,37 @@ static bool try_decrease_cpuperf_target(struct cpu_ctx *cpuc)
 	return false;
 }
 
+static bool try_apply_cpuperf_pred(struct cpu_ctx *cpuc,
+				   struct task_ctx *taskc)
+{
+	/*
+	 * Apply the governor's prediction for this CPU. A latency-critical
+	 * task ramps the CPU up right away instead of waiting for the next
+	 * prediction. Small changes are ignored to avoid frequent P-state
+	 * transitions.
+	 */
+	u32 target, cur, lc_floor;
+
+	if (!cpuc)
+		return false;
+
+	target = READ_ONCE(cpuc->cpuperf_pred);
+	if (taskc && is_lat_cri(taskc, get_sys_stat_cur())) {
+		lc_floor = SCX_CPUPERF_ONE * (100 - min(cpuperf_bias, 100)) / 100;
+		target = max(target, lc_floor);
+	}
+
+	cur = cpuc->cpuperf_cur;
+	if (cur == target ||
+	    ((cur > target ? cur - target : target - cur) < LAVD_CPUPERF_HYST &&
+	     target != SCX_CPUPERF_ONE))
+		return false;
+
+	cpuc->cpuperf_cur = target;
+	scx_bpf_cpuperf_set(cpuc->cpu_id, target);
+	return true;
+}
+
 void BPF_STRUCT_OPS(lavd_tick, struct task_struct *p_run)
 {
 	struct cpu_ctx *cpuc_run;
@@ -2528,6 +3173,8 @@ void BPF_STRUCT_OPS(lavd_tick, struct task_struct *p_run)
 	if (!cpuc_run || !taskc_run)
 		goto freq_out;
 
+	update_cpu_util(cpuc_run, bpf_ktime_get_ns());
+
 	preempted = try_yield_current_cpu(p_run, cpuc_run, taskc_run);
 
 	/*
@@ -2535,8 +3182,12 @@ void BPF_STRUCT_OPS(lavd_tick, struct task_struct *p_run)
 	 * task continues to run.
 	 */
 freq_out:
-	if (!no_freq_scaling && !preempted)
-		try_decrease_cpuperf_target(cpuc_run);
+	if (!no_freq_scaling && !preempted) {
+		if (cpuperf_governor)
+			try_apply_cpuperf_pred(cpuc_run, taskc_run);
+		else
+			try_decrease_cpuperf_target(cpuc_run);
+	}
 }
 
 void BPF_STRUCT_OPS(lavd_runnable, struct task_struct *p, u64 enq_flags)
@@ -2618,15 +3269,22 @@ void BPF_STRUCT_OPS(lavd_running, struct task_struct *p)
 		return;
 
 	update_stat_for_running(p, taskc, cpuc);
+	update_cpu_util(cpuc, bpf_ktime_get_ns());
 
 	/*
 	 * Calculate the task's CPU performance target and update if the new
 	 * target is higher than the current one. The CPU's performance target
 	 * urgently increases according to task's target but it decreases
-	 * gradually according to EWMA of past performance targets.
-	 */
-	calc_cpuperf_target(stat_cur, taskc, cpuc);
-	try_increase_cpuperf_target(cpuc);
+	 * gradually according to EWMA of past performance targets. The
+	 * governor mode follows its own prediction instead.
+	 */
+	if (cpuperf_governor) {
+		lc_queued_del(taskc);
+		try_apply_cpuperf_pred(cpuc, taskc);
+	} else {
+		calc_cpuperf_target(stat_cur, taskc, cpuc);
+		try_increase_cpuperf_target(cpuc);
+	}
 
 	/*
 	 * Update running task's information for preemption
@@ -2716,6 +3374,8 @@ void BPF_STRUCT_OPS(lavd_quiescent, struct task_struct *p, u64 deq_flags)
 		return;
 
 	update_stat_for_quiescent(p, taskc, cpuc);
+	if (cpuperf_governor)
+		lc_queued_del(taskc);
 
 	/*
 	 * If a task @p is dequeued from a run queue for some other reason
@@ -2738,6 +3398,8 @@ static void cpu_ctx_init_online(struct cpu_ctx *cpuc, u32 cpu_id, u64 now)
 {
 	cpuc->idle_start_clk = 0;
 	cpuc->cpu_id = cpu_id;
+	cpuc->util_clk = now;
+	cpuc->util_idle_snap = cpuc->idle_total;
 	cpuc->lat_prio = LAVD_LAT_PRIO_IDLE;
 	cpuc->stopping_tm_est_ns = LAVD_TIME_INFINITY_NS;
 	WRITE_ONCE(cpuc->online_clk, now);
@@ -2748,8 +3410,9 @@ static void cpu_ctx_init_online(struct cpu_ctx *cpuc, u32 cpu_id, u64 now)
 
 static void cpu_ctx_init_offline(struct cpu_ctx *cpuc, u32 cpu_id, u64 now)
 {
-	cpuc->idle_start_clk = 0;
 	cpuc->cpu_id = cpu_id;
+	exit_cpu_idle(cpuc, now);
+	set_cpu_util_violation(cpuc, false);
 	WRITE_ONCE(cpuc->offline_clk, now);
 	cpuc->is_online = false;
 	barrier();
@@ -2772,6 +3435,7 @@ void BPF_STRUCT_OPS(lavd_cpu_online, s32 cpu)
 		return;
 
 	cpu_ctx_init_online(cpuc, cpu, now);
+	get_llc_ctx(cpuc)->dirty = true;
 
 	__sync_fetch_and_add(&nr_cpus_onln, 1);
 	update_sys_stat();
@@ -2791,6 +3455,7 @@ void BPF_STRUCT_OPS(lavd_cpu_offline, s32 cpu)
 		return;
 
 	cpu_ctx_init_offline(cpuc, cpu, now);
+	get_llc_ctx(cpuc)->dirty = true;
 
 	__sync_fetch_and_sub(&nr_cpus_onln, 1);
 	update_sys_stat();
@@ -2805,16 +3470,20 @@ void BPF_STRUCT_OPS(lavd_update_idle, s32 cpu, bool idle)
 	 */
 
 	struct cpu_ctx *cpuc;
+	u64 now;
 
 	cpuc = get_cpu_ctx_id(cpu);
 	if (!cpuc)
 		return;
 
+	now = bpf_ktime_get_ns();
+
 	/*
 	 * The CPU is entering into the idle state.
 	 */
 	if (idle) {
-		cpuc->idle_start_clk = bpf_ktime_get_ns();
+		update_cpu_util(cpuc, now);
+		enter_cpu_idle(cpuc, now);
 		cpuc->lat_prio = LAVD_LAT_PRIO_IDLE;
 		cpuc->stopping_tm_est_ns = LAVD_TIME_INFINITY_NS;
 	}
@@ -2822,28 +3491,62 @@ void BPF_STRUCT_OPS(lavd_update_idle, s32 cpu, bool idle)
 	 * The CPU is exiting from the idle state.
 	 */
 	else {
-		/*
-		 * If idle_start_clk is zero, that means entering into the idle
-		 * is not captured by the scx (i.e., the scx scheduler is
-		 * loaded when this CPU is in an idle state).
-		 */
-		u64 old_clk = cpuc->idle_start_clk;
-		if (old_clk != 0) {
-			/*
-			 * The CAS failure happens when idle_start_clk is
-			 * updated by the update timer. That means the update
-			 * timer already took the idle_time duration. Hence the
-			 * idle duration should not be accumulated.
-			 */
-			u64 duration = bpf_ktime_get_ns() - old_clk;
-			bool ret = __sync_bool_compare_and_swap(
-					&cpuc->idle_start_clk, old_clk, 0);
-			if (ret)
-				cpuc->idle_total += duration;
-		}
+		exit_cpu_idle(cpuc, now);
+		update_cpu_util(cpuc, now);
 	}
 }
 
+static void task_save_handoff(struct task_struct *p, struct task_ctx *taskc)
+{
+	struct handoff_task ho = {
+		.start_time = p->start_time,
+		.saved_at = bpf_ktime_get_ns(),
+		.run_time_ns = taskc->run_time_ns,
+		.run_freq = taskc->run_freq,
+		.wait_freq = taskc->wait_freq,
+		.wake_freq = taskc->wake_freq,
+		.load_actual = taskc->load_actual,
+		.greedy_ratio = taskc->greedy_ratio,
+		.lat_cri = taskc->lat_cri,
+		.perf_cri = taskc->perf_cri,
+		.slice_boost_prio = taskc->slice_boost_prio,
+		.version = LAVD_HANDOFF_VERSION,
+	};
+	s32 pid = p->pid;
+
+	bpf_map_update_elem(&handoff_tasks, &pid, &ho, BPF_ANY);
+}
+
+static void task_adopt_handoff(struct task_struct *p, struct task_ctx *taskc,
+			       u64 now)
+{
+	struct handoff_task *ho;
+	s32 pid = p->pid;
+
+	ho = bpf_map_lookup_elem(&handoff_tasks, &pid);
+	if (!ho)
+		return;
+
+	if (ho->version != LAVD_HANDOFF_VERSION ||
+	    ho->start_time != p->start_time ||
+	    now - ho->saved_at > LAVD_HANDOFF_MAX_AGE_NS)
+		goto out_delete;
+
+	taskc->run_time_ns = ho->run_time_ns;
+	taskc->run_freq = ho->run_freq;
+	taskc->wait_freq = ho->wait_freq;
+	taskc->wake_freq = ho->wake_freq;
+	taskc->load_actual = ho->load_actual;
+	taskc->greedy_ratio = ho->greedy_ratio;
+	taskc->lat_cri = ho->lat_cri;
+	taskc->perf_cri = ho->perf_cri;
+	taskc->slice_boost_prio = ho->slice_boost_prio;
+	__sync_fetch_and_add(&nr_handoff_tasks, 1);
+
+out_delete:
+	bpf_map_delete_elem(&handoff_tasks, &pid);
+}
+
 s32 BPF_STRUCT_OPS(lavd_init_task, struct task_struct *p,
 		   struct scx_init_task_args *args)
 {
@@ -2876,6 +3579,12 @@ s32 BPF_STRUCT_OPS(lavd_init_task, struct task_struct *p,
 	taskc->run_freq = 1;
 	taskc->victim_cpu = (s32)LAVD_CPU_ID_NONE;
 
+	/*
+	 * Pick up where the previous scheduler instance left off, if any.
+	 */
+	if (handoff)
+		task_adopt_handoff(p, taskc, now);
+
 	/*
 	 * When a task is forked, we immediately reflect changes to the current
 	 * ideal load not to over-allocate time slices without counting forked
@@ -2891,6 +3600,19 @@ s32 BPF_STRUCT_OPS(lavd_init_task, struct task_struct *p,
 	return 0;
 }
 
+void BPF_STRUCT_OPS(lavd_exit_task, struct task_struct *p,
+		    struct scx_exit_task_args *args)
+{
+	struct task_ctx *taskc;
+
+	if (!handoff || !unloading || (p->flags & PF_EXITING))
+		return;
+
+	taskc = try_get_task_ctx(p);
+	if (taskc)
+		task_save_handoff(p, taskc);
+}
+
 static int calloc_cpumask(struct bpf_cpumask **p_cpumask)
 {
 	struct bpf_cpumask *cpumask;
@@ -2933,6 +3655,22 @@ out:
 	return err;
 }
 
+static void init_per_llc_ctx(void)
+{
+	u32 llc;
+
+	bpf_for(llc, 0, nr_llcs) {
+		u32 i = llc & (LAVD_LLC_MAX - 1);
+
+		/*
+		 * All CPUs start active (see init_cpumasks()); let the first
+		 * core compaction visit every LLC.
+		 */
+		__llc_ctxs[i].dirty = true;
+		__llc_snaps[i].nr_active = llc_nr_cpus[i];
+	}
+}
+
 static s32 init_per_cpu_ctx(u64 now)
 {
 	int cpu;
@@ -2957,6 +3695,8 @@ static s32 init_per_cpu_ctx(u64 now)
 		cpuc->offline_clk = now;
 	}
 
+	init_per_llc_ctx();
+
 	return 0;
 }
 
@@ -3002,6 +3742,24 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(lavd_init)
 		return err;
 	}
 
+	/*
+	 * Create per-LLC task queues on their NUMA nodes.
+	 */
+	if (per_llc_dsq) {
+		u32 llc;
+
+		bpf_for(llc, 0, nr_llcs) {
+			u32 i = llc & (LAVD_LLC_MAX - 1);
+
+			err = scx_bpf_create_dsq(LAVD_LLC_DSQ_BASE + i,
+						 llc_node_id[i]);
+			if (err) {
+				scx_bpf_error("Failed to create LLC DSQ %d", i);
+				return err;
+			}
+		}
+	}
+
 	/*
 	 * Initialize per-CPU context.
 	 */
@@ -3048,6 +3806,7 @@ SCX_OPS_DEFINE(lavd_ops,
 	       .cpu_offline		= (void *)lavd_cpu_offline,
 	       .update_idle		= (void *)lavd_update_idle,
 	       .init_task		= (void *)lavd_init_task,
+	       .exit_task		= (void *)lavd_exit_task,
 	       .init			= (void *)lavd_init,
 	       .exit			= (void *)lavd_exit,
 	       .flags			= /* SCX_OPS_ENQ_LAST | */ SCX_OPS_KEEP_BUILTIN_IDLE,
@@ -12,14 +12,12 @@ pub mod bpf_intf;
 pub use bpf_intf::*;
 
 use std::mem;
+use std::slice;
+use std::str;
 use std::sync::atomic::AtomicBool;
 use std::sync::atomic::Ordering;
 use std::time::Duration;
 
-use libc::c_char;
-use std::ffi::CStr;
-use std::str;
-
 use anyhow::Context;
 use anyhow::Result;
 use clap::Parser;
@@ -27,6 +25,8 @@ use libbpf_rs::skel::OpenSkel;
 use libbpf_rs::skel::Skel;
 use libbpf_rs::skel::SkelBuilder;
 use log::info;
+use log::warn;
+use scx_utils::handoff;
 use scx_utils::scx_ops_attach;
 use scx_utils::scx_ops_load;
 use scx_utils::scx_ops_open;
@@ -40,6 +40,7 @@ use plain::Plain;
 use rlimit::{getrlimit, setrlimit, Resource};
 
 static RUNNING: AtomicBool = AtomicBool::new(true);
+const HANDOFF_TASKS_PIN: &str = "/sys/fs/bpf/scx_lavd_handoff_tasks";
 
 /// scx_lavd: Latency-criticality Aware Virtual Deadline (LAVD) scheduler
 ///
@@ -56,14 +57,54 @@ struct Opts {
     #[clap(long = "no-freq-scaling", action = clap::ArgAction::SetTrue)]
     no_freq_scaling: bool,
 
+    /// Set the per-CPU performance targets from a prediction of the demand in
+    /// the next interval, derived from the CPU utilization and the
+    /// latency-critical tasks queued on each LLC, instead of following the
+    /// running task.
+    #[clap(
+        long = "cpuperf-governor",
+        action = clap::ArgAction::SetTrue,
+        conflicts_with = "no_freq_scaling"
+    )]
+    cpuperf_governor: bool,
+
+    /// Energy/latency tradeoff of --cpuperf-governor, from 0 (ramp up early
+    /// and keep 100% headroom for latency) to 100 (run just fast enough to
+    /// serve the utilization).
+    #[clap(long, default_value = "50", value_parser = clap::value_parser!(u32).range(0..=100))]
+    cpuperf_bias: u32,
+
+    /// Queue tasks on per-LLC DSQs instead of a single global DSQ. An idle
+    /// CPU consumes from its own LLC first, then from the other LLCs on the
+    /// same NUMA node, and finally from a bounded number of remote LLCs.
+    #[clap(long = "per-llc-dsq", action = clap::ArgAction::SetTrue)]
+    per_llc_dsq: bool,
+
+    /// The maximum number of remote-node LLCs probed for stealing on each
+    /// dispatch when --per-llc-dsq is on.
+    #[clap(long, default_value = "1")]
+    llc_steal_max: u32,
+
     /// The number of scheduling samples to be reported every second (default: 1)
     #[clap(short = 's', long, default_value = "1")]
     nr_sched_samples: u64,
 
+    /// Sample one out of N scheduling events on each CPU for
+    /// --nr-sched-samples (default: 1, every event)
+    #[clap(long, default_value = "1")]
+    sched_sample_rate: u32,
+
     /// PID to be tracked all its scheduling activities if specified
     #[clap(short = 'p', long, default_value = "0")]
     pid_traced: u64,
 
+    /// Save the per-task latency criticality history into a map pinned
+    /// under /sys/fs/bpf when exiting and adopt the history saved by the
+    /// previous instance when starting, so that a restarted scheduler
+    /// doesn't have to re-learn it. The saved state expires after 10 seconds.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    handoff: bool,
+
     /// Exit debug dump buffer length. 0 indicates default.
     #[clap(long, default_value = "0")]
     exit_dump_len: u32,
@@ -74,10 +115,10 @@ struct Opts {
     verbose: u8,
 }
 
-unsafe impl Plain for msg_task_ctx {}
+unsafe impl Plain for msg_task_batch {}
 
-impl msg_task_ctx {
-    fn from_bytes(buf: &[u8]) -> &msg_task_ctx {
+impl msg_task_batch {
+    fn from_bytes(buf: &[u8]) -> &msg_task_batch {
         plain::from_bytes(buf).expect("The buffer is either too short or not aligned!")
     }
 }
@@ -124,17 +165,9 @@ impl<'a> Scheduler<'a> {
         skel_builder.obj_builder.debug(opts.verbose > 0);
         let mut skel = scx_ops_open!(skel_builder, lavd_ops)?;
 
-        // Initialize CPU order topologically sorted by cpu, core, LLC, and NUMA.
+        // Initialize CPU order and LLC topology.
         let topo = Topology::new().expect("Failed to build host topology");
-        for node in topo.nodes().iter() {
-            for llc in node.llcs().values() {
-                for core in llc.cores().values() {
-                    for (cpu_id, cpu) in core.cpus().iter() {
-                        skel.rodata_mut().cpu_order[*cpu_id] = cpu.id() as u16;
-                    }
-                }
-            }
-        }
+        Self::init_cpu_topology(&mut skel, &topo)?;
 
         // Initialize skel according to @opts.
         let nr_cpus_onln = topo.span().weight() as u64;
@@ -142,12 +175,28 @@ impl<'a> Scheduler<'a> {
         skel.struct_ops.lavd_ops_mut().exit_dump_len = opts.exit_dump_len;
         skel.rodata_mut().no_core_compaction = opts.no_core_compaction;
         skel.rodata_mut().no_freq_scaling = opts.no_freq_scaling;
+        skel.rodata_mut().cpuperf_governor = opts.cpuperf_governor;
+        skel.rodata_mut().cpuperf_bias = opts.cpuperf_bias;
+        skel.rodata_mut().per_llc_dsq = opts.per_llc_dsq;
+        skel.rodata_mut().llc_steal_max = opts.llc_steal_max;
+        skel.rodata_mut().introspec_sample_rate = opts.sched_sample_rate.max(1);
         skel.rodata_mut().verbose = opts.verbose;
+        skel.rodata_mut().handoff = opts.handoff;
+        if opts.handoff {
+            handoff::pin_handoff_map(
+                skel.maps_mut().handoff_tasks(),
+                HANDOFF_TASKS_PIN,
+                mem::size_of::<bpf_intf::handoff_task>(),
+            )?;
+        }
         let intrspc = introspec::init(opts);
 
         // Attach.
         let mut skel = scx_ops_load!(skel, lavd_ops, uei)?;
         let struct_ops = Some(scx_ops_attach!(skel, lavd_ops)?);
+        if opts.handoff {
+            info!("handoff: adopted tasks={}", skel.bss().nr_handoff_tasks);
+        }
 
         // Build a ring buffer for instrumentation
         let mut maps = skel.maps_mut();
@@ -165,6 +214,80 @@ impl<'a> Scheduler<'a> {
         })
     }
 
+    fn init_cpu_topology(skel: &mut OpenBpfSkel, topo: &Topology) -> Result<()> {
+        // Lay out CPUs topologically sorted by cpu, core, LLC, and NUMA so
+        // that each LLC covers a contiguous range of cpu_order.
+        let mut topo_llcs = Vec::new();
+        for node in topo.nodes().iter() {
+            for llc in node.llcs().values() {
+                let cpus: Vec<usize> = llc
+                    .cores()
+                    .values()
+                    .flat_map(|core| core.cpus().keys().copied())
+                    .collect();
+                topo_llcs.push((node.id(), cpus));
+            }
+        }
+
+        // Number LLCs compactly in the same order and remember their nodes.
+        // If there are more LLCs than the BPF side can track, fold adjacent
+        // ones together. As they're sorted topologically, folded LLCs are
+        // on the same node as long as there are enough LLCs per node.
+        let max = LAVD_LLC_MAX as usize;
+        let fold = ((topo_llcs.len() + max - 1) / max).max(1);
+        if fold > 1 {
+            warn!(
+                "{} LLCs exceed the max of {}, folding {} adjacent LLCs into one",
+                topo_llcs.len(),
+                LAVD_LLC_MAX,
+                fold
+            );
+        }
+
+        let mut llc_nodes = Vec::new();
+        let mut pos = 0;
+        for (i, (node_id, cpus)) in topo_llcs.iter().enumerate() {
+            let llc_idx = i / fold;
+            let rodata = skel.rodata_mut();
+            if i % fold == 0 {
+                rodata.llc_cpu_start[llc_idx] = pos as u16;
+                llc_nodes.push(*node_id);
+            }
+            for cpu_id in cpus.iter() {
+                rodata.cpu_order[pos] = *cpu_id as u16;
+                rodata.cpu_llc_id[*cpu_id] = llc_idx as u8;
+                pos += 1;
+            }
+            rodata.llc_nr_cpus[llc_idx] = (pos - rodata.llc_cpu_start[llc_idx] as usize) as u16;
+        }
+
+        // For each LLC, order the other LLCs for stealing: the ones on the
+        // same node first, then the remote ones. Both are rotated to start
+        // right after the LLC itself to spread out the stealers.
+        let nr_llcs = llc_nodes.len();
+        for llc in 0..nr_llcs {
+            let others = (1..nr_llcs).map(|i| (llc + i) % nr_llcs);
+            let (near, far): (Vec<usize>, Vec<usize>) =
+                others.partition(|&other| llc_nodes[other] == llc_nodes[llc]);
+
+            let rodata = skel.rodata_mut();
+            for (i, other) in near.iter().chain(far.iter()).enumerate() {
+                rodata.llc_steal_order[llc][i] = *other as u8;
+            }
+            rodata.llc_nr_near[llc] = near.len() as u8;
+            rodata.llc_node_id[llc] = llc_nodes[llc] as u32;
+        }
+        skel.rodata_mut().nr_llcs = nr_llcs as u32;
+
+        info!(
+            "CPU topology: {} CPUs, {} LLCs on {} nodes",
+            pos,
+            nr_llcs,
+            topo.nodes().len()
+        );
+        Ok(())
+    }
+
     fn get_msg_seq_id() -> u64 {
         static mut MSEQ: u64 = 0;
         unsafe {
@@ -174,15 +297,23 @@ impl<'a> Scheduler<'a> {
     }
 
     fn print_bpf_msg(data: &[u8]) -> i32 {
-        let mt = msg_task_ctx::from_bytes(data);
-        let tx = mt.taskc_x;
-        let tc = mt.taskc;
+        let mb = msg_task_batch::from_bytes(data);
 
-        // No idea how to print other types than LAVD_MSG_TASKC
-        if mt.hdr.kind != LAVD_MSG_TASKC {
+        // No idea how to print other types than LAVD_MSG_TASK_BATCH
+        if mb.hdr.kind != LAVD_MSG_TASK_BATCH {
             return 0;
         }
 
+        // Decode the samples in place from the ring buffer.
+        let nr = (mb.nr as usize).min(mb.samples.len());
+        for ts in mb.samples[..nr].iter() {
+            Scheduler::print_task_sample(ts);
+        }
+
+        0
+    }
+
+    fn print_task_sample(ts: &task_sample) {
         // Print a message from the BPF scheduler
         let mseq = Scheduler::get_msg_seq_id();
 
@@ -223,9 +354,9 @@ impl<'a> Scheduler<'a> {
             );
         }
 
-        let c_tx_cm: *const c_char = (&tx.comm as *const [c_char; 17]) as *const c_char;
-        let c_tx_cm_str: &CStr = unsafe { CStr::from_ptr(c_tx_cm) };
-        let tx_comm: &str = c_tx_cm_str.to_str().unwrap();
+        let comm = unsafe { slice::from_raw_parts(ts.comm.as_ptr() as *const u8, ts.comm.len()) };
+        let comm_len = comm.iter().position(|&c| c == 0).unwrap_or(comm.len());
+        let tx_comm = str::from_utf8(&comm[..comm_len]).unwrap_or("?");
 
         info!(
             "| {:6} | {:7} | {:17} \
@@ -237,32 +368,30 @@ impl<'a> Scheduler<'a> {
                | {:8} | {:8} | {:8} \
                | {:8} | {:6} | {:6} |",
             mseq,
-            tx.pid,
+            ts.pid,
             tx_comm,
-            tx.cpu_id,
-            tc.victim_cpu,
-            tc.vdeadline_delta_ns,
-            tc.eligible_delta_ns,
-            tc.slice_ns,
-            tc.greedy_ratio,
-            tc.lat_prio,
-            tx.avg_lat_cri,
-            tx.static_prio,
-            tc.lat_boost_prio,
-            tc.slice_boost_prio,
-            tc.run_freq,
-            tc.run_time_ns,
-            tc.wait_freq,
-            tc.wake_freq,
-            tc.perf_cri,
-            tx.avg_perf_cri,
-            tx.cpuperf_cur,
-            tx.cpu_util,
-            tx.sys_load_factor,
-            tx.nr_active,
+            ts.cpu_id,
+            ts.victim_cpu,
+            ts.vdeadline_delta_ns,
+            ts.eligible_delta_ns,
+            ts.slice_ns,
+            ts.greedy_ratio,
+            ts.lat_prio,
+            ts.avg_lat_cri,
+            ts.static_prio,
+            ts.lat_boost_prio,
+            ts.slice_boost_prio,
+            ts.run_freq,
+            ts.run_time_ns,
+            ts.wait_freq,
+            ts.wake_freq,
+            ts.perf_cri,
+            ts.avg_perf_cri,
+            ts.cpuperf_cur,
+            ts.cpu_util,
+            ts.sys_load_factor,
+            ts.nr_active,
         );
-
-        0
     }
 
     fn prep_introspec(&mut self) -> u64 {
@@ -307,6 +436,8 @@ impl<'a> Scheduler<'a> {
         }
         self.rb_mgr.consume().unwrap();
 
+        // only save the handoff state of the tasks left behind by the unload
+        self.skel.bss_mut().unloading = true;
         self.struct_ops.take();
         uei_report!(&self.skel, uei)
     }
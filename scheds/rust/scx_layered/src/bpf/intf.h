@@ -20,21 +20,39 @@ typedef unsigned u32;
 typedef unsigned long long u64;
 #endif
 
+#include <scx/cacheline.h>
 #include <scx/ravg.bpf.h>
 
 enum consts {
 	MAX_CPUS_SHIFT		= 9,
 	MAX_CPUS		= 1 << MAX_CPUS_SHIFT,
 	MAX_CPUS_U8		= MAX_CPUS / 8,
+	MAX_CPUS_U64		= MAX_CPUS / 64,
 	MAX_TASKS		= 131072,
 	MAX_PATH		= 4096,
 	MAX_COMM		= 16,
 	MAX_LAYER_MATCH_ORS	= 32,
 	MAX_LAYERS		= 16,
+	MAX_LLCS		= 64,
 	USAGE_HALF_LIFE		= 100000000,	/* 100ms */
 
-	HI_FALLBACK_DSQ		= MAX_LAYERS,
-	LO_FALLBACK_DSQ		= MAX_LAYERS + 1,
+	/* compiled layer match index, see match_layer() */
+	MAX_MATCH_CLAUSES	= MAX_LAYERS * MAX_LAYER_MATCH_ORS,
+	MATCH_MASK_WORDS	= MAX_MATCH_CLAUSES / 64,
+	NR_MATCH_PREFIX_KINDS	= 3,	/* MATCH_{CGROUP|COMM|PCOMM}_PREFIX */
+	MAX_MATCH_PREFIXES	= MAX_MATCH_CLAUSES * NR_MATCH_PREFIX_KINDS,
+	NICE_WIDTH		= 40,	/* nice -20 .. 19 */
+
+	/* layer DSQs are layer_idx * MAX_LLCS + llc, see layer_dsq_id() */
+	HI_FALLBACK_DSQ		= MAX_LAYERS * MAX_LLCS,
+	LO_FALLBACK_DSQ		= MAX_LAYERS * MAX_LLCS + 1,
+
+	/*
+	 * With --handoff, the state saved by the previous instance is adopted
+	 * if it's younger than this. Up to MAX_TASKS tasks are saved.
+	 */
+	HANDOFF_MAX_AGE_NS	= 10LLU * 1000000000,
+	HANDOFF_VERSION		= 1,	/* bump when struct handoff_* change */
 
 	/* XXX remove */
 	MAX_CGRP_PREFIXES = 32
@@ -70,6 +88,7 @@ enum layer_stat_idx {
 	LSTAT_YIELD,
 	LSTAT_YIELD_IGNORE,
 	LSTAT_MIGRATION,
+	LSTAT_XLLC_STEAL,
 	NR_LSTATS,
 };
 
@@ -80,11 +99,21 @@ struct cpu_ctx {
 	bool			maybe_idle;
 	bool			yielding;
 	bool			try_preempt_first;
+	bool			xllc_kick;
+	u64			ran_current_for;
+};
+
+/*
+ * Per-CPU statistics, see cpu_stats[] in main.bpf.c. @seq is odd while the
+ * owning CPU is updating the entry.
+ */
+struct cpu_stats {
+	u64			seq;
 	u64			layer_cycles[MAX_LAYERS];
 	u64			gstats[NR_GSTATS];
 	u64			lstats[MAX_LAYERS][NR_LSTATS];
-	u64			ran_current_for;
-};
+} __scx_cacheline_aligned;
+SCX_ASSERT_CACHELINE_ALIGNED(struct cpu_stats);
 
 enum layer_match_kind {
 	MATCH_CGROUP_PREFIX,
@@ -110,6 +139,31 @@ struct layer_match_ands {
 	int			nr_match_ands;
 };
 
+/* 64bit FNV-1a, used to hash match prefixes on both sides */
+#define MATCH_HASH_SEED		0xcbf29ce484222325LLU
+#define MATCH_HASH_PRIME	0x100000001b3LLU
+
+/*
+ * Each OR block of each layer is compiled into a match clause numbered
+ * layer_idx * MAX_LAYER_MATCH_ORS + or_idx. match_index maps the prefixes of
+ * the MATCH_*_PREFIX conditions to the clauses which require them.
+ */
+struct match_key {
+	u32		kind;
+	u32		len;
+	u64		hash;
+};
+
+struct match_val {
+	u64		clauses[MATCH_MASK_WORDS];
+	char		prefix[MAX_PATH];
+};
+
+/*
+ * Laid out so that the fields written from every CPU on each schedule
+ * (vtime_now and the load tracking) don't share cachelines with the
+ * read-mostly configuration and CPU assignment.
+ */
 struct layer {
 	struct layer_match_ands	matches[MAX_LAYER_MATCH_ORS];
 	unsigned int		nr_match_ors;
@@ -121,18 +175,43 @@ struct layer {
 	bool			preempt;
 	bool			preempt_first;
 	bool			exclusive;
+	unsigned int		perf;
+
+	u64			cpus_seq __scx_cacheline_aligned;
+	unsigned int		refresh_cpus;
+	unsigned char		cpus[MAX_CPUS_U8];
+	unsigned int		nr_cpus;	// managed from BPF side
 
-	u64			vtime_now;
+	u64			vtime_now __scx_cacheline_aligned;
 	u64			nr_tasks;
 
-	u64			load;
+	u64			load __scx_cacheline_aligned;
 	struct ravg_data	load_rd;
+} __scx_cacheline_aligned;
+SCX_ASSERT_CACHELINE_ALIGNED(struct layer);
+SCX_ASSERT_CACHELINE_START(struct layer, cpus_seq);
+SCX_ASSERT_CACHELINE_START(struct layer, vtime_now);
+SCX_ASSERT_CACHELINE_START(struct layer, load);
+
+/*
+ * Warm state saved into pinned maps when the scheduler is unloaded with
+ * --handoff, so that the next instance doesn't have to re-learn it.
+ */
+struct handoff_task {
+	u64 start_time;		/* to detect pid reuse */
+	u64 saved_at;
+	u64 dsq_vtime;
+	s32 layer;
+	u32 version;		/* HANDOFF_VERSION */
+};
 
-	u64			cpus_seq;
-	unsigned int		refresh_cpus;
-	unsigned char		cpus[MAX_CPUS_U8];
-	unsigned int		nr_cpus;	// managed from BPF side
-	unsigned int		perf;
+struct handoff_layer {
+	u64 saved_at;
+	u64 cfg_hash;		/* only adopted if the layer config is the same */
+	u32 nr_layers;
+	u32 version;		/* HANDOFF_VERSION */
+	u64 vtime_now;
+	struct ravg_data load_rd;
 };
 
 #endif /* __INTF_H */
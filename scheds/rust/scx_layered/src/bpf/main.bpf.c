@@ -1,6 +1,8 @@
 /* Copyright (c) Meta Platforms, Inc. and affiliates. */
 #include <scx/common.bpf.h>
 #include <scx/ravg_impl.bpf.h>
+#include <scx/lathist_impl.bpf.h>
+#include <scx/sched_trace_impl.bpf.h>
 #include "intf.h"
 
 #include <errno.h>
@@ -19,12 +21,25 @@ const volatile u32 nr_possible_cpus = 1;
 const volatile u32 nr_layers = 1;
 const volatile bool smt_enabled = true;
 const volatile s32 __sibling_cpu[MAX_CPUS];
+const volatile u32 nr_llcs = 1;
+const volatile u32 cpu_llc_id[MAX_CPUS];
+const volatile u64 xllc_steal_delay_ns = 1000 * 1000;
 const volatile unsigned char all_cpus[MAX_CPUS_U8];
+const volatile bool handoff;
+const volatile u64 layer_cfg_hash;
 
 private(all_cpumask) struct bpf_cpumask __kptr *all_cpumask;
 struct layer layers[MAX_LAYERS];
 u32 fallback_cpu;
-static u32 preempt_cursor;
+u64 match_gen;	/* see cgrp_match_ctx */
+
+/*
+ * CPUs which aren't running a task from a preempting layer and thus can be
+ * preempted by one. A bit is cleared when a preempting task starts running on
+ * the CPU and set again when it stops, so that the enqueue path can look for
+ * victims a word at a time instead of probing the cpu_ctx of every CPU.
+ */
+u64 preemptible_cpus[MAX_CPUS_U64];
 
 #define dbg(fmt, args...)	do { if (debug) bpf_printk(fmt, ##args); } while (0)
 #define trace(fmt, args...)	do { if (debug > 1) bpf_printk(fmt, ##args); } while (0)
@@ -55,6 +70,59 @@ static inline s32 sibling_cpu(s32 cpu)
 		return -1;
 }
 
+static inline u32 cpu_llc(s32 cpu)
+{
+	const volatile u32 *llc;
+
+	llc = MEMBER_VPTR(cpu_llc_id, [cpu]);
+	if (llc)
+		return *llc;
+	else
+		return 0;
+}
+
+/*
+ * Non-preempting open and grouped layers are consumed from CPUs all over the
+ * machine. To avoid sharing a single DSQ lock across all LLCs and bouncing
+ * tasks between them, such layers have a DSQ per LLC. A task is queued on the
+ * DSQ of the LLC it last ran in and the CPUs consume their own LLC's DSQ
+ * first. See layered_dispatch().
+ */
+static bool layer_llc_split(struct layer *layer)
+{
+	return layer->open && !layer->preempt && nr_llcs > 1;
+}
+
+static u64 layer_dsq_id(u32 layer_idx, u32 llc)
+{
+	return (u64)layer_idx * MAX_LLCS + llc;
+}
+
+static void set_cpu_preemptible(s32 cpu, bool preemptible)
+{
+	u64 *word;
+
+	if (!(word = MEMBER_VPTR(preemptible_cpus, [cpu / 64]))) {
+		scx_bpf_error("invalid cpu %d", cpu);
+		return;
+	}
+
+	if (preemptible)
+		__sync_fetch_and_or(word, 1LLU << (cpu % 64));
+	else
+		__sync_fetch_and_and(word, ~(1LLU << (cpu % 64)));
+}
+
+static bool test_cpu_preemptible(s32 cpu)
+{
+	u64 *word;
+
+	if (cpu < 0 || !(word = MEMBER_VPTR(preemptible_cpus, [cpu / 64])))
+		return false;
+
+	return READ_ONCE(*word) & (1LLU << (cpu % 64));
+}
+
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
 	__type(key, u32);
@@ -80,31 +148,93 @@ static struct cpu_ctx *lookup_cpu_ctx(int cpu)
 	return cctx;
 }
 
-static void gstat_inc(enum global_stat_idx idx, struct cpu_ctx *cctx)
+/*
+ * Statistics live in .bss, which is memory mapped by user space, instead of in
+ * cpu_ctx so that they can be read without copying out the whole per-CPU map.
+ * Each CPU only updates its own entry. Callbacks which update stats wrap their
+ * body in cpu_stats_begin() and cpu_stats_end(), so that readers can tell a
+ * consistent snapshot of the entry.
+ */
+struct cpu_stats cpu_stats[MAX_CPUS];
+
+static struct cpu_stats *lookup_cpu_stats(void)
 {
-	if (idx < 0 || idx >= NR_GSTATS) {
-		scx_bpf_error("invalid global stat idx %d", idx);
-		return;
+	struct cpu_stats *cstats;
+	u32 cpu = bpf_get_smp_processor_id();
+
+	if (!(cstats = MEMBER_VPTR(cpu_stats, [cpu]))) {
+		scx_bpf_error("no cpu_stats for cpu %u", cpu);
+		return NULL;
 	}
 
-	cctx->gstats[idx]++;
+	return cstats;
+}
+
+/*
+ * BPF has no smp_wmb(). The seqcount is bumped with __sync_fetch_and_add(),
+ * which is fully ordered, so that the counter updates can't be reordered with
+ * either end of the section, by the compiler or by the CPU.
+ */
+static struct cpu_stats *cpu_stats_begin(void)
+{
+	struct cpu_stats *cstats;
+
+	if ((cstats = lookup_cpu_stats()))
+		__sync_fetch_and_add(&cstats->seq, 1);
+	return cstats;
+}
+
+static void cpu_stats_end(struct cpu_stats *cstats)
+{
+	if (cstats)
+		__sync_fetch_and_add(&cstats->seq, 1);
+}
+
+static void gstat_inc(enum global_stat_idx idx)
+{
+	struct cpu_stats *cstats;
+	u64 *vptr;
+
+	if (!(cstats = lookup_cpu_stats()))
+		return;
+
+	if ((vptr = MEMBER_VPTR(*cstats, .gstats[idx])))
+		(*vptr)++;
+	else
+		scx_bpf_error("invalid global stat idx %d", idx);
 }
 
-static void lstat_add(enum layer_stat_idx idx, struct layer *layer,
-		      struct cpu_ctx *cctx, s64 delta)
+static void lstat_add(enum layer_stat_idx idx, struct layer *layer, s64 delta)
 {
+	struct cpu_stats *cstats;
 	u64 *vptr;
 
-	if ((vptr = MEMBER_VPTR(*cctx, .lstats[layer->idx][idx])))
+	if (!(cstats = lookup_cpu_stats()))
+		return;
+
+	if ((vptr = MEMBER_VPTR(*cstats, .lstats[layer->idx][idx])))
 		(*vptr) += delta;
 	else
 		scx_bpf_error("invalid layer or stat idxs: %d, %d", idx, layer->idx);
 }
 
-static void lstat_inc(enum layer_stat_idx idx, struct layer *layer,
-		      struct cpu_ctx *cctx)
+static void lstat_inc(enum layer_stat_idx idx, struct layer *layer)
 {
-	lstat_add(idx, layer, cctx, 1);
+	lstat_add(idx, layer, 1);
+}
+
+static void layer_cycles_add(u32 layer_idx, u64 cycles)
+{
+	struct cpu_stats *cstats;
+	u64 *vptr;
+
+	if (!(cstats = lookup_cpu_stats()))
+		return;
+
+	if ((vptr = MEMBER_VPTR(*cstats, .layer_cycles[layer_idx])))
+		(*vptr) += cycles;
+	else
+		scx_bpf_error("invalid layer idx %u", layer_idx);
 }
 
 struct lock_wrapper {
@@ -154,6 +284,31 @@ struct {
 	__uint(map_flags, 0);
 } layer_cpumasks SEC(".maps");
 
+/*
+ * The CPUs of each LLC, built once at init for scx_pick_idle_cpu(). There's no
+ * NUMA information here, so the search widens straight from the LLC to the
+ * candidate CPUs.
+ */
+struct llc_cpumask_wrapper {
+	struct bpf_cpumask __kptr *cpumask;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct llc_cpumask_wrapper);
+	__uint(max_entries, MAX_LLCS);
+	__uint(map_flags, 0);
+} llc_cpumasks SEC(".maps");
+
+/* Per-CPU scratch cpumasks of scx_pick_idle_cpu() */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct scx_pick_scratch);
+	__uint(max_entries, 1);
+} pick_scratch SEC(".maps");
+
 static struct cpumask *lookup_layer_cpumask(int idx)
 {
 	struct layer_cpumask_wrapper *cpumaskw;
@@ -237,6 +392,7 @@ struct task_ctx {
 	bool			all_cpus_allowed;
 	u64			runnable_at;
 	u64			running_at;
+	int			handoff_layer;	/* see task_adopt_handoff() */
 };
 
 struct {
@@ -246,6 +402,39 @@ struct {
 	__type(value, struct task_ctx);
 } task_ctxs SEC(".maps");
 
+/*
+ * With @handoff, the per-task and per-layer state is saved into these maps
+ * when the scheduler is unloaded. User space pins them so that the next
+ * instance can adopt the state in layered_init() and layered_init_task().
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, s32);
+	__type(value, struct handoff_task);
+	__uint(max_entries, MAX_TASKS);
+} handoff_tasks SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct handoff_layer);
+	__uint(max_entries, MAX_LAYERS);
+} handoff_layers SEC(".maps");
+
+/*
+ * Whether layered_init() adopted the saved state of each layer. A task's vtime
+ * is only meaningful relative to its layer's vtime_now, so it's only carried
+ * over if the layer's vtime_now was too.
+ */
+static bool layer_handoff_adopted[MAX_LAYERS];
+u64 nr_handoff_tasks, nr_handoff_layers;
+
+/*
+ * Set by user space right before detaching. layered_exit_task() also runs when
+ * a task switches to another sched class, whose state shouldn't be saved.
+ */
+volatile bool unloading;
+
 static struct task_ctx *lookup_task_ctx_may_fail(struct task_struct *p)
 {
 	return bpf_task_storage_get(&task_ctxs, p, 0, 0);
@@ -329,6 +518,14 @@ int BPF_PROG(tp_cgroup_attach_task, struct cgroup *cgrp, const char *cgrp_path,
 	return 0;
 }
 
+SEC("tp_btf/cgroup_rename")
+int BPF_PROG(tp_cgroup_rename, struct cgroup *cgrp, const char *path)
+{
+	/* the paths of the whole subtree changed, drop all cached matches */
+	__sync_fetch_and_add(&match_gen, 1);
+	return 0;
+}
+
 SEC("tp_btf/task_rename")
 int BPF_PROG(tp_task_rename, struct task_struct *p, const char *buf)
 {
@@ -361,28 +558,17 @@ static void maybe_refresh_layered_cpumask(struct cpumask *layered_cpumask,
 static s32 pick_idle_cpu_from(const struct cpumask *cand_cpumask, s32 prev_cpu,
 			      const struct cpumask *idle_smtmask)
 {
-	bool prev_in_cand = bpf_cpumask_test_cpu(prev_cpu, cand_cpumask);
-	s32 cpu;
+	const struct cpumask *llc_cpumask = NULL;
+	struct llc_cpumask_wrapper *llcw;
+	u32 llc = cpu_llc(prev_cpu), zero = 0;
 
-	/*
-	 * If CPU has SMT, any wholly idle CPU is likely a better pick than
-	 * partially idle @prev_cpu.
-	 */
-	if (smt_enabled) {
-		if (prev_in_cand &&
-		    bpf_cpumask_test_cpu(prev_cpu, idle_smtmask) &&
-		    scx_bpf_test_and_clear_cpu_idle(prev_cpu))
-			return prev_cpu;
-
-		cpu = scx_bpf_pick_idle_cpu(cand_cpumask, SCX_PICK_IDLE_CORE);
-		if (cpu >= 0)
-			return cpu;
-	}
-
-	if (prev_in_cand && scx_bpf_test_and_clear_cpu_idle(prev_cpu))
-		return prev_cpu;
+	/* with a single LLC, its mask is the same as all CPUs */
+	if (nr_llcs > 1 && (llcw = bpf_map_lookup_elem(&llc_cpumasks, &llc)))
+		llc_cpumask = (const struct cpumask *)llcw->cpumask;
 
-	return scx_bpf_pick_idle_cpu(cand_cpumask, 0);
+	return scx_pick_idle_cpu(cand_cpumask, prev_cpu, llc_cpumask, NULL,
+				 smt_enabled ? idle_smtmask : NULL,
+				 bpf_map_lookup_elem(&pick_scratch, &zero));
 }
 
 static __always_inline
@@ -425,7 +611,7 @@ s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu,
 	/* not much to do if bound to a single CPU */
 	if (p->nr_cpus_allowed == 1 && scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
 		if (!layer->open && !bpf_cpumask_test_cpu(prev_cpu, layer_cpumask))
-			lstat_inc(LSTAT_AFFN_VIOL, layer, cctx);
+			lstat_inc(LSTAT_AFFN_VIOL, layer);
 		return prev_cpu;
 	}
 
@@ -458,7 +644,7 @@ s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu,
 	if (layer->open &&
 	    ((cpu = pick_idle_cpu_from(p->cpus_ptr, prev_cpu,
 				       idle_smtmask)) >= 0)) {
-		lstat_inc(LSTAT_OPEN_IDLE, layer, cctx);
+		lstat_inc(LSTAT_OPEN_IDLE, layer);
 		goto out_put;
 	}
 
@@ -468,7 +654,8 @@ out_put:
 	return cpu;
 }
 
-s32 BPF_STRUCT_OPS(layered_select_cpu, struct task_struct *p, s32 prev_cpu, u64 wake_flags)
+static __always_inline s32
+__layered_select_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags)
 {
 	struct cpu_ctx *cctx;
 	struct task_ctx *tctx;
@@ -489,7 +676,9 @@ s32 BPF_STRUCT_OPS(layered_select_cpu, struct task_struct *p, s32 prev_cpu, u64
 	cpu = pick_idle_cpu(p, prev_cpu, cctx, tctx, layer, true);
 
 	if (cpu >= 0) {
-		lstat_inc(LSTAT_SEL_LOCAL, layer, cctx);
+		/* @p skips layered_enqueue(), take its LATHIST_RUNQ timestamp */
+		lstat_inc(LSTAT_SEL_LOCAL, layer);
+		lathist_enqueued(p);
 		scx_bpf_dispatch(p, SCX_DSQ_LOCAL, slice_ns, 0);
 		return cpu;
 	} else {
@@ -497,6 +686,18 @@ s32 BPF_STRUCT_OPS(layered_select_cpu, struct task_struct *p, s32 prev_cpu, u64
 	}
 }
 
+s32 BPF_STRUCT_OPS(layered_select_cpu, struct task_struct *p, s32 prev_cpu, u64 wake_flags)
+{
+	struct cpu_stats *cstats = cpu_stats_begin();
+	u64 started_at = lathist_start();
+	s32 cpu;
+
+	cpu = __layered_select_cpu(p, prev_cpu, wake_flags);
+	lathist_end(LATHIST_SELECT_CPU, started_at);
+	cpu_stats_end(cstats);
+	return cpu;
+}
+
 static __always_inline
 bool pick_idle_cpu_and_kick(struct task_struct *p, s32 task_cpu,
 			    struct cpu_ctx *cctx, struct task_ctx *tctx,
@@ -507,7 +708,18 @@ bool pick_idle_cpu_and_kick(struct task_struct *p, s32 task_cpu,
 	cpu = pick_idle_cpu(p, task_cpu, cctx, tctx, layer, false);
 
 	if (cpu >= 0) {
-		lstat_inc(LSTAT_KICK, layer, cctx);
+		struct cpu_ctx *cand_cctx;
+
+		/*
+		 * @p is queued on the DSQ of @task_cpu's LLC. If @cpu is in
+		 * another LLC, let it steal right away instead of going back
+		 * to idle. See layered_dispatch().
+		 */
+		if (layer_llc_split(layer) && cpu_llc(cpu) != cpu_llc(task_cpu) &&
+		    (cand_cctx = lookup_cpu_ctx(cpu)))
+			cand_cctx->xllc_kick = true;
+
+		lstat_inc(LSTAT_KICK, layer);
 		scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
 		return true;
 	} else {
@@ -516,8 +728,8 @@ bool pick_idle_cpu_and_kick(struct task_struct *p, s32 task_cpu,
 }
 
 static __always_inline
-bool try_preempt(s32 cand, struct task_struct *p, struct cpu_ctx *cctx,
-		 struct task_ctx *tctx, struct layer *layer, bool preempt_first)
+bool try_preempt(s32 cand, struct task_struct *p, struct task_ctx *tctx,
+		 struct layer *layer, bool preempt_first)
 {
 	struct cpu_ctx *cand_cctx, *sib_cctx = NULL;
 	s32 sib;
@@ -535,7 +747,7 @@ bool try_preempt(s32 cand, struct task_struct *p, struct cpu_ctx *cctx,
 	 */
 	if (layer->exclusive && (sib = sibling_cpu(cand)) >= 0 &&
 	    (!(sib_cctx = lookup_cpu_ctx(sib)) || sib_cctx->current_preempt)) {
-		lstat_inc(LSTAT_EXCL_COLLISION, layer, cctx);
+		lstat_inc(LSTAT_EXCL_COLLISION, layer);
 		return false;
 	}
 
@@ -549,21 +761,73 @@ bool try_preempt(s32 cand, struct task_struct *p, struct cpu_ctx *cctx,
 	 * optimization.
 	 */
 	if (sib_cctx && !sib_cctx->maybe_idle) {
-		lstat_inc(LSTAT_EXCL_PREEMPT, layer, cctx);
+		lstat_inc(LSTAT_EXCL_PREEMPT, layer);
 		scx_bpf_kick_cpu(sib, SCX_KICK_PREEMPT);
 	}
 
 	if (!cand_cctx->maybe_idle) {
-		lstat_inc(LSTAT_PREEMPT, layer, cctx);
+		lstat_inc(LSTAT_PREEMPT, layer);
 		if (preempt_first)
-			lstat_inc(LSTAT_PREEMPT_FIRST, layer, cctx);
+			lstat_inc(LSTAT_PREEMPT_FIRST, layer);
 	} else {
-		lstat_inc(LSTAT_PREEMPT_IDLE, layer, cctx);
+		lstat_inc(LSTAT_PREEMPT_IDLE, layer);
 	}
 	return true;
 }
 
-void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
+/*
+ * Look for a CPU to preempt among the preemptible ones, other than @task_cpu
+ * which the caller has already tried. The SMT sibling of @task_cpu is tried
+ * first as it shares all the caches. The rest are scanned starting right after
+ * @task_cpu so that CPUs which are close in the numbering, and thus usually
+ * in the same LLC, are preferred.
+ */
+static __always_inline
+bool try_preempt_preemptible(s32 task_cpu, struct task_struct *p,
+			     struct task_ctx *tctx, struct layer *layer)
+{
+	u32 nr_words = (nr_possible_cpus + 63) / 64;
+	u32 cursor = (task_cpu + 1) % nr_possible_cpus;
+	s32 sib = sibling_cpu(task_cpu);
+	u32 i, j;
+
+	if (test_cpu_preemptible(sib) && try_preempt(sib, p, tctx, layer, false))
+		return true;
+
+	/* go around one extra word to cover the bits before the cursor */
+	bpf_for(i, 0, nr_words + 1) {
+		u32 widx = (cursor / 64 + i) % nr_words;
+		u64 *wordp = MEMBER_VPTR(preemptible_cpus, [widx]);
+		u64 word;
+
+		if (!wordp)
+			break;
+		word = READ_ONCE(*wordp);
+		if (!i)
+			word &= -1LLU << (cursor % 64);
+		else if (i == nr_words)
+			word &= ~(-1LLU << (cursor % 64));
+
+		bpf_for(j, 0, 64) {
+			s32 cand;
+
+			if (!word)
+				break;
+			cand = widx * 64 + lowest_bit_u64(word);
+			word &= word - 1;
+
+			if (cand == task_cpu || cand == sib)
+				continue;
+			if (try_preempt(cand, p, tctx, layer, false))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static __always_inline void
+__layered_enqueue(struct task_struct *p, u64 enq_flags)
 {
 	struct cpu_ctx *cctx;
 	struct task_ctx *tctx;
@@ -571,7 +835,6 @@ void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
 	s32 task_cpu = scx_bpf_task_cpu(p);
 	u64 vtime = p->scx.dsq_vtime;
 	bool try_preempt_first;
-	u32 idx;
 
 	if (!(cctx = lookup_cpu_ctx(-1)) || !(tctx = lookup_task_ctx(p)) ||
 	    !(layer = lookup_layer(tctx->layer)))
@@ -581,23 +844,23 @@ void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
 	cctx->try_preempt_first = false;
 
 	if (cctx->yielding) {
-		lstat_inc(LSTAT_YIELD, layer, cctx);
+		lstat_inc(LSTAT_YIELD, layer);
 		cctx->yielding = false;
 	}
 
 	if (enq_flags & SCX_ENQ_REENQ) {
-		lstat_inc(LSTAT_ENQ_REENQ, layer, cctx);
+		lstat_inc(LSTAT_ENQ_REENQ, layer);
 	} else {
 		if (enq_flags & SCX_ENQ_LAST) {
-			lstat_inc(LSTAT_ENQ_LAST, layer, cctx);
+			lstat_inc(LSTAT_ENQ_LAST, layer);
 			scx_bpf_dispatch(p, SCX_DSQ_LOCAL, slice_ns, 0);
 			return;
 		}
 
 		if (enq_flags & SCX_ENQ_WAKEUP)
-			lstat_inc(LSTAT_ENQ_WAKEUP, layer, cctx);
+			lstat_inc(LSTAT_ENQ_WAKEUP, layer);
 		else
-			lstat_inc(LSTAT_ENQ_EXPIRE, layer, cctx);
+			lstat_inc(LSTAT_ENQ_EXPIRE, layer);
 	}
 
 	/*
@@ -620,7 +883,7 @@ void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
 		if (!layer->open &&
 		    (layer_cpumask = lookup_layer_cpumask(tctx->layer)) &&
 		    !bpf_cpumask_test_cpu(task_cpu, layer_cpumask))
-			lstat_inc(LSTAT_AFFN_VIOL, layer, cctx);
+			lstat_inc(LSTAT_AFFN_VIOL, layer);
 
 		scx_bpf_dispatch(p, HI_FALLBACK_DSQ, slice_ns, enq_flags);
 		goto find_cpu;
@@ -634,12 +897,14 @@ void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
 	 * time. Queue them to the fallback DSQ.
 	 */
 	if (!layer->open && !tctx->all_cpus_allowed) {
-		lstat_inc(LSTAT_AFFN_VIOL, layer, cctx);
+		lstat_inc(LSTAT_AFFN_VIOL, layer);
 		scx_bpf_dispatch(p, LO_FALLBACK_DSQ, slice_ns, enq_flags);
 		goto find_cpu;
 	}
 
-	scx_bpf_dispatch_vtime(p, tctx->layer, slice_ns, vtime, enq_flags);
+	scx_bpf_dispatch_vtime(p, layer_dsq_id(tctx->layer, layer_llc_split(layer) ?
+						   cpu_llc(task_cpu) : 0),
+			       slice_ns, vtime, enq_flags);
 
 find_cpu:
 	if (try_preempt_first) {
@@ -647,7 +912,7 @@ find_cpu:
 		 * @p prefers to preempt its previous CPU even when there are
 		 * other idle CPUs.
 		 */
-		if (try_preempt(task_cpu, p, cctx, tctx, layer, true))
+		if (try_preempt(task_cpu, p, tctx, layer, true))
 			return;
 		/* we skipped idle CPU picking in select_cpu. Do it here. */
 		if (pick_idle_cpu_and_kick(p, task_cpu, cctx, tctx, layer))
@@ -663,24 +928,25 @@ find_cpu:
 			return;
 		if (!layer->preempt)
 			return;
-		if (try_preempt(task_cpu, p, cctx, tctx, layer, false))
+		if (try_preempt(task_cpu, p, tctx, layer, false))
 			return;
 	}
 
-	bpf_for(idx, 0, nr_possible_cpus) {
-		s32 cand = (preempt_cursor + idx) % nr_possible_cpus;
+	if (try_preempt_preemptible(task_cpu, p, tctx, layer))
+		return;
 
-		if (try_preempt(cand, p, cctx, tctx, layer, false)) {
-			/*
-			 * Round-robining doesn't have to be strict. Let's
-			 * not bother with atomic ops on $preempt_cursor.
-			 */
-			preempt_cursor = (cand + 1) % nr_possible_cpus;
-			return;
-		}
-	}
+	lstat_inc(LSTAT_PREEMPT_FAIL, layer);
+}
+
+void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
+{
+	struct cpu_stats *cstats = cpu_stats_begin();
+	u64 started_at = lathist_start();
 
-	lstat_inc(LSTAT_PREEMPT_FAIL, layer, cctx);
+	lathist_enqueued(p);
+	__layered_enqueue(p, enq_flags);
+	lathist_end(LATHIST_ENQUEUE, started_at);
+	cpu_stats_end(cstats);
 }
 
 static bool keep_running(struct cpu_ctx *cctx, struct task_struct *p)
@@ -707,7 +973,7 @@ static bool keep_running(struct cpu_ctx *cctx, struct task_struct *p)
 	 * for too long.
 	 */
 	if (cctx->ran_current_for > max_exec_ns) {
-		lstat_inc(LSTAT_KEEP_FAIL_MAX_EXEC, layer, cctx);
+		lstat_inc(LSTAT_KEEP_FAIL_MAX_EXEC, layer);
 		goto no;
 	}
 
@@ -722,8 +988,8 @@ static bool keep_running(struct cpu_ctx *cctx, struct task_struct *p)
 		 * have tasks waiting, keep running it. If there are multiple
 		 * competing preempting layers, this won't work well.
 		 */
-		if (!scx_bpf_dsq_nr_queued(layer->idx)) {
-			lstat_inc(LSTAT_KEEP, layer, cctx);
+		if (!scx_bpf_dsq_nr_queued(layer_dsq_id(layer->idx, 0))) {
+			lstat_inc(LSTAT_KEEP, layer);
 			return true;
 		}
 	} else {
@@ -747,26 +1013,64 @@ static bool keep_running(struct cpu_ctx *cctx, struct task_struct *p)
 		scx_bpf_put_idle_cpumask(idle_cpumask);
 
 		if (has_idle) {
-			lstat_inc(LSTAT_KEEP, layer, cctx);
+			lstat_inc(LSTAT_KEEP, layer);
 			return true;
 		}
 	}
 
-	lstat_inc(LSTAT_KEEP_FAIL_BUSY, layer, cctx);
+	lstat_inc(LSTAT_KEEP_FAIL_BUSY, layer);
 no:
 	cctx->ran_current_for = 0;
 	return false;
 }
 
-void BPF_STRUCT_OPS(layered_dispatch, s32 cpu, struct task_struct *prev)
+static u64 dsq_first_runnable_for(u64 dsq_id, u64 now)
+{
+	struct task_struct *p;
+
+	/* don't bother creating an iterator for an empty DSQ */
+	if (!scx_bpf_dsq_nr_queued(dsq_id))
+		return 0;
+
+	__COMPAT_DSQ_FOR_EACH(p, dsq_id, 0) {
+		struct task_ctx *tctx;
+
+		if ((tctx = lookup_task_ctx(p)))
+			return now - tctx->runnable_at;
+	}
+
+	return 0;
+}
+
+/*
+ * Whether a CPU in another LLC may consume from @dsq_id. Tasks are left to
+ * their own LLC for xllc_steal_delay_ns. If the head of the DSQ can't be
+ * inspected, fall back to stealing right away.
+ */
+static bool xllc_steal_allowed(u64 dsq_id, u64 now)
+{
+	if (!xllc_steal_delay_ns || !bpf_ksym_exists(bpf_iter_scx_dsq_new))
+		return true;
+
+	return dsq_first_runnable_for(dsq_id, now) >= xllc_steal_delay_ns;
+}
+
+static __always_inline void
+__layered_dispatch(s32 cpu, struct task_struct *prev)
 {
 	s32 sib = sibling_cpu(cpu);
+	u32 llc = cpu_llc(cpu);
 	struct cpu_ctx *cctx, *sib_cctx;
-	int idx;
+	bool xllc_kick;
+	u64 now;
+	int idx, i;
 
 	if (!(cctx = lookup_cpu_ctx(-1)))
 		return;
 
+	xllc_kick = cctx->xllc_kick;
+	cctx->xllc_kick = false;
+
 	/*
 	 * if @prev was on SCX and is still runnable, we are here because @prev
 	 * has exhausted its slice. We may want to keep running it on this CPU
@@ -789,13 +1093,13 @@ void BPF_STRUCT_OPS(layered_dispatch, s32 cpu, struct task_struct *prev)
 	 */
 	if (sib >= 0 && (sib_cctx = lookup_cpu_ctx(sib)) &&
 	    sib_cctx->current_exclusive) {
-		gstat_inc(GSTAT_EXCL_IDLE, cctx);
+		gstat_inc(GSTAT_EXCL_IDLE);
 		return;
 	}
 
 	/* consume preempting layers first */
 	bpf_for(idx, 0, nr_layers)
-		if (layers[idx].preempt && scx_bpf_consume(idx))
+		if (layers[idx].preempt && scx_bpf_consume(layer_dsq_id(idx, 0)))
 			return;
 
 	if (scx_bpf_consume(HI_FALLBACK_DSQ))
@@ -812,121 +1116,264 @@ void BPF_STRUCT_OPS(layered_dispatch, s32 cpu, struct task_struct *prev)
 
 		if (bpf_cpumask_test_cpu(cpu, layer_cpumask) ||
 		    (cpu == fallback_cpu && layer->nr_cpus == 0)) {
-			if (scx_bpf_consume(idx))
+			if (scx_bpf_consume(layer_dsq_id(idx, layer_llc_split(layer) ?
+							       llc : 0)))
 				return;
 		}
 	}
 
-	/* consume !preempting open layers */
+	/* consume !preempting open layers, from the local LLC first */
 	bpf_for(idx, 0, nr_layers) {
-		if (!layers[idx].preempt && layers[idx].open &&
-		    scx_bpf_consume(idx))
+		struct layer *layer = &layers[idx];
+
+		if (!layer->preempt && layer->open &&
+		    scx_bpf_consume(layer_dsq_id(idx, layer_llc_split(layer) ?
+						       llc : 0)))
 			return;
 	}
 
+	/* steal from the other LLCs, nearest in numbering first */
+	now = bpf_ktime_get_ns();
+	bpf_for(idx, 0, nr_layers) {
+		struct layer *layer = &layers[idx];
+
+		if (!layer_llc_split(layer))
+			continue;
+
+		bpf_for(i, 1, nr_llcs) {
+			u64 dsq_id = layer_dsq_id(idx, (llc + i) % nr_llcs);
+
+			if (!scx_bpf_dsq_nr_queued(dsq_id))
+				continue;
+			if ((xllc_kick || xllc_steal_allowed(dsq_id, now)) &&
+			    scx_bpf_consume(dsq_id)) {
+				lstat_inc(LSTAT_XLLC_STEAL, layer);
+				return;
+			}
+		}
+	}
+
 	scx_bpf_consume(LO_FALLBACK_DSQ);
 }
 
-static bool match_one(struct layer_match *match, struct task_struct *p, const char *cgrp_path)
+void BPF_STRUCT_OPS(layered_dispatch, s32 cpu, struct task_struct *prev)
 {
-	switch (match->kind) {
-	case MATCH_CGROUP_PREFIX: {
-		return match_prefix(match->cgroup_prefix, cgrp_path, MAX_PATH);
-	}
-	case MATCH_COMM_PREFIX: {
-		char comm[MAX_COMM];
-		memcpy(comm, p->comm, MAX_COMM);
-		return match_prefix(match->comm_prefix, comm, MAX_COMM);
-	}
-	case MATCH_PCOMM_PREFIX: {
-		char pcomm[MAX_COMM];
+	struct cpu_stats *cstats = cpu_stats_begin();
+	u64 started_at = lathist_start();
+
+	__layered_dispatch(cpu, prev);
+	lathist_end(LATHIST_DISPATCH, started_at);
+	cpu_stats_end(cstats);
+}
+
+/*
+ * Compiled layer match index. Instead of evaluating every rule of every layer
+ * in order, user space compiles the layer specs into the following tables.
+ * Each OR block is a clause and the lowest clause matching a task belongs to
+ * the first matching layer.
+ *
+ * - match_index: (kind, prefix length, prefix hash) -> clauses requiring that
+ *   prefix. Only the prefix lengths set in match_prefix_lens[] are looked up,
+ *   so a string costs one pass over its first match_prefix_max_len[] chars
+ *   plus a lookup per configured prefix length.
+ * - match_no_prefix: clauses without a condition of the kind.
+ * - match_nice: clauses whose nice conditions hold for each nice value.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, struct match_key);
+	__type(value, struct match_val);
+	__uint(max_entries, MAX_MATCH_PREFIXES);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} match_index SEC(".maps");
+
+u32 match_prefix_max_len[NR_MATCH_PREFIX_KINDS];
+u64 match_prefix_lens[NR_MATCH_PREFIX_KINDS][MAX_PATH / 64];
+u64 match_no_prefix[NR_MATCH_PREFIX_KINDS][MATCH_MASK_WORDS];
+u64 match_nice[NICE_WIDTH][MATCH_MASK_WORDS];
+
+/*
+ * Cgroup prefix matches only depend on the cgroup. Their result is cached in
+ * the cgroup's local storage so that the path is formatted and matched once
+ * per cgroup rather than once per task. A cached result is valid while its
+ * @gen equals match_gen, which user space bumps whenever it (re)loads the
+ * match index and which is bumped on cgroup renames as they change the paths
+ * of the whole subtree. match_gen stays zero until the index is loaded, so
+ * freshly created entries are never mistaken for valid ones.
+ */
+struct cgrp_match_ctx {
+	u64			gen;
+	u64			clauses[MATCH_MASK_WORDS];
+};
 
-		memcpy(pcomm, p->group_leader->comm, MAX_COMM);
-		return match_prefix(match->pcomm_prefix, pcomm, MAX_COMM);
+struct {
+	__uint(type, BPF_MAP_TYPE_CGRP_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct cgrp_match_ctx);
+} cgrp_match_ctxs SEC(".maps");
+
+/*
+ * Fill @hits with the clauses which are satisfied by @str for the prefix match
+ * @kind.
+ */
+static void match_prefix_clauses(u32 kind, const char *str, u32 max_len,
+				 u64 *hits)
+{
+	struct match_key key = { .kind = kind };
+	u64 hash = MATCH_HASH_SEED;
+	u32 c, len;
+	int w;
+
+	if (kind >= NR_MATCH_PREFIX_KINDS) {
+		scx_bpf_error("invalid prefix match kind %u", kind);
+		return;
 	}
-	case MATCH_NICE_ABOVE:
-		return prio_to_nice((s32)p->static_prio) > match->nice;
-	case MATCH_NICE_BELOW:
-		return prio_to_nice((s32)p->static_prio) < match->nice;
-	case MATCH_NICE_EQUALS:
-		return prio_to_nice((s32)p->static_prio) == match->nice;
-	default:
-		scx_bpf_error("invalid match kind %d", match->kind);
-		return false;
+
+	for (w = 0; w < MATCH_MASK_WORDS; w++)
+		hits[w] = match_no_prefix[kind][w];
+
+	len = match_prefix_max_len[kind];
+	if (len > max_len)
+		len = max_len;
+
+	bpf_for(c, 0, len) {
+		struct match_val *val;
+		u32 plen = c + 1;
+
+		if (c >= max_len || str[c] == '\0')
+			break;
+		hash = (hash ^ (u8)str[c]) * MATCH_HASH_PRIME;
+
+		if (!(match_prefix_lens[kind][(plen / 64) % (MAX_PATH / 64)] &
+		      (1LLU << (plen % 64))))
+			continue;
+
+		key.len = plen;
+		key.hash = hash;
+		if (!(val = bpf_map_lookup_elem(&match_index, &key)))
+			continue;
+
+		/* don't trust the hash alone */
+		if (!match_prefix(val->prefix, str, max_len))
+			continue;
+
+		for (w = 0; w < MATCH_MASK_WORDS; w++)
+			hits[w] |= val->clauses[w];
 	}
 }
 
-static bool match_layer(struct layer *layer, struct task_struct *p, const char *cgrp_path)
+static void match_cgrp_clauses(struct task_struct *p, u64 *hits)
 {
-	u32 nr_match_ors = layer->nr_match_ors;
-	u64 or_idx, and_idx;
+	struct cgrp_match_ctx *cmctx = NULL;
+	struct cgroup *cgrp;
+	const char *cgrp_path;
+	u64 gen = match_gen;
+	int w;
 
-	if (nr_match_ors > MAX_LAYER_MATCH_ORS) {
-		scx_bpf_error("too many ORs");
-		return false;
+	/* without any cgroup prefix, there's nothing to look at */
+	if (!match_prefix_max_len[MATCH_CGROUP_PREFIX]) {
+		for (w = 0; w < MATCH_MASK_WORDS; w++)
+			hits[w] = match_no_prefix[MATCH_CGROUP_PREFIX][w];
+		return;
 	}
 
-	bpf_for(or_idx, 0, nr_match_ors) {
-		struct layer_match_ands *ands;
-		bool matched = true;
+	cgrp = bpf_cgroup_from_id(BPF_CORE_READ(p, cgroups, dfl_cgrp, kn, id));
+	if (!cgrp) {
+		/* raced against cgroup removal, nothing left to cache */
+		if ((cgrp_path = format_cgrp_path(p->cgroups->dfl_cgrp)))
+			match_prefix_clauses(MATCH_CGROUP_PREFIX, cgrp_path,
+					     MAX_PATH, hits);
+		return;
+	}
 
-		barrier_var(or_idx);
-		if (or_idx >= MAX_LAYER_MATCH_ORS)
-			return false; /* can't happen */
-		ands = &layer->matches[or_idx];
+	cmctx = bpf_cgrp_storage_get(&cgrp_match_ctxs, cgrp, 0,
+				     BPF_LOCAL_STORAGE_GET_F_CREATE);
+	if (cmctx && cmctx->gen == gen) {
+		for (w = 0; w < MATCH_MASK_WORDS; w++)
+			hits[w] = cmctx->clauses[w];
+		goto out_release;
+	}
 
-		if (ands->nr_match_ands > NR_LAYER_MATCH_KINDS) {
-			scx_bpf_error("too many ANDs");
-			return false;
-		}
+	if (!(cgrp_path = format_cgrp_path(cgrp)))
+		goto out_release;
+	match_prefix_clauses(MATCH_CGROUP_PREFIX, cgrp_path, MAX_PATH, hits);
 
-		bpf_for(and_idx, 0, ands->nr_match_ands) {
-			struct layer_match *match;
+	/*
+	 * Racing updaters store the same result. @gen was read before matching
+	 * so that a result computed before an invalidation isn't marked
+	 * current by its own updater.
+	 */
+	if (cmctx) {
+		for (w = 0; w < MATCH_MASK_WORDS; w++)
+			cmctx->clauses[w] = hits[w];
+		cmctx->gen = gen;
+	}
 
-			barrier_var(and_idx);
-			if (and_idx >= NR_LAYER_MATCH_KINDS)
-				return false; /* can't happen */
-			match = &ands->matches[and_idx];
+out_release:
+	bpf_cgroup_release(cgrp);
+}
 
-			if (!match_one(match, p, cgrp_path)) {
-				matched = false;
-				break;
-			}
-		}
+static void match_task_clauses(u32 kind, const char *str, u32 max_len,
+			       u64 *clauses)
+{
+	u64 hits[MATCH_MASK_WORDS];
+	int w;
 
-		if (matched)
-			return true;
+	match_prefix_clauses(kind, str, max_len, hits);
+	for (w = 0; w < MATCH_MASK_WORDS; w++)
+		clauses[w] &= hits[w];
+}
+
+/*
+ * Find the first layer @p matches. Returns the layer index or -1 if none
+ * matches.
+ */
+static s32 match_layer(struct task_struct *p)
+{
+	u64 clauses[MATCH_MASK_WORDS], hits[MATCH_MASK_WORDS] = {};
+	char comm[MAX_COMM];
+	s32 nice_idx;
+	int w;
+
+	nice_idx = prio_to_nice((s32)p->static_prio) + NICE_WIDTH / 2;
+	if (nice_idx < 0 || nice_idx >= NICE_WIDTH) {
+		scx_bpf_error("invalid static_prio %d", p->static_prio);
+		return -1;
 	}
 
-	return false;
+	match_cgrp_clauses(p, hits);
+	for (w = 0; w < MATCH_MASK_WORDS; w++)
+		clauses[w] = match_nice[nice_idx][w] & hits[w];
+
+	memcpy(comm, p->comm, MAX_COMM);
+	match_task_clauses(MATCH_COMM_PREFIX, comm, MAX_COMM, clauses);
+
+	memcpy(comm, p->group_leader->comm, MAX_COMM);
+	match_task_clauses(MATCH_PCOMM_PREFIX, comm, MAX_COMM, clauses);
+
+	for (w = 0; w < MATCH_MASK_WORDS; w++)
+		if (clauses[w])
+			return (w * 64 + lowest_bit_u64(clauses[w])) / MAX_LAYER_MATCH_ORS;
+
+	return -1;
 }
 
 static void maybe_refresh_layer(struct task_struct *p, struct task_ctx *tctx)
 {
-	const char *cgrp_path;
-	bool matched = false;
-	u64 idx;	// XXX - int makes verifier unhappy
+	struct layer *layer;
+	s32 idx;
 
 	if (!tctx->refresh_layer)
 		return;
 	tctx->refresh_layer = false;
 
-	if (!(cgrp_path = format_cgrp_path(p->cgroups->dfl_cgrp)))
-		return;
-
 	if (tctx->layer >= 0 && tctx->layer < nr_layers)
 		__sync_fetch_and_add(&layers[tctx->layer].nr_tasks, -1);
 
-	bpf_for(idx, 0, nr_layers) {
-		if (match_layer(&layers[idx], p, cgrp_path)) {
-			matched = true;
-			break;
-		}
-	}
-
-	if (matched) {
-		struct layer *layer = &layers[idx];
+	idx = match_layer(p);
 
+	if (idx >= 0 && idx < nr_layers && (layer = MEMBER_VPTR(layers, [idx]))) {
 		tctx->layer = idx;
 		tctx->layer_cpus_seq = layer->cpus_seq - 1;
 		__sync_fetch_and_add(&layer->nr_tasks, 1);
@@ -939,15 +1386,20 @@ static void maybe_refresh_layer(struct task_struct *p, struct task_ctx *tctx)
 		 *
 		 * Revisit if high frequency dynamic layer switching
 		 * needs to be supported.
+		 *
+		 * A vtime adopted from the previous instance is kept if the
+		 * task landed in the same layer.
 		 */
-		p->scx.dsq_vtime = layer->vtime_now;
+		if (idx != tctx->handoff_layer)
+			p->scx.dsq_vtime = layer->vtime_now;
 	} else {
 		scx_bpf_error("[%s]%d didn't match any layer", p->comm, p->pid);
 	}
 
+	tctx->handoff_layer = -1;
+
 	if (tctx->layer < nr_layers - 1)
-		trace("LAYER=%d %s[%d] cgrp=\"%s\"",
-		      tctx->layer, p->comm, p->pid, cgrp_path);
+		trace("LAYER=%d %s[%d]", tctx->layer, p->comm, p->pid);
 }
 
 void BPF_STRUCT_OPS(layered_runnable, struct task_struct *p, u64 enq_flags)
@@ -955,6 +1407,8 @@ void BPF_STRUCT_OPS(layered_runnable, struct task_struct *p, u64 enq_flags)
 	u64 now = bpf_ktime_get_ns();
 	struct task_ctx *tctx;
 
+	sched_trace_runnable(p);
+
 	if (!(tctx = lookup_task_ctx(p)))
 		return;
 
@@ -963,7 +1417,8 @@ void BPF_STRUCT_OPS(layered_runnable, struct task_struct *p, u64 enq_flags)
 	adj_load(tctx->layer, p->scx.weight, now);
 }
 
-void BPF_STRUCT_OPS(layered_running, struct task_struct *p)
+static __always_inline void
+__layered_running(struct task_struct *p)
 {
 	struct cpu_ctx *cctx;
 	struct task_ctx *tctx;
@@ -975,12 +1430,15 @@ void BPF_STRUCT_OPS(layered_running, struct task_struct *p)
 		return;
 
 	if (tctx->last_cpu >= 0 && tctx->last_cpu != task_cpu)
-		lstat_inc(LSTAT_MIGRATION, layer, cctx);
+		lstat_inc(LSTAT_MIGRATION, layer);
 	tctx->last_cpu = task_cpu;
 
 	if (vtime_before(layer->vtime_now, p->scx.dsq_vtime))
 		layer->vtime_now = p->scx.dsq_vtime;
 
+	/* stopping sets the bit back, only preempting tasks need to touch it */
+	if (layer->preempt)
+		set_cpu_preemptible(task_cpu, false);
 	cctx->current_preempt = layer->preempt;
 	cctx->current_exclusive = layer->exclusive;
 	tctx->running_at = bpf_ktime_get_ns();
@@ -1000,7 +1458,7 @@ void BPF_STRUCT_OPS(layered_running, struct task_struct *p)
 		 */
 		if (sib >= 0 && (sib_cctx = lookup_cpu_ctx(sib)) &&
 		    sib_cctx->maybe_idle) {
-			gstat_inc(GSTAT_EXCL_WAKEUP, cctx);
+			gstat_inc(GSTAT_EXCL_WAKEUP);
 			scx_bpf_kick_cpu(sib, 0);
 		}
 	}
@@ -1011,7 +1469,20 @@ void BPF_STRUCT_OPS(layered_running, struct task_struct *p)
 	cctx->maybe_idle = false;
 }
 
-void BPF_STRUCT_OPS(layered_stopping, struct task_struct *p, bool runnable)
+void BPF_STRUCT_OPS(layered_running, struct task_struct *p)
+{
+	struct cpu_stats *cstats = cpu_stats_begin();
+	u64 started_at = lathist_start();
+
+	lathist_running(p);
+	sched_trace_running(p);
+	__layered_running(p);
+	lathist_end(LATHIST_RUNNING, started_at);
+	cpu_stats_end(cstats);
+}
+
+static __always_inline void
+__layered_stopping(struct task_struct *p, bool runnable)
 {
 	struct cpu_ctx *cctx;
 	struct task_ctx *tctx;
@@ -1028,12 +1499,14 @@ void BPF_STRUCT_OPS(layered_stopping, struct task_struct *p, bool runnable)
 
 	used = bpf_ktime_get_ns() - tctx->running_at;
 	if (used < layer->min_exec_ns) {
-		lstat_inc(LSTAT_MIN_EXEC, layer, cctx);
-		lstat_add(LSTAT_MIN_EXEC_NS, layer, cctx, layer->min_exec_ns - used);
+		lstat_inc(LSTAT_MIN_EXEC, layer);
+		lstat_add(LSTAT_MIN_EXEC_NS, layer, layer->min_exec_ns - used);
 		used = layer->min_exec_ns;
 	}
 
-	cctx->layer_cycles[lidx] += used;
+	layer_cycles_add(lidx, used);
+	if (cctx->current_preempt)
+		set_cpu_preemptible(scx_bpf_task_cpu(p), true);
 	cctx->current_preempt = false;
 	cctx->prev_exclusive = cctx->current_exclusive;
 	cctx->current_exclusive = false;
@@ -1045,6 +1518,17 @@ void BPF_STRUCT_OPS(layered_stopping, struct task_struct *p, bool runnable)
 	cctx->maybe_idle = true;
 }
 
+void BPF_STRUCT_OPS(layered_stopping, struct task_struct *p, bool runnable)
+{
+	struct cpu_stats *cstats = cpu_stats_begin();
+	u64 started_at = lathist_start();
+
+	sched_trace_stopping(p, runnable);
+	__layered_stopping(p, runnable);
+	lathist_end(LATHIST_STOPPING, started_at);
+	cpu_stats_end(cstats);
+}
+
 void BPF_STRUCT_OPS(layered_quiescent, struct task_struct *p, u64 deq_flags)
 {
 	struct task_ctx *tctx;
@@ -1053,7 +1537,8 @@ void BPF_STRUCT_OPS(layered_quiescent, struct task_struct *p, u64 deq_flags)
 		adj_load(tctx->layer, -(s64)p->scx.weight, bpf_ktime_get_ns());
 }
 
-bool BPF_STRUCT_OPS(layered_yield, struct task_struct *from, struct task_struct *to)
+static __always_inline bool
+__layered_yield(struct task_struct *from, struct task_struct *to)
 {
 	struct cpu_ctx *cctx;
 	struct task_ctx *tctx;
@@ -1068,13 +1553,13 @@ bool BPF_STRUCT_OPS(layered_yield, struct task_struct *from, struct task_struct
 	 * the task is eligible for keep_running().
 	 */
 	if (!layer->yield_step_ns) {
-		lstat_inc(LSTAT_YIELD_IGNORE, layer, cctx);
+		lstat_inc(LSTAT_YIELD_IGNORE, layer);
 		return false;
 	}
 
 	if (from->scx.slice > layer->yield_step_ns) {
 		from->scx.slice -= layer->yield_step_ns;
-		lstat_inc(LSTAT_YIELD_IGNORE, layer, cctx);
+		lstat_inc(LSTAT_YIELD_IGNORE, layer);
 	} else {
 		from->scx.slice = 0;
 		cctx->yielding = true;
@@ -1083,6 +1568,16 @@ bool BPF_STRUCT_OPS(layered_yield, struct task_struct *from, struct task_struct
 	return false;
 }
 
+bool BPF_STRUCT_OPS(layered_yield, struct task_struct *from, struct task_struct *to)
+{
+	struct cpu_stats *cstats = cpu_stats_begin();
+	bool ret;
+
+	ret = __layered_yield(from, to);
+	cpu_stats_end(cstats);
+	return ret;
+}
+
 void BPF_STRUCT_OPS(layered_set_weight, struct task_struct *p, u32 weight)
 {
 	struct task_ctx *tctx;
@@ -1114,6 +1609,51 @@ void BPF_STRUCT_OPS(layered_cpu_release, s32 cpu,
 	scx_bpf_reenqueue_local();
 }
 
+static void task_save_handoff(struct task_struct *p, struct task_ctx *tctx)
+{
+	struct handoff_task ho = {
+		.start_time = p->start_time,
+		.saved_at = bpf_ktime_get_ns(),
+		.dsq_vtime = p->scx.dsq_vtime,
+		.layer = tctx->layer,
+		.version = HANDOFF_VERSION,
+	};
+	s32 pid = p->pid;
+
+	if (tctx->layer >= 0)
+		bpf_map_update_elem(&handoff_tasks, &pid, &ho, BPF_ANY);
+}
+
+/*
+ * Adopt the vtime the previous instance saved for @p, if any. The layer itself
+ * is still picked by match_layer() on the first runnable and the vtime is
+ * dropped by maybe_refresh_layer() if @p ends up in a different layer.
+ */
+static void task_adopt_handoff(struct task_struct *p, struct task_ctx *tctx)
+{
+	struct handoff_task *ho;
+	s32 pid = p->pid;
+
+	ho = bpf_map_lookup_elem(&handoff_tasks, &pid);
+	if (!ho)
+		return;
+
+	if (ho->version != HANDOFF_VERSION ||
+	    ho->start_time != p->start_time ||
+	    bpf_ktime_get_ns() - ho->saved_at > HANDOFF_MAX_AGE_NS)
+		goto out_delete;
+
+	if (ho->layer >= 0 && ho->layer < nr_layers && ho->layer < MAX_LAYERS &&
+	    layer_handoff_adopted[ho->layer]) {
+		tctx->handoff_layer = ho->layer;
+		p->scx.dsq_vtime = ho->dsq_vtime;
+		__sync_fetch_and_add(&nr_handoff_tasks, 1);
+	}
+
+out_delete:
+	bpf_map_delete_elem(&handoff_tasks, &pid);
+}
+
 s32 BPF_STRUCT_OPS(layered_init_task, struct task_struct *p,
 		   struct scx_init_task_args *args)
 {
@@ -1147,6 +1687,10 @@ s32 BPF_STRUCT_OPS(layered_init_task, struct task_struct *p,
 	tctx->last_cpu = -1;
 	tctx->layer = -1;
 	tctx->refresh_layer = true;
+	tctx->handoff_layer = -1;
+
+	if (handoff)
+		task_adopt_handoff(p, tctx);
 
 	if (all_cpumask)
 		tctx->all_cpus_allowed =
@@ -1173,24 +1717,13 @@ void BPF_STRUCT_OPS(layered_exit_task, struct task_struct *p,
 	if (!(cctx = lookup_cpu_ctx(-1)) || !(tctx = lookup_task_ctx(p)))
 		return;
 
+	if (handoff && unloading && !(p->flags & PF_EXITING))
+		task_save_handoff(p, tctx);
+
 	if (tctx->layer >= 0 && tctx->layer < nr_layers)
 		__sync_fetch_and_add(&layers[tctx->layer].nr_tasks, -1);
 }
 
-static u64 dsq_first_runnable_for_ms(u64 dsq_id, u64 now)
-{
-	struct task_struct *p;
-
-	__COMPAT_DSQ_FOR_EACH(p, dsq_id, 0) {
-		struct task_ctx *tctx;
-
-		if ((tctx = lookup_task_ctx(p)))
-			return (now - tctx->runnable_at) / 1000000;
-	}
-
-	return 0;
-}
-
 static void dump_layer_cpumask(int idx)
 {
 	struct cpumask *layer_cpumask;
@@ -1222,22 +1755,79 @@ static void dump_layer_cpumask(int idx)
 void BPF_STRUCT_OPS(layered_dump, struct scx_dump_ctx *dctx)
 {
 	u64 now = bpf_ktime_get_ns();
-	int i;
+	int i, j;
 
 	bpf_for(i, 0, nr_layers) {
+		u64 dsq_id = layer_dsq_id(i, 0);
+
 		scx_bpf_dump("LAYER[%d] nr_cpus=%u nr_queued=%d -%llums cpus=",
-			     i, layers[i].nr_cpus, scx_bpf_dsq_nr_queued(i),
-			     dsq_first_runnable_for_ms(i, now));
+			     i, layers[i].nr_cpus, scx_bpf_dsq_nr_queued(dsq_id),
+			     dsq_first_runnable_for(dsq_id, now) / 1000000);
 		dump_layer_cpumask(i);
 		scx_bpf_dump("\n");
+
+		if (!layer_llc_split(&layers[i]))
+			continue;
+
+		bpf_for(j, 1, nr_llcs) {
+			dsq_id = layer_dsq_id(i, j);
+			scx_bpf_dump("LAYER[%d] LLC[%d] nr_queued=%d -%llums\n",
+				     i, j, scx_bpf_dsq_nr_queued(dsq_id),
+				     dsq_first_runnable_for(dsq_id, now) / 1000000);
+		}
 	}
 
 	scx_bpf_dump("HI_FALLBACK nr_queued=%d -%llums\n",
 		     scx_bpf_dsq_nr_queued(HI_FALLBACK_DSQ),
-		     dsq_first_runnable_for_ms(HI_FALLBACK_DSQ, now));
+		     dsq_first_runnable_for(HI_FALLBACK_DSQ, now) / 1000000);
 	scx_bpf_dump("LO_FALLBACK nr_queued=%d -%llums\n",
 		     scx_bpf_dsq_nr_queued(LO_FALLBACK_DSQ),
-		     dsq_first_runnable_for_ms(LO_FALLBACK_DSQ, now));
+		     dsq_first_runnable_for(LO_FALLBACK_DSQ, now) / 1000000);
+}
+
+static void layer_save_handoff(u32 layer_idx, u64 now)
+{
+	struct handoff_layer *ho;
+	struct layer *layer;
+
+	if (!(ho = bpf_map_lookup_elem(&handoff_layers, &layer_idx)) ||
+	    !(layer = MEMBER_VPTR(layers, [layer_idx])))
+		return;
+
+	ho->saved_at = now;
+	ho->cfg_hash = layer_cfg_hash;
+	ho->nr_layers = nr_layers;
+	ho->version = HANDOFF_VERSION;
+	ho->vtime_now = layer->vtime_now;
+	ho->load_rd = layer->load_rd;
+}
+
+/*
+ * Called before any task is initialized. The running average of the load
+ * includes the tasks which are still runnable, which is also what they're
+ * going to be accounted as once they go through layered_runnable(). The
+ * instantaneous load itself starts from zero and is rebuilt by the tasks.
+ */
+static void layer_adopt_handoff(u32 layer_idx, u64 now)
+{
+	struct handoff_layer *ho;
+	struct layer *layer;
+
+	if (!(ho = bpf_map_lookup_elem(&handoff_layers, &layer_idx)) ||
+	    !(layer = MEMBER_VPTR(layers, [layer_idx])))
+		return;
+
+	if (!ho->saved_at || ho->version != HANDOFF_VERSION ||
+	    ho->cfg_hash != layer_cfg_hash || ho->nr_layers != nr_layers ||
+	    now - ho->saved_at > HANDOFF_MAX_AGE_NS)
+		return;
+
+	layer->vtime_now = ho->vtime_now;
+	layer->load_rd = ho->load_rd;
+	ho->saved_at = 0;
+	if (layer_idx < MAX_LAYERS)
+		layer_handoff_adopted[layer_idx] = true;
+	__sync_fetch_and_add(&nr_handoff_layers, 1);
 }
 
 s32 BPF_STRUCT_OPS_SLEEPABLE(layered_init)
@@ -1269,12 +1859,49 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(layered_init)
 		} else {
 			return -EINVAL;
 		}
+
+		/* nothing runs a preempting task yet */
+		set_cpu_preemptible(i, true);
 	}
 
 	cpumask = bpf_kptr_xchg(&all_cpumask, cpumask);
 	if (cpumask)
 		bpf_cpumask_release(cpumask);
 
+	bpf_for(i, 0, nr_llcs) {
+		struct llc_cpumask_wrapper *llcw;
+		u32 llc = i;
+
+		if (!(llcw = bpf_map_lookup_elem(&llc_cpumasks, &llc)))
+			return -ENOENT;
+
+		cpumask = bpf_cpumask_create();
+		if (!cpumask)
+			return -ENOMEM;
+
+		bpf_for(j, 0, nr_possible_cpus) {
+			const volatile u8 *u8_ptr;
+
+			if ((u8_ptr = MEMBER_VPTR(all_cpus, [j / 8])) &&
+			    (*u8_ptr & (1 << (j % 8))) && cpu_llc(j) == llc)
+				bpf_cpumask_set_cpu(j, cpumask);
+		}
+
+		cpumask = bpf_kptr_xchg(&llcw->cpumask, cpumask);
+		if (cpumask)
+			bpf_cpumask_release(cpumask);
+	}
+
+	bpf_for(i, 0, nr_possible_cpus) {
+		struct scx_pick_scratch *scratch;
+		u32 zero = 0;
+
+		if (!(scratch = bpf_map_lookup_percpu_elem(&pick_scratch, &zero, i)))
+			return -ENOENT;
+		if ((ret = scx_pick_scratch_init(scratch)))
+			return ret;
+	}
+
 	dbg("CFG: Dumping configuration, nr_online_cpus=%d smt_enabled=%d",
 	    nr_online_cpus, smt_enabled);
 
@@ -1352,10 +1979,21 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(layered_init)
 
 		layers[i].idx = i;
 
-		ret = scx_bpf_create_dsq(i, -1);
+		if (handoff)
+			layer_adopt_handoff(i, bpf_ktime_get_ns());
+
+		ret = scx_bpf_create_dsq(layer_dsq_id(i, 0), -1);
 		if (ret < 0)
 			return ret;
 
+		if (layer_llc_split(&layers[i])) {
+			bpf_for(j, 1, nr_llcs) {
+				ret = scx_bpf_create_dsq(layer_dsq_id(i, j), -1);
+				if (ret < 0)
+					return ret;
+			}
+		}
+
 		if (!(cpumaskw = bpf_map_lookup_elem(&layer_cpumasks, &i)))
 			return -ENOENT;
 
@@ -1380,6 +2018,14 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(layered_init)
 
 void BPF_STRUCT_OPS(layered_exit, struct scx_exit_info *ei)
 {
+	u64 now = bpf_ktime_get_ns();
+	u32 i;
+
+	if (handoff) {
+		bpf_for(i, 0, nr_layers)
+			layer_save_handoff(i, now);
+	}
+
 	UEI_RECORD(uei, ei);
 }
 
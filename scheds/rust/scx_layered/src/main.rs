@@ -13,9 +13,12 @@ use std::fs;
 use std::io::Read;
 use std::io::Write;
 use std::ops::Sub;
+use std::path::Path;
+use std::path::PathBuf;
 use std::sync::atomic::AtomicBool;
 use std::sync::atomic::AtomicI64;
 use std::sync::atomic::AtomicU64;
+use std::sync::atomic::fence;
 use std::sync::atomic::Ordering;
 use std::sync::Arc;
 use std::time::Duration;
@@ -26,7 +29,6 @@ use anyhow::anyhow;
 use anyhow::bail;
 use anyhow::Context;
 use anyhow::Result;
-use bitvec::prelude::*;
 use clap::Parser;
 use libbpf_rs::skel::OpenSkel;
 use libbpf_rs::skel::Skel;
@@ -40,13 +42,21 @@ use prometheus_client::metrics::family::Family;
 use prometheus_client::metrics::gauge::Gauge;
 use prometheus_client::registry::Registry;
 use scx_utils::compat;
+use scx_utils::handoff::pin_handoff_map;
+use scx_utils::Cpumask;
 use scx_utils::init_libbpf_logging;
-use scx_utils::ravg::ravg_read;
+use scx_utils::lathist::LatHist;
+use scx_utils::lathist::LATHIST_NAMES;
+use scx_utils::ravg::RavgData;
+use scx_utils::ravg::RavgReader;
+use scx_utils::sched_trace;
+use scx_utils::sched_trace::TraceWriter;
 use scx_utils::scx_ops_attach;
 use scx_utils::scx_ops_load;
 use scx_utils::scx_ops_open;
 use scx_utils::uei_exited;
 use scx_utils::uei_report;
+use scx_utils::Topology;
 use scx_utils::UserExitInfo;
 use serde::Deserialize;
 use serde::Serialize;
@@ -57,11 +67,18 @@ const MAX_PATH: usize = bpf_intf::consts_MAX_PATH as usize;
 const MAX_COMM: usize = bpf_intf::consts_MAX_COMM as usize;
 const MAX_LAYER_MATCH_ORS: usize = bpf_intf::consts_MAX_LAYER_MATCH_ORS as usize;
 const MAX_LAYERS: usize = bpf_intf::consts_MAX_LAYERS as usize;
+const MAX_LLCS: usize = bpf_intf::consts_MAX_LLCS as usize;
 const USAGE_HALF_LIFE: u32 = bpf_intf::consts_USAGE_HALF_LIFE;
 const USAGE_HALF_LIFE_F64: f64 = USAGE_HALF_LIFE as f64 / 1_000_000_000.0;
 const NR_GSTATS: usize = bpf_intf::global_stat_idx_NR_GSTATS as usize;
 const NR_LSTATS: usize = bpf_intf::layer_stat_idx_NR_LSTATS as usize;
 const NR_LAYER_MATCH_KINDS: usize = bpf_intf::layer_match_kind_NR_LAYER_MATCH_KINDS as usize;
+const MATCH_MASK_WORDS: usize = bpf_intf::consts_MATCH_MASK_WORDS as usize;
+const NR_MATCH_PREFIX_KINDS: usize = bpf_intf::consts_NR_MATCH_PREFIX_KINDS as usize;
+const NICE_WIDTH: usize = bpf_intf::consts_NICE_WIDTH as usize;
+const HANDOFF_TASKS_PIN: &str = "/sys/fs/bpf/scx_layered_handoff_tasks";
+const HANDOFF_LAYERS_PIN: &str = "/sys/fs/bpf/scx_layered_handoff_layers";
+const TOPO_CACHE_PATH: &str = "/run/scx_layered/topology";
 const CORE_CACHE_LEVEL: u32 = 2;
 
 lazy_static::lazy_static! {
@@ -299,6 +316,32 @@ struct Opts {
     #[clap(short = 'n', long)]
     no_load_frac_limit: bool,
 
+    /// Open and grouped layers are queued per LLC. A CPU only takes tasks
+    /// queued in another LLC once they have waited for this long in
+    /// microseconds, unless it was woken up to run them. 0 disables the
+    /// delay.
+    #[clap(long, default_value = "1000")]
+    xllc_steal_delay_us: u64,
+
+    /// Save the per-task and per-layer vtimes and layer load averages into
+    /// maps pinned under /sys/fs/bpf when exiting and adopt the state saved
+    /// by the previous instance when starting. Layer state is only adopted
+    /// if the layer config is identical. The saved state expires after 10
+    /// seconds.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    handoff: bool,
+
+    /// Record log2 histograms of the enqueue to running latency and of the
+    /// execution time of select_cpu, enqueue, dispatch, running and stopping
+    /// in BPF, and report their p50 and p99 at each monitoring interval.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    lathist: bool,
+
+    /// Capture the wakeup, running and stopping events of all tasks into
+    /// this file, to be replayed offline with scx_utils::sched_sim.
+    #[clap(long)]
+    trace_file: Option<PathBuf>,
+
     /// Exit debug dump buffer length. 0 indicates default.
     #[clap(long, default_value = "0")]
     exit_dump_len: u32,
@@ -486,19 +529,18 @@ fn copy_into_cstr(dst: &mut [i8], src: &str) {
     dst[0..bytes.len()].copy_from_slice(bytes);
 }
 
-fn format_bitvec(bitvec: &BitVec) -> String {
-    let mut vals = Vec::<u32>::new();
-    let mut val: u32 = 0;
-    for (idx, bit) in bitvec.iter().enumerate() {
-        if idx > 0 && idx % 32 == 0 {
-            vals.push(val);
-            val = 0;
-        }
-        if *bit {
-            val |= 1 << (idx % 32);
-        }
-    }
-    vals.push(val);
+unsafe fn any_as_u8_slice<T: Sized>(p: &T) -> &[u8] {
+    ::std::slice::from_raw_parts((p as *const T) as *const u8, ::std::mem::size_of::<T>())
+}
+
+fn format_cpumask(cpumask: &Cpumask) -> String {
+    let nr_vals = ((cpumask.len() + 31) / 32).max(1);
+    let vals: Vec<u32> = cpumask
+        .as_raw_slice()
+        .iter()
+        .flat_map(|word| [*word as u32, (*word >> 32) as u32])
+        .take(nr_vals)
+        .collect();
     let mut output = vals
         .iter()
         .fold(String::new(), |string, v| format!("{}{:08x} ", string, v));
@@ -506,42 +548,73 @@ fn format_bitvec(bitvec: &BitVec) -> String {
     output
 }
 
-fn read_cpu_ctxs(skel: &BpfSkel) -> Result<Vec<bpf_intf::cpu_ctx>> {
-    let mut cpu_ctxs = vec![];
-    let cpu_ctxs_vec = skel
-        .maps()
-        .cpu_ctxs()
-        .lookup_percpu(&0u32.to_ne_bytes(), libbpf_rs::MapFlags::ANY)
-        .context("Failed to lookup cpu_ctx")?
-        .unwrap();
-    for cpu in 0..*NR_POSSIBLE_CPUS {
-        cpu_ctxs.push(*unsafe {
-            &*(cpu_ctxs_vec[cpu].as_slice().as_ptr() as *const bpf_intf::cpu_ctx)
-        });
-    }
-    Ok(cpu_ctxs)
-}
-
 #[derive(Clone, Debug)]
 struct BpfStats {
     gstats: Vec<u64>,
     lstats: Vec<Vec<u64>>,
     lstats_sums: Vec<u64>,
+    layer_cycles: Vec<u64>,
 }
 
 impl BpfStats {
-    fn read(cpu_ctxs: &[bpf_intf::cpu_ctx], nr_layers: usize) -> Self {
+    /// Sum up the per-CPU stats directly from the memory mapped cpu_stats[]
+    /// array in .bss. Each CPU's entry is read under its seqcount, so the
+    /// counters of a CPU always come from the same point in time, and only
+    /// the rows of the configured layers are touched.
+    ///
+    /// A reader never waits on a CPU for more than MAX_RETRIES attempts. If
+    /// the CPU keeps updating its entry, the last read is used as is: the
+    /// counters only grow and are only monitored, so a slightly torn entry
+    /// is better than stalling the scheduling loop.
+    fn read(skel: &BpfSkel, nr_layers: usize) -> Self {
+        const MAX_RETRIES: usize = 16;
+
         let mut gstats = vec![0u64; NR_GSTATS];
         let mut lstats = vec![vec![0u64; NR_LSTATS]; nr_layers];
+        let mut layer_cycles = vec![0u64; nr_layers];
+
+        let mut cpu_gstats = [0u64; NR_GSTATS];
+        let mut cpu_lstats = vec![[0u64; NR_LSTATS]; nr_layers];
+        let mut cpu_layer_cycles = vec![0u64; nr_layers];
+
+        for cstats in skel.bss().cpu_stats.iter().take(*NR_POSSIBLE_CPUS) {
+            // SAFETY: The entries are concurrently updated by BPF. Read them
+            // through volatile loads and retry if the seqcount indicates
+            // that an update was in progress or raced with the read.
+            let rd = |v: &u64| unsafe { std::ptr::read_volatile(v) };
+            for retry in 0..=MAX_RETRIES {
+                let last = retry == MAX_RETRIES;
+                let seq = rd(&cstats.seq);
+                if seq & 1 != 0 && !last {
+                    std::hint::spin_loop();
+                    continue;
+                }
+                fence(Ordering::Acquire);
+
+                for stat in 0..NR_GSTATS {
+                    cpu_gstats[stat] = rd(&cstats.gstats[stat]);
+                }
+                for layer in 0..nr_layers {
+                    for stat in 0..NR_LSTATS {
+                        cpu_lstats[layer][stat] = rd(&cstats.lstats[layer][stat]);
+                    }
+                    cpu_layer_cycles[layer] = rd(&cstats.layer_cycles[layer]);
+                }
+
+                fence(Ordering::Acquire);
+                if rd(&cstats.seq) == seq || last {
+                    break;
+                }
+            }
 
-        for cpu in 0..*NR_POSSIBLE_CPUS {
             for stat in 0..NR_GSTATS {
-                gstats[stat] += cpu_ctxs[cpu].gstats[stat];
+                gstats[stat] += cpu_gstats[stat];
             }
             for layer in 0..nr_layers {
                 for stat in 0..NR_LSTATS {
-                    lstats[layer][stat] += cpu_ctxs[cpu].lstats[layer][stat];
+                    lstats[layer][stat] += cpu_lstats[layer][stat];
                 }
+                layer_cycles[layer] += cpu_layer_cycles[layer];
             }
         }
 
@@ -556,6 +629,7 @@ impl BpfStats {
             gstats,
             lstats,
             lstats_sums,
+            layer_cycles,
         }
     }
 }
@@ -574,6 +648,7 @@ impl<'a, 'b> Sub<&'b BpfStats> for &'a BpfStats {
                 .map(|(l, r)| vec_sub(l, r))
                 .collect(),
             lstats_sums: vec_sub(&self.lstats_sums, &rhs.lstats_sums),
+            layer_cycles: vec_sub(&self.layer_cycles, &rhs.layer_cycles),
         }
     }
 }
@@ -589,7 +664,6 @@ struct Stats {
 
     total_util: f64, // Running AVG of sum of layer_utils
     layer_utils: Vec<f64>,
-    prev_layer_cycles: Vec<u64>,
 
     cpu_busy: f64, // Read from /proc, maybe higher than total_util
     prev_total_cpu: procfs::CpuStat,
@@ -600,43 +674,28 @@ struct Stats {
 
 impl Stats {
     fn read_layer_loads(skel: &mut BpfSkel, nr_layers: usize) -> (f64, Vec<f64>) {
+        const READER: RavgReader = RavgReader::new(USAGE_HALF_LIFE, RAVG_FRAC_BITS);
         let now_mono = now_monotonic();
-        let layer_loads: Vec<f64> = skel
+        let rds: Vec<RavgData> = skel
             .bss()
             .layers
             .iter()
             .take(nr_layers)
-            .map(|layer| {
-                let rd = &layer.load_rd;
-                ravg_read(
-                    rd.val,
-                    rd.val_at,
-                    rd.old,
-                    rd.cur,
-                    now_mono,
-                    USAGE_HALF_LIFE,
-                    RAVG_FRAC_BITS,
-                )
+            .map(|layer| RavgData {
+                val: layer.load_rd.val,
+                val_at: layer.load_rd.val_at,
+                old: layer.load_rd.old,
+                cur: layer.load_rd.cur,
             })
             .collect();
+        let mut layer_loads = vec![0.0f64; rds.len()];
+        READER.read_batch(&rds, now_mono, &mut layer_loads);
         (layer_loads.iter().sum(), layer_loads)
     }
 
-    fn read_layer_cycles(cpu_ctxs: &[bpf_intf::cpu_ctx], nr_layers: usize) -> Vec<u64> {
-        let mut layer_cycles = vec![0u64; nr_layers];
-
-        for cpu in 0..*NR_POSSIBLE_CPUS {
-            for layer in 0..nr_layers {
-                layer_cycles[layer] += cpu_ctxs[cpu].layer_cycles[layer];
-            }
-        }
-
-        layer_cycles
-    }
-
     fn new(skel: &mut BpfSkel, proc_reader: &procfs::ProcReader) -> Result<Self> {
         let nr_layers = skel.rodata().nr_layers as usize;
-        let bpf_stats = BpfStats::read(&read_cpu_ctxs(skel)?, nr_layers);
+        let bpf_stats = BpfStats::read(skel, nr_layers);
 
         Ok(Self {
             at: Instant::now(),
@@ -649,7 +708,6 @@ impl Stats {
 
             total_util: 0.0,
             layer_utils: vec![0.0; nr_layers],
-            prev_layer_cycles: vec![0; nr_layers],
 
             cpu_busy: 0.0,
             prev_total_cpu: read_total_cpu(&proc_reader)?,
@@ -666,7 +724,6 @@ impl Stats {
         now: Instant,
     ) -> Result<()> {
         let elapsed = now.duration_since(self.at).as_secs_f64() as f64;
-        let cpu_ctxs = read_cpu_ctxs(skel)?;
 
         let nr_layer_tasks: Vec<usize> = skel
             .bss()
@@ -678,11 +735,13 @@ impl Stats {
 
         let (total_load, layer_loads) = Self::read_layer_loads(skel, self.nr_layers);
 
-        let cur_layer_cycles = Self::read_layer_cycles(&cpu_ctxs, self.nr_layers);
-        let cur_layer_utils: Vec<f64> = cur_layer_cycles
+        let cur_bpf_stats = BpfStats::read(skel, self.nr_layers);
+        let bpf_stats = &cur_bpf_stats - &self.prev_bpf_stats;
+
+        let cur_layer_utils: Vec<f64> = bpf_stats
+            .layer_cycles
             .iter()
-            .zip(self.prev_layer_cycles.iter())
-            .map(|(cur, prev)| (cur - prev) as f64 / 1_000_000_000.0 / elapsed)
+            .map(|cycles| *cycles as f64 / 1_000_000_000.0 / elapsed)
             .collect();
         let layer_utils: Vec<f64> = cur_layer_utils
             .iter()
@@ -696,9 +755,6 @@ impl Stats {
         let cur_total_cpu = read_total_cpu(proc_reader)?;
         let cpu_busy = calc_util(&cur_total_cpu, &self.prev_total_cpu)?;
 
-        let cur_bpf_stats = BpfStats::read(&cpu_ctxs, self.nr_layers);
-        let bpf_stats = &cur_bpf_stats - &self.prev_bpf_stats;
-
         *self = Self {
             at: now,
             nr_layers: self.nr_layers,
@@ -710,7 +766,6 @@ impl Stats {
 
             total_util: layer_utils.iter().sum(),
             layer_utils: layer_utils.try_into().unwrap(),
-            prev_layer_cycles: cur_layer_cycles,
 
             cpu_busy,
             prev_total_cpu: cur_total_cpu,
@@ -722,21 +777,179 @@ impl Stats {
     }
 }
 
+/// Layer matches compiled into the tables match_layer() in BPF looks up.
+///
+/// Each OR block of each layer becomes a clause numbered `layer_idx *
+/// MAX_LAYER_MATCH_ORS + or_idx` so that the lowest clause a task satisfies
+/// belongs to the first layer it matches. For each prefix match kind, a
+/// string satisfies the clauses without a condition of that kind plus the
+/// ones whose prefix is in the index. Nice conditions are resolved up front
+/// for every nice value.
+#[derive(Debug)]
+struct LayerMatchIndex {
+    prefixes: BTreeMap<(usize, String), [u64; MATCH_MASK_WORDS]>,
+    no_prefix: [[u64; MATCH_MASK_WORDS]; NR_MATCH_PREFIX_KINDS],
+    nice: [[u64; MATCH_MASK_WORDS]; NICE_WIDTH],
+}
+
+impl LayerMatchIndex {
+    fn new(specs: &[LayerSpec]) -> Self {
+        let mut index = Self {
+            prefixes: BTreeMap::new(),
+            no_prefix: [[0; MATCH_MASK_WORDS]; NR_MATCH_PREFIX_KINDS],
+            nice: [[0; MATCH_MASK_WORDS]; NICE_WIDTH],
+        };
+
+        for (layer_idx, spec) in specs.iter().enumerate() {
+            for (or_idx, ands) in spec.matches.iter().enumerate() {
+                let clause = layer_idx * MAX_LAYER_MATCH_ORS + or_idx;
+                let (word, bit) = (clause / 64, 1u64 << (clause % 64));
+
+                // Multiple prefixes of the same kind can only all match if
+                // they're prefixes of each other, in which case only the
+                // longest one needs to be tested. Otherwise, the clause can
+                // never match and is left out of the index.
+                let mut longest: [Option<&str>; NR_MATCH_PREFIX_KINDS] =
+                    [None; NR_MATCH_PREFIX_KINDS];
+                let mut satisfiable = true;
+                for one in ands.iter() {
+                    let (kind, prefix, max_len) = match one {
+                        LayerMatch::CgroupPrefix(prefix) => (
+                            bpf_intf::layer_match_kind_MATCH_CGROUP_PREFIX,
+                            prefix,
+                            MAX_PATH,
+                        ),
+                        LayerMatch::CommPrefix(prefix) => (
+                            bpf_intf::layer_match_kind_MATCH_COMM_PREFIX,
+                            prefix,
+                            MAX_COMM,
+                        ),
+                        LayerMatch::PcommPrefix(prefix) => (
+                            bpf_intf::layer_match_kind_MATCH_PCOMM_PREFIX,
+                            prefix,
+                            MAX_COMM,
+                        ),
+                        _ => continue,
+                    };
+                    let (kind, prefix) = (kind as usize, prefix.as_str());
+                    if prefix.len() >= max_len {
+                        satisfiable = false;
+                        break;
+                    }
+                    if prefix.is_empty() {
+                        continue;
+                    }
+                    longest[kind] = match longest[kind] {
+                        None => Some(prefix),
+                        Some(cur) if cur.starts_with(prefix) => Some(cur),
+                        Some(cur) if prefix.starts_with(cur) => Some(prefix),
+                        Some(_) => {
+                            satisfiable = false;
+                            break;
+                        }
+                    };
+                }
+                if !satisfiable {
+                    continue;
+                }
+
+                for (kind, prefix) in longest.iter().enumerate() {
+                    match prefix {
+                        Some(prefix) => {
+                            index
+                                .prefixes
+                                .entry((kind, prefix.to_string()))
+                                .or_insert([0; MATCH_MASK_WORDS])[word] |= bit
+                        }
+                        None => index.no_prefix[kind][word] |= bit,
+                    }
+                }
+
+                for (nice_idx, clauses) in index.nice.iter_mut().enumerate() {
+                    let nice = nice_idx as i32 - (NICE_WIDTH / 2) as i32;
+                    let matched = ands.iter().all(|one| match one {
+                        LayerMatch::NiceAbove(v) => nice > *v,
+                        LayerMatch::NiceBelow(v) => nice < *v,
+                        LayerMatch::NiceEquals(v) => nice == *v,
+                        _ => true,
+                    });
+                    if matched {
+                        clauses[word] |= bit;
+                    }
+                }
+            }
+        }
+
+        index
+    }
+
+    fn hash(prefix: &str) -> u64 {
+        prefix.bytes().fold(bpf_intf::MATCH_HASH_SEED, |hash, c| {
+            (hash ^ c as u64).wrapping_mul(bpf_intf::MATCH_HASH_PRIME)
+        })
+    }
+
+    fn init_skel(&self, skel: &mut OpenBpfSkel) {
+        let bss = skel.bss_mut();
+
+        bss.match_no_prefix = self.no_prefix;
+        bss.match_nice = self.nice;
+        for (kind, prefix) in self.prefixes.keys() {
+            let len = prefix.len();
+            bss.match_prefix_lens[*kind][len / 64] |= 1 << (len % 64);
+            bss.match_prefix_max_len[*kind] = bss.match_prefix_max_len[*kind].max(len as u32);
+        }
+    }
+
+    fn load(&self, skel: &mut BpfSkel) -> Result<()> {
+        for ((kind, prefix), clauses) in self.prefixes.iter() {
+            let key = bpf_intf::match_key {
+                kind: *kind as u32,
+                len: prefix.len() as u32,
+                hash: Self::hash(prefix),
+            };
+
+            let mut val = vec![0u8; std::mem::size_of::<bpf_intf::match_val>()];
+            let prefix_off = std::mem::size_of_val(clauses);
+            for (i, word) in clauses.iter().enumerate() {
+                val[i * 8..(i + 1) * 8].copy_from_slice(&word.to_ne_bytes());
+            }
+            val[prefix_off..prefix_off + prefix.len()].copy_from_slice(prefix.as_bytes());
+
+            skel.maps_mut()
+                .match_index()
+                .update(
+                    unsafe { any_as_u8_slice(&key) },
+                    &val,
+                    libbpf_rs::MapFlags::ANY,
+                )
+                .with_context(|| format!("Failed to add {:?} to match_index", prefix))?;
+        }
+
+        // Invalidate the per-cgroup match results cached by BPF.
+        skel.bss_mut().match_gen += 1;
+        Ok(())
+    }
+}
+
 #[derive(Debug)]
 struct CpuPool {
     nr_cores: usize,
     nr_cpus: usize,
-    all_cpus: BitVec,
-    core_cpus: Vec<BitVec>,
+    nr_llcs: usize,
+    all_cpus: Cpumask,
+    core_cpus: Vec<Cpumask>,
     sibling_cpu: Vec<i32>,
     cpu_core: Vec<usize>,
-    available_cores: BitVec,
+    cpu_llc: Vec<usize>,
+    core_llc: Vec<usize>,
+    available_cores: Cpumask,
     first_cpu: usize,
     fallback_cpu: usize, // next free or the first CPU if none is free
 }
 
 impl CpuPool {
-    fn new() -> Result<Self> {
+    fn new(topo: &Topology) -> Result<Self> {
         if *NR_POSSIBLE_CPUS > MAX_CPUS {
             bail!(
                 "NR_POSSIBLE_CPUS {} > MAX_CPUS {}",
@@ -784,15 +997,15 @@ impl CpuPool {
         }
 
         // Build core -> cpumask and cpu -> core mappings.
-        let mut all_cpus = bitvec![0; *NR_POSSIBLE_CPUS];
-        let mut core_cpus = vec![bitvec![0; *NR_POSSIBLE_CPUS]; nr_cores];
+        let mut all_cpus = Cpumask::new_with_size(*NR_POSSIBLE_CPUS);
+        let mut core_cpus = vec![Cpumask::new_with_size(*NR_POSSIBLE_CPUS); nr_cores];
         let mut cpu_core = vec![];
 
         for (cpu, cache) in cpu_to_cache.iter().enumerate().take(*NR_POSSIBLE_CPUS) {
             if let Some(cache_id) = cache {
                 let core_id = cache_to_core[cache_id];
-                all_cpus.set(cpu, true);
-                core_cpus[core_id].set(cpu, true);
+                all_cpus.set_cpu(cpu)?;
+                core_cpus[core_id].set_cpu(cpu)?;
                 cpu_core.push(core_id);
             }
         }
@@ -801,7 +1014,7 @@ impl CpuPool {
         let mut sibling_cpu = vec![-1i32; *NR_POSSIBLE_CPUS];
         for cpus in &core_cpus {
             let mut first = -1i32;
-            for cpu in cpus.iter_ones() {
+            for cpu in cpus.iter() {
                 if first < 0 {
                     first = cpu as i32;
                 } else {
@@ -812,22 +1025,44 @@ impl CpuPool {
             }
         }
 
+        // Build cpu -> LLC and core -> LLC mappings. LLC IDs are also made
+        // consecutive. Without L3 information, everything is in LLC 0.
+        let mut llc_ids = BTreeMap::<usize, usize>::new();
+        let mut cpu_llc = vec![0; *NR_POSSIBLE_CPUS];
+        for cpu in all_cpus.iter() {
+            let id = topo.cpu_llc_id(cpu).unwrap_or(0);
+            let nr_llcs = llc_ids.len();
+            cpu_llc[cpu] = *llc_ids.entry(id).or_insert(nr_llcs) % MAX_LLCS;
+        }
+        let nr_llcs = llc_ids.len().clamp(1, MAX_LLCS);
+        let core_llc = core_cpus
+            .iter()
+            .map(|cpus| cpu_llc[cpus.first_cpu().unwrap()])
+            .collect();
+
         info!(
-            "CPUs: online/possible={}/{} nr_cores={}",
-            nr_cpus, *NR_POSSIBLE_CPUS, nr_cores,
+            "CPUs: online/possible={}/{} nr_cores={} nr_llcs={}",
+            nr_cpus, *NR_POSSIBLE_CPUS, nr_cores, nr_llcs,
         );
         debug!("CPUs: siblings={:?}", &sibling_cpu[..nr_cpus]);
 
-        let first_cpu = core_cpus[0].first_one().unwrap();
+        let first_cpu = core_cpus[0].first_cpu().unwrap();
 
         let mut cpu_pool = Self {
             nr_cores,
             nr_cpus,
+            nr_llcs,
             all_cpus,
             core_cpus,
             sibling_cpu,
             cpu_core,
-            available_cores: bitvec![1; nr_cores],
+            cpu_llc,
+            core_llc,
+            available_cores: {
+                let mut cores = Cpumask::new_with_size(nr_cores);
+                cores.setall();
+                cores
+            },
             first_cpu,
             fallback_cpu: first_cpu,
         };
@@ -836,27 +1071,52 @@ impl CpuPool {
     }
 
     fn update_fallback_cpu(&mut self) {
-        match self.available_cores.first_one() {
-            Some(next) => self.fallback_cpu = self.core_cpus[next].first_one().unwrap(),
+        match self.available_cores.first_cpu() {
+            Some(next) => self.fallback_cpu = self.core_cpus[next].first_cpu().unwrap(),
             None => self.fallback_cpu = self.first_cpu,
         }
     }
 
-    fn alloc<'a>(&'a mut self) -> Option<&'a BitVec> {
-        let core = self.available_cores.first_one()?;
-        self.available_cores.set(core, false);
+    /// Allocate a core for a layer which currently owns @cpus. To keep the
+    /// layer's CPUs LLC-contiguous, the core is taken from the LLC where the
+    /// layer already has the most CPUs and, if none of those has a free
+    /// core, from the LLC with the most free cores. Ties go to the lowest
+    /// core.
+    fn alloc<'a>(&'a mut self, cpus: &Cpumask) -> Option<&'a Cpumask> {
+        let mut layer_cpus = vec![0usize; self.nr_llcs];
+        for cpu in cpus.iter() {
+            layer_cpus[self.cpu_llc[cpu]] += 1;
+        }
+        let mut free_cores = vec![0usize; self.nr_llcs];
+        for core in self.available_cores.iter() {
+            free_cores[self.core_llc[core]] += 1;
+        }
+
+        let core = self.available_cores.iter().max_by_key(|core| {
+            let llc = self.core_llc[*core];
+            (layer_cpus[llc], free_cores[llc], std::cmp::Reverse(*core))
+        })?;
+        self.available_cores.clear_cpu(core).unwrap();
         self.update_fallback_cpu();
         Some(&self.core_cpus[core])
     }
 
-    fn cpus_to_cores(&self, cpus_to_match: &BitVec) -> Result<BitVec> {
-        let mut cpus = cpus_to_match.clone();
-        let mut cores = bitvec![0; self.nr_cores];
+    fn cpus_to_cores(&self, cpus_to_match: &Cpumask) -> Result<Cpumask> {
+        let mut cores = Cpumask::new_with_size(self.nr_cores);
+        let mut next = cpus_to_match.first_cpu();
+
+        // Cores are visited in the order of their lowest CPU in
+        // @cpus_to_match. All CPUs of a visited core are skipped by checking
+        // @cores, so no scratch cpumask is needed.
+        while let Some(cpu) = next {
+            next = cpus_to_match.next_cpu(cpu + 1);
 
-        while let Some(cpu) = cpus.first_one() {
             let core = self.cpu_core[cpu];
+            if cores.test_cpu(core) {
+                continue;
+            }
 
-            if (self.core_cpus[core].clone() & !cpus.clone()).count_ones() != 0 {
+            if !self.core_cpus[core].is_subset_of(cpus_to_match) {
                 bail!(
                     "CPUs {} partially intersect with core {} ({})",
                     cpus_to_match,
@@ -865,30 +1125,43 @@ impl CpuPool {
                 );
             }
 
-            cpus &= !self.core_cpus[core].clone();
-            cores.set(core, true);
+            cores.set_cpu(core)?;
         }
 
         Ok(cores)
     }
 
-    fn free<'a>(&'a mut self, cpus_to_free: &BitVec) -> Result<()> {
+    fn free<'a>(&'a mut self, cpus_to_free: &Cpumask) -> Result<()> {
         let cores = self.cpus_to_cores(cpus_to_free)?;
-        if (self.available_cores.clone() & &cores).any() {
+        if self.available_cores.intersects(&cores) {
             bail!("Some of CPUs {} are already free", cpus_to_free);
         }
-        self.available_cores |= cores;
+        self.available_cores |= &cores;
         self.update_fallback_cpu();
         Ok(())
     }
 
-    fn next_to_free<'a>(&'a self, cands: &BitVec) -> Result<Option<&'a BitVec>> {
-        let last = match cands.last_one() {
+    /// Pick the core to free from a layer which currently owns @cands. The
+    /// mirror of alloc(): the core is taken from the LLC where the layer has
+    /// the fewest CPUs so that the layer shrinks back towards the LLCs it
+    /// mostly occupies. Ties go to the highest core.
+    fn next_to_free<'a>(&'a self, cands: &Cpumask) -> Result<Option<&'a Cpumask>> {
+        let mut layer_cpus = vec![0usize; self.nr_llcs];
+        for cpu in cands.iter() {
+            layer_cpus[self.cpu_llc[cpu]] += 1;
+        }
+
+        let core = match cands
+            .iter()
+            .map(|cpu| self.cpu_core[cpu])
+            .min_by_key(|core| {
+                let llc = self.core_llc[*core];
+                (layer_cpus[llc], std::cmp::Reverse(*core))
+            }) {
             Some(ret) => ret,
             None => return Ok(None),
         };
-        let core = self.cpu_core[last];
-        if (self.core_cpus[core].clone() & !cands.clone()).count_ones() != 0 {
+        if !self.core_cpus[core].is_subset_of(cands) {
             bail!(
                 "CPUs{} partially intersect with core {} ({})",
                 cands,
@@ -900,12 +1173,11 @@ impl CpuPool {
         Ok(Some(&self.core_cpus[core]))
     }
 
-    fn available_cpus(&self) -> BitVec {
-        let mut cpus = bitvec![0; self.nr_cpus];
-        for core in self.available_cores.iter_ones() {
-            cpus |= &self.core_cpus[core];
+    fn available_cpus(&self, cpus: &mut Cpumask) {
+        cpus.clear();
+        for core in self.available_cores.iter() {
+            *cpus |= &self.core_cpus[core];
         }
-        cpus
     }
 }
 
@@ -915,7 +1187,7 @@ struct Layer {
     kind: LayerKind,
 
     nr_cpus: usize,
-    cpus: BitVec,
+    cpus: Cpumask,
 }
 
 impl Layer {
@@ -942,14 +1214,12 @@ impl Layer {
             _ => {}
         }
 
-        let nr_cpus = cpu_pool.nr_cpus;
-
         Ok(Self {
             name: name.into(),
             kind,
 
             nr_cpus: 0,
-            cpus: bitvec![0; nr_cpus],
+            cpus: Cpumask::new_with_size(cpu_pool.all_cpus.len()),
         })
     }
 
@@ -988,8 +1258,8 @@ impl Layer {
             return Ok(false);
         }
 
-        let new_cpus = match cpu_pool.alloc().clone() {
-            Some(ret) => ret.clone(),
+        let new_cpus = match cpu_pool.alloc(&self.cpus) {
+            Some(ret) => ret,
             None => {
                 trace!("layer-{} can't grow, no CPUs", &self.name);
                 return Ok(false);
@@ -999,12 +1269,12 @@ impl Layer {
         trace!(
             "layer-{} adding {} CPUs to {} CPUs",
             &self.name,
-            new_cpus.count_ones(),
+            new_cpus.weight(),
             self.nr_cpus
         );
 
-        self.nr_cpus += new_cpus.count_ones();
-        self.cpus |= &new_cpus;
+        self.nr_cpus += new_cpus.weight();
+        self.cpus |= new_cpus;
         Ok(true)
     }
 
@@ -1016,7 +1286,7 @@ impl Layer {
         (layer_load, total_load): (f64, f64),
         (layer_util, _total_util): (f64, f64),
         no_load_frac_limit: bool,
-    ) -> Result<Option<BitVec>> {
+    ) -> Result<Option<Cpumask>> {
         if self.nr_cpus <= cpus_min {
             return Ok(None);
         }
@@ -1026,7 +1296,7 @@ impl Layer {
             None => return Ok(None),
         };
 
-        let nr_to_free = cpus_to_free.count_ones();
+        let nr_to_free = cpus_to_free.weight();
 
         // If we'd be over the load fraction even after freeing
         // $cpus_to_free, we have to free.
@@ -1078,8 +1348,8 @@ impl Layer {
         )? {
             Some(cpus_to_free) => {
                 trace!("freeing CPUs {}", &cpus_to_free);
-                self.nr_cpus -= cpus_to_free.count_ones();
-                self.cpus &= !cpus_to_free.clone();
+                self.nr_cpus -= cpus_to_free.weight();
+                self.cpus.andnot_assign(&cpus_to_free);
                 cpu_pool.free(&cpus_to_free)?;
                 Ok(true)
             }
@@ -1173,6 +1443,7 @@ struct OpenMetricsStats {
     l_yield: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
     l_yield_ignore: Family<Vec<(String, String)>, Gauge<i64, AtomicI64>>,
     l_migration: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
+    l_xllc_steal: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
     l_cur_nr_cpus: Family<Vec<(String, String)>, Gauge<i64, AtomicI64>>,
     l_min_nr_cpus: Family<Vec<(String, String)>, Gauge<i64, AtomicI64>>,
     l_max_nr_cpus: Family<Vec<(String, String)>, Gauge<i64, AtomicI64>>,
@@ -1313,6 +1584,10 @@ impl OpenMetricsStats {
         register!(l_yield, "% of scheduling events that yielded");
         register!(l_yield_ignore, "Number of times yield was ignored");
 	register!(l_migration, "% of scheduling events that migrated across CPUs");
+        register!(
+            l_xllc_steal,
+            "% of scheduling events that were dispatched from another LLC's queue"
+        );
         register!(l_cur_nr_cpus, "Current # of CPUs assigned to the layer");
         register!(l_min_nr_cpus, "Minimum # of CPUs assigned to the layer");
         register!(l_max_nr_cpus, "Maximum # of CPUs assigned to the layer");
@@ -1331,6 +1606,7 @@ struct Scheduler<'a, 'b> {
 
     cpu_pool: CpuPool,
     layers: Vec<Layer>,
+    available_cpus: Cpumask, // scratch for refresh_cpumasks()
 
     proc_reader: procfs::ProcReader,
     sched_stats: Stats,
@@ -1339,6 +1615,8 @@ struct Scheduler<'a, 'b> {
     nr_layer_cpus_min_max: Vec<(usize, usize)>,
     processing_dur: Duration,
     prev_processing_dur: Duration,
+    prev_lathists: Option<Vec<LatHist>>,
+    trace: Option<TraceWriter<'a>>,
 
     om_stats: OpenMetricsStats,
     om_format: bool,
@@ -1447,9 +1725,9 @@ impl<'a, 'b> Scheduler<'a, 'b> {
         Ok(())
     }
 
-    fn init(opts: &Opts, layer_specs: &'b Vec<LayerSpec>) -> Result<Self> {
+    fn init(opts: &Opts, layer_specs: &'b Vec<LayerSpec>, topo: &Topology) -> Result<Self> {
         let nr_layers = layer_specs.len();
-        let mut cpu_pool = CpuPool::new()?;
+        let mut cpu_pool = CpuPool::new(topo)?;
 
         // Open the BPF prog first for verification.
         let mut skel_builder = BpfSkelBuilder::default();
@@ -1483,12 +1761,43 @@ impl<'a, 'b> Scheduler<'a, 'b> {
         for (cpu, sib) in cpu_pool.sibling_cpu.iter().enumerate() {
             skel.rodata_mut().__sibling_cpu[cpu] = *sib;
         }
-        for cpu in cpu_pool.all_cpus.iter_ones() {
-            skel.rodata_mut().all_cpus[cpu / 8] |= 1 << (cpu % 8);
+        skel.rodata_mut().nr_llcs = cpu_pool.nr_llcs as u32;
+        for (cpu, llc) in cpu_pool.cpu_llc.iter().enumerate() {
+            skel.rodata_mut().cpu_llc_id[cpu] = *llc as u32;
+        }
+        skel.rodata_mut().xllc_steal_delay_ns = opts.xllc_steal_delay_us * 1000;
+        skel.rodata_mut().handoff = opts.handoff;
+        skel.rodata_mut().lathist_enabled = opts.lathist;
+        skel.rodata_mut().sched_trace_enabled = opts.trace_file.is_some();
+        sched_trace::size_trace_ring(skel.maps_mut().sched_trace_rb(), opts.trace_file.is_some())?;
+        if opts.handoff {
+            skel.rodata_mut().layer_cfg_hash =
+                LayerMatchIndex::hash(&serde_json::to_string(layer_specs)?);
+            let mut maps = skel.maps_mut();
+            pin_handoff_map(
+                maps.handoff_tasks(),
+                HANDOFF_TASKS_PIN,
+                std::mem::size_of::<bpf_intf::handoff_task>(),
+            )?;
+            pin_handoff_map(
+                maps.handoff_layers(),
+                HANDOFF_LAYERS_PIN,
+                std::mem::size_of::<bpf_intf::handoff_layer>(),
+            )?;
         }
+        cpu_pool
+            .all_cpus
+            .write_to_u8_slice(&mut skel.rodata_mut().all_cpus);
         Self::init_layers(&mut skel, opts, layer_specs)?;
+        let match_index = LayerMatchIndex::new(layer_specs);
+        match_index.init_skel(&mut skel);
 
         let mut skel = scx_ops_load!(skel, layered, uei)?;
+        match_index.load(&mut skel)?;
+        let trace = match opts.trace_file.as_ref() {
+            Some(path) => Some(TraceWriter::new(skel.maps().sched_trace_rb(), path)?),
+            None => None,
+        };
 
         let mut layers = vec![];
         for spec in layer_specs.iter() {
@@ -1506,6 +1815,7 @@ impl<'a, 'b> Scheduler<'a, 'b> {
             monitor_intv: Duration::from_secs_f64(opts.monitor),
             no_load_frac_limit: opts.no_load_frac_limit,
 
+            available_cpus: Cpumask::new_with_size(cpu_pool.all_cpus.len()),
             cpu_pool,
             layers,
 
@@ -1515,6 +1825,11 @@ impl<'a, 'b> Scheduler<'a, 'b> {
             nr_layer_cpus_min_max: vec![(0, 0); nr_layers],
             processing_dur: Duration::from_millis(0),
             prev_processing_dur: Duration::from_millis(0),
+            prev_lathists: match opts.lathist {
+                true => Some(vec![LatHist::default(); LATHIST_NAMES.len()]),
+                false => None,
+            },
+            trace,
 
             proc_reader,
             skel,
@@ -1532,18 +1847,19 @@ impl<'a, 'b> Scheduler<'a, 'b> {
         // Attach.
         sched.struct_ops = Some(scx_ops_attach!(sched.skel, layered)?);
         info!("Layered Scheduler Attached");
+        if opts.handoff {
+            info!(
+                "handoff: adopted tasks={} layers={}",
+                sched.skel.bss().nr_handoff_tasks,
+                sched.skel.bss().nr_handoff_layers
+            );
+        }
 
         Ok(sched)
     }
 
     fn update_bpf_layer_cpumask(layer: &Layer, bpf_layer: &mut bpf_types::layer) {
-        for bit in 0..layer.cpus.len() {
-            if layer.cpus[bit] {
-                bpf_layer.cpus[bit / 8] |= 1 << (bit % 8);
-            } else {
-                bpf_layer.cpus[bit / 8] &= !(1 << (bit % 8));
-            }
-        }
+        layer.cpus.write_to_u8_slice(&mut bpf_layer.cpus);
         bpf_layer.refresh_cpus = 1;
     }
 
@@ -1591,14 +1907,15 @@ impl<'a, 'b> Scheduler<'a, 'b> {
         }
 
         if updated {
-            let available_cpus = self.cpu_pool.available_cpus();
-            let nr_available_cpus = available_cpus.count_ones();
+            let available_cpus = &mut self.available_cpus;
+            self.cpu_pool.available_cpus(available_cpus);
+            let nr_available_cpus = available_cpus.weight();
             for idx in 0..self.layers.len() {
                 let layer = &mut self.layers[idx];
                 let bpf_layer = &mut self.skel.bss_mut().layers[idx];
                 match &layer.kind {
                     LayerKind::Open { .. } => {
-                        layer.cpus.copy_from_bitslice(&available_cpus);
+                        layer.cpus.copy_from(available_cpus);
                         layer.nr_cpus = nr_available_cpus;
                         Self::update_bpf_layer_cpumask(layer, bpf_layer);
                     }
@@ -1853,6 +2170,10 @@ impl<'a, 'b> Scheduler<'a, 'b> {
                 l_migration,
                 lstat_pct(bpf_intf::layer_stat_idx_LSTAT_MIGRATION)
             );
+            let l_xllc_steal = set!(
+                l_xllc_steal,
+                lstat_pct(bpf_intf::layer_stat_idx_LSTAT_XLLC_STEAL)
+            );
             let l_cur_nr_cpus = set!(l_cur_nr_cpus, layer.nr_cpus as i64);
             let l_min_nr_cpus = set!(l_min_nr_cpus, self.nr_layer_cpus_min_max[lidx].0 as i64);
             let l_max_nr_cpus = set!(l_max_nr_cpus, self.nr_layer_cpus_min_max[lidx].1 as i64);
@@ -1890,10 +2211,11 @@ impl<'a, 'b> Scheduler<'a, 'b> {
                     width = header_width,
                 );
                 info!(
-                    "  {:<width$}  open_idle={} mig={} affn_viol={}",
+                    "  {:<width$}  open_idle={} mig={} xllc={} affn_viol={}",
                     "",
                     fmt_pct(l_open_idle.get()),
                     fmt_pct(l_migration.get()),
+                    fmt_pct(l_xllc_steal.get()),
                     fmt_pct(l_affn_viol.get()),
                     width = header_width,
                 );
@@ -1914,7 +2236,7 @@ impl<'a, 'b> Scheduler<'a, 'b> {
                     l_cur_nr_cpus.get(),
                     l_min_nr_cpus.get(),
                     l_max_nr_cpus.get(),
-                    format_bitvec(&layer.cpus),
+                    format_cpumask(&layer.cpus),
                     width = header_width
                 );
                 match &layer.kind {
@@ -1943,6 +2265,16 @@ impl<'a, 'b> Scheduler<'a, 'b> {
             self.nr_layer_cpus_min_max[lidx] = (layer.nr_cpus, layer.nr_cpus);
         }
 
+        self.report_lathists();
+
+        if let Some(trace) = self.trace.as_ref() {
+            info!(
+                "trace: events={} dropped={}",
+                trace.nr_events(),
+                self.skel.bss().sched_trace_nr_dropped,
+            );
+        }
+
         if self.om_format {
             let mut buffer = String::new();
             encode(&mut buffer, &self.om_stats.registry).unwrap();
@@ -1952,6 +2284,35 @@ impl<'a, 'b> Scheduler<'a, 'b> {
         Ok(())
     }
 
+    fn report_lathists(&mut self) {
+        let prev_lathists = match self.prev_lathists.as_mut() {
+            Some(prev) => prev,
+            None => return,
+        };
+        let lathists = match LatHist::read_all(self.skel.maps().lathists()) {
+            Ok(lathists) => lathists,
+            Err(e) => {
+                warn!("Failed to read latency histograms: {:?}", e);
+                return;
+            }
+        };
+
+        for (i, (cur, prev)) in lathists.iter().zip(prev_lathists.iter()).enumerate() {
+            let hist = cur.delta(prev);
+            if hist.count() > 0 {
+                info!(
+                    "lat_{}: cnt={} avg={:.0}ns p50<{}ns p99<{}ns",
+                    LATHIST_NAMES[i],
+                    hist.count(),
+                    hist.mean(),
+                    hist.percentile(50.0),
+                    hist.percentile(99.0),
+                );
+            }
+        }
+        *prev_lathists = lathists;
+    }
+
     fn run(&mut self, shutdown: Arc<AtomicBool>) -> Result<UserExitInfo> {
         let now = Instant::now();
         let mut next_sched_at = now + self.sched_intv;
@@ -1974,6 +2335,10 @@ impl<'a, 'b> Scheduler<'a, 'b> {
                 }
             }
 
+            if let Some(trace) = self.trace.as_mut() {
+                trace.consume()?;
+            }
+
             std::thread::sleep(
                 next_sched_at
                     .min(next_monitor_at)
@@ -1981,7 +2346,12 @@ impl<'a, 'b> Scheduler<'a, 'b> {
             );
         }
 
+        // only save the handoff state of the tasks left behind by the unload
+        self.skel.bss_mut().unloading = true;
         self.struct_ops.take();
+        if let Some(trace) = self.trace.as_mut() {
+            trace.consume()?;
+        }
         uei_report!(&self.skel, uei)
     }
 }
@@ -2197,8 +2567,12 @@ fn main() -> Result<()> {
     })
     .context("Error setting Ctrl-C handler")?;
 
+    // The scheduler is restarted on CPU hotplug. Keep the Topology across
+    // restarts and only re-read the CPUs whose online state changed.
+    let mut topo = Topology::with_cache(Path::new(TOPO_CACHE_PATH))?;
     loop {
-        let mut sched = Scheduler::init(&opts, &layer_config.specs)?;
+        topo.update_online()?;
+        let mut sched = Scheduler::init(&opts, &layer_config.specs, &topo)?;
         if !sched.run(shutdown.clone())?.should_restart() {
             break;
         }
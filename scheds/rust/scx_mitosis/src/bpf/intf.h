@@ -18,7 +18,12 @@ enum consts {
 	MAX_CPUS = 1 << MAX_CPUS_SHIFT,
 	MAX_CPUS_U8 = MAX_CPUS / 8,
 	MAX_CELLS = 16,
+	MAX_LLCS_SHIFT = 6,
+	MAX_LLCS = 1 << MAX_LLCS_SHIFT,
 	USAGE_HALF_LIFE = 100000000, /* 100ms */
+
+	MAX_DIRTY_CGRPS = 8192,
+	LOAD_EXPORT_BATCH = 256,
 };
 
 /* Statistics */
@@ -42,6 +47,16 @@ struct cgrp_ctx {
 	struct ravg_data pinned_load_rd;
 	u64 pinned_load;
 	u32 cell;
+	/* queued on dirty_cgrps, waiting to be exported to userspace */
+	u32 dirty;
+};
+
+/* Record of a cgroup's load exported through the cgrp_load_recs ringbuf */
+struct cgrp_load_rec {
+	u64 cgid;
+	struct ravg_data load_rd;
+	struct ravg_data pinned_load_rd;
+	u32 exited;
 };
 
 #endif /* __INTF_H */
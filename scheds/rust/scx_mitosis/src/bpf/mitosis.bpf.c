@@ -8,8 +8,16 @@
  * of cells is dynamic, as is cgroup to cell assignment and cell to CPU
  * assignment (all are determined by userspace).
  *
- * Each cell has an associated DSQ which it uses for vtime scheduling of the
- * cgroups belonging to the cell.
+ * Each cell has an associated DSQ per LLC which it uses for vtime scheduling
+ * of the cgroups belonging to the cell. Userspace packs cells into as few
+ * cores and LLCs as possible, so most cells only use a single DSQ. A CPU
+ * first consumes from its own LLC's DSQ and only then from the DSQs of the
+ * other LLCs the cell spans.
+ *
+ * The load of each cgroup is tracked in its cgrp_ctx. Cgroups whose load
+ * changed are queued on dirty_cgrps and their load is exported to userspace
+ * through the cgrp_load_recs ringbuf once every load_export_interval_ns, so
+ * userspace never has to walk the whole cgroup hierarchy.
  */
 #include "intf.h"
 #include <scx/common.bpf.h>
@@ -26,6 +34,10 @@ const volatile u64 slice_ns = SCX_SLICE_DFL;
 const volatile u32 nr_possible_cpus = 1;
 const volatile bool smt_enabled = true;
 const volatile unsigned char all_cpus[MAX_CPUS_U8];
+const volatile u64 load_export_interval_ns = 1000000000; /* 1s */
+const volatile u32 nr_llcs = 1;
+const volatile u32 cpu_llc[MAX_CPUS];
+const volatile s32 llc_node[MAX_LLCS];
 
 /*
 * user_global_seq is bumped by userspace to indicate that a new configuration
@@ -34,6 +46,14 @@ const volatile unsigned char all_cpus[MAX_CPUS_U8];
 volatile u32 user_global_seq;
 /* BPF-logic uses this to keep track of the last configuration completed */
 u32 global_seq;
+/* the last global_seq which changed the cgroup -> cell assignment */
+u32 assign_seq;
+
+/*
+ * Set when a cgroup's load couldn't be exported. Userspace then reads the
+ * load of all cgroups and clears it.
+ */
+volatile bool load_export_overflow;
 
 private(all_cpumask) struct bpf_cpumask __kptr *all_cpumask;
 
@@ -107,6 +127,21 @@ static inline struct cgrp_ctx *lookup_cgrp_ctx_fallible(struct cgroup *cgrp)
 	return bpf_cgrp_storage_get(&cgrp_ctx, cgrp, 0, BPF_LOCAL_STORAGE_GET_F_CREATE);
 }
 
+/* IDs of the cgroups whose load changed since it was last exported */
+struct {
+	__uint(type, BPF_MAP_TYPE_QUEUE);
+	__uint(max_entries, MAX_DIRTY_CGRPS);
+	__type(value, u64);
+} dirty_cgrps SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 1 << 20);
+} cgrp_load_recs SEC(".maps");
+
+static u64 last_load_export_at;
+static bool load_exporting;
+
 /* Map from cgrp -> cell populated by userspace for reconfiguration */
 struct {
 	__uint(type, BPF_MAP_TYPE_CGRP_STORAGE);
@@ -129,6 +164,8 @@ struct task_ctx {
 	u64 started_running_at;
 	u32 cell;
 	u32 global_seq;
+	/* cpus_seq of the cell when the task's cpumask was last updated */
+	u32 cpus_seq;
 	bool all_cpus_allowed;
 };
 
@@ -178,7 +215,13 @@ static inline struct cpu_ctx *lookup_cpu_ctx(int cpu)
 
 struct cell {
 	u64 vtime_now;
+	/* the DSQ of the cell's first LLC, see cell_dsq() */
 	u32 dsq;
+	/* bumped whenever the cell's cpumask changes */
+	u32 cpus_seq;
+	/* the LLCs the cell's CPUs are in and the first one of them */
+	u64 llc_mask;
+	u32 first_llc;
 	// The following field is populated from userspace to indicate
 	// which cpus the cell should belong to.
 	unsigned char cpus[MAX_CPUS_U8];
@@ -198,6 +241,43 @@ static inline struct cell *lookup_cell(int idx)
 	return cell;
 }
 
+static inline u32 cpu_to_llc(s32 cpu)
+{
+	const volatile u32 *llc;
+
+	if (nr_llcs <= 1 || !(llc = MEMBER_VPTR(cpu_llc, [cpu])))
+		return 0;
+	return *llc;
+}
+
+static inline s32 llc_to_node(u32 llc)
+{
+	const volatile s32 *node;
+
+	if (!(node = MEMBER_VPTR(llc_node, [llc])))
+		return -1;
+	return *node;
+}
+
+static inline u64 cell_dsq(u32 cell_idx, u32 llc)
+{
+	return ((u64)cell_idx << MAX_LLCS_SHIFT) | llc;
+}
+
+/*
+ * The LLC whose DSQ a task of @cell which is going to run on @cpu should be
+ * queued on. If @cpu isn't in any of the cell's LLCs, e.g. because the task's
+ * affinity doesn't overlap with the cell, use the cell's first LLC.
+ */
+static inline u32 cell_llc_for_cpu(struct cell *cell, s32 cpu)
+{
+	u32 llc = cpu_to_llc(cpu);
+
+	if (cell->llc_mask & (1LLU << llc))
+		return llc;
+	return cell->first_llc;
+}
+
 /*
  * Store the cpumask for each cell (owned by BPF logic)
  */
@@ -228,6 +308,32 @@ static inline const struct cpumask *lookup_cell_cpumask(int idx)
 	return (const struct cpumask *)cpumaskw->cpumask;
 }
 
+/*
+ * The CPUs of each LLC and of the NUMA node the LLC is in, built once at init
+ * for scx_pick_idle_cpu(). node_cpumask is left NULL if the LLC is the only
+ * one in its node.
+ */
+struct llc_cpumask_wrapper {
+	struct bpf_cpumask __kptr *llc_cpumask;
+	struct bpf_cpumask __kptr *node_cpumask;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct llc_cpumask_wrapper);
+	__uint(max_entries, MAX_LLCS);
+	__uint(map_flags, 0);
+} llc_cpumasks SEC(".maps");
+
+/* Per-CPU scratch cpumasks of scx_pick_idle_cpu() */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct scx_pick_scratch);
+	__uint(max_entries, 1);
+} pick_scratch SEC(".maps");
+
 /*
 * Along with a user_global_seq bump, indicates that cgroup->cell assignment
 * changed
@@ -235,6 +341,58 @@ static inline const struct cpumask *lookup_cell_cpumask(int idx)
 volatile bool update_cell_assignment;
 bool draining;
 
+/*
+ * Export the load of the dirty cgroups once every load_export_interval_ns,
+ * LOAD_EXPORT_BATCH cgroups per tick.
+ */
+static void export_cgrp_loads(void)
+{
+	u64 now = bpf_ktime_get_ns();
+	u32 i;
+
+	if (!load_exporting) {
+		if (now - last_load_export_at < load_export_interval_ns)
+			return;
+		last_load_export_at = now;
+		load_exporting = true;
+	}
+
+	bpf_for(i, 0, LOAD_EXPORT_BATCH) {
+		struct cgrp_load_rec rec = {};
+		struct cgrp_lock_wrapper *lockw;
+		struct cgrp_ctx *cgc;
+		struct cgroup *cgrp;
+
+		if (bpf_map_pop_elem(&dirty_cgrps, &rec.cgid)) {
+			load_exporting = false;
+			return;
+		}
+
+		/* the cgroup may be gone already */
+		if (!(cgrp = bpf_cgroup_from_id(rec.cgid)))
+			continue;
+
+		if (!(cgc = bpf_cgrp_storage_get(&cgrp_ctx, cgrp, 0, 0)) ||
+		    !(lockw = bpf_cgrp_storage_get(&cgrp_locks, cgrp, 0, 0))) {
+			bpf_cgroup_release(cgrp);
+			continue;
+		}
+
+		/* clear before reading so that a racing change requeues it */
+		cgc->dirty = 0;
+		barrier();
+
+		bpf_spin_lock(&lockw->lock);
+		rec.load_rd = cgc->load_rd;
+		rec.pinned_load_rd = cgc->pinned_load_rd;
+		bpf_spin_unlock(&lockw->lock);
+		bpf_cgroup_release(cgrp);
+
+		if (bpf_ringbuf_output(&cgrp_load_recs, &rec, sizeof(rec), 0))
+			load_export_overflow = true;
+	}
+}
+
 /*
  * This is the main driver for reconfiguration. It only runs on CPU 0
  */
@@ -268,6 +426,8 @@ int BPF_PROG(sched_tick_fentry)
 		draining = false;
 	}
 
+	export_cgrp_loads();
+
 	if (global_seq == user_global_seq)
 		return 0;
 
@@ -277,6 +437,14 @@ int BPF_PROG(sched_tick_fentry)
 	   userspace says */
 	bpf_for(cell_idx, 0, MAX_CELLS)
 	{
+		struct bpf_cpumask *cur_cpumask;
+		struct cell *cell;
+		u64 llc_mask = 0;
+		bool changed;
+
+		if (!(cell = lookup_cell(cell_idx)))
+			return 0;
+
 		if (!(cell_cpumaskw =
 			      bpf_map_lookup_elem(&cell_cpumasks, &cell_idx))) {
 			scx_bpf_error("Failed to find cell cpumask");
@@ -298,6 +466,7 @@ int BPF_PROG(sched_tick_fentry)
 				     cells, [cell_idx].cpus[cpu_idx / 8]))) {
 				if (*u8_ptr & (1 << (cpu_idx % 8))) {
 					bpf_cpumask_set_cpu(cpu_idx, cpumask);
+					llc_mask |= 1LLU << cpu_to_llc(cpu_idx);
 					if (!(cpu_ctx = lookup_cpu_ctx(
 						      cpu_idx))) {
 						bpf_cpumask_release(cpumask);
@@ -308,11 +477,34 @@ int BPF_PROG(sched_tick_fentry)
 				}
 			}
 		}
+		/*
+		 * Only the tasks in cells whose cpumask changed need to update
+		 * their cpumasks, see maybe_update_task_cell(). Bump cpus_seq
+		 * after installing the new cpumask.
+		 */
+		cur_cpumask = cell_cpumaskw->cpumask;
+		changed = !cur_cpumask ||
+			  !bpf_cpumask_equal((const struct cpumask *)cur_cpumask,
+					     (const struct cpumask *)cpumask);
+
 		cpumask = bpf_kptr_xchg(&cell_cpumaskw->cpumask, cpumask);
 		if (!cpumask) {
 			scx_bpf_error("cpumask should never be null");
 			return 0;
 		}
+		if (changed) {
+			u32 llc;
+
+			cell->llc_mask = llc_mask;
+			cell->first_llc = 0;
+			bpf_for(llc, 0, nr_llcs) {
+				if (llc_mask & (1LLU << llc)) {
+					cell->first_llc = llc;
+					break;
+				}
+			}
+			cell->cpus_seq++;
+		}
 		cpumask = bpf_kptr_xchg(&cell_cpumaskw->tmp_cpumask, cpumask);
 		/* We just xchg'd NULL into it, so tmp_cpumask should be NULL */
 		if (cpumask) {
@@ -407,6 +599,7 @@ int BPF_PROG(sched_tick_fentry)
 		bpf_rcu_read_unlock();
 		bpf_cgroup_release(root_cgrp);
 		update_cell_assignment = false;
+		assign_seq = global_seq + 1;
 	}
 
 	barrier();
@@ -431,6 +624,20 @@ static void cstat_inc(enum cell_stat_idx idx, u32 cell, struct cpu_ctx *cctx)
 	cstat_add(idx, cell, cctx, 1);
 }
 
+static void mark_cgrp_dirty(struct cgroup *cgrp, struct cgrp_ctx *cgc)
+{
+	u64 cgid;
+
+	if (cgc->dirty || __sync_val_compare_and_swap(&cgc->dirty, 0, 1))
+		return;
+
+	cgid = cgrp->kn->id;
+	if (bpf_map_push_elem(&dirty_cgrps, &cgid, 0)) {
+		cgc->dirty = 0;
+		load_export_overflow = true;
+	}
+}
+
 static inline void adj_load(struct task_struct *p, struct task_ctx *tctx,
 			    struct cgroup *cgrp, s64 adj, u64 now)
 {
@@ -453,6 +660,8 @@ static inline void adj_load(struct task_struct *p, struct task_ctx *tctx,
 	}
 	bpf_spin_unlock(&lockw->lock);
 
+	mark_cgrp_dirty(cgrp, cgc);
+
 	if (debug && adj < 0 && (s64)cgc->load < 0) {
 		char comm[16];
 		if (bpf_probe_read_kernel_str(comm, 16, p->comm) >= 0)
@@ -466,6 +675,14 @@ static inline void adj_load(struct task_struct *p, struct task_ctx *tctx,
 static inline int update_task_cpumask(struct task_struct *p, struct task_ctx *tctx)
 {
 	const struct cpumask *cell_cpumask;
+	struct cell *cell;
+
+	if (!(cell = lookup_cell(tctx->cell)))
+		return -ENOENT;
+
+	/* read cpus_seq before the cpumask, see sched_tick_fentry() */
+	tctx->cpus_seq = cell->cpus_seq;
+	barrier();
 
 	if (!(cell_cpumask = lookup_cell_cpumask(tctx->cell)))
 		return -ENOENT;
@@ -485,6 +702,7 @@ static inline int update_task_cell(struct task_struct *p, struct task_ctx *tctx,
 {
 	struct cell *cell;
 	struct cgrp_ctx *cgc;
+	u32 prev_cell = tctx->cell;
 
 	if (!(cgc = lookup_cgrp_ctx(cg)))
 		return -ENOENT;
@@ -513,36 +731,67 @@ static inline int update_task_cell(struct task_struct *p, struct task_ctx *tctx,
 	 * Revisit if high frequency dynamic cell switching
 	 * needs to be supported.
 	 */
-	p->scx.dsq_vtime = cell->vtime_now;
+	if (tctx->cell != prev_cell)
+		p->scx.dsq_vtime = cell->vtime_now;
 
 	return update_task_cpumask(p, tctx);
 }
 
-static s32 pick_idle_cpu_from(const struct cpumask *cand_cpumask, s32 prev_cpu,
-			      const struct cpumask *idle_smtmask)
+/*
+ * Bring the task's cell and cpumask up to date with the latest configuration.
+ * Most configuration changes only move CPUs between some of the cells, so
+ * only look up the task's cgroup if the cgroup -> cell assignment changed since
+ * the task last looked, and otherwise only update its cpumask if that of its
+ * cell changed.
+ */
+static inline int maybe_update_task_cell(struct task_struct *p,
+					 struct task_ctx *tctx)
 {
-	bool prev_in_cand = bpf_cpumask_test_cpu(prev_cpu, cand_cpumask);
-	s32 cpu;
+	struct cgroup *cgrp;
+	struct cell *cell;
+	u32 seq;
+	int ret;
 
-	/*
-	 * If CPU has SMT, any wholly idle CPU is likely a better pick than
-	 * partially idle @prev_cpu.
-	 */
-	if (smt_enabled) {
-		if (prev_in_cand &&
-		    bpf_cpumask_test_cpu(prev_cpu, idle_smtmask) &&
-		    scx_bpf_test_and_clear_cpu_idle(prev_cpu))
-			return prev_cpu;
+	/* read global_seq first, see update_task_cell() */
+	seq = global_seq;
+	barrier();
 
-		cpu = scx_bpf_pick_idle_cpu(cand_cpumask, SCX_PICK_IDLE_CORE);
-		if (cpu >= 0)
-			return cpu;
+	if (tctx->global_seq == seq)
+		return 0;
+
+	if ((s32)(tctx->global_seq - assign_seq) < 0) {
+		if (!(cgrp = task_cgroup(p)))
+			return -ENOENT;
+		ret = update_task_cell(p, tctx, cgrp);
+		bpf_cgroup_release(cgrp);
+		return ret;
 	}
 
-	if (prev_in_cand && scx_bpf_test_and_clear_cpu_idle(prev_cpu))
-		return prev_cpu;
+	tctx->global_seq = seq;
+	if (!(cell = lookup_cell(tctx->cell)))
+		return -ENOENT;
+	if (tctx->cpus_seq == cell->cpus_seq)
+		return 0;
+
+	return update_task_cpumask(p, tctx);
+}
 
-	return scx_bpf_pick_idle_cpu(cand_cpumask, 0);
+static s32 pick_idle_cpu_from(const struct cpumask *cand_cpumask, s32 prev_cpu,
+			      const struct cpumask *idle_smtmask)
+{
+	const struct cpumask *llc_cpumask = NULL, *node_cpumask = NULL;
+	struct llc_cpumask_wrapper *llcw;
+	u32 llc = cpu_to_llc(prev_cpu), zero = 0;
+
+	/* with a single LLC, its mask is the same as all CPUs */
+	if (nr_llcs > 1 && (llcw = bpf_map_lookup_elem(&llc_cpumasks, &llc))) {
+		llc_cpumask = (const struct cpumask *)llcw->llc_cpumask;
+		node_cpumask = (const struct cpumask *)llcw->node_cpumask;
+	}
+
+	return scx_pick_idle_cpu(cand_cpumask, prev_cpu, llc_cpumask,
+				 node_cpumask, smt_enabled ? idle_smtmask : NULL,
+				 bpf_map_lookup_elem(&pick_scratch, &zero));
 }
 
 /*
@@ -552,7 +801,6 @@ static s32 pick_idle_cpu_from(const struct cpumask *cand_cpumask, s32 prev_cpu,
 s32 BPF_STRUCT_OPS(mitosis_select_cpu, struct task_struct *p, s32 prev_cpu,
 		   u64 wake_flags)
 {
-	struct cgroup *cgrp;
 	struct cpu_ctx *cctx;
 	struct task_ctx *tctx;
 	struct cpumask *task_cpumask;
@@ -564,15 +812,8 @@ s32 BPF_STRUCT_OPS(mitosis_select_cpu, struct task_struct *p, s32 prev_cpu,
 		return prev_cpu;
 
 	/* Check if we need to update the cell/cpumask mapping */
-	if (tctx->global_seq != global_seq) {
-		if (!(cgrp = task_cgroup(p)))
-			return prev_cpu;
-		if (update_task_cell(p, tctx, cgrp)) {
-			bpf_cgroup_release(cgrp);
-			return prev_cpu;
-		}
-		bpf_cgroup_release(cgrp);
-	}
+	if (maybe_update_task_cell(p, tctx))
+		return prev_cpu;
 
 	if (!(task_cpumask = (struct cpumask *)tctx->cpumask) ||
 	    !(idle_smtmask = scx_bpf_get_idle_smtmask()))
@@ -639,17 +880,48 @@ void BPF_STRUCT_OPS(mitosis_enqueue, struct task_struct *p, u64 enq_flags)
 	if (vtime_before(vtime, cell->vtime_now - slice_ns))
 		vtime = cell->vtime_now - slice_ns;
 
-	scx_bpf_dispatch_vtime(p, tctx->cell, slice_ns, vtime, enq_flags);
+	scx_bpf_dispatch_vtime(p,
+			       cell_dsq(tctx->cell,
+					cell_llc_for_cpu(cell, scx_bpf_task_cpu(p))),
+			       slice_ns, vtime, enq_flags);
+}
+
+/*
+ * Consume from the DSQs of @cell_idx starting with @llc. Tasks are only queued
+ * on the LLCs the cell spans, but the DSQs of the LLCs it no longer spans may
+ * still hold tasks queued before the cell's CPUs changed, so scan all of them.
+ * Empty DSQs are skipped cheaply.
+ */
+static bool consume_cell(u32 cell_idx, u32 llc)
+{
+	u32 i;
+
+	if (scx_bpf_consume(cell_dsq(cell_idx, llc)))
+		return true;
+
+	if (nr_llcs <= 1)
+		return false;
+
+	bpf_for(i, 1, nr_llcs) {
+		u64 dsq = cell_dsq(cell_idx, (llc + i) % nr_llcs);
+
+		if (scx_bpf_dsq_nr_queued(dsq) && scx_bpf_consume(dsq))
+			return true;
+	}
+
+	return false;
 }
 
 void BPF_STRUCT_OPS(mitosis_dispatch, s32 cpu, struct task_struct *prev)
 {
 	struct cpu_ctx *cctx;
-	u32 prev_cell, cell;
+	u32 prev_cell, cell, llc;
 
 	if (!(cctx = lookup_cpu_ctx(-1)))
 		return;
 
+	llc = cpu_to_llc(cpu);
+
 	prev_cell = *(volatile u32 *)&cctx->prev_cell;
 	cell = *(volatile u32 *)&cctx->cell;
 
@@ -658,10 +930,10 @@ void BPF_STRUCT_OPS(mitosis_dispatch, s32 cpu, struct task_struct *prev)
 	 * scheduling racing with assignment change, we schedule from the previous
 	 * cell first to make sure it drains.
 	 */
-	if (prev_cell != cell && scx_bpf_consume(prev_cell))
+	if (prev_cell != cell && consume_cell(prev_cell, llc))
 		return;
 
-	scx_bpf_consume(cell);
+	consume_cell(cell, llc);
 }
 
 static inline void runnable(struct task_struct *p, struct task_ctx *tctx,
@@ -797,6 +1069,18 @@ s32 BPF_STRUCT_OPS(mitosis_cgroup_init, struct cgroup *cgrp,
 	return 0;
 }
 
+void BPF_STRUCT_OPS(mitosis_cgroup_exit, struct cgroup *cgrp)
+{
+	struct cgrp_load_rec rec = {
+		.cgid = cgrp->kn->id,
+		.exited = true,
+	};
+
+	/* let userspace forget about the cgroup */
+	if (bpf_ringbuf_output(&cgrp_load_recs, &rec, sizeof(rec), 0))
+		load_export_overflow = true;
+}
+
 void BPF_STRUCT_OPS(mitosis_cgroup_move, struct task_struct *p,
 		    struct cgroup *from, struct cgroup *to)
 {
@@ -864,6 +1148,8 @@ s32 BPF_STRUCT_OPS(mitosis_init_task, struct task_struct *p,
 		return -EINVAL;
 	}
 
+	/* make update_task_cell() initialize the vtime */
+	tctx->cell = -1;
 	if ((ret = update_task_cell(p, tctx, args->cgroup))) {
 		return ret;
 	}
@@ -871,6 +1157,77 @@ s32 BPF_STRUCT_OPS(mitosis_init_task, struct task_struct *p,
 	return 0;
 }
 
+static inline bool cpu_in_all_cpus(u32 cpu)
+{
+	const volatile u8 *u8_ptr;
+
+	return (u8_ptr = MEMBER_VPTR(all_cpus, [cpu / 8])) &&
+	       (*u8_ptr & (1 << (cpu % 8)));
+}
+
+static s32 init_llc_cpumasks(void)
+{
+	struct bpf_cpumask *llc_cpumask, *node_cpumask;
+	struct llc_cpumask_wrapper *llcw;
+	u32 llc, cpu;
+
+	bpf_for(llc, 0, nr_llcs) {
+		s32 node = llc_to_node(llc);
+		bool node_has_others = false;
+
+		if (!(llcw = bpf_map_lookup_elem(&llc_cpumasks, &llc)))
+			return -ENOENT;
+
+		if (!(llc_cpumask = bpf_cpumask_create()))
+			return -ENOMEM;
+		if (!(node_cpumask = bpf_cpumask_create())) {
+			bpf_cpumask_release(llc_cpumask);
+			return -ENOMEM;
+		}
+
+		bpf_for(cpu, 0, nr_possible_cpus) {
+			u32 cpu_llc_idx = cpu_to_llc(cpu);
+
+			if (!cpu_in_all_cpus(cpu))
+				continue;
+			if (cpu_llc_idx == llc)
+				bpf_cpumask_set_cpu(cpu, llc_cpumask);
+			if (node >= 0 && llc_to_node(cpu_llc_idx) == node) {
+				bpf_cpumask_set_cpu(cpu, node_cpumask);
+				if (cpu_llc_idx != llc)
+					node_has_others = true;
+			}
+		}
+
+		if (!node_has_others) {
+			bpf_cpumask_release(node_cpumask);
+			node_cpumask = NULL;
+		}
+
+		llc_cpumask = bpf_kptr_xchg(&llcw->llc_cpumask, llc_cpumask);
+		if (llc_cpumask)
+			bpf_cpumask_release(llc_cpumask);
+		if (node_cpumask) {
+			node_cpumask = bpf_kptr_xchg(&llcw->node_cpumask, node_cpumask);
+			if (node_cpumask)
+				bpf_cpumask_release(node_cpumask);
+		}
+	}
+
+	bpf_for(cpu, 0, nr_possible_cpus) {
+		struct scx_pick_scratch *scratch;
+		u32 zero = 0;
+		s32 ret;
+
+		if (!(scratch = bpf_map_lookup_percpu_elem(&pick_scratch, &zero, cpu)))
+			return -ENOENT;
+		if ((ret = scx_pick_scratch_init(scratch)))
+			return ret;
+	}
+
+	return 0;
+}
+
 s32 BPF_STRUCT_OPS_SLEEPABLE(mitosis_init)
 {
 	struct bpf_cpumask *cpumask;
@@ -898,15 +1255,25 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(mitosis_init)
 	if (cpumask)
 		bpf_cpumask_release(cpumask);
 
+	if ((ret = init_llc_cpumasks()))
+		return ret;
+
 	bpf_for(i, 0, MAX_CELLS)
 	{
 		struct cell_cpumask_wrapper *cpumaskw;
 		struct cell *cell = &cells[i];
+		u32 llc;
 
-		ret = scx_bpf_create_dsq(i, -1);
-		if (ret < 0)
-			return ret;
-		cell->dsq = i;
+		bpf_for(llc, 0, nr_llcs) {
+			const volatile s32 *node = MEMBER_VPTR(llc_node, [llc]);
+
+			ret = scx_bpf_create_dsq(cell_dsq(i, llc), node ? *node : -1);
+			if (ret < 0)
+				return ret;
+		}
+		cell->dsq = cell_dsq(i, 0);
+		/* all cells start with all CPUs, see below */
+		cell->llc_mask = nr_llcs >= 64 ? -1LLU : (1LLU << nr_llcs) - 1;
 
 		if (!(cpumaskw = bpf_map_lookup_elem(&cell_cpumasks, &i)))
 			return -ENOENT;
@@ -959,6 +1326,7 @@ struct sched_ext_ops mitosis = {
 	.set_cpumask = (void *)mitosis_set_cpumask,
 	.init_task = (void *)mitosis_init_task,
 	.cgroup_init = (void *)mitosis_cgroup_init,
+	.cgroup_exit = (void *)mitosis_cgroup_exit,
 	.cgroup_move = (void *)mitosis_cgroup_move,
 	.init = (void *)mitosis_init,
 	.exit = (void *)mitosis_exit,
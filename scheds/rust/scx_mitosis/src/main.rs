@@ -6,12 +6,15 @@ mod bpf_skel;
 pub use bpf_skel::*;
 pub mod bpf_intf;
 
+use std::cell::RefCell;
 use std::collections::BTreeMap;
 use std::collections::HashMap;
 use std::collections::VecDeque;
 use std::fs::File;
 use std::os::fd::AsRawFd;
+use std::os::unix::fs::MetadataExt;
 use std::path::PathBuf;
+use std::rc::Rc;
 use std::sync::atomic::AtomicBool;
 use std::sync::atomic::Ordering;
 use std::sync::Arc;
@@ -34,17 +37,20 @@ use maplit::btreemap;
 use maplit::hashmap;
 use scx_utils::compat;
 use scx_utils::init_libbpf_logging;
-use scx_utils::ravg::ravg_read;
+use scx_utils::ravg::RavgData;
+use scx_utils::ravg::RavgReader;
 use scx_utils::scx_ops_attach;
 use scx_utils::scx_ops_load;
 use scx_utils::scx_ops_open;
 use scx_utils::uei_exited;
 use scx_utils::uei_report;
+use scx_utils::Topology;
 use scx_utils::UserExitInfo;
 
 const RAVG_FRAC_BITS: u32 = bpf_intf::ravg_consts_RAVG_FRAC_BITS;
 const MAX_CPUS: usize = bpf_intf::consts_MAX_CPUS as usize;
 const MAX_CELLS: usize = bpf_intf::consts_MAX_CELLS as usize;
+const MAX_LLCS: usize = bpf_intf::consts_MAX_LLCS as usize;
 const USAGE_HALF_LIFE: u32 = bpf_intf::consts_USAGE_HALF_LIFE;
 
 lazy_static::lazy_static! {
@@ -101,12 +107,17 @@ struct CpuPool {
     nr_cpus: usize,
     all_cpus: BitVec,
     available_cpus: BitVec,
+    /// CPU ID -> index into core_cpus
+    cpu_core: Vec<usize>,
+    /// CPU ID -> index into llc_cpus and llc_nodes
+    cpu_llc: Vec<usize>,
+    core_cpus: Vec<BitVec>,
+    llc_cpus: Vec<BitVec>,
+    llc_nodes: Vec<usize>,
 }
 
-// TODO: The way we alloc/free CPUs to/from cells is totally topology agnostic,
-// needs to be much smarter.
 impl CpuPool {
-    fn new() -> Result<Self> {
+    fn new(topo: &Topology) -> Result<Self> {
         if *NR_POSSIBLE_CPUS > MAX_CPUS {
             bail!(
                 "NR_POSSIBLE_CPUS {} > MAX_CPUS {}",
@@ -115,36 +126,119 @@ impl CpuPool {
             );
         }
 
-        let mut nr_offline = 0;
-        let mut all_cpus = bitvec![1; *NR_POSSIBLE_CPUS];
-
-        for cpu in 0..*NR_POSSIBLE_CPUS {
-            let path = format!("/sys/devices/system/cpu/cpu{}", cpu,);
-            if !std::path::Path::new(&path).exists() {
-                nr_offline += 1;
-                all_cpus.set(cpu, false);
+        let mut all_cpus = bitvec![0; *NR_POSSIBLE_CPUS];
+        let mut cpu_core = vec![usize::MAX; *NR_POSSIBLE_CPUS];
+        let mut cpu_llc = vec![usize::MAX; *NR_POSSIBLE_CPUS];
+        let mut core_cpus = Vec::new();
+        let mut llc_cpus = Vec::new();
+        let mut llc_nodes = Vec::new();
+
+        for node in topo.nodes().iter() {
+            for llc in node.llcs().values() {
+                let mut llc_span = bitvec![0; *NR_POSSIBLE_CPUS];
+                for core in llc.cores().values() {
+                    let mut core_span = bitvec![0; *NR_POSSIBLE_CPUS];
+                    for cpu in core.cpus().keys() {
+                        if *cpu >= *NR_POSSIBLE_CPUS {
+                            continue;
+                        }
+                        all_cpus.set(*cpu, true);
+                        core_span.set(*cpu, true);
+                        llc_span.set(*cpu, true);
+                        cpu_core[*cpu] = core_cpus.len();
+                        cpu_llc[*cpu] = llc_cpus.len();
+                    }
+                    core_cpus.push(core_span);
+                }
+                llc_cpus.push(llc_span);
+                llc_nodes.push(node.id());
             }
         }
 
-        let nr_cpus = *NR_POSSIBLE_CPUS - nr_offline;
+        if llc_cpus.len() > MAX_LLCS {
+            bail!("Too many LLCs {} > MAX_LLCS {}", llc_cpus.len(), MAX_LLCS);
+        }
+
+        let nr_cpus = all_cpus.count_ones();
 
-        info!("CPUs: online/possible={}/{}", nr_cpus, *NR_POSSIBLE_CPUS);
+        info!(
+            "CPUs: online/possible={}/{} LLCs={}",
+            nr_cpus,
+            *NR_POSSIBLE_CPUS,
+            llc_cpus.len()
+        );
 
         Ok(Self {
             nr_cpus,
             all_cpus: all_cpus.clone(),
             available_cpus: all_cpus,
+            cpu_core,
+            cpu_llc,
+            core_cpus,
+            llc_cpus,
+            llc_nodes,
         })
     }
 
-    fn alloc(&mut self) -> Option<usize> {
-        let cpu = self.available_cpus.first_one()?;
+    /// Allocate the available CPU which keeps @cell_cpus the most packed: a
+    /// sibling of one of its CPUs, then a CPU in one of its LLCs and then a
+    /// CPU on one of its nodes. Among those, CPUs of free cores are preferred
+    /// to keep cores whole, then CPUs in the LLC with the most available CPUs
+    /// so that new cells get an LLC of their own.
+    fn alloc(&mut self, cell_cpus: &BitVec) -> Option<usize> {
+        let nr_llcs = self.llc_cpus.len();
+        let mut cell_cores = vec![false; self.core_cpus.len()];
+        let mut cell_llcs = vec![false; nr_llcs];
+        let mut llc_avail = vec![0; nr_llcs];
+        for cpu in cell_cpus.iter_ones() {
+            cell_cores[self.cpu_core[cpu]] = true;
+            cell_llcs[self.cpu_llc[cpu]] = true;
+        }
+        let cell_nodes: Vec<usize> = (0..nr_llcs)
+            .filter(|llc| cell_llcs[*llc])
+            .map(|llc| self.llc_nodes[llc])
+            .collect();
+        for cpu in self.available_cpus.iter_ones() {
+            llc_avail[self.cpu_llc[cpu]] += 1;
+        }
+
+        let cpu = self.available_cpus.iter_ones().max_by_key(|&cpu| {
+            let core = self.cpu_core[cpu];
+            let llc = self.cpu_llc[cpu];
+            let core_free = self.core_cpus[core]
+                .iter_ones()
+                .all(|sib| self.available_cpus[sib]);
+            (
+                cell_cores[core],
+                cell_llcs[llc],
+                cell_nodes.contains(&self.llc_nodes[llc]),
+                core_free,
+                llc_avail[llc],
+                std::cmp::Reverse(cpu),
+            )
+        })?;
         self.available_cpus.set(cpu, false);
         Some(cpu)
     }
 
+    /// Free the CPU of @cands which keeps it the most packed: a CPU in the LLC
+    /// it has the fewest CPUs in, and in there, a CPU of a core it only
+    /// partially owns.
     fn free(&mut self, cands: &mut BitVec) -> Option<usize> {
-        let cpu = cands.last_one()?;
+        let mut cell_cores = vec![0; self.core_cpus.len()];
+        let mut cell_llcs = vec![0; self.llc_cpus.len()];
+        for cpu in cands.iter_ones() {
+            cell_cores[self.cpu_core[cpu]] += 1;
+            cell_llcs[self.cpu_llc[cpu]] += 1;
+        }
+
+        let cpu = cands.iter_ones().min_by_key(|&cpu| {
+            (
+                cell_llcs[self.cpu_llc[cpu]],
+                cell_cores[self.cpu_core[cpu]],
+                std::cmp::Reverse(cpu),
+            )
+        })?;
         self.available_cpus.set(cpu, true);
         cands.set(cpu, false);
         Some(cpu)
@@ -178,6 +272,27 @@ impl PartialEq for Cgroup {
 
 impl Eq for Cgroup {}
 
+/// Last load of a cgroup exported by BPF. A cgroup's load only changes when
+/// BPF exports it again, so ravg_read() of this stays accurate in between.
+#[derive(Clone, Copy)]
+struct CgroupLoadData {
+    load_rd: bpf_intf::ravg_data,
+    pinned_load_rd: bpf_intf::ravg_data,
+}
+
+fn read_ravg(rd: &bpf_intf::ravg_data, now: u64) -> f64 {
+    const READER: RavgReader = RavgReader::new(USAGE_HALF_LIFE, RAVG_FRAC_BITS);
+    READER.read(
+        &RavgData {
+            val: rd.val,
+            val_at: rd.val_at,
+            old: rd.old,
+            cur: rd.cur,
+        },
+        now,
+    )
+}
+
 #[derive(Debug)]
 struct Cell {
     cgroups: BTreeMap<String, Cgroup>,
@@ -253,6 +368,10 @@ struct Scheduler<'a> {
     cpu_pool: CpuPool,
     cells: BTreeMap<u32, Cell>,
     cgroup_to_cell: HashMap<String, u32>,
+    cgroup_loads: HashMap<u64, CgroupLoadData>,
+    cgroup_names: HashMap<u64, String>,
+    load_recs: Rc<RefCell<Vec<bpf_intf::cgrp_load_rec>>>,
+    load_rb: libbpf_rs::RingBuffer<'static>,
     prev_percpu_cell_cycles: Vec<[u64; MAX_CELLS]>,
     last_reconfiguration: std::time::Instant,
     last_cpu_rebalancing: std::time::Instant,
@@ -263,7 +382,8 @@ struct Scheduler<'a> {
 
 impl<'a> Scheduler<'a> {
     fn init(opts: &Opts) -> Result<Self> {
-        let mut cpu_pool = CpuPool::new()?;
+        let topo = Topology::new()?;
+        let mut cpu_pool = CpuPool::new(&topo)?;
 
         let mut skel_builder = BpfSkelBuilder::default();
         skel_builder.obj_builder.debug(opts.verbose > 1);
@@ -287,12 +407,21 @@ impl<'a> Scheduler<'a> {
             skel.rodata_mut().debug = true;
         }
         skel.rodata_mut().nr_possible_cpus = *NR_POSSIBLE_CPUS as u32;
+        skel.rodata_mut().load_export_interval_ns = opts.monitor_interval_s * 1_000_000_000;
         for cpu in cpu_pool.all_cpus.iter_ones() {
             skel.rodata_mut().all_cpus[cpu / 8] |= 1 << (cpu % 8);
+            skel.rodata_mut().cpu_llc[cpu] = cpu_pool.cpu_llc[cpu] as u32;
             skel.bss_mut().cells[0].cpus[cpu / 8] |= 1 << (cpu % 8);
         }
+        skel.rodata_mut().nr_llcs = cpu_pool.llc_cpus.len() as u32;
+        for (llc, node) in cpu_pool.llc_nodes.iter().enumerate() {
+            skel.rodata_mut().llc_node[llc] = *node as i32;
+        }
+        let mut cell0_cpus = bitvec![0; *NR_POSSIBLE_CPUS];
         for _ in 0..cpu_pool.all_cpus.count_ones() {
-            cpu_pool.alloc();
+            if let Some(cpu) = cpu_pool.alloc(&cell0_cpus) {
+                cell0_cpus.set(cpu, true);
+            }
         }
 
         let mut skel = scx_ops_load!(skel, mitosis, uei)?;
@@ -300,6 +429,24 @@ impl<'a> Scheduler<'a> {
         let struct_ops = Some(scx_ops_attach!(skel, mitosis)?);
         info!("Mitosis Scheduler Attached");
 
+        // BPF exports the load of the cgroups whose load changed through
+        // cgrp_load_recs, stash the records until collect_cgroup_load().
+        let load_recs = Rc::new(RefCell::new(Vec::new()));
+        let load_recs_cb = load_recs.clone();
+        let mut builder = libbpf_rs::RingBufferBuilder::new();
+        builder
+            .add(skel.maps().cgrp_load_recs(), move |data: &[u8]| {
+                let rec = unsafe {
+                    std::ptr::read_unaligned(data.as_ptr() as *const bpf_intf::cgrp_load_rec)
+                };
+                load_recs_cb.borrow_mut().push(rec);
+                0
+            })
+            .context("Failed to add cgrp_load_recs ringbuf")?;
+        let load_rb = builder
+            .build()
+            .context("Failed to build cgrp_load_recs ringbuf")?;
+
         // Initial configuration: Cell 0 with the rootcg assigned to it
         let cells = btreemap! {
             0 => Cell {
@@ -326,6 +473,10 @@ impl<'a> Scheduler<'a> {
             cpu_pool,
             cells,
             cgroup_to_cell,
+            cgroup_loads: HashMap::new(),
+            cgroup_names: HashMap::new(),
+            load_recs,
+            load_rb,
             prev_percpu_cell_cycles: vec![[0; MAX_CELLS]; nr_cpus],
             last_reconfiguration: now,
             last_cpu_rebalancing: now,
@@ -404,21 +555,14 @@ impl<'a> Scheduler<'a> {
         self.skel.bss_mut().user_global_seq += 1;
     }
 
-    /// Iterate through each cg in the cgroupfs, read its load from BPF and
-    /// update the cells map
-    fn collect_cgroup_load(&mut self) -> Result<f64> {
-        let mut cgroup_to_cell = HashMap::new();
-
-        for (_, cell) in self.cells.iter_mut() {
-            cell.cgroups = BTreeMap::new();
-            cell.load = 0.0;
-            cell.pinned_load = 0.0;
-        }
-        let now_mono = now_monotonic();
+    /// Walk the cgroupfs and call @f with the ID and name of each cgroup.
+    fn walk_cgroups<F>(mut f: F) -> Result<()>
+    where
+        F: FnMut(u64, String, &File) -> Result<()>,
+    {
         let mut stack = VecDeque::new();
         let root = CgroupReader::root()?;
         stack.push_back(root);
-        let mut total_load = 0.0;
         while let Some(reader) = stack.pop_back() {
             for child in reader.child_cgroup_iter()? {
                 stack.push_back(child);
@@ -429,86 +573,163 @@ impl<'a> Scheduler<'a> {
             let cg = File::open(path).with_context(|| {
                 format!("Failed to open cgroup dir {}", reader.name().display())
             })?;
+            // The cgroup ID is the inode number of its cgroupfs directory.
+            let cgid = cg.metadata()?.ino();
+            f(cgid, reader.name().to_string_lossy().to_string(), &cg)?;
+        }
+        Ok(())
+    }
+
+    /// Read the load of every cgroup from BPF. Only needed on startup and if
+    /// BPF failed to export some of the changes.
+    fn resync_cgroup_loads(&mut self) -> Result<()> {
+        let mut cgroup_loads = HashMap::new();
+        let mut cgroup_names = HashMap::new();
+        let maps = self.skel.maps();
+        Self::walk_cgroups(|cgid, name, cg| {
             let cg_fd = cg.as_raw_fd();
             let cg_fd_slice = unsafe { any_as_u8_slice(&cg_fd) };
-            if let Some(v) = self
-                .skel
-                .maps()
+            if let Some(v) = maps
                 .cgrp_ctx()
                 .lookup(cg_fd_slice, libbpf_rs::MapFlags::ANY)
-                .with_context(|| {
-                    format!(
-                        "Failed to lookup cgroup {} in cgrp_ctx map",
-                        reader.name().display()
-                    )
-                })?
+                .with_context(|| format!("Failed to lookup cgroup {} in cgrp_ctx map", name))?
             {
                 let cgrp_ctx = unsafe {
                     let ptr = v.as_slice().as_ptr() as *const bpf_intf::cgrp_ctx;
                     *ptr
                 };
-                let rd = &cgrp_ctx.load_rd;
-                let load = ravg_read(
-                    rd.val,
-                    rd.val_at,
-                    rd.old,
-                    rd.cur,
-                    now_mono,
-                    USAGE_HALF_LIFE,
-                    RAVG_FRAC_BITS,
-                );
-                total_load += load;
-                let pinned_rd = &cgrp_ctx.pinned_load_rd;
-                let pinned_load = ravg_read(
-                    pinned_rd.val,
-                    pinned_rd.val_at,
-                    pinned_rd.old,
-                    pinned_rd.cur,
-                    now_mono,
-                    USAGE_HALF_LIFE,
-                    RAVG_FRAC_BITS,
-                );
-                let name = reader.name().to_string_lossy().to_string();
-
-                // We don't trust BPF knows the cgroup's cell (e.g. if a
-                // reconfiguration is in flight) so rely on userspace as the
-                // source of truth. If we don't know the cell, then walk up the
-                // hierarchy.
-                let cell_idx = self
-                    .cgroup_to_cell
-                    .get(&name)
-                    .or_else(|| {
-                        let mut s = name.as_str();
-                        while let Some((parent, _)) = s.rsplit_once('/') {
-                            if let Some(cell) = cgroup_to_cell.get(parent) {
-                                return Some(cell);
-                            }
-                            s = parent;
-                        }
-                        cgroup_to_cell.get("")
-                    })
-                    .copied()
-                    .ok_or_else(|| anyhow!("Failed to identify cell for cgroup {}", name))?;
-
-                cgroup_to_cell.insert(name.clone(), cell_idx);
-                let cell = self.cells.get_mut(&cell_idx).ok_or_else(|| {
-                    anyhow!(
-                        "Cgroup {} maps to cell {} which doesn't exist",
-                        name,
-                        cell_idx
-                    )
-                })?;
-                cell.cgroups.insert(
-                    name.clone(),
-                    Cgroup {
-                        name,
-                        load,
-                        pinned_load,
+                cgroup_loads.insert(
+                    cgid,
+                    CgroupLoadData {
+                        load_rd: cgrp_ctx.load_rd,
+                        pinned_load_rd: cgrp_ctx.pinned_load_rd,
                     },
                 );
-                cell.load += load;
-                cell.pinned_load += pinned_load;
+                cgroup_names.insert(cgid, name);
             }
+            Ok(())
+        })?;
+        self.cgroup_loads = cgroup_loads;
+        self.cgroup_names = cgroup_names;
+        Ok(())
+    }
+
+    /// Apply the cgroup loads exported by BPF since the last call, and refresh
+    /// the cgroup names if new cgroups showed up.
+    fn update_cgroup_loads(&mut self) -> Result<()> {
+        if self.cgroup_names.is_empty() || self.skel.bss().load_export_overflow {
+            debug!("Resynchronizing the load of all cgroups");
+            self.skel.bss_mut().load_export_overflow = false;
+            self.resync_cgroup_loads()?;
+        }
+
+        self.load_rb
+            .consume()
+            .context("Failed to consume cgrp_load_recs ringbuf")?;
+        let recs = std::mem::take(&mut *self.load_recs.borrow_mut());
+        let mut nr_unknown = 0;
+        for rec in recs.iter() {
+            if rec.exited != 0 {
+                self.cgroup_loads.remove(&rec.cgid);
+                self.cgroup_names.remove(&rec.cgid);
+                continue;
+            }
+            self.cgroup_loads.insert(
+                rec.cgid,
+                CgroupLoadData {
+                    load_rd: rec.load_rd,
+                    pinned_load_rd: rec.pinned_load_rd,
+                },
+            );
+            if !self.cgroup_names.contains_key(&rec.cgid) {
+                nr_unknown += 1;
+            }
+        }
+        trace!("{} cgroup load updates, {} new", recs.len(), nr_unknown);
+
+        if nr_unknown > 0 {
+            let cgroup_names = &mut self.cgroup_names;
+            let cgroup_loads = &self.cgroup_loads;
+            Self::walk_cgroups(|cgid, name, _| {
+                if cgroup_loads.contains_key(&cgid) {
+                    cgroup_names.insert(cgid, name);
+                }
+                Ok(())
+            })?;
+        }
+        Ok(())
+    }
+
+    /// Update the cells map with the latest load of each cgroup. Only the
+    /// cgroups whose load changed are read from BPF.
+    fn collect_cgroup_load(&mut self) -> Result<f64> {
+        self.update_cgroup_loads()?;
+
+        let mut cgroup_to_cell = HashMap::new();
+
+        for (_, cell) in self.cells.iter_mut() {
+            cell.cgroups = BTreeMap::new();
+            cell.load = 0.0;
+            cell.pinned_load = 0.0;
+        }
+        let now_mono = now_monotonic();
+        let mut total_load = 0.0;
+
+        // Cgroups sort before their descendants, so that each cgroup's parent
+        // is already in cgroup_to_cell when walking up the hierarchy below.
+        let mut cgroups: Vec<(&String, &CgroupLoadData)> = self
+            .cgroup_loads
+            .iter()
+            .filter_map(|(cgid, data)| self.cgroup_names.get(cgid).map(|name| (name, data)))
+            .collect();
+        cgroups.sort_unstable_by(|a, b| a.0.cmp(b.0));
+        if cgroups.first().map_or(true, |(name, _)| !name.is_empty()) {
+            cgroup_to_cell.insert("".to_string(), *self.cgroup_to_cell.get("").unwrap_or(&0));
+        }
+
+        for (name, data) in cgroups.into_iter() {
+            let load = read_ravg(&data.load_rd, now_mono);
+            let pinned_load = read_ravg(&data.pinned_load_rd, now_mono);
+            total_load += load;
+
+            // We don't trust BPF knows the cgroup's cell (e.g. if a
+            // reconfiguration is in flight) so rely on userspace as the
+            // source of truth. If we don't know the cell, then walk up the
+            // hierarchy.
+            let cell_idx = self
+                .cgroup_to_cell
+                .get(name)
+                .or_else(|| {
+                    let mut s = name.as_str();
+                    while let Some((parent, _)) = s.rsplit_once('/') {
+                        if let Some(cell) = cgroup_to_cell.get(parent) {
+                            return Some(cell);
+                        }
+                        s = parent;
+                    }
+                    cgroup_to_cell.get("")
+                })
+                .copied()
+                .ok_or_else(|| anyhow!("Failed to identify cell for cgroup {}", name))?;
+
+            cgroup_to_cell.insert(name.clone(), cell_idx);
+            let cell = self.cells.get_mut(&cell_idx).ok_or_else(|| {
+                anyhow!(
+                    "Cgroup {} maps to cell {} which doesn't exist",
+                    name,
+                    cell_idx
+                )
+            })?;
+            cell.cgroups.insert(
+                name.clone(),
+                Cgroup {
+                    name: name.clone(),
+                    load,
+                    pinned_load,
+                },
+            );
+            cell.load += load;
+            cell.pinned_load += pinned_load;
         }
         self.cgroup_to_cell = cgroup_to_cell;
         Ok(total_load)
@@ -572,12 +793,7 @@ impl<'a> Scheduler<'a> {
             // For each cell pair, find the best merge
             let mut best_score = 0.0;
             for ((cell_idx1, cell1), (cell_idx2, cell2)) in self.cells.iter().tuple_combinations() {
-                let mut score = 0.0;
-                for (_, c1) in cell1.cgroups.iter() {
-                    for (_, c2) in cell2.cgroups.iter() {
-                        score += self.score_cgroup_pair(c1, c2);
-                    }
-                }
+                let score = self.score_cgroup_groups(cell1.load, cell2.load);
                 if score > best_score {
                     best_score = score;
                     ret = Some(SplitOrMerge::Merge(Merge {
@@ -651,7 +867,7 @@ impl<'a> Scheduler<'a> {
             while cell.cpu_assignment.count_ones() < *cpus {
                 let new_cpu = self
                     .cpu_pool
-                    .alloc()
+                    .alloc(&cell.cpu_assignment)
                     .ok_or(anyhow!("No cpus to allocate"))?;
                 trace!("Allocating {} to Cell {}", new_cpu, cell_idx);
                 cell.cpu_assignment.set(new_cpu, true);
@@ -749,43 +965,52 @@ impl<'a> Scheduler<'a> {
 
     /// This is largely a placeholder, it views the Cell as a fully-connected
     /// graph of cgroups where edges are the score of the pair (see
-    /// score_cgroup_pair) and then identifies the max-cut of that graph.
+    /// score_cgroup_groups) and then identifies the max-cut of that graph.
+    ///
+    /// Candidate cuts split the cgroups in name order. As the score of a cut
+    /// only depends on the load on each side, it's updated incrementally while
+    /// moving the cut point.
     fn find_best_split(&self, cell: &Cell, cell_idx: u32) -> Result<Option<Split>> {
-        let num_cgroups = cell.cgroups.len();
+        let cgroups: Vec<&Cgroup> = cell.cgroups.values().collect();
+        let total_load: f64 = cgroups.iter().map(|cg| cg.load).sum();
+        let mut g1_load = 0.0;
         let mut best_score = 0.0;
-        let mut best_split = None;
-        for combo_vec in cell.cgroups.iter().combinations(num_cgroups) {
-            for i in 1..(num_cgroups - 2) {
-                let mut score = 0.0;
-                let (g1, g2) = combo_vec.split_at(i);
-                for (_, c1) in g1.iter() {
-                    for (_, c2) in g2.iter() {
-                        score += self.score_cgroup_pair(c1, c2);
-                    }
-                }
-                if score > best_score {
-                    best_score = score;
-                    let mut g1: Vec<Cgroup> = g1.iter().map(|(_, c)| (*c).clone()).collect();
-                    g1.sort_by(|a, b| b.load.partial_cmp(&a.load).expect("Can't compare loads"));
-                    let mut g2: Vec<Cgroup> = g2.iter().map(|(_, c)| (*c).clone()).collect();
-                    g2.sort_by(|a, b| b.load.partial_cmp(&a.load).expect("Can't compare loads"));
-                    best_split = Some(Split {
-                        cell: cell_idx,
-                        g1,
-                        g2,
-                        score,
-                    });
-                }
+        let mut best_cut = None;
+        for i in 1..cgroups.len().saturating_sub(2) {
+            g1_load += cgroups[i - 1].load;
+            let score = self.score_cgroup_groups(g1_load, total_load - g1_load);
+            if score > best_score {
+                best_score = score;
+                best_cut = Some(i);
             }
         }
-        Ok(best_split)
+
+        Ok(best_cut.map(|i| {
+            let (g1, g2) = cgroups.split_at(i);
+            let mut g1: Vec<Cgroup> = g1.iter().map(|c| (*c).clone()).collect();
+            g1.sort_by(|a, b| b.load.partial_cmp(&a.load).expect("Can't compare loads"));
+            let mut g2: Vec<Cgroup> = g2.iter().map(|c| (*c).clone()).collect();
+            g2.sort_by(|a, b| b.load.partial_cmp(&a.load).expect("Can't compare loads"));
+            Split {
+                cell: cell_idx,
+                g1,
+                g2,
+                score: best_score,
+            }
+        }))
     }
 
     /// This is a straight-up placeholder - can take into account cgroup tree
     /// distance, weights, etc. The idea is that higher scoring pairs should be
     /// in separate cells.
-    fn score_cgroup_pair(&self, c1: &Cgroup, c2: &Cgroup) -> f64 {
-        c1.load * c2.load
+    ///
+    /// Returns the sum of the scores of all the cgroup pairs across two groups
+    /// of cgroups. The score of a pair is the product of their loads, so the
+    /// sum is the product of the total loads of the groups. A pair score which
+    /// doesn't factor like this would need to be accumulated per cgroup as
+    /// loads change to keep the split and merge searches from going quadratic.
+    fn score_cgroup_groups(&self, g1_load: f64, g2_load: f64) -> f64 {
+        g1_load * g2_load
     }
 }
 
@@ -0,0 +1,139 @@
+// Copyright (c) Andrea Righi <andrea.righi@canonical.com>
+
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+// Multi-threaded variant of scx_rlfifo: the tasks enqueued on the CPUs of each NUMA node are
+// received and dispatched by a different worker thread, pinned to the CPUs of the node, while the
+// main thread only reports the statistics.
+//
+//   cargo run --example rlfifo_workers
+#[path = "../src/bpf_skel.rs"]
+mod bpf_skel;
+pub use bpf_skel::*;
+#[path = "../src/bpf_intf.rs"]
+pub mod bpf_intf;
+
+#[path = "../src/bpf.rs"]
+mod bpf;
+use bpf::*;
+
+use scx_utils::Topology;
+use scx_utils::UserExitInfo;
+
+use std::sync::atomic::AtomicBool;
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+
+use std::time::Duration;
+
+use anyhow::Result;
+
+struct Scheduler<'a> {
+    bpf: BpfScheduler<'a>,
+}
+
+impl<'a> Scheduler<'a> {
+    fn init() -> Result<Self> {
+        let topo = Topology::new().expect("Failed to build host topology");
+        let bpf = BpfScheduler::init(&BpfSchedulerOpts {
+            slice_us: 5000,                                 // default task time slice
+            nr_cpus_online: topo.nr_cpus_possible() as i32, // max CPUs available in the system
+            full_user: true,                                // schedule all tasks in user-space
+            numa_workers: true,                             // one worker per NUMA node
+            ..Default::default()
+        })?;
+        Ok(Self { bpf })
+    }
+
+    fn dispatch_tasks(worker: &mut BpfWorker, shutdown: &AtomicBool) {
+        let mut queued = vec![QueuedTask::default(); MAX_DEQUEUE_BATCH];
+        let mut dispatched = Vec::with_capacity(MAX_DEQUEUE_BATCH);
+
+        while !shutdown.load(Ordering::Relaxed) {
+            // Get queued taks and dispatch them in order (FIFO).
+            let nr = match worker.dequeue_tasks(&mut queued, Duration::from_millis(100)) {
+                Ok(nr) => nr,
+                Err(_) => break,
+            };
+
+            // task.cpu < 0 is used to to notify an exiting task, in this case we can simply
+            // ignore the task.
+            dispatched.clear();
+            for task in queued[..nr].iter().filter(|task| task.cpu >= 0) {
+                let mut dispatched_task = DispatchedTask::new(task);
+
+                // Allow to dispatch on the first CPU available.
+                dispatched_task.set_flag(RL_CPU_ANY);
+
+                dispatched.push(dispatched_task);
+            }
+            let _ = worker.dispatch_tasks(&dispatched);
+
+            // Notify the BPF component that all the tasks received by this worker have been
+            // scheduled and dispatched.
+            worker.update_tasks(0);
+
+            // Give the tasks a chance to run and prevent overflowing the dispatch queue.
+            if nr > 0 {
+                std::thread::yield_now();
+            }
+        }
+    }
+
+    fn print_stats(bpf: &BpfScheduler) {
+        let bss = bpf.skel.bss();
+
+        println!(
+            "user={} kernel={} cancel={} bounce={} fail={} cong={}",
+            bss.nr_user_dispatches,
+            bss.nr_kernel_dispatches,
+            bss.nr_cancel_dispatches,
+            bss.nr_bounce_dispatches,
+            bss.nr_failed_dispatches,
+            bss.nr_sched_congested,
+        );
+    }
+
+    fn run(&mut self, shutdown: Arc<AtomicBool>) -> Result<UserExitInfo> {
+        let bpf = &self.bpf;
+        let stop = AtomicBool::new(false);
+
+        std::thread::scope(|s| {
+            for mut worker in bpf.workers() {
+                let stop = &stop;
+                s.spawn(move || {
+                    if let Err(err) = worker.pin() {
+                        eprintln!("worker {}: {}", worker.shard(), err);
+                    }
+                    Self::dispatch_tasks(&mut worker, stop);
+                });
+            }
+
+            while !shutdown.load(Ordering::Relaxed) && !bpf.exited() {
+                Self::print_stats(bpf);
+                std::thread::sleep(Duration::from_secs(1));
+            }
+            stop.store(true, Ordering::Relaxed);
+        });
+
+        self.bpf.shutdown_and_report()
+    }
+}
+
+fn main() -> Result<()> {
+    let shutdown = Arc::new(AtomicBool::new(false));
+    let shutdown_clone = shutdown.clone();
+    ctrlc::set_handler(move || {
+        shutdown_clone.store(true, Ordering::Relaxed);
+    })?;
+
+    loop {
+        let mut sched = Scheduler::init()?;
+        if !sched.run(shutdown.clone())?.should_restart() {
+            break;
+        }
+    }
+
+    Ok(())
+}
@@ -9,13 +9,14 @@ pub mod bpf_intf;
 mod bpf;
 use bpf::*;
 
+use scx_utils::lathist::LatHist;
 use scx_utils::Topology;
 use scx_utils::TopologyMap;
 use scx_utils::UserExitInfo;
 
 use std::thread;
 
-use std::collections::BTreeSet;
+use std::cmp::Ordering as CmpOrdering;
 use std::collections::HashMap;
 
 use std::sync::atomic::AtomicBool;
@@ -60,7 +61,7 @@ const VERSION: &'static str = env!("CARGO_PKG_VERSION");
 ///
 /// - tasks are then dispatched from the lowest to the highest vruntime
 ///
-/// All the tasks are stored in a BTreeSet (TaskTree), using vruntime as the ordering key.
+/// All the tasks are stored in a task pool (TaskPool), using vruntime as the ordering key.
 /// Once the order of execution is determined all tasks are sent back to the BPF counterpart to be
 /// dispatched. To keep track of the accumulated cputime and vruntime the scheduler maintain a
 /// HashMap (TaskInfoMap) indexed by pid.
@@ -140,6 +141,38 @@ struct Opts {
     #[clap(short = 'f', long, action = clap::ArgAction::SetTrue)]
     disable_fifo: bool,
 
+    /// Coalesce the wakeups of the user-space scheduler when at least half of the CPUs are busy:
+    /// the scheduler is woken up only when this many tasks are waiting to be scheduled (or
+    /// --wakeup-delay-us has elapsed). Values <= 1 wake up the scheduler for every event.
+    #[clap(long, default_value = "1")]
+    wakeup_batch: u64,
+
+    /// Maximum time (in us) a task can wait to be sent to the user-space scheduler when wakeups
+    /// are coalesced (see --wakeup-batch).
+    #[clap(long, default_value = "100")]
+    wakeup_delay_us: u64,
+
+    /// When almost all the CPUs are busy, keep the user-space scheduler busy polling on this CPU
+    /// instead of waking it up on demand. -1 disables busy polling.
+    #[clap(long, default_value = "-1", allow_hyphen_values = true)]
+    busy_poll_cpu: i32,
+
+    /// Record a log2 histogram of the time from when a task is queued to the scheduler until it
+    /// is dispatched, and report its p50 and p99 with the statistics.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    lathist: bool,
+
+    /// Shard the task pool per LLC.
+    ///
+    /// Tasks are queued to the pool of the LLC where they previously ran and each LLC dispatches
+    /// its own tasks to its idle CPUs, preserving cache locality. When an LLC has idle CPUs, but
+    /// no tasks, it steals tasks from the busiest LLC.
+    ///
+    /// This can improve scalability and throughput on systems with multiple LLCs, at the cost of
+    /// a less strict global vruntime ordering.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    llc_shards: bool,
+
     /// If specified, only tasks which have their scheduling policy set to
     /// SCHED_EXT using sched_setscheduler(2) are switched. Otherwise, all
     /// tasks are switched.
@@ -198,7 +231,7 @@ impl TaskInfoMap {
     }
 }
 
-#[derive(Debug, PartialEq, Eq, PartialOrd, Clone)]
+#[derive(Debug, Default, PartialEq, Eq, PartialOrd, Clone)]
 struct Task {
     qtask: QueuedTask,    // queued task
     vruntime: u64,        // total vruntime (that determines the order how tasks are dispatched)
@@ -207,72 +240,268 @@ struct Task {
 
 // Make sure tasks are ordered by vruntime, if multiple tasks have the same vruntime order by pid.
 impl Ord for Task {
-    fn cmp(&self, other: &Self) -> std::cmp::Ordering {
+    fn cmp(&self, other: &Self) -> CmpOrdering {
         self.vruntime
             .cmp(&other.vruntime)
             .then_with(|| self.qtask.pid.cmp(&other.qtask.pid))
     }
 }
 
-// Task pool where all the tasks that needs to run are stored before dispatching
-// (ordered by vruntime using a BTreeSet).
-struct TaskTree {
-    tasks: BTreeSet<Task>,
-    task_map: HashMap<i32, Task>, // Map from pid to task
+// Slot of the task pool slab.
+#[derive(Debug)]
+struct TaskSlot {
+    task: Task,   // queued task
+    shard: usize, // shard where the task is queued
+    pos: usize,   // position of the task in the shard's heap
+}
+
+// Task pool where all the tasks that needs to run are stored before dispatching.
+//
+// Tasks are stored in a slab, indexed by pid, and each shard keeps a binary min-heap of slab
+// indices ordered by vruntime (items with the same vruntime are sorted by pid). Slab slots are
+// recycled, so in steady state pushing and popping tasks doesn't allocate any memory: the pid
+// map is sized to pid_max upfront and the slab and heaps are preallocated to TASK_POOL_CAPACITY,
+// only growing if more tasks than that are ever queued at the same time.
+//
+// With a single shard the pool behaves as a global vruntime-ordered queue. With per-LLC shards
+// each task is queued to the shard of the CPU where it previously ran.
+struct TaskPool {
+    slots: Vec<TaskSlot>,    // slab of queued tasks
+    free: Vec<usize>,        // free slab slots
+    pid_slot: Vec<u32>,      // map pids to slab slots (slot + 1, 0 = task not queued)
+    shards: Vec<Vec<usize>>, // per-shard heaps of slab slots
+    cpu_shard: Vec<usize>,   // map CPUs to shards
+    nr_tasks: usize,         // total amount of queued tasks
 }
 
+// Initial capacity of the task pool slab.
+const TASK_POOL_CAPACITY: usize = 8192;
+
+// Fallback if the maximum pid can't be read from procfs (kernel default on 64-bit hosts).
+const DEFAULT_PID_MAX: usize = 4194304;
+
 // Task pool methods (push / pop).
-impl TaskTree {
-    fn new() -> Self {
-        TaskTree {
-            tasks: BTreeSet::new(),
-            task_map: HashMap::new(),
+impl TaskPool {
+    fn new(nr_shards: usize, cpu_shard: Vec<usize>) -> Self {
+        let pid_max = std::fs::read_to_string("/proc/sys/kernel/pid_max")
+            .ok()
+            .and_then(|val| val.trim().parse::<usize>().ok())
+            .unwrap_or(DEFAULT_PID_MAX);
+        let nr_shards = nr_shards.max(1);
+
+        TaskPool {
+            slots: Vec::with_capacity(TASK_POOL_CAPACITY),
+            free: Vec::with_capacity(TASK_POOL_CAPACITY),
+            pid_slot: vec![0; pid_max + 1],
+            shards: (0..nr_shards)
+                .map(|_| Vec::with_capacity(TASK_POOL_CAPACITY / nr_shards))
+                .collect(),
+            cpu_shard,
+            nr_tasks: 0,
+        }
+    }
+
+    // Return the total amount of queued tasks.
+    fn len(&self) -> usize {
+        self.nr_tasks
+    }
+
+    // Return the amount of shards of the pool.
+    fn nr_shards(&self) -> usize {
+        self.shards.len()
+    }
+
+    // Return the shard associated to a CPU.
+    fn cpu_to_shard(&self, cpu: i32) -> usize {
+        match self.cpu_shard.get(cpu as usize) {
+            Some(&shard) if shard < self.shards.len() => shard,
+            _ => 0,
+        }
+    }
+
+    fn less(&self, a: usize, b: usize) -> bool {
+        self.slots[a].task.cmp(&self.slots[b].task) == CmpOrdering::Less
+    }
+
+    fn heap_set(&mut self, shard: usize, pos: usize, idx: usize) {
+        self.shards[shard][pos] = idx;
+        self.slots[idx].pos = pos;
+    }
+
+    fn sift_up(&mut self, shard: usize, mut pos: usize) {
+        let idx = self.shards[shard][pos];
+
+        while pos > 0 {
+            let parent = (pos - 1) / 2;
+            let parent_idx = self.shards[shard][parent];
+            if !self.less(idx, parent_idx) {
+                break;
+            }
+            self.heap_set(shard, pos, parent_idx);
+            pos = parent;
         }
+        self.heap_set(shard, pos, idx);
     }
 
-    // Add an item to the pool (item will be placed in the tree depending on its vruntime, items
-    // with the same vruntime will be sorted by pid).
+    fn sift_down(&mut self, shard: usize, mut pos: usize) {
+        let idx = self.shards[shard][pos];
+        let len = self.shards[shard].len();
+
+        loop {
+            let mut child = pos * 2 + 1;
+            if child >= len {
+                break;
+            }
+            if child + 1 < len
+                && self.less(self.shards[shard][child + 1], self.shards[shard][child])
+            {
+                child += 1;
+            }
+            let child_idx = self.shards[shard][child];
+            if !self.less(child_idx, idx) {
+                break;
+            }
+            self.heap_set(shard, pos, child_idx);
+            pos = child;
+        }
+        self.heap_set(shard, pos, idx);
+    }
+
+    fn heap_insert(&mut self, shard: usize, idx: usize) {
+        self.shards[shard].push(idx);
+        self.sift_up(shard, self.shards[shard].len() - 1);
+    }
+
+    fn heap_remove(&mut self, shard: usize, pos: usize) -> usize {
+        let idx = self.shards[shard].swap_remove(pos);
+
+        if pos < self.shards[shard].len() {
+            let moved = self.shards[shard][pos];
+            self.slots[moved].pos = pos;
+            self.sift_up(shard, pos);
+            self.sift_down(shard, self.slots[moved].pos);
+        }
+        idx
+    }
+
+    // Add an item to the pool (item will be placed in the heap of the shard associated to the
+    // task's CPU, depending on its vruntime). If the task is already queued, it is updated in
+    // place.
     fn push(&mut self, task: Task) {
-        // Check if task already exists.
-        if let Some(prev_task) = self.task_map.get(&task.qtask.pid) {
-            self.tasks.remove(prev_task);
+        let pid = task.qtask.pid as usize;
+        let shard = self.cpu_to_shard(task.qtask.cpu);
+
+        // pid_max can be raised at runtime, so keep it as a slow path.
+        if pid >= self.pid_slot.len() {
+            self.pid_slot.resize(pid + 1, 0);
         }
+        match self.pid_slot[pid] {
+            0 => {
+                let slot = TaskSlot {
+                    task,
+                    shard,
+                    pos: 0,
+                };
+                let idx = match self.free.pop() {
+                    Some(idx) => {
+                        self.slots[idx] = slot;
+                        idx
+                    }
+                    None => {
+                        self.slots.push(slot);
+                        self.slots.len() - 1
+                    }
+                };
+                self.pid_slot[pid] = idx as u32 + 1;
+                self.nr_tasks += 1;
+                self.heap_insert(shard, idx);
+            }
+            slot => {
+                let idx = slot as usize - 1;
+                let prev_shard = self.slots[idx].shard;
+                let pos = self.slots[idx].pos;
+
+                self.heap_remove(prev_shard, pos);
+                self.slots[idx].task = task;
+                self.slots[idx].shard = shard;
+                self.heap_insert(shard, idx);
+            }
+        }
+    }
 
-        // Insert/update task.
-        self.tasks.insert(task.clone());
-        self.task_map.insert(task.qtask.pid, task);
+    // Pop the item with the smallest vruntime from a shard.
+    fn pop_shard(&mut self, shard: usize) -> Option<Task> {
+        if self.shards[shard].is_empty() {
+            return None;
+        }
+        let idx = self.heap_remove(shard, 0);
+        let task = std::mem::take(&mut self.slots[idx].task);
+
+        self.pid_slot[task.qtask.pid as usize] = 0;
+        self.free.push(idx);
+        self.nr_tasks -= 1;
+
+        Some(task)
     }
 
-    // Pop the first item from the BTreeSet (item with the smallest vruntime).
-    fn pop(&mut self) -> Option<Task> {
-        if let Some(task) = self.tasks.pop_first() {
-            self.task_map.remove(&task.qtask.pid);
-            Some(task)
-        } else {
-            None
+    // Pop the item with the smallest vruntime from a shard. If the shard is empty steal the item
+    // with the smallest vruntime from the busiest shard.
+    //
+    // Return the task along with a flag that indicates whether the task has been stolen.
+    fn pop(&mut self, shard: usize) -> Option<(Task, bool)> {
+        if let Some(task) = self.pop_shard(shard) {
+            return Some((task, false));
         }
+        let victim = (0..self.shards.len()).max_by_key(|&s| self.shards[s].len())?;
+
+        self.pop_shard(victim).map(|task| (task, true))
     }
 }
 
 // Main scheduler object
 struct Scheduler<'a> {
-    bpf: BpfScheduler<'a>, // BPF connector
-    topo_map: TopologyMap, // Host topology
-    task_pool: TaskTree,   // tasks ordered by vruntime
-    task_map: TaskInfoMap, // map pids to the corresponding task information
-    min_vruntime: u64,     // Keep track of the minimum vruntime across all tasks
-    max_vruntime: u64,     // Keep track of the maximum vruntime across all tasks
-    slice_ns: u64,         // Default time slice (in ns)
-    slice_boost: u64,      // Slice booster
-    init_page_faults: u64, // Initial page faults counter
-    no_preemption: bool,   // Disable task preemption
-    full_user: bool,       // Run all tasks through the user-space scheduler
+    bpf: BpfScheduler<'a>,             // BPF connector
+    topo_map: TopologyMap,             // Host topology
+    task_pool: TaskPool,               // tasks ordered by vruntime
+    task_map: TaskInfoMap,             // map pids to the corresponding task information
+    queued_buf: Vec<QueuedTask>,       // buffer of tasks received from the BPF dispatcher
+    dispatch_buf: Vec<DispatchedTask>, // batch of tasks to send to the BPF dispatcher
+    dispatch_pending: Vec<Task>,       // tasks of the current dispatch batch
+    shard_idle: Vec<usize>,            // amount of idle cores in each task pool shard
+    shard_idle_cpus: Vec<Vec<i32>>,    // idle CPUs in each task pool shard
+    shard_cursor: usize,               // first shard to dispatch from (round-robin)
+    min_vruntime: u64,                 // Keep track of the minimum vruntime across all tasks
+    max_vruntime: u64,                 // Keep track of the maximum vruntime across all tasks
+    slice_ns: u64,                     // Default time slice (in ns)
+    slice_boost: u64,                  // Slice booster
+    init_page_faults: u64,             // Initial page faults counter
+    no_preemption: bool,               // Disable task preemption
+    full_user: bool,                   // Run all tasks through the user-space scheduler
+    decision_lat: Option<LatHist>,     // Decision latency at the last stats update (if enabled)
 }
 
 impl<'a> Scheduler<'a> {
     fn init(opts: &Opts) -> Result<Self> {
         // Initialize core mapping topology.
         let topo = Topology::new().expect("Failed to build host topology");
+
+        // Map each CPU to its task pool shard (one shard per LLC, or a single global shard).
+        let mut cpu_shard = vec![0; topo.nr_cpus_possible()];
+        let mut nr_shards = 1;
+        if opts.llc_shards {
+            nr_shards = 0;
+            for node in topo.nodes() {
+                for llc in node.llcs().values() {
+                    for cpu in llc.span().clone().into_iter() {
+                        if cpu < cpu_shard.len() {
+                            cpu_shard[cpu] = nr_shards;
+                        }
+                    }
+                    nr_shards += 1;
+                }
+            }
+            nr_shards = nr_shards.max(1);
+        }
         let topo_map = TopologyMap::new(topo).expect("Failed to generate topology map");
 
         // Save the default time slice (in ns) in the scheduler class.
@@ -288,11 +517,21 @@ impl<'a> Scheduler<'a> {
         let full_user = opts.full_user;
 
         // Scheduler task pool to sort tasks by vruntime.
-        let task_pool = TaskTree::new();
+        let task_pool = TaskPool::new(nr_shards, cpu_shard);
+        let shard_idle = vec![0; task_pool.nr_shards()];
+        let shard_idle_cpus = (0..task_pool.nr_shards())
+            .map(|_| Vec::with_capacity(topo_map.nr_cpus_possible()))
+            .collect();
 
         // Scheduler task map to store tasks information.
         let task_map = TaskInfoMap::new();
 
+        // Preallocate the buffers used to exchange batches of tasks with the BPF component, to
+        // prevent allocations in the scheduling path.
+        let queued_buf = vec![QueuedTask::default(); MAX_DEQUEUE_BATCH];
+        let dispatch_buf = Vec::with_capacity(MAX_DISPATCH_BATCH);
+        let dispatch_pending = Vec::with_capacity(MAX_DISPATCH_BATCH);
+
         // Initialize global minimum and maximum vruntime.
         let min_vruntime: u64 = 0;
         let max_vruntime: u64 = 0;
@@ -302,17 +541,27 @@ impl<'a> Scheduler<'a> {
 
         // Low-level BPF connector.
         let nr_cpus = topo_map.nr_cpus_possible();
-        let bpf = BpfScheduler::init(
-            opts.slice_us,
-            nr_cpus as i32,
-            opts.partial,
-            opts.exit_dump_len,
-            opts.full_user,
-            opts.low_power,
-            !opts.disable_fifo,
-            opts.debug,
-        )?;
-        info!("{} scheduler attached - {} CPUs", SCHEDULER_NAME, nr_cpus);
+        let bpf = BpfScheduler::init(&BpfSchedulerOpts {
+            slice_us: opts.slice_us,
+            nr_cpus_online: nr_cpus as i32,
+            partial: opts.partial,
+            exit_dump_len: opts.exit_dump_len,
+            full_user: opts.full_user,
+            low_power: opts.low_power,
+            fifo_sched: !opts.disable_fifo,
+            wakeup_batch: opts.wakeup_batch,
+            wakeup_delay_us: opts.wakeup_delay_us,
+            busy_poll_cpu: opts.busy_poll_cpu,
+            lathist: opts.lathist,
+            numa_workers: false,
+            debug: opts.debug,
+        })?;
+        info!(
+            "{} scheduler attached - {} CPUs, {} task pool shards",
+            SCHEDULER_NAME,
+            nr_cpus,
+            task_pool.nr_shards()
+        );
 
         // Return scheduler object.
         Ok(Self {
@@ -320,6 +569,12 @@ impl<'a> Scheduler<'a> {
             topo_map,
             task_pool,
             task_map,
+            queued_buf,
+            dispatch_buf,
+            dispatch_pending,
+            shard_idle,
+            shard_idle_cpus,
+            shard_cursor: 0,
             min_vruntime,
             max_vruntime,
             slice_ns,
@@ -327,29 +582,35 @@ impl<'a> Scheduler<'a> {
             init_page_faults,
             no_preemption,
             full_user,
+            decision_lat: match opts.lathist {
+                true => Some(LatHist::default()),
+                false => None,
+            },
         })
     }
 
-    // Return the amount of idle cores.
+    // Return the amount of idle cores, updating the amount of idle cores and an idle CPU of each
+    // task pool shard.
     //
     // On SMT systems consider only one CPU for each fully idle core, to avoid disrupting
     // performnance too much by running multiple tasks in the same core.
+    //
+    // The idle cores are read from the idle bitmap maintained by the BPF component, cores picked
+    // by a previous round that are not running their task yet are not counted again.
     fn nr_idle_cpus(&mut self) -> usize {
         let mut idle_cpu_count = 0;
 
-        // Count the number of cores where all the CPUs are idle.
-        for core in self.topo_map.iter() {
-            let mut all_idle = true;
-            for cpu_id in core {
-                if self.bpf.get_cpu_pid(*cpu_id as i32) != 0 {
-                    all_idle = false;
-                    break;
-                }
-            }
-
-            if all_idle {
-                idle_cpu_count += 1;
-            }
+        self.shard_idle.fill(0);
+        self.shard_idle_cpus
+            .iter_mut()
+            .for_each(|cpus| cpus.clear());
+
+        self.bpf.refresh_idle_cpus();
+        for cpu in self.bpf.idle_cores() {
+            let shard = self.task_pool.cpu_to_shard(cpu as i32);
+            idle_cpu_count += 1;
+            self.shard_idle[shard] += 1;
+            self.shard_idle_cpus[shard].push(cpu as i32);
         }
 
         idle_cpu_count
@@ -466,31 +727,35 @@ impl<'a> Scheduler<'a> {
     // then push them all to the task pool (doing so will sort them by their vruntime).
     fn drain_queued_tasks(&mut self) {
         loop {
-            match self.bpf.dequeue_task() {
-                Ok(Some(task)) => {
-                    // Check for exiting tasks (cpu < 0) and remove their corresponding entries in
-                    // the task map (if present).
-                    if task.cpu < 0 {
-                        self.task_map.tasks.remove(&task.pid);
-                        continue;
-                    }
+            match self.bpf.dequeue_tasks(&mut self.queued_buf) {
+                Ok(nr) if nr > 0 => {
+                    for i in 0..nr {
+                        let task = std::mem::take(&mut self.queued_buf[i]);
+
+                        // Check for exiting tasks (cpu < 0) and remove their corresponding entries
+                        // in the task map (if present).
+                        if task.cpu < 0 {
+                            self.task_map.tasks.remove(&task.pid);
+                            continue;
+                        }
 
-                    // Update task information and determine vruntime and interactiveness.
-                    let (vruntime, is_interactive) = self.update_enqueued(&task);
+                        // Update task information and determine vruntime and interactiveness.
+                        let (vruntime, is_interactive) = self.update_enqueued(&task);
 
-                    // Insert task in the task pool (ordered by vruntime).
-                    self.task_pool.push(Task {
-                        qtask: task,
-                        vruntime,
-                        is_interactive,
-                    });
+                        // Insert task in the task pool (ordered by vruntime).
+                        self.task_pool.push(Task {
+                            qtask: task,
+                            vruntime,
+                            is_interactive,
+                        });
+                    }
                 }
-                Ok(None) => {
+                Ok(_) => {
                     // Reset nr_queued and update nr_scheduled, to notify the dispatcher that
                     // queued tasks are drained, but there is still some work left to do in the
                     // scheduler.
                     self.bpf
-                        .update_tasks(Some(0), Some(self.task_pool.tasks.len() as u64));
+                        .update_tasks(Some(0), Some(self.task_pool.len() as u64));
                     break;
                 }
                 Err(err) => {
@@ -501,6 +766,148 @@ impl<'a> Scheduler<'a> {
         }
     }
 
+    // Send the current batch of tasks to the BPF dispatcher.
+    //
+    // Tasks that can't be dispatched are re-added to the task pool. Return false if the whole
+    // batch couldn't be dispatched, to notify the caller to stop dispatching.
+    fn flush_dispatch_batch(&mut self) -> bool {
+        if self.dispatch_buf.is_empty() {
+            return true;
+        }
+        let nr = self.bpf.dispatch_tasks(&self.dispatch_buf).unwrap_or(0);
+        let done = nr == self.dispatch_buf.len();
+
+        // Re-add the tasks to the task pool in case of failure.
+        for task in self.dispatch_pending.drain(nr..) {
+            self.task_pool.push(task);
+        }
+        self.dispatch_pending.clear();
+        self.dispatch_buf.clear();
+
+        done
+    }
+
+    // Add a task to the current dispatch batch, sending the batch to the BPF dispatcher when it's
+    // full. If @target_cpu is set the task is dispatched to that CPU.
+    //
+    // Return false if the batch couldn't be dispatched, to notify the caller to stop dispatching.
+    fn dispatch_task(&mut self, task: Task, target_cpu: Option<i32>) -> bool {
+        // Determine the task's virtual time slice.
+        //
+        // The goal is to evaluate the optimal time slice, considering the vruntime as
+        // a deadline for the task to complete its work before releasing the CPU.
+        //
+        // This is accomplished by calculating the difference between the task's
+        // vruntime and the global current vruntime and use this value as the task time
+        // slice.
+        //
+        // In this way, tasks that "promise" to release the CPU quickly (based on
+        // their previous work pattern) get a much higher priority (due to
+        // vruntime-based scheduling and the additional priority boost for being
+        // classified as interactive), but they are also given a shorter time slice
+        // to complete their work and fulfill their promise of rapidity.
+        //
+        // At the same time tasks that are more CPU-intensive get de-prioritized, but
+        // they will also tend to have a longer time slice available, reducing in this
+        // way the amount of context switches that can negatively affect their
+        // performance.
+        //
+        // In conclusion, latency-sensitive tasks get a high priority and a short time
+        // slice (and they can preempt other tasks), CPU-intensive tasks get low
+        // priority and a long time slice.
+        //
+        // Moreover, ensure that the time slice is never less than 0.25 ms to prevent
+        // excessive penalty from assigning time slices that are too short and reduce
+        // context switch overhead.
+        //
+        // NOTE: with per-LLC shards tasks are not dispatched in strict global vruntime order,
+        // so the vruntime of a task can be lower than the current global minimum vruntime.
+        let slice_ns = task
+            .vruntime
+            .saturating_sub(self.min_vruntime)
+            .clamp(NSEC_PER_MSEC / 4, self.slice_ns);
+
+        // Update global minimum vruntime.
+        self.min_vruntime = self.min_vruntime.max(task.vruntime);
+
+        // Create a new task to dispatch.
+        let mut dispatched_task = DispatchedTask::new(&task.qtask);
+
+        dispatched_task.set_slice_ns(slice_ns);
+
+        if task.is_interactive {
+            // Dispatch interactive tasks on the first CPU available: the idle CPUs seen by the
+            // scheduler may be already busy by the time the task is dispatched.
+            dispatched_task.set_flag(RL_CPU_ANY);
+
+            // Interactive tasks can preempt other tasks.
+            if !self.no_preemption {
+                dispatched_task.set_flag(RL_PREEMPT_CPU);
+            }
+        } else {
+            // A task stolen from a different shard is moved to an idle CPU of the shard that
+            // stole it, other tasks are moved to an idle CPU close to their previous CPU (if
+            // any).
+            let idle_cpu = match target_cpu {
+                Some(cpu) => cpu,
+                None => self.bpf.pick_idle_cpu(&task.qtask),
+            };
+            if idle_cpu >= 0 {
+                dispatched_task.set_cpu(idle_cpu);
+            }
+        }
+
+        // In full-user mode we skip the built-in idle selection logic, so simply
+        // dispatch all the tasks on the first CPU available.
+        if self.full_user {
+            dispatched_task.set_flag(RL_CPU_ANY);
+        }
+
+        // Add the task to the current batch, sending the batch to the BPF dispatcher when it's
+        // full.
+        self.dispatch_buf.push(dispatched_task);
+        self.dispatch_pending.push(task);
+        if self.dispatch_buf.len() >= MAX_DISPATCH_BATCH {
+            return self.flush_dispatch_batch();
+        }
+        true
+    }
+
+    // Dispatch up to @nr_tasks tasks from a task pool shard, stealing tasks from the other shards
+    // if the shard runs out of tasks (unless @local_only is set).
+    //
+    // Return false if dispatching failed or all the shards are empty.
+    //
+    // Stolen tasks are spread across the idle CPUs of the shard.
+    fn dispatch_shard(&mut self, shard: usize, nr_tasks: usize, local_only: bool) -> bool {
+        let mut nr_stolen = 0;
+
+        for _ in 0..nr_tasks {
+            let (task, stolen) = if local_only {
+                match self.task_pool.pop_shard(shard) {
+                    Some(task) => (task, false),
+                    None => return true,
+                }
+            } else {
+                match self.task_pool.pop(shard) {
+                    Some(item) => item,
+                    None => return false,
+                }
+            };
+            let idle_cpus = &self.shard_idle_cpus[shard];
+            let target_cpu = if stolen && !idle_cpus.is_empty() {
+                nr_stolen += 1;
+                Some(idle_cpus[(nr_stolen - 1) % idle_cpus.len()])
+            } else {
+                None
+            };
+            if !self.dispatch_task(task, target_cpu) {
+                return false;
+            }
+        }
+        true
+    }
+
     // Return the target time slice, proportionally adjusted based on the total amount of tasks
     // waiting to be scheduled (more tasks waiting => shorter time slice).
     // Dispatch tasks from the task pool in order (sending them to the BPF dispatcher).
@@ -511,91 +918,38 @@ impl<'a> Scheduler<'a> {
         // dispatcher queues and giving a chance to higher priority tasks to come in and get
         // dispatched earlier, mitigating potential priority inversion issues.
         let delta_slice = self.max_vruntime - self.min_vruntime;
-        let nr_tasks = if delta_slice <= self.slice_ns {
-            self.nr_idle_cpus().max(1)
-        } else {
-            // Scheduler is getting congested, flush all tasks that are waiting to be scheduled to
-            // mitigate excessive starvation.
-            usize::MAX
-        };
-        for _ in 0..nr_tasks {
-            match self.task_pool.pop() {
-                Some(task) => {
-                    // Determine the task's virtual time slice.
-                    //
-                    // The goal is to evaluate the optimal time slice, considering the vruntime as
-                    // a deadline for the task to complete its work before releasing the CPU.
-                    //
-                    // This is accomplished by calculating the difference between the task's
-                    // vruntime and the global current vruntime and use this value as the task time
-                    // slice.
-                    //
-                    // In this way, tasks that "promise" to release the CPU quickly (based on
-                    // their previous work pattern) get a much higher priority (due to
-                    // vruntime-based scheduling and the additional priority boost for being
-                    // classified as interactive), but they are also given a shorter time slice
-                    // to complete their work and fulfill their promise of rapidity.
-                    //
-                    // At the same time tasks that are more CPU-intensive get de-prioritized, but
-                    // they will also tend to have a longer time slice available, reducing in this
-                    // way the amount of context switches that can negatively affect their
-                    // performance.
-                    //
-                    // In conclusion, latency-sensitive tasks get a high priority and a short time
-                    // slice (and they can preempt other tasks), CPU-intensive tasks get low
-                    // priority and a long time slice.
-                    //
-                    // Moreover, ensure that the time slice is never less than 0.25 ms to prevent
-                    // excessive penalty from assigning time slices that are too short and reduce
-                    // context switch overhead.
-                    let slice_ns =
-                        (task.vruntime - self.min_vruntime).clamp(NSEC_PER_MSEC / 4, self.slice_ns);
-
-                    // Update global minimum vruntime.
-                    self.min_vruntime = task.vruntime;
-
-                    // Create a new task to dispatch.
-                    let mut dispatched_task = DispatchedTask::new(&task.qtask);
-
-                    dispatched_task.set_slice_ns(slice_ns);
-
-                    if task.is_interactive {
-                        // Dispatch interactive tasks on the first CPU available.
-                        dispatched_task.set_flag(RL_CPU_ANY);
-
-                        // Interactive tasks can preempt other tasks.
-                        if !self.no_preemption {
-                            dispatched_task.set_flag(RL_PREEMPT_CPU);
-                        }
-                    }
+        let congested = delta_slice > self.slice_ns;
+        let nr_idle = self.nr_idle_cpus();
+        let nr_shards = self.task_pool.nr_shards();
 
-                    // In full-user mode we skip the built-in idle selection logic, so simply
-                    // dispatch all the tasks on the first CPU available.
-                    if self.full_user {
-                        dispatched_task.set_flag(RL_CPU_ANY);
-                    }
+        if !congested && nr_idle == 0 {
+            // Always dispatch at least one task.
+            self.shard_idle[self.shard_cursor % nr_shards] = 1;
+        }
 
-                    // Send task to the BPF dispatcher.
-                    match self.bpf.dispatch_task(&dispatched_task) {
-                        Ok(_) => {}
-                        Err(_) => {
-                            /*
-                             * Re-add the task to the dispatched list in case of failure and stop
-                             * dispatching.
-                             */
-                            self.task_pool.push(task);
-                            break;
-                        }
-                    }
-                }
-                None => break,
+        // Dispatch tasks from each shard, starting from a different shard at each round to
+        // prevent starving the last shards.
+        for i in 0..nr_shards {
+            let shard = (self.shard_cursor + i) % nr_shards;
+            let nr_tasks = if congested {
+                // Scheduler is getting congested, flush all tasks that are waiting to be
+                // scheduled to mitigate excessive starvation.
+                usize::MAX
+            } else {
+                self.shard_idle[shard]
+            };
+            if !self.dispatch_shard(shard, nr_tasks, congested) {
+                break;
             }
         }
+        self.shard_cursor = (self.shard_cursor + 1) % nr_shards;
+
+        self.flush_dispatch_batch();
         // Update nr_scheduled to notify the dispatcher that all the tasks received by the
         // scheduler has been dispatched, so there is no reason to re-activate the scheduler,
         // unless more tasks are queued.
         self.bpf
-            .update_tasks(None, Some(self.task_pool.tasks.len() as u64));
+            .update_tasks(None, Some(self.task_pool.len() as u64));
     }
 
     // Main scheduling function (called in a loop to periodically drain tasks from the queued list
@@ -604,8 +958,13 @@ impl<'a> Scheduler<'a> {
         self.drain_queued_tasks();
         self.dispatch_tasks();
 
-        // Yield to avoid using too much CPU from the scheduler itself.
-        thread::yield_now();
+        // Yield to avoid using too much CPU from the scheduler itself, unless the BPF part asks
+        // to keep polling for new tasks (the scheduler has its own CPU in this case).
+        if self.bpf.busy_polling() {
+            std::hint::spin_loop();
+        } else {
+            thread::yield_now();
+        }
     }
 
     // Get total page faults from /proc/self/stat.
@@ -732,6 +1091,31 @@ impl<'a> Scheduler<'a> {
             nr_running, nr_waiting, nr_queued, nr_scheduled
         );
 
+        // Show the wakeups of the scheduler and how long it takes to dispatch the queued tasks.
+        let nr_usersched_wakeups = *self.bpf.nr_usersched_wakeups_mut();
+        let nr_coalesced_wakeups = *self.bpf.nr_coalesced_wakeups_mut();
+        info!(
+            "  nr_usersched_wakeups={} nr_coalesced_wakeups={} busy_poll={}",
+            nr_usersched_wakeups,
+            nr_coalesced_wakeups,
+            self.bpf.busy_polling(),
+        );
+        if let Some(prev) = self.decision_lat.as_mut() {
+            match self.bpf.decision_lat() {
+                Ok(decision_lat) => {
+                    let lat = decision_lat.delta(prev);
+                    info!(
+                        "  decision_lat: avg={:.1}us p50<{}us p99<{}us",
+                        lat.mean() / NSEC_PER_USEC as f64,
+                        lat.percentile(50.0) / NSEC_PER_USEC,
+                        lat.percentile(99.0) / NSEC_PER_USEC,
+                    );
+                    *prev = decision_lat;
+                }
+                Err(e) => warn!("Failed to read decision latency: {:?}", e),
+            }
+        }
+
         // Show total page faults of the user-space scheduler.
         self.print_faults();
 
@@ -15,17 +15,18 @@
 
 #ifndef __KERNEL__
 typedef unsigned char u8;
+typedef int s32;
 typedef unsigned int u32;
 typedef unsigned long long u64;
 #endif
 
+#include <scx/cacheline.h>
 #include <scx/ravg.bpf.h>
 
 enum consts {
 	MAX_CPUS		= 512,
 	MAX_DOMS		= 64,	/* limited to avoid complex bitmask ops */
 	MAX_NUMA_NODES		= MAX_DOMS,	/* Assume at least 1 domain per NUMA node */
-	CACHELINE_SIZE		= 64,
 	NO_DOM_FOUND		= MAX_DOMS + 1,
 
 	LB_DEFAULT_WEIGHT	= 100,
@@ -49,16 +50,44 @@ enum consts {
 	DL_MAX_LATENCY_NS	= (50 * NSEC_PER_MSEC),
 	DL_FREQ_FT_MAX		= 100000,
 	DL_MAX_LAT_PRIO		= 39,
+	DL_LOG_SHIFT		= 8,	/* fixed point shift of log2 values */
+	DL_CHAIN_DECAY		= 1 << DL_LOG_SHIFT, /* lat prio lost per wake hop */
 
 	/*
 	 * When userspace load balancer is trying to determine the tasks to push
 	 * out from an overloaded domain, it looks at the the following number
-	 * of recently active tasks of the domain. While this may lead to
-	 * spurious migration victim selection failures in pathological cases,
-	 * this isn't a practical problem as the LB rounds are best-effort
-	 * anyway and will be retried until loads are balanced.
+	 * of heaviest tasks of the domain that have been active since the
+	 * previous load balancing round.
+	 *
+	 * This used to be the 1024 most recently active pids, but a push
+	 * domain only sheds up to half of its imbalance per round and the
+	 * heaviest tasks are tried first, so the victims are practically
+	 * always among the first few candidates. The incremental balancer
+	 * also merges the candidates of the previous rounds, and a domain
+	 * that's still imbalanced gets a fresh set in the next round. Keeping
+	 * the set small keeps the sorted insertion on the stopping path cheap.
 	 */
-	MAX_DOM_ACTIVE_PIDS	= 1024,
+	LB_TOPK_TASKS		= 32,	/* Must be a power of 2 */
+
+	/*
+	 * A task which is already a candidate in the current generation is
+	 * only updated again if its load moved by more than 1/2^this.
+	 */
+	LB_CAND_LOAD_SHIFT	= 3,
+
+	/*
+	 * An idle CPU steals up to this many tasks, and at most half of the
+	 * victim's queued tasks, at once.
+	 */
+	DOM_STEAL_BATCH		= 4,
+
+	/*
+	 * With --handoff, the state saved by the previous instance is adopted
+	 * if it's younger than this. Up to this many tasks are saved.
+	 */
+	HANDOFF_MAX_AGE_NS	= 10 * NSEC_PER_SEC,
+	HANDOFF_MAX_TASKS	= 65536,
+	HANDOFF_VERSION		= 1,	/* bump when struct handoff_* change */
 };
 
 /* Statistics */
@@ -87,10 +116,43 @@ enum stat_idx {
 	/* Deadline related stats */
 	RUSTY_STAT_DL_CLAMP,
 	RUSTY_STAT_DL_PRESET,
+	RUSTY_STAT_DL_CHAIN_BOOST,
+	RUSTY_STAT_DL_UPDATE_NS,
+	RUSTY_STAT_DL_UPDATE_CNT,
+
+	/* State adopted from the previous instance, see --handoff */
+	RUSTY_STAT_HANDOFF_TASK,
+	RUSTY_STAT_HANDOFF_DOM,
 
 	RUSTY_NR_STATS,
 };
 
+/*
+ * Latency criticality state of a task, see task_compute_dl(). The waker and
+ * blocked frequencies are EWMAs whose log2 values are cached when they're
+ * updated, so that task_compute_dl() can work on sums instead of products.
+ * All log2 values are DL_LOG_SHIFT fixed point.
+ */
+struct task_lat {
+	u64 last_blocked_at;
+	u64 last_woke_at;
+
+	/* frequency with which a task is blocked (consumer) */
+	u64 blocked_freq;
+	/* frequency with which a task wakes other tasks (producer) */
+	u64 waker_freq;
+
+	/* log2 of blocked_freq and waker_freq, capped at DL_FREQ_FT_MAX */
+	u16 blocked_log;
+	u16 waker_log;
+	/* log2 of the task's scaled average runtime */
+	u16 runtime_log;
+	/* lat prio inherited from the waker, see rusty_runnable() */
+	u16 chain_prio;
+	/* lat prio computed by the last task_compute_dl() */
+	u16 lat_prio;
+};
+
 struct task_ctx {
 	/* The domains this task can run on */
 	u64 dom_mask;
@@ -100,20 +162,15 @@ struct task_ctx {
 	u32 dom_id;
 	u32 weight;
 	bool runnable;
-	u64 dom_active_pids_gen;
+	u64 lb_cand_gen;
+	u64 lb_cand_load;	/* load when last recorded in lb_cand_gen */
 	u64 deadline;
 
 	u64 sum_runtime;
 	u64 avg_runtime;
 	u64 last_run_at;
 
-	/* frequency with which a task is blocked (consumer) */
-	u64 blocked_freq;
-	u64 last_blocked_at;
-
-	/* frequency with which a task wakes other tasks (producer) */
-	u64 waker_freq;
-	u64 last_woke_at;
+	struct task_lat lat;
 
 	/* The task is a workqueue worker thread */
 	bool is_kworker;
@@ -124,6 +181,10 @@ struct task_ctx {
 	/* select_cpu() telling enqueue() to queue directly on the DSQ */
 	bool dispatch_local;
 
+	/* domain whose dom_queued the task is accounted in, or NO_DOM_FOUND */
+	u32 queued_dom;
+	u32 queued_weight;
+
 	struct ravg_data dcyc_rd;
 };
 
@@ -132,20 +193,96 @@ struct bucket_ctx {
 	struct ravg_data rd;
 };
 
+/*
+ * The cpumasks are read on every wakeup, min_vruntime is written whenever a
+ * task of the domain starts running, and the load buckets are written on every
+ * schedule. Keep each group on its own cachelines.
+ */
 struct dom_ctx {
 	u32 id;
 	struct bpf_cpumask __kptr *cpumask;
 	struct bpf_cpumask __kptr *direct_greedy_cpumask;
 	struct bpf_cpumask __kptr *node_cpumask;
 
-	u64 min_vruntime;
+	u64 min_vruntime __scx_cacheline_aligned;
 
-	u64 dbg_dcycle_printed_at;
+	u64 dbg_dcycle_printed_at __scx_cacheline_aligned;
 	struct bucket_ctx buckets[LB_LOAD_BUCKETS];
+} __scx_cacheline_aligned;
+SCX_ASSERT_CACHELINE_ALIGNED(struct dom_ctx);
+SCX_ASSERT_CACHELINE_START(struct dom_ctx, min_vruntime);
+SCX_ASSERT_CACHELINE_START(struct dom_ctx, dbg_dcycle_printed_at);
+
+/*
+ * Migration candidate of a domain, see struct dom_lb_cands.
+ */
+struct lb_cand {
+	s32 pid;
+	u32 weight;
+	u64 dom_mask;
+	struct ravg_data dcyc_rd; /* duty cycle when the task last stopped */
+	u64 load;	/* dcycle scaled by weight, used to order candidates */
+	u64 gen;	/* dom_lb_cands gen when the candidate was updated */
+	bool is_kworker;
 };
 
+/*
+ * The heaviest tasks of a domain that have been active in the current
+ * generation, sorted in descending load order. Candidates of previous
+ * generations are stale and always sorted after the current ones.
+ *
+ * The BPF side updates the candidates holding the domain lock, bumping @seq
+ * before and after each update, so that userspace can read a consistent
+ * snapshot from the mmap'd .bss without any syscall. Userspace then sets
+ * @req_gen to request the next generation, which the BPF side adopts with the
+ * next update, so that @gen and @min_load are only written under the lock.
+ */
+struct dom_lb_cands {
+	u64 seq;
+	u64 gen;
+	u64 req_gen;	/* next generation, written by userspace */
+	u64 min_load;	/* minimum load to enter the candidates */
+	u32 nr;
+	struct lb_cand cands[LB_TOPK_TASKS];
+};
+
+/*
+ * Summary of the tasks queued on a domain's DSQ which CPUs of other domains
+ * look at to pick a victim to steal from without probing every DSQ. Tasks are
+ * accounted when they're queued on the DSQ and removed when they start running
+ * or leave the runqueue, so it's approximate while tasks are being moved.
+ */
+struct dom_queued {
+	u64 nr;
+	u64 load;	/* sum of the weights of the queued tasks */
+} __scx_cacheline_aligned;
+SCX_ASSERT_CACHELINE_ALIGNED(struct dom_queued);
+
 struct node_ctx {
 	struct bpf_cpumask __kptr *cpumask;
 };
 
+/*
+ * Warm state saved into pinned maps when the scheduler is unloaded with
+ * --handoff, so that the next instance doesn't have to re-learn it.
+ */
+struct handoff_task {
+	u64 start_time;		/* to detect pid reuse */
+	u64 saved_at;
+	u64 dsq_vtime;
+	u64 avg_runtime;
+	u32 dom_id;
+	u32 version;		/* HANDOFF_VERSION */
+	struct task_lat lat;
+	struct ravg_data dcyc_rd;
+};
+
+struct handoff_dom {
+	u64 saved_at;
+	u32 nr_doms;		/* only adopted if the domains are the same */
+	u32 version;		/* HANDOFF_VERSION */
+	u64 min_vruntime;
+	struct ravg_data bucket_rds[LB_LOAD_BUCKETS];
+};
+
 #endif /* __INTF_H */
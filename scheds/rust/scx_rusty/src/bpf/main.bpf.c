@@ -8,8 +8,8 @@
  * calculates the load factor of each domain and tells the BPF part how to load
  * balance the domains.
  *
- * Every task has an entry in the task_data map which lists which domain the
- * task belongs to. When a task first enters the system (rusty_prep_enable),
+ * Every task has a task_ctx in the task_data task local storage which lists
+ * which domain the task belongs to. When a task first enters the system (rusty_prep_enable),
  * they are round-robined to a domain.
  *
  * rusty_select_cpu is the primary scheduling logic, invoked when a task
@@ -31,12 +31,16 @@
  * then greedy load stealing will attempt to find a task on another dispatch
  * queue to run.
  *
- * Load balancing is almost entirely handled by userspace. BPF populates the
- * task weight, dom mask and current dom in the task_data map and executes the
- * load balance based on userspace populating the lb_data map.
+ * Load balancing is almost entirely handled by userspace. BPF keeps track of
+ * the heaviest tasks of each domain along with their pids, weights and dom
+ * masks as migration candidates in dom_lb_cands, which userspace reads from
+ * the mmap'd .bss, and executes the load balance based on userspace populating
+ * the lb_data map.
  */
 #include <scx/common.bpf.h>
 #include <scx/ravg_impl.bpf.h>
+#include <scx/lathist_impl.bpf.h>
+#include <scx/sched_trace_impl.bpf.h>
 #include "intf.h"
 
 #include <errno.h>
@@ -63,15 +67,24 @@ const volatile u32 nr_nodes = 32;	/* !0 for veristat, set during init */
 const volatile u32 nr_cpus_possible = 64;	/* !0 for veristat, set during init */
 const volatile u32 cpu_dom_id_map[MAX_CPUS];
 const volatile u32 dom_numa_id_map[MAX_DOMS];
+/*
+ * The other domains in the order they're stolen from by each domain, sorted by
+ * NUMA distance. The first dom_nr_local_doms[] are on the same node.
+ */
+const volatile u32 dom_steal_order[MAX_DOMS][MAX_DOMS];
+const volatile u32 dom_nr_local_doms[MAX_DOMS];
 const volatile u64 dom_cpumasks[MAX_DOMS][MAX_CPUS / 64];
 const volatile u64 numa_cpumasks[MAX_NUMA_NODES][MAX_CPUS / 64];
 const volatile u32 load_half_life = 1000000000	/* 1s */;
 
 const volatile bool kthreads_local;
 const volatile bool fifo_sched;
+const volatile bool dl_chain_boost;
+const volatile bool dl_bench;
 const volatile bool direct_greedy_numa;
 const volatile u32 greedy_threshold;
 const volatile u32 greedy_threshold_x_numa;
+const volatile bool handoff;
 const volatile u32 debug;
 
 /* base slice duration */
@@ -83,18 +96,22 @@ static u64 slice_ns = SCX_SLICE_DFL;
 struct pcpu_ctx {
 	u32 dom_rr_cur; /* used when scanning other doms */
 	u32 dom_id;
+
+	/* read by the userspace tuner */
+	u64 dom_nr_queued;	/* depth of the domain DSQ at the last dispatch or stop */
+
 	/*
-	 * Add some padding so that libbpf-rs can generate the rest of the
-	 * padding to CACHELINE_SIZE. This is necessary for now because most
-	 * versions of rust can't generate Default impls for arrays of more
-	 * than 32 elements, so if the struct requires more than 32 bytes of
-	 * padding, rustc will error out.
-	 *
-	 * This is currently being fixed in libbpf-cargo, so we should be able
-	 * to remove this workaround soon.
+	 * The skeleton's Rust type fills the tail of the cacheline with a u8
+	 * array and derives Default, which rustc only implements for arrays of
+	 * up to 32 elements. Pad explicitly so that the fields cover at least
+	 * half of the cacheline.
 	 */
-	u32 pad[8];
-} __attribute__((aligned(CACHELINE_SIZE)));
+	u32 pad[6];
+} __scx_cacheline_aligned;
+SCX_ASSERT_CACHELINE_ALIGNED(struct pcpu_ctx);
+_Static_assert(sizeof(struct pcpu_ctx) - __builtin_offsetof(struct pcpu_ctx, pad) -
+	       sizeof(((struct pcpu_ctx *)0)->pad) <= 32,
+	       "pcpu_ctx tail padding too large for Default");
 
 struct pcpu_ctx pcpu_ctx[MAX_CPUS];
 
@@ -140,26 +157,63 @@ struct {
 	__uint(map_flags, 0);
 } dom_dcycle_locks SEC(".maps");
 
-struct dom_active_pids {
-	u64 gen;
-	u64 read_idx;
-	u64 write_idx;
-	s32 pids[MAX_DOM_ACTIVE_PIDS];
-};
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct lock_wrapper);
+	__uint(max_entries, MAX_DOMS);
+	__uint(map_flags, 0);
+} dom_lb_cand_locks SEC(".maps");
+
+struct dom_lb_cands dom_lb_cands[MAX_DOMS];
 
-struct dom_active_pids dom_active_pids[MAX_DOMS];
+struct dom_queued dom_queued[MAX_DOMS];
 
 const u64 ravg_1 = 1 << RAVG_FRAC_BITS;
 
-/* Map pid -> task_ctx */
+/*
+ * Per-task scheduling context. Userspace doesn't need to look tasks up by pid,
+ * it only ever looks at the migration candidates in dom_lb_cands.
+ */
 struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, pid_t);
+	__uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
 	__type(value, struct task_ctx);
-	__uint(max_entries, 1000000);
-	__uint(map_flags, 0);
 } task_data SEC(".maps");
 
+/*
+ * With @handoff, the per-task and per-domain state is saved into these maps
+ * when the scheduler is unloaded. User space pins them so that the next
+ * instance can adopt the state in rusty_init() and rusty_init_task().
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, s32);
+	__type(value, struct handoff_task);
+	__uint(max_entries, HANDOFF_MAX_TASKS);
+} handoff_tasks SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct handoff_dom);
+	__uint(max_entries, MAX_DOMS);
+} handoff_doms SEC(".maps");
+
+/*
+ * Whether rusty_init() adopted the saved state of each domain. A task's vtime
+ * is only meaningful relative to its domain's min_vruntime, so it's only
+ * carried over if the domain's min_vruntime was too.
+ */
+static bool dom_handoff_adopted[MAX_DOMS];
+
+/*
+ * Set by user space right before detaching. rusty_exit_task() also runs when a
+ * task switches to another sched class, whose state shouldn't be saved.
+ */
+volatile bool unloading;
+
 static struct dom_ctx *try_lookup_dom_ctx(u32 dom_id)
 {
 	return bpf_map_lookup_elem(&dom_data, &dom_id);
@@ -178,9 +232,7 @@ static struct dom_ctx *lookup_dom_ctx(u32 dom_id)
 
 static struct task_ctx *try_lookup_task_ctx(struct task_struct *p)
 {
-	s32 pid = p->pid;
-
-	return bpf_map_lookup_elem(&task_data, &pid);
+	return bpf_task_storage_get(&task_data, p, 0, 0);
 }
 
 static struct task_ctx *lookup_task_ctx(struct task_struct *p)
@@ -258,6 +310,199 @@ static struct lock_wrapper *lookup_dom_vtime_lock(u32 dom_id)
 	return lockw;
 }
 
+static struct lock_wrapper *lookup_dom_lb_cand_lock(u32 dom_id)
+{
+	struct lock_wrapper *lockw;
+	u32 idx = dom_id;
+
+	lockw = bpf_map_lookup_elem(&dom_lb_cand_locks, &idx);
+	if (!lockw)
+		scx_bpf_error("Failed to lookup dom lock");
+
+	return lockw;
+}
+
+/*
+ * Return true if candidate @a must be sorted before candidate @b: candidates
+ * of the current generation @gen come first, in descending load order.
+ */
+static __always_inline bool lb_cand_before(const struct lb_cand *a,
+					   const struct lb_cand *b, u64 gen)
+{
+	if ((a->gen == gen) != (b->gen == gen))
+		return a->gen == gen;
+	return a->load > b->load;
+}
+
+static __always_inline void lb_cand_swap(struct dom_lb_cands *dc, u32 i, u32 j)
+{
+	struct lb_cand tmp;
+
+	i &= LB_TOPK_TASKS - 1;
+	j &= LB_TOPK_TASKS - 1;
+	tmp = dc->cands[i];
+	dc->cands[i] = dc->cands[j];
+	dc->cands[j] = tmp;
+}
+
+/*
+ * Record @p as a migration candidate of its domain, if it's one of the
+ * LB_TOPK_TASKS heaviest tasks that ran in the current generation.
+ */
+static void dom_lb_cands_update(struct task_struct *p, struct task_ctx *taskc,
+				u64 now)
+{
+	struct dom_lb_cands *dc;
+	struct lock_wrapper *lockw;
+	struct lb_cand *cand;
+	u64 gen, dcycle, load;
+	u32 dom_id = taskc->dom_id, i, pos, nr;
+
+	dc = MEMBER_VPTR(dom_lb_cands, [dom_id]);
+	if (!dc)
+		return;
+
+	dcycle = ravg_read(&taskc->dcyc_rd, now, load_half_life);
+	load = dcycle * taskc->weight;
+
+	/*
+	 * Skip the tasks that can't enter the candidates, or which were
+	 * already recorded in this generation with about the same load,
+	 * without grabbing the lock. This is racy, but we just need to be
+	 * right most of the time. @min_load is only meaningful if userspace
+	 * didn't request a new generation yet.
+	 */
+	gen = READ_ONCE(dc->req_gen);
+	if (taskc->lb_cand_gen == gen) {
+		u64 delta = load > taskc->lb_cand_load ?
+			load - taskc->lb_cand_load : taskc->lb_cand_load - load;
+
+		if (delta <= taskc->lb_cand_load >> LB_CAND_LOAD_SHIFT)
+			return;
+	} else if (READ_ONCE(dc->gen) == gen &&
+		   READ_ONCE(dc->nr) >= LB_TOPK_TASKS &&
+		   load <= READ_ONCE(dc->min_load)) {
+		return;
+	}
+
+	lockw = lookup_dom_lb_cand_lock(dom_id);
+	if (!lockw)
+		return;
+
+	bpf_spin_lock(&lockw->lock);
+	__sync_fetch_and_add(&dc->seq, 1);
+
+	/* Start the generation requested by userspace */
+	gen = READ_ONCE(dc->req_gen);
+	if (dc->gen != gen) {
+		dc->gen = gen;
+		dc->min_load = 0;
+	}
+	nr = dc->nr;
+	if (nr > LB_TOPK_TASKS)
+		nr = LB_TOPK_TASKS;
+
+	/* Look for the task, or for a free slot, or for the lightest slot */
+	pos = nr;
+	for (i = 0; i < LB_TOPK_TASKS; i++) {
+		if (i >= nr)
+			break;
+		if (dc->cands[i].pid == p->pid) {
+			pos = i;
+			break;
+		}
+	}
+	if (pos == nr) {
+		if (nr < LB_TOPK_TASKS) {
+			nr++;
+		} else {
+			pos = LB_TOPK_TASKS - 1;
+			if (dc->cands[pos].gen == gen && dc->cands[pos].load >= load)
+				goto out_unlock;
+		}
+	}
+
+	cand = &dc->cands[pos & (LB_TOPK_TASKS - 1)];
+	cand->pid = p->pid;
+	cand->weight = taskc->weight;
+	cand->dom_mask = taskc->dom_mask;
+	cand->dcyc_rd = taskc->dcyc_rd;
+	cand->load = load;
+	cand->gen = gen;
+	cand->is_kworker = taskc->is_kworker;
+
+	/* Restore the candidates order */
+	for (i = 0; i < LB_TOPK_TASKS; i++) {
+		if (pos == 0 || pos >= LB_TOPK_TASKS ||
+		    !lb_cand_before(&dc->cands[pos], &dc->cands[pos - 1], gen))
+			break;
+		lb_cand_swap(dc, pos, pos - 1);
+		pos--;
+	}
+	for (i = 0; i < LB_TOPK_TASKS; i++) {
+		if (pos + 1 >= nr || pos + 1 >= LB_TOPK_TASKS ||
+		    !lb_cand_before(&dc->cands[pos + 1], &dc->cands[pos], gen))
+			break;
+		lb_cand_swap(dc, pos, pos + 1);
+		pos++;
+	}
+
+	dc->nr = nr;
+	if (nr < LB_TOPK_TASKS || dc->cands[LB_TOPK_TASKS - 1].gen != gen)
+		dc->min_load = 0;
+	else
+		dc->min_load = dc->cands[LB_TOPK_TASKS - 1].load;
+	taskc->lb_cand_gen = gen;
+	taskc->lb_cand_load = load;
+
+out_unlock:
+	__sync_fetch_and_add(&dc->seq, 1);
+	bpf_spin_unlock(&lockw->lock);
+}
+
+/*
+ * Remove @pid from the migration candidates of @dom_id (e.g., because the
+ * task left the domain).
+ */
+static void dom_lb_cands_remove(u32 dom_id, s32 pid)
+{
+	struct dom_lb_cands *dc;
+	struct lock_wrapper *lockw;
+	u32 i, nr;
+	bool found = false;
+
+	dc = MEMBER_VPTR(dom_lb_cands, [dom_id]);
+	if (!dc)
+		return;
+
+	lockw = lookup_dom_lb_cand_lock(dom_id);
+	if (!lockw)
+		return;
+
+	bpf_spin_lock(&lockw->lock);
+	__sync_fetch_and_add(&dc->seq, 1);
+
+	nr = dc->nr;
+	if (nr > LB_TOPK_TASKS)
+		nr = LB_TOPK_TASKS;
+
+	for (i = 0; i < LB_TOPK_TASKS - 1; i++) {
+		if (i + 1 >= nr)
+			break;
+		if (dc->cands[i].pid == pid)
+			found = true;
+		if (found)
+			dc->cands[i] = dc->cands[i + 1];
+	}
+	if (found || (nr && dc->cands[(nr - 1) & (LB_TOPK_TASKS - 1)].pid == pid)) {
+		dc->nr = nr - 1;
+		dc->min_load = 0;
+	}
+
+	__sync_fetch_and_add(&dc->seq, 1);
+	bpf_spin_unlock(&lockw->lock);
+}
+
 static inline bool vtime_before(u64 a, u64 b)
 {
 	return (s64)(a - b) < 0;
@@ -388,32 +633,18 @@ static u64 dom_min_vruntime(struct dom_ctx *domc)
 	return READ_ONCE(domc->min_vruntime);
 }
 
-int dom_xfer_task(pid_t pid, u32 new_dom_id, u64 now)
+static void dom_xfer_task(struct task_struct *p, struct task_ctx *taskc,
+			  u32 new_dom_id, u64 now)
 {
 	struct dom_ctx *from_domc, *to_domc;
-	struct task_ctx *taskc;
-	struct task_struct *p;
-
-	p = bpf_task_from_pid(pid);
-	if (!p) {
-		scx_bpf_error("Failed to lookup task %d", pid);
-		return 0;
-	}
-
-	taskc = lookup_task_ctx(p);
-	if (!taskc)
-		goto free_task;
 
 	from_domc = lookup_dom_ctx(taskc->dom_id);
 	to_domc = lookup_dom_ctx(new_dom_id);
 
-	if (!from_domc || !to_domc || !taskc)
-		goto free_task;
+	if (!from_domc || !to_domc)
+		return;
 
 	dom_dcycle_xfer_task(p, taskc, from_domc, to_domc, now);
-free_task:
-	bpf_task_release(p);
-	return 0;
 }
 
 /*
@@ -455,11 +686,13 @@ struct {
 struct tune_input{
 	u64 gen;
 	u64 slice_ns;
+	u64 dom_slice_ns[MAX_DOMS];
 	u64 direct_greedy_cpumask[MAX_CPUS / 64];
 	u64 kick_greedy_cpumask[MAX_CPUS / 64];
 } tune_input;
 
 u64 tune_params_gen;
+static u64 dom_slice_ns[MAX_DOMS];
 private(A) struct bpf_cpumask __kptr *all_cpumask;
 private(A) struct bpf_cpumask __kptr *direct_greedy_cpumask;
 private(A) struct bpf_cpumask __kptr *kick_greedy_cpumask;
@@ -485,7 +718,7 @@ static inline bool is_offline_cpu(s32 cpu)
 
 static void refresh_tune_params(void)
 {
-	s32 cpu;
+	s32 cpu, dom;
 
 	if (tune_params_gen == tune_input.gen)
 		return;
@@ -493,6 +726,13 @@ static void refresh_tune_params(void)
 	tune_params_gen = tune_input.gen;
 	slice_ns = tune_input.slice_ns;
 
+	bpf_for(dom, 0, MAX_DOMS) {
+		u64 *dom_slicep = MEMBER_VPTR(dom_slice_ns, [dom]);
+
+		if (dom_slicep)
+			*dom_slicep = tune_input.dom_slice_ns[dom];
+	}
+
 	bpf_for(cpu, 0, nr_cpus_possible) {
 		u32 dom_id = cpu_to_dom_id(cpu);
 		struct dom_ctx *domc;
@@ -530,6 +770,19 @@ static u64 min(u64 a, u64 b)
 	return a <= b ? a : b;
 }
 
+/*
+ * The tuner sets a slice for each domain according to its utilization. Fall
+ * back to the global slice until it has.
+ */
+static u64 task_slice(struct task_ctx *taskc)
+{
+	u64 *dom_slicep = MEMBER_VPTR(dom_slice_ns, [taskc->dom_id]);
+
+	if (dom_slicep && *dom_slicep)
+		return *dom_slicep;
+	return slice_ns;
+}
+
 /*
  * ** Taken directly from fair.c in the Linux kernel **
  *
@@ -569,12 +822,44 @@ static u64 sched_prio_to_latency_weight(u64 prio)
 	return sched_prio_to_weight[DL_MAX_LAT_PRIO - prio - 1];
 }
 
+/*
+ * log2 in DL_LOG_SHIFT fixed point. The fractional part linearly interpolates
+ * between powers of two, which is off by less than 0.09 and much cheaper than
+ * the divisions it replaces.
+ */
+static u32 log2_fp(u64 v)
+{
+	u32 msb;
+
+	if (!v)
+		return 0;
+
+	/* log2_u64() returns the number of significant bits */
+	msb = log2_u64(v) - 1;
+	if (msb >= DL_LOG_SHIFT)
+		v >>= msb - DL_LOG_SHIFT;
+	else
+		v <<= DL_LOG_SHIFT - msb;
+
+	return (msb << DL_LOG_SHIFT) | (v & ((1 << DL_LOG_SHIFT) - 1));
+}
+
+/* initialized in rusty_init() */
+static u32 dl_log_100;
+
+static u32 clamp_log(s64 v, u32 max)
+{
+	if (v < 0)
+		return 0;
+	return v < max ? v : max;
+}
+
 static u64 task_compute_dl(struct task_struct *p, struct task_ctx *taskc,
 			   u64 enq_flags)
 {
-	u64 waker_freq, blocked_freq;
-	u64 lat_prio, lat_scale, avg_run_raw, avg_run;
-	u64 freq_factor;
+	struct task_lat *lat = &taskc->lat;
+	s64 weight_log, freq_factor, avg_run;
+	u64 lat_prio, lat_scale;
 
 	/*
 	 * Determine the latency criticality of a task, and scale a task's
@@ -640,52 +925,62 @@ static u64 task_compute_dl(struct task_struct *p, struct task_ctx *taskc,
 	 *
 	 * We multiply the frequencies of wait_freq and waker_freq somewhat
 	 * arbitrarily, based on observed performance for audio and gaming
-	 * interactive workloads.
+	 * interactive workloads. As their log2 values are cached, see
+	 * update_freq_log(), the product is a sum. If either frequency is
+	 * zero, so is the product, and the task gets no frequency boost.
 	 */
-	waker_freq = min(taskc->waker_freq, DL_FREQ_FT_MAX);
-	blocked_freq = min(taskc->blocked_freq, DL_FREQ_FT_MAX);
-	freq_factor = blocked_freq * waker_freq * waker_freq;
+	freq_factor = lat->blocked_log + 2 * lat->waker_log;
 
 	/*
 	 * Scale the frequency factor according to the task's weight. A task
 	 * with higher weight is given a higher frequency factor than a task
 	 * with a lower weight.
 	 */
-	freq_factor = scale_up_fair(freq_factor, p->scx.weight);
+	weight_log = (s64)log2_fp(p->scx.weight);
+	freq_factor += weight_log - dl_log_100;
 
 	/*
 	 * The above frequencies roughly follow an exponential distribution, so
-	 * use log2_u64() to linearize it to a boost priority that we can then
-	 * scale to a weight factor below.
+	 * working on log2 values linearizes it to a boost priority that we can
+	 * then scale to a weight factor below.
 	 */
-	lat_prio = log2_u64(freq_factor + 1);
-	lat_prio = min(lat_prio, DL_MAX_LAT_PRIO);
+	freq_factor = clamp_log(freq_factor, DL_MAX_LAT_PRIO << DL_LOG_SHIFT);
+	if (!lat->blocked_freq || !lat->waker_freq)
+		freq_factor = 0;
 
 	/*
-	 * Next calculate a task's average runtime, and apply it to deadline
-	 * accordingly. A task with a large runtime is penalized from an
-	 * interactivity standpoint, for obvious reasons.
-	 *
-	 * As with waker and blocked frequencies above, this follows an
-	 * exponential distribution. We inversely scale to account for
-	 * empirical observations which seem to bring it roughly to the same
-	 * order of magnitude as the blocker and waker frequencies above.
+	 * Next apply a task's average runtime to its deadline. A task with a
+	 * large runtime is penalized from an interactivity standpoint, for
+	 * obvious reasons. lat->runtime_log is updated when the task stops,
+	 * see stopping_update_vtime().
 	 *
 	 * We inversely scale the task's averge_runtime to cause tasks with
 	 * lower weight to receive a harsher penalty for long runtimes, and
-	 * vice versa for tasks with lower weight.
+	 * vice versa for tasks with lower weight. lat->runtime_log already
+	 * includes the * 100 of scale_inverse_fair().
 	 */
-	avg_run_raw = taskc->avg_runtime / DL_RUNTIME_SCALE;
-	avg_run_raw = min(avg_run_raw, DL_MAX_LATENCY_NS);
-	avg_run_raw = scale_inverse_fair(avg_run_raw, p->scx.weight);
-	avg_run = log2_u64(avg_run_raw + 1);
-
-	if (avg_run < lat_prio) {
-		/* Equivalent to lat_prio = log(freq_factor / avg_run_raw) */
-		lat_prio -= avg_run;
-	} else {
-		lat_prio = 0;
-	}
+	avg_run = clamp_log((s64)lat->runtime_log - weight_log,
+			    DL_MAX_LAT_PRIO << DL_LOG_SHIFT);
+
+	/*
+	 * Equivalent to lat_prio = log(freq_factor / avg_run_raw). Both
+	 * factors are truncated to whole priorities before subtracting, as
+	 * the integer log2_u64() of each used to do. Truncating the difference
+	 * instead would lose half a priority level on average.
+	 */
+	lat_prio = clamp_log((freq_factor >> DL_LOG_SHIFT) -
+			     (avg_run >> DL_LOG_SHIFT), DL_MAX_LAT_PRIO);
+	lat_prio <<= DL_LOG_SHIFT;
+
+	/*
+	 * A task woken up by a latency critical task is likely the next stage
+	 * of a pipeline. Let it inherit the waker's priority so that the whole
+	 * chain is boosted right away instead of each stage having to build up
+	 * its own frequencies.
+	 */
+	if (dl_chain_boost && lat->chain_prio > lat_prio)
+		lat_prio = lat->chain_prio;
+	lat->lat_prio = lat_prio;
 
 	/*
 	 * Ultimately, what we're trying to arrive at is a single value
@@ -701,6 +996,7 @@ static u64 task_compute_dl(struct task_struct *p, struct task_ctx *taskc,
 	 * generic and/or continuous and flexible so that it can also
 	 * accommodate cgroups.
 	 */
+	lat_prio = min(lat_prio >> DL_LOG_SHIFT, DL_MAX_LAT_PRIO - 1);
 	lat_scale = sched_prio_to_latency_weight(lat_prio);
 	lat_scale = min(lat_scale, LB_MAX_WEIGHT);
 
@@ -725,7 +1021,7 @@ static void clamp_task_vtime(struct task_struct *p, struct task_ctx *taskc, u64
 		return;
 
 	dom_vruntime = dom_min_vruntime(domc);
-	min_vruntime = dom_vruntime - slice_ns;
+	min_vruntime = dom_vruntime - task_slice(taskc);
 	/*
 	 * Allow an idling task to accumulate at most one slice worth of
 	 * vruntime budget. This prevents e.g. a task for sleeping for 1 day,
@@ -791,8 +1087,11 @@ static bool task_set_domain(struct task_ctx *taskc, struct task_struct *p,
 				   p->cpus_ptr)) {
 		u64 now = bpf_ktime_get_ns();
 
-		if (!init_dsq_vtime)
-			dom_xfer_task(p->pid, new_dom_id, now);
+		if (!init_dsq_vtime) {
+			dom_xfer_task(p, taskc, new_dom_id, now);
+			if (old_dom_id != new_dom_id)
+				dom_lb_cands_remove(old_dom_id, p->pid);
+		}
 		taskc->dom_id = new_dom_id;
 		p->scx.dsq_vtime = dom_min_vruntime(new_domc);
 		taskc->deadline = p->scx.dsq_vtime +
@@ -859,8 +1158,8 @@ err_out:
 	return cpu;
 }
 
-s32 BPF_STRUCT_OPS(rusty_select_cpu, struct task_struct *p, s32 prev_cpu,
-		   u64 wake_flags)
+static __always_inline s32 __rusty_select_cpu(struct task_struct *p,
+					       s32 prev_cpu, u64 wake_flags)
 {
 	const struct cpumask *idle_smtmask = scx_bpf_get_idle_smtmask();
 	struct task_ctx *taskc;
@@ -1085,15 +1384,59 @@ enoent:
 	return -ENOENT;
 }
 
+s32 BPF_STRUCT_OPS(rusty_select_cpu, struct task_struct *p, s32 prev_cpu,
+		   u64 wake_flags)
+{
+	u64 started_at = lathist_start();
+	s32 cpu;
+
+	cpu = __rusty_select_cpu(p, prev_cpu, wake_flags);
+	lathist_end(LATHIST_SELECT_CPU, started_at);
+	return cpu;
+}
+
 static void place_task_dl(struct task_struct *p, struct task_ctx *taskc,
 			  u64 enq_flags)
 {
 	clamp_task_vtime(p, taskc, enq_flags);
-	scx_bpf_dispatch_vtime(p, taskc->dom_id, slice_ns, taskc->deadline,
+	scx_bpf_dispatch_vtime(p, taskc->dom_id, task_slice(taskc), taskc->deadline,
 			       enq_flags);
 }
 
-void BPF_STRUCT_OPS(rusty_enqueue, struct task_struct *p, u64 enq_flags)
+static void dom_queued_del(struct task_ctx *taskc)
+{
+	struct dom_queued *dq;
+
+	if (taskc->queued_dom == NO_DOM_FOUND)
+		return;
+
+	dq = MEMBER_VPTR(dom_queued, [taskc->queued_dom]);
+	if (dq) {
+		__sync_fetch_and_sub(&dq->nr, 1);
+		__sync_fetch_and_sub(&dq->load, taskc->queued_weight);
+	}
+	taskc->queued_dom = NO_DOM_FOUND;
+}
+
+static void dom_queued_add(struct task_ctx *taskc)
+{
+	struct dom_queued *dq;
+
+	/* @p may be re-enqueued without having run, e.g. on affinity change */
+	dom_queued_del(taskc);
+
+	dq = MEMBER_VPTR(dom_queued, [taskc->dom_id]);
+	if (!dq)
+		return;
+
+	__sync_fetch_and_add(&dq->nr, 1);
+	__sync_fetch_and_add(&dq->load, taskc->weight);
+	taskc->queued_dom = taskc->dom_id;
+	taskc->queued_weight = taskc->weight;
+}
+
+static __always_inline void __rusty_enqueue(struct task_struct *p,
+					    u64 enq_flags)
 {
 	struct task_ctx *taskc;
 	struct bpf_cpumask *p_cpumask;
@@ -1124,7 +1467,7 @@ void BPF_STRUCT_OPS(rusty_enqueue, struct task_struct *p, u64 enq_flags)
 
 	if (taskc->dispatch_local) {
 		taskc->dispatch_local = false;
-		scx_bpf_dispatch(p, SCX_DSQ_LOCAL, slice_ns, enq_flags);
+		scx_bpf_dispatch(p, SCX_DSQ_LOCAL, task_slice(taskc), enq_flags);
 		return;
 	}
 
@@ -1144,9 +1487,10 @@ void BPF_STRUCT_OPS(rusty_enqueue, struct task_struct *p, u64 enq_flags)
 
 dom_queue:
 	if (fifo_sched)
-		scx_bpf_dispatch(p, taskc->dom_id, slice_ns, enq_flags);
+		scx_bpf_dispatch(p, taskc->dom_id, task_slice(taskc), enq_flags);
 	else
 		place_task_dl(p, taskc, enq_flags);
+	dom_queued_add(taskc);
 
 	/*
 	 * If there are CPUs which are idle and not saturated, wake them up to
@@ -1173,6 +1517,20 @@ dom_queue:
 	}
 }
 
+/*
+ * Even the tasks which are dispatched to the local DSQ of the CPU picked by
+ * select_cpu() go through here (see dispatch_local), so this is the only place
+ * where the LATHIST_RUNQ timestamp needs to be taken.
+ */
+void BPF_STRUCT_OPS(rusty_enqueue, struct task_struct *p, u64 enq_flags)
+{
+	u64 started_at = lathist_start();
+
+	lathist_enqueued(p);
+	__rusty_enqueue(p, enq_flags);
+	lathist_end(LATHIST_ENQUEUE, started_at);
+}
+
 static bool cpumask_intersects_domain(const struct cpumask *cpumask, u32 dom_id)
 {
 	struct dom_ctx *domc;
@@ -1201,11 +1559,36 @@ u32 dom_node_id(u32 dom_id)
 	return *nid_ptr;
 }
 
-void BPF_STRUCT_OPS(rusty_dispatch, s32 cpu, struct task_struct *prev)
+/*
+ * Move up to DOM_STEAL_BATCH tasks, and at most half of the @nr_queued tasks,
+ * from @dom into the local DSQ. Stealing a few tasks at once amortizes picking
+ * the victim while leaving tasks for the other idle CPUs.
+ */
+static u32 steal_from_dom(u32 dom, u64 nr_queued, enum stat_idx idx)
+{
+	u32 i, batch, nr = 0;
+
+	batch = min(nr_queued / 2, DOM_STEAL_BATCH) ?: 1;
+
+	bpf_for(i, 0, batch) {
+		if (!scx_bpf_consume(dom))
+			break;
+		nr++;
+	}
+
+	if (nr)
+		stat_add(idx, nr);
+	return nr;
+}
+
+static __always_inline void __rusty_dispatch(s32 cpu,
+					     struct task_struct *prev)
 {
-	u32 curr_dom = cpu_to_dom_id(cpu), dom;
+	u32 curr_dom = cpu_to_dom_id(cpu), dom, nr_local, i;
+	u32 victim = NO_DOM_FOUND;
+	u64 victim_nr = 0, victim_load = 0;
+	const volatile u32 *nr_localp;
 	struct pcpu_ctx *pcpuc;
-	u32 my_node;
 
 	/*
 	 * In older kernels, we may receive an ops.dispatch() callback when a
@@ -1217,6 +1600,12 @@ void BPF_STRUCT_OPS(rusty_dispatch, s32 cpu, struct task_struct *prev)
 	if (unlikely(is_offline_cpu(cpu)))
 		return;
 
+	pcpuc = lookup_pcpu_ctx(cpu);
+	if (!pcpuc)
+		return;
+
+	pcpuc->dom_nr_queued = scx_bpf_dsq_nr_queued(curr_dom);
+
 	if (scx_bpf_consume(curr_dom)) {
 		stat_add(RUSTY_STAT_DSQ_DISPATCH, 1);
 		return;
@@ -1225,42 +1614,74 @@ void BPF_STRUCT_OPS(rusty_dispatch, s32 cpu, struct task_struct *prev)
 	if (!greedy_threshold)
 		return;
 
-	pcpuc = lookup_pcpu_ctx(cpu);
-	if (!pcpuc)
+	if (!(nr_localp = MEMBER_VPTR(dom_nr_local_doms, [curr_dom]))) {
+		scx_bpf_error("Invalid dom ID %u", curr_dom);
 		return;
+	}
+	nr_local = *nr_localp;
+
+	/*
+	 * Try to steal from the domain on the current NUMA node with the most
+	 * queued load. Only the dom_queued summaries are read, so domains with
+	 * nothing to steal are skipped without touching their DSQs.
+	 */
+	bpf_for(i, 0, nr_local) {
+		const volatile u32 *domp;
+		struct dom_queued *dq;
+		u64 nr, load;
 
-	my_node = dom_node_id(curr_dom);
+		if (!(domp = MEMBER_VPTR(dom_steal_order, [curr_dom][i])) ||
+		    !(dq = MEMBER_VPTR(dom_queued, [*domp])))
+			break;
 
-	/* try to steal a task from domains on the current NUMA node */
-	bpf_repeat(nr_doms - 1) {
-		dom = pcpuc->dom_rr_cur++ % nr_doms;
-		if (dom == curr_dom || dom_node_id(dom) != my_node)
+		nr = READ_ONCE(dq->nr);
+		load = READ_ONCE(dq->load);
+		if (nr < greedy_threshold || load <= victim_load)
 			continue;
 
-		if (scx_bpf_consume(dom)) {
-			stat_add(RUSTY_STAT_GREEDY_LOCAL, 1);
-			return;
-		}
+		victim = *domp;
+		victim_nr = nr;
+		victim_load = load;
 	}
 
+	if (victim != NO_DOM_FOUND &&
+	    steal_from_dom(victim, victim_nr, RUSTY_STAT_GREEDY_LOCAL))
+		return;
+
 	if (!greedy_threshold_x_numa || nr_nodes == 1)
 		return;
 
-	/* try to steal a task from domains on other NUMA nodes */
-	bpf_repeat(nr_doms - 1) {
-		dom = pcpuc->dom_rr_cur++ % nr_doms;
+	/*
+	 * Try to steal from domains on other NUMA nodes, closest first, which
+	 * have enough tasks queued to be worth pulling across nodes.
+	 */
+	bpf_for(i, nr_local, nr_doms - 1) {
+		const volatile u32 *domp;
+		struct dom_queued *dq;
+		u64 nr;
+
+		if (!(domp = MEMBER_VPTR(dom_steal_order, [curr_dom][i])) ||
+		    !(dq = MEMBER_VPTR(dom_queued, [*domp])))
+			break;
 
-		if (dom_node_id(dom) == my_node || dom == curr_dom ||
-		    scx_bpf_dsq_nr_queued(dom) >= greedy_threshold_x_numa)
+		dom = *domp;
+		nr = READ_ONCE(dq->nr);
+		if (nr < greedy_threshold_x_numa)
 			continue;
 
-		if (scx_bpf_consume(dom)) {
-			stat_add(RUSTY_STAT_GREEDY_XNUMA, 1);
+		if (steal_from_dom(dom, nr, RUSTY_STAT_GREEDY_XNUMA))
 			return;
-		}
 	}
 }
 
+void BPF_STRUCT_OPS(rusty_dispatch, s32 cpu, struct task_struct *prev)
+{
+	u64 started_at = lathist_start();
+
+	__rusty_dispatch(cpu, prev);
+	lathist_end(LATHIST_DISPATCH, started_at);
+}
+
 /*
  * Exponential weighted moving average
  *
@@ -1273,20 +1694,43 @@ static u64 calc_avg(u64 old_val, u64 new_val)
 	return (old_val - (old_val >> 2)) + (new_val >> 2);
 }
 
-static u64 update_freq(u64 freq, u64 interval)
+/*
+ * Fold an event @interval after the previous one into @freq, the EWMA of the
+ * event frequency in events per 100ms, and return log2 of it capped at
+ * DL_FREQ_FT_MAX for task_compute_dl().
+ */
+static u16 update_freq_log(u64 *freq, u64 interval)
+{
+	*freq = calc_avg(*freq, (100 * NSEC_PER_MSEC) / interval);
+	return log2_fp(min(*freq, DL_FREQ_FT_MAX));
+}
+
+/*
+ * If dl_bench is set, measure the cost of the latency criticality updates on
+ * each wakeup and block. Reading the clock adds a bit on top.
+ */
+static u64 dl_bench_start(void)
 {
-	u64 new_freq;
+	return dl_bench ? bpf_ktime_get_ns() : 0;
+}
 
-	new_freq = (100 * NSEC_PER_MSEC) / interval;
-	return calc_avg(freq, new_freq);
+static void dl_bench_record(u64 started_at)
+{
+	if (dl_bench) {
+		stat_add(RUSTY_STAT_DL_UPDATE_NS,
+			 bpf_ktime_get_ns() - started_at);
+		stat_add(RUSTY_STAT_DL_UPDATE_CNT, 1);
+	}
 }
 
 void BPF_STRUCT_OPS(rusty_runnable, struct task_struct *p, u64 enq_flags)
 {
-	u64 now = bpf_ktime_get_ns(), interval;
+	u64 now = bpf_ktime_get_ns(), interval, bench_at;
 	struct task_struct *waker;
 	struct task_ctx *wakee_ctx, *waker_ctx;
 
+	sched_trace_runnable(p);
+
 	if (!(wakee_ctx = lookup_task_ctx(p)))
 		return;
 
@@ -1304,9 +1748,31 @@ void BPF_STRUCT_OPS(rusty_runnable, struct task_struct *p, u64 enq_flags)
 	if (!(waker_ctx = try_lookup_task_ctx(waker)))
 		return;
 
-	interval = now - waker_ctx->last_woke_at;
-	waker_ctx->waker_freq = update_freq(waker_ctx->waker_freq, interval);
-	waker_ctx->last_woke_at = now;
+	bench_at = dl_bench_start();
+	interval = now - waker_ctx->lat.last_woke_at;
+	waker_ctx->lat.waker_log = update_freq_log(&waker_ctx->lat.waker_freq,
+						   interval);
+	waker_ctx->lat.last_woke_at = now;
+
+	/*
+	 * Propagate the waker's latency criticality down producer -> consumer
+	 * chains, losing DL_CHAIN_DECAY per hop. lat_prio of the waker already
+	 * includes what it inherited from its own waker.
+	 */
+	if (dl_chain_boost && (enq_flags & SCX_ENQ_WAKEUP)) {
+		u16 waker_prio = waker_ctx->lat.lat_prio;
+		u16 inherited = waker_prio > DL_CHAIN_DECAY ?
+			waker_prio - DL_CHAIN_DECAY : 0;
+
+		wakee_ctx->lat.chain_prio = inherited;
+		if (inherited > wakee_ctx->lat.lat_prio) {
+			wakee_ctx->deadline = p->scx.dsq_vtime +
+				task_compute_dl(p, wakee_ctx, enq_flags);
+			stat_add(RUSTY_STAT_DL_CHAIN_BOOST, 1);
+		}
+	}
+
+	dl_bench_record(bench_at);
 }
 
 static void running_update_vtime(struct task_struct *p,
@@ -1324,43 +1790,23 @@ static void running_update_vtime(struct task_struct *p,
 	bpf_spin_unlock(&lockw->lock);
 }
 
-void BPF_STRUCT_OPS(rusty_running, struct task_struct *p)
+static __always_inline void __rusty_running(struct task_struct *p)
 {
 	struct task_ctx *taskc;
 	struct dom_ctx *domc;
-	u32 dom_id, dap_gen;
+	u32 dom_id;
 
 	if (!(taskc = lookup_task_ctx(p)))
 		return;
 
+	dom_queued_del(taskc);
+
 	dom_id = taskc->dom_id;
 	if (dom_id >= MAX_DOMS) {
 		scx_bpf_error("Invalid dom ID");
 		return;
 	}
 
-	/*
-	 * Record that @p has been active in @domc. Load balancer will only
-	 * consider recently active tasks. Access synchronization rules aren't
-	 * strict. We just need to be right most of the time.
-	 */
-	dap_gen = dom_active_pids[dom_id].gen;
-	if (taskc->dom_active_pids_gen != dap_gen) {
-		u64 idx = __sync_fetch_and_add(&dom_active_pids[dom_id].write_idx, 1) %
-			MAX_DOM_ACTIVE_PIDS;
-		s32 *pidp;
-
-		pidp = MEMBER_VPTR(dom_active_pids, [dom_id].pids[idx]);
-		if (!pidp) {
-			scx_bpf_error("dom_active_pids[%u][%llu] indexing failed",
-				      dom_id, idx);
-			return;
-		}
-
-		*pidp = p->pid;
-		taskc->dom_active_pids_gen = dap_gen;
-	}
-
 	if (fifo_sched)
 		return;
 
@@ -1372,6 +1818,16 @@ void BPF_STRUCT_OPS(rusty_running, struct task_struct *p)
 	taskc->last_run_at = bpf_ktime_get_ns();
 }
 
+void BPF_STRUCT_OPS(rusty_running, struct task_struct *p)
+{
+	u64 started_at = lathist_start();
+
+	lathist_running(p);
+	sched_trace_running(p);
+	__rusty_running(p);
+	lathist_end(LATHIST_RUNNING, started_at);
+}
+
 static void stopping_update_vtime(struct task_struct *p,
 				  struct task_ctx *taskc,
 				  struct dom_ctx *domc)
@@ -1387,37 +1843,66 @@ static void stopping_update_vtime(struct task_struct *p,
 
 	taskc->sum_runtime += delta;
 	taskc->avg_runtime = calc_avg(taskc->avg_runtime, taskc->sum_runtime);
+	taskc->lat.runtime_log =
+		log2_fp(min(taskc->avg_runtime / DL_RUNTIME_SCALE,
+			    DL_MAX_LATENCY_NS) + 1) + dl_log_100;
 
 	p->scx.dsq_vtime += scale_inverse_fair(delta, p->scx.weight);
 	taskc->deadline = p->scx.dsq_vtime + task_compute_dl(p, taskc, 0);
 }
 
-void BPF_STRUCT_OPS(rusty_stopping, struct task_struct *p, bool runnable)
+static __always_inline void __rusty_stopping(struct task_struct *p)
 {
 	struct task_ctx *taskc;
+	struct pcpu_ctx *pcpuc;
 	struct dom_ctx *domc;
 
-	if (fifo_sched)
-		return;
+	if ((pcpuc = lookup_pcpu_ctx(bpf_get_smp_processor_id()))) {
+		/*
+		 * A CPU which keeps running tasks may not go through dispatch
+		 * for a while. Also sample the DSQ depth here so that it's
+		 * refreshed at least once per slice.
+		 */
+		pcpuc->dom_nr_queued = scx_bpf_dsq_nr_queued(pcpuc->dom_id);
+	}
 
 	if (!(taskc = lookup_task_ctx(p)))
 		return;
 
+	/*
+	 * Record that @p has been active in its domain. Load balancer will
+	 * only consider the heaviest recently active tasks.
+	 */
+	dom_lb_cands_update(p, taskc, bpf_ktime_get_ns());
+
+	if (fifo_sched)
+		return;
+
 	if (!(domc = lookup_dom_ctx(taskc->dom_id)))
 		return;
 
 	stopping_update_vtime(p, taskc, domc);
 }
 
+void BPF_STRUCT_OPS(rusty_stopping, struct task_struct *p, bool runnable)
+{
+	u64 started_at = lathist_start();
+
+	sched_trace_stopping(p, runnable);
+	__rusty_stopping(p);
+	lathist_end(LATHIST_STOPPING, started_at);
+}
+
 void BPF_STRUCT_OPS(rusty_quiescent, struct task_struct *p, u64 deq_flags)
 {
-	u64 now = bpf_ktime_get_ns(), interval;
+	u64 now = bpf_ktime_get_ns(), interval, bench_at;
 	struct task_ctx *taskc;
 	struct dom_ctx *domc;
 
 	if (!(taskc = lookup_task_ctx(p)))
 		return;
 
+	dom_queued_del(taskc);
 	task_load_adj(p, taskc, now, false);
 	dom_dcycle_adj(taskc->dom_id, taskc->weight, now, false);
 
@@ -1427,9 +1912,13 @@ void BPF_STRUCT_OPS(rusty_quiescent, struct task_struct *p, u64 deq_flags)
 	if (!(domc = lookup_dom_ctx(taskc->dom_id)))
 		return;
 
-	interval = now - taskc->last_blocked_at;
-	taskc->blocked_freq = update_freq(taskc->blocked_freq, interval);
-	taskc->last_blocked_at = now;
+	bench_at = dl_bench_start();
+	interval = now - taskc->lat.last_blocked_at;
+	taskc->lat.blocked_log = update_freq_log(&taskc->lat.blocked_freq,
+						 interval);
+	taskc->lat.last_blocked_at = now;
+
+	dl_bench_record(bench_at);
 }
 
 void BPF_STRUCT_OPS(rusty_set_weight, struct task_struct *p, u32 weight)
@@ -1522,58 +2011,100 @@ static s32 create_save_cpumask(struct bpf_cpumask **kptr)
 	return 0;
 }
 
+static void task_save_handoff(struct task_struct *p, struct task_ctx *taskc)
+{
+	struct handoff_task ho = {
+		.start_time = p->start_time,
+		.saved_at = bpf_ktime_get_ns(),
+		.dsq_vtime = p->scx.dsq_vtime,
+		.avg_runtime = taskc->avg_runtime,
+		.dom_id = taskc->dom_id,
+		.version = HANDOFF_VERSION,
+		.lat = taskc->lat,
+		.dcyc_rd = taskc->dcyc_rd,
+	};
+	s32 pid = p->pid;
+
+	bpf_map_update_elem(&handoff_tasks, &pid, &ho, BPF_ANY);
+}
+
+/*
+ * Adopt the state the previous instance saved for @p, if any. The domain is
+ * only carried over if @p can still run in it.
+ */
+static void task_adopt_handoff(struct task_struct *p, struct task_ctx *taskc,
+			       u64 now)
+{
+	struct handoff_task *ho;
+	s32 pid = p->pid;
+
+	ho = bpf_map_lookup_elem(&handoff_tasks, &pid);
+	if (!ho)
+		return;
+
+	if (ho->version != HANDOFF_VERSION ||
+	    ho->start_time != p->start_time ||
+	    now - ho->saved_at > HANDOFF_MAX_AGE_NS)
+		goto out_delete;
+
+	if (ho->dom_id != taskc->dom_id && ho->dom_id < nr_doms &&
+	    (taskc->dom_mask & (1LLU << ho->dom_id)))
+		task_set_domain(taskc, p, ho->dom_id, true);
+
+	taskc->avg_runtime = ho->avg_runtime;
+	taskc->lat = ho->lat;
+	taskc->dcyc_rd = ho->dcyc_rd;
+
+	if (taskc->dom_id == ho->dom_id && ho->dom_id < MAX_DOMS &&
+	    dom_handoff_adopted[ho->dom_id]) {
+		p->scx.dsq_vtime = ho->dsq_vtime;
+		taskc->deadline = p->scx.dsq_vtime + task_compute_dl(p, taskc, 0);
+	}
+	stat_add(RUSTY_STAT_HANDOFF_TASK, 1);
+
+out_delete:
+	bpf_map_delete_elem(&handoff_tasks, &pid);
+}
+
 s32 BPF_STRUCT_OPS(rusty_init_task, struct task_struct *p,
 		   struct scx_init_task_args *args)
 {
 	u64 now = bpf_ktime_get_ns();
-	struct task_ctx taskc = {
-		.dom_active_pids_gen = -1,
-		.last_blocked_at = now,
-		.last_woke_at = now,
-
-	};
-	struct task_ctx *map_value;
+	struct task_ctx *taskc;
 	long ret;
-	pid_t pid;
-
-	pid = p->pid;
 
 	/*
-	 * XXX - We want BPF_NOEXIST but bpf_map_delete_elem() in .disable() may
-	 * fail spuriously due to BPF recursion protection triggering
-	 * unnecessarily.
+	 * @p is new. Let's ensure that its task_ctx is available. We can sleep
+	 * in this function and the following will automatically use
+	 * GFP_KERNEL. The storage is zeroed and freed with the task.
 	 */
-	ret = bpf_map_update_elem(&task_data, &pid, &taskc, 0 /*BPF_NOEXIST*/);
-	if (ret) {
+	taskc = bpf_task_storage_get(&task_data, p, 0,
+				     BPF_LOCAL_STORAGE_GET_F_CREATE);
+	if (!taskc) {
 		stat_add(RUSTY_STAT_TASK_GET_ERR, 1);
-		return ret;
+		return -ENOMEM;
 	}
 
+	taskc->lb_cand_gen = -1;
+	taskc->queued_dom = NO_DOM_FOUND;
+	taskc->lat.last_blocked_at = now;
+	taskc->lat.last_woke_at = now;
+
 	if (debug >= 2)
 		bpf_printk("%s[%d]: INIT (weight %u))", p->comm, p->pid, p->scx.weight);
 
-	/*
-	 * Read the entry from the map immediately so we can add the cpumask
-	 * with bpf_kptr_xchg().
-	 */
-	map_value = bpf_map_lookup_elem(&task_data, &pid);
-	if (!map_value)
-		/* Should never happen -- it was just inserted above. */
-		return -EINVAL;
-
-	ret = create_save_cpumask(&map_value->cpumask);
-	if (ret) {
-		bpf_map_delete_elem(&task_data, &pid);
+	ret = create_save_cpumask(&taskc->cpumask);
+	if (ret)
 		return ret;
-	}
 
-	ret = create_save_cpumask(&map_value->tmp_cpumask);
-	if (ret) {
-		bpf_map_delete_elem(&task_data, &pid);
+	ret = create_save_cpumask(&taskc->tmp_cpumask);
+	if (ret)
 		return ret;
-	}
 
-	task_pick_and_set_domain(map_value, p, p->cpus_ptr, true);
+	task_pick_and_set_domain(taskc, p, p->cpus_ptr, true);
+
+	if (handoff)
+		task_adopt_handoff(p, taskc, now);
 
 	return 0;
 }
@@ -1581,20 +2112,17 @@ s32 BPF_STRUCT_OPS(rusty_init_task, struct task_struct *p,
 void BPF_STRUCT_OPS(rusty_exit_task, struct task_struct *p,
 		    struct scx_exit_task_args *args)
 {
-	pid_t pid = p->pid;
-	long ret;
+	struct task_ctx *taskc;
 
-	/*
-	 * XXX - There's no reason delete should fail here but BPF's recursion
-	 * protection can unnecessarily fail the operation. The fact that
-	 * deletions aren't reliable means that we sometimes leak task_ctx and
-	 * can't use BPF_NOEXIST on allocation in .prep_enable().
-	 */
-	ret = bpf_map_delete_elem(&task_data, &pid);
-	if (ret) {
-		stat_add(RUSTY_STAT_TASK_GET_ERR, 1);
+	if (!(taskc = try_lookup_task_ctx(p)))
 		return;
-	}
+
+	/* tasks which are exiting won't be around for the next instance */
+	if (handoff && unloading && !(p->flags & PF_EXITING))
+		task_save_handoff(p, taskc);
+
+	/* task_ctx itself goes away with the task's local storage */
+	dom_lb_cands_remove(taskc->dom_id, p->pid);
 }
 
 static s32 create_node(u32 node_id)
@@ -1765,10 +2293,68 @@ static s32 initialize_cpu(s32 cpu)
 	return -ENOENT;
 }
 
+static void dom_save_handoff(u32 dom_id, u64 now)
+{
+	struct handoff_dom *ho;
+	struct dom_ctx *domc;
+	u32 i;
+
+	if (!(ho = bpf_map_lookup_elem(&handoff_doms, &dom_id)) ||
+	    !(domc = try_lookup_dom_ctx(dom_id)))
+		return;
+
+	ho->saved_at = now;
+	ho->nr_doms = nr_doms;
+	ho->version = HANDOFF_VERSION;
+	ho->min_vruntime = domc->min_vruntime;
+	bpf_for(i, 0, LB_LOAD_BUCKETS) {
+		struct bucket_ctx *bucket = MEMBER_VPTR(domc->buckets, [i]);
+		struct ravg_data *rd = MEMBER_VPTR(ho->bucket_rds, [i]);
+
+		if (bucket && rd)
+			*rd = bucket->rd;
+	}
+}
+
+/*
+ * Called before any task is initialized. The buckets' running averages
+ * include the load of the tasks which are still runnable, which is also what
+ * they're going to be accounted as once they go through rusty_runnable().
+ */
+static void dom_adopt_handoff(u32 dom_id, u64 now)
+{
+	struct handoff_dom *ho;
+	struct dom_ctx *domc;
+	u32 i;
+
+	if (!(ho = bpf_map_lookup_elem(&handoff_doms, &dom_id)) ||
+	    !(domc = try_lookup_dom_ctx(dom_id)))
+		return;
+
+	if (!ho->saved_at || ho->version != HANDOFF_VERSION ||
+	    ho->nr_doms != nr_doms || now - ho->saved_at > HANDOFF_MAX_AGE_NS)
+		return;
+
+	domc->min_vruntime = ho->min_vruntime;
+	bpf_for(i, 0, LB_LOAD_BUCKETS) {
+		struct bucket_ctx *bucket = MEMBER_VPTR(domc->buckets, [i]);
+		struct ravg_data *rd = MEMBER_VPTR(ho->bucket_rds, [i]);
+
+		if (bucket && rd)
+			bucket->rd = *rd;
+	}
+	ho->saved_at = 0;
+	if (dom_id < MAX_DOMS)
+		dom_handoff_adopted[dom_id] = true;
+	stat_add(RUSTY_STAT_HANDOFF_DOM, 1);
+}
+
 s32 BPF_STRUCT_OPS_SLEEPABLE(rusty_init)
 {
 	s32 i, ret;
 
+	dl_log_100 = log2_fp(100);
+
 	ret = create_save_cpumask(&all_cpumask);
 	if (ret)
 		return ret;
@@ -1790,6 +2376,8 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(rusty_init)
 		ret = create_dom(i);
 		if (ret)
 			return ret;
+		if (handoff)
+			dom_adopt_handoff(i, bpf_ktime_get_ns());
 	}
 
 	bpf_for(i, 0, nr_cpus_possible) {
@@ -1806,6 +2394,14 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(rusty_init)
 
 void BPF_STRUCT_OPS(rusty_exit, struct scx_exit_info *ei)
 {
+	u64 now = bpf_ktime_get_ns();
+	u32 i;
+
+	if (handoff) {
+		bpf_for(i, 0, nr_doms)
+			dom_save_handoff(i, now);
+	}
+
 	UEI_RECORD(uei, ei);
 }
 
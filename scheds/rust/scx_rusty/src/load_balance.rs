@@ -89,6 +89,28 @@
 //! LoadBalancer object, but actual load balancing is only performed if the
 //! balance_load option is specified.
 //!
+//! Incremental Load Balancing
+//! --------------------------
+//!
+//! By default, the whole domain hierarchy and the task candidates of every
+//! pushing domain are rebuilt from the BPF maps at every load balancing
+//! round. When a non-zero refresh threshold is specified, the load balancer
+//! instead keeps its state across rounds in a LoadBalancerCache object:
+//!
+//! - The load of a domain is refreshed only if it changed by more than the
+//!   threshold (relative to the average domain load) since it was last
+//!   refreshed. Otherwise the load expected after the migrations of the
+//!   previous rounds is reused, so tasks that were already migrated are not
+//!   accounted twice while their load averages settle in the new domain.
+//!
+//! - Task candidates are cached per domain. At every round the candidates
+//!   reported by BPF for the previous round are merged into the cache, while
+//!   the cached candidates are dropped for the domains whose load changed
+//!   beyond the threshold, or once they haven't been active for a few rounds.
+//!
+//! - If no domain changed beyond the threshold and the previous round didn't
+//!   migrate any task, the balancing pass is skipped entirely.
+//!
 //! Statistics
 //! ----------
 //!
@@ -137,7 +159,10 @@ use crate::bpf_intf;
 use crate::DomainGroup;
 
 use std::cell::Cell;
+use std::collections::BTreeMap;
 use std::fmt;
+use std::sync::atomic::fence;
+use std::sync::atomic::Ordering as AtomicOrdering;
 use std::sync::Arc;
 
 use anyhow::bail;
@@ -146,7 +171,8 @@ use anyhow::Result;
 use log::debug;
 use log::warn;
 use ordered_float::OrderedFloat;
-use scx_utils::ravg::ravg_read;
+use scx_utils::ravg::RavgData;
+use scx_utils::ravg::RavgReader;
 use scx_utils::LoadLedger;
 use scx_utils::LoadAggregator;
 use sorted_vec::SortedVec;
@@ -498,8 +524,88 @@ impl fmt::Display for NumaStat {
     }
 }
 
+// Migration candidate reported by BPF (see struct lb_cand).
+struct LbCand {
+    pid: i32,
+    weight: u32,
+    dom_mask: u64,
+    dcycle: f64,
+    is_kworker: bool,
+}
+
+// Task candidate cached by the incremental load balancer.
+#[derive(Debug, Clone)]
+struct CachedTask {
+    load: f64,
+    dom_mask: u64,
+    is_kworker: bool,
+    seen_round: u64,
+}
+
+/// State of the load balancer that is preserved across load balancing rounds
+/// (see Incremental Load Balancing above).
+pub struct LoadBalancerCache {
+    refresh_ratio: f64,
+    round: u64,
+    migrated: bool,
+    dom_loads: Vec<Option<f64>>,
+    dom_refreshed: Vec<bool>,
+    dom_tasks: Vec<BTreeMap<i32, CachedTask>>,
+}
+
+impl LoadBalancerCache {
+    // Amount of rounds a cached task candidate is kept without being
+    // reported as active.
+    const TASK_MAX_IDLE_ROUNDS: u64 = 4;
+
+    /// Create a new cache for @nr_doms domains. A @refresh_ratio of 0
+    /// disables incremental load balancing.
+    pub fn new(nr_doms: usize, refresh_ratio: f64) -> Self {
+        Self {
+            refresh_ratio,
+            round: 0,
+            migrated: true,
+            dom_loads: vec![None; nr_doms],
+            dom_refreshed: vec![true; nr_doms],
+            dom_tasks: vec![BTreeMap::new(); nr_doms],
+        }
+    }
+
+    fn incremental(&self) -> bool {
+        self.refresh_ratio > 0.0f64
+    }
+
+    // Return the load to use for @dom_id in the current round: the cached
+    // load is reused unless it differs from the current @load by more than
+    // the refresh threshold.
+    fn dom_load(&mut self, dom_id: usize, load: f64, dom_load_avg: f64) -> f64 {
+        let refreshed = match self.dom_loads[dom_id] {
+            Some(cached) if self.incremental() => {
+                (load - cached).abs() > dom_load_avg * self.refresh_ratio
+            }
+            _ => true,
+        };
+
+        self.dom_refreshed[dom_id] = refreshed;
+        if refreshed {
+            self.dom_loads[dom_id] = Some(load);
+        }
+        self.dom_loads[dom_id].unwrap()
+    }
+
+    // Whether the balancing pass can be skipped in the current round.
+    fn is_stable(&self) -> bool {
+        self.incremental() && !self.migrated && !self.dom_refreshed.iter().any(|&r| r)
+    }
+
+    fn nr_refreshed(&self) -> usize {
+        self.dom_refreshed.iter().filter(|&&r| r).count()
+    }
+}
+
 pub struct LoadBalancer<'a, 'b> {
     skel: &'a mut BpfSkel<'b>,
+    cache: &'a mut LoadBalancerCache,
     dom_group: Arc<DomainGroup>,
     skip_kworkers: bool,
 
@@ -518,6 +624,7 @@ const_assert_eq!(bpf_intf::consts_LB_MAX_WEIGHT % bpf_intf::consts_LB_LOAD_BUCKE
 impl<'a, 'b> LoadBalancer<'a, 'b> {
     pub fn new(
         skel: &'a mut BpfSkel<'b>,
+        cache: &'a mut LoadBalancerCache,
         dom_group: Arc<DomainGroup>,
         skip_kworkers: bool,
         lb_apply_weight: bool,
@@ -525,6 +632,7 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
     ) -> Self {
         Self {
             skel,
+            cache,
             skip_kworkers,
 
             infeas_threshold: bpf_intf::consts_LB_MAX_WEIGHT as f64,
@@ -542,10 +650,32 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
     /// also perform rebalances between NUMA nodes (when running on a
     /// multi-socket host) and domains.
     pub fn load_balance(&mut self) -> Result<()> {
+        self.cache.round += 1;
         self.create_domain_hierarchy()?;
 
         if self.balance_load {
-            self.perform_balancing()?
+            if self.cache.is_stable() {
+                debug!("No domain load changed beyond the threshold, skipping LB");
+            } else {
+                self.perform_balancing()?
+            }
+        }
+
+        // Remember the loads expected after the migrations, so that the
+        // next round can tell apart real load changes from the effects of
+        // the migrations performed in this round.
+        let mut migrated = false;
+        for node in self.nodes.iter() {
+            for dom in node.domains.iter() {
+                self.cache.dom_loads[dom.id] = Some(dom.load.load_sum());
+                migrated |= dom.load.delta() != 0.0f64;
+            }
+        }
+        self.cache.migrated = migrated;
+
+        if self.cache.incremental() {
+            debug!("LB refreshed {}/{} domains", self.cache.nr_refreshed(),
+                   self.cache.dom_loads.len());
         }
 
         Ok(())
@@ -565,13 +695,23 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
     fn create_domain_hierarchy(&mut self) -> Result<()> {
         let ledger = self.calculate_load_avgs()?;
 
-        let (dom_loads, total_load) = if !self.lb_apply_weight {
+        let (mut dom_loads, mut total_load) = if !self.lb_apply_weight {
             (ledger.dom_dcycle_sums().to_vec(), ledger.global_dcycle_sum())
         } else {
             self.infeas_threshold = ledger.effective_max_weight();
             (ledger.dom_load_sums().to_vec(), ledger.global_load_sum())
         };
 
+        // Reuse the cached loads of the domains that didn't change beyond
+        // the refresh threshold.
+        let dom_load_avg = total_load / dom_loads.len() as f64;
+        for (dom_id, load) in dom_loads.iter_mut().enumerate() {
+            *load = self.cache.dom_load(dom_id, *load, dom_load_avg);
+        }
+        if self.cache.incremental() {
+            total_load = dom_loads.iter().sum();
+        }
+
         let num_numa_nodes = self.dom_group.nr_nodes();
         let numa_load_avg = total_load / num_numa_nodes as f64;
 
@@ -603,6 +743,7 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         const NUM_BUCKETS: u64 = bpf_intf::consts_LB_LOAD_BUCKETS as u64;
         let now_mono = now_monotonic();
         let load_half_life = self.skel.rodata().load_half_life;
+        let reader = RavgReader::new(load_half_life, RAVG_FRAC_BITS);
         let maps = self.skel.maps();
         let dom_data = maps.dom_data();
 
@@ -616,28 +757,36 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
                 .lookup(&dom_key, libbpf_rs::MapFlags::ANY)
                 .context("Failed to lookup dom_ctx")?
             {
-                let dom_ctx =
-                    unsafe { &*(dom_ctx_map_elem.as_slice().as_ptr() as *const bpf_intf::dom_ctx) };
+                // The map value buffer isn't necessarily aligned to the
+                // cacheline alignment of dom_ctx.
+                let dom_ctx: bpf_intf::dom_ctx = unsafe {
+                    std::ptr::read_unaligned(
+                        dom_ctx_map_elem.as_slice().as_ptr() as *const bpf_intf::dom_ctx
+                    )
+                };
+
+                let rds: Vec<RavgData> = dom_ctx
+                    .buckets
+                    .iter()
+                    .map(|bucket_ctx| RavgData {
+                        val: bucket_ctx.rd.val,
+                        val_at: bucket_ctx.rd.val_at,
+                        old: bucket_ctx.rd.old,
+                        cur: bucket_ctx.rd.cur,
+                    })
+                    .collect();
+                let mut duty_cycles = vec![0.0f64; rds.len()];
+                reader.read_batch(&rds, now_mono, &mut duty_cycles);
 
                 for bucket in 0..NUM_BUCKETS {
-                    let bucket_ctx = dom_ctx.buckets[bucket as usize];
-                    let rd = &bucket_ctx.rd;
-                    let duty_cycle = ravg_read(
-                        rd.val,
-                        rd.val_at,
-                        rd.old,
-                        rd.cur,
-                        now_mono,
-                        load_half_life,
-                        RAVG_FRAC_BITS,
-                    );
+                    let duty_cycle = duty_cycles[bucket as usize];
 
                     if duty_cycle == 0.0f64 {
                         continue;
                     }
 
                     let weight = self.bucket_weight(bucket);
-                    aggregator.record_dom_load(dom, weight, duty_cycle)?;
+                    aggregator.record_dom_load(dom, weight, duty_cycle);
                 }
             }
         }
@@ -669,6 +818,70 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         (min_weight + (WEIGHT_PER_BUCKET / 2.0f64)).ceil() as usize
     }
 
+    /// Read a consistent snapshot of the migration candidates that BPF
+    /// collected for @dom_id in the current generation, and request a new
+    /// generation. Return None if no consistent snapshot could be read.
+    ///
+    /// The duty cycle of each candidate is decayed to now, so that the tasks
+    /// which haven't run since they were recorded don't rank above the
+    /// currently active ones.
+    fn read_dom_lb_cands(&mut self, dom_id: usize) -> Option<Vec<LbCand>> {
+        const MAX_RETRIES: usize = 8;
+        let reader = RavgReader::new(self.skel.rodata().load_half_life, RAVG_FRAC_BITS);
+        let dc: *mut _ = &mut self.skel.bss_mut().dom_lb_cands[dom_id];
+
+        for _ in 0..MAX_RETRIES {
+            // The candidates are updated concurrently by BPF: retry if an
+            // update was in progress or happened while reading.
+            let seq = unsafe { std::ptr::read_volatile(&(*dc).seq) };
+            if seq & 1 != 0 {
+                std::hint::spin_loop();
+                continue;
+            }
+            fence(AtomicOrdering::Acquire);
+            let snap = unsafe { std::ptr::read_volatile(dc) };
+            fence(AtomicOrdering::Acquire);
+            if unsafe { std::ptr::read_volatile(&(*dc).seq) } != seq {
+                continue;
+            }
+
+            // BPF starts the requested generation with its next update
+            // while holding the domain lock, only the candidates recorded
+            // since the previous request belong to this round.
+            let gen = snap.req_gen;
+            unsafe { std::ptr::write_volatile(&mut (*dc).req_gen, gen + 1) };
+
+            let now = now_monotonic();
+            let nr = match snap.gen == gen {
+                true => (snap.nr as usize).min(snap.cands.len()),
+                false => 0,
+            };
+            return Some(
+                snap.cands[..nr]
+                    .iter()
+                    .take_while(|cand| cand.gen == gen)
+                    .map(|cand| {
+                        let rd = RavgData {
+                            val: cand.dcyc_rd.val,
+                            val_at: cand.dcyc_rd.val_at,
+                            old: cand.dcyc_rd.old,
+                            cur: cand.dcyc_rd.cur,
+                        };
+                        LbCand {
+                            pid: cand.pid,
+                            weight: cand.weight,
+                            dom_mask: cand.dom_mask,
+                            dcycle: reader.read(&rd, now),
+                            is_kworker: cand.is_kworker,
+                        }
+                    })
+                    .collect(),
+            );
+        }
+
+        None
+    }
+
     /// @dom needs to push out tasks to balance loads. Make sure its
     /// tasks_by_load is populated so that the victim tasks can be picked.
     fn populate_tasks_by_load(&mut self, dom: &mut Domain) -> Result<()> {
@@ -677,69 +890,64 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         }
         dom.queried_tasks = true;
 
-        // Read active_pids and update write_idx and gen.
-        //
-        // XXX - We can't read task_ctx inline because self.skel.bss()
-        // borrows mutably and thus conflicts with self.skel.maps().
-        const MAX_PIDS: u64 = bpf_intf::consts_MAX_DOM_ACTIVE_PIDS as u64;
-        let active_pids = &mut self.skel.bss_mut().dom_active_pids[dom.id];
-        let mut pids = vec![];
-
-        let (mut ridx, widx) = (active_pids.read_idx, active_pids.write_idx);
-        if widx - ridx > MAX_PIDS {
-            ridx = widx - MAX_PIDS;
-        }
+        // Read the heaviest tasks that have been active in the domain
+        // since the last read.
+        let cands = match self.read_dom_lb_cands(dom.id) {
+            Some(cands) => cands,
+            None => {
+                debug!("DOM {} failed to read migration candidates", dom.id);
+                Vec::new()
+            }
+        };
 
-        for idx in ridx..widx {
-            let pid = active_pids.pids[(idx % MAX_PIDS) as usize];
-            pids.push(pid);
+        // In incremental mode the candidates read in this round are merged
+        // into the cached candidates of the domain. The cached candidates
+        // are dropped if the domain load has been refreshed in this round.
+        let incremental = self.cache.incremental();
+        let round = self.cache.round;
+        let mut cached = std::mem::take(&mut self.cache.dom_tasks[dom.id]);
+        if self.cache.dom_refreshed[dom.id] {
+            cached.clear();
         }
 
-        active_pids.read_idx = active_pids.write_idx;
-        active_pids.gen += 1;
-
-        // Read task_ctx and load.
-        let load_half_life = self.skel.rodata().load_half_life;
-        let maps = self.skel.maps();
-        let task_data = maps.task_data();
-        let now_mono = now_monotonic();
+        for cand in cands.iter() {
+            let mut load = cand.dcycle;
+            if self.lb_apply_weight {
+                let weight = (cand.weight as f64).min(self.infeas_threshold);
+                load *= weight;
+            }
 
-        for pid in pids.iter() {
-            let key = unsafe { std::mem::transmute::<i32, [u8; 4]>(*pid) };
+            cached.insert(
+                cand.pid,
+                CachedTask {
+                    load,
+                    dom_mask: cand.dom_mask,
+                    is_kworker: cand.is_kworker,
+                    seen_round: round,
+                },
+            );
+        }
 
-            if let Some(task_data_elem) = task_data.lookup(&key, libbpf_rs::MapFlags::ANY)? {
-                let task_ctx =
-                    unsafe { &*(task_data_elem.as_slice().as_ptr() as *const bpf_intf::task_ctx) };
-                if task_ctx.dom_id as usize != dom.id {
-                    continue;
-                }
+        if incremental {
+            cached.retain(|_, task| {
+                round - task.seen_round < LoadBalancerCache::TASK_MAX_IDLE_ROUNDS
+            });
+        }
 
-                let rd = &task_ctx.dcyc_rd;
-                let mut load = ravg_read(
-                        rd.val,
-                        rd.val_at,
-                        rd.old,
-                        rd.cur,
-                        now_mono,
-                        load_half_life,
-                        RAVG_FRAC_BITS,
-                    );
-
-                if self.lb_apply_weight {
-                    let weight = (task_ctx.weight as f64).min(self.infeas_threshold);
-                    load *= weight;
-                }
+        let tasks = cached
+            .iter()
+            .map(|(pid, task)| TaskInfo {
+                pid: *pid,
+                load: OrderedFloat(task.load),
+                dom_mask: task.dom_mask,
+                migrated: Cell::new(false),
+                is_kworker: task.is_kworker,
+            })
+            .collect();
+        dom.tasks = SortedVec::from_unsorted(tasks);
 
-                dom.tasks.insert(
-                    TaskInfo {
-                        pid: *pid,
-                        load: OrderedFloat(load),
-                        dom_mask: task_ctx.dom_mask,
-                        migrated: Cell::new(false),
-                        is_kworker: task_ctx.is_kworker,
-                    },
-                );
-            }
+        if incremental {
+            self.cache.dom_tasks[dom.id] = cached;
         }
 
         Ok(())
@@ -790,22 +998,20 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         // migratable task while scanning left from $to_xfer and the
         // counterpart while scanning right and picking the better of the
         // two.
-        let tasks = std::mem::take(&mut push_dom.tasks).into_vec();
+        //
+        // The tasks are sorted by load, so the two scans can start right
+        // from the position of $to_xfer.
+        let tasks = push_dom.tasks.as_slice();
+        let left = tasks.partition_point(|x| x.load <= OrderedFloat(to_xfer));
+        let right = tasks.partition_point(|x| x.load < OrderedFloat(to_xfer));
         let (task, new_imbal) = match (
             Self::find_first_candidate(
-                tasks
-                    .as_slice()
-                    .iter()
-                    .filter(|x| x.load <= OrderedFloat(to_xfer))
-                    .rev(),
+                tasks[..left].iter().rev(),
                 pull_dom.id.try_into().unwrap(),
                 self.skip_kworkers,
             ),
             Self::find_first_candidate(
-                tasks
-                    .as_slice()
-                    .iter()
-                    .filter(|x| x.load >= OrderedFloat(to_xfer)),
+                tasks[right..].iter(),
                 pull_dom.id.try_into().unwrap(),
                 self.skip_kworkers,
             ),
@@ -828,14 +1034,16 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         // to do for this pair.
         let old_imbal = to_push + to_pull;
         if old_imbal < new_imbal {
-            std::mem::swap(&mut push_dom.tasks, &mut SortedVec::from_unsorted(tasks));
             return Ok(None);
         }
 
         let load = *(task.load);
         let pid = task.pid;
         task.migrated.set(true);
-        std::mem::swap(&mut push_dom.tasks, &mut SortedVec::from_unsorted(tasks));
+
+        // The task is leaving the domain, it will be reported as active by
+        // the pulling domain once it runs there.
+        self.cache.dom_tasks[push_dom.id].remove(&pid);
 
         push_dom.transfer_load(load, pid, pull_dom, &mut self.skel);
         Ok(Some(load))
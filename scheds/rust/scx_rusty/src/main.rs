@@ -14,8 +14,11 @@ use tuner::Tuner;
 
 pub mod load_balance;
 use load_balance::LoadBalancer;
+use load_balance::LoadBalancerCache;
 use load_balance::NumaStat;
 
+use std::path::Path;
+use std::path::PathBuf;
 use std::sync::atomic::AtomicBool;
 use std::sync::atomic::Ordering;
 use std::sync::Arc;
@@ -35,8 +38,14 @@ use libbpf_rs::skel::OpenSkel;
 use libbpf_rs::skel::Skel;
 use libbpf_rs::skel::SkelBuilder;
 use log::info;
+use log::warn;
 use scx_utils::compat;
+use scx_utils::handoff::pin_handoff_map;
 use scx_utils::init_libbpf_logging;
+use scx_utils::lathist::LatHist;
+use scx_utils::lathist::LATHIST_NAMES;
+use scx_utils::sched_trace;
+use scx_utils::sched_trace::TraceWriter;
 use scx_utils::scx_ops_attach;
 use scx_utils::scx_ops_load;
 use scx_utils::scx_ops_open;
@@ -49,6 +58,10 @@ use scx_utils::UserExitInfo;
 const MAX_DOMS: usize = bpf_intf::consts_MAX_DOMS as usize;
 const MAX_CPUS: usize = bpf_intf::consts_MAX_CPUS as usize;
 
+const HANDOFF_TASKS_PIN: &str = "/sys/fs/bpf/scx_rusty_handoff_tasks";
+const HANDOFF_DOMS_PIN: &str = "/sys/fs/bpf/scx_rusty_handoff_doms";
+const TOPO_CACHE_PATH: &str = "/run/scx_rusty/topology";
+
 /// scx_rusty: A multi-domain BPF / userspace hybrid scheduler
 ///
 /// The BPF part does simple vtime or round robin scheduling in each domain
@@ -61,9 +74,9 @@ const MAX_CPUS: usize = bpf_intf::consts_MAX_CPUS as usize;
 ///
 /// Second, it drives lower frequency (2s) load balancing. It determines
 /// whether load balancing is necessary by comparing domain load averages.
-/// If there are large enough load differences, it examines upto 1024
-/// recently active tasks on the domain to determine which should be
-/// migrated.
+/// If there are large enough load differences, it examines the heaviest
+/// recently active tasks on the domain, tracked by the BPF part, to
+/// determine which should be migrated.
 ///
 /// The overhead of userspace operations is low. Load balancing is not
 /// performed frequently but work-conservation is still maintained through
@@ -81,14 +94,23 @@ const MAX_CPUS: usize = bpf_intf::consts_MAX_CPUS as usize;
 /// limitation will be removed in the future.
 #[derive(Debug, Parser)]
 struct Opts {
-    /// Scheduling slice duration for under-utilized hosts, in microseconds.
+    /// Scheduling slice duration for under-utilized domains, in microseconds.
     #[clap(short = 'u', long, default_value = "20000")]
     slice_us_underutil: u64,
 
-    /// Scheduling slice duration for over-utilized hosts, in microseconds.
+    /// Scheduling slice duration for over-utilized domains, in microseconds. A
+    /// domain is over-utilized when its CPUs are fully busy, see also
+    /// --slice-hysteresis.
     #[clap(short = 'o', long, default_value = "1000")]
     slice_us_overutil: u64,
 
+    /// Switch domains between the under- and over-utilized slices with
+    /// hysteresis. A domain becomes over-utilized at 95% utilization or when
+    /// tasks are queueing up in it, and only goes back once its utilization
+    /// drops below 85% and the queue has drained.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    slice_hysteresis: bool,
+
     /// Monitoring and load balance interval in seconds.
     #[clap(short = 'i', long, default_value = "2.0")]
     interval: f64,
@@ -121,7 +143,9 @@ struct Opts {
     /// 1. Try to consume a task from the current domain
     /// 2. Try to consume a task from another domain in the current NUMA node
     ///    (or globally, if running on a single-socket system), if the domain
-    ///    has at least this specified number of tasks enqueued.
+    ///    has at least this specified number of tasks enqueued. The domain
+    ///    with the most queued load is picked, and up to a few tasks are
+    ///    stolen at once.
     ///
     /// See greedy_threshold_x_numa to enable task stealing across NUMA nodes.
     /// Tasks stolen in this manner are not permanently stolen from their
@@ -129,10 +153,11 @@ struct Opts {
     #[clap(short = 'g', long, default_value = "1")]
     greedy_threshold: u32,
 
-    /// When non-zero, enable greedy task stealing across NUMA nodes. The order
-    /// of greedy task stealing follows greedy-threshold as described above, and
-    /// greedy-threshold must be nonzero to enable task stealing across NUMA
-    /// nodes.
+    /// When non-zero, enable greedy task stealing across NUMA nodes from
+    /// domains which have at least this specified number of tasks enqueued,
+    /// trying closer nodes first. The order of greedy task stealing follows
+    /// greedy-threshold as described above, and greedy-threshold must be
+    /// nonzero to enable task stealing across NUMA nodes.
     #[clap(long, default_value = "0")]
     greedy_threshold_x_numa: u32,
 
@@ -142,6 +167,15 @@ struct Opts {
     #[clap(long, action = clap::ArgAction::SetTrue)]
     no_load_balance: bool,
 
+    /// Enable incremental load balancing. The load balancer keeps its state
+    /// across rounds and only refreshes the domains whose load changed by
+    /// more than this fraction of the average domain load since their last
+    /// refresh. Task candidates are then collected only from the tasks that
+    /// were active since the previous round. 0 disables incremental load
+    /// balancing, refreshing all domains at every round.
+    #[clap(long, default_value = "0.0")]
+    lb_refresh_threshold: f64,
+
     /// Put per-cpu kthreads directly into local dsq's.
     #[clap(short = 'k', long, action = clap::ArgAction::SetTrue)]
     kthreads_local: bool,
@@ -156,6 +190,37 @@ struct Opts {
     #[clap(short = 'f', long, action = clap::ArgAction::SetTrue)]
     fifo_sched: bool,
 
+    /// Let tasks inherit the latency criticality of their wakers, decayed by
+    /// one priority level per hop, so that all the stages of a producer ->
+    /// consumer pipeline get boosted without building up their own wakeup
+    /// frequencies first.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    dl_chain_boost: bool,
+
+    /// Measure the per-wakeup cost of updating latency criticality in BPF
+    /// and report the average. Adds a couple of clock reads per wakeup.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    dl_bench: bool,
+
+    /// Record log2 histograms of the enqueue to running latency and of the
+    /// execution time of select_cpu, enqueue, dispatch, running and stopping
+    /// in BPF, and report their p50 and p99 at each scheduling interval.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    lathist: bool,
+
+    /// Capture the wakeup, running and stopping events of all tasks into
+    /// this file, to be replayed offline with scx_utils::sched_sim.
+    #[clap(long)]
+    trace_file: Option<PathBuf>,
+
+    /// Save the per-task and per-domain state into maps pinned under
+    /// /sys/fs/bpf when exiting and adopt the state saved by the previous
+    /// instance when starting, so that a restarted scheduler doesn't have to
+    /// re-learn task loads, domain assignments and latency criticality.
+    /// The saved state expires after 10 seconds.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    handoff: bool,
+
     /// Idle CPUs with utilization lower than this will get remote tasks
     /// directly pushed on them. 0 disables, 100 enables always.
     #[clap(short = 'D', long, default_value = "90.0")]
@@ -227,11 +292,15 @@ struct Scheduler<'a> {
 
     nr_lb_data_errors: u64,
 
+    prev_lathists: Option<Vec<LatHist>>,
+    trace: Option<TraceWriter<'a>>,
+
+    lb_cache: LoadBalancerCache,
     tuner: Tuner,
 }
 
 impl<'a> Scheduler<'a> {
-    fn init(opts: &Opts) -> Result<Self> {
+    fn init(opts: &Opts, top: Arc<Topology>) -> Result<Self> {
         // Open the BPF prog first for verification.
         let mut skel_builder = BpfSkelBuilder::default();
         skel_builder.obj_builder.debug(opts.verbose > 0);
@@ -239,8 +308,6 @@ impl<'a> Scheduler<'a> {
         let mut skel = scx_ops_open!(skel_builder, rusty).unwrap();
 
         // Initialize skel according to @opts.
-        let top = Arc::new(Topology::new()?);
-
         let domains = Arc::new(DomainGroup::new(top.clone(), &opts.cpumasks)?);
 
         if top.nr_cpus_possible() > MAX_CPUS {
@@ -306,6 +373,39 @@ impl<'a> Scheduler<'a> {
             }
         }
 
+        // Order in which each domain steals from the others, see
+        // rusty_dispatch(). Domains on the same node come first, then the
+        // rest by NUMA distance. The order starts after the domain itself so
+        // that idle domains don't all go for the same victims first.
+        let node_ids: Vec<usize> = top.nodes().iter().map(|node| node.id()).collect();
+        let nr_doms = domains.nr_doms();
+        for dom in 0..nr_doms {
+            let node = domains.dom_numa_id(&dom).unwrap_or(0);
+            let mut order: Vec<(usize, usize)> = (1..nr_doms)
+                .map(|off| {
+                    let other = (dom + off) % nr_doms;
+                    let other_node = domains.dom_numa_id(&other).unwrap_or(0);
+                    let dist = if other_node == node {
+                        0
+                    } else {
+                        match (node_ids.get(node), node_ids.get(other_node)) {
+                            (Some(&from), Some(&to)) => top.node_distance(from, to),
+                            _ => usize::MAX,
+                        }
+                    };
+                    (dist, other)
+                })
+                .collect();
+            order.sort_by_key(|&(dist, _)| dist);
+
+            let rodata = skel.rodata_mut();
+            rodata.dom_nr_local_doms[dom] =
+                order.iter().filter(|&&(dist, _)| dist == 0).count() as u32;
+            for (i, &(_, other)) in order.iter().enumerate() {
+                rodata.dom_steal_order[dom][i] = other as u32;
+            }
+        }
+
         if opts.partial {
             skel.struct_ops.rusty_mut().flags |= *compat::SCX_OPS_SWITCH_PARTIAL;
         }
@@ -314,6 +414,25 @@ impl<'a> Scheduler<'a> {
         skel.rodata_mut().load_half_life = (opts.load_half_life * 1000000000.0) as u32;
         skel.rodata_mut().kthreads_local = opts.kthreads_local;
         skel.rodata_mut().fifo_sched = opts.fifo_sched;
+        skel.rodata_mut().dl_chain_boost = opts.dl_chain_boost;
+        skel.rodata_mut().dl_bench = opts.dl_bench;
+        skel.rodata_mut().lathist_enabled = opts.lathist;
+        skel.rodata_mut().sched_trace_enabled = opts.trace_file.is_some();
+        sched_trace::size_trace_ring(skel.maps_mut().sched_trace_rb(), opts.trace_file.is_some())?;
+        skel.rodata_mut().handoff = opts.handoff;
+        if opts.handoff {
+            let mut maps = skel.maps_mut();
+            pin_handoff_map(
+                maps.handoff_tasks(),
+                HANDOFF_TASKS_PIN,
+                std::mem::size_of::<bpf_intf::handoff_task>(),
+            )?;
+            pin_handoff_map(
+                maps.handoff_doms(),
+                HANDOFF_DOMS_PIN,
+                std::mem::size_of::<bpf_intf::handoff_dom>(),
+            )?;
+        }
         skel.rodata_mut().greedy_threshold = opts.greedy_threshold;
         skel.rodata_mut().greedy_threshold_x_numa = opts.greedy_threshold_x_numa;
         skel.rodata_mut().direct_greedy_numa = opts.direct_greedy_numa;
@@ -321,6 +440,10 @@ impl<'a> Scheduler<'a> {
 
         // Attach.
         let mut skel = scx_ops_load!(skel, rusty, uei)?;
+        let trace = match opts.trace_file.as_ref() {
+            Some(path) => Some(TraceWriter::new(skel.maps().sched_trace_rb(), path)?),
+            None => None,
+        };
         let struct_ops = Some(scx_ops_attach!(skel, rusty)?);
         info!("Rusty Scheduler Attached");
 
@@ -346,12 +469,20 @@ impl<'a> Scheduler<'a> {
 
             nr_lb_data_errors: 0,
 
+            prev_lathists: match opts.lathist {
+                true => Some(vec![LatHist::default(); LATHIST_NAMES.len()]),
+                false => None,
+            },
+            trace,
+
+            lb_cache: LoadBalancerCache::new(domains.nr_doms(), opts.lb_refresh_threshold),
             tuner: Tuner::new(
                 domains,
                 opts.direct_greedy_under,
                 opts.kick_greedy_under,
                 opts.slice_us_underutil * 1000,
                 opts.slice_us_overutil * 1000,
+                opts.slice_hysteresis,
             )?,
         })
     }
@@ -506,12 +637,42 @@ impl<'a> Scheduler<'a> {
             stat_pct(bpf_intf::stat_idx_RUSTY_STAT_REPATRIATE),
         );
         info!(
-            "dl_clamped={:5.2} dl_preset={:5.2}",
+            "dl_clamped={:5.2} dl_preset={:5.2} dl_chain_boost={:5.2}",
             stat_pct(bpf_intf::stat_idx_RUSTY_STAT_DL_CLAMP),
             stat_pct(bpf_intf::stat_idx_RUSTY_STAT_DL_PRESET),
+            stat_pct(bpf_intf::stat_idx_RUSTY_STAT_DL_CHAIN_BOOST),
         );
 
-        info!("slice_length={}us", self.tuner.slice_ns / 1000);
+        let nr_handoff_tasks = stat(bpf_intf::stat_idx_RUSTY_STAT_HANDOFF_TASK);
+        let nr_handoff_doms = stat(bpf_intf::stat_idx_RUSTY_STAT_HANDOFF_DOM);
+        if nr_handoff_tasks + nr_handoff_doms > 0 {
+            info!("handoff: adopted tasks={} doms={}", nr_handoff_tasks, nr_handoff_doms);
+        }
+
+        let dl_update_cnt = stat(bpf_intf::stat_idx_RUSTY_STAT_DL_UPDATE_CNT);
+        if dl_update_cnt > 0 {
+            info!(
+                "dl_update={:.1}ns x {}",
+                stat(bpf_intf::stat_idx_RUSTY_STAT_DL_UPDATE_NS) as f64 / dl_update_cnt as f64,
+                dl_update_cnt,
+            );
+        }
+
+        self.report_lathists();
+
+        if let Some(trace) = self.trace.as_ref() {
+            info!(
+                "trace: events={} dropped={}",
+                trace.nr_events(),
+                self.skel.bss().sched_trace_nr_dropped,
+            );
+        }
+
+        info!(
+            "slice_length={}us dom_slice_lengths={:?}us",
+            self.tuner.slice_ns / 1000,
+            self.tuner.dom_slice_ns.iter().map(|ns| ns / 1000).collect::<Vec<u64>>(),
+        );
         info!("direct_greedy_cpumask={}", self.tuner.direct_greedy_mask);
         info!("  kick_greedy_cpumask={}", self.tuner.kick_greedy_mask);
 
@@ -523,6 +684,35 @@ impl<'a> Scheduler<'a> {
         }
     }
 
+    fn report_lathists(&mut self) {
+        let prev_lathists = match self.prev_lathists.as_mut() {
+            Some(prev) => prev,
+            None => return,
+        };
+        let lathists = match LatHist::read_all(self.skel.maps().lathists()) {
+            Ok(lathists) => lathists,
+            Err(e) => {
+                warn!("Failed to read latency histograms: {:?}", e);
+                return;
+            }
+        };
+
+        for (i, (cur, prev)) in lathists.iter().zip(prev_lathists.iter()).enumerate() {
+            let hist = cur.delta(prev);
+            if hist.count() > 0 {
+                info!(
+                    "lat_{}: cnt={} avg={:.0}ns p50<{}ns p99<{}ns",
+                    LATHIST_NAMES[i],
+                    hist.count(),
+                    hist.mean(),
+                    hist.percentile(50.0),
+                    hist.percentile(99.0),
+                );
+            }
+        }
+        *prev_lathists = lathists;
+    }
+
     fn lb_step(&mut self) -> Result<()> {
         let started_at = Instant::now();
         let bpf_stats = self.read_bpf_stats()?;
@@ -530,6 +720,7 @@ impl<'a> Scheduler<'a> {
 
         let mut lb = LoadBalancer::new(
             &mut self.skel,
+            &mut self.lb_cache,
             self.dom_group.clone(),
             self.balanced_kworkers,
             self.tuner.fully_utilized.clone(),
@@ -566,6 +757,10 @@ impl<'a> Scheduler<'a> {
                 }
             }
 
+            if let Some(trace) = self.trace.as_mut() {
+                trace.consume()?;
+            }
+
             if now >= next_sched_at {
                 self.lb_step()?;
                 next_sched_at += self.sched_interval;
@@ -581,7 +776,12 @@ impl<'a> Scheduler<'a> {
             );
         }
 
+        // only save the handoff state of the tasks left behind by the unload
+        self.skel.bss_mut().unloading = true;
         self.struct_ops.take();
+        if let Some(trace) = self.trace.as_mut() {
+            trace.consume()?;
+        }
         uei_report!(&self.skel, uei)
     }
 }
@@ -621,8 +821,12 @@ fn main() -> Result<()> {
     })
     .context("Error setting Ctrl-C handler")?;
 
+    // The scheduler is restarted on CPU hotplug. Keep the Topology across
+    // restarts and only re-read the CPUs whose online state changed.
+    let mut top = Topology::with_cache(Path::new(TOPO_CACHE_PATH))?;
     loop {
-        let mut sched = Scheduler::init(&opts)?;
+        top.update_online()?;
+        let mut sched = Scheduler::init(&opts, Arc::new(top.clone()))?;
         if !sched.run(shutdown.clone())?.should_restart() {
             break;
         }
@@ -66,16 +66,39 @@ fn calc_util(curr: &procfs::CpuStat, prev: &procfs::CpuStat) -> Result<f64> {
     }
 }
 
+// By default, a domain uses the over-utilized slice while it's fully utilized.
+const FULLY_UTILIZED: f64 = 0.99999;
+
+// With hysteresis, a domain is switched to the over-utilized slice when its
+// utilization reaches OVERUTIL_ENTER or tasks are piling up in its DSQ, and
+// only switched back once its utilization drops below OVERUTIL_EXIT and the
+// DSQ has drained, so that a domain hovering around a threshold doesn't flap
+// between the slices on every step. Queue depths are per CPU in the domain.
+const OVERUTIL_ENTER: f64 = 0.95;
+const OVERUTIL_EXIT: f64 = 0.85;
+const QUEUED_ENTER: f64 = 1.0;
+const QUEUED_EXIT: f64 = 0.25;
+
+struct Thresholds {
+    util_enter: f64,
+    util_exit: f64,
+    queued_enter: f64,
+    queued_exit: f64,
+}
+
 pub struct Tuner {
     pub direct_greedy_mask: Cpumask,
     pub kick_greedy_mask: Cpumask,
     pub fully_utilized: bool,
     pub slice_ns: u64,
+    pub dom_slice_ns: Vec<u64>,
     underutil_slice_ns: u64,
     overutil_slice_ns: u64,
     dom_group: Arc<DomainGroup>,
     direct_greedy_under: f64,
     kick_greedy_under: f64,
+    thresholds: Thresholds,
+    dom_overutil: Vec<bool>,
     proc_reader: procfs::ProcReader,
     prev_cpu_stats: BTreeMap<u32, procfs::CpuStat>,
 }
@@ -85,12 +108,28 @@ impl Tuner {
                direct_greedy_under: f64,
                kick_greedy_under: f64,
                underutil_slice_ns: u64,
-               overutil_slice_ns: u64) -> Result<Self> {
-        let proc_reader = procfs::ProcReader::new();
-        let prev_cpu_stats = proc_reader
-            .read_stat()?
-            .cpus_map
-            .ok_or_else(|| anyhow!("Expected cpus_map to exist"))?;
+               overutil_slice_ns: u64,
+               hysteresis: bool) -> Result<Self> {
+       let nr_doms = dom_group.nr_doms();
+       let proc_reader = procfs::ProcReader::new();
+       let prev_cpu_stats = proc_reader
+           .read_stat()?
+           .cpus_map
+           .ok_or_else(|| anyhow!("Expected cpus_map to exist"))?;
+       let thresholds = match hysteresis {
+           true => Thresholds {
+               util_enter: OVERUTIL_ENTER,
+               util_exit: OVERUTIL_EXIT,
+               queued_enter: QUEUED_ENTER,
+               queued_exit: QUEUED_EXIT,
+           },
+           false => Thresholds {
+               util_enter: FULLY_UTILIZED,
+               util_exit: FULLY_UTILIZED,
+               queued_enter: f64::INFINITY,
+               queued_exit: f64::INFINITY,
+           },
+       };
 
        Ok(Self {
            direct_greedy_mask: Cpumask::new()?,
@@ -98,28 +137,37 @@ impl Tuner {
            fully_utilized: false,
            direct_greedy_under: direct_greedy_under / 100.0,
            kick_greedy_under: kick_greedy_under / 100.0,
-           proc_reader,
-           prev_cpu_stats,
            slice_ns: underutil_slice_ns,
+           dom_slice_ns: vec![underutil_slice_ns; nr_doms],
            underutil_slice_ns: underutil_slice_ns,
            overutil_slice_ns: overutil_slice_ns,
            dom_group,
+           thresholds,
+           dom_overutil: vec![false; nr_doms],
+           proc_reader,
+           prev_cpu_stats,
        })
     }
 
     /// Apply a step in the Tuner by:
     ///
-    /// 1. Recording CPU stats from procfs
+    /// 1. Recording CPU stats from procfs and DSQ depths from BPF
     /// 2. Calculating current per-domain and host-wide utilization
     /// 3. Updating direct_greedy_under and kick_greedy_under cpumasks according
     ///    to the observed utilization
+    /// 4. Picking each domain's slice according to its utilization and queue
+    ///    depth
     pub fn step(&mut self, skel: &mut BpfSkel) -> Result<()> {
         let curr_cpu_stats = self
             .proc_reader
             .read_stat()?
             .cpus_map
             .ok_or_else(|| anyhow!("Expected cpus_map to exist"))?;
-        let mut dom_util_sum = vec![0.0f64; self.dom_group.nr_doms()];
+        let pcpu_ctx = &skel.bss().pcpu_ctx;
+
+        let nr_doms = self.dom_group.nr_doms();
+        let mut dom_util_sum = vec![0.0f64; nr_doms];
+        let mut dom_queued_sum = vec![0.0f64; nr_doms];
 
         let mut avg_util = 0.0f64;
         for (dom_id, dom) in self.dom_group.doms().iter() {
@@ -133,10 +181,15 @@ impl Tuner {
                     dom_util_sum[*dom_id] += util;
                     avg_util += util;
                 }
+                dom_queued_sum[*dom_id] += pcpu_ctx[cpu].dom_nr_queued as f64;
             }
         }
         avg_util /= self.dom_group.weight() as f64;
-        self.fully_utilized = avg_util >= 0.99999;
+        let th = &self.thresholds;
+        self.fully_utilized = match self.fully_utilized {
+            true => avg_util >= th.util_exit,
+            false => avg_util >= th.util_enter,
+        };
 
         self.direct_greedy_mask.clear();
         self.kick_greedy_mask.clear();
@@ -144,9 +197,9 @@ impl Tuner {
             // Calculate the domain avg util. If there are no active CPUs,
             // it doesn't really matter. Go with 0.0 as that's less likely
             // to confuse users.
-            let util = match dom.weight() {
-                0 => 0.0,
-                nr => dom_util_sum[*dom_id] / nr as f64,
+            let (util, queued) = match dom.weight() {
+                0 => (0.0, 0.0),
+                nr => (dom_util_sum[*dom_id] / nr as f64, dom_queued_sum[*dom_id] / nr as f64),
             };
 
             let enable_direct = self.direct_greedy_under > 0.99999 || util < self.direct_greedy_under;
@@ -158,6 +211,16 @@ impl Tuner {
             if enable_kick {
                 self.kick_greedy_mask |= dom.mask();
             }
+
+            let overutil = &mut self.dom_overutil[*dom_id];
+            *overutil = match *overutil {
+                true => util >= th.util_exit || queued >= th.queued_exit,
+                false => util >= th.util_enter || queued >= th.queued_enter,
+            };
+            self.dom_slice_ns[*dom_id] = match *overutil {
+                true => self.overutil_slice_ns,
+                false => self.underutil_slice_ns,
+            };
         }
 
         let ti = &mut skel.bss_mut().tune_input;
@@ -175,6 +238,9 @@ impl Tuner {
             self.slice_ns = self.underutil_slice_ns;
         }
         ti.slice_ns = self.slice_ns;
+        for (dom_id, slice_ns) in self.dom_slice_ns.iter().enumerate() {
+            ti.dom_slice_ns[dom_id] = *slice_ns;
+        }
 
         ti.gen += 1;
 